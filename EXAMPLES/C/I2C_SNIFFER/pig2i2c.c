@@ -186,6 +186,10 @@ int main(int argc, char * argv[])
 
    while ((r=read(STDIN_FILENO, &report, RS)) == RS)
    {
+      /* an overflow report holds the number dropped, not levels */
+
+      if (report.flags & PI_NTFY_FLAGS_OVFL) continue;
+
       report.level &= bI2C;
 
       if (report.level != level)
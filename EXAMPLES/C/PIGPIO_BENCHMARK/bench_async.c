@@ -0,0 +1,131 @@
+/*
+bench_async.c
+Public Domain
+
+Compares reading a GPIO with gpio_read, which waits for each reply
+before sending the next request, against gpio_read_async, which keeps
+many requests in flight on the one connection.  The asynchronous
+reads are timed both with a completion callback and with the results
+collected by async_wait.
+
+TO BUILD
+
+gcc -O2 -o bench_async bench_async.c -lpigpiod_if2 -lpthread -lrt
+
+TO RUN
+
+sudo pigpiod
+
+./bench_async [count [gpio]]
+
+count is the number of reads of each kind (default 20000) and gpio the
+GPIO read (default 4).  The PIGPIO_ADDR and PIGPIO_PORT environment
+variables select the daemon as for the other clients.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pigpiod_if2.h>
+
+static volatile int completed;
+static volatile int wrong;    /* set by the callback */
+static int failed;
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void benchDone(int pi, unsigned id, int level, void *userdata)
+{
+   if ((level < 0) || (level != *(int *)userdata)) wrong++;
+
+   completed++;
+}
+
+int main(int argc, char *argv[])
+{
+   int pi, gpio, count, level, i, res, sent;
+   double t, tSync;
+
+   count = 20000;
+   gpio  = 4;
+
+   if (argc > 1) count = atoi(argv[1]);
+   if (argc > 2) gpio  = atoi(argv[2]);
+
+   if (count < 1) count = 1;
+
+   pi = pigpio_start(NULL, NULL);
+
+   if (pi < 0) return 1;
+
+   level = gpio_read(pi, gpio);
+
+   t = benchTime();
+
+   for (i=0; i<count; i++)
+   {
+      if (gpio_read(pi, gpio) != level) failed++;
+   }
+
+   tSync = benchTime() - t;
+
+   printf("gpio_read        %8.0f reads/s\n", count / tSync);
+
+   completed = 0;
+   wrong = 0;
+   sent = 0;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++)
+   {
+      if (gpio_read_async(pi, gpio, benchDone, &level) < 0) failed++;
+      else sent++;
+   }
+
+   /* a request which could not be sent has no callback */
+
+   while (completed < sent) time_sleep(0.0001);
+
+   failed += wrong;
+
+   t = benchTime() - t;
+
+   printf("callback         %8.0f reads/s (%.1fx)\n",
+      count / t, tSync / t);
+
+   sent = 0;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++)
+   {
+      if (gpio_read_async(pi, gpio, NULL, NULL) < 0) failed++;
+      else sent++;
+   }
+
+   for (i=0; i<sent; i++)
+   {
+      if ((async_wait(pi, 1.0, NULL, &res) != 1) || (res != level)) failed++;
+   }
+
+   t = benchTime() - t;
+
+   printf("async_wait       %8.0f reads/s (%.1fx)\n",
+      count / t, tSync / t);
+
+   if (failed) printf("%d reads failed\n", failed);
+
+   pigpio_stop(pi);
+
+   return 0;
+}
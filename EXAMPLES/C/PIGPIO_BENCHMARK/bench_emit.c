@@ -0,0 +1,164 @@
+/*
+bench_emit.c
+Public Domain
+
+Times alertEmit, the alert dispatch routine which calls alert
+callbacks and queues notification reports, with 1, 8 and 32 running
+notify handles.  The queued reports are then written to /dev/null by
+the notify writer code, so the figures show the dispatch and batching
+cost rather than the pipe cost.
+
+TO BUILD
+
+gcc -O2 -o bench_emit bench_emit.c ../../../command.c -lpthread -lrt
+
+TO RUN
+
+./bench_emit [blocks]
+
+blocks is the number of MAX_REPORT sample blocks to dispatch for each
+handle count (default 20000).
+
+*/
+
+#include "../../../pigpio.c"
+
+static uint32_t benchRand(void)
+{
+   static uint32_t x = 2463534242u;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+
+   return x;
+}
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void benchCallback(int gpio, int level, uint32_t tick)
+{
+}
+
+static int benchRun(int handles, int blocks, int fd)
+{
+   int b, i, n;
+   uint32_t level, tick, changed, flip;
+   long edges;
+   double t;
+   static gpioSample_t sample[MAX_REPORT];
+
+   for (n=0; n<PI_NOTIFY_SLOTS; n++)
+   {
+      gpioNotify[n].state = PI_NOTIFY_CLOSED;
+      gpioNotify[n].bits  = 0;
+   }
+
+   /* each handle watches 8 of the 32 gpios */
+
+   for (n=0; n<handles; n++)
+   {
+      gpioNotify[n].seqno = 0;
+      gpioNotify[n].state = PI_NOTIFY_RUNNING;
+      gpioNotify[n].bits  = 0xFF << ((n % 4) * 8);
+      gpioNotify[n].eventBits = 0;
+      gpioNotify[n].fd = fd;
+      gpioNotify[n].pipe = 0;
+      gpioNotify[n].max_emits = MAX_EMITS;
+      gpioNotify[n].lastReportTick = 0;
+      gpioNotify[n].ringHead = 0;
+      gpioNotify[n].ringTail = 0;
+      gpioNotify[n].ringPartial = 0;
+      gpioNotify[n].dropped = 0;
+
+      if (!gpioNotify[n].ring)
+         gpioNotify[n].ring = malloc(NOTIFY_RING_SIZE * sizeof(gpioReport_t));
+   }
+
+   intNotifyBits();
+
+   gpioSetAlertFunc(4, benchCallback);
+
+   level = 0;
+   tick = 0;
+   edges = 0;
+
+   t = benchTime();
+
+   for (b=0; b<blocks; b++)
+   {
+      changed = 0;
+
+      for (i=0; i<MAX_REPORT; i++)
+      {
+         flip = 1 << (benchRand() % 32);
+         level ^= flip;
+         changed |= flip;
+         tick += 5;
+         sample[i].tick = tick;
+         sample[i].level = level;
+      }
+
+      edges += MAX_REPORT;
+
+      alertEmit(sample, MAX_REPORT, changed, tick);
+
+      for (n=0; n<handles; n++) notifyWrite(n);
+   }
+
+   t = benchTime() - t;
+
+   printf("handles=%2d %8.0f edges/s  %6.1f ns/edge  dropped %u\n",
+      handles, edges / t, t * 1e9 / edges, gpioStats.notifyDropped);
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   int blocks, fd;
+   static uint32_t bsc[BSC_FR+1];
+
+   blocks = 20000;
+
+   if (argc > 1) blocks = atoi(argv[1]);
+
+   if (blocks < 1)
+   {
+      fprintf(stderr, "usage: bench_emit [blocks]\n");
+      return 1;
+   }
+
+   fd = open("/dev/null", O_WRONLY);
+
+   if (fd < 0)
+   {
+      perror("/dev/null");
+      return 1;
+   }
+
+   /* alertEmit samples the BSC FIFO register for BSC events */
+
+   bscsReg = bsc;
+
+   sem_init(&notifyWriteSem, 0, 0);
+
+   /* gpioSetAlertFunc needs an initialised library */
+
+   libInitialised = 1;
+
+   benchRun(1, blocks, fd);
+   benchRun(8, blocks, fd);
+   benchRun(32, blocks, fd);
+
+   close(fd);
+
+   return 0;
+}
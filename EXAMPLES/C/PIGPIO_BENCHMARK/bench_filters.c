@@ -0,0 +1,312 @@
+/*
+bench_filters.c
+Public Domain
+
+Replays synthetic gpioSample_t streams through the alert glitch and
+noise filters and reports samples per second for the previous per-gpio
+filters and the current word-at-a-time filters.  The outputs and filter
+state of both are compared after every buffer.
+
+TO BUILD
+
+gcc -O2 -o bench_filters bench_filters.c ../../../command.c -lpthread -lrt
+
+TO RUN
+
+./bench_filters [gpios [buffers]]
+
+gpios is the number of filtered gpios (default 12).
+buffers is the number of 4000 sample buffers to replay (default 2000).
+
+*/
+
+#include "../../../pigpio.c"
+
+#define BENCH_SAMPLES 4000
+
+/* The filters as they were before the word-at-a-time rewrite */
+
+static void oldGlitchFilter(gpioSample_t *sample, int numSamples)
+{
+   int i, j, diff;
+   uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
+   uint32_t bit, bitV;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      bit = (1<<i);
+
+      if (monitorBits & bit & gFilterBits)
+      {
+         initialised = gpioAlert[i].gfInitialised;
+         if (!initialised && numSamples > 0)
+         {
+           bitV = sample[0].level & bit;
+           gpioAlert[i].gfRBitV = bitV;
+           gpioAlert[i].gfLBitV = bitV;
+           gpioAlert[i].gfTick = sample[0].tick;
+           gpioAlert[i].gfInitialised = 1;
+         }
+
+         steadyUs    = gpioAlert[i].gfSteadyUs;
+         RBitV       = gpioAlert[i].gfRBitV;
+         LBitV       = gpioAlert[i].gfLBitV;
+         changedTick = gpioAlert[i].gfTick;
+
+         for (j=0; j<numSamples; j++)
+         {
+            bitV = sample[j].level & bit;
+
+            if (bitV != LBitV)
+            {
+               changedTick = sample[j].tick;
+               LBitV = bitV;
+            }
+
+            if (bitV != RBitV)
+            {
+               diff = sample[j].tick - changedTick;
+
+               if (diff >= steadyUs) RBitV = bitV;
+               else sample[j].level ^= bit;
+            }
+         }
+
+         gpioAlert[i].gfRBitV = RBitV;
+         gpioAlert[i].gfLBitV = LBitV;
+         gpioAlert[i].gfTick  = changedTick;
+      }
+   }
+}
+
+static void oldNoiseFilter(gpioSample_t *sample, int numSamples)
+{
+   int i, j, diff;
+   uint32_t LBitV;
+   uint32_t bit, bitV;
+   uint32_t nowTick;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      bit = (1<<i);
+
+      if (monitorBits & bit & nFilterBits)
+      {
+         LBitV = gpioAlert[i].nfLBitV;
+
+         for (j=0; j<numSamples; j++)
+         {
+            bitV = sample[j].level & bit;
+            nowTick = sample[j].tick;
+
+            if (gpioAlert[i].nfActive)
+            {
+               diff = nowTick - gpioAlert[i].nfTick2;
+
+               if (diff >= 0)
+               {
+                  gpioAlert[i].nfActive = 0;
+                  gpioAlert[i].nfTick1 = nowTick;
+               }
+            }
+            else
+            {
+               if (bitV != LBitV)
+               {
+                  diff = nowTick - gpioAlert[i].nfTick1;
+                  gpioAlert[i].nfTick1 = nowTick;
+
+                  if (diff >= gpioAlert[i].nfSteadyUs)
+                  {
+                     gpioAlert[i].nfRBitV = LBitV;
+                     gpioAlert[i].nfActive = 1;
+                     gpioAlert[i].nfTick2 =
+                        nowTick + gpioAlert[i].nfActiveUs;
+                  }
+               }
+            }
+
+            if (!gpioAlert[i].nfActive)
+            {
+               if (bitV != gpioAlert[i].nfRBitV)
+                  sample[j].level ^= bit;
+            }
+
+            LBitV = bitV;
+         }
+
+         gpioAlert[i].nfLBitV = LBitV;
+      }
+   }
+}
+
+static gpioSample_t benchIn[BENCH_SAMPLES];
+static gpioSample_t benchOld[BENCH_SAMPLES];
+static gpioSample_t benchNew[BENCH_SAMPLES];
+static gpioAlert_t  alertOld[PI_MAX_USER_GPIO+1];
+static gpioAlert_t  alertNew[PI_MAX_USER_GPIO+1];
+
+static uint32_t benchRand(void)
+{
+   static uint32_t x = 2463534242u;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+
+   return x;
+}
+
+/* Fill a buffer with 1 us samples.  Each gpio toggles occasionally and
+   now and then produces short bursts of glitches. */
+
+static void benchFill(uint32_t bits, uint32_t *level, uint32_t *tick)
+{
+   int i;
+   uint32_t r, flip;
+
+   for (i=0; i<BENCH_SAMPLES; i++)
+   {
+      r = benchRand();
+
+      flip = 0;
+
+      if ((r & 0xFF) < 3) flip = benchRand() & bits;
+      else if ((r & 0xFFFF) < 40) flip = (1 << (benchRand() % 32)) & bits;
+
+      *level ^= flip;
+      *tick += 1;
+
+      benchIn[i].level = *level;
+      benchIn[i].tick  = *tick;
+   }
+}
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int benchCompare(const char *what, int buf)
+{
+   int i;
+
+   if (memcmp(benchOld, benchNew, sizeof(benchOld)))
+   {
+      for (i=0; i<BENCH_SAMPLES; i++)
+      {
+         if (benchOld[i].level != benchNew[i].level)
+         {
+            fprintf(stderr, "%s: buffer %d sample %d old=%08X new=%08X\n",
+               what, buf, i, benchOld[i].level, benchNew[i].level);
+            break;
+         }
+      }
+      return 1;
+   }
+
+   if (memcmp(alertOld, alertNew, sizeof(alertOld)))
+   {
+      fprintf(stderr, "%s: buffer %d filter state differs\n", what, buf);
+      return 1;
+   }
+
+   return 0;
+}
+
+static int benchRun(
+   const char *what, int gpios, int buffers,
+   void (*oldF)(gpioSample_t *, int), void (*newF)(gpioSample_t *, int))
+{
+   int b, i;
+   uint32_t bits, level, tick;
+   double t, oldT, newT;
+
+   bits = 0;
+   for (i=0; i<gpios; i++) bits |= (1<<i);
+
+   monitorBits = bits;
+
+   memset(gpioAlert, 0, sizeof(gpioAlert));
+
+   for (i=0; i<gpios; i++)
+   {
+      gpioAlert[i].gfSteadyUs = 20 + (i * 7);
+      gpioAlert[i].nfSteadyUs = 50 + (i * 11);
+      gpioAlert[i].nfActiveUs = 300 + (i * 13);
+   }
+
+   memcpy(alertOld, gpioAlert, sizeof(alertOld));
+   memcpy(alertNew, gpioAlert, sizeof(alertNew));
+
+   level = 0;
+   tick = 0xFFFFFFFF - (BENCH_SAMPLES * 3); /* cover tick wrap */
+   oldT = 0.0;
+   newT = 0.0;
+
+   for (b=0; b<buffers; b++)
+   {
+      benchFill(bits, &level, &tick);
+
+      memcpy(benchOld, benchIn, sizeof(benchIn));
+      memcpy(benchNew, benchIn, sizeof(benchIn));
+
+      memcpy(gpioAlert, alertOld, sizeof(alertOld));
+      t = benchTime();
+      oldF(benchOld, BENCH_SAMPLES);
+      oldT += benchTime() - t;
+      memcpy(alertOld, gpioAlert, sizeof(alertOld));
+
+      memcpy(gpioAlert, alertNew, sizeof(alertNew));
+      t = benchTime();
+      newF(benchNew, BENCH_SAMPLES);
+      newT += benchTime() - t;
+      memcpy(alertNew, gpioAlert, sizeof(alertNew));
+
+      if (benchCompare(what, b)) return 1;
+   }
+
+   printf("%-7s gpios=%2d old %7.1f Msamples/s  new %7.1f Msamples/s  "
+      "(x%.1f)\n",
+      what, gpios,
+      (double)buffers * BENCH_SAMPLES / oldT / 1e6,
+      (double)buffers * BENCH_SAMPLES / newT / 1e6,
+      oldT / newT);
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   int gpios, buffers;
+
+   gpios = 12;
+   buffers = 2000;
+
+   if (argc > 1) gpios = atoi(argv[1]);
+   if (argc > 2) buffers = atoi(argv[2]);
+
+   if ((gpios < 1) || (gpios > 32) || (buffers < 1))
+   {
+      fprintf(stderr, "usage: bench_filters [gpios(1-32) [buffers]]\n");
+      return 1;
+   }
+
+   gFilterBits = 0xFFFFFFFF;
+   nFilterBits = 0;
+
+   if (benchRun("glitch", gpios, buffers, oldGlitchFilter, alertGlitchFilter))
+      return 1;
+
+   gFilterBits = 0;
+   nFilterBits = 0xFFFFFFFF;
+
+   if (benchRun("noise", gpios, buffers, oldNoiseFilter, alertNoiseFilter))
+      return 1;
+
+   return 0;
+}
@@ -0,0 +1,180 @@
+/*
+bench_parse.c
+Public Domain
+
+Times the command parser used by the /dev/pigpio pipe interface,
+pigs, and the script compiler.  A corpus of pigs style commands
+built from every command name is parsed with cmdParse, and the
+command name and error text lookups are timed against the linear
+searches they replaced.
+
+TO BUILD
+
+gcc -O2 -o bench_parse bench_parse.c
+
+TO RUN
+
+./bench_parse [passes]
+
+passes is the number of times the corpus is parsed (default 200).
+
+*/
+
+#include <time.h>
+
+#include "../../../command.c"
+
+#define BENCH_LINES 4096
+
+static int oldMatch(char *str)
+{
+   int i;
+
+   for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
+   {
+      if (strcasecmp(str, cmdInfo[i].name) == 0) return i;
+   }
+   return CMD_UNKNOWN_CMD;
+}
+
+static char *oldErrStr(int error)
+{
+   int i;
+
+   for (i=0; i<(sizeof(errInfo)/sizeof(errInfo_t)); i++)
+   {
+      if (errInfo[i].error == error) return errInfo[i].str;
+   }
+   return "unknown error";
+}
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+   static char line[BENCH_LINES][64];
+   static char name[BENCH_LINES][32];
+   static uintptr_t p[CMD_P_ARR];
+   static char ext[CMD_MAX_EXTENSION];
+   cmdCtlParse_t ctl;
+   int cmds, errs, i, n, passes, err, bad;
+   long sum;
+   double t, tOld, tNew;
+
+   passes = 200;
+
+   if (argc > 1) passes = atoi(argv[1]);
+
+   if (passes < 1) passes = 1;
+
+   cmds = sizeof(cmdInfo)/sizeof(cmdInfo_t);
+   errs = sizeof(errInfo)/sizeof(errInfo_t);
+
+   /* every command in turn, in mixed case, with a couple of numbers */
+
+   srand(1);
+
+   for (i=0; i<BENCH_LINES; i++)
+   {
+      strcpy(name[i], cmdInfo[i % cmds].name);
+
+      if (i & 1) name[i][0] = tolower(name[i][0]);
+
+      if ((i % 17) == 0) strcpy(name[i], "XYZZY"); /* unknown */
+
+      sprintf(line[i], "%s %d %d", name[i], rand() % 32, rand() % 2);
+   }
+
+   /* check the new lookups give the same answers */
+
+   bad = 0;
+
+   for (i=0; i<BENCH_LINES; i++)
+   {
+      if (cmdMatch(name[i]) != oldMatch(name[i])) bad++;
+   }
+
+   for (err=-errs-10; err<10; err++)
+   {
+      if (strcmp(cmdErrStr(err), oldErrStr(err))) bad++;
+   }
+
+   if (bad)
+   {
+      printf("%d lookups differ\n", bad);
+      return 1;
+   }
+
+   sum = 0;
+
+   t = benchTime();
+
+   for (n=0; n<passes; n++)
+   {
+      for (i=0; i<BENCH_LINES; i++) sum += oldMatch(name[i]);
+   }
+
+   tOld = benchTime() - t;
+
+   t = benchTime();
+
+   for (n=0; n<passes; n++)
+   {
+      for (i=0; i<BENCH_LINES; i++) sum += cmdMatch(name[i]);
+   }
+
+   tNew = benchTime() - t;
+
+   printf("command lookup  old %6.2f M/s  new %6.2f M/s  (%.1fx)\n",
+      passes * BENCH_LINES / tOld / 1e6,
+      passes * BENCH_LINES / tNew / 1e6, tOld / tNew);
+
+   t = benchTime();
+
+   for (n=0; n<passes; n++)
+   {
+      for (i=0; i<BENCH_LINES; i++)
+         sum += (intptr_t)oldErrStr(-1 - (i % errs));
+   }
+
+   tOld = benchTime() - t;
+
+   t = benchTime();
+
+   for (n=0; n<passes; n++)
+   {
+      for (i=0; i<BENCH_LINES; i++)
+         sum += (intptr_t)cmdErrStr(-1 - (i % errs));
+   }
+
+   tNew = benchTime() - t;
+
+   printf("error lookup    old %6.2f M/s  new %6.2f M/s  (%.1fx)\n",
+      passes * BENCH_LINES / tOld / 1e6,
+      passes * BENCH_LINES / tNew / 1e6, tOld / tNew);
+
+   t = benchTime();
+
+   for (n=0; n<passes; n++)
+   {
+      for (i=0; i<BENCH_LINES; i++)
+      {
+         ctl.eaten = 0;
+         sum += cmdParse(line[i], p, sizeof(ext), ext, &ctl);
+      }
+   }
+
+   t = benchTime() - t;
+
+   printf("cmdParse        %6.2f M lines/s\n",
+      passes * BENCH_LINES / t / 1e6);
+
+   return (sum == 1); /* keep the results live */
+}
@@ -0,0 +1,112 @@
+/*
+bench_script.c
+Public Domain
+
+Times the script interpreter.  Each script is a counted loop which is
+stored with gpioStoreScript, run once with the loop count as p0, and
+timed until it halts.  The library runs in simulation mode so the
+gpio commands do not touch any hardware.
+
+arith    accumulator and register arithmetic
+gpio     gpio writes and reads
+tick     reads of the microsecond tick
+command  commands run through the general command dispatcher
+
+TO BUILD
+
+gcc -O2 -o bench_script bench_script.c ../../../command.c -lpthread -lrt
+
+TO RUN
+
+./bench_script [loops]
+
+loops is the number of times each script loop is run (default 2000000).
+
+*/
+
+#include "../../../pigpio.c"
+
+typedef struct
+{
+   char *name;
+   char *text;
+   int perLoop; /* instructions executed each time round the loop */
+} benchScript_t;
+
+static benchScript_t benchScript[]=
+{
+   {"arith",   "ld v0 p0 tag 1 lda v0 add 3 xor 5 sta v1 dcr v0 jp 1", 6},
+   {"gpio",    "ld v0 p0 tag 1 w 4 1 r 4 w 4 0 dcr v0 jp 1",           5},
+   {"tick",    "ld v0 p0 tag 1 tick sub v1 sta v1 dcr v0 jp 1",         5},
+   {"command", "ld v0 p0 tag 1 br1 br2 dcr v0 jp 1",                    4},
+};
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void benchWait(int id, int running)
+{
+   /* wait for the script to start (or finish) running */
+
+   while ((gpioScriptStatus(id, NULL) == PI_SCRIPT_RUNNING) == running)
+      gpioDelay(100);
+}
+
+int main(int argc, char *argv[])
+{
+   uint32_t loops;
+   int i, id;
+   double t, instrs;
+
+   loops = 2000000;
+
+   if (argc > 1) loops = atoi(argv[1]);
+
+   if (loops < 1000) loops = 1000;
+
+   gpioCfgInterfaces(PI_DISABLE_FIFO_IF | PI_DISABLE_SOCK_IF);
+   gpioCfgSetInternals(gpioCfgGetInternals() | PI_CFG_SIMULATE);
+
+   if (gpioInitialise() < 0) return 1;
+
+   for (i=0; i<(sizeof(benchScript)/sizeof(benchScript_t)); i++)
+   {
+      id = gpioStoreScript(benchScript[i].text);
+
+      if (id < 0)
+      {
+         printf("%s: store failed (%d)\n", benchScript[i].name, id);
+         break;
+      }
+
+      while (gpioScriptStatus(id, NULL) == PI_SCRIPT_INITING) gpioDelay(100);
+
+      t = benchTime();
+
+      gpioRunScript(id, 1, &loops);
+
+      benchWait(id, 0);
+      benchWait(id, 1);
+
+      t = benchTime() - t;
+
+      /* the loop runs loops+1 times after the initial ld */
+
+      instrs = 1.0 + (loops + 1.0) * benchScript[i].perLoop;
+
+      printf("%-8s %6.2f M instructions/sec\n",
+         benchScript[i].name, instrs / t / 1e6);
+
+      gpioDeleteScript(id);
+   }
+
+   gpioTerminate();
+
+   return 0;
+}
@@ -0,0 +1,292 @@
+/*
+bench_socket.c
+Public Domain
+
+Opens many socket connections to a running pigpiod and keeps each
+one busy with TICK commands, then reports the number of connections
+served and the command throughput.  Each connection keeps depth
+commands outstanding, so a depth greater than 1 also exercises the
+daemon's handling of several commands arriving in one read.
+
+The thread count of the pigpiod process is shown before and after
+the run.
+
+TO BUILD
+
+gcc -O2 -o bench_socket bench_socket.c
+
+TO RUN
+
+sudo pigpiod
+
+./bench_socket [connections [seconds [depth]]]
+
+connections defaults to 64, seconds to 5, and depth to 1.  The
+PIGPIO_ADDR and PIGPIO_PORT environment variables select the daemon
+as for the other clients.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define CMD_TICK 16
+
+typedef struct
+{
+   int fd;
+   int got;       /* bytes of the current response received */
+   int pending;   /* commands sent but not yet answered */
+   uint32_t res[4];
+} benchConn_t;
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static int benchConnect(char *addr, char *port)
+{
+   struct addrinfo hints, *res, *rp;
+   int fd, opt;
+
+   memset(&hints, 0, sizeof(hints));
+
+   hints.ai_family   = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   if (getaddrinfo(addr, port, &hints, &res)) return -1;
+
+   fd = -1;
+
+   for (rp=res; rp!=NULL; rp=rp->ai_next)
+   {
+      fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+      if (fd == -1) continue;
+
+      if (connect(fd, rp->ai_addr, rp->ai_addrlen) != -1) break;
+
+      close(fd);
+      fd = -1;
+   }
+
+   freeaddrinfo(res);
+
+   if (fd != -1)
+   {
+      opt = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+   }
+
+   return fd;
+}
+
+static int benchSend(benchConn_t *c, int count)
+{
+   uint32_t cmd[4*16];
+   int i;
+
+   if (count > 16) count = 16;
+
+   memset(cmd, 0, sizeof(cmd));
+
+   for (i=0; i<count; i++) cmd[4*i] = CMD_TICK;
+
+   if (write(c->fd, cmd, 16*count) != (16*count)) return -1;
+
+   c->pending += count;
+
+   return 0;
+}
+
+static int benchThreads(void)
+{
+   DIR *dir;
+   struct dirent *ent;
+   FILE *f;
+   char name[300], line[128];
+   int threads;
+
+   /* find the pigpiod process and return its thread count */
+
+   threads = -1;
+
+   dir = opendir("/proc");
+
+   if (dir == NULL) return -1;
+
+   while ((threads < 0) && ((ent = readdir(dir)) != NULL))
+   {
+      sprintf(name, "/proc/%s/comm", ent->d_name);
+
+      f = fopen(name, "r");
+
+      if (f == NULL) continue;
+
+      if (fgets(line, sizeof(line), f) && !strcmp(line, "pigpiod\n"))
+      {
+         fclose(f);
+
+         sprintf(name, "/proc/%s/status", ent->d_name);
+
+         f = fopen(name, "r");
+
+         if (f == NULL) continue;
+
+         while (fgets(line, sizeof(line), f))
+         {
+            if (sscanf(line, "Threads: %d", &threads) == 1) break;
+         }
+      }
+
+      fclose(f);
+   }
+
+   closedir(dir);
+
+   return threads;
+}
+
+int main(int argc, char *argv[])
+{
+   benchConn_t *conn;
+   struct pollfd *pfd;
+   char *addr, *port;
+   int conns, depth, i, n, r, open;
+   long done;
+   double seconds, start, now;
+
+   conns   = 64;
+   seconds = 5.0;
+   depth   = 1;
+
+   if (argc > 1) conns   = atoi(argv[1]);
+   if (argc > 2) seconds = atof(argv[2]);
+   if (argc > 3) depth   = atoi(argv[3]);
+
+   if (conns < 1) conns = 1;
+   if (depth < 1) depth = 1;
+   if (depth > 16) depth = 16;
+
+   addr = getenv("PIGPIO_ADDR");
+   port = getenv("PIGPIO_PORT");
+
+   if ((addr == NULL) || (!strlen(addr))) addr = "localhost";
+   if ((port == NULL) || (!strlen(port))) port = "8888";
+
+   conn = calloc(conns, sizeof(benchConn_t));
+   pfd  = calloc(conns, sizeof(struct pollfd));
+
+   if ((conn == NULL) || (pfd == NULL)) return 1;
+
+   open = 0;
+
+   for (i=0; i<conns; i++)
+   {
+      conn[i].fd = benchConnect(addr, port);
+
+      if (conn[i].fd < 0)
+      {
+         fprintf(stderr, "connection %d failed (%s)\n", i, strerror(errno));
+         break;
+      }
+
+      pfd[i].fd = conn[i].fd;
+      pfd[i].events = POLLIN;
+
+      open++;
+   }
+
+   if (!open) return 1;
+
+   printf("connections %d, depth %d, daemon threads %d\n",
+      open, depth, benchThreads());
+
+   for (i=0; i<open; i++)
+   {
+      if (benchSend(&conn[i], depth)) return 1;
+   }
+
+   done = 0;
+
+   start = benchTime();
+   now = start;
+
+   while ((now - start) < seconds)
+   {
+      n = poll(pfd, open, 1000);
+
+      if (n < 0) break;
+
+      for (i=0; (i<open) && n; i++)
+      {
+         if (!pfd[i].revents) continue;
+
+         n--;
+
+         if (pfd[i].revents & (POLLERR | POLLHUP))
+         {
+            fprintf(stderr, "connection %d closed\n", i);
+            return 1;
+         }
+
+         /* TICK responses are 16 bytes with no extension */
+
+         while (1)
+         {
+            r = recv(conn[i].fd, (char *)conn[i].res + conn[i].got,
+                     16 - conn[i].got, MSG_DONTWAIT);
+
+            if (r <= 0) break;
+
+            conn[i].got += r;
+
+            if (conn[i].got < 16) continue;
+
+            conn[i].got = 0;
+            conn[i].pending--;
+            done++;
+
+            if (conn[i].res[0] != CMD_TICK)
+            {
+               fprintf(stderr, "bad response on connection %d\n", i);
+               return 1;
+            }
+         }
+
+         if (conn[i].pending < depth)
+         {
+            if (benchSend(&conn[i], depth - conn[i].pending)) return 1;
+         }
+      }
+
+      now = benchTime();
+   }
+
+   printf("daemon threads %d\n", benchThreads());
+
+   printf("%ld commands in %.2f seconds, %.0f commands/sec, "
+          "%.1f us per command per connection\n",
+      done, now - start, done / (now - start),
+      1e6 * (now - start) * open / (done ? done : 1));
+
+   for (i=0; i<open; i++) close(conn[i].fd);
+
+   return 0;
+}
@@ -0,0 +1,184 @@
+/*
+bench_stream.c
+Public Domain
+
+Streams a square wave on a GPIO through a wave stream for a few
+seconds at each of several half periods, refilling the ring whenever
+the daemon triggers the stream's event.  For each half period it
+reports the pulses queued per second, the refills (events answered),
+the mean wait for each event, and the underruns, i.e. how often the
+output ran dry and stopped.
+
+Underruns are expected once the half period is short enough that the
+client can not keep the ring filled.
+
+TO BUILD
+
+gcc -O2 -o bench_stream bench_stream.c -lpigpiod_if2 -lpthread -lrt
+
+TO RUN
+
+sudo pigpiod
+
+./bench_stream [seconds [gpio]]
+
+seconds is how long each half period is streamed (default 2) and gpio
+the GPIO used (default 4).  The GPIO is set as an output.  The
+PIGPIO_ADDR and PIGPIO_PORT environment variables select the daemon
+as for the other clients.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pigpiod_if2.h>
+
+#define BENCH_EVENT 9
+
+#define BENCH_SEGMENTS   8
+#define BENCH_SEG_CBS   64
+#define BENCH_THRESHOLD  4
+
+#define BENCH_CHUNK 16
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/*
+   Queue square wave pulses until the ring is full.  phase is the level
+   the next pulse sets, carried over so a partly queued chunk does not
+   break the wave.
+*/
+
+static int benchFill(int pi, int gpio, int halfPeriod, int *phase)
+{
+   gpioPulse_t pulse[BENCH_CHUNK+1];
+   int i, n, total;
+
+   for (i=0; i<=BENCH_CHUNK; i++)
+   {
+      pulse[i].gpioOn  = (i & 1) ? 0 : (1<<gpio);
+      pulse[i].gpioOff = (i & 1) ? (1<<gpio) : 0;
+      pulse[i].usDelay = halfPeriod;
+   }
+
+   total = 0;
+
+   while (1)
+   {
+      n = wave_stream_add(pi, BENCH_CHUNK, &pulse[*phase]);
+
+      if (n < 0) return n;
+
+      total += n;
+
+      *phase ^= (n & 1);
+
+      if (n < BENCH_CHUNK) break;
+   }
+
+   return total;
+}
+
+static int benchRun(int pi, int gpio, int halfPeriod, double seconds)
+{
+   double start, asked, wait;
+   int n, phase, pulses, refills, timeouts, under;
+
+   n = wave_stream_open(pi, BENCH_SEGMENTS, BENCH_SEG_CBS, BENCH_THRESHOLD);
+
+   if (n < 0)
+   {
+      printf("wave_stream_open failed (%d)\n", n);
+      return n;
+   }
+
+   wave_stream_set_event(pi, BENCH_EVENT);
+
+   pulses   = 0;
+   refills  = 0;
+   timeouts = 0;
+   wait     = 0.0;
+   phase    = 0;
+
+   start = benchTime();
+
+   n = benchFill(pi, gpio, halfPeriod, &phase);
+
+   while ((n >= 0) && ((benchTime() - start) < seconds))
+   {
+      pulses += n;
+
+      asked = benchTime();
+
+      /*
+         A missed event is not fatal, the stream asks again when it
+         runs dry, so a timeout just refills.
+      */
+
+      if (wait_for_event(pi, BENCH_EVENT, 0.1) == 1)
+      {
+         wait += benchTime() - asked;
+         refills++;
+      }
+      else timeouts++;
+
+      n = benchFill(pi, gpio, halfPeriod, &phase);
+   }
+
+   under = wave_stream_get_underruns(pi);
+
+   wave_stream_close(pi);
+
+   if (n < 0)
+   {
+      printf("wave_stream_add failed (%d)\n", n);
+      return n;
+   }
+
+   printf("%4d us  %9.0f pulses/s  %6d refills  %8.1f us wait  "
+      "%5d underruns  (%d timeouts)\n",
+      halfPeriod, pulses / seconds, refills,
+      refills ? 1e6 * wait / refills : 0.0, under, timeouts);
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   static int halfPeriod[]={500, 100, 50, 20, 10, 5};
+
+   double seconds;
+   int pi, gpio, i;
+
+   seconds = 2.0;
+   gpio    = 4;
+
+   if (argc > 1) seconds = atof(argv[1]);
+   if (argc > 2) gpio    = atoi(argv[2]);
+
+   if (seconds <= 0.0) seconds = 0.1;
+
+   pi = pigpio_start(NULL, NULL);
+
+   if (pi < 0) return 1;
+
+   set_mode(pi, gpio, PI_OUTPUT);
+
+   for (i=0; i<(sizeof(halfPeriod)/sizeof(halfPeriod[0])); i++)
+   {
+      if (benchRun(pi, gpio, halfPeriod[i], seconds) < 0) break;
+   }
+
+   pigpio_stop(pi);
+
+   return 0;
+}
@@ -0,0 +1,170 @@
+/*
+bench_timer.c
+Public Domain
+
+Runs the ten gpioSetTimerFunc timers at 10 milliseconds together with
+a number of gpioTimerStart timers at a sub-millisecond period, then
+prints a jitter report for each of the ten and a summary for the
+rest.  Each callback spins for a few microseconds to stand in for
+real work.
+
+drift is the number of calls made less the number expected from the
+elapsed time, so a timer which keeps to its deadlines shows 0 or -1.
+The thread count of the process is shown while the timers run.
+
+TO BUILD
+
+gcc -O2 -o bench_timer bench_timer.c ../../../command.c -lpthread -lrt
+
+TO RUN
+
+./bench_timer [timers [micros [seconds]]]
+
+timers is the number of extra timers (default 100), micros their
+period (default 500), and seconds the run time (default 5).
+
+*/
+
+#include "../../../pigpio.c"
+
+#define BENCH_WORK_NS 5000
+
+static uint32_t legacyCalls[PI_MAX_TIMER+1];
+static uint32_t timerCalls[PI_TIMER_SLOTS];
+
+static int benchThreads(void)
+{
+   FILE *f;
+   char line[128];
+   int threads;
+
+   threads = -1;
+
+   f = fopen("/proc/self/status", "r");
+
+   if (f == NULL) return -1;
+
+   while (fgets(line, sizeof(line), f))
+   {
+      if (sscanf(line, "Threads: %d", &threads) == 1) break;
+   }
+
+   fclose(f);
+
+   return threads;
+}
+
+static void benchWork(void *userdata)
+{
+   uint64_t end;
+
+   (*(uint32_t *)userdata)++;
+
+   end = timerNanos() + BENCH_WORK_NS;
+
+   while (timerNanos() < end);
+}
+
+static void benchReport(char *name, int id, uint32_t calls, double seconds)
+{
+   gpioTimerJitter_t j;
+   long drift;
+
+   if (gpioTimerJitter(id, &j)) return;
+
+   drift = calls - (long)(seconds * 1e6 / j.micros);
+
+   printf("%-8s %5u %6u %4ld %6u %8u %8u %8u\n",
+      name, j.micros, j.calls, drift, j.missed,
+      j.lateMin / 1000, j.lateMean / 1000, j.lateMax / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+   int handle[PI_TIMER_SLOTS];
+   int timers, micros, i, n;
+   uint32_t lateMean, lateMax, missed;
+   gpioTimerJitter_t j;
+   double seconds, t;
+   char name[16];
+
+   timers  = 100;
+   micros  = 500;
+   seconds = 5.0;
+
+   if (argc > 1) timers  = atoi(argv[1]);
+   if (argc > 2) micros  = atoi(argv[2]);
+   if (argc > 3) seconds = atof(argv[3]);
+
+   if (timers < 0) timers = 0;
+   if (timers > (PI_TIMER_SLOTS-PI_MAX_TIMER-1))
+      timers = PI_TIMER_SLOTS-PI_MAX_TIMER-1;
+
+   gpioCfgInterfaces(PI_DISABLE_FIFO_IF | PI_DISABLE_SOCK_IF);
+   gpioCfgSetInternals(gpioCfgGetInternals() | PI_CFG_SIMULATE);
+
+   if (gpioInitialise() < 0) return 1;
+
+   printf("threads before %d\n", benchThreads());
+
+   t = timerNanos() / 1e9;
+
+   for (i=0; i<=PI_MAX_TIMER; i++)
+      gpioSetTimerFuncEx(i, PI_MIN_MS, benchWork, &legacyCalls[i]);
+
+   for (n=0; n<timers; n++)
+   {
+      handle[n] = gpioTimerStart(micros, benchWork, &timerCalls[n]);
+
+      if (handle[n] < 0)
+      {
+         printf("gpioTimerStart failed (%d)\n", handle[n]);
+         return 1;
+      }
+   }
+
+   printf("threads running %d\n", benchThreads());
+
+   gpioSleep(PI_TIME_RELATIVE, (int)seconds, (seconds - (int)seconds) * 1e6);
+
+   t = (timerNanos() / 1e9) - t;
+
+   printf("\ntimer    micros  calls drift missed  min(us) mean(us)  max(us)\n");
+
+   for (i=0; i<=PI_MAX_TIMER; i++)
+   {
+      sprintf(name, "%d", i);
+      benchReport(name, i, legacyCalls[i], t);
+   }
+
+   lateMean = 0;
+   lateMax  = 0;
+   missed   = 0;
+
+   for (n=0; n<timers; n++)
+   {
+      if (gpioTimerJitter(handle[n], &j)) continue;
+
+      lateMean += j.lateMean / timers;
+      missed   += j.missed;
+
+      if (j.lateMax > lateMax) lateMax = j.lateMax;
+   }
+
+   if (timers)
+   {
+      printf("\n%d timers at %d micros: %u missed, "
+             "mean %u us late, max %u us late\n",
+         timers, micros, missed, lateMean / 1000, lateMax / 1000);
+
+      benchReport("first", handle[0], timerCalls[0], t);
+   }
+
+   for (i=0; i<=PI_MAX_TIMER; i++) gpioSetTimerFunc(i, 0, NULL);
+
+   for (n=0; n<timers; n++) gpioTimerStop(handle[n]);
+
+   gpioTerminate();
+
+   return 0;
+}
@@ -0,0 +1,198 @@
+/*
+bench_transport.c
+Public Domain
+
+Times the round trip of gpio_read and gpio_write to a local pigpiod
+over each of its command transports.
+
+tcp      the socket port (loopback TCP)
+unix     the Unix domain socket
+fifo     the /dev/pigpio and /dev/pigout pipes
+shm      a shared memory command region (see command_open_shm)
+
+A transport which can not be opened is skipped.
+
+TO BUILD
+
+gcc -O2 -o bench_transport bench_transport.c -lpigpiod_if2 -lpthread -lrt
+
+TO RUN
+
+sudo pigpiod
+
+sudo ./bench_transport [count [gpio [path]]]
+
+count is the number of commands of each kind (default 20000), gpio
+the GPIO written and read (default 4), and path that of the Unix
+domain socket (default /var/run/pigpio.sock).  The GPIO is set as an
+output.  The PIGPIO_ADDR and PIGPIO_PORT environment variables select
+the daemon for the tcp transport as for the other clients.  sudo is
+only needed to open the pipes.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <pigpio.h>
+#include <pigpiod_if2.h>
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void benchReport(char *name, double tRead, double tWrite, int count)
+{
+   printf("%-6s gpio_read %7.1f us  gpio_write %7.1f us\n",
+      name, 1e6 * tRead / count, 1e6 * tWrite / count);
+}
+
+static void benchSocket(
+   char *name, char *addrStr, int count, int gpio, int shm)
+{
+   int pi, i, bad, h;
+   double t, tRead, tWrite;
+
+   pi = pigpio_start(addrStr, NULL);
+
+   if (pi < 0)
+   {
+      printf("%-6s not available (%s)\n", name, pigpio_error(pi));
+      return;
+   }
+
+   if (shm)
+   {
+      h = command_open_shm(pi, 0);
+
+      if (h < 0)
+      {
+         printf("%-6s not available (%s)\n", name, pigpio_error(h));
+         pigpio_stop(pi);
+         return;
+      }
+   }
+
+   set_mode(pi, gpio, PI_OUTPUT);
+
+   bad = 0;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++) if (gpio_read(pi, gpio) < 0) bad++;
+
+   tRead = benchTime() - t;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++) if (gpio_write(pi, gpio, i & 1)) bad++;
+
+   tWrite = benchTime() - t;
+
+   benchReport(name, tRead, tWrite, count);
+
+   if (bad) printf("%d commands failed\n", bad);
+
+   pigpio_stop(pi);
+}
+
+static int fifoCommand(int fdIn, int fdOut, char *cmd)
+{
+   char buf[64];
+   int len, n;
+
+   if (write(fdIn, cmd, strlen(cmd)) < 0) return -1;
+
+   /* one line per reply */
+
+   len = 0;
+
+   while ((len == 0) || (buf[len-1] != '\n'))
+   {
+      n = read(fdOut, buf + len, sizeof(buf) - len - 1);
+
+      if (n <= 0) return -1;
+
+      len += n;
+   }
+
+   buf[len] = 0;
+
+   return atoi(buf);
+}
+
+static void benchFifo(int count, int gpio)
+{
+   int fdIn, fdOut, i, bad;
+   char rd[32], wr[2][32];
+   double t, tRead, tWrite;
+
+   fdIn = open(PI_INPFIFO, O_WRONLY);
+   fdOut = open(PI_OUTFIFO, O_RDONLY);
+
+   if ((fdIn < 0) || (fdOut < 0))
+   {
+      printf("%-6s not available\n", "fifo");
+      if (fdIn >= 0) close(fdIn);
+      if (fdOut >= 0) close(fdOut);
+      return;
+   }
+
+   sprintf(rd, "r %d\n", gpio);
+   sprintf(wr[0], "w %d 0\n", gpio);
+   sprintf(wr[1], "w %d 1\n", gpio);
+
+   bad = 0;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++) if (fifoCommand(fdIn, fdOut, rd) < 0) bad++;
+
+   tRead = benchTime() - t;
+
+   t = benchTime();
+
+   for (i=0; i<count; i++) if (fifoCommand(fdIn, fdOut, wr[i&1])) bad++;
+
+   tWrite = benchTime() - t;
+
+   benchReport("fifo", tRead, tWrite, count);
+
+   if (bad) printf("%d commands failed\n", bad);
+
+   close(fdIn);
+   close(fdOut);
+}
+
+int main(int argc, char *argv[])
+{
+   int count, gpio;
+   char unixAddr[PI_MAX_SOCKET_PATH+8];
+
+   count = 20000;
+   gpio  = 4;
+
+   strcpy(unixAddr, "unix:");
+
+   if (argc > 1) count = atoi(argv[1]);
+   if (argc > 2) gpio  = atoi(argv[2]);
+   if (argc > 3) strncat(unixAddr, argv[3], PI_MAX_SOCKET_PATH);
+
+   if (count < 1) count = 1;
+
+   benchSocket("tcp", NULL, count, gpio, 0);
+   benchSocket("unix", unixAddr, count, gpio, 0);
+   benchFifo(count, gpio);
+   benchSocket("shm", unixAddr, count, gpio, 1);
+
+   return 0;
+}
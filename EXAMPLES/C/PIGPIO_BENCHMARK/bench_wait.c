@@ -0,0 +1,187 @@
+/*
+bench_wait.c
+Public Domain
+
+Measures how long wait_for_edge and wait_for_event take to return
+after the edge or event is caused.  A waiting thread blocks in the
+wait while the main thread toggles a GPIO (or triggers an event) and
+notes the time.  The latency is the time from just before the
+gpio_write or event_trigger to the wait returning, so it includes the
+command, the daemon's sampling and notification, and the wake up.
+
+TO BUILD
+
+gcc -O2 -o bench_wait bench_wait.c -lpigpiod_if2 -lpthread -lrt
+
+TO RUN
+
+sudo pigpiod
+
+./bench_wait [count [gpio]]
+
+count is the number of waits of each kind (default 200) and gpio the
+GPIO toggled (default 4).  The GPIO is set as an output.  The
+PIGPIO_ADDR and PIGPIO_PORT environment variables select the daemon
+as for the other clients.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <pigpiod_if2.h>
+
+#define BENCH_EVENT 7
+
+typedef struct
+{
+   int pi;
+   int gpio;
+   int count;
+   int event;             /* wait for events rather than edges */
+   volatile int waiting;  /* set before each wait */
+   double *done;          /* time each wait returned */
+   int *result;
+} bench_t;
+
+static double benchTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void benchWatch(int pi, unsigned gpio, unsigned level, uint32_t tick)
+{
+}
+
+static void *benchWaiter(void *x)
+{
+   bench_t *b = x;
+   int i;
+
+   for (i=0; i<b->count; i++)
+   {
+      b->waiting = 1;
+
+      if (b->event) b->result[i] = wait_for_event(b->pi, b->event, 2.0);
+      else b->result[i] = wait_for_edge(b->pi, b->gpio, EITHER_EDGE, 2.0);
+
+      b->done[i] = benchTime();
+   }
+
+   return NULL;
+}
+
+static void benchRun(bench_t *b, char *name)
+{
+   pthread_t pth;
+   double *start, lat, sum, min, max;
+   int i, missed;
+
+   start     = calloc(b->count, sizeof(double));
+   b->done   = calloc(b->count, sizeof(double));
+   b->result = calloc(b->count, sizeof(int));
+
+   b->waiting = 0;
+
+   pthread_create(&pth, NULL, benchWaiter, b);
+
+   for (i=0; i<b->count; i++)
+   {
+      while (!b->waiting) time_sleep(0.001);
+
+      b->waiting = 0;
+
+      /* give the waiter time to register its callback */
+
+      time_sleep(0.02);
+
+      start[i] = benchTime();
+
+      if (b->event) event_trigger(b->pi, b->event);
+      else          gpio_write(b->pi, b->gpio, i & 1);
+   }
+
+   pthread_join(pth, NULL);
+
+   sum = 0.0;
+   min = 1e9;
+   max = 0.0;
+   missed = 0;
+
+   for (i=0; i<b->count; i++)
+   {
+      if (b->result[i] != 1)
+      {
+         missed++;
+         continue;
+      }
+
+      lat = b->done[i] - start[i];
+
+      sum += lat;
+      if (lat < min) min = lat;
+      if (lat > max) max = lat;
+   }
+
+   if (missed < b->count)
+   {
+      printf("%-14s mean %8.1f us  min %8.1f us  max %8.1f us",
+         name, 1e6 * sum / (b->count - missed), 1e6 * min, 1e6 * max);
+   }
+   else printf("%-14s", name);
+
+   printf("  (%d missed)\n", missed);
+
+   free(start);
+   free(b->done);
+   free(b->result);
+}
+
+int main(int argc, char *argv[])
+{
+   bench_t b;
+   int id;
+
+   b.count = 200;
+   b.gpio  = 4;
+
+   if (argc > 1) b.count = atoi(argv[1]);
+   if (argc > 2) b.gpio  = atoi(argv[2]);
+
+   if (b.count < 1) b.count = 1;
+
+   b.pi = pigpio_start(NULL, NULL);
+
+   if (b.pi < 0) return 1;
+
+   set_mode(b.pi, b.gpio, PI_OUTPUT);
+   gpio_write(b.pi, b.gpio, 1);
+
+   /*
+      Keep the GPIO watched between waits so the level known to the
+      client stays current and a wait is not triggered by a change
+      made while nothing was watching.
+   */
+
+   id = callback(b.pi, b.gpio, EITHER_EDGE, benchWatch);
+
+   time_sleep(0.1);
+
+   b.event = 0;
+   benchRun(&b, "wait_for_edge");
+
+   b.event = BENCH_EVENT;
+   benchRun(&b, "wait_for_event");
+
+   callback_cancel(id);
+
+   pigpio_stop(b.pi);
+
+   return 0;
+}
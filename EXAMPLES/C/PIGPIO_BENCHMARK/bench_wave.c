@@ -0,0 +1,309 @@
+/*
+bench_wave.c
+Public Domain
+
+Times the assembly of a waveform from 1 to 32 serial trains, each on
+its own GPIO, built the incremental way with gpioWaveAddSerial and
+with a wave builder, which merges all the trains once when the wave
+is created.
+
+The trains are run twice, first all at the same baud rate starting
+together, so their edges mostly coincide, and then each at a slightly
+different rate and starting a few microseconds after the last, so
+they rarely do.
+
+Each time is the shortest of loops runs.
+
+add      the time to merge the trains (gpioWaveAddSerial calls, or the
+         builder's adds and single merge)
+create   add plus gpioWaveCreate or gpioWaveBuilderCreate
+
+The merged pulses of the two methods are compared and any difference
+is reported.
+
+The serial encoder alone is timed for 8, 16, and 32 bit characters.
+
+Finally a frame of generic pulses which is already resident is
+created again and deleted, with and without the wave cache (see
+PI_CFG_NO_WAVE_CACHE).
+
+TO BUILD
+
+gcc -O2 -o bench_wave bench_wave.c ../../../command.c -lpthread -lrt
+
+TO RUN
+
+./bench_wave [bytes [baud [loops]]]
+
+bytes is the length of each train's message (default 32), baud the
+serial rate (default 115200), and loops the number of times each
+waveform is built (default 20).
+
+*/
+
+#include "../../../pigpio.c"
+
+#define BENCH_TRAINS 32
+
+static char benchMsg[BENCH_TRAINS][PI_WAVE_MAX_CHARS];
+
+static rawWave_t benchOld[PI_WAVE_MAX_PULSES];
+static rawWave_t benchNew[PI_WAVE_MAX_PULSES];
+
+static double benchTime(void)
+{
+   return timerNanos() / 1e9;
+}
+
+static int benchBaud[BENCH_TRAINS];
+static int benchOffset[BENCH_TRAINS];
+
+static int benchOldWay(int trains, int bytes, int create)
+{
+   int t, n, wid;
+
+   gpioWaveAddNew();
+
+   for (t=0; t<trains; t++)
+      n = gpioWaveAddSerial(
+         t, benchBaud[t], 8, 2, benchOffset[t], bytes, benchMsg[t]);
+
+   if (create)
+   {
+      wid = gpioWaveCreate();
+      if (wid >= 0) gpioWaveDelete(wid);
+      return wid;
+   }
+
+   memcpy(benchOld, wf[wfcur], n * sizeof(rawWave_t));
+
+   return n;
+}
+
+static int benchNewWay(int h, int trains, int bytes, int create)
+{
+   int t, wid;
+
+   for (t=0; t<trains; t++)
+      gpioWaveBuilderAddSerial(
+         h, t, benchBaud[t], 8, 2, benchOffset[t], bytes, benchMsg[t]);
+
+   if (create)
+   {
+      wid = gpioWaveBuilderCreate(h);
+      if (wid >= 0) gpioWaveDelete(wid);
+      return wid;
+   }
+
+   /* merge without creating, then empty the builder */
+
+   t = waveMergeTrains(&waveBuilder[h], benchNew);
+
+   waveBuilder[h].numTrains = 0;
+   waveBuilder[h].numPulses = 0;
+
+   return t;
+}
+
+static void benchRun(int h, int bytes, int loops)
+{
+   int trains, i, nOld, nNew, create, wid;
+   double t, tOld[2], tNew[2];
+
+   nOld = 0;
+   nNew = 0;
+
+   printf("trains pulses   add(old)  add(new)  create(old)  create(new)\n");
+
+   for (trains=1; trains<=BENCH_TRAINS; trains*=2)
+   {
+      for (create=0; create<2; create++)
+      {
+         tOld[create] = 1e9;
+         tNew[create] = 1e9;
+
+         for (i=0; i<loops; i++)
+         {
+            t = benchTime();
+            wid = benchOldWay(trains, bytes, create);
+            t = benchTime() - t;
+            if (t < tOld[create]) tOld[create] = t;
+         }
+
+         if (!create) nOld = wid;
+
+         for (i=0; i<loops; i++)
+         {
+            t = benchTime();
+            wid = benchNewWay(h, trains, bytes, create);
+            t = benchTime() - t;
+            if (t < tNew[create]) tNew[create] = t;
+         }
+
+         if (!create) nNew = wid;
+
+         if (wid < 0) printf("trains %d: error %d\n", trains, wid);
+      }
+
+      if ((nOld != nNew) ||
+          memcmp(benchOld, benchNew, nOld * sizeof(rawWave_t)))
+         printf("trains %d: merged waves differ (%d, %d pulses)\n",
+            trains, nOld, nNew);
+
+      printf("%6d %6d %10.3f %9.3f %12.3f %12.3f\n",
+         trains, nNew, 1e3 * tOld[0], 1e3 * tNew[0],
+         1e3 * tOld[1], 1e3 * tNew[1]);
+   }
+}
+
+static void benchEncode(int baud, int loops)
+{
+   static int bits[3] = {8, 16, 32};
+   int i, j, n;
+   double t, best;
+
+   printf("\nserial encoding at %d baud\n\n", baud);
+
+   for (i=0; i<3; i++)
+   {
+      best = 1e9;
+
+      for (j=0; j<loops; j++)
+      {
+         t = benchTime();
+         n = waveSerialPulses(benchOld, 4, baud, bits[i], 2, 0,
+            PI_WAVE_MAX_CHARS, benchMsg[0]);
+         t = benchTime() - t;
+         if (t < best) best = t;
+      }
+
+      printf("%2d bits %6d pulses %10.0f chars/s\n", bits[i], n,
+         (PI_WAVE_MAX_CHARS * 8 / bits[i]) / best);
+   }
+}
+
+static double benchCreate(int numPulses, gpioPulse_t *pulses, int loops)
+{
+   int i, wid;
+   double t, best;
+
+   best = 1e9;
+
+   for (i=0; i<loops; i++)
+   {
+      t = benchTime();
+
+      gpioWaveAddNew();
+      gpioWaveAddGeneric(numPulses, pulses);
+      wid = gpioWaveCreate();
+      gpioWaveDelete(wid);
+
+      t = benchTime() - t;
+      if (t < best) best = t;
+   }
+
+   return best;
+}
+
+static void benchCache(int loops)
+{
+   static int sizes[3] = {16, 256, 4096};
+   gpioPulse_t *pulses;
+   int i, j, wid;
+   double tNew, tHit;
+
+   pulses = malloc(sizes[2] * sizeof(gpioPulse_t));
+
+   printf("\nrecreating a resident wave, times in us\n\n");
+   printf("pulses    uncached    cached\n");
+
+   for (i=0; i<3; i++)
+   {
+      for (j=0; j<sizes[i]; j++)
+      {
+         pulses[j].gpioOn  = (j & 1) ? (1<<4) : 0;
+         pulses[j].gpioOff = (j & 1) ? 0 : (1<<4);
+         pulses[j].usDelay = 10 + (j % 7);
+      }
+
+      gpioCfg.internals |= PI_CFG_NO_WAVE_CACHE;
+
+      tNew = benchCreate(sizes[i], pulses, loops);
+
+      gpioCfg.internals &= ~PI_CFG_NO_WAVE_CACHE;
+
+      /* keep one reference so the frame stays resident */
+
+      gpioWaveAddNew();
+      gpioWaveAddGeneric(sizes[i], pulses);
+      wid = gpioWaveCreate();
+
+      tHit = benchCreate(sizes[i], pulses, loops);
+
+      gpioWaveDelete(wid);
+
+      printf("%6d %11.1f %9.1f\n", sizes[i], 1e6 * tNew, 1e6 * tHit);
+   }
+
+   free(pulses);
+}
+
+int main(int argc, char *argv[])
+{
+   int bytes, baud, loops, h, i, j;
+
+   bytes = 32;
+   baud  = 115200;
+   loops = 20;
+
+   if (argc > 1) bytes = atoi(argv[1]);
+   if (argc > 2) baud  = atoi(argv[2]);
+   if (argc > 3) loops = atoi(argv[3]);
+
+   if (bytes < 1) bytes = 1;
+   if (bytes > PI_WAVE_MAX_CHARS) bytes = PI_WAVE_MAX_CHARS;
+   if (loops < 1) loops = 1;
+
+   for (i=0; i<BENCH_TRAINS; i++)
+      for (j=0; j<PI_WAVE_MAX_CHARS; j++) benchMsg[i][j] = rand();
+
+   gpioCfgInterfaces(PI_DISABLE_FIFO_IF | PI_DISABLE_SOCK_IF);
+   gpioCfgSetInternals(gpioCfgGetInternals() | PI_CFG_SIMULATE);
+
+   if (gpioInitialise() < 0) return 1;
+
+   h = gpioWaveBuilderOpen();
+
+   printf("%d bytes per train, times in ms\n", bytes);
+
+   for (i=0; i<BENCH_TRAINS; i++)
+   {
+      benchBaud[i]   = baud;
+      benchOffset[i] = 0;
+   }
+
+   printf("\nall at %d baud\n\n", baud);
+
+   benchRun(h, bytes, loops);
+
+   for (i=0; i<BENCH_TRAINS; i++)
+   {
+      benchBaud[i]   = baud - (i * (baud / 100));
+      benchOffset[i] = i * 3;
+   }
+
+   printf("\n%d to %d baud, starts staggered\n\n",
+      benchBaud[BENCH_TRAINS-1], baud);
+
+   benchRun(h, bytes, loops);
+
+   benchEncode(baud, loops);
+
+   benchCache(loops);
+
+   gpioWaveBuilderClose(h);
+
+   gpioTerminate();
+
+   return 0;
+}
@@ -35,6 +35,7 @@ This version is for pigpio version 70+
 #include <stdlib.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "pigpio.h"
 #include "command.h"
@@ -84,8 +85,10 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_FS,    "FS",    133, 2, 1}, // fileSeek
    {PI_CMD_FW,    "FW",    193, 0, 0}, // fileWrite
 
+   {PI_CMD_GAPPLY,"GAPPLY",198, 0, 0}, // gpioApply
    {PI_CMD_GDC,   "GDC",   112, 2, 1}, // gpioGetPWMdutycycle
    {PI_CMD_GPW,   "GPW",   112, 2, 1}, // gpioGetServoPulsewidth
+   {PI_CMD_GSNAP, "GSNAP", 101, 9, 0}, // gpioSnapshot
 
    {PI_CMD_HELP,  "H",     101, 5, 0}, // cmdUsage
    {PI_CMD_HELP,  "HELP",  101, 5, 0}, // cmdUsage
@@ -130,6 +133,7 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_NB,    "NB",    122, 0, 1}, // gpioNotifyBegin
    {PI_CMD_NC,    "NC",    112, 0, 1}, // gpioNotifyClose
    {PI_CMD_NO,    "NO",    101, 2, 1}, // gpioNotifyOpen
+   {PI_CMD_NOS,   "NOS",   112, 2, 1}, // gpioNotifyOpenShm
    {PI_CMD_NP,    "NP",    112, 0, 1}, // gpioNotifyPause
 
    {PI_CMD_PADG,  "PADG",  112, 2, 1}, // gpioGetPad
@@ -158,6 +162,7 @@ cmdInfo_t cmdInfo[]=
 
    {PI_CMD_PWM,   "P",     121, 0, 1}, // gpioPWM
    {PI_CMD_PWM,   "PWM",   121, 0, 1}, // gpioPWM
+   {PI_CMD_PWMM,  "PWMM",  199, 0, 0}, // gpioPWMMulti
 
    {PI_CMD_READ,  "R",     112, 2, 1}, // gpioRead
    {PI_CMD_READ,  "READ",  112, 2, 1}, // gpioRead
@@ -172,9 +177,13 @@ cmdInfo_t cmdInfo[]=
 
    {PI_CMD_SERVO, "S",     121, 0, 1}, // gpioServo
    {PI_CMD_SERVO, "SERVO", 121, 0, 1}, // gpioServo
+   {PI_CMD_SERVOM,"SERVOM",199, 0, 0}, // gpioServoMulti
 
    {PI_CMD_SHELL, "SHELL", 128, 2, 0}, // shell
 
+   {PI_CMD_SHMC,  "SHMC",  112, 0, 0}, // gpioCommandCloseShm
+   {PI_CMD_SHMO,  "SHMO",  112, 2, 0}, // gpioCommandOpenShm
+
    {PI_CMD_SLR,   "SLR",   121, 6, 0}, // gpioSerialRead
    {PI_CMD_SLRC,  "SLRC",  112, 0, 1}, // gpioSerialReadClose
    {PI_CMD_SLRO,  "SLRO",  131, 0, 1}, // gpioSerialReadOpen
@@ -186,6 +195,8 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_SPIW,  "SPIW",  193, 0, 0}, // spiWrite
    {PI_CMD_SPIX,  "SPIX",  193, 6, 0}, // spiXfer
 
+   {PI_CMD_STATS, "STATS", 112,10, 0}, // gpioStatistics
+
    {PI_CMD_TICK,  "T",     101, 4, 1}, // gpioTick
    {PI_CMD_TICK,  "TICK",  101, 4, 1}, // gpioTick
 
@@ -198,19 +209,33 @@ cmdInfo_t cmdInfo[]=
 
    {PI_CMD_WVAG,  "WVAG",  192, 2, 0}, // gpioWaveAddGeneric
    {PI_CMD_WVAS,  "WVAS",  196, 2, 0}, // gpioWaveAddSerial
+   {PI_CMD_WVBAG, "WVBAG", 200, 2, 0}, // gpioWaveBuilderAddGeneric
+   {PI_CMD_WVBAS, "WVBAS", 201, 2, 0}, // gpioWaveBuilderAddSerial
+   {PI_CMD_WVBCRE,"WVBCRE",112, 2, 1}, // gpioWaveBuilderCreate
+   {PI_CMD_WVBDEL,"WVBDEL",112, 0, 1}, // gpioWaveBuilderClose
+   {PI_CMD_WVBNEW,"WVBNEW",101, 2, 1}, // gpioWaveBuilderOpen
    {PI_CMD_WVBSY, "WVBSY", 101, 2, 1}, // gpioWaveTxBusy
    {PI_CMD_WVCHA, "WVCHA", 197, 0, 0}, // gpioWaveChain
    {PI_CMD_WVCLR, "WVCLR", 101, 0, 1}, // gpioWaveClear
+   {PI_CMD_WVCMP, "WVCMP", 101, 2, 1}, // gpioWaveCompact
    {PI_CMD_WVCRE, "WVCRE", 101, 2, 1}, // gpioWaveCreate 
    {PI_CMD_WVCAP, "WVCAP", 112, 2, 1}, // gpioWaveCreatePad
    {PI_CMD_WVDEL, "WVDEL", 112, 0, 1}, // gpioWaveDelete
    {PI_CMD_WVGO,  "WVGO" , 101, 2, 0}, // gpioWaveTxStart
    {PI_CMD_WVGOR, "WVGOR", 101, 2, 0}, // gpioWaveTxStart
    {PI_CMD_WVHLT, "WVHLT", 101, 0, 1}, // gpioWaveTxStop
+   {PI_CMD_WVLKP, "WVLKP", 101, 2, 1}, // gpioWaveLookup
    {PI_CMD_WVNEW, "WVNEW", 101, 0, 1}, // gpioWaveAddNew
+   {PI_CMD_WVSAD, "WVSAD", 192, 2, 0}, // gpioWaveStreamAdd
    {PI_CMD_WVSC,  "WVSC",  112, 2, 1}, // gpioWaveGet*Cbs
+   {PI_CMD_WVSCH, "WVSCH", 112, 2, 1}, // gpioWaveGetCache*
+   {PI_CMD_WVSCL, "WVSCL", 101, 0, 1}, // gpioWaveStreamClose
+   {PI_CMD_WVSEV, "WVSEV", 112, 0, 1}, // gpioWaveStreamSetEvent
    {PI_CMD_WVSM,  "WVSM",  112, 2, 1}, // gpioWaveGet*Micros
+   {PI_CMD_WVSOP, "WVSOP", 131, 0, 1}, // gpioWaveStreamOpen
    {PI_CMD_WVSP,  "WVSP",  112, 2, 1}, // gpioWaveGet*Pulses
+   {PI_CMD_WVSPC, "WVSPC", 101,11, 0}, // gpioWaveGetSpace
+   {PI_CMD_WVSST, "WVSST", 112, 2, 1}, // gpioWaveStreamGet*
    {PI_CMD_WVTAT, "WVTAT", 101, 2, 1}, // gpioWaveTxAt
    {PI_CMD_WVTX,  "WVTX",  112, 2, 1}, // gpioWaveTxSend
    {PI_CMD_WVTXM, "WVTXM", 121, 2, 1}, // gpioWaveTxSend
@@ -300,8 +325,10 @@ FR h n           Read bytes from file handle\n\
 FS h n from      Seek to file handle position\n\
 FW h ...         Write bytes to file handle\n\
 \n\
+GAPPLY g what ... | Configure GPIO, nine values per GPIO\n\
 GDC g            Get PWM dutycycle for GPIO\n\
 GPW g            Get servo pulsewidth for GPIO\n\
+GSNAP            Get the settings and levels of all GPIO\n\
 \n\
 H/HELP           Display command help\n\
 HC g f           Set hardware clock frequency\n\
@@ -335,6 +362,7 @@ MILS n           Delay for milliseconds\n\
 NB h bits        Start notification\n\
 NC h             Close notification\n\
 NO               Request a notification\n\
+NOS n            Request a shared memory notification\n\
 NP h             Pause notification\n\
 \n\
 P/PWM g v        Set GPIO PWM value\n\
@@ -354,10 +382,12 @@ PROCU sid ...    Set script parameters\n\
 PRRG g           Get GPIO PWM real range\n\
 PRS g v          Set GPIO PWM range\n\
 PUD g pud        Set GPIO pull up/down\n\
+PWMM g v ...     Set PWM values of many GPIO together\n\
 \n\
 R/READ g         Read GPIO level\n\
 \n\
 S/SERVO g v      Set GPIO servo pulsewidth\n\
+SERVOM g v ...   Set servo pulsewidths of many GPIO together\n\
 SERC h           Close serial handle\n\
 SERDA h          Check for serial data ready to read\n\
 SERO text baud flags | Open serial device at baud with flags\n\
@@ -366,6 +396,8 @@ SERRB h          Read byte from serial handle\n\
 SERW h ...       Write bytes to serial handle\n\
 SERWB h byte     Write byte to serial handle\n\
 SHELL name str   Execute a shell command\n\
+SHMC h           Close shared memory command region\n\
+SHMO n           Open shared memory command region\n\
 SLR g v          Read bit bang serial data from GPIO\n\
 SLRC g           Close GPIO for bit bang serial data\n\
 SLRO g baud bitlen | Open GPIO for bit bang serial data\n\
@@ -375,6 +407,7 @@ SPIO channel baud flags | SPI open channel at baud with flags\n\
 SPIR h v         SPI read bytes from handle\n\
 SPIW h ...       SPI write bytes to handle\n\
 SPIX h ...       SPI transfer bytes to handle\n\
+STATS clr        Get run time statistics, clear them if clr is 1\n\
 \n\
 T/TICK           Get current tick\n\
 TRIG g micros l  Trigger level for micros on GPIO\n\
@@ -383,18 +416,32 @@ W/WRITE g l      Write level to GPIO\n\
 WDOG g millis    Set millisecond watchdog on GPIO\n\
 WVAG triplets    Wave add generic pulses\n\
 WVAS g baud bitlen stopbits offset ... | Wave add serial data\n\
+WVBAG h triplets Wave builder add generic pulses\n\
+WVBAS h g baud bitlen stopbits offset ... | Wave builder add serial data\n\
+WVBCRE h         Create wave from wave builder\n\
+WVBDEL h         Close wave builder\n\
+WVBNEW           Open wave builder\n\
 WVBSY            Check if wave busy\n\
 WVCHA            Transmit a chain of waves\n\
 WVCLR            Wave clear\n\
+WVCMP            Move waves together to join free space\n\
 WVCRE            Create wave from added pulses\n\
-WVDEL wid        Delete waves w and higher\n\
+WVDEL wid        Delete wave\n\
 WVGO             Wave transmit (DEPRECATED)\n\
 WVGOR            Wave transmit repeatedly (DEPRECATED)\n\
 WVHLT            Wave stop\n\
+WVLKP            Find existing wave with added pulses\n\
 WVNEW            Start a new empty wave\n\
+WVSAD triplets   Wave stream add pulses\n\
 WVSC 0,1,2       Wave get DMA control block stats\n\
+WVSCH 0,1        Wave get cache hits or misses\n\
+WVSCL            Wave stream close\n\
+WVSEV event      Wave stream set refill event\n\
 WVSM 0,1,2       Wave get micros stats\n\
+WVSOP segs cbs threshold | Wave stream open\n\
 WVSP 0,1,2       Wave get pulses stats\n\
+WVSPC            Wave get free DMA control blocks and OOL\n\
+WVSST 0,1        Wave stream get free segments or underruns\n\
 WVTAT            Returns the current transmitting wave\n\
 WVTX wid         Transmit wave as one-shot\n\
 WVTXM wid wmde   Transmit wave using mode\n\
@@ -567,20 +614,107 @@ static errInfo_t errInfo[]=
    {PI_CMD_INTERRUPTED  , "command interrupted, Python"},
    {PI_NOT_ON_BCM2711   , "not available on BCM2711"},
    {PI_ONLY_ON_BCM2711  , "only available on BCM2711"},
+   {PI_BAD_NOTIFY_SIZE  , "bad notification shared memory size"},
+   {PI_BAD_BATCH        , "bad batched command"},
+   {PI_BAD_TIMER_MICROS , "timer micros not 100-60000000"},
+   {PI_BAD_SOCKET_PATH  , "socket path empty or too long"},
+   {PI_BAD_SHM_SLOTS    , "bad command shared memory slots"},
+   {PI_BAD_SHM_CMD      , "command not allowed in shared memory"},
+   {PI_WAVE_TX_BUSY     , "wave being transmitted"},
+   {PI_WAVE_NOT_CACHED  , "no waveform with the same pulses"},
+   {PI_WAVE_STREAM_OPEN , "wave stream open"},
+   {PI_NO_WAVE_STREAM   , "no wave stream open"},
+   {PI_BAD_WAVE_STREAM  , "bad wave stream segments, CBs, or threshold"},
+   {PI_BAD_SOCKET_WORKERS, "socket workers not 1-64"},
+   {PI_NO_ALERTS        , "alerts are disabled"},
 
 };
 
 static char * fmtMdeStr="RW540123";
 static char * fmtPudStr="ODU";
 
-static int cmdMatch(char *str)
+/*
+   Command names are at most 8 characters so the upper cased name,
+   packed into a uint64_t, is a unique key.  cmdMatch looks the key
+   up in an open addressed hash of cmdInfo built on first use.
+*/
+
+#define CMD_HASH_BITS 9
+#define CMD_HASH_SIZE (1<<CMD_HASH_BITS) /* over twice cmdInfo entries */
+
+static uint64_t cmdHashKey[CMD_HASH_SIZE];
+static int16_t  cmdHashIdx[CMD_HASH_SIZE]; /* cmdInfo index + 1 */
+static pthread_once_t cmdHashOnce = PTHREAD_ONCE_INIT;
+
+static uint64_t cmdKey(char *str)
 {
+   uint64_t key;
    int i;
 
+   key = 0;
+
+   for (i=0; str[i]; i++)
+   {
+      if (i == 8) return 0; /* longer than any command */
+
+      key = (key << 8) | (uint8_t)toupper((uint8_t)str[i]);
+   }
+
+   return key;
+}
+
+static unsigned cmdSlot(uint64_t key)
+{
+   return (key * 0x9E3779B97F4A7C15ULL) >> (64 - CMD_HASH_BITS);
+}
+
+static void cmdHashInit(void)
+{
+   int i;
+   unsigned slot;
+   uint64_t key;
+
    for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
    {
-      if (strcasecmp(str, cmdInfo[i].name) == 0) return i;
+      key = cmdKey(cmdInfo[i].name);
+
+      slot = cmdSlot(key);
+
+      /* the first entry for a name wins, as with a linear search */
+
+      while (cmdHashIdx[slot] && (cmdHashKey[slot] != key))
+         slot = (slot + 1) & (CMD_HASH_SIZE - 1);
+
+      if (!cmdHashIdx[slot])
+      {
+         cmdHashKey[slot] = key;
+         cmdHashIdx[slot] = i + 1;
+      }
+   }
+}
+
+static int cmdMatch(char *str)
+{
+   unsigned slot;
+   uint64_t key;
+
+   /* a lookup made while another thread builds the hash waits for it */
+
+   pthread_once(&cmdHashOnce, cmdHashInit);
+
+   key = cmdKey(str);
+
+   if (!key) return CMD_UNKNOWN_CMD;
+
+   slot = cmdSlot(key);
+
+   while (cmdHashIdx[slot])
+   {
+      if (cmdHashKey[slot] == key) return cmdHashIdx[slot] - 1;
+
+      slot = (slot + 1) & (CMD_HASH_SIZE - 1);
    }
+
    return CMD_UNKNOWN_CMD;
 }
 
@@ -631,6 +765,35 @@ char *cmdStr(void)
    return intCmdStr;
 }
 
+char *cmdName(int cmd)
+{
+   int i;
+   char *name;
+
+   /* the last entry is the full name where there is an abbreviation */
+
+   name = NULL;
+
+   for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
+   {
+      if (cmdInfo[i].cmd == cmd) name = cmdInfo[i].name;
+   }
+
+   return name;
+}
+
+int cmdVerifyType(int cmd)
+{
+   int i;
+
+   for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
+   {
+      if (cmdInfo[i].cmd == cmd) return cmdInfo[i].vt;
+   }
+
+   return -1;
+}
+
 int cmdParse(
    char *buf, uintptr_t *p, unsigned ext_len, char *ext, cmdCtlParse_t *ctl)
 {
@@ -668,10 +831,11 @@ int cmdParse(
 
    switch (cmdInfo[idx].vt)
    {
-      case 101: /* BR1  BR2  CGI  H  HELP  HWVER
+      case 101: /* BR1  BR2  CGI  GSNAP  H  HELP  HWVER
                    DCRA  HALT  INRA  NO
-                   PIGPV  POPA  PUSHA  RET  T  TICK  WVBSY  WVCLR
-                   WVCRE  WVGO  WVGOR  WVHLT  WVNEW
+                   PIGPV  POPA  PUSHA  RET  T  TICK  WVBNEW  WVBSY
+                   WVCLR  WVCMP  WVCRE  WVGO  WVGOR  WVHLT  WVLKP  WVNEW
+                   WVSCL  WVSPC
 
                    No parameters, always valid.
                 */
@@ -692,9 +856,11 @@ int cmdParse(
          break;
 
       case 112: /* BI2CC FC  GDC  GPW  I2CC  I2CRB
-                   MG  MICS  MILS  MODEG  NC  NP  PADG PFG  PRG
-                   PROCD  PROCP  PROCS  PRRG  R  READ  SLRC  SPIC
-                   WVCAP WVDEL  WVSC  WVSM  WVSP  WVTX  WVTXR  BSPIC
+                   MG  MICS  MILS  MODEG  NC  NOS  NP  PADG PFG  PRG
+                   PROCD  PROCP  PROCS  PRRG  R  READ  SHMC  SHMO  SLRC
+                   SPIC  STATS
+                   WVBCRE  WVBDEL  WVCAP WVDEL  WVSC  WVSCH  WVSEV  WVSM
+                   WVSP  WVSST  WVTX  WVTXR  BSPIC
 
                    One positive parameter.
                 */
@@ -894,7 +1060,7 @@ int cmdParse(
          break;
 
       case 131: /* BI2CO  HP  I2CO  I2CPC  I2CRI  I2CWB  I2CWW
-                   SLRO  SPIO  TRIG
+                   SLRO  SPIO  TRIG  WVSOP
 
                    Three positive parameters.
                 */
@@ -1015,7 +1181,7 @@ int cmdParse(
 
          break;
 
-      case 192: /* WVAG
+      case 192: /* WVAG  WVSAD
 
                    One or more triplets (gpios on, gpios off, delay),
                    any value.
@@ -1246,6 +1412,144 @@ int cmdParse(
 
          break;
 
+      case 198: /* GAPPLY
+
+                   One or more groups of nine parameters, any value.
+                */
+
+         pars = 0;
+         p32 = (int32_t *)ext;
+
+         while (pars < CMD_MAX_PARAM)
+         {
+            ctl->eaten += getNum(buf+ctl->eaten, &tp1, &to1);
+            if (to1 == CMD_NUMERIC)
+            {
+               pars++;
+               *p32++ = tp1;
+            }
+            else break;
+         }
+
+         p[3] = pars * 4;
+
+         if (pars && ((pars % 9) == 0)) valid = 1;
+
+         break;
+
+      case 199: /* PWMM  SERVOM
+
+                   One or more pairs (gpio, value), any value.
+                */
+
+         pars = 0;
+         p32 = (int32_t *)ext;
+
+         while (pars < CMD_MAX_PARAM)
+         {
+            ctl->eaten += getNum(buf+ctl->eaten, &tp1, &to1);
+            if (to1 == CMD_NUMERIC)
+            {
+               pars++;
+               *p32++ = tp1;
+            }
+            else break;
+         }
+
+         p[3] = pars * 4;
+
+         if (pars && ((pars % 2) == 0)) valid = 1;
+
+         break;
+
+      case 200: /* WVBAG
+
+                   Handle followed by one or more triplets (gpios on,
+                   gpios off, delay), any value.
+                */
+         ctl->eaten += getNum(buf+ctl->eaten, &p[1], &ctl->opt[1]);
+
+         if ((ctl->opt[1] == CMD_NUMERIC) && ((int)p[1] >= 0))
+         {
+            pars = 0;
+            p32 = (int32_t *)ext;
+
+            while (pars < CMD_MAX_PARAM)
+            {
+               ctl->eaten += getNum(buf+ctl->eaten, &tp1, &to1);
+               if (to1 == CMD_NUMERIC)
+               {
+                  pars++;
+                  *p32++ = tp1;
+               }
+               else break;
+            }
+
+            p[3] = pars * 4;
+
+            if (pars && ((pars % 3) == 0)) valid = 1;
+         }
+
+         break;
+
+      case 201: /* WVBAS
+
+                   handle gpio baud databits stophalfbits offset char...
+
+                   p1 handle
+                   p2 gpio
+                   p3 len + 16
+                   ---------
+                   uint32_t baud
+                   uint32_t databits
+                   uint32_t stophalfbits
+                   uint32_t offset
+                   uint8_t[len]
+                */
+         ctl->eaten += getNum(buf+ctl->eaten, &p[1], &ctl->opt[1]);
+         ctl->eaten += getNum(buf+ctl->eaten, &p[2], &ctl->opt[2]);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp1, &to1);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp2, &to2);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp3, &to3);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp4, &to4);
+
+         if ((ctl->opt[1] == CMD_NUMERIC) && ((int)p[1] >= 0) &&
+             (ctl->opt[2] == CMD_NUMERIC) && ((int)p[2] >= 0) &&
+             (to1 == CMD_NUMERIC) && ((int)tp1 > 0) &&
+             (to2 == CMD_NUMERIC) &&
+             (to3 == CMD_NUMERIC) &&
+             (to4 == CMD_NUMERIC))
+         {
+            pars = 0;
+
+            memcpy(ext, &tp1, 4);
+            memcpy(ext+4, &tp2, 4);
+            memcpy(ext+8, &tp3, 4);
+            memcpy(ext+12, &tp4, 4);
+            p8 = ext + 16;
+            while (pars < CMD_MAX_PARAM)
+            {
+               eaten = getNum(buf+ctl->eaten, &tp1, &to1);
+               if (to1 == CMD_NUMERIC)
+               {
+                  if (((int)tp1>=0) && ((int)tp1<=255))
+                  {
+                     *p8++ = tp1;
+                     pars++;
+                     ctl->eaten += eaten;
+                  }
+                  else break; /* invalid number, end of command */
+               }
+               else break;
+            }
+
+            p[3] = pars + 16;
+
+            if (pars > 0) valid = 1;
+         }
+
+         break;
+
 
    }
 
@@ -1256,6 +1560,13 @@ char * cmdErrStr(int error)
 {
    int i;
 
+   /* errInfo is in error order, -1 first, check there before searching */
+
+   i = -1 - error;
+
+   if ((i >= 0) && (i < (sizeof(errInfo)/sizeof(errInfo_t))) &&
+       (errInfo[i].error == error)) return errInfo[i].str;
+
    for (i=0; i<(sizeof(errInfo)/sizeof(errInfo_t)); i++)
    {
       if (errInfo[i].error == error) return errInfo[i].str;
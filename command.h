@@ -120,5 +120,9 @@ char *cmdErrStr(int error);
 
 char *cmdStr(void);
 
+int cmdVerifyType(int cmd);
+
+char *cmdName(int cmd);
+
 #endif
 
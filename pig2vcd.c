@@ -97,6 +97,10 @@ int main(int argc, char * argv[])
 
    while ((r=read(STDIN_FILENO, &report, RS)) == RS)
    {
+      /* an overflow report holds the number dropped, not levels */
+
+      if (report.flags & PI_NTFY_FLAGS_OVFL) continue;
+
       if (report.level != lastLevel)
       {
          printf("#%u\n", report.tick - t0);
@@ -50,13 +50,21 @@ For more information, please refer to <http://unlicense.org/>
 #include <sys/ioctl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/sysmacros.h>
+#include <sys/prctl.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
@@ -751,6 +759,12 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define NUM_WAVE_OOL (DMAO_PAGES * OOL_PER_OPAGE)
 #define NUM_WAVE_CBS (DMAO_PAGES * CBS_PER_OPAGE)
 
+#define WAVE_BOT_CB  (PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE)
+#define WAVE_BOT_OOL (PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE)
+
+/* a free range either side of each wave */
+#define WAVE_FREE_RANGES (PI_MAX_WAVES + 1)
+
 #define TICKSLOTS 50
 
 #define PI_I2C_CLOSED   0
@@ -776,6 +790,19 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define PI_NOTIFY_RUNNING  4
 #define PI_NOTIFY_PAUSED   5
 
+#define PI_WAVE_BUILDER_CLOSED   0
+#define PI_WAVE_BUILDER_RESERVED 1
+#define PI_WAVE_BUILDER_OPENED   2
+
+#define PI_CMD_SHM_CLOSED   0
+#define PI_CMD_SHM_RESERVED 1
+#define PI_CMD_SHM_OPENED   2
+#define PI_CMD_SHM_CLOSING  3
+
+#define CMD_SHM_CMDS    256
+#define CMD_SHM_SPIN_NS 50000
+#define CMD_SHM_WAIT_NS 50000000
+
 #define PI_WFRX_NONE     0
 #define PI_WFRX_SERIAL   1
 #define PI_WFRX_I2C_SDA  2
@@ -792,6 +819,13 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define MAX_REPORT 250
 #define MAX_SAMPLE 4000
 
+#define ALERT_RING_SLOTS 128 /* must be a power of 2 */
+
+#define NOTIFY_RING_SIZE 2048 /* reports per handle, must be a power of 2 */
+
+#define SOCK_IN_SIZE  256 /* initial connection input buffer */
+#define SOCK_MAX_READS 16 /* reads per connection before yielding */
+
 #define DEFAULT_PWM_IDX 5
 
 #define MAX_EMITS (PIPE_BUF / sizeof(gpioReport_t))
@@ -866,6 +900,55 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define PI_SCRIPT_STACK_SIZE 256
 
+/* compiled script op codes, in pthScript dispatch table order */
+
+#define SCR_END    0
+#define SCR_CMD    1
+#define SCR_READ   2
+#define SCR_WRITE  3
+#define SCR_TICK   4
+#define SCR_ADD    5
+#define SCR_AND    6
+#define SCR_CALL   7
+#define SCR_CMP    8
+#define SCR_DCR    9
+#define SCR_DCRA  10
+#define SCR_DIV   11
+#define SCR_EVTWT 12
+#define SCR_HALT  13
+#define SCR_INR   14
+#define SCR_INRA  15
+#define SCR_JM    16
+#define SCR_JMP   17
+#define SCR_JNZ   18
+#define SCR_JP    19
+#define SCR_JZ    20
+#define SCR_LD    21
+#define SCR_LDA   22
+#define SCR_LDAB  23
+#define SCR_MLT   24
+#define SCR_MOD   25
+#define SCR_NOP   26
+#define SCR_OR    27
+#define SCR_POP   28
+#define SCR_POPA  29
+#define SCR_PUSH  30
+#define SCR_PUSHA 31
+#define SCR_RET   32
+#define SCR_RL    33
+#define SCR_RLA   34
+#define SCR_RR    35
+#define SCR_RRA   36
+#define SCR_STA   37
+#define SCR_STAB  38
+#define SCR_SUB   39
+#define SCR_SYS   40
+#define SCR_WAIT  41
+#define SCR_X     42
+#define SCR_XA    43
+#define SCR_XOR   44
+#define SCR_OPS   45
+
 #define PI_SPI_FLAGS_CHANNEL(x)    ((x&7)<<29)
 
 #define PI_SPI_FLAGS_GET_CHANNEL(x) (((x)>>29)&7)
@@ -893,6 +976,14 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define PI_MAX_PATH 512
 
+#define SIM_HARDWARE_REV   0xa02082 /* Pi3B */
+#define SIM_DRAM_BUS       0x80000000
+#define SIM_DMA_CHANNELS   15
+#define SIM_CBS_PER_PASS   64
+#define SIM_RESYNC_NANOS   10000000
+#define SIM_SLEEP_NANOS    20000
+#define SIM_STEP_NANOS     1000
+
 /* typedef ------------------------------------------------------- */
 
 typedef void (*callbk_t) ();
@@ -923,7 +1014,7 @@ typedef struct
 typedef struct
 {
    uint8_t  is;
-   uint8_t  pad;
+   uint8_t  pud;   /* last set, PI_PUD_UNKNOWN if not set */
    uint16_t width;
    uint16_t range; /* dutycycles specified by 0 .. range */
    uint16_t freqIdx;
@@ -931,6 +1022,21 @@ typedef struct
    uint16_t deferRng;
 } gpioInfo_t;
 
+/*
+PWM and servo schedule changes collected by gpioPWMMulti and
+gpioServoMulti, a bit per GPIO for each gpioOff and gpioOn slot.
+*/
+
+typedef struct
+{
+   uint32_t offSet[SUPERLEVEL+1];
+   uint32_t offClr[SUPERLEVEL+1];
+   uint32_t onSet [SUPERCYCLE];
+   uint32_t onClr [SUPERCYCLE];
+   uint32_t gpioClr;  /* PWM GPIO to switch off once written */
+   uint32_t servoOff; /* servo GPIO whose last pulse must complete */
+} pwmBatch_t;
+
 typedef struct
 {
    callbk_t func;
@@ -1001,10 +1107,27 @@ typedef struct
    void *userdata;
    unsigned id;
    unsigned running;
-   unsigned millis;
-   pthread_t pthId;
+   int heapPos;       /* position in timerHeap, -1 if not scheduled */
+   uint64_t period;   /* nanoseconds */
+   uint64_t due;      /* next deadline, CLOCK_MONOTONIC nanoseconds */
+   uint32_t calls;
+   uint32_t missed;   /* periods skipped after running late */
+   uint32_t lateMin;  /* callback lateness, nanoseconds */
+   uint32_t lateMax;
+   uint32_t lateLast;
+   uint64_t lateSum;
 } gpioTimer_t;
 
+typedef struct
+{
+   uint16_t op;
+   int k1;            /* numeric operands */
+   int k2;
+   int *v1;           /* resolved operands, a var, par, or k1/k2 */
+   int *v2;
+   cmdInstr_t *instr; /* source instruction */
+} scrOp_t;
+
 typedef struct
 {
    unsigned id;
@@ -1018,6 +1141,7 @@ typedef struct
    pthread_mutex_t pthMutex;
    pthread_cond_t pthCond;
    cmdScript_t script;
+   scrOp_t *code;
 } gpioScript_t;
 
 
@@ -1037,8 +1161,49 @@ typedef struct
    int      fd;
    int      pipe;
    int      max_emits;
+   gpioReport_t *ring;   /* NOTIFY_RING_SIZE reports */
+   uint32_t ringHead;    /* only written by the dispatch thread */
+   uint32_t ringTail;    /* only written by the notify writer thread */
+   unsigned ringPartial; /* bytes of the tail report already written */
+   uint32_t dropped;     /* reports dropped since the last overflow mark */
+   uint32_t droppedTick;
+   gpioNotifyShm_t *shm; /* set if reports go to shared memory */
 } gpioNotify_t;
 
+typedef struct
+{
+   uint16_t state;
+   int      fd;          /* owning socket, -1 if none */
+   volatile int stop;
+   int      detached;    /* the thread unmaps the ring when it stops */
+   size_t   len;
+   gpioCommandShm_t *shm;
+   pthread_t thread;
+} cmdShmInfo_t;
+
+typedef struct
+{
+   gpioReport_t *report;
+   uint32_t mask;
+   uint32_t *head;
+   uint32_t *tail;
+} notifyRing_t;
+
+typedef struct sockConn_s
+{
+   int   fd;
+   char *in;       /* received bytes not yet run as commands */
+   int   inLen;
+   int   inSize;
+   char *out;      /* response bytes the socket would not take */
+   int   outPos;
+   int   outLen;
+   int   outSize;
+   int   busy;     /* a helper thread is running its first command */
+   struct sockConn_s *prev;
+   struct sockConn_s *next;
+} sockConn_t;
+
 typedef struct
 {
    uint16_t state;
@@ -1086,8 +1251,34 @@ typedef struct
    uint32_t goodPipeWrite;
    uint32_t shortPipeWrite;
    uint32_t wouldBlockPipeWrite;
+   uint32_t alertRingFull;
+   uint32_t alertRingDropped;
+   uint32_t alertRingMaxUsed;
+   uint32_t notifyDropped;
+   uint64_t startNanos;
+   gpioHistogram_t alertPeriod;
+   gpioHistogram_t alertSamples;
+   gpioHistogram_t emit;
+   gpioHistogram_t notifyLatency;
+   gpioHistogram_t command;
+   gpioHistogram_t callback[PI_STATS_GPIOS];
+   uint32_t commandCalls[PI_STATS_COMMANDS];
+   uint32_t commandMax[PI_STATS_COMMANDS];
 } gpioStats_t;
 
+/* One alert tick (or MAX_REPORT chunk of one) of compacted samples
+   passed from the sampling thread to the dispatch thread. */
+
+typedef struct
+{
+   int          numSamples;
+   int          tickEnd;
+   uint32_t     changedBits;
+   uint32_t     eTick;
+   uint32_t     level;
+   gpioSample_t sample[MAX_REPORT];
+} alertBlock_t;
+
 typedef struct
 {
    unsigned bufferMilliseconds;
@@ -1096,6 +1287,7 @@ typedef struct
    unsigned DMAprimaryChannel;
    unsigned DMAsecondaryChannel;
    unsigned socketPort;
+   unsigned socketWorkers;
    unsigned ifFlags;
    unsigned memAllocMode;
    unsigned dbgLevel;
@@ -1118,8 +1310,63 @@ typedef struct
    uint32_t cbs;
    uint32_t highCbs;
    uint32_t maxCbs;
+   uint32_t cacheHits;
+   uint32_t cacheMisses;
 } wfStats_t;
 
+typedef struct
+{
+   uint16_t  state;
+   unsigned  numTrains;
+   unsigned  maxTrains;
+   unsigned  *train;     /* start of each train in pulses, one extra */
+   unsigned  numPulses;
+   unsigned  maxPulses;
+   rawWave_t *pulses;
+} waveBuilder_t;
+
+typedef struct
+{
+   int start;
+   int count;
+} waveRange_t;
+
+typedef struct
+{
+   int num;
+   waveRange_t range[WAVE_FREE_RANGES]; /* in address order */
+} waveFree_t;
+
+typedef struct
+{
+   unsigned  refs;       /* creates less deletes */
+   uint64_t  hash;
+   unsigned  numPulses;
+   rawWave_t *pulses;    /* copy of the pulses, NULL if not cached */
+} waveCache_t;
+
+typedef struct
+{
+   int       open;
+   int       running;    /* the stream started the DMA */
+   unsigned  segments;
+   unsigned  segmentCBs; /* also the OOL in each segment */
+   int       botCB;
+   int       botOOL;
+   unsigned  head;       /* next segment to fill */
+   unsigned  tail;       /* oldest queued segment */
+   unsigned  queued;     /* segments queued and not yet played */
+   unsigned  threshold;  /* free segments which ask for a refill */
+   int       signalled;  /* refill asked for since free fell below */
+   unsigned  underruns;
+   unsigned  reported;   /* underruns already reported */
+   unsigned  event;
+   gpioWaveStreamFunc_t func;
+   void      *userdata;
+   rawWave_t *pulses;    /* one segment's pulses */
+   int       owner;      /* socket which opened the stream, -1 if none */
+} waveStream_t;
+
 typedef struct
 {
    char    *buf;
@@ -1214,6 +1461,14 @@ typedef struct
    unsigned  size;          /* in bytes */
 } DMAMem_t;
 
+typedef struct
+{
+   int      active;
+   int      pending;  /* paced CB done once deadline passes */
+   uint32_t cbAdr;    /* CB the deadline applies to */
+   uint64_t deadline; /* nanoseconds */
+} simDMA_t;
+
 /* global -------------------------------------------------------- */
 
 /* initialise once then preserve */
@@ -1240,8 +1495,16 @@ static uint32_t sockNetAddr[MAX_CONNECT_ADDRESSES];
 
 static int numSockNetAddr = 0;
 
+static char sockPath[PI_MAX_SOCKET_PATH+1] = PI_DEFAULT_SOCKET_PATH;
+
 static uint32_t reportedLevel = 0;
 
+static alertBlock_t alertRing[ALERT_RING_SLOTS];
+static uint32_t alertRingHead = 0; /* only written by the alert thread */
+static uint32_t alertRingTail = 0; /* only written by the dispatch thread */
+static sem_t alertRingSem;
+static sem_t notifyWriteSem;
+
 static int waveClockInited = 0;
 static int PWMClockInited = 0;
 
@@ -1263,20 +1526,32 @@ static wfStats_t wfStats=
 {
    0, 0, PI_WAVE_MAX_MICROS,
    0, 0, PI_WAVE_MAX_PULSES,
-   0, 0, (DMAO_PAGES * CBS_PER_OPAGE)
+   0, 0, (DMAO_PAGES * CBS_PER_OPAGE),
+   0, 0
 };
 
 static rawWaveInfo_t waveInfo[PI_MAX_WAVES];
 
+static waveCache_t waveCache[PI_MAX_WAVES];
+
+static waveBuilder_t waveBuilder[PI_WAVE_BUILDERS];
+
+static pthread_mutex_t waveAllocMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static wfRx_t wfRx[PI_MAX_USER_GPIO+1];
 
-static int waveOutBotCB  = PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE;
-static int waveOutBotOOL = PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE;
-static int waveOutTopOOL = NUM_WAVE_OOL;
+static waveFree_t waveFreeCB =
+   {1, {{WAVE_BOT_CB, NUM_WAVE_CBS - WAVE_BOT_CB}}};
+static waveFree_t waveFreeOOL =
+   {1, {{WAVE_BOT_OOL, NUM_WAVE_OOL - WAVE_BOT_OOL}}};
 static int waveOutCount = 0;
 
 static uint32_t *waveEndPtr = NULL;
 
+static waveStream_t waveStream;
+
+static pthread_mutex_t waveStreamMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static volatile uint32_t alertBits   = 0;
 static volatile uint32_t monitorBits = 0;
 static volatile uint32_t notifyBits  = 0;
@@ -1287,11 +1562,23 @@ static volatile uint32_t wdogBits    = 0;
 
 static volatile uint32_t scriptEventBits  = 0;
 
+/* gpio/event to notify handle and script bit maps for alertEmit */
+
+static volatile uint32_t notifyOpenSlots = 0;
+static volatile uint32_t notifyGpioSlots  [PI_MAX_USER_GPIO+1];
+static volatile uint32_t notifyEventSlots [PI_MAX_EVENT+1];
+static volatile uint32_t scriptGpioSlots  [PI_MAX_USER_GPIO+1];
+static volatile uint32_t scriptEventSlots [PI_MAX_EVENT+1];
+
 static volatile int runState = PI_STARTING;
 
 static int pthAlertRunning  = PI_THREAD_NONE;
+static int pthDispatchRunning = PI_THREAD_NONE;
+static int pthNotifyRunning = PI_THREAD_NONE;
 static int pthFifoRunning   = PI_THREAD_NONE;
 static int pthSocketRunning = PI_THREAD_NONE;
+static int pthSimRunning    = PI_THREAD_NONE;
+static int pthTimerRunning  = PI_THREAD_NONE;
 
 static gpioAlert_t      gpioAlert  [PI_MAX_USER_GPIO+1];
 
@@ -1303,8 +1590,17 @@ static gpioGetSamples_t gpioGetSamples;
 
 static gpioInfo_t       gpioInfo   [PI_MAX_GPIO+1];
 
+static pwmBatch_t       pwmBatch;
+static pthread_mutex_t  pwmBatchMutex = PTHREAD_MUTEX_INITIALIZER;
+
 static gpioNotify_t     gpioNotify [PI_NOTIFY_SLOTS];
 
+static cmdShmInfo_t     cmdShm     [PI_COMMAND_SHM_SLOTS];
+static uint8_t          cmdShmValid[CMD_SHM_CMDS];
+static pthread_mutex_t  cmdShmLock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   cmdShmCond    = PTHREAD_COND_INITIALIZER;
+static int              cmdShmClosing; /* detached rings not yet released */
+
 static fileInfo_t       fileInfo   [PI_FILE_SLOTS];
 static i2cInfo_t        i2cInfo    [PI_I2C_SLOTS];
 static serInfo_t        serInfo    [PI_SER_SLOTS];
@@ -1314,7 +1610,14 @@ static gpioScript_t     gpioScript [PI_MAX_SCRIPTS];
 
 static gpioSignal_t     gpioSignal [PI_MAX_SIGNUM+1];
 
-static gpioTimer_t      gpioTimer  [PI_MAX_TIMER+1];
+static gpioTimer_t      gpioTimer  [PI_TIMER_SLOTS];
+
+static int timerHeap[PI_TIMER_SLOTS]; /* scheduled timers, earliest first */
+static int timerHeapLen;
+static int timerActive = -1; /* timer whose callback is running */
+static pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timerCond; /* CLOCK_MONOTONIC, set up with the thread */
+static pthread_cond_t timerDone = PTHREAD_COND_INITIALIZER;
 
 static int pwmFreq[PWM_FREQS];
 
@@ -1328,6 +1631,9 @@ static FILE * outFifo = NULL;
 static int fdLock       = -1;
 static int fdMem        = -1;
 static int fdSock       = -1;
+static int fdUnix       = -1;
+static int fdEpoll      = -1;
+static int fdSockStop   = -1;
 static int fdPmap       = -1;
 static int fdMbox       = -1;
 
@@ -1369,11 +1675,12 @@ static volatile gpioCfg_t gpioCfg =
    PI_DEFAULT_DMA_NOT_SET, /* primary DMA */
    PI_DEFAULT_DMA_NOT_SET, /* secondary DMA */
    PI_DEFAULT_SOCKET_PORT,
+   PI_DEFAULT_SOCKET_WORKERS,
    PI_DEFAULT_IF_FLAGS,
    PI_DEFAULT_MEM_ALLOC_MODE,
    0, /* dbgLevel */
    0, /* alertFreq */
-   0, /* internals */
+   PI_DEFAULT_CFG_INTERNALS, /* internals */
 };
 
 /* no initialisation required */
@@ -1382,8 +1689,20 @@ static unsigned bufferBlocks; /* number of blocks in buffer */
 static unsigned bufferCycles; /* number of cycles */
 
 static pthread_t pthAlert;
+static pthread_t pthDispatch;
+static pthread_t pthNotify;
 static pthread_t pthFifo;
 static pthread_t pthSocket;
+static pthread_t pthSockWorker[PI_MAX_SOCKET_WORKERS];
+
+static int sockWorkers; /* socket worker threads started */
+static int sockStopping; /* the workers are being stopped */
+static sockConn_t *sockConns; /* open socket connections */
+static pthread_mutex_t sockConnMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t pthSim;
+static pthread_t pthTimer;
+
+static unsigned simDMAPages; /* DMA pages visible to the simulator */
 
 static uint32_t spi_dummy;
 
@@ -1515,6 +1834,26 @@ int gpioWaveTxStart(unsigned wave_mode); /* deprecated */
 
 static void closeOrphanedNotifications(int slot, int fd);
 
+static void closeOrphanedCommandShm(int fd);
+
+static int  intCommandOpenShm(int owner, unsigned slots);
+static int  intNotifyOpenShm(int owner, unsigned reports);
+static int  intWaveStreamOpen(
+   int owner, unsigned segments, unsigned segmentCBs, unsigned threshold);
+static void closeOrphanedWaveStream(int fd);
+
+static void simGpioUpdate(void);
+
+static uint64_t timerNanos(void);
+
+static void statsRecord(volatile gpioHistogram_t *h, uint32_t value);
+
+static void statsClear(void);
+
+static void waveCacheRelease(void);
+static void waveStreamCheck(void);
+static void waveStreamRelease(void);
+
 
 /* ======================================================================= */
 
@@ -1655,10 +1994,27 @@ static void myGpioSetMode(unsigned gpio, unsigned mode)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+static void myGpioOut(unsigned reg, uint32_t bits)
+{
+   /* the simulator folds GPSET/GPCLR into GPLEV from another thread,
+      writes made before a fold must accumulate rather than replace
+   */
+
+   if (pthSimRunning)
+      __atomic_or_fetch((uint32_t *)&gpioReg[reg], bits, __ATOMIC_SEQ_CST);
+   else
+      gpioReg[reg] = bits;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 static int myGpioRead(unsigned gpio)
 {
+   if (pthSimRunning) simGpioUpdate();
+
    if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
    else                                         return PI_OFF;
 }
@@ -1668,8 +2024,10 @@ static int myGpioRead(unsigned gpio)
 
 static void myGpioWrite(unsigned gpio, unsigned level)
 {
-   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   if (level == PI_OFF) myGpioOut(GPCLR0 + BANK, BIT);
+   else                 myGpioOut(GPSET0 + BANK, BIT);
+
+   if (pthSimRunning) simGpioUpdate();
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1810,6 +2168,38 @@ static int myPermit(unsigned gpio)
    return 1; /* will fail for bad gpio number */
 }
 
+static int myMaskPulses(gpioPulse_t *pulse, unsigned numPulses)
+{
+   /* mask off any non permitted gpios, returns 1 if any were masked */
+
+   uint32_t mask, bits;
+   int i, masked;
+
+   mask = gpioMask;
+   masked = 0;
+
+   for (i=0; i<numPulses; i++)
+   {
+      bits = pulse[i].gpioOn & mask;
+      if (bits != pulse[i].gpioOn)
+      {
+         pulse[i].gpioOn = bits;
+         masked = 1;
+      }
+
+      bits = pulse[i].gpioOff & mask;
+      if (bits != pulse[i].gpioOff)
+      {
+         pulse[i].gpioOff = bits;
+         masked = 1;
+      }
+      DBG(DBG_SCRIPT, "on=%X off=%X delay=%d",
+         pulse[i].gpioOn, pulse[i].gpioOff, pulse[i].usDelay);
+   }
+
+   return masked;
+}
+
 static void flushMemory(void)
 {
    static int val = 0;
@@ -1869,8 +2259,13 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
    gpioPulse_t *pulse;
    bsc_xfer_t xfer;
    int masked;
+   uint64_t started;
+   uint32_t micros;
+
    res = 0;
 
+   started = timerNanos();
+
    switch (p[0])
    {
       case PI_CMD_BC1:
@@ -2063,10 +2458,44 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_FW: res = fileWrite(p[1], buf, p[3]); break;
 
+      case PI_CMD_GAPPLY:
+         if (p[3] % sizeof(gpioApply_t))
+         {
+            res = PI_BAD_PARAM;
+            break;
+         }
+
+         j = p[3] / sizeof(gpioApply_t);
+
+         for (i=0; i<j; i++)
+         {
+            if (!myPermit(((gpioApply_t *)buf)[i].gpio))
+            {
+               DBG(DBG_USER, "gpioApply: gpio %d, no permission to update",
+                  ((gpioApply_t *)buf)[i].gpio);
+               res = PI_NOT_PERMITTED;
+               break;
+            }
+         }
+
+         if (!res) res = gpioApply(j, (gpioApply_t *)buf);
+         break;
+
       case PI_CMD_GDC: res = gpioGetPWMdutycycle(p[1]); break;
 
       case PI_CMD_GPW: res = gpioGetServoPulsewidth(p[1]); break;
 
+      case PI_CMD_GSNAP:
+         /* a batch may have less room than a single command */
+         if (bufSize < ((PI_MAX_GPIO+1) * sizeof(gpioStatus_t)))
+         {
+            res = PI_BAD_PARAM;
+            break;
+         }
+         res = gpioSnapshot((gpioStatus_t *)buf);
+         if (res > 0) res *= sizeof(gpioStatus_t);
+         break;
+
       case PI_CMD_HC:
          /* special case to allow password in upper byte */
          if (myPermit(p[1]&0xFFFFFF)) res = gpioHardwareClock(p[1], p[2]);
@@ -2199,6 +2628,8 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_NO: res = gpioNotifyOpen();  break;
 
+      case PI_CMD_NOS: res = gpioNotifyOpenShm(p[1]);  break;
+
       case PI_CMD_NP: res = gpioNotifyPause(p[1]); break;
 
       case PI_CMD_PADG: res = gpioGetPad(p[1]); break;
@@ -2272,6 +2703,29 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          }
          break;
 
+      case PI_CMD_PWMM:
+         if (p[3] % sizeof(gpioWidth_t))
+         {
+            res = PI_BAD_PARAM;
+            break;
+         }
+
+         j = p[3] / sizeof(gpioWidth_t);
+
+         for (i=0; i<j; i++)
+         {
+            if (!myPermit(((gpioWidth_t *)buf)[i].gpio))
+            {
+               DBG(DBG_USER, "gpioPWMMulti: gpio %d, no permission to update",
+                  ((gpioWidth_t *)buf)[i].gpio);
+               res = PI_NOT_PERMITTED;
+               break;
+            }
+         }
+
+         if (!res) res = gpioPWMMulti(j, (gpioWidth_t *)buf);
+         break;
+
       case PI_CMD_READ: res = gpioRead(p[1]); break;
 
       case PI_CMD_SERVO:
@@ -2284,12 +2738,49 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          }
          break;
 
+      case PI_CMD_SERVOM:
+         if (p[3] % sizeof(gpioWidth_t))
+         {
+            res = PI_BAD_PARAM;
+            break;
+         }
+
+         j = p[3] / sizeof(gpioWidth_t);
+
+         for (i=0; i<j; i++)
+         {
+            if (!myPermit(((gpioWidth_t *)buf)[i].gpio))
+            {
+               DBG(DBG_USER, "gpioServoMulti: gpio %d, no permission to update",
+                  ((gpioWidth_t *)buf)[i].gpio);
+               res = PI_NOT_PERMITTED;
+               break;
+            }
+         }
+
+         if (!res) res = gpioServoMulti(j, (gpioWidth_t *)buf);
+         break;
+
 
 
       case PI_CMD_SERRB: res = serReadByte(p[1]); break;
 
       case PI_CMD_SERWB: res = serWriteByte(p[1], p[2]); break;
 
+      case PI_CMD_SHMC: res = gpioCommandCloseShm(p[1]); break;
+
+      case PI_CMD_SHMO: res = gpioCommandOpenShm(p[1]); break;
+
+      case PI_CMD_STATS:
+         /* a batch may have less room than a single command */
+         if (bufSize < sizeof(gpioStatistics_t))
+         {
+            res = PI_BAD_PARAM;
+            break;
+         }
+         res = gpioStatistics((gpioStatistics_t *)buf, p[1]);
+         break;
+
       case PI_CMD_SERC: res = serClose(p[1]); break;
 
       case PI_CMD_SERDA: res = serDataAvailable(p[1]); break;
@@ -2379,29 +2870,10 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
          /* need to mask off any non permitted gpios */
 
-         mask = gpioMask;
          pulse = (gpioPulse_t *)buf;
          j = p[3]/sizeof(gpioPulse_t);
-         masked = 0;
-
-         for (i=0; i<j; i++)
-         {
-            tmp1 = pulse[i].gpioOn & mask;
-            if (tmp1 != pulse[i].gpioOn)
-            {
-               pulse[i].gpioOn = tmp1;
-               masked = 1;
-            }
 
-            tmp1 = pulse[i].gpioOff & mask;
-            if (tmp1 != pulse[i].gpioOff)
-            {
-               pulse[i].gpioOff = tmp1;
-               masked = 1;
-            }
-            DBG(DBG_SCRIPT, "on=%X off=%X delay=%d",
-               pulse[i].gpioOn, pulse[i].gpioOff, pulse[i].usDelay);
-         }
+         masked = myMaskPulses(pulse, j);
 
          res = gpioWaveAddGeneric(j, pulse);
 
@@ -2428,6 +2900,48 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          }
          break;
 
+      case PI_CMD_WVBAG:
+
+         /* need to mask off any non permitted gpios */
+
+         pulse = (gpioPulse_t *)buf;
+         j = p[3]/sizeof(gpioPulse_t);
+
+         masked = myMaskPulses(pulse, j);
+
+         res = gpioWaveBuilderAddGeneric(p[1], j, pulse);
+
+         /* report permission error unless another error occurred */
+         if (masked && (res >= 0)) res = PI_SOME_PERMITTED;
+
+         break;
+
+      case PI_CMD_WVBAS:
+         if (p[3] < 16) res = PI_BAD_PARAM;
+         else if (myPermit(p[2]))
+         {
+            memcpy(&tmp1, buf, 4);    /* baud */
+            memcpy(&tmp2, buf+4, 4);  /* databits */
+            memcpy(&tmp3, buf+8, 4);  /* stophalfbits */
+            memcpy(&tmp4, buf+12, 4); /* offset */
+            res = gpioWaveBuilderAddSerial
+               (p[1], p[2], tmp1, tmp2, tmp3, tmp4, p[3]-16, buf+16);
+         }
+         else
+         {
+            DBG(
+               DBG_USER,
+               "gpioWaveBuilderAddSerial: gpio %"PRIdPTR", no permission to update", p[2]);
+            res = PI_NOT_PERMITTED;
+         }
+         break;
+
+      case PI_CMD_WVBCRE: res = gpioWaveBuilderCreate(p[1]); break;
+
+      case PI_CMD_WVBDEL: res = gpioWaveBuilderClose(p[1]); break;
+
+      case PI_CMD_WVBNEW: res = gpioWaveBuilderOpen(); break;
+
       case PI_CMD_WVBSY: res = gpioWaveTxBusy(); break;
 
       case PI_CMD_WVCHA:
@@ -2438,6 +2952,8 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_WVCLR: res = gpioWaveClear(); break;
 
+      case PI_CMD_WVCMP: res = gpioWaveCompact(); break;
+
       case PI_CMD_WVCRE: res = gpioWaveCreate(); break;
 
       case PI_CMD_WVCAP:
@@ -2469,6 +2985,8 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_WVHLT: res = gpioWaveTxStop(); break;
 
+      case PI_CMD_WVLKP: res = gpioWaveLookup(); break;
+
       case PI_CMD_WVNEW: res = gpioWaveAddNew(); break;
 
       case PI_CMD_WVSC:
@@ -2501,6 +3019,50 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          }
          break;
 
+      case PI_CMD_WVSCH:
+         switch(p[1])
+         {
+            case 0: res = gpioWaveGetCacheHits();   break;
+            case 1: res = gpioWaveGetCacheMisses(); break;
+            default: res = PI_BAD_PARAM;
+         }
+         break;
+
+      case PI_CMD_WVSPC: res = gpioWaveGetSpace((gpioWaveSpace_t *)buf); break;
+
+      case PI_CMD_WVSAD:
+
+         /*
+            The count of pulses queued must reach the client, so rather
+            than queue masked pulses queue none.
+         */
+
+         pulse = (gpioPulse_t *)buf;
+         j = p[3]/sizeof(gpioPulse_t);
+
+         if (myMaskPulses(pulse, j)) res = PI_SOME_PERMITTED;
+         else res = gpioWaveStreamAdd(j, pulse);
+
+         break;
+
+      case PI_CMD_WVSCL: res = gpioWaveStreamClose(); break;
+
+      case PI_CMD_WVSEV: res = gpioWaveStreamSetEvent(p[1]); break;
+
+      case PI_CMD_WVSOP:
+         memcpy(&p[4], buf, 4);
+         res = gpioWaveStreamOpen(p[1], p[2], p[4]);
+         break;
+
+      case PI_CMD_WVSST:
+         switch(p[1])
+         {
+            case 0: res = gpioWaveStreamGetFree();      break;
+            case 1: res = gpioWaveStreamGetUnderruns(); break;
+            default: res = PI_BAD_PARAM;
+         }
+         break;
+
       case PI_CMD_WVTAT: res = gpioWaveTxAt(); break;
 
       case PI_CMD_WVTX:
@@ -2517,15 +3079,34 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          break;
    }
 
+   micros = (timerNanos() - started) / THOUSAND;
+
+   statsRecord(&gpioStats.command, micros);
+
+   if (p[0] < PI_STATS_COMMANDS)
+   {
+      gpioStats.commandCalls[p[0]]++;
+
+      if (micros > gpioStats.commandMax[p[0]])
+         gpioStats.commandMax[p[0]] = micros;
+   }
+
    return res;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void mySetGpioOff(unsigned gpio, int pos)
+static void mySetGpioOff(pwmBatch_t *batch, unsigned gpio, int pos)
 {
    int page, slot;
 
+   if (batch)
+   {
+      batch->offSet[pos] |= (1<<gpio);
+      batch->offClr[pos] &= ~(1<<gpio);
+      return;
+   }
+
    myOffPageSlot(pos, &page, &slot);
 
    dmaIVirt[page]->gpioOff[slot] |= (1<<gpio);
@@ -2533,10 +3114,17 @@ static void mySetGpioOff(unsigned gpio, int pos)
 
 /* ----------------------------------------------------------------------- */
 
-static void myClearGpioOff(unsigned gpio, int pos)
+static void myClearGpioOff(pwmBatch_t *batch, unsigned gpio, int pos)
 {
    int page, slot;
 
+   if (batch)
+   {
+      batch->offClr[pos] |= (1<<gpio);
+      batch->offSet[pos] &= ~(1<<gpio);
+      return;
+   }
+
    myOffPageSlot(pos, &page, &slot);
 
    dmaIVirt[page]->gpioOff[slot] &= ~(1<<gpio);
@@ -2544,10 +3132,17 @@ static void myClearGpioOff(unsigned gpio, int pos)
 
 /* ----------------------------------------------------------------------- */
 
-static void mySetGpioOn(unsigned gpio, int pos)
+static void mySetGpioOn(pwmBatch_t *batch, unsigned gpio, int pos)
 {
    int page, slot;
 
+   if (batch)
+   {
+      batch->onSet[pos] |= (1<<gpio);
+      batch->onClr[pos] &= ~(1<<gpio);
+      return;
+   }
+
    page = pos/ON_PER_IPAGE;
    slot = pos%ON_PER_IPAGE;
 
@@ -2556,10 +3151,17 @@ static void mySetGpioOn(unsigned gpio, int pos)
 
 /* ----------------------------------------------------------------------- */
 
-static void myClearGpioOn(unsigned gpio, int pos)
+static void myClearGpioOn(pwmBatch_t *batch, unsigned gpio, int pos)
 {
    int page, slot;
 
+   if (batch)
+   {
+      batch->onClr[pos] |= (1<<gpio);
+      batch->onSet[pos] &= ~(1<<gpio);
+      return;
+   }
+
    page = pos/ON_PER_IPAGE;
    slot = pos%ON_PER_IPAGE;
 
@@ -2568,7 +3170,8 @@ static void myClearGpioOn(unsigned gpio, int pos)
 
 /* ----------------------------------------------------------------------- */
 
-static void myGpioSetPwm(unsigned gpio, int oldVal, int newVal)
+static void myGpioSetPwm(
+   pwmBatch_t *batch, unsigned gpio, int oldVal, int newVal)
 {
    int switchGpioOff;
    int newOff, oldOff, realRange, cycles, i;
@@ -2593,7 +3196,7 @@ static void myGpioSetPwm(unsigned gpio, int oldVal, int newVal)
    {
       for (i=0; i<SUPERLEVEL; i+=deferRng)
       {
-         myClearGpioOff(gpio, i+deferOff);
+         myClearGpioOff(batch, gpio, i+deferOff);
       }
       gpioInfo[gpio].deferOff = 0;
    }
@@ -2604,13 +3207,14 @@ static void myGpioSetPwm(unsigned gpio, int oldVal, int newVal)
       {
          if (newOff != realRange)
          {
-            for (i=0; i<SUPERLEVEL; i+=realRange) mySetGpioOff(gpio, i+newOff);
+            for (i=0; i<SUPERLEVEL; i+=realRange)
+               mySetGpioOff(batch, gpio, i+newOff);
          }
 
          if (newOff > oldOff)
          {
             for (i=0; i<SUPERLEVEL; i+=realRange)
-               myClearGpioOff(gpio, i+oldOff);
+               myClearGpioOff(batch, gpio, i+oldOff);
          }
          else
          {
@@ -2622,37 +3226,42 @@ static void myGpioSetPwm(unsigned gpio, int oldVal, int newVal)
       {
          if (newOff != realRange)
          {
-            for (i=0; i<SUPERLEVEL; i+=realRange) mySetGpioOff(gpio, i+newOff);
+            for (i=0; i<SUPERLEVEL; i+=realRange)
+               mySetGpioOff(batch, gpio, i+newOff);
          }
 
          /* schedule new gpio on */
 
-         for (i=0; i<SUPERCYCLE; i+=cycles) mySetGpioOn(gpio, i);
+         for (i=0; i<SUPERCYCLE; i+=cycles) mySetGpioOn(batch, gpio, i);
       }
       else                                       /* PWM STOP */
       {
          /* deschedule gpio on */
 
          for (i=0; i<SUPERCYCLE; i+=cycles)
-            myClearGpioOn(gpio, i);
+            myClearGpioOn(batch, gpio, i);
 
          for (i=0; i<SUPERLEVEL; i+=realRange)
-            myClearGpioOff(gpio, i+oldOff);
+            myClearGpioOff(batch, gpio, i+oldOff);
 
          switchGpioOff = 1;
       }
 
-      if (switchGpioOff)
+      if (switchGpioOff && batch) batch->gpioClr |= (1<<gpio);
+      else if (switchGpioOff)
       {
-         *(gpioReg + GPCLR0) = (1<<gpio);
-         *(gpioReg + GPCLR0) = (1<<gpio);
+         myGpioOut(GPCLR0, (1<<gpio));
+         myGpioOut(GPCLR0, (1<<gpio));
+
+         if (pthSimRunning) simGpioUpdate();
       }
    }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void myGpioSetServo(unsigned gpio, int oldVal, int newVal)
+static void myGpioSetServo(
+   pwmBatch_t *batch, unsigned gpio, int oldVal, int newVal)
 {
    int newOff, oldOff, realRange, cycles, i;
    int deferOff, deferRng;
@@ -2673,7 +3282,7 @@ static void myGpioSetServo(unsigned gpio, int oldVal, int newVal)
    {
       for (i=0; i<SUPERLEVEL; i+=deferRng)
       {
-         myClearGpioOff(gpio, i+deferOff);
+         myClearGpioOff(batch, gpio, i+deferOff);
       }
       gpioInfo[gpio].deferOff = 0;
    }
@@ -2683,12 +3292,12 @@ static void myGpioSetServo(unsigned gpio, int oldVal, int newVal)
       if (newOff && oldOff)                       /* SERVO CHANGE */
       {
          for (i=0; i<SUPERLEVEL; i+=realRange)
-            mySetGpioOff(gpio, i+newOff);
+            mySetGpioOff(batch, gpio, i+newOff);
 
          if (newOff > oldOff)
          {
             for (i=0; i<SUPERLEVEL; i+=realRange)
-               myClearGpioOff(gpio, i+oldOff);
+               myClearGpioOff(batch, gpio, i+oldOff);
          }
          else
          {
@@ -2699,18 +3308,28 @@ static void myGpioSetServo(unsigned gpio, int oldVal, int newVal)
       else if (newOff)                            /* SERVO START */
       {
          for (i=0; i<SUPERLEVEL; i+=realRange)
-            mySetGpioOff(gpio, i+newOff);
+            mySetGpioOff(batch, gpio, i+newOff);
 
          /* schedule new gpio on */
 
-         for (i=0; i<SUPERCYCLE; i+=cycles) mySetGpioOn(gpio, i);
+         for (i=0; i<SUPERCYCLE; i+=cycles) mySetGpioOn(batch, gpio, i);
       }
       else                                        /* SERVO STOP */
       {
          /* deschedule gpio on */
 
          for (i=0; i<SUPERCYCLE; i+=cycles)
-            myClearGpioOn(gpio, i);
+            myClearGpioOn(batch, gpio, i);
+
+         if (batch)
+         {
+            /* deschedule gpio off once the batch is written */
+
+            gpioInfo[gpio].deferOff = oldOff;
+            gpioInfo[gpio].deferRng = realRange;
+            batch->servoOff |= (1<<gpio);
+            return;
+         }
 
          /* if in pulse then delay for the last cycle to complete */
 
@@ -2719,7 +3338,7 @@ static void myGpioSetServo(unsigned gpio, int oldVal, int newVal)
          /* deschedule gpio off */
 
          for (i=0; i<SUPERLEVEL; i+=realRange)
-            myClearGpioOff(gpio, i+oldOff);
+            myClearGpioOff(batch, gpio, i+oldOff);
       }
    }
 }
@@ -2985,19 +3604,13 @@ static int waveDelayCBs(uint32_t delay)
 
 /* ----------------------------------------------------------------------- */
 
-static void waveCBsOOLs(int *numCBs, int *numBOOLs, int *numTOOLs)
+static void waveCBsOOLs(unsigned numWaves, rawWave_t *waves,
+   int *numCBs, int *numBOOLs, int *numTOOLs)
 {
    int numCB=0, numBOOL=0, numTOOL=0;
 
    unsigned i;
 
-   unsigned numWaves;
-
-   rawWave_t *waves;
-
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
-
    /* delay cb at start of DMA */
 
    numCB++;
@@ -3020,7 +3633,8 @@ static void waveCBsOOLs(int *numCBs, int *numBOOLs, int *numTOOLs)
 
 /* ----------------------------------------------------------------------- */
 
-static int wave2Cbs(unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
+static int wave2Cbs(unsigned numWaves, rawWave_t *waves,
+                    unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
                     int numCB, int numBOOL, int numTOOL)
 {
    int botCB=*CB, botOOL=*BOOL, topOOL=*TOOL;
@@ -3031,18 +3645,11 @@ static int wave2Cbs(unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
 
    unsigned i, repeatCB;
 
-   unsigned numWaves;
-
    unsigned delayCBs, dcb;
 
    uint32_t delayLeft;
 
-   rawWave_t * waves;
-
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
-
-   /* add delay cb at start of DMA */
+   /* add delay cb at start of DMA */
 
    p = rawWaveCBAdr(botCB++);
 
@@ -3438,6 +4045,215 @@ int rawWaveAddGeneric(unsigned numIn1, rawWave_t *in1)
    else return PI_TOO_MANY_PULSES;
 }
 
+/* ----------------------------------------------------------------------- */
+
+static void waveHeapDown(unsigned *heap, unsigned n, uint64_t *key)
+{
+   unsigned i, c, g;
+
+   i = 0;
+   g = heap[0];
+
+   while ((c = (2 * i) + 1) < n)
+   {
+      if (((c + 1) < n) && (key[heap[c+1]] < key[heap[c]])) c++;
+
+      if (key[g] <= key[heap[c]]) break;
+
+      heap[i] = heap[c];
+      i = c;
+   }
+
+   heap[i] = g;
+}
+
+static void waveHeapUp(unsigned *heap, unsigned n, uint64_t *key)
+{
+   unsigned i, p, g;
+
+   i = n - 1;
+   g = heap[i];
+
+   while (i)
+   {
+      p = (i - 1) / 2;
+
+      if (key[heap[p]] <= key[g]) break;
+
+      heap[i] = heap[p];
+      i = p;
+   }
+
+   heap[i] = g;
+}
+
+#define WAVE_NONE ((unsigned)-1)
+
+static int waveMergeTrains(waveBuilder_t *b, rawWave_t *out)
+{
+   /*
+      Merges all the builder's pulse trains in one pass.
+
+      The trains whose next pulses are due at the same time are kept
+      together in a group and the groups are kept in a heap ordered
+      by time, a hash of the group times finding the group a train
+      joins.  The pulses of all the trains due at the same time are
+      combined, as rawWaveAddGeneric does for two trains.  Trains
+      sharing a bit rate share few times, so few heap operations are
+      needed even when all of them change together.
+
+      The low word of a group key is the first output pulse the group
+      may join, so that a pulse following one with no delay starts a
+      new output pulse.
+   */
+
+   unsigned g, g2, t, list, n, numTrains, freeGroup, hashMask;
+   unsigned outPos, level;
+   unsigned *heap, *head, *chain, *pos, *next, *bucket, *link;
+   uint32_t tNow, tNext, tMax;
+   uint64_t *key;
+   rawWave_t *in;
+
+   numTrains = b->numTrains;
+
+   hashMask = 1;
+   while (hashMask < (2 * numTrains)) hashMask <<= 1;
+
+   key = malloc((numTrains * (sizeof(uint64_t) + (5 * sizeof(unsigned)))) +
+      (hashMask * sizeof(unsigned)));
+
+   if (key == NULL) return PI_NO_MEMORY;
+
+   heap   = (unsigned *)(key + numTrains); /* groups, earliest first */
+   head   = heap  + numTrains; /* first train of a group */
+   chain  = head  + numTrains; /* next group in hash chain or free list */
+   pos    = chain + numTrains; /* next pulse of a train */
+   next   = pos   + numTrains; /* next train in a group */
+   bucket = next  + numTrains; /* first group in hash chain */
+
+   hashMask--;
+
+   for (g=0; g<=hashMask; g++) bucket[g] = WAVE_NONE;
+
+   /* all the trains start in group 0, the other groups are free */
+
+   for (t=0; t<numTrains; t++)
+   {
+      pos[t]   = b->train[t];
+      next[t]  = t + 1;
+      chain[t] = t + 1;
+   }
+
+   next[numTrains-1]  = WAVE_NONE;
+   chain[numTrains-1] = WAVE_NONE;
+
+   freeGroup = chain[0];
+
+   head[0]  = 0;
+   key[0]   = 0;
+   chain[0] = WAVE_NONE;
+   heap[0]  = 0;
+   n        = 1;
+
+   tMax   = 0;
+   outPos = 0;
+   level  = NUM_WAVE_OOL;
+
+   while (n && (outPos < PI_WAVE_MAX_PULSES) && (outPos < level))
+   {
+      tNow = key[heap[0]] >> 32;
+
+      out[outPos].gpioOn  = 0;
+      out[outPos].gpioOff = 0;
+      out[outPos].flags   = 0;
+
+      /* take one pulse from each train due now */
+
+      while (n && ((key[heap[0]] >> 32) == tNow) &&
+             ((uint32_t)key[heap[0]] <= outPos))
+      {
+         g = heap[0];
+
+         heap[0] = heap[--n];
+         if (n) waveHeapDown(heap, n, key);
+
+         link = &bucket[tNow & hashMask];
+         while ((*link != WAVE_NONE) && (*link != g)) link = &chain[*link];
+         if (*link == g) *link = chain[g];
+
+         list = head[g];
+
+         chain[g] = freeGroup;
+         freeGroup = g;
+
+         while (list != WAVE_NONE)
+         {
+            t = list;
+            list = next[t];
+
+            in = &b->pulses[pos[t]++];
+
+            out[outPos].gpioOn  |= in->gpioOn;
+            out[outPos].gpioOff |= in->gpioOff;
+            out[outPos].flags   |= in->flags;
+
+            tNext = tNow + in->usDelay;
+            if (tMax < tNext) tMax = tNext;
+
+            if (pos[t] >= b->train[t+1]) continue;
+
+            /* join the group due at tNext, starting one if needed */
+
+            g2 = WAVE_NONE;
+
+            if (tNext != tNow)
+            {
+               g2 = bucket[tNext & hashMask];
+               while ((g2 != WAVE_NONE) && ((key[g2] >> 32) != tNext))
+                  g2 = chain[g2];
+            }
+
+            if (g2 == WAVE_NONE)
+            {
+               g2 = freeGroup;
+               freeGroup = chain[g2];
+
+               key[g2]  = ((uint64_t)tNext << 32) | (outPos + 1);
+               head[g2] = WAVE_NONE;
+
+               if (tNext != tNow)
+               {
+                  chain[g2] = bucket[tNext & hashMask];
+                  bucket[tNext & hashMask] = g2;
+               }
+               else chain[g2] = WAVE_NONE; /* a new pulse, don't share */
+
+               heap[n++] = g2;
+               waveHeapUp(heap, n, key);
+            }
+
+            next[t] = head[g2];
+            head[g2] = t;
+         }
+      }
+
+      if (n) out[outPos].usDelay = (key[heap[0]] >> 32) - tNow;
+      else   out[outPos].usDelay = tMax - tNow;
+
+      if (out[outPos].flags & WAVE_FLAG_READ) --level;
+      if (out[outPos].flags & WAVE_FLAG_TICK) --level;
+
+      outPos++;
+   }
+
+   free(key);
+
+   if (n || (outPos >= PI_WAVE_MAX_PULSES) || (outPos >= level))
+      return PI_TOO_MANY_PULSES;
+
+   return outPos;
+}
+
 /* ======================================================================= */
 
 int i2cWriteQuick(unsigned handle, unsigned bit)
@@ -5686,2061 +6502,2081 @@ unsigned alert_delays[]=
 
 /* ======================================================================= */
 
+/*
+   The glitch and noise filters work on whole sample words.  Each
+   filtered gpio contributes one bit to the level words (last level,
+   reported level, active) so a sample with no pending bits costs a
+   couple of XORs whatever the number of filtered gpios.  Only bits
+   which have changed or are pending are visited individually.
+
+   Bits known to be pending but not yet due are held in a mask which
+   is applied to each sample until the earliest deadline (kept relative
+   to holdTick) is reached or the pending set changes.
+*/
+
 static void alertGlitchFilter(gpioSample_t *sample, int numSamples)
 {
-   int i, j, diff;
-   uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
-   uint32_t bit, bitV;
+   int b, j;
+   uint32_t filter, bits, bit, level, tick;
+   uint32_t changed, pending, hold, holdTick, holdWait, elapsed;
+   uint32_t LLevel, RLevel;
+   uint32_t changedTick[PI_MAX_USER_GPIO+1];
+   uint32_t steadyUs[PI_MAX_USER_GPIO+1];
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   filter = monitorBits & gFilterBits;
+
+   if (!filter || (numSamples <= 0)) return;
+
+   LLevel = 0;
+   RLevel = 0;
+
+   bits = filter;
+
+   while (bits)
    {
-      bit = (1<<i);
+      b = __builtin_ctz(bits);
+      bits &= (bits - 1);
 
-      if (monitorBits & bit & gFilterBits)
+      if (!gpioAlert[b].gfInitialised)
       {
-         initialised = gpioAlert[i].gfInitialised;
-         if (!initialised && numSamples > 0)
-         {
-           /* Initialise filter with first sample */
-           bitV = sample[0].level & bit;
-           gpioAlert[i].gfRBitV = bitV;
-           gpioAlert[i].gfLBitV = bitV;
-           gpioAlert[i].gfTick = sample[0].tick;
-           gpioAlert[i].gfInitialised = 1;
-         }
-
-         steadyUs    = gpioAlert[i].gfSteadyUs;
-         RBitV       = gpioAlert[i].gfRBitV;
-         LBitV       = gpioAlert[i].gfLBitV;
-         changedTick = gpioAlert[i].gfTick;
+         /* Initialise filter with first sample */
+         gpioAlert[b].gfRBitV = sample[0].level & (1<<b);
+         gpioAlert[b].gfLBitV = gpioAlert[b].gfRBitV;
+         gpioAlert[b].gfTick = sample[0].tick;
+         gpioAlert[b].gfInitialised = 1;
+      }
 
-         for (j=0; j<numSamples; j++)
-         {
-            bitV = sample[j].level & bit;
+      LLevel |= gpioAlert[b].gfLBitV;
+      RLevel |= gpioAlert[b].gfRBitV;
+      changedTick[b] = gpioAlert[b].gfTick;
+      steadyUs[b]    = gpioAlert[b].gfSteadyUs;
+   }
 
-            if (bitV != LBitV)
-            {
-               /* Difference between level and last level.
-                  Restart steady timer. */
+   hold = 0;
+   holdTick = 0;
+   holdWait = 0;
 
-               changedTick = sample[j].tick;
-               LBitV = bitV;
-            }
+   for (j=0; j<numSamples; j++)
+   {
+      level = sample[j].level;
+      tick  = sample[j].tick;
 
-            if (bitV != RBitV)
-            {
-               /* Difference between level and reported level. */
+      /* Difference between level and last level.
+         Restart steady timer. */
 
-               diff = sample[j].tick - changedTick;
+      changed = (level ^ LLevel) & filter;
 
-               if (diff >= steadyUs)
-               {
-                  /* Level stable for steady period. */
-                  RBitV = bitV;
-               }
-               else
-               {
-                  /* Keep reporting old level. */
+      if (changed)
+      {
+         LLevel ^= changed;
+         hold &= (~changed);
 
-                  sample[j].level ^= bit;
-               }
-            }
+         bits = changed;
 
+         while (bits)
+         {
+            changedTick[__builtin_ctz(bits)] = tick;
+            bits &= (bits - 1);
          }
-
-         gpioAlert[i].gfRBitV = RBitV;
-         gpioAlert[i].gfLBitV = LBitV;
-         gpioAlert[i].gfTick  = changedTick;
       }
-   }
-}
 
-static void alertNoiseFilter(gpioSample_t *sample, int numSamples)
-{
-   int i, j, diff;
-   uint32_t LBitV;
-   uint32_t bit, bitV;
-   uint32_t nowTick;
+      /* Difference between level and reported level. */
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
-   {
-      bit = (1<<i);
+      pending = (level ^ RLevel) & filter;
 
-      if (monitorBits & bit & nFilterBits)
+      if (!pending) continue;
+
+      if ((pending != hold) || ((tick - holdTick) >= holdWait))
       {
-         LBitV = gpioAlert[i].nfLBitV;
+         hold = 0;
+         holdTick = tick;
+         holdWait = 0;
 
-         for (j=0; j<numSamples; j++)
-         {
-            bitV = sample[j].level & bit;
-            nowTick = sample[j].tick;
+         bits = pending;
 
-            if (gpioAlert[i].nfActive) /* reporting events */
-            {
-               diff = nowTick - gpioAlert[i].nfTick2;
+         while (bits)
+         {
+            b = __builtin_ctz(bits);
+            bit = (1<<b);
+            bits ^= bit;
 
-               if (diff >= 0)
-               {
-                  /* Stop reporting gpio changes */
+            elapsed = tick - changedTick[b];
 
-                  gpioAlert[i].nfActive = 0;
-                  gpioAlert[i].nfTick1 = nowTick;
-               }
+            if (elapsed >= steadyUs[b])
+            {
+               /* Level stable for steady period. */
+               RLevel ^= bit;
             }
-            else /* waiting for steady us */
+            else
             {
-               if (bitV != LBitV)
-               {
-                  diff = nowTick - gpioAlert[i].nfTick1;
-                  gpioAlert[i].nfTick1 = nowTick;
-
-                  if (diff >= gpioAlert[i].nfSteadyUs)
-                  {
-                     /* Start reporting gpio changes */
+               if (!hold || ((steadyUs[b] - elapsed) < holdWait))
+                  holdWait = steadyUs[b] - elapsed;
 
-                     gpioAlert[i].nfRBitV = LBitV;
-                     gpioAlert[i].nfActive = 1;
-                     gpioAlert[i].nfTick2 =
-                        nowTick + gpioAlert[i].nfActiveUs;
-                  }
-               }
+               hold |= bit;
             }
+         }
+      }
 
-            if (!gpioAlert[i].nfActive)
-            {
-               if (bitV != gpioAlert[i].nfRBitV)
-                  sample[j].level ^= bit;
-            }
+      /* Keep reporting old level. */
 
-            LBitV = bitV;
-         }
+      sample[j].level = level ^ hold;
+   }
 
-         gpioAlert[i].nfLBitV = LBitV;
+   bits = filter;
 
-      }
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bit = (1<<b);
+      bits ^= bit;
+
+      gpioAlert[b].gfRBitV = RLevel & bit;
+      gpioAlert[b].gfLBitV = LLevel & bit;
+      gpioAlert[b].gfTick  = changedTick[b];
    }
 }
 
-static void alertEmit(
-   gpioSample_t *sample, int numSamples, uint32_t changedBits, uint32_t eTick)
+static void alertNoiseFilter(gpioSample_t *sample, int numSamples)
 {
-   uint32_t oldLevel, newLevel;
-   int32_t diff;
-   int emit, seqno, emitted;
-   uint32_t changes, bits, timeoutBits, eventBits;
-   int d;
-   int b, n, v;
-   int err;
-   int max_emits;
-   char fifo[32];
-   /* ensure space for maximum number of watchdog and event notifications */
-   gpioReport_t report[MAX_REPORT+PI_MAX_USER_GPIO+1+PI_MAX_EVENT+1];
+   int b, j;
+   uint32_t filter, bits, bit, level, tick;
+   uint32_t changed, expired, active, activeTick, activeWait;
+   uint32_t LLevel, RLevel;
+   uint32_t tick1[PI_MAX_USER_GPIO+1];
+   uint32_t tick2[PI_MAX_USER_GPIO+1];
 
-   if (changedBits)
-   {
-      if (gpioGetSamples.func)
-      {
-         if (gpioGetSamples.ex)
-         {
-            (gpioGetSamples.func)
-               (sample, numSamples, gpioGetSamples.userdata);
-         }
-         else
-         {
-            (gpioGetSamples.func)(sample, numSamples);
-         }
-      }
-   }
+   filter = monitorBits & nFilterBits;
 
-   eventBits = 0;
+   if (!filter || (numSamples <= 0)) return;
 
-   if (bscFR != (bscsReg[BSC_FR]&0xffff))
-   {
-      bscFR = bscsReg[BSC_FR]&0xffff;
-      eventAlert[PI_EVENT_BSC].fired = 1;
-   }
+   LLevel = 0;
+   RLevel = 0;
+   active = 0;
 
-   for (b=0; b<=PI_MAX_EVENT; b++)
-   {
-      if (eventAlert[b].fired && (!eventAlert[b].ignore))
-      {
-         eventBits |= (1<<b);
+   bits = filter;
 
-         if (eventAlert[b].func)
-         {
-            if (eventAlert[b].ex)
-            {
-               (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
-            }
-            else
-            {
-               (eventAlert[b].func)(b, eTick);
-            }
-         }
-      }
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bit = (1<<b);
+      bits ^= bit;
 
-      eventAlert[b].fired = 0;
+      LLevel |= gpioAlert[b].nfLBitV;
+      RLevel |= gpioAlert[b].nfRBitV;
+      if (gpioAlert[b].nfActive) active |= bit;
+      tick1[b] = gpioAlert[b].nfTick1;
+      tick2[b] = gpioAlert[b].nfTick2;
    }
 
-   /* call alert callbacks for each bit transition */
+   /* Force a check of the active bits against the first sample */
 
-   if (changedBits & alertBits)
+   activeTick = sample[0].tick;
+   activeWait = 0;
+
+   for (j=0; j<numSamples; j++)
    {
-      oldLevel = (reportedLevel & alertBits);
+      level = sample[j].level;
+      tick  = sample[j].tick;
 
-      for (d=0; d<numSamples; d++)
+      changed = (level ^ LLevel) & filter & (~active);
+
+      if (active && ((tick - activeTick) >= activeWait))
       {
-         newLevel = (sample[d].level & alertBits);
+         /* Stop reporting gpio changes once the active period ends */
 
-         if (newLevel != oldLevel)
+         expired = 0;
+         activeTick = tick;
+         activeWait = 0;
+
+         bits = active;
+
+         while (bits)
          {
-            changes = (newLevel ^ oldLevel);
+            b = __builtin_ctz(bits);
+            bit = (1<<b);
+            bits ^= bit;
 
-            for (b=0; b<=PI_MAX_USER_GPIO; b++)
+            if ((int32_t)(tick - tick2[b]) >= 0)
             {
-               if (changes & (1<<b))
-               {
-                  if (newLevel & (1<<b)) v = 1; else v = 0;
-
-                  if (gpioAlert[b].func)
-                  {
-                     if (gpioAlert[b].ex)
-                     {
-                        (gpioAlert[b].func)
-                           (b, v, sample[d].tick,
-                            gpioAlert[b].userdata);
-                     }
-                     else
-                     {
-                        (gpioAlert[b].func)(b, v, sample[d].tick);
-                     }
-                  }
-               }
+               expired |= bit;
+               tick1[b] = tick;
             }
-            oldLevel = newLevel;
+            else if (!activeWait || ((tick2[b] - tick) < activeWait))
+               activeWait = tick2[b] - tick;
          }
+
+         active ^= expired;
       }
-   }
 
-   /* check for watchdog timeouts */
+      /* Waiting for steady us */
 
-   timeoutBits = 0;
+      bits = changed;
 
-   if (wdogBits)
-   {
-      for (b=0; b<=PI_MAX_USER_GPIO; b++)
+      while (bits)
       {
-         if (gpioAlert[b].wdSteadyUs)
-         {
-            diff = eTick - gpioAlert[b].wdTick;
+         b = __builtin_ctz(bits);
+         bit = (1<<b);
+         bits ^= bit;
 
-            if (diff >= gpioAlert[b].wdSteadyUs)
-            {
-               timeoutBits |= (1<<b);
+         if ((int)(tick - tick1[b]) >= gpioAlert[b].nfSteadyUs)
+         {
+            /* Start reporting gpio changes */
 
-               gpioAlert[b].wdTick = eTick;
+            RLevel = (RLevel & (~bit)) | (LLevel & bit);
+            tick2[b] = tick + gpioAlert[b].nfActiveUs;
 
-               if (gpioAlert[b].func)
-               {
-                  if (gpioAlert[b].ex)
-                  {
-                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick,
-                                            gpioAlert[b].userdata);
-                  }
-                  else
-                  {
-                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
-                  }
-               }
+            if (!active || ((tick - activeTick) + gpioAlert[b].nfActiveUs) <
+               activeWait)
+            {
+               if (!active) activeTick = tick;
+               activeWait = (tick - activeTick) + gpioAlert[b].nfActiveUs;
             }
-         }
-      }
-   }
-
-   for (n=0; n<PI_NOTIFY_SLOTS; n++)
-   {
-      if (gpioNotify[n].state == PI_NOTIFY_CLOSING)
-      {
-         if (gpioNotify[n].pipe)
-         {
-            DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
-            close(gpioNotify[n].fd);
 
-            sprintf(fifo, "/dev/pigpio%d", n);
-
-            unlink(fifo);
+            active |= bit;
          }
 
-         gpioNotify[n].state = PI_NOTIFY_CLOSED;
+         tick1[b] = tick;
       }
-      else if (gpioNotify[n].state >= PI_NOTIFY_OPENED)
-      {
-         bits = gpioNotify[n].bits;
 
-         emit = 0;
+      sample[j].level = level ^ ((level ^ RLevel) & filter & (~active));
 
-         seqno = gpioNotify[n].seqno;
+      LLevel = (LLevel & (~filter)) | (level & filter);
+   }
 
-         if (gpioNotify[n].state == PI_NOTIFY_RUNNING)
-         {
-            /* check to see if any bits have changed for this
-               notification.
+   bits = filter;
 
-               bits         is the set of notification bits
-               changedBits is the set of changed bits
-            */
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bit = (1<<b);
+      bits ^= bit;
 
-            if (changedBits & bits)
-            {
-               oldLevel = reportedLevel & bits;
+      gpioAlert[b].nfLBitV  = LLevel & bit;
+      gpioAlert[b].nfRBitV  = RLevel & bit;
+      gpioAlert[b].nfActive = (active & bit) ? 1 : 0;
+      gpioAlert[b].nfTick1  = tick1[b];
+      gpioAlert[b].nfTick2  = tick2[b];
+   }
+}
 
-               for (d=0; d<numSamples; d++)
-               {
-                  newLevel = sample[d].level & bits;
+/*
+   Notification reports are queued on a per handle ring by the dispatch
+   thread and written out in batches by the notify writer thread.  If
+   the consumer doesn't keep up the ring fills and further reports are
+   dropped.  The number dropped is sent as a PI_NTFY_FLAGS_OVFL report
+   as soon as there is room.
+*/
 
-                  if (newLevel != oldLevel)
-                  {
-                     report[emit].seqno = seqno;
-                     report[emit].flags = 0;
-                     report[emit].tick  = sample[d].tick;
-                     report[emit].level = sample[d].level;
+/* Returns the free space in handle n's ring, which is either the
+   internal ring drained by the notify writer or a shared memory ring
+   drained by the client. */
 
-                     oldLevel = newLevel;
+static int notifyRing(int n, notifyRing_t *ring)
+{
+   uint32_t used;
+   gpioNotifyShm_t *shm;
 
-                     emit++;
-                     seqno++;
-                  }
-               }
-            }
+   shm = gpioNotify[n].shm;
 
-            /* check to see if any watchdogs are due for this
-               notification.
+   if (shm)
+   {
+      ring->report = shm->report;
+      ring->mask   = shm->size - 1;
+      ring->head   = &shm->head;
+      ring->tail   = &shm->tail;
+   }
+   else
+   {
+      ring->report = gpioNotify[n].ring;
+      ring->mask   = NOTIFY_RING_SIZE - 1;
+      ring->head   = &gpioNotify[n].ringHead;
+      ring->tail   = &gpioNotify[n].ringTail;
+   }
 
-               bits        is the set of notification bits
-               timeoutBits is the set of timed out bits
-            */
+   used = *ring->head - __atomic_load_n(ring->tail, __ATOMIC_ACQUIRE);
 
-            bits = gpioNotify[n].bits;
+   /* don't trust a shared memory tail */
 
-            if (timeoutBits & bits)
-            {
-               /* at least one watchdog has fired for this
-                  notification.
-               */
+   if (used > ring->mask) return 0;
 
-               for (b=0; b<=PI_MAX_USER_GPIO; b++)
-               {
-                  if (timeoutBits & bits & (1<<b))
-                  {
-                     if (numSamples)
-                        newLevel = sample[numSamples-1].level;
-                     else
-                        newLevel = reportedLevel;
-
-                     report[emit].seqno = seqno;
-                     report[emit].flags =
-                        PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b);
-                     report[emit].tick  = eTick;
-                     report[emit].level = newLevel;
-
-                     emit++;
-                     seqno++;
-                  }
-               }
-            }
-         }
+   return (ring->mask + 1) - used;
+}
 
-         /* check to see if any events are due
+static int alertNotifyMark(
+   int n, uint16_t *seqno, notifyRing_t *ring, uint32_t *head, int room)
+{
+   gpioReport_t *r;
 
-            eventBits is the set of events
-         */
+   if (gpioNotify[n].dropped)
+   {
+      if (!room) return 0;
 
-         if (eventBits & gpioNotify[n].eventBits)
-         {
-            for (b=0; b<=PI_MAX_EVENT; b++)
-            {
-               if (eventBits & gpioNotify[n].eventBits & (1<<b))
-               {
-                  if (numSamples)
-                     newLevel = sample[numSamples-1].level;
-                  else
-                     newLevel = reportedLevel;
+      r = &ring->report[(*head)++ & ring->mask];
 
-                  report[emit].seqno = seqno;
-                  report[emit].flags = 
-                     PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b);
-                  report[emit].tick  = eTick;
-                  report[emit].level = newLevel;
+      r->seqno = (*seqno)++;
+      r->flags = PI_NTFY_FLAGS_OVFL;
+      r->tick  = gpioNotify[n].droppedTick;
+      r->level = gpioNotify[n].dropped;
 
-                  emit++;
-                  seqno++;
-               }
-            }
-         }
+      gpioNotify[n].dropped = 0;
 
-         if (!emit)
-         {
-            if ((int)(eTick - gpioNotify[n].lastReportTick) > 60000000)
-            {
-               if (numSamples)
-                  newLevel = sample[numSamples-1].level;
-               else
-                  newLevel = reportedLevel;
+      return 1;
+   }
 
-               report[emit].seqno = seqno;
-               report[emit].flags = PI_NTFY_FLAGS_ALIVE;
-               report[emit].tick  = eTick;
-               report[emit].level = newLevel;
+   return 0;
+}
 
-               emit++;
-               seqno++;
-            }
-         }
+static void alertNotifyPut(
+   int n, uint16_t *seqno, uint16_t flags, uint32_t tick, uint32_t level)
+{
+   uint32_t head;
+   int room;
+   notifyRing_t ring;
+   gpioReport_t *r;
 
-         if (emit)
-         {
-            DBG(DBG_FAST_TICK, "notification %d (%d reports, %x-%x)",
-               n, emit, report[0].seqno,  report[emit-1].seqno);
-            gpioNotify[n].lastReportTick = eTick;
-            max_emits = gpioNotify[n].max_emits;
+   room = notifyRing(n, &ring);
 
-            if (emit > gpioStats.maxEmit) gpioStats.maxEmit = emit;
+   head = *ring.head;
 
-            emitted = 0;
+   /* the overflow mark must be followed by room for this report */
 
-            while (emit > 0)
-            {
-               if (emit > max_emits)
-               {
-                  gpioStats.emitFrags++;
+   if (room > 1) room -= alertNotifyMark(n, seqno, &ring, &head, room);
 
-                  err = write(gpioNotify[n].fd,
-                           report+emitted,
-                           max_emits*sizeof(gpioReport_t));
+   if (!room || gpioNotify[n].dropped)
+   {
+      if (!gpioNotify[n].dropped++) gpioNotify[n].droppedTick = tick;
+      gpioStats.notifyDropped++;
+   }
+   else
+   {
+      r = &ring.report[head++ & ring.mask];
 
-                  if (err != (max_emits*sizeof(gpioReport_t)))
-                  {
-                     if (err < 0)
-                     {
-                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
-                        {
-                           /* serious error, no point continuing */
+      r->seqno = (*seqno)++;
+      r->flags = flags;
+      r->tick  = tick;
+      r->level = level;
+   }
 
-                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
-                              gpioNotify[n].fd, err, errno);
+   __atomic_store_n(ring.head, head, __ATOMIC_RELEASE);
+}
 
-                           DBG(DBG_ALWAYS, "%s", strerror(errno));
+static void alertNotifyFlush(int n, uint16_t *seqno)
+{
+   uint32_t head;
+   int room;
+   notifyRing_t ring;
 
-                           gpioNotify[n].bits  = 0;
-                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                           intNotifyBits();
-                           break;
-                        }
-                        else gpioStats.wouldBlockPipeWrite++;
-                     }
-                     else
-                     {
-                        gpioStats.shortPipeWrite++;
-                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
-                           err/sizeof(gpioReport_t), max_emits);
-                     }
-                  }
-                  else
-                  {
-                     gpioStats.goodPipeWrite++;
-                  }
+   room = notifyRing(n, &ring);
 
-                  emitted += max_emits;
-                  emit    -= max_emits;
-               }
-               else
-               {
-                  err = write(gpioNotify[n].fd,
-                           report+emitted,
-                           emit*sizeof(gpioReport_t));
+   head = *ring.head;
 
-                  if (err != (emit*sizeof(gpioReport_t)))
-                  {
-                     if (err < 0)
-                     {
-                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
-                        {
-                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
-                              gpioNotify[n].fd, err, errno);
-
-                           DBG(DBG_ALWAYS, "%s", strerror(errno));
-
-                           /* serious error, no point continuing */
-                           gpioNotify[n].bits  = 0;
-                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                           intNotifyBits();
-                           break;
-                        }
-                        else gpioStats.wouldBlockPipeWrite++;
-                     }
-                     else
-                     {
-                        gpioStats.shortPipeWrite++;
-                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
-                           err/sizeof(gpioReport_t), emit);
-                     }
-                  }
-                  else
-                  {
-                     gpioStats.goodPipeWrite++;
-                  }
+   if (alertNotifyMark(n, seqno, &ring, &head, room))
+      __atomic_store_n(ring.head, head, __ATOMIC_RELEASE);
+}
 
-                  emitted += emit;
-                  emit = 0;
-               }
-            }
+static void notifyShmWake(int n)
+{
+   gpioNotifyShm_t *shm;
 
-            gpioNotify[n].seqno = seqno;
-         }
-      }
-   }
+   shm = gpioNotify[n].shm;
 
-   if (changedBits & scriptBits)
-   {
-      for (n=0; n<PI_MAX_SCRIPTS; n++)
-      {
-         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
-             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
-             (gpioScript[n].waitBits & changedBits))
-         {
-            pthread_mutex_lock(&gpioScript[n].pthMutex);
+   __atomic_add_fetch(&shm->futex, 1, __ATOMIC_SEQ_CST);
 
-            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
-            {
-               gpioScript[n].changedBits =
-                  gpioScript[n].waitBits & changedBits;
-               pthread_cond_signal(&gpioScript[n].pthCond);
-            }
+   if (__atomic_load_n(&shm->waiting, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &shm->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
 
-            pthread_mutex_unlock(&gpioScript[n].pthMutex);
-         }
-      }
-   }
+static void notifyShmClose(int n)
+{
+   char name[32];
 
-   if (eventBits & scriptEventBits)
-   {
-      for (n=0; n<PI_MAX_SCRIPTS; n++)
-      {
-         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
-             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
-             (gpioScript[n].eventBits & eventBits))
-         {
-            pthread_mutex_lock(&gpioScript[n].pthMutex);
+   DBG(DBG_INTERNAL, "close notify shm %d", n);
 
-            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
-            {
-               gpioScript[n].changedBits =
-                  gpioScript[n].eventBits & eventBits;
-               pthread_cond_signal(&gpioScript[n].pthCond);
-            }
+   munmap(gpioNotify[n].shm, sizeof(gpioNotifyShm_t) +
+      (gpioNotify[n].shm->size * sizeof(gpioReport_t)));
 
-            pthread_mutex_unlock(&gpioScript[n].pthMutex);
-         }
-      }
-   }
+   gpioNotify[n].shm = NULL;
 
-   if (numSamples) reportedLevel = sample[numSamples-1].level;
+   sprintf(name, "/pigpio%d", n);
+
+   shm_unlink(name);
 }
 
-static void alertWdogCheck(gpioSample_t *sample, int numSamples)
+/* returns 1 if reports are left queued because the fd is full */
+
+static int notifyWrite(int n)
 {
-   /*
-   Go through and set the last time each GPIO with a watchdog changed state.
-   */
+   uint32_t head, tail, idx;
+   int count, first, iovcnt, err, total, bytes;
+   struct iovec iov[2];
 
-   int i, j;
-   uint32_t LBitV;
-   uint32_t bit;
+   head = __atomic_load_n(&gpioNotify[n].ringHead, __ATOMIC_ACQUIRE);
+   tail = gpioNotify[n].ringTail;
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   while (tail != head)
    {
-      bit = (1<<i);
+      count = head - tail;
 
-      if (monitorBits & bit & wdogBits)
+      if (count > gpioNotify[n].max_emits)
       {
-         LBitV = gpioAlert[i].wdLBitV;
+         gpioStats.emitFrags++;
+         count = gpioNotify[n].max_emits;
+      }
 
-         for (j=0; j<numSamples; j++)
-         {
-            if ((sample[j].level & bit) != LBitV)
-            {
-               LBitV = sample[j].level & bit;
-               gpioAlert[i].wdTick = sample[j].tick;
-            }
-         }
+      idx = tail & (NOTIFY_RING_SIZE-1);
 
-         gpioAlert[i].wdLBitV = LBitV;
-      }
-   }
-}
+      first = NOTIFY_RING_SIZE - idx;
+      if (first > count) first = count;
 
-static void * pthAlertThread(void *x)
-{
-   struct timespec req, rem;
-   uint32_t oldLevel, newLevel, level;
-   uint32_t oldSlot,  newSlot;
-   uint32_t expected, ft, sTick;
-   uint32_t changedBits;
-   int32_t diff, minDiff, stickInited;
-   int cycle, pulse;
-   int numSamples, ticks, i;
-   int rp, reports, totalSamples;
-   int stopped;
-   int moreToDo;
-   gpioSample_t sample[MAX_SAMPLE];
+      iov[0].iov_base = (char *)&gpioNotify[n].ring[idx] +
+                           gpioNotify[n].ringPartial;
+      iov[0].iov_len  = (first * sizeof(gpioReport_t)) -
+                           gpioNotify[n].ringPartial;
+      iovcnt = 1;
 
-   req.tv_sec = 0;
+      if (count > first)
+      {
+         iov[1].iov_base = gpioNotify[n].ring;
+         iov[1].iov_len  = (count - first) * sizeof(gpioReport_t);
+         iovcnt = 2;
+      }
 
-   /* don't start until DMA started */
+      total = (count * sizeof(gpioReport_t)) - gpioNotify[n].ringPartial;
 
-   spinWhileStarting();
+      err = writev(gpioNotify[n].fd, iov, iovcnt);
 
-   reportedLevel = gpioReg[GPLEV0];
+      if (err < 0)
+      {
+         if (errno == EINTR) continue;
 
-   oldLevel = reportedLevel;
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+         {
+            /* serious error, no point continuing */
 
-   oldSlot = dmaCurrentSlot(dmaNowAtICB());
+            DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
+               gpioNotify[n].fd, err, errno);
 
-   oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+            DBG(DBG_ALWAYS, "%s", strerror(errno));
 
-   cycle = (oldSlot/PULSE_PER_CYCLE);
+            gpioNotify[n].bits  = 0;
+            gpioNotify[n].state = PI_NOTIFY_CLOSING;
+            intNotifyBits();
+            return 0;
+         }
 
-   pulse = 0;
+         gpioStats.wouldBlockPipeWrite++;
+         return 1;
+      }
 
-   stopped = 0;
+      bytes = gpioNotify[n].ringPartial + err;
 
-   moreToDo = 0;
+      if (bytes >= sizeof(gpioReport_t))
+      {
+         /* the last whole report written */
 
-   stickInited = 0;
+         idx = (tail + (bytes / sizeof(gpioReport_t)) - 1) &
+                  (NOTIFY_RING_SIZE-1);
 
-   sTick = 0;
+         statsRecord(&gpioStats.notifyLatency,
+            systReg[SYST_CLO] - gpioNotify[n].ring[idx].tick);
+      }
 
-   minDiff = gpioCfg.clockMicros / 2;
+      tail += bytes / sizeof(gpioReport_t);
+      gpioNotify[n].ringPartial = bytes % sizeof(gpioReport_t);
 
-   while (1)
-   {
-      /* Check that DMA is running okay */
+      __atomic_store_n(&gpioNotify[n].ringTail, tail, __ATOMIC_RELEASE);
 
-      if (dmaIn[DMA_CONBLK_AD])
+      if (err != total)
       {
-         if (stopped)
-         {
-            DBG(DBG_STARTUP, "****** GOING ******");
-            stopped = 0;
-         }
+         gpioStats.shortPipeWrite++;
+         return 1;
       }
-      else
-      {
-         stopped = 1;
 
-         myGpioDelay(5000);
+      gpioStats.goodPipeWrite++;
+   }
 
-         if (runState == PI_RUNNING)
-         {
-            /* should never be executed, leave code just in case */
+   return 0;
+}
 
-            gpioCfg.internals |= PI_CFG_STATS;
+static void * pthNotifyThread(void *x)
+{
+   struct timespec req, rem;
+   uint32_t slots;
+   int n, backlog;
+   char fifo[32];
 
-            dmaInitCbs();
-            flushMemory();
-            //cast twice to suppress compiler warning, I belive this cast is ok
-            //because dmaIbus contains bus addresses, not user addresses. --plugwash
-            initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
-            myGpioDelay(5000); /* let DMA run for a while */
-            oldSlot = dmaCurrentSlot(dmaNowAtICB());
-            gpioStats.DMARestarts++;
-         }
-      }
+   pthNotifyRunning = PI_THREAD_RUNNING;
 
-      newSlot = dmaCurrentSlot(dmaNowAtICB());
+   backlog = 0;
 
-      newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+   while (1)
+   {
+      if (backlog)
+      {
+         /* a fd was full, try again shortly */
 
-      numSamples = 0;
+         req.tv_sec = 0;
+         req.tv_nsec = 1000000;
 
-      /*
-      Extract samples from DMA ring buffer.
-      */
+         while (nanosleep(&req, &rem))
+         {
+            req.tv_sec  = rem.tv_sec;
+            req.tv_nsec = rem.tv_nsec;
+         }
 
-      while ((oldSlot != newSlot) && (numSamples < MAX_SAMPLE))
+         while (!sem_trywait(&notifyWriteSem)) ;
+      }
+      else
       {
-         level = myGetLevel(oldSlot++);
+         while (sem_wait(&notifyWriteSem)) ; /* EINTR */
+      }
 
-         sample[numSamples].tick  = sTick;
-         sample[numSamples].level = level;
+      backlog = 0;
 
-         numSamples++;
+      slots = notifyOpenSlots;
 
-         sTick += gpioCfg.clockMicros;
+      while (slots)
+      {
+         n = __builtin_ctz(slots);
+         slots &= (slots - 1);
 
-         if (++pulse >= PULSE_PER_CYCLE)
-         {
-            pulse = 0;
+         if (gpioNotify[n].shm) continue;
 
-            if (++cycle >= bufferCycles)
+         if (gpioNotify[n].state == PI_NOTIFY_CLOSING)
+         {
+            if (gpioNotify[n].pipe)
             {
-               cycle = 0;
-               oldSlot = 0;
-            }
+               DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
+               close(gpioNotify[n].fd);
 
-            expected = sTick;
+               sprintf(fifo, "/dev/pigpio%d", n);
 
-            sTick = myGetTick(cycle);
+               unlink(fifo);
+            }
 
-            if (stickInited)
-            {
-               diff = sTick - expected;
+            gpioNotify[n].state = PI_NOTIFY_CLOSED;
+            intNotifyBits();
+         }
+         else if (gpioNotify[n].state >= PI_NOTIFY_OPENED)
+         {
+            backlog |= notifyWrite(n);
+         }
+      }
+   }
 
-               if (abs(diff) > minDiff)
-               {
-                  ft = sample[numSamples-PULSE_PER_CYCLE].tick;
+   return 0;
+}
 
-                  ticks = sTick - ft;
+/*
+   alertEmit only visits the set bits of each change word.  The gpio
+   and event to notify handle/script tables (see intNotifyBits and
+   intScriptBits) turn each changed gpio into the set of handles or
+   scripts to service, so the cost per sample follows the number of
+   edges rather than the number of gpios times the number of handles.
+*/
 
-                  for (i=1; i<PULSE_PER_CYCLE; i++)
-                  {
-                     sample[numSamples-PULSE_PER_CYCLE+i].tick =
-                        ((i*ticks)/PULSE_PER_CYCLE) + ft;
-                  }
-               }
+static void alertEmit(
+   gpioSample_t *sample, int numSamples, uint32_t changedBits, uint32_t eTick)
+{
+   uint32_t oldLevel, newLevel, lastLevel;
+   int32_t diff;
+   uint32_t changes, bits, timeoutBits, eventBits, slots, seqBits;
+   int d;
+   int b, n, v;
+   int emit[PI_NOTIFY_SLOTS];
+   uint16_t seqno[PI_NOTIFY_SLOTS];
+   uint64_t started;
 
-               diff += (TICKSLOTS/2);
+   if (changedBits)
+   {
+      if (gpioGetSamples.func)
+      {
+         if (gpioGetSamples.ex)
+         {
+            (gpioGetSamples.func)
+               (sample, numSamples, gpioGetSamples.userdata);
+         }
+         else
+         {
+            (gpioGetSamples.func)(sample, numSamples);
+         }
+      }
+   }
 
-               if (diff < 0)
-               {
-                  gpioStats.diffTick[0]++;
-               }
+   eventBits = 0;
 
-               else if (diff >= TICKSLOTS)
-               {
-                  gpioStats.diffTick[TICKSLOTS-1]++;
-               }
+   if (bscFR != (bscsReg[BSC_FR]&0xffff))
+   {
+      bscFR = bscsReg[BSC_FR]&0xffff;
+      eventAlert[PI_EVENT_BSC].fired = 1;
+   }
 
-               else gpioStats.diffTick[diff]++;
+   for (b=0; b<=PI_MAX_EVENT; b++)
+   {
+      if (eventAlert[b].fired && (!eventAlert[b].ignore))
+      {
+         eventBits |= (1<<b);
+
+         if (eventAlert[b].func)
+         {
+            if (eventAlert[b].ex)
+            {
+               (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
             }
             else
             {
-               stickInited = 1;
-               numSamples = 0;
-               if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
-               {
-                  pthAlertRunning = PI_THREAD_RUNNING;
-               }
+               (eventAlert[b].func)(b, eTick);
             }
          }
       }
 
-      if (oldSlot == newSlot) moreToDo = 0; else moreToDo = 1;
-
-      /* Apply glitch filter */
-
-      if (numSamples && gFilterBits) alertGlitchFilter(sample, numSamples);
-
-      /* Apply noise filter */
-
-      if (numSamples && nFilterBits) alertNoiseFilter(sample, numSamples);
+      eventAlert[b].fired = 0;
+   }
 
-      /* Compact samples */
+   /* call alert callbacks for each bit transition */
 
-      changedBits = 0;
-      oldLevel &= monitorBits;
-      reports = 0;
-      totalSamples = 0;
+   if (changedBits & alertBits)
+   {
+      oldLevel = (reportedLevel & alertBits);
 
-      for (rp=0; rp<numSamples; rp++)
+      for (d=0; d<numSamples; d++)
       {
-         newLevel = (sample[rp].level & monitorBits);
+         newLevel = (sample[d].level & alertBits);
 
-         if (newLevel != oldLevel)
+         changes = (newLevel ^ oldLevel);
+
+         while (changes)
          {
-            sample[reports].tick  = sample[rp].tick;
-            sample[reports].level = sample[rp].level;
-            changedBits |= (newLevel ^ oldLevel);
-            oldLevel = newLevel;
+            b = __builtin_ctz(changes);
+            changes &= (changes - 1);
 
-            reports++;
+            if (newLevel & (1<<b)) v = 1; else v = 0;
 
-            if (reports >= MAX_REPORT)
+            if (gpioAlert[b].func)
             {
-               totalSamples += reports;
+               started = timerNanos();
 
-               /* Rebase watchdog timeouts */
-               if (wdogBits) alertWdogCheck(sample, reports);
-
-               gpioStats.numSamples += reports;
-
-               alertEmit(sample, reports, changedBits, sample[rp].tick);
+               if (gpioAlert[b].ex)
+               {
+                  (gpioAlert[b].func)
+                     (b, v, sample[d].tick,
+                      gpioAlert[b].userdata);
+               }
+               else
+               {
+                  (gpioAlert[b].func)(b, v, sample[d].tick);
+               }
 
-               changedBits = 0;
-               reports = 0;
+               statsRecord(&gpioStats.callback[b],
+                  (timerNanos() - started) / THOUSAND);
             }
          }
+         oldLevel = newLevel;
       }
+   }
 
-      if (reports)
-      {
-         totalSamples += reports;
-
-         /* Rebase watchdog timeouts */
-         if (wdogBits) alertWdogCheck(sample, reports);
-
-         gpioStats.numSamples += reports;
-      }
+   /* check for watchdog timeouts */
 
-      alertEmit(sample, reports, changedBits, sTick);
-      reportedLevel = sample[numSamples -1].level;
+   timeoutBits = 0;
 
-      if (totalSamples > gpioStats.maxSamples)
-         gpioStats.maxSamples = numSamples;
+   bits = wdogBits;
 
-      req.tv_sec = 0;
-      req.tv_nsec = alert_delays[(gpioCfg.internals>>PI_CFG_ALERT_FREQ)&15];
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bits &= (bits - 1);
 
-      if (moreToDo)
-      {
-         gpioStats.moreToDo++;
-      }
-      else
+      if (gpioAlert[b].wdSteadyUs)
       {
-         gpioStats.alertTicks++;
+         diff = eTick - gpioAlert[b].wdTick;
 
-         while (nanosleep(&req, &rem))
+         if (diff >= gpioAlert[b].wdSteadyUs)
          {
-            req.tv_sec  = rem.tv_sec;
-            req.tv_nsec = rem.tv_nsec;
+            timeoutBits |= (1<<b);
+
+            gpioAlert[b].wdTick = eTick;
+
+            if (gpioAlert[b].func)
+            {
+               started = timerNanos();
+
+               if (gpioAlert[b].ex)
+               {
+                  (gpioAlert[b].func)(b, PI_TIMEOUT, eTick,
+                                         gpioAlert[b].userdata);
+               }
+               else
+               {
+                  (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
+               }
+
+               statsRecord(&gpioStats.callback[b],
+                  (timerNanos() - started) / THOUSAND);
+            }
          }
       }
    }
 
-   return 0;
-}
+   /* notifications */
 
-/* ======================================================================= */
+   if (numSamples) lastLevel = sample[numSamples-1].level;
+   else            lastLevel = reportedLevel;
 
-static int scrPop(gpioScript_t *s, int *SP, int *S)
-{
-   if ((*SP) > 0)
-   {
-      return S[--(*SP)];
-   }
-   else
+   slots = notifyOpenSlots;
+   seqBits = 0;
+
+   while (slots)
    {
-      s->run_state = PI_SCRIPT_FAILED;
-      DBG(DBG_ALWAYS, "script %d too many pops", s->id);
-      return 0;
-   }
-}
+      n = __builtin_ctz(slots);
+      slots &= (slots - 1);
 
-/* ----------------------------------------------------------------------- */
+      /* closing handles are dealt with by the notify writer, apart
+         from shared memory which only this thread writes */
 
-static void scrPush(gpioScript_t *s, int *SP, int *S, int val)
-{
-   if ((*SP) < PI_SCRIPT_STACK_SIZE)
-   {
-      S[(*SP)++] = val;
+      if (gpioNotify[n].state == PI_NOTIFY_CLOSING)
+      {
+         if (gpioNotify[n].shm)
+         {
+            notifyShmClose(n);
+            gpioNotify[n].state = PI_NOTIFY_CLOSED;
+            intNotifyBits();
+         }
+      }
+      else if (gpioNotify[n].state >= PI_NOTIFY_OPENED)
+      {
+         emit[n] = 0;
+         seqno[n] = gpioNotify[n].seqno;
+         seqBits |= (1u<<n);
+      }
    }
-   else
+
+   /* level changes, in sample order, for running notifications */
+
+   if (changedBits & notifyBits)
    {
-      s->run_state = PI_SCRIPT_FAILED;
-      DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
-   }
-}
+      oldLevel = reportedLevel;
 
-/* ----------------------------------------------------------------------- */
+      for (d=0; d<numSamples; d++)
+      {
+         newLevel = sample[d].level;
 
-static void scrSwap(int *v1, int *v2)
-{
-   int t;
+         changes = (newLevel ^ oldLevel) & notifyBits;
 
-   t=*v1; *v1=*v2; *v2= t;
-}
+         oldLevel = newLevel;
 
-/* ----------------------------------------------------------------------- */
+         slots = 0;
 
-static int scrEvtWait(gpioScript_t *s, uint32_t bits)
-{
-   pthread_mutex_lock(&s->pthMutex);
+         while (changes)
+         {
+            slots |= notifyGpioSlots[__builtin_ctz(changes)];
+            changes &= (changes - 1);
+         }
 
-   if (s->request == PI_SCRIPT_RUN)
-   {
-      s->run_state = PI_SCRIPT_WAITING;
-      s->eventBits = bits;
-      intScriptEventBits();
+         slots &= seqBits;
 
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+         while (slots)
+         {
+            n = __builtin_ctz(slots);
+            slots &= (slots - 1);
 
-      s->waitBits = 0;
-      intScriptEventBits();
-      s->run_state = PI_SCRIPT_RUNNING;
+            alertNotifyPut(n, &seqno[n], 0, sample[d].tick, newLevel);
+
+            emit[n]++;
+         }
+      }
    }
 
-   pthread_mutex_unlock(&s->pthMutex);
+   /* watchdogs due for running notifications */
 
-   return s->changedBits;
-}
+   bits = timeoutBits & notifyBits;
 
-/* ----------------------------------------------------------------------- */
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bits &= (bits - 1);
 
-static int scrWait(gpioScript_t *s, uint32_t bits)
-{
-   pthread_mutex_lock(&s->pthMutex);
+      slots = notifyGpioSlots[b] & seqBits;
 
-   if (s->request == PI_SCRIPT_RUN)
-   {
-      s->run_state = PI_SCRIPT_WAITING;
-      s->waitBits = bits;
-      intScriptBits();
+      while (slots)
+      {
+         n = __builtin_ctz(slots);
+         slots &= (slots - 1);
 
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+         alertNotifyPut(n, &seqno[n],
+            PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b), eTick, lastLevel);
 
-      s->waitBits = 0;
-      intScriptBits();
-      s->run_state = PI_SCRIPT_RUNNING;
+         emit[n]++;
+      }
    }
 
-   pthread_mutex_unlock(&s->pthMutex);
+   /* events due for open notifications */
 
-   return s->changedBits;
-}
+   bits = eventBits;
 
-/* ----------------------------------------------------------------------- */
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
+      bits &= (bits - 1);
 
-static int scrSys(char *cmd, uint32_t p1, uint32_t p2)
-{
-   char buf[1024];
-   int status;
+      slots = notifyEventSlots[b] & seqBits;
 
-   if (!myScriptNameValid(cmd))
-      SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
+      while (slots)
+      {
+         n = __builtin_ctz(slots);
+         slots &= (slots - 1);
 
-   snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
+         alertNotifyPut(n, &seqno[n],
+            PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b), eTick, lastLevel);
 
-   DBG(DBG_USER, "%s", buf);
+         emit[n]++;
+      }
+   }
 
-   status = system(buf);
+   slots = seqBits;
 
-   if (status < 0) status = PI_BAD_SHELL_STATUS;
+   while (slots)
+   {
+      n = __builtin_ctz(slots);
+      slots &= (slots - 1);
 
-   return status;
-}
+      if (!emit[n])
+      {
+         if ((int)(eTick - gpioNotify[n].lastReportTick) > 60000000)
+         {
+            alertNotifyPut(
+               n, &seqno[n], PI_NTFY_FLAGS_ALIVE, eTick, lastLevel);
 
-/* ----------------------------------------------------------------------- */
+            emit[n]++;
+         }
 
-static void *pthScript(void *x)
-{
-   gpioScript_t *s;
-   cmdInstr_t instr;
-   int p1, p2, p1o, p2o, p3o, *t1, *t2;
-   int PC, A, F, SP;
-   int S[PI_SCRIPT_STACK_SIZE];
-   char buf[CMD_MAX_EXTENSION];
+         alertNotifyFlush(n, &seqno[n]);
+      }
 
+      if (emit[n])
+      {
+         DBG(DBG_FAST_TICK, "notification %d (%d reports)", n, emit[n]);
 
-   S[0] = 0; /* to prevent compiler warning */
+         gpioNotify[n].lastReportTick = eTick;
 
-   s = x;
+         if (emit[n] > gpioStats.maxEmit) gpioStats.maxEmit = emit[n];
 
-   while ((volatile int)s->request != PI_SCRIPT_DELETE)
-   {
-      pthread_mutex_lock(&s->pthMutex);
-      s->run_state = PI_SCRIPT_HALTED;
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
-      pthread_mutex_unlock(&s->pthMutex);
+         if (gpioNotify[n].shm) notifyShmWake(n);
+      }
 
-      s->run_state = PI_SCRIPT_RUNNING;
+      gpioNotify[n].seqno = seqno[n];
+   }
 
-      A  = 0;
-      F  = 0;
-      PC = 0;
-      SP = 0;
+   if (notifyOpenSlots) sem_post(&notifyWriteSem);
 
-      while (((volatile int)s->request   == PI_SCRIPT_RUN    ) &&
-                           (s->run_state == PI_SCRIPT_RUNNING))
-      {
-         instr = s->script.instr[PC];
+   if (changedBits & scriptBits)
+   {
+      slots = 0;
+      bits = changedBits & scriptBits;
 
-         p1o = instr.p[1];
-         p2o = instr.p[2];
+      while (bits)
+      {
+         slots |= scriptGpioSlots[__builtin_ctz(bits)];
+         bits &= (bits - 1);
+      }
 
-         if      (instr.opt[1] == CMD_VAR) instr.p[1] = s->script.var[p1o];
-         else if (instr.opt[1] == CMD_PAR) instr.p[1] = s->script.par[p1o];
+      while (slots)
+      {
+         n = __builtin_ctz(slots);
+         slots &= (slots - 1);
 
-         if      (instr.opt[2] == CMD_VAR) instr.p[2] = s->script.var[p2o];
-         else if (instr.opt[2] == CMD_PAR) instr.p[2] = s->script.par[p2o];
-/*
-         fprintf(stderr, "PC=%d cmd=%d p1o=%d p1=%d p2o=%d p2=%d\n",
-            PC, instr.p[0], p1o, instr.p[1], p2o, instr.p[2]);
-         fflush(stderr);
-*/
-         if (instr.p[0] < PI_CMD_SCRIPT)
+         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
+             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
+             (gpioScript[n].waitBits & changedBits))
          {
-            if (instr.p[3])
+            pthread_mutex_lock(&gpioScript[n].pthMutex);
+
+            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
             {
-               if ((instr.p[3] == sizeof(int)) && ((instr.opt[3] == CMD_VAR) || (instr.opt[3] == CMD_PAR)))
-               {
-                  /* Hack to allow register use in 3rd parameter */
-                  memcpy((char*)&p3o, (char *)instr.p[4], sizeof(int));
-                  if (instr.opt[3] == CMD_VAR) memcpy(buf, (char *)&(s->script.var[p3o]), sizeof(int));
-                  else                         memcpy(buf, (char *)&(s->script.par[p3o]), sizeof(int));
-               }
-               else
-               {
-                  memcpy(buf, (char *)instr.p[4], instr.p[3]);
-               }
+               gpioScript[n].changedBits =
+                  gpioScript[n].waitBits & changedBits;
+               pthread_cond_signal(&gpioScript[n].pthCond);
             }
 
-            A = myDoCommand(instr.p, sizeof(buf)-1, buf);
-
-            F = A;
-
-            PC++;
+            pthread_mutex_unlock(&gpioScript[n].pthMutex);
          }
-         else
-         {
-            p1 = instr.p[1];
-            p2 = instr.p[2];
-
-            switch (instr.p[0])
-            {
-               case PI_CMD_ADD:   A+=p1; F=A;                     PC++; break;
-
-               case PI_CMD_AND:   A&=p1; F=A;                     PC++; break;
-
-               case PI_CMD_CALL:  scrPush(s, &SP, S, PC+1);    PC = p1; break;
-
-               case PI_CMD_CMP:   F=A-p1;                         PC++; break;
-
-               case PI_CMD_DCR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {--s->script.par[p1o]; F=s->script.par[p1o];}
-                  else
-                     {--s->script.var[p1o]; F=s->script.var[p1o];}
-                  PC++;
-                  break;
-
-               case PI_CMD_DCRA:  --A; F=A;                       PC++; break;
-
-               case PI_CMD_DIV:   A/=p1; F=A;                     PC++; break;
+      }
+   }
 
-               case PI_CMD_HALT:  s->run_state = PI_SCRIPT_HALTED;      break;
+   if (eventBits & scriptEventBits)
+   {
+      slots = 0;
+      bits = eventBits & scriptEventBits;
 
-               case PI_CMD_EVTWT: A=scrEvtWait(s, p1); F=A;       PC++; break;
+      while (bits)
+      {
+         slots |= scriptEventSlots[__builtin_ctz(bits)];
+         bits &= (bits - 1);
+      }
 
-               case PI_CMD_INR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {++s->script.par[p1o]; F=s->script.par[p1o];}
-                  else
-                     {++s->script.var[p1o]; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+      while (slots)
+      {
+         n = __builtin_ctz(slots);
+         slots &= (slots - 1);
 
-               case PI_CMD_INRA:  ++A; F=A;                       PC++; break;
+         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
+             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
+             (gpioScript[n].eventBits & eventBits))
+         {
+            pthread_mutex_lock(&gpioScript[n].pthMutex);
 
-               case PI_CMD_JM:    if (F<0)  PC=p1; else PC++;           break;
+            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
+            {
+               gpioScript[n].changedBits =
+                  gpioScript[n].eventBits & eventBits;
+               pthread_cond_signal(&gpioScript[n].pthCond);
+            }
 
-               case PI_CMD_JMP:   PC=p1;                                break;
+            pthread_mutex_unlock(&gpioScript[n].pthMutex);
+         }
+      }
+   }
 
-               case PI_CMD_JNZ:   if (F)    PC=p1; else PC++;           break;
+   if (numSamples) reportedLevel = sample[numSamples-1].level;
+}
 
-               case PI_CMD_JP:    if (F>=0) PC=p1; else PC++;           break;
+static void alertWdogCheck(gpioSample_t *sample, int numSamples)
+{
+   /*
+   Go through and set the last time each GPIO with a watchdog changed state.
+   */
 
-               case PI_CMD_JZ:    if (!F)   PC=p1; else PC++;           break;
+   int i, j;
+   uint32_t LBitV;
+   uint32_t bit, bits;
 
-               case PI_CMD_LD:
-                  if (instr.opt[1] == CMD_PAR) s->script.par[p1o]=p2;
-                  else                         s->script.var[p1o]=p2;
-                  PC++;
-                  break;
+   bits = monitorBits & wdogBits;
 
-               case PI_CMD_LDA:   A=p1;                           PC++; break;
+   while (bits)
+   {
+      i = __builtin_ctz(bits);
+      bit = (1<<i);
+      bits ^= bit;
 
-               case PI_CMD_LDAB:
-                  if ((p1 >= 0) && (p1 < sizeof(buf))) A = buf[p1];
-                  PC++;
-                  break;
+      LBitV = gpioAlert[i].wdLBitV;
 
-               case PI_CMD_MLT:   A*=p1; F=A;                     PC++; break;
+      for (j=0; j<numSamples; j++)
+      {
+         if ((sample[j].level & bit) != LBitV)
+         {
+            LBitV = sample[j].level & bit;
+            gpioAlert[i].wdTick = sample[j].tick;
+         }
+      }
 
-               case PI_CMD_MOD:   A%=p1; F=A;                     PC++; break;
+      gpioAlert[i].wdLBitV = LBitV;
+   }
+}
 
-               case PI_CMD_OR:    A|=p1; F=A;                     PC++; break;
+/*
+   The alert thread only extracts, filters and compacts samples.  The
+   results are passed through a single producer, single consumer ring
+   to the dispatch thread which calls alertEmit.  A slow consumer can
+   never stall sampling; if the ring is full the block is discarded
+   and counted.
+*/
 
-               case PI_CMD_POP:
-                  if (instr.opt[1] == CMD_PAR)
-                     s->script.par[p1o]=scrPop(s, &SP, S);
-                  else
-                     s->script.var[p1o]=scrPop(s, &SP, S);
-                  PC++;
-                  break;
+static void alertRingPut(
+   gpioSample_t *sample, int numSamples, uint32_t changedBits,
+   uint32_t eTick, int tickEnd, uint32_t level)
+{
+   uint32_t head, used;
+   alertBlock_t *blk;
 
-               case PI_CMD_POPA:  A=scrPop(s, &SP, S);            PC++; break;
+   head = alertRingHead;
+   used = head - __atomic_load_n(&alertRingTail, __ATOMIC_ACQUIRE);
 
-               case PI_CMD_PUSH:
-                  if (instr.opt[1] == CMD_PAR)
-                     scrPush(s, &SP, S, s->script.par[p1o]);
-                  else
-                     scrPush(s, &SP, S, s->script.var[p1o]);
-                  PC++;
-                  break;
+   if (used >= ALERT_RING_SLOTS)
+   {
+      /*
+         The tail belongs to the dispatch thread so the newest block
+         is dropped, not the oldest.  An empty block only carries
+         timing, the next one will do.
+      */
 
-               case PI_CMD_PUSHA: scrPush(s, &SP, S, A);          PC++; break;
+      if (numSamples)
+      {
+         gpioStats.alertRingFull++;
+         gpioStats.alertRingDropped += numSamples;
+      }
+      return;
+   }
 
-               case PI_CMD_RET:   PC=scrPop(s, &SP, S);                 break;
+   blk = &alertRing[head & (ALERT_RING_SLOTS-1)];
 
-               case PI_CMD_RL:
-                  if (instr.opt[1] == CMD_PAR)
-                     {s->script.par[p1o]<<=p2; F=s->script.par[p1o];}
-                  else
-                     {s->script.var[p1o]<<=p2; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+   blk->numSamples  = numSamples;
+   blk->tickEnd     = tickEnd;
+   blk->changedBits = changedBits;
+   blk->eTick       = eTick;
+   blk->level       = level;
 
-               case PI_CMD_RLA:   A<<=p1; F=A;                    PC++; break;
+   if (numSamples)
+      memcpy(blk->sample, sample, numSamples * sizeof(gpioSample_t));
 
-               case PI_CMD_RR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {s->script.par[p1o]>>=p2; F=s->script.par[p1o];}
-                  else
-                     {s->script.var[p1o]>>=p2; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+   __atomic_store_n(&alertRingHead, head+1, __ATOMIC_RELEASE);
 
-               case PI_CMD_RRA:   A>>=p1; F=A;                    PC++; break;
+   if (++used > gpioStats.alertRingMaxUsed) gpioStats.alertRingMaxUsed = used;
 
-               case PI_CMD_STA:
-                  if (instr.opt[1] == CMD_PAR) s->script.par[p1o]=A;
-                  else                         s->script.var[p1o]=A;
-                  PC++;
-                  break;
+   sem_post(&alertRingSem);
+}
 
-               case PI_CMD_STAB:
-                  if ((p1 >= 0) && (p1 < sizeof(buf))) buf[p1] = A;
-                  PC++;
-                  break;
+static void * pthDispatchThread(void *x)
+{
+   uint32_t tail;
+   alertBlock_t *blk;
+   uint64_t started;
 
-               case PI_CMD_SUB:   A-=p1; F=A;                     PC++; break;
+   pthDispatchRunning = PI_THREAD_RUNNING;
 
-               case PI_CMD_SYS:
-                  A=scrSys((char*)instr.p[4], A, *(gpioReg + GPLEV0));
-                  F=A;
-                  PC++;
-                  break;
+   while (1)
+   {
+      while (sem_wait(&alertRingSem)) ; /* EINTR */
 
-               case PI_CMD_WAIT:  A=scrWait(s, p1); F=A;          PC++; break;
+      tail = alertRingTail;
 
-               case PI_CMD_X:
-                  if (instr.opt[1] == CMD_PAR) t1 = &s->script.par[p1o];
-                  else                         t1 = &s->script.var[p1o];
+      if (tail == __atomic_load_n(&alertRingHead, __ATOMIC_ACQUIRE))
+         continue;
 
-                  if (instr.opt[2] == CMD_PAR) t2 = &s->script.par[p2o];
-                  else                         t2 = &s->script.var[p2o];
+      blk = &alertRing[tail & (ALERT_RING_SLOTS-1)];
 
-                  scrSwap(t1, t2);
-                  PC++;
-                  break;
+      started = timerNanos();
 
-               case PI_CMD_XA:
-                  if (instr.opt[1] == CMD_PAR)
-                     scrSwap(&s->script.par[p1o], &A);
-                  else
-                     scrSwap(&s->script.var[p1o], &A);
-                  PC++;
-                  break;
+      /* Rebase watchdog timeouts */
+      if (wdogBits && blk->numSamples)
+         alertWdogCheck(blk->sample, blk->numSamples);
 
-               case PI_CMD_XOR:   A^=p1; F=A;                     PC++; break;
+      alertEmit(blk->sample, blk->numSamples, blk->changedBits, blk->eTick);
 
-            }
-         }
+      statsRecord(&gpioStats.emit, (timerNanos() - started) / THOUSAND);
 
-         if (PC >= s->script.instrs) s->run_state = PI_SCRIPT_HALTED;
+      if (blk->tickEnd) reportedLevel = blk->level;
 
-      }
+      __atomic_store_n(&alertRingTail, tail+1, __ATOMIC_RELEASE);
 
-      if ((volatile int)s->request == PI_SCRIPT_HALT)
-         s->run_state = PI_SCRIPT_HALTED;
+      /* reclaim played stream segments, ask for a refill if due */
 
+      waveStreamCheck();
    }
 
    return 0;
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void * pthTimerTick(void *x)
+static void * pthAlertThread(void *x)
 {
-   gpioTimer_t *tp;
    struct timespec req, rem;
+   uint32_t oldLevel, newLevel, level;
+   uint32_t oldSlot,  newSlot;
+   uint32_t expected, ft, sTick;
+   uint32_t changedBits;
+   int32_t diff, minDiff, stickInited;
+   int cycle, pulse;
+   int numSamples, ticks, i;
+   int rp, reports, totalSamples;
+   int stopped;
+   int moreToDo;
+   uint64_t now, lastLoop;
+   gpioSample_t sample[MAX_SAMPLE];
 
-   tp = x;
-
-   while (1)
-   {
-      req.tv_sec  = tp->millis / THOUSAND;
-      req.tv_nsec = (tp->millis % THOUSAND) * THOUSAND * THOUSAND;
+   req.tv_sec = 0;
 
-      while (nanosleep(&req, &rem))
-      {
-         req.tv_sec  = rem.tv_sec;
-         req.tv_nsec = rem.tv_nsec;
-      }
+   /* don't start until DMA started */
 
-      if (tp->ex) (tp->func)(tp->userdata);
-      else        (tp->func)();
-   }
+   spinWhileStarting();
 
-   return 0;
-}
+   reportedLevel = gpioReg[GPLEV0];
 
-/* ----------------------------------------------------------------------- */
+   oldLevel = reportedLevel;
 
+   oldSlot = dmaCurrentSlot(dmaNowAtICB());
 
-static void * pthFifoThread(void *x)
-{
-   char buf[CMD_MAX_EXTENSION];
-   int idx, flags, len, res, i;
-   uintptr_t p[CMD_P_ARR];
-   cmdCtlParse_t ctl;
-   uint32_t *param;
-   char v[CMD_MAX_EXTENSION];
+   oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
 
-   myCreatePipe(PI_INPFIFO, 0662);
+   cycle = (oldSlot/PULSE_PER_CYCLE);
 
-   if ((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
+   pulse = 0;
 
-   myCreatePipe(PI_OUTFIFO, 0664);
+   stopped = 0;
 
-   if ((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
+   moreToDo = 0;
 
-   /* set outFifo non-blocking */
+   stickInited = 0;
 
-   flags = fcntl(fileno(outFifo), F_GETFL, 0);
-   fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
+   sTick = 0;
 
-   /* don't start until DMA started */
+   minDiff = gpioCfg.clockMicros / 2;
 
-   spinWhileStarting();
+   lastLoop = 0;
 
    while (1)
    {
-      if (fgets(buf, sizeof(buf), inpFifo) == NULL)
-         SOFT_ERROR((void*)PI_INIT_FAILED, "fifo fgets failed (%m)");
+      now = timerNanos();
 
-      len = strlen(buf);
+      if (lastLoop)
+         statsRecord(&gpioStats.alertPeriod, (now - lastLoop) / THOUSAND);
 
-      if (len)
+      lastLoop = now;
+
+      /* Check that DMA is running okay */
+
+      if (dmaIn[DMA_CONBLK_AD])
       {
-        --len;
-        buf[len] = 0; /* replace terminating */
+         if (stopped)
+         {
+            DBG(DBG_STARTUP, "****** GOING ******");
+            stopped = 0;
+         }
       }
+      else
+      {
+         stopped = 1;
 
-      ctl.eaten = 0;
-      idx = 0;
+         myGpioDelay(5000);
 
-      while (((ctl.eaten)<len) && (idx >= 0))
-      {
-         if ((idx=cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0)
+         if (runState == PI_RUNNING)
          {
-            /* make sure extensions are null terminated */
+            /* should never be executed, leave code just in case */
 
-            v[p[3]] = 0;
+            gpioCfg.internals |= PI_CFG_STATS;
 
-            res = myDoCommand(p, sizeof(v)-1, v);
+            dmaInitCbs();
+            flushMemory();
+            //cast twice to suppress compiler warning, I belive this cast is ok
+            //because dmaIbus contains bus addresses, not user addresses. --plugwash
+            initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+            myGpioDelay(5000); /* let DMA run for a while */
+            oldSlot = dmaCurrentSlot(dmaNowAtICB());
+            gpioStats.DMARestarts++;
+         }
+      }
 
-            switch (cmdInfo[idx].rv)
-            {
-               case 0:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+      newSlot = dmaCurrentSlot(dmaNowAtICB());
 
-               case 1:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+      newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
 
-               case 2:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+      numSamples = 0;
 
-               case 3:
-                  fprintf(outFifo, "%08X\n", res);
-                  break;
+      /*
+      Extract samples from DMA ring buffer.
+      */
 
-               case 4:
-                  fprintf(outFifo, "%u\n", res);
-                  break;
+      while ((oldSlot != newSlot) && (numSamples < MAX_SAMPLE))
+      {
+         level = myGetLevel(oldSlot++);
 
-               case 5:
-                  fprintf(outFifo, "%s", cmdUsage);
-                  break;
+         sample[numSamples].tick  = sTick;
+         sample[numSamples].level = level;
 
-               case 6:
-                  fprintf(outFifo, "%d", res);
-                  if (res > 0)
-                  {
-                     for (i=0; i<res; i++)
-                     {
-                        fprintf(outFifo, " %d", v[i]);
-                     }
-                  }
-                  fprintf(outFifo, "\n");
-                  break;
+         numSamples++;
 
-               case 7:
-                  if (res < 0) fprintf(outFifo, "%d\n", res);
-                  else
-                  {
-                     fprintf(outFifo, "%d", res);
-                     param = (uint32_t *)v;
-                     for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
-                     {
-                        fprintf(outFifo, " %d", param[i]);
-                     }
-                     fprintf(outFifo, "\n");
-                  }
-                  break;
-            }
-         }
-         else fprintf(outFifo, "%d\n", PI_BAD_FIFO_COMMAND);
-      }
+         sTick += gpioCfg.clockMicros;
 
-      fflush(outFifo);
-   }
+         if (++pulse >= PULSE_PER_CYCLE)
+         {
+            pulse = 0;
 
-   return 0;
-}
+            if (++cycle >= bufferCycles)
+            {
+               cycle = 0;
+               oldSlot = 0;
+            }
 
-/* ----------------------------------------------------------------------- */
+            expected = sTick;
 
-static void *pthSocketThreadHandler(void *fdC)
-{
-   int sock = *(int*)fdC;
-   uintptr_t p[10];
-   uint32_t tmp, response[4];
-   int i;
-   int opt;
-   char buf[CMD_MAX_EXTENSION];
+            sTick = myGetTick(cycle);
 
-   free(fdC);
+            if (stickInited)
+            {
+               diff = sTick - expected;
 
-   /* Disable the Nagle algorithm. */
-   opt = 1;
-   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+               if (abs(diff) > minDiff)
+               {
+                  ft = sample[numSamples-PULSE_PER_CYCLE].tick;
 
-   while (1)
-   {
-      if (sizeof(uintptr_t) == 8)
-      {
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[0] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[1] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[2] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[3] = (uintptr_t)tmp;
-      }
-      else
-      {
-         if (recv(sock, p, 16, MSG_WAITALL) != 16) break;
-      }
+                  ticks = sTick - ft;
 
-      if (p[3])
-      {
-         if (p[3] < sizeof(buf))
-         {
-            /* read extension into buf */
-            if (recv(sock, buf, p[3], MSG_WAITALL) != p[3])
-            {
-               /* Serious error.  No point continuing. */
-               DBG(DBG_ALWAYS,
-                  "recv failed for %"PRIdPTR" bytes, sock=%d", p[3], sock);
+                  for (i=1; i<PULSE_PER_CYCLE; i++)
+                  {
+                     sample[numSamples-PULSE_PER_CYCLE+i].tick =
+                        ((i*ticks)/PULSE_PER_CYCLE) + ft;
+                  }
+               }
 
-               closeOrphanedNotifications(-1, sock);
+               diff += (TICKSLOTS/2);
+
+               if (diff < 0)
+               {
+                  gpioStats.diffTick[0]++;
+               }
 
-               close(sock);
+               else if (diff >= TICKSLOTS)
+               {
+                  gpioStats.diffTick[TICKSLOTS-1]++;
+               }
 
-               return 0;
+               else gpioStats.diffTick[diff]++;
+            }
+            else
+            {
+               stickInited = 1;
+               numSamples = 0;
+               if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+               {
+                  pthAlertRunning = PI_THREAD_RUNNING;
+               }
             }
          }
-         else
-         {
-            /* Serious error.  No point continuing. */
-            DBG(DBG_ALWAYS, "ext too large %"PRIdPTR"(%zd), sock=%d",
-               p[3], sizeof(buf), sock);
+      }
 
-            closeOrphanedNotifications(-1, sock);
+      statsRecord(&gpioStats.alertSamples, numSamples);
 
-            close(sock);
+      if (oldSlot == newSlot) moreToDo = 0; else moreToDo = 1;
 
-            return 0;
-         }
-      }
+      /* Apply glitch filter */
 
-      /* add null terminator in case it's a string */
+      if (numSamples && gFilterBits) alertGlitchFilter(sample, numSamples);
 
-      buf[p[3]] = 0;
+      /* Apply noise filter */
 
-      switch (p[0])
-      {
-         case PI_CMD_NOIB:
+      if (numSamples && nFilterBits) alertNoiseFilter(sample, numSamples);
+
+      /* Compact samples */
 
-            p[3] = gpioNotifyOpenInBand(sock);
+      changedBits = 0;
+      oldLevel &= monitorBits;
+      reports = 0;
+      totalSamples = 0;
 
-           /* Enable the Nagle algorithm. */
-            opt = 0;
-            setsockopt(
-               sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+      for (rp=0; rp<numSamples; rp++)
+      {
+         newLevel = (sample[rp].level & monitorBits);
 
-            break;
+         if (newLevel != oldLevel)
+         {
+            sample[reports].tick  = sample[rp].tick;
+            sample[reports].level = sample[rp].level;
+            changedBits |= (newLevel ^ oldLevel);
+            oldLevel = newLevel;
+
+            reports++;
 
-         case PI_CMD_PROCP:
-            p[3] = myDoCommand(p, sizeof(buf)-1, buf+sizeof(int));
-            if (((int)p[3]) >= 0)
+            if (reports >= MAX_REPORT)
             {
-               memcpy(buf, &p[3], 4);
-               p[3] = 4 + (4*PI_MAX_SCRIPT_PARAMS);
-            }
-            break;
+               totalSamples += reports;
 
-         default:
-            p[3] = myDoCommand(p, sizeof(buf)-1, buf);
-      }
+               gpioStats.numSamples += reports;
 
-      if (sizeof(uintptr_t) == 8) // 64-bit system
-      {
-         for (i = 0; i < 4; i++)
-            response[i] = (uint32_t)p[i];
-         if (write(sock, response, 16) == -1) { /* ignore errors */ }
-      }
-      else // 32-bit system
-      {
-         if (write(sock, p, 16) == -1) { /* ignore errors */ }
+               alertRingPut(sample, reports, changedBits, sample[rp].tick,
+                  0, 0);
+
+               changedBits = 0;
+               reports = 0;
+            }
+         }
       }
 
-      switch (p[0])
+      if (reports)
       {
-         /* extensions */
+         totalSamples += reports;
 
-         case PI_CMD_BI2CZ:
-         case PI_CMD_BSCX:
-         case PI_CMD_CF2:
-         case PI_CMD_FL:
-         case PI_CMD_FR:
-         case PI_CMD_I2CPK:
-         case PI_CMD_I2CRD:
-         case PI_CMD_I2CRI:
-         case PI_CMD_I2CRK:
-         case PI_CMD_I2CZ:
-         case PI_CMD_PROCP:
-         case PI_CMD_SERR:
-         case PI_CMD_SLR:
-         case PI_CMD_SPIX:
-         case PI_CMD_SPIR:
-         case PI_CMD_BSPIX:
+         gpioStats.numSamples += reports;
+      }
 
-            if (((int)p[3]) > 0)
-            {
-               if (write(sock, buf, p[3]) == 1) { /* ignore errors */ }
-            }
-            break;
+      if (numSamples)
+         alertRingPut(sample, reports, changedBits, sTick,
+            1, sample[numSamples-1].level);
+      else
+         alertRingPut(sample, reports, changedBits, sTick, 0, 0);
 
-         default:
-           break;
-      }
-   }
+      if (totalSamples > gpioStats.maxSamples)
+         gpioStats.maxSamples = numSamples;
 
-   closeOrphanedNotifications(-1, sock);
+      req.tv_sec = 0;
+      req.tv_nsec = alert_delays[(gpioCfg.internals>>PI_CFG_ALERT_FREQ)&15];
 
-   close(sock);
+      if (moreToDo)
+      {
+         gpioStats.moreToDo++;
+      }
+      else
+      {
+         gpioStats.alertTicks++;
 
-   DBG(DBG_USER, "Socket %d closed", sock);
+         while (nanosleep(&req, &rem))
+         {
+            req.tv_sec  = rem.tv_sec;
+            req.tv_nsec = rem.tv_nsec;
+         }
+      }
+   }
 
    return 0;
 }
 
-static int addrAllowed(struct sockaddr *saddr)
-{
-   int i;
-   uint32_t addr;
-
-   if (!numSockNetAddr) return 1;
+/* ======================================================================= */
 
-   // FIXME: add IPv6 whitelisting support
-   if (saddr->sa_family != AF_INET) return 0;
+static int scrPop(gpioScript_t *s, int *SP, int *S)
+{
+   if ((*SP) > 0)
+   {
+      return S[--(*SP)];
+   }
+   else
+   {
+      s->run_state = PI_SCRIPT_FAILED;
+      DBG(DBG_ALWAYS, "script %d too many pops", s->id);
+      return 0;
+   }
+}
 
-   addr = ((struct sockaddr_in *) saddr)->sin_addr.s_addr;
+/* ----------------------------------------------------------------------- */
 
-   for (i=0; i<numSockNetAddr; i++)
+static void scrPush(gpioScript_t *s, int *SP, int *S, int val)
+{
+   if ((*SP) < PI_SCRIPT_STACK_SIZE)
    {
-      if (addr == sockNetAddr[i]) return 1;
+      S[(*SP)++] = val;
+   }
+   else
+   {
+      s->run_state = PI_SCRIPT_FAILED;
+      DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
    }
-   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void * pthSocketThread(void *x)
+static void scrSwap(int *v1, int *v2)
 {
-   int fdC=0, c, *sock;
-   struct sockaddr_storage client;
-   pthread_attr_t attr;
+   int t;
 
-   if (pthread_attr_init(&attr))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_init failed (%m)");
+   t=*v1; *v1=*v2; *v2= t;
+}
 
-   if (pthread_attr_setstacksize(&attr, STACK_SIZE))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_setstacksize failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-   if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_setdetachstate failed (%m)");
+static int scrEvtWait(gpioScript_t *s, uint32_t bits)
+{
+   pthread_mutex_lock(&s->pthMutex);
 
-   /* fdSock opened in gpioInitialise so that we can treat
-      failure to bind as fatal. */
+   if (s->request == PI_SCRIPT_RUN)
+   {
+      s->run_state = PI_SCRIPT_WAITING;
+      s->eventBits = bits;
+      intScriptEventBits();
 
-   listen(fdSock, 100);
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
 
-   c = sizeof(client);
+      s->waitBits = 0;
+      intScriptEventBits();
+      s->run_state = PI_SCRIPT_RUNNING;
+   }
 
-   /* don't start until DMA started */
+   pthread_mutex_unlock(&s->pthMutex);
 
-   spinWhileStarting();
+   return s->changedBits;
+}
 
-   while (fdC >= 0)
-   {
-      pthread_t thr;
+/* ----------------------------------------------------------------------- */
 
-      fdC = accept(fdSock, (struct sockaddr *)&client, (socklen_t*)&c);
+static int scrWait(gpioScript_t *s, uint32_t bits)
+{
+   pthread_mutex_lock(&s->pthMutex);
 
-      closeOrphanedNotifications(-1, fdC);
+   if (s->request == PI_SCRIPT_RUN)
+   {
+      s->run_state = PI_SCRIPT_WAITING;
+      s->waitBits = bits;
+      intScriptBits();
 
-      if (addrAllowed((struct sockaddr *)&client))
-      {
-         DBG(DBG_USER, "Connection accepted on socket %d", fdC);
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
 
-         sock = malloc(sizeof(int));
+      s->waitBits = 0;
+      intScriptBits();
+      s->run_state = PI_SCRIPT_RUNNING;
+   }
 
-         *sock = fdC;
-
-         /* Enable tcp_keepalive */
-         int optval = 1;
-         socklen_t optlen = sizeof(optval);
+   pthread_mutex_unlock(&s->pthMutex);
 
-         if (setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0)
-         {
-           DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
-           close(fdC);
-         }
+   return s->changedBits;
+}
 
-         DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+/* ----------------------------------------------------------------------- */
 
-         if (pthread_create
-            (&thr, &attr, pthSocketThreadHandler, (void*) sock) < 0)
-            SOFT_ERROR((void*)PI_INIT_FAILED,
-               "socket pthread_create failed (%m)");
-      }
-      else
-      {
-         DBG(DBG_ALWAYS, "Connection rejected, closing");
-         close(fdC);
-      }
-   }
+static int scrSys(char *cmd, uint32_t p1, uint32_t p2)
+{
+   char buf[1024];
+   int status;
 
-   if (fdC < 0)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
+   if (!myScriptNameValid(cmd))
+      SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
 
-   return 0;
-}
+   snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
 
-/* ======================================================================= */
+   DBG(DBG_USER, "%s", buf);
 
-static void initCheckLockFile(void)
-{
-   int fd;
-   int count;
-   int pid;
-   int err;
-   int delete;
-   char str[20];
+   status = system(buf);
 
-   fd = open(PI_LOCKFILE, O_RDONLY);
+   if (status < 0) status = PI_BAD_SHELL_STATUS;
 
-   if (fd != -1)
-   {
-      DBG(DBG_STARTUP, "lock file exists");
-      delete = 1;
+   return status;
+}
 
-      count = read(fd, str, sizeof(str)-1);
+/* ----------------------------------------------------------------------- */
 
-      if (count)
-      {
-         pid = atoi(str);
-         err = kill(pid, 0);
-         if (!err) delete = 0; /* process still exists */
-         DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
-      }
+/*
+   Scripts are compiled by gpioStoreScript into one scrOp_t per
+   instruction plus a final SCR_END.  Each operand is resolved once to
+   a pointer at a variable, a parameter, or the constant held in the op
+   so the handlers need not test operand kinds.  pthScript dispatches
+   with computed gotos.  Arithmetic and register ops fall straight
+   through to the next handler, jumps and commands which may block or
+   change the script state check for a halt request first.
+*/
 
-      close(fd);
-      DBG(DBG_STARTUP, "lock file delete=%d", delete);
+static int scrOpCode(unsigned cmd)
+{
+   switch (cmd)
+   {
+      case PI_CMD_READ:  return SCR_READ;
+      case PI_CMD_WRITE: return SCR_WRITE;
+      case PI_CMD_TICK:  return SCR_TICK;
+
+      case PI_CMD_ADD:   return SCR_ADD;
+      case PI_CMD_AND:   return SCR_AND;
+      case PI_CMD_CALL:  return SCR_CALL;
+      case PI_CMD_CMP:   return SCR_CMP;
+      case PI_CMD_DCR:   return SCR_DCR;
+      case PI_CMD_DCRA:  return SCR_DCRA;
+      case PI_CMD_DIV:   return SCR_DIV;
+      case PI_CMD_EVTWT: return SCR_EVTWT;
+      case PI_CMD_HALT:  return SCR_HALT;
+      case PI_CMD_INR:   return SCR_INR;
+      case PI_CMD_INRA:  return SCR_INRA;
+      case PI_CMD_JM:    return SCR_JM;
+      case PI_CMD_JMP:   return SCR_JMP;
+      case PI_CMD_JNZ:   return SCR_JNZ;
+      case PI_CMD_JP:    return SCR_JP;
+      case PI_CMD_JZ:    return SCR_JZ;
+      case PI_CMD_LD:    return SCR_LD;
+      case PI_CMD_LDA:   return SCR_LDA;
+      case PI_CMD_LDAB:  return SCR_LDAB;
+      case PI_CMD_MLT:   return SCR_MLT;
+      case PI_CMD_MOD:   return SCR_MOD;
+      case PI_CMD_OR:    return SCR_OR;
+      case PI_CMD_POP:   return SCR_POP;
+      case PI_CMD_POPA:  return SCR_POPA;
+      case PI_CMD_PUSH:  return SCR_PUSH;
+      case PI_CMD_PUSHA: return SCR_PUSHA;
+      case PI_CMD_RET:   return SCR_RET;
+      case PI_CMD_RL:    return SCR_RL;
+      case PI_CMD_RLA:   return SCR_RLA;
+      case PI_CMD_RR:    return SCR_RR;
+      case PI_CMD_RRA:   return SCR_RRA;
+      case PI_CMD_STA:   return SCR_STA;
+      case PI_CMD_STAB:  return SCR_STAB;
+      case PI_CMD_SUB:   return SCR_SUB;
+      case PI_CMD_SYS:   return SCR_SYS;
+      case PI_CMD_WAIT:  return SCR_WAIT;
+      case PI_CMD_X:     return SCR_X;
+      case PI_CMD_XA:    return SCR_XA;
+      case PI_CMD_XOR:   return SCR_XOR;
 
-      if (delete) unlink(PI_LOCKFILE);
+      default:
+         if (cmd < PI_CMD_SCRIPT) return SCR_CMD;
+         return SCR_NOP;
    }
 }
 
-static int initGrabLockFile(void)
+/* ----------------------------------------------------------------------- */
+
+static int *scrOperand(gpioScript_t *s, int opt, int reg, int *k)
 {
-   int fd;
-   int lockResult;
-   char pidStr[20];
+   /* a register operand given as a number names a variable */
 
-   initCheckLockFile();
+   if (opt == CMD_PAR) return &s->script.par[*k];
+   if ((opt == CMD_VAR) || reg) return &s->script.var[*k];
+   return k;
+}
 
-   /* try to grab the lock file */
+/* ----------------------------------------------------------------------- */
 
-   fd = open(PI_LOCKFILE, O_WRONLY|O_CREAT|O_EXCL|O_TRUNC, 0644);
+static int scrCompile(gpioScript_t *s)
+{
+   cmdInstr_t *instr;
+   scrOp_t *code;
+   int i, reg1, reg2;
 
-   if (fd != -1)
+   code = calloc(s->script.instrs + 1, sizeof(scrOp_t));
+
+   if (code == NULL) return PI_NO_MEMORY;
+
+   for (i=0; i<s->script.instrs; i++)
    {
-      lockResult = flock(fd, LOCK_EX|LOCK_NB);
+      instr = &s->script.instr[i];
 
-      if(lockResult == 0)
-      {
-         sprintf(pidStr, "%d\n", (int)getpid());
+      code[i].op    = scrOpCode(instr->p[0]);
+      code[i].k1    = instr->p[1];
+      code[i].k2    = instr->p[2];
+      code[i].instr = instr;
 
-         if (write(fd, pidStr, strlen(pidStr)) == -1)
-         {
-            /* ignore errors */
-         }
-      }
-      else
+      switch (code[i].op)
       {
-         close(fd);
-         return -1;
+         case SCR_DCR: case SCR_INR: case SCR_POP: case SCR_PUSH:
+         case SCR_STA: case SCR_XA: case SCR_LD: case SCR_RL: case SCR_RR:
+            reg1 = 1; reg2 = 0; break;
+
+         case SCR_X:
+            reg1 = 1; reg2 = 1; break;
+
+         default:
+            reg1 = 0; reg2 = 0;
       }
+
+      code[i].v1 = scrOperand(s, instr->opt[1], reg1, &code[i].k1);
+      code[i].v2 = scrOperand(s, instr->opt[2], reg2, &code[i].k2);
    }
 
-   return fd;
-}
+   code[i].op = SCR_END;
 
-/* ----------------------------------------------------------------------- */
+   s->code = code;
 
-static uint32_t * initMapMem(int fd, uint32_t addr, uint32_t len)
-{
-    return (uint32_t *) mmap(0, len,
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_LOCKED,
-       fd, addr);
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int initCheckPermitted(void)
+static int scrCommand(gpioScript_t *s, cmdInstr_t *instr, scrOp_t *op,
+                      char *buf, unsigned bufSize)
 {
-   DBG(DBG_STARTUP, "");
+   uintptr_t p[CMD_P_ARR];
+   int p3o;
 
-   if (!pi_ispi)
-   {
-      DBG(DBG_ALWAYS,
-         "\n" \
-         "+---------------------------------------------------------+\n" \
-         "|Sorry, this system does not appear to be a raspberry pi. |\n" \
-         "|aborting.                                                |\n" \
-         "+---------------------------------------------------------+\n\n");
-      return -1;
-   }
+   memcpy(p, instr->p, sizeof(instr->p));
 
-   if ((fdMem = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
+   if ((instr->opt[1] == CMD_VAR) || (instr->opt[1] == CMD_PAR))
+      p[1] = *op->v1;
+
+   if ((instr->opt[2] == CMD_VAR) || (instr->opt[2] == CMD_PAR))
+      p[2] = *op->v2;
+
+   if (p[3])
    {
-      DBG(DBG_ALWAYS,
-         "\n" \
-         "+---------------------------------------------------------+\n" \
-         "|Sorry, you don't have permission to run this program.    |\n" \
-         "|Try running as root, e.g. precede the command with sudo. |\n" \
-         "+---------------------------------------------------------+\n\n");
-      return -1;
+      if ((p[3] == sizeof(int)) &&
+          ((instr->opt[3] == CMD_VAR) || (instr->opt[3] == CMD_PAR)))
+      {
+         /* Hack to allow register use in 3rd parameter */
+         memcpy((char*)&p3o, (char *)p[4], sizeof(int));
+         if (instr->opt[3] == CMD_VAR)
+            memcpy(buf, (char *)&(s->script.var[p3o]), sizeof(int));
+         else
+            memcpy(buf, (char *)&(s->script.par[p3o]), sizeof(int));
+      }
+      else
+      {
+         memcpy(buf, (char *)p[4], p[3]);
+      }
    }
-   return 0;
+
+   return myDoCommand(p, bufSize, buf);
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int initPeripherals(void)
+#define SCR_NEXT goto *dispatch[(op = &code[++PC])->op]
+
+#define SCR_JUMP(x) do {PC = (x); goto jump;} while (0)
+
+static void *pthScript(void *x)
 {
-   DBG(DBG_STARTUP, "");
+   static void *dispatch[SCR_OPS] =
+   {
+      &&op_end,  &&op_cmd,  &&op_read, &&op_write, &&op_tick,
+      &&op_add,  &&op_and,  &&op_call, &&op_cmp,   &&op_dcr,
+      &&op_dcra, &&op_div,  &&op_evtwt,&&op_halt,  &&op_inr,
+      &&op_inra, &&op_jm,   &&op_jmp,  &&op_jnz,   &&op_jp,
+      &&op_jz,   &&op_ld,   &&op_lda,  &&op_ldab,  &&op_mlt,
+      &&op_mod,  &&op_nop,  &&op_or,   &&op_pop,   &&op_popa,
+      &&op_push, &&op_pusha,&&op_ret,  &&op_rl,    &&op_rla,
+      &&op_rr,   &&op_rra,  &&op_sta,  &&op_stab,  &&op_sub,
+      &&op_sys,  &&op_wait, &&op_x,    &&op_xa,    &&op_xor,
+   };
 
-   gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
+   gpioScript_t *s;
+   scrOp_t *code, *op;
+   int PC, A, F, SP, p1;
+   int S[PI_SCRIPT_STACK_SIZE];
+   char buf[CMD_MAX_EXTENSION];
 
-   if (gpioReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
 
-   dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
+   S[0] = 0; /* to prevent compiler warning */
 
-   if (dmaReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
+   s = x;
 
-   /* we should know if we are running on a BCM2711 by now */
+   code = s->code;
 
-   if (gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET)
-   {
-      if (pi_is_2711)
-         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
-      else
-         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
-   }
-      
-   if (gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET)
+   while ((volatile int)s->request != PI_SCRIPT_DELETE)
    {
-      if (pi_is_2711)
-         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
-      else
-         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
-   }
-      
-   dmaIn =  dmaReg + (gpioCfg.DMAprimaryChannel   * 0x40);
-   dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
+      pthread_mutex_lock(&s->pthMutex);
+      s->run_state = PI_SCRIPT_HALTED;
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+      pthread_mutex_unlock(&s->pthMutex);
 
-   DBG(DBG_STARTUP, "DMA #%d @ %08"PRIXPTR,
-      gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
+      s->run_state = PI_SCRIPT_RUNNING;
 
-   DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
+      A  = 0;
+      F  = 0;
+      SP = 0;
 
-   clkReg  = initMapMem(fdMem, CLK_BASE,  CLK_LEN);
+      SCR_JUMP(0);
 
-   if (clkReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
+      /* hardware commands */
 
-   systReg  = initMapMem(fdMem, SYST_BASE,  SYST_LEN);
+      op_cmd:
+         A = scrCommand(s, op->instr, op, buf, sizeof(buf)-1);
+         F = A;
+         SCR_JUMP(PC+1);
 
-   if (systReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
+      op_read:
+         A = gpioRead(*op->v1); F = A;
+         SCR_NEXT;
 
-   spiReg  = initMapMem(fdMem, SPI_BASE,  SPI_LEN);
+      op_write:
+         p1 = *op->v1;
+         if (myPermit(p1)) A = gpioWrite(p1, *op->v2);
+         else
+         {
+            DBG(DBG_USER, "gpioWrite: gpio %d, no permission to update", p1);
+            A = PI_NOT_PERMITTED;
+         }
+         F = A;
+         SCR_NEXT;
+
+      op_tick:  A = gpioTick(); F = A;        SCR_NEXT;
+
+      /* accumulator and register commands */
+
+      op_add:   A += *op->v1; F = A;         SCR_NEXT;
+      op_and:   A &= *op->v1; F = A;         SCR_NEXT;
+      op_cmp:   F = A - *op->v1;             SCR_NEXT;
+      op_dcr:   F = --(*op->v1);             SCR_NEXT;
+      op_dcra:  --A; F = A;                  SCR_NEXT;
+      op_div:   A /= *op->v1; F = A;         SCR_NEXT;
+      op_inr:   F = ++(*op->v1);             SCR_NEXT;
+      op_inra:  ++A; F = A;                  SCR_NEXT;
+      op_ld:    *op->v1 = *op->v2;           SCR_NEXT;
+      op_lda:   A = *op->v1;                 SCR_NEXT;
+      op_mlt:   A *= *op->v1; F = A;         SCR_NEXT;
+      op_mod:   A %= *op->v1; F = A;         SCR_NEXT;
+      op_nop:                                SCR_NEXT;
+      op_or:    A |= *op->v1; F = A;         SCR_NEXT;
+      op_rl:    F = (*op->v1 <<= *op->v2);   SCR_NEXT;
+      op_rla:   A <<= *op->v1; F = A;        SCR_NEXT;
+      op_rr:    F = (*op->v1 >>= *op->v2);   SCR_NEXT;
+      op_rra:   A >>= *op->v1; F = A;        SCR_NEXT;
+      op_sta:   *op->v1 = A;                 SCR_NEXT;
+      op_sub:   A -= *op->v1; F = A;         SCR_NEXT;
+      op_x:     scrSwap(op->v1, op->v2);     SCR_NEXT;
+      op_xa:    scrSwap(op->v1, &A);         SCR_NEXT;
+      op_xor:   A ^= *op->v1; F = A;         SCR_NEXT;
+
+      op_ldab:
+         p1 = *op->v1;
+         if ((p1 >= 0) && (p1 < sizeof(buf))) A = buf[p1];
+         SCR_NEXT;
+
+      op_stab:
+         p1 = *op->v1;
+         if ((p1 >= 0) && (p1 < sizeof(buf))) buf[p1] = A;
+         SCR_NEXT;
+
+      /* stack commands, these may fail the script */
+
+      op_pop:   *op->v1 = scrPop(s, &SP, S);          SCR_JUMP(PC+1);
+      op_popa:  A = scrPop(s, &SP, S);                SCR_JUMP(PC+1);
+      op_push:  scrPush(s, &SP, S, *op->v1);          SCR_JUMP(PC+1);
+      op_pusha: scrPush(s, &SP, S, A);                SCR_JUMP(PC+1);
+
+      /* flow control */
+
+      op_call:  scrPush(s, &SP, S, PC+1);             SCR_JUMP(*op->v1);
+      op_ret:   p1 = scrPop(s, &SP, S);               SCR_JUMP(p1);
+      op_jm:    if (F<0)  SCR_JUMP(*op->v1);          SCR_NEXT;
+      op_jmp:   SCR_JUMP(*op->v1);
+      op_jnz:   if (F)    SCR_JUMP(*op->v1);          SCR_NEXT;
+      op_jp:    if (F>=0) SCR_JUMP(*op->v1);          SCR_NEXT;
+      op_jz:    if (!F)   SCR_JUMP(*op->v1);          SCR_NEXT;
+
+      /* commands which may block */
+
+      op_evtwt: A = scrEvtWait(s, *op->v1); F = A;    SCR_JUMP(PC+1);
+      op_wait:  A = scrWait(s, *op->v1); F = A;       SCR_JUMP(PC+1);
+
+      op_sys:
+         A = scrSys((char*)op->instr->p[4], A, *(gpioReg + GPLEV0));
+         F = A;
+         SCR_JUMP(PC+1);
+
+      jump:
+         /* leaving the script halts it, as does running off the end */
+
+         if ((unsigned)PC > (unsigned)s->script.instrs) PC = s->script.instrs;
+
+         if (((volatile int)s->request   == PI_SCRIPT_RUN    ) &&
+                           (s->run_state == PI_SCRIPT_RUNNING))
+         {
+            op = &code[PC];
+            goto *dispatch[op->op];
+         }
 
-   if (spiReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
+         goto stopped;
 
-   pwmReg  = initMapMem(fdMem, PWM_BASE,  PWM_LEN);
+      op_end:
+      op_halt:
+         s->run_state = PI_SCRIPT_HALTED;
 
-   if (pwmReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
+      stopped:
+      if ((volatile int)s->request == PI_SCRIPT_HALT)
+         s->run_state = PI_SCRIPT_HALTED;
 
-   pcmReg  = initMapMem(fdMem, PCM_BASE,  PCM_LEN);
+   }
 
-   if (pcmReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
+   return 0;
+}
 
-   auxReg  = initMapMem(fdMem, AUX_BASE,  AUX_LEN);
+/* ----------------------------------------------------------------------- */
 
-   if (auxReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
+/*
+   All timers are run by one thread.  The scheduled timers are held
+   in a binary heap ordered on their next deadline, and the thread
+   sleeps on timerCond until the earliest deadline using an absolute
+   CLOCK_MONOTONIC time.  Each deadline is the previous deadline plus
+   the period, so callback run time and wake up latency do not
+   accumulate.  If a timer falls more than a period behind the missed
+   periods are skipped and counted rather than run back to back.
+*/
 
-   padsReg  = initMapMem(fdMem, PADS_BASE,  PADS_LEN);
+static uint64_t timerNanos(void)
+{
+   struct timespec ts;
 
-   if (padsReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
+   clock_gettime(CLOCK_MONOTONIC, &ts);
 
-   bscsReg  = initMapMem(fdMem, BSCS_BASE,  BSCS_LEN);
+   return ((uint64_t)ts.tv_sec * BILLION) + ts.tv_nsec;
+}
 
-   if (bscsReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-   return 0;
+static void timerHeapSet(int pos, int id)
+{
+   timerHeap[pos] = id;
+   gpioTimer[id].heapPos = pos;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int initZaps
-   (int  pmapFd, void *virtualBase, int  basePage, int  pages)
+static void timerHeapUp(int pos)
 {
-   int n;
-   uintptr_t index;
-   off_t offset;
-   ssize_t t;
-   uint32_t physical;
-   int status;
-   uintptr_t pageAdr;
-   unsigned long long pa;
+   int id, parent;
 
-   DBG(DBG_STARTUP, "");
+   id = timerHeap[pos];
 
-   status = 0;
+   while (pos)
+   {
+      parent = (pos - 1) / 2;
 
-   pageAdr = (uintptr_t) dmaVirt[basePage];
+      if (gpioTimer[timerHeap[parent]].due <= gpioTimer[id].due) break;
 
-   index  = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
+      timerHeapSet(pos, timerHeap[parent]);
+      pos = parent;
+   }
 
-   offset = lseek(pmapFd, index, SEEK_SET);
+   timerHeapSet(pos, id);
+}
 
-   if (offset != index)
-      SOFT_ERROR(PI_INIT_FAILED, "lseek pagemap failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-   for (n=0; n<pages; n++)
+static void timerHeapDown(int pos)
+{
+   int id, child;
+
+   id = timerHeap[pos];
+
+   while ((child = (2 * pos) + 1) < timerHeapLen)
    {
-      t = read(pmapFd, &pa, sizeof(pa));
+      if (((child + 1) < timerHeapLen) &&
+          (gpioTimer[timerHeap[child+1]].due < gpioTimer[timerHeap[child]].due))
+         child++;
 
-      if (t != sizeof(pa))
-         SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
+      if (gpioTimer[id].due <= gpioTimer[timerHeap[child]].due) break;
 
-      DBG(DBG_STARTUP, "pf%d=%016llX", n, pa);
+      timerHeapSet(pos, timerHeap[child]);
+      pos = child;
+   }
 
-      physical = 0x3FFFFFFF & (PAGE_SIZE * (pa & 0xFFFFFFFF));
-
-      if (physical)
-      {
-         //cast twice to suppress warning, I belive this is ok as these
-         //are bus addresses, not virtual addresses. --plugwash
-         dmaBus[basePage+n] = (dmaPage_t *)(uintptr_t) (physical | pi_dram_bus);
-
-         dmaVirt[basePage+n] = mmap
-         (
-            (void *)pageAdr,
-            PAGE_SIZE,
-            PROT_READ|PROT_WRITE,
-            MAP_SHARED|MAP_FIXED|MAP_LOCKED|MAP_NORESERVE,
-            fdMem,
-            physical
-         );
-      }
-      else status = 1;
-
-      pageAdr += PAGE_SIZE;
-   }
-
-   return status;
-}
+   timerHeapSet(pos, id);
+}
 
 /* ----------------------------------------------------------------------- */
 
-static int initPagemapBlock(int block)
+static void timerHeapRemove(int id)
 {
-   int trys, ok;
-   unsigned pageNum;
+   int pos;
 
-   DBG(DBG_STARTUP, "block=%d", block);
+   pos = gpioTimer[id].heapPos;
 
-   dmaPMapBlk[block] = mmap(
-       0, (PAGES_PER_BLOCK*PAGE_SIZE),
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
-       -1, 0);
+   if (pos < 0) return;
 
-   if (dmaPMapBlk[block] == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+   gpioTimer[id].heapPos = -1;
 
-   /* force allocation of physical memory */
+   if (--timerHeapLen == pos) return;
 
-   memset((void *)dmaPMapBlk[block], 0xAA, (PAGES_PER_BLOCK*PAGE_SIZE));
+   timerHeapSet(pos, timerHeap[timerHeapLen]);
+   timerHeapUp(pos);
+   timerHeapDown(gpioTimer[timerHeap[pos]].heapPos);
+}
 
-   memset((void *)dmaPMapBlk[block], 0xFF, (PAGES_PER_BLOCK*PAGE_SIZE));
+/* ----------------------------------------------------------------------- */
 
-   memset((void *)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK*PAGE_SIZE));
+static void timerUnlock(void *locked)
+{
+   /* cleanup handler, the thread may be cancelled inside a callback */
 
-   pageNum = block * PAGES_PER_BLOCK;
+   if (*(int *)locked) pthread_mutex_unlock(&timerMutex);
+}
 
-   dmaVirt[pageNum] = mmap(
-       0, (PAGES_PER_BLOCK*PAGE_SIZE),
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
-       -1, 0);
+/* ----------------------------------------------------------------------- */
 
-   if (dmaVirt[pageNum] == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+static void *pthTimerThread(void *x)
+{
+   gpioTimer_t *tp;
+   struct timespec ts;
+   uint64_t now, late, skip;
+   callbk_t func;
+   void *userdata;
+   unsigned ex;
+   int locked;
 
-   munmap(dmaVirt[pageNum], PAGES_PER_BLOCK*PAGE_SIZE);
+   locked = 1;
 
-   trys = 0;
-   ok = 0;
+   pthread_mutex_lock(&timerMutex);
 
-   while ((trys < 10) && !ok)
+   pthread_cleanup_push(timerUnlock, &locked);
+
+   while (1)
    {
-      if (initZaps(fdPmap,
-                    dmaPMapBlk[block],
-                    pageNum,
-                    PAGES_PER_BLOCK) == 0) ok = 1;
-      else myGpioDelay(50000);
+      if (!timerHeapLen)
+      {
+         pthread_cond_wait(&timerCond, &timerMutex);
+         continue;
+      }
 
-      ++trys;
-   }
+      tp = &gpioTimer[timerHeap[0]];
 
-   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
+      now = timerNanos();
 
-   return 0;
-}
+      if (now < tp->due)
+      {
+         ts.tv_sec  = tp->due / BILLION;
+         ts.tv_nsec = tp->due % BILLION;
 
-static int initMboxBlock(int block)
-{
-   int n, ok;
-   unsigned page;
-   uintptr_t virtualAdr;
-   uintptr_t busAdr;
+         pthread_cond_timedwait(&timerCond, &timerMutex, &ts);
+         continue;
+      }
 
-   DBG(DBG_STARTUP, "block=%d", block);
+      late = now - tp->due;
 
-   ok = mbDMAAlloc
-      (&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
+      if (late > UINT32_MAX) late = UINT32_MAX;
 
-   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
+      if (!tp->calls || (late < tp->lateMin)) tp->lateMin = late;
+      if (late > tp->lateMax) tp->lateMax = late;
 
-   page = block * PAGES_PER_BLOCK;
+      tp->lateLast = late;
+      tp->lateSum += late;
+      tp->calls++;
 
-   virtualAdr = (uintptr_t) dmaMboxBlk[block].virtual_addr;
-   busAdr = dmaMboxBlk[block].bus_addr;
+      skip = (now - tp->due) / tp->period;
 
-   for (n=0; n<PAGES_PER_BLOCK; n++)
-   {
-      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
-      dmaBus[page+n] = (dmaPage_t *) busAdr;
-      virtualAdr += PAGE_SIZE;
-      busAdr += PAGE_SIZE;
-   }
+      tp->missed += skip;
+      tp->due += (skip + 1) * tp->period;
 
-   return 0;
-}
+      timerHeapDown(0);
 
-/* ----------------------------------------------------------------------- */
+      func     = tp->func;
+      ex       = tp->ex;
+      userdata = tp->userdata;
 
-static int initAllocDMAMem(void)
-{
-   int i, servoCycles, superCycles;
-   int status;
+      timerActive = tp->id;
 
-   DBG(DBG_STARTUP, "");
+      locked = 0;
+      pthread_mutex_unlock(&timerMutex);
 
-   /* Calculate the number of blocks needed for buffers.  The number
-      of blocks must be a multiple of the 20ms servo cycle.
-   */
+      if (ex) (func)(userdata);
+      else    (func)();
 
-   servoCycles = gpioCfg.bufferMilliseconds / 20;
-   if           (gpioCfg.bufferMilliseconds % 20) servoCycles++;
+      pthread_mutex_lock(&timerMutex);
+      locked = 1;
 
-   bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
+      timerActive = -1;
 
-   superCycles = bufferCycles / SUPERCYCLE;
-   if           (bufferCycles % SUPERCYCLE) superCycles++;
+      pthread_cond_broadcast(&timerDone);
+   }
 
-   bufferCycles = SUPERCYCLE * superCycles;
+   pthread_cleanup_pop(1);
 
-   bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
+   return 0;
+}
 
-   DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d",
-      gpioCfg.bufferMilliseconds, gpioCfg.clockMicros,
-      bufferBlocks, bufferCycles);
+/* ----------------------------------------------------------------------- */
 
-   /* allocate memory for pointers to virtual and bus memory pages */
 
-   dmaVirt = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-       PROT_READ|PROT_WRITE,
-       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-       -1, 0);
+static void * pthFifoThread(void *x)
+{
+   char buf[CMD_MAX_EXTENSION];
+   int idx, flags, len, res, i;
+   uintptr_t p[CMD_P_ARR];
+   cmdCtlParse_t ctl;
+   uint32_t *param;
+   char v[CMD_MAX_EXTENSION];
 
-   if (dmaVirt == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
+   myCreatePipe(PI_INPFIFO, 0662);
 
-   dmaBus = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-       PROT_READ|PROT_WRITE,
-       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-       -1, 0);
+   if ((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
 
-   if (dmaBus == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
+   myCreatePipe(PI_OUTFIFO, 0664);
 
-   dmaIVirt = (dmaIPage_t **) dmaVirt;
-   dmaIBus  = (dmaIPage_t **) dmaBus;
+   if ((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
 
-   dmaOVirt = (dmaOPage_t **)(dmaVirt + (PAGES_PER_BLOCK*bufferBlocks));
-   dmaOBus  = (dmaOPage_t **)(dmaBus  + (PAGES_PER_BLOCK*bufferBlocks));
+   /* set outFifo non-blocking */
 
-   if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
-       ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) &&
-        (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS)))
-   {
-      /* pagemap allocation of DMA memory */
+   flags = fcntl(fileno(outFifo), F_GETFL, 0);
+   fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
 
-      dmaPMapBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-          PROT_READ|PROT_WRITE,
-          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-          -1, 0);
+   /* don't start until DMA started */
 
-      if (dmaPMapBlk == MAP_FAILED)
-         SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
+   spinWhileStarting();
 
-      fdPmap = open("/proc/self/pagemap", O_RDONLY);
+   while (1)
+   {
+      if (fgets(buf, sizeof(buf), inpFifo) == NULL)
+         SOFT_ERROR((void*)PI_INIT_FAILED, "fifo fgets failed (%m)");
 
-      if (fdPmap < 0)
-         SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
+      len = strlen(buf);
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      if (len)
       {
-         status = initPagemapBlock(i);
-         if (status < 0)
-         {
-            close(fdPmap);
-            return status;
-         }
+        --len;
+        buf[len] = 0; /* replace terminating */
       }
 
-      close(fdPmap);
-
-      DBG(DBG_STARTUP, "dmaPMapBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
-         (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
-   }
-   else
-   {
-      /* mailbox allocation of DMA memory */
+      ctl.eaten = 0;
+      idx = 0;
 
-      dmaMboxBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t),
-          PROT_READ|PROT_WRITE,
-          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-          -1, 0);
+      while (((ctl.eaten)<len) && (idx >= 0))
+      {
+         if ((idx=cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0)
+         {
+            /* make sure extensions are null terminated */
 
-      if (dmaMboxBlk == MAP_FAILED)
-         SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
+            v[p[3]] = 0;
 
-      fdMbox = mbOpen();
+            res = myDoCommand(p, sizeof(v)-1, v);
 
-      if (fdMbox < 0)
-         SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
+            switch (cmdInfo[idx].rv)
+            {
+               case 0:
+                  fprintf(outFifo, "%d\n", res);
+                  break;
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         status = initMboxBlock(i);
-         if (status < 0)
-         {
-            mbClose(fdMbox);
-            return status;
-         }
-      }
+               case 1:
+                  fprintf(outFifo, "%d\n", res);
+                  break;
 
-      mbClose(fdMbox);
+               case 2:
+                  fprintf(outFifo, "%d\n", res);
+                  break;
 
-      DBG(DBG_STARTUP, "dmaMboxBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
-         (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
-   }
+               case 3:
+                  fprintf(outFifo, "%08X\n", res);
+                  break;
 
-   DBG(DBG_STARTUP,
-      "gpioReg=%08"PRIXPTR" pwmReg=%08"PRIXPTR" pcmReg=%08"PRIXPTR" clkReg=%08"PRIXPTR" auxReg=%08"PRIXPTR,
-      (uintptr_t)gpioReg, (uintptr_t)pwmReg,
-      (uintptr_t)pcmReg,  (uintptr_t)clkReg, (uintptr_t)auxReg);
+               case 4:
+                  fprintf(outFifo, "%u\n", res);
+                  break;
 
-   for (i=0; i<DMAI_PAGES; i++)
-      DBG(DBG_STARTUP, "dmaIBus[%d]=%08"PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+               case 5:
+                  fprintf(outFifo, "%s", cmdUsage);
+                  break;
 
-   if (gpioCfg.dbgLevel >= DBG_DMACBS)
-   {
-      fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
-      for (i=0; i<NUM_CBS; i++) dmaCbPrint(i);
+               case 6:
+                  fprintf(outFifo, "%d", res);
+                  if (res > 0)
+                  {
+                     for (i=0; i<res; i++)
+                     {
+                        fprintf(outFifo, " %d", v[i]);
+                     }
+                  }
+                  fprintf(outFifo, "\n");
+                  break;
+
+               case 7:
+                  if (res < 0) fprintf(outFifo, "%d\n", res);
+                  else
+                  {
+                     fprintf(outFifo, "%d", res);
+                     param = (uint32_t *)v;
+                     for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
+                     {
+                        fprintf(outFifo, " %d", param[i]);
+                     }
+                     fprintf(outFifo, "\n");
+                  }
+                  break;
+
+               case 9:
+                  if (res < 0) fprintf(outFifo, "%d\n", res);
+                  else
+                  {
+                     /* all the gpioStatus_t fields on one line */
+
+                     fprintf(outFifo, "%d", (int)(res/sizeof(gpioStatus_t)));
+                     param = (uint32_t *)v;
+                     for (i=0; i<res/4; i++)
+                     {
+                        fprintf(outFifo, " %u", param[i]);
+                     }
+                     fprintf(outFifo, "\n");
+                  }
+                  break;
+
+               case 10:
+               case 11:
+                  if (res < 0) fprintf(outFifo, "%d\n", res);
+                  else
+                  {
+                     /* all the gpioStatistics_t or gpioWaveSpace_t fields */
+
+                     param = (uint32_t *)v;
+                     fprintf(outFifo, "%u", param[0]);
+                     for (i=1; i<res/4; i++)
+                     {
+                        fprintf(outFifo, " %u", param[i]);
+                     }
+                     fprintf(outFifo, "\n");
+                  }
+                  break;
+            }
+         }
+         else fprintf(outFifo, "%d\n", PI_BAD_FIFO_COMMAND);
+      }
+
+      fflush(outFifo);
    }
 
    return 0;
@@ -7748,4324 +8584,8349 @@ static int initAllocDMAMem(void)
 
 /* ----------------------------------------------------------------------- */
 
-static void initPWM(unsigned bits)
+/*
+   The socket interface is serviced by gpioCfg.socketWorkers threads
+   (see gpioCfgSocketWorkers) sharing one epoll set.  Connection
+   sockets are non-blocking and registered EPOLLONESHOT so that only
+   one worker services a connection at a time.  Each connection
+   buffers its input until a complete command (the 16 byte header
+   plus any extension) has arrived, and holds any response the socket
+   will not take until the client reads it.  A connection with a
+   response pending is not read from again until the response has
+   gone.
+
+   A command which may block (see sockCmdBlocks) is not run by a
+   worker.  The connection is handed to a helper thread which runs
+   that command and then hands the connection back to the epoll set,
+   so a MILS or slow I2C transfer never holds up other connections.
+*/
+
+static void sockConnClose(sockConn_t *conn)
 {
-   DBG(DBG_STARTUP, "bits=%d", bits);
+   epoll_ctl(fdEpoll, EPOLL_CTL_DEL, conn->fd, NULL);
 
-   /* reset PWM */
+   closeOrphanedNotifications(-1, conn->fd);
 
-   pwmReg[PWM_CTL] = 0;
+   closeOrphanedCommandShm(conn->fd);
 
-   myGpioDelay(10);
+   closeOrphanedWaveStream(conn->fd);
 
-   pwmReg[PWM_STA] = -1;
+   close(conn->fd);
 
-   myGpioDelay(10);
+   DBG(DBG_USER, "Socket %d closed", conn->fd);
 
-   /* set number of bits to transmit */
+   pthread_mutex_lock(&sockConnMutex);
 
-   pwmReg[PWM_RNG1] = bits;
+   if (conn->prev) conn->prev->next = conn->next;
+   else            sockConns = conn->next;
 
-   myGpioDelay(10);
+   if (conn->next) conn->next->prev = conn->prev;
 
-   dmaIVirt[0]->periphData = 1;
+   pthread_mutex_unlock(&sockConnMutex);
 
-   /* enable PWM DMA, raise panic and dreq thresholds to 15 */
+   free(conn->in);
+   free(conn->out);
+   free(conn);
+}
 
-   pwmReg[PWM_DMAC] = PWM_DMAC_ENAB      |
-                      PWM_DMAC_PANIC(15) |
-                      PWM_DMAC_DREQ(15);
+/* ----------------------------------------------------------------------- */
 
-   myGpioDelay(10);
+static int sockConnFlush(sockConn_t *conn)
+{
+   int n;
 
-   /* clear PWM fifo */
+   /* returns 0 when the output is written, 1 if some is still pending */
 
-   pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
+   while (conn->outPos < conn->outLen)
+   {
+      n = write(conn->fd, conn->out + conn->outPos,
+                conn->outLen - conn->outPos);
 
-   myGpioDelay(10);
+      if (n < 0)
+      {
+         if (errno == EINTR) continue;
 
-   /* enable PWM channel 1 and use fifo */
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 1;
 
-   pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+         return -1;
+      }
+
+      conn->outPos += n;
+   }
+
+   conn->outPos = 0;
+   conn->outLen = 0;
+
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initPCM(unsigned bits)
+static int sockConnSend(sockConn_t *conn, struct iovec *iov, int iovcnt)
 {
-   DBG(DBG_STARTUP, "bits=%d", bits);
+   int i, n, len;
+   char *out;
 
-   /* disable PCM so we can modify the regs */
-
-   pcmReg[PCM_CS] = 0;
+   n = 0;
 
-   myGpioDelay(1000);
+   if (!conn->outLen)
+   {
+      do n = writev(conn->fd, iov, iovcnt);
+      while ((n < 0) && (errno == EINTR));
 
-   pcmReg[PCM_FIFO]   = 0;
-   pcmReg[PCM_MODE]   = 0;
-   pcmReg[PCM_RXC]    = 0;
-   pcmReg[PCM_TXC]    = 0;
-   pcmReg[PCM_DREQ]   = 0;
-   pcmReg[PCM_INTEN]  = 0;
-   pcmReg[PCM_INTSTC] = 0;
-   pcmReg[PCM_GRAY]   = 0;
+      if (n < 0)
+      {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) return -1;
 
-   myGpioDelay(1000);
+         n = 0;
+      }
+   }
 
-   pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits-1); /* # bits in frame */
+   /* keep whatever the socket would not take */
 
-   /* enable channel 1 with # bits width */
+   for (i=0; i<iovcnt; i++)
+   {
+      if (n >= iov[i].iov_len)
+      {
+         n -= iov[i].iov_len;
+         continue;
+      }
 
-   pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits-8);
+      len = iov[i].iov_len - n;
 
-   pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
+      if ((conn->outLen + len) > conn->outSize)
+      {
+         out = realloc(conn->out, conn->outLen + len);
 
-   myGpioDelay(1000);
+         if (out == NULL) return -1;
 
-   pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
+         conn->out = out;
+         conn->outSize = conn->outLen + len;
+      }
 
-   pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
+      memcpy(conn->out + conn->outLen, (char *)iov[i].iov_base + n, len);
 
-   pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
+      conn->outLen += len;
 
-   pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
+      n = 0;
+   }
 
-   /* enable PCM */
+   return 0;
+}
 
-   pcmReg[PCM_CS] |= PCM_CS_EN;
+/* ----------------------------------------------------------------------- */
 
-   /* enable tx */
+static int sockReplyHasExt(unsigned cmd)
+{
+   switch (cmd)
+   {
+      /* extensions */
 
-   pcmReg[PCM_CS] |= PCM_CS_TXON;
+      case PI_CMD_BATCH:
+      case PI_CMD_BI2CZ:
+      case PI_CMD_BSCX:
+      case PI_CMD_CF2:
+      case PI_CMD_FL:
+      case PI_CMD_FR:
+      case PI_CMD_GSNAP:
+      case PI_CMD_I2CPK:
+      case PI_CMD_I2CRD:
+      case PI_CMD_I2CRI:
+      case PI_CMD_I2CRK:
+      case PI_CMD_I2CZ:
+      case PI_CMD_PROCP:
+      case PI_CMD_SERR:
+      case PI_CMD_SLR:
+      case PI_CMD_SPIX:
+      case PI_CMD_SPIR:
+      case PI_CMD_STATS:
+      case PI_CMD_WVSPC:
+      case PI_CMD_BSPIX:
+         return 1;
 
-   dmaIVirt[0]->periphData = 0x0F;
+      default:
+         return 0;
+   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initHWClk
-   (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH)
+static int sockRunCommand(uintptr_t *p, unsigned bufSize, char *buf)
 {
-   DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d",
-      clkCtl, clkDiv, clkSrc, divI, divF, MASH);
+   int res;
 
-   /* kill the clock if busy, anything else isn't reliable */
-
-   if (clkReg[clkCtl] & CLK_CTL_BUSY)
+   if (p[0] == PI_CMD_PROCP)
    {
-      do
+      res = myDoCommand(p, bufSize-sizeof(int), buf+sizeof(int));
+
+      if (res >= 0)
       {
-         clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL;
+         memcpy(buf, &res, 4);
+         res = 4 + (4*PI_MAX_SCRIPT_PARAMS);
       }
-      while (clkReg[clkCtl] & CLK_CTL_BUSY);
-   }
 
-   clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
+      return res;
+   }
 
-   usleep(10);
+   return myDoCommand(p, bufSize, buf);
+}
 
-   clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
+/* ----------------------------------------------------------------------- */
 
-   usleep(10);
+static int sockRunBatch(uintptr_t *p, char *ext, char *buf, char *reply)
+{
+   uintptr_t q[10];
+   uint32_t cmd[4];
+   int i, pos, len, res, space;
 
-   clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
-}
+   /* check the framing before running any command */
 
-static void initClock(int mainClock)
-{
-   const unsigned BITS=10;
-   int clockPWM;
-   unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
-   char *per;
-   unsigned micros;
+   pos = 0;
 
-   DBG(DBG_STARTUP, "mainClock=%d", mainClock);
+   for (i=0; i<p[1]; i++)
+   {
+      if ((p[3] - pos) < 16) return PI_BAD_BATCH;
 
-   if (mainClock) micros = gpioCfg.clockMicros;
-   else           micros = PI_WF_MICROS;
+      memcpy(cmd, ext + pos, 16);
 
-   clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
+      if (cmd[3] > (p[3] - pos - 16)) return PI_BAD_BATCH;
 
-   if (clockPWM)
-   {
-      clkCtl = CLK_PWMCTL;
-      clkDiv = CLK_PWMDIV;
-      per = "PWM";
-   }
-   else
-   {
-      clkCtl = CLK_PCMCTL;
-      clkDiv = CLK_PCMDIV;
-      per = "PCM";
+      pos += 16 + cmd[3];
    }
 
-   clkSrc  = CLK_CTL_SRC_PLLD;
-   clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */ 
-   clkBits = BITS;        /* 10/BITS MHz - 1/BITS MHz */
-   clkDivF = 0;
-   clkMash = 0;
+   if (pos != p[3]) return PI_BAD_BATCH;
 
-   DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d",
-      per, clkDivI, clkDivF, clkMash, clkBits);
+   pos = 0;
+   len = 0;
 
-   initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
+   for (i=0; i<p[1]; i++)
+   {
+      /* space for any data after the result, at least a script status */
 
-   if (clockPWM) initPWM(BITS);
-   else          initPCM(BITS);
+      space = CMD_MAX_EXTENSION - 1 - len - 4;
 
-   myGpioDelay(2000);
-}
+      if (space < (4 + (4*PI_MAX_SCRIPT_PARAMS))) break;
 
-static void initKillDMA(volatile uint32_t *dmaAddr)
-{
-   dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
-   dmaAddr[DMA_CS] = 0;
-   dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
+      memcpy(cmd, ext + pos, 16);
 
-   dmaAddr[DMA_CONBLK_AD] = 0;
-}
+      memcpy(buf, ext + pos + 16, cmd[3]);
 
-/* ----------------------------------------------------------------------- */
+      buf[cmd[3]] = 0;
 
-static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr)
-{
-   DBG(DBG_STARTUP, "");
+      pos += 16 + cmd[3];
 
-   initKillDMA(dmaAddr);
+      q[0] = cmd[0];
+      q[1] = cmd[1];
+      q[2] = cmd[2];
+      q[3] = cmd[3];
 
-   dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
+      /* these need the connection, which a batched command lacks */
 
-   dmaAddr[DMA_CONBLK_AD] = cbAddr;
+      if ((q[0] == PI_CMD_NOIB) || (q[0] == PI_CMD_BATCH) ||
+          (q[0] == PI_CMD_NOS)  || (q[0] == PI_CMD_SHMO) ||
+          (q[0] == PI_CMD_WVSOP))
+         res = PI_BAD_BATCH;
+      else
+         res = sockRunCommand(q, space, buf);
 
-   /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
+      memcpy(reply + len, &res, 4);
 
-   dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR            |
-                        DMA_DEBUG_FIFO_ERR            |
-                        DMA_DEBUG_RD_LST_NOT_SET_ERR;
+      len += 4;
 
+      if (sockReplyHasExt(q[0]) && (res > 0))
+      {
+         memcpy(reply + len, buf, res);
 
-   dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES    |
-                     DMA_PANIC_PRIORITY(8) |
-                     DMA_PRIORITY(8)       |
-                     DMA_ACTIVE;
+         len += res;
+      }
+   }
+
+   return len;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initClearGlobals(void)
+static int sockConnCommand(sockConn_t *conn, char *cmd, char *buf)
 {
-   int i;
+   uintptr_t p[10];
+   uint32_t response[4], threshold;
+   struct iovec iov[2];
+   int i, opt, iovcnt;
 
-   DBG(DBG_STARTUP, "");
+   /* buf is 2*CMD_MAX_EXTENSION, a batch uses the top half */
 
-   alertBits   = 0;
-   monitorBits = 0;
-   notifyBits  = 0;
-   scriptBits  = 0;
-   gFilterBits = 0;
-   nFilterBits = 0;
-   wdogBits    = 0;
+   memcpy(response, cmd, 16);
 
-   pthAlertRunning  = PI_THREAD_NONE;
-   pthFifoRunning   = PI_THREAD_NONE;
-   pthSocketRunning = PI_THREAD_NONE;
+   for (i=0; i<4; i++) p[i] = response[i];
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   switch (p[0])
+   {
+      case PI_CMD_NOIB:
 
-   wfcur=0;
+         p[3] = gpioNotifyOpenInBand(conn->fd);
 
-   wfStats.micros     = 0;
-   wfStats.highMicros = 0;
-   wfStats.maxMicros  = PI_WAVE_MAX_MICROS;
+        /* Enable the Nagle algorithm. */
+         opt = 0;
+         setsockopt(
+            conn->fd, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
 
-   wfStats.pulses     = 0;
-   wfStats.highPulses = 0;
-   wfStats.maxPulses  = PI_WAVE_MAX_PULSES;
+         break;
 
-   wfStats.cbs        = 0;
-   wfStats.highCbs    = 0;
-   wfStats.maxCbs     = (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE);
+      case PI_CMD_BATCH:
+         p[3] = sockRunBatch(p, cmd + 16, buf + CMD_MAX_EXTENSION, buf);
+         break;
 
-   gpioGetSamples.func     = NULL;
-   gpioGetSamples.ex       = 0;
-   gpioGetSamples.userdata = NULL;
-   gpioGetSamples.bits     = 0;
+      case PI_CMD_NOS:
+         p[3] = intNotifyOpenShm(conn->fd, p[1]);
+         break;
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
-   {
-      wfRx[i].mode      = PI_WFRX_NONE;
-      pthread_mutex_init(&wfRx[i].mutex, NULL);
-      gpioAlert[i].func = NULL;
-   }
+      case PI_CMD_SHMO:
+         p[3] = intCommandOpenShm(conn->fd, p[1]);
+         break;
 
-   for (i=0; i<=PI_MAX_GPIO; i++)
-   {
-      gpioInfo [i].is      = GPIO_UNDEFINED;
-      gpioInfo [i].width   = 0;
-      gpioInfo [i].range   = PI_DEFAULT_DUTYCYCLE_RANGE;
-      gpioInfo [i].freqIdx = DEFAULT_PWM_IDX;
-   }
+      case PI_CMD_WVSOP:
+         /* the threshold is in the extension */
+         if (p[3] != 4)
+         {
+            p[3] = PI_BAD_PARAM;
+            break;
+         }
+         memcpy(&threshold, cmd + 16, 4);
+         p[3] = intWaveStreamOpen(conn->fd, p[1], p[2], threshold);
+         break;
 
-   for (i=0; i<PI_NOTIFY_SLOTS; i++)
-   {
-      gpioNotify[i].seqno = 0;
-      gpioNotify[i].state = PI_NOTIFY_CLOSED;
-   }
+      default:
 
-   for (i=0; i<=PI_MAX_SIGNUM; i++)
-   {
-      gpioSignal[i].func     = NULL;
-      gpioSignal[i].ex       = 0;
-      gpioSignal[i].userdata = NULL;
-   }
+         if (p[3]) memcpy(buf, cmd + 16, p[3]);
 
-   for (i=0; i<=PI_MAX_TIMER; i++)
-   {
-      gpioTimer[i].running = 0;
-      gpioTimer[i].func    = NULL;
+         /* add null terminator in case it's a string */
+
+         buf[p[3]] = 0;
+
+         p[3] = sockRunCommand(p, CMD_MAX_EXTENSION-1, buf);
    }
 
-   for (i=0; i<=PI_MAX_EVENT; i++)
+   for (i=0; i<4; i++) response[i] = (uint32_t)p[i];
+
+   iov[0].iov_base = response;
+   iov[0].iov_len  = 16;
+   iovcnt = 1;
+
+   if (sockReplyHasExt(p[0]) && (((int)p[3]) > 0))
    {
-      eventAlert[i].func      = NULL;
-      eventAlert[i].ignore    = 0;
-      eventAlert[i].fired     = 0;
+      iov[1].iov_base = buf;
+      iov[1].iov_len  = p[3];
+      iovcnt = 2;
    }
 
-   /* calculate the usable PWM frequencies */
+   return sockConnSend(conn, iov, iovcnt);
+}
 
-   for (i=0; i<PWM_FREQS; i++)
+/* ----------------------------------------------------------------------- */
+
+static int sockCmdBlocks(char *cmd)
+{
+   uint32_t p[4], q[4];
+   int i, pos;
+
+   memcpy(p, cmd, 16);
+
+   switch (p[0])
    {
-      pwmFreq[i]=
-         (1000000.0/
-            ((float)PULSE_PER_CYCLE*gpioCfg.clockMicros*pwmCycles[i]))+0.5;
+      /* delays, bus transfers, and code pigpio does not control */
 
-      DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
-   }
+      case PI_CMD_MICS:
+      case PI_CMD_MILS:
+      case PI_CMD_I2CRD:
+      case PI_CMD_I2CWD:
+      case PI_CMD_I2CWQ:
+      case PI_CMD_I2CRS:
+      case PI_CMD_I2CWS:
+      case PI_CMD_I2CRB:
+      case PI_CMD_I2CWB:
+      case PI_CMD_I2CRW:
+      case PI_CMD_I2CWW:
+      case PI_CMD_I2CRK:
+      case PI_CMD_I2CWK:
+      case PI_CMD_I2CRI:
+      case PI_CMD_I2CWI:
+      case PI_CMD_I2CPC:
+      case PI_CMD_I2CPK:
+      case PI_CMD_I2CZ:
+      case PI_CMD_SPIR:
+      case PI_CMD_SPIW:
+      case PI_CMD_SPIX:
+      case PI_CMD_BI2CZ:
+      case PI_CMD_BSPIX:
+      case PI_CMD_CF1:
+      case PI_CMD_CF2:
+      case PI_CMD_SHELL:
+         return 1;
 
-   inpFifo = NULL;
-   outFifo = NULL;
+      case PI_CMD_BATCH:
 
-   fdLock       = -1;
-   fdMem        = -1;
-   fdSock       = -1;
+         /* a batch blocks if any of its commands does */
 
-   dmaMboxBlk = MAP_FAILED;
-   dmaPMapBlk = MAP_FAILED;
-   dmaVirt = MAP_FAILED;
-   dmaBus  = MAP_FAILED;
+         pos = 0;
 
-   auxReg  = MAP_FAILED;
-   clkReg  = MAP_FAILED;
-   dmaReg  = MAP_FAILED;
-   gpioReg = MAP_FAILED;
-   pcmReg  = MAP_FAILED;
-   pwmReg  = MAP_FAILED;
-   systReg = MAP_FAILED;
-   spiReg  = MAP_FAILED;
+         for (i=0; i<p[1]; i++)
+         {
+            if ((p[3] - pos) < 16) break;
+
+            memcpy(q, cmd + 16 + pos, 16);
+
+            if (q[3] > (p[3] - pos - 16)) break;
+
+            if (sockCmdBlocks(cmd + 16 + pos)) return 1;
+
+            pos += 16 + q[3];
+         }
+
+         return 0;
+
+      default:
+         return 0;
+   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initReleaseResources(void)
+static int sockConnRunHead(sockConn_t *conn, char *buf)
 {
-   int i;
+   uint32_t ext;
+   int need;
 
-   DBG(DBG_STARTUP, "");
+   /* run the command at the head of the input and drop it */
 
-   /* shut down running threads */
+   memcpy(&ext, conn->in + 12, 4);
 
-   for (i=0; i<=PI_MAX_GPIO; i++)
-   {
-      if (gpioISR[i].pth)
-      {
-         /* destroy thread, unexport GPIO */
+   need = 16 + ext;
 
-         gpioSetISRFunc(i, 0, 0, NULL);
-      }
-   }
+   if (sockConnCommand(conn, conn->in, buf) < 0) return -1;
 
-   for (i=0; i<=PI_MAX_TIMER; i++)
-   {
-      if (gpioTimer[i].running)
-      {
-         /* destroy thread */
+   conn->inLen -= need;
 
-         pthread_cancel(gpioTimer[i].pthId);
-         pthread_join(gpioTimer[i].pthId, NULL);
-         gpioTimer[i].running = 0;
-      }
-   }
+   memmove(conn->in, conn->in + need, conn->inLen);
 
-   if (pthAlertRunning != PI_THREAD_NONE)
-   {
-      pthread_cancel(pthAlert);
-      pthread_join(pthAlert, NULL);
-      pthAlertRunning = PI_THREAD_NONE;
-   }
+   return 0;
+}
 
-   if (pthFifoRunning != PI_THREAD_NONE)
-   {
-      pthread_cancel(pthFifo);
-      pthread_join(pthFifo, NULL);
-      pthFifoRunning = PI_THREAD_NONE;
-   }
+/* ----------------------------------------------------------------------- */
 
-   if (pthSocketRunning != PI_THREAD_NONE)
-   {
-      pthread_cancel(pthSocket);
-      pthread_join(pthSocket, NULL);
-      pthSocketRunning = PI_THREAD_NONE;
-   }
+static void * pthSockHelperThread(void *x)
+{
+   struct epoll_event ev;
+   sockConn_t *conn;
+   int n;
+   char buf[2*CMD_MAX_EXTENSION];
 
-   /* release mmap'd memory */
+   conn = x;
 
-   if (auxReg  != MAP_FAILED) munmap((void *)auxReg,  AUX_LEN);
-   if (bscsReg != MAP_FAILED) munmap((void *)bscsReg, BSCS_LEN);
-   if (clkReg  != MAP_FAILED) munmap((void *)clkReg,  CLK_LEN);
-   if (dmaReg  != MAP_FAILED) munmap((void *)dmaReg,  DMA_LEN);
-   if (gpioReg != MAP_FAILED) munmap((void *)gpioReg, GPIO_LEN);
-   if (pcmReg  != MAP_FAILED) munmap((void *)pcmReg,  PCM_LEN);
-   if (pwmReg  != MAP_FAILED) munmap((void *)pwmReg,  PWM_LEN);
-   if (systReg != MAP_FAILED) munmap((void *)systReg, SYST_LEN);
-   if (spiReg  != MAP_FAILED) munmap((void *)spiReg,  SPI_LEN);
+   n = sockConnRunHead(conn, buf);
 
-   auxReg  = MAP_FAILED;
-   bscsReg = MAP_FAILED;
-   clkReg  = MAP_FAILED;
-   dmaReg  = MAP_FAILED;
-   gpioReg = MAP_FAILED;
-   pcmReg  = MAP_FAILED;
-   pwmReg  = MAP_FAILED;
-   systReg = MAP_FAILED;
-   spiReg  = MAP_FAILED;
+   /*
+      Hand the connection back to the epoll set.  EPOLLOUT fires at
+      once so a worker runs any commands read after this one.  If the
+      workers are being stopped gpioTerminate has left the connection
+      for us to close.
+   */
 
-   if (dmaBus != MAP_FAILED)
+   pthread_mutex_lock(&sockConnMutex);
+
+   if ((n == 0) && !sockStopping)
    {
-      munmap(dmaBus,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
-   }
+      ev.events = EPOLLOUT | EPOLLONESHOT;
+      ev.data.ptr = conn;
 
-   dmaBus = MAP_FAILED;
+      conn->busy = 0;
 
-   if (dmaVirt != MAP_FAILED)
-   {
-      for (i=0; i<PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      if (epoll_ctl(fdEpoll, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
       {
-         munmap(dmaVirt[i], PAGE_SIZE);
+         conn->busy = 1;
+         n = -1;
       }
-
-      munmap(dmaVirt,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
    }
+   else n = -1;
 
-   dmaVirt = MAP_FAILED;
+   pthread_mutex_unlock(&sockConnMutex);
 
-   if (dmaPMapBlk != MAP_FAILED)
-   {
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         munmap(dmaPMapBlk[i], PAGES_PER_BLOCK*PAGE_SIZE);
-      }
+   if (n < 0) sockConnClose(conn);
 
-      munmap(dmaPMapBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
-   }
+   return 0;
+}
 
-   dmaPMapBlk = MAP_FAILED;
+/* ----------------------------------------------------------------------- */
 
-   if (dmaMboxBlk != MAP_FAILED)
-   {
-      fdMbox = mbOpen();
+static int sockConnHandOff(sockConn_t *conn)
+{
+   pthread_t thr;
+   pthread_attr_t attr;
+   int err;
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         mbDMAFree(&dmaMboxBlk[bufferBlocks+PI_WAVE_BLOCKS-i-1]);
-      }
+   if (pthread_attr_init(&attr)) return -1;
 
-      mbClose(fdMbox);
+   pthread_attr_setstacksize(&attr, STACK_SIZE);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-      munmap(dmaMboxBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t));
-   }
+   /* gpioTerminate joins the workers before it reads busy */
 
-   dmaMboxBlk = MAP_FAILED;
+   conn->busy = 1;
 
-   if (inpFifo != NULL)
-   {
-      fclose(inpFifo);
-      unlink(PI_INPFIFO);
-      inpFifo = NULL;
-   }
+   err = pthread_create(&thr, &attr, pthSockHelperThread, conn);
 
-   if (outFifo != NULL)
-   {
-      fclose(outFifo);
-      unlink(PI_OUTFIFO);
-      outFifo = NULL;
-   }
+   pthread_attr_destroy(&attr);
 
-   if (fdMem != -1)
+   if (err)
    {
-      close(fdMem);
-      fdMem = -1;
+      DBG(DBG_ALWAYS, "helper pthread_create failed, socket %d", conn->fd);
+
+      conn->busy = 0;
+
+      return -1;
    }
 
-   if (fdLock != -1)
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int sockConnService(sockConn_t *conn, char *buf)
+{
+   int n, pos, need, reads;
+   uint32_t ext;
+   char *in;
+
+   /*
+      returns -1 if the connection should be closed, 1 if it is
+      waiting for the client to read a response, 2 if it has been
+      handed to a helper thread, otherwise 0.
+   */
+
+   if (conn->outLen)
    {
-      close(fdLock);
-      unlink(PI_LOCKFILE);
-      fdLock = -1;
+      n = sockConnFlush(conn);
+      if (n) return n;
    }
 
-   if (fdSock != -1)
-   {
-      close(fdSock);
-      fdSock = -1;
-   }
-
-   if (fdPmap != -1)
-   {
-      close(fdPmap);
-      fdPmap = -1;
-   }
+   reads = 0;
 
-   if (fdMbox != -1)
+   while (1)
    {
-      close(fdMbox);
-      fdMbox = -1;
-   }
+      /* run each complete command in the input buffer */
 
-   gpioStats.DMARestarts = 0;
-   gpioStats.dmaInitCbsCount = 0;
+      pos = 0;
+      n = 0;
 
-   numSockNetAddr = 0;
-}
+      while ((conn->inLen - pos) >= 16)
+      {
+         memcpy(&ext, conn->in + pos + 12, 4);
 
-int initInitialise(void)
-{
-   int i;
-   unsigned rev, model;
-   struct sockaddr_in server;
-   struct sockaddr_in6 server6;
-   char * portStr;
-   unsigned port;
-   struct sched_param param;
-   pthread_attr_t pthAttr;
+         if (ext >= CMD_MAX_EXTENSION)
+         {
+            /* Serious error.  No point continuing. */
+            DBG(DBG_ALWAYS, "ext too large %u(%d), sock=%d",
+               ext, CMD_MAX_EXTENSION, conn->fd);
 
-   DBG(DBG_STARTUP, "");
+            return -1;
+         }
 
-   waveClockInited = 0;
-   PWMClockInited = 0;
+         need = 16 + ext;
 
-   clock_gettime(CLOCK_REALTIME, &libStarted);
+         if ((conn->inLen - pos) < need) break;
 
-   rev = gpioHardwareRevision();
+         if (sockCmdBlocks(conn->in + pos))
+         {
+            n = 2;
+            break;
+         }
 
-   initClearGlobals();
+         if (sockConnCommand(conn, conn->in + pos, buf) < 0) return -1;
 
-   if (initCheckPermitted() < 0) return PI_INIT_FAILED;
+         pos += need;
 
-   fdLock = initGrabLockFile();
+         if (conn->outLen)
+         {
+            n = 1;
+            break;
+         }
+      }
 
-   if (fdLock < 0)
-      SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
+      if (pos)
+      {
+         conn->inLen -= pos;
+         memmove(conn->in, conn->in + pos, conn->inLen);
+      }
 
-   if (!gpioMaskSet)
-   {
-      if      (rev ==  0) gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
-      else if (rev <   4) gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
-      else if (rev <  16) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-      else if (rev == 17) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-      else if (rev  < 20) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-      else if (rev == 20) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-      else if (rev == 21) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-      else
+      if (n == 2)
       {
-         model = (rev >> 4) & 0xFF;
+         /* the blocking command is now at the head of the input */
 
-         /* model
-         0=A 1=B
-         2=A+ 3=B+
-         4=Pi2B
-         5=Alpha
-         6=Compute Module
-         7=Unknown
-         8=Pi3B
-         9=Zero
-         12=Zero W
-         13=Pi3B+
-         14=Pi3A+
-         17=Pi4B
-         */
-         if      (model <  2) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-         else if (model <  4) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-         else if (model == 4) gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
+         if (sockConnHandOff(conn) == 0) return 2;
 
-         else if (model == 6
-               || model ==10
-               || model ==16) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+         /* no helper thread, run it here */
 
-         else if (model == 8
-               || model ==13
-               || model ==14) gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
+         if (sockConnRunHead(conn, buf) < 0) return -1;
 
-         else if (model == 9
-               || model ==12) gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
+         if (conn->outLen) return 1;
 
-         else if (model ==17) gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
-         else                 gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+         continue;
       }
 
-      gpioMaskSet = 1;
-   }
+      if (n) return n;
 
-#ifndef EMBEDDED_IN_VM
-   if (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
-      sigSetHandler();
-#endif
+      if (conn->inLen >= 16)
+      {
+         /* make room for a large extension */
 
-   if (initPeripherals() < 0) return PI_INIT_FAILED;
+         memcpy(&ext, conn->in + 12, 4);
 
-   if (initAllocDMAMem() < 0) return PI_INIT_FAILED;
+         need = 16 + ext;
 
-   /* done with /dev/mem */
+         if (need > conn->inSize)
+         {
+            in = realloc(conn->in, need);
 
-   if (fdMem != -1)
-   {
-      close(fdMem);
-      fdMem = -1;
-   }
+            if (in == NULL) return -1;
 
-   param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+            conn->in = in;
+            conn->inSize = need;
+         }
+      }
 
-   if (gpioCfg.internals & PI_CFG_RT_PRIORITY)
-      sched_setscheduler(0, SCHED_FIFO, &param);
+      if (reads++ >= SOCK_MAX_READS) return 0;
 
-   initClock(1); /* initialise main clock */
+      n = recv(conn->fd, conn->in + conn->inLen,
+               conn->inSize - conn->inLen, 0);
 
-   atexit(gpioTerminate);
+      if (n > 0) conn->inLen += n;
+      else if (n == 0) return -1;
+      else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+      else if (errno != EINTR) return -1;
+   }
+}
 
-   if (pthread_attr_init(&pthAttr))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
+static void * pthSockWorkerThread(void *x)
+{
+   struct epoll_event ev;
+   sockConn_t *conn;
+   int n;
+   char buf[2*CMD_MAX_EXTENSION];
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+   while (1)
    {
-      if (pthread_create(&pthAlert, &pthAttr, pthAlertThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
+      if (epoll_wait(fdEpoll, &ev, 1, -1) < 1) continue;
 
-      pthAlertRunning = PI_THREAD_STARTED;
-   }
+      /* fdSockStop is never read so every worker sees it */
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF))
-   {
-      if (pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
+      if (ev.data.ptr == NULL) break;
 
-      pthFifoRunning = PI_THREAD_STARTED;
-   }
+      conn = ev.data.ptr;
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF))
-   {
-      portStr = getenv(PI_ENVPORT);
-      if (portStr) port = atoi(portStr); else port = gpioCfg.socketPort;
+      n = sockConnService(conn, buf);
 
-      // Accept connections on IPv6, unless we have an IPv4-only whitelist
-      if (!numSockNetAddr)
+      if (n < 0) sockConnClose(conn);
+      else if (n < 2)
       {
-         fdSock = socket(AF_INET6, SOCK_STREAM , 0);
+         /* hand the connection back to the epoll set */
 
-         if (fdSock != -1)
-         {
-            bzero((char *)&server6, sizeof(server6));
-            server6.sin6_family = AF_INET6;
-            if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
-            {
-               server6.sin6_addr = in6addr_loopback;
-            }
-            else
-            {
-               server6.sin6_addr = in6addr_any;
-            }
-            server6.sin6_port = htons(port);
+         ev.events = (n ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+         ev.data.ptr = conn;
 
-            int opt = 1;
-            setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-            if (bind(fdSock,(struct sockaddr *)&server6, sizeof(server6)) < 0)
-               SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-         }
+         if (epoll_ctl(fdEpoll, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+            sockConnClose(conn);
       }
+   }
 
-      if (numSockNetAddr || fdSock == -1)
-      {
-         fdSock = socket(AF_INET , SOCK_STREAM , 0);
+   return 0;
+}
 
-         if (fdSock == -1)
-            SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
-         else
-         {
-           int opt = 1;
-           setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-         }
-         server.sin_family = AF_INET;
-         if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
-         {
-            server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-         }
-         else
-         {
-            server.sin_addr.s_addr = htonl(INADDR_ANY);
-         }
-         server.sin_port = htons(port);
+static int addrAllowed(struct sockaddr *saddr)
+{
+   int i;
+   uint32_t addr;
 
-         if (bind(fdSock,(struct sockaddr *)&server , sizeof(server)) < 0)
-            SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-      }
+   if (!numSockNetAddr) return 1;
 
-      if (pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
+   // FIXME: add IPv6 whitelisting support
+   if (saddr->sa_family != AF_INET) return 0;
 
-      pthSocketRunning = PI_THREAD_STARTED;
+   addr = ((struct sockaddr_in *) saddr)->sin_addr.s_addr;
+
+   for (i=0; i<numSockNetAddr; i++)
+   {
+      if (addr == sockNetAddr[i]) return 1;
    }
+   return 0;
+}
 
-   myGpioDelay(1000);
+/* ----------------------------------------------------------------------- */
 
-   dmaInitCbs();
+static void * pthSocketThread(void *x)
+{
+   int fdC=0, c, i, opt, state;
+   struct sockaddr_storage client;
+   struct pollfd pfd[2];
+   struct epoll_event ev;
+   sockConn_t *conn;
+   pthread_attr_t attr;
 
-   flushMemory();
+   if (pthread_attr_init(&attr))
+      SOFT_ERROR((void*)PI_INIT_FAILED,
+         "pthread_attr_init failed (%m)");
 
-   //cast twice to suppress compiler warning, I belive this cast
-   //is ok because dmaIBus contains bus addresses, not virtual
-   //addresses.
-   initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+   if (pthread_attr_setstacksize(&attr, STACK_SIZE))
+      SOFT_ERROR((void*)PI_INIT_FAILED,
+         "pthread_attr_setstacksize failed (%m)");
 
-   return PIGPIO_VERSION;
-}
+   /* fdSock opened in gpioInitialise so that we can treat
+      failure to bind as fatal. */
 
+   listen(fdSock, 100);
 
-/* ======================================================================= */
+   if (fdUnix != -1) listen(fdUnix, 100);
 
-int getBitInBytes(int bitPos, char *buf, int numBits)
-{
-   int bitp, bufp;
+   /* poll ignores the Unix domain socket if it is not open */
 
-   if (bitPos < numBits)
-   {
-      bufp =      bitPos / 8;
-      bitp = 7 - (bitPos % 8);
-      if (buf[bufp] & (1<<bitp)) return 1;
-   }
+   pfd[0].fd = fdSock;
+   pfd[0].events = POLLIN;
+   pfd[1].fd = fdUnix;
+   pfd[1].events = POLLIN;
 
-   return 0;
-}
+   fdEpoll = epoll_create1(EPOLL_CLOEXEC);
 
-/* ----------------------------------------------------------------------- */
+   if (fdEpoll < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "epoll_create1 failed (%m)");
 
-void putBitInBytes(int bitPos, char *buf, int bit)
-{
-   int bitp, bufp;
+   /* gpioTerminate writes fdSockStop to stop the workers */
 
-   bufp =      bitPos / 8;
-   bitp = 7 - (bitPos % 8);
+   fdSockStop = eventfd(0, EFD_CLOEXEC);
 
-   if (bit) buf[bufp] |=   (1<<bitp);
-   else     buf[bufp] &= (~(1<<bitp));
-}
+   if (fdSockStop < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "eventfd failed (%m)");
 
-/* ----------------------------------------------------------------------- */
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
 
-uint32_t rawWaveGetOOL(int pos)
-{
-   int page, slot;
+   if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdSockStop, &ev) < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "epoll_ctl failed (%m)");
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   for (i=0; i<gpioCfg.socketWorkers; i++)
    {
-      waveOOLPageSlot(pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
+      if (pthread_create
+         (&pthSockWorker[i], &attr, pthSockWorkerThread, NULL))
+         SOFT_ERROR((void*)PI_INIT_FAILED,
+            "socket pthread_create failed (%m)");
+
+      sockWorkers++;
    }
 
-   return -1;
-}
+   /* don't start until DMA started */
 
-/* ----------------------------------------------------------------------- */
-
-void rawWaveSetOOL(int pos, uint32_t value)
-{
-   int page, slot;
+   spinWhileStarting();
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   while (fdC >= 0)
    {
-      waveOOLPageSlot(pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
-   }
-}
+      if (poll(pfd, 2, -1) < 0)
+      {
+         if (errno == EINTR) continue;
+         break;
+      }
 
+      c = sizeof(client);
 
-/* ----------------------------------------------------------------------- */
+      if (pfd[0].revents)
+         fdC = accept(fdSock, (struct sockaddr *)&client, (socklen_t*)&c);
+      else
+         fdC = accept(fdUnix, (struct sockaddr *)&client, (socklen_t*)&c);
 
-uint32_t rawWaveGetOut(int pos)
-{
-   int page, slot;
+      if (fdC < 0) break;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot(pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
-   }
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
 
-   return -1;
-}
+      closeOrphanedNotifications(-1, fdC);
 
-/* ----------------------------------------------------------------------- */
+      if (addrAllowed((struct sockaddr *)&client))
+      {
+         DBG(DBG_USER, "Connection accepted on socket %d", fdC);
 
-void rawWaveSetOut(int pos, uint32_t value)
-{
-   int page, slot;
+         /* Enable tcp_keepalive */
+         opt = 1;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot(pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
+         if (setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0)
+         {
+            DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
+            close(fdC);
+            pthread_setcancelstate(state, NULL);
+            continue;
+         }
+
+         DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+
+         /* Disable the Nagle algorithm. */
+         opt = 1;
+         setsockopt(fdC, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+         fcntl(fdC, F_SETFL, fcntl(fdC, F_GETFL) | O_NONBLOCK);
+
+         conn = calloc(1, sizeof(sockConn_t));
+
+         if (conn) conn->in = malloc(SOCK_IN_SIZE);
+
+         if ((conn == NULL) || (conn->in == NULL))
+         {
+            DBG(DBG_ALWAYS, "no memory, closing socket %d", fdC);
+            free(conn);
+            close(fdC);
+            pthread_setcancelstate(state, NULL);
+            continue;
+         }
+
+         conn->fd = fdC;
+         conn->inSize = SOCK_IN_SIZE;
+
+         pthread_mutex_lock(&sockConnMutex);
+
+         conn->next = sockConns;
+         if (sockConns) sockConns->prev = conn;
+         sockConns = conn;
+
+         pthread_mutex_unlock(&sockConnMutex);
+
+         ev.events = EPOLLIN | EPOLLONESHOT;
+         ev.data.ptr = conn;
+
+         if (epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdC, &ev) < 0)
+         {
+            DBG(DBG_ALWAYS, "epoll_ctl failed (%m), closing socket %d", fdC);
+            sockConnClose(conn);
+         }
+      }
+      else
+      {
+         DBG(DBG_ALWAYS, "Connection rejected, closing");
+         close(fdC);
+      }
+
+      pthread_setcancelstate(state, NULL);
    }
+
+   SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
 }
 
+/* ======================================================================= */
 
-/* ----------------------------------------------------------------------- */
+/*
+Simulated peripherals, selected by PI_CFG_SIMULATE.
+
+The peripheral registers become ordinary process memory and the DMA
+pages are anonymous mappings given fake bus addresses.  pthSimThread
+wakes every SIM_SLEEP_NANOS and, in SIM_STEP_NANOS steps through the
+time since it last ran, runs the system timer, folds GPSET/GPCLR
+writes into GPLEV, and walks each active DMA channel's control blocks.  Transfers paced by the PWM
+or PCM DREQ take one clock period per word, so the input ring runs at
+the configured sample rate and waves run at PI_WF_MICROS.
+*/
 
-uint32_t rawWaveGetIn(int pos)
+static uint64_t simNanos(void)
 {
-   int page, slot;
+   struct timespec ts;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
-   }
+   clock_gettime(CLOCK_MONOTONIC, &ts);
 
-   return -1;
+   return ((uint64_t)ts.tv_sec * BILLION) + ts.tv_nsec;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void rawWaveSetIn(int pos, uint32_t value)
+#define SIM_PERI(base, len, reg)                                   \
+   do                                                              \
+   {                                                               \
+      uint32_t b = (base) & 0x00FFFFFF;                            \
+      if ((off >= b) && (off < (b + (len))))                       \
+         return (reg) + ((off - b) / 4);                           \
+   }                                                               \
+   while (0)
+
+static volatile uint32_t * simBusToVirt(uint32_t adr)
 {
-   int page, slot;
+   uint32_t off;
+   unsigned page;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   if ((adr & 0xFF000000) == PI_PERI_BUS)
    {
-      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
+      off = adr & 0x00FFFFFF;
+
+      SIM_PERI(GPIO_BASE, GPIO_LEN, gpioReg);
+      SIM_PERI(SYST_BASE, SYST_LEN, systReg);
+      SIM_PERI(PWM_BASE,  PWM_LEN,  pwmReg);
+      SIM_PERI(PCM_BASE,  PCM_LEN,  pcmReg);
+      SIM_PERI(CLK_BASE,  CLK_LEN,  clkReg);
+      SIM_PERI(DMA_BASE,  DMA_LEN,  dmaReg);
+      SIM_PERI(SPI_BASE,  SPI_LEN,  spiReg);
+      SIM_PERI(AUX_BASE,  AUX_LEN,  auxReg);
+      SIM_PERI(PADS_BASE, PADS_LEN, padsReg);
+      SIM_PERI(BSCS_BASE, BSCS_LEN, bscsReg);
+
+      return NULL;
    }
+
+   if (adr < SIM_DRAM_BUS) return NULL;
+
+   page = (adr - SIM_DRAM_BUS) / PAGE_SIZE;
+
+   if (page >= simDMAPages) return NULL;
+
+   return (uint32_t *)((char *)dmaVirt[page] + (adr % PAGE_SIZE));
 }
 
 /* ----------------------------------------------------------------------- */
 
-rawWaveInfo_t rawWaveInfo(int wave_id)
+static void simWrite(volatile uint32_t *dst, uint32_t val)
 {
-   rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
+   volatile uint32_t *lev;
 
-   if ((wave_id >=0) && (wave_id < PI_MAX_WAVES)) return waveInfo[wave_id];
-   else                                           return dummy;
+   if ((dst == gpioReg + GPSET0) || (dst == gpioReg + GPSET1))
+   {
+      lev = gpioReg + GPLEV0 + (dst - (gpioReg + GPSET0));
+      __atomic_or_fetch((uint32_t *)lev, val, __ATOMIC_SEQ_CST);
+   }
+   else if ((dst == gpioReg + GPCLR0) || (dst == gpioReg + GPCLR1))
+   {
+      lev = gpioReg + GPLEV0 + (dst - (gpioReg + GPCLR0));
+      __atomic_and_fetch((uint32_t *)lev, ~val, __ATOMIC_SEQ_CST);
+   }
+   else *dst = val;
 }
 
 /* ----------------------------------------------------------------------- */
 
-double time_time(void)
+static void simGpioUpdate(void)
 {
-   struct timeval tv;
-   double t;
+   int bank;
+   uint32_t set, clr;
 
-   gettimeofday(&tv, 0);
+   /* apply CPU writes to the set and clear registers.  Also called
+      by readers so a write is visible to an immediate read.
+   */
 
-   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
+   for (bank=0; bank<2; bank++)
+   {
+      set = __atomic_exchange_n(
+         (uint32_t *)&gpioReg[GPSET0+bank], 0, __ATOMIC_SEQ_CST);
 
-   return t;
+      if (set) __atomic_or_fetch(
+         (uint32_t *)&gpioReg[GPLEV0+bank], set, __ATOMIC_SEQ_CST);
+
+      clr = __atomic_exchange_n(
+         (uint32_t *)&gpioReg[GPCLR0+bank], 0, __ATOMIC_SEQ_CST);
+
+      if (clr) __atomic_and_fetch(
+         (uint32_t *)&gpioReg[GPLEV0+bank], ~clr, __ATOMIC_SEQ_CST);
+   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-void time_sleep(double seconds)
+static void simTransfer(rawCbs_t *cb, uint32_t tick)
 {
-   struct timespec ts, rem;
+   volatile uint32_t *src, *dst;
+   uint32_t srcAdr, dstAdr, val;
+   int x, y, rows, words;
+   int16_t sStride, dStride;
 
-   if (seconds > 0.0)
+   if (cb->info & DMA_TDMODE)
    {
-      ts.tv_sec = seconds;
-      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
+      rows    = (cb->length >> 16) & 0x3FFF;
+      words   = (cb->length & 0xFFFF) / 4;
+      sStride = cb->stride & 0xFFFF;
+      dStride = cb->stride >> 16;
+   }
+   else
+   {
+      rows    = 1;
+      words   = cb->length / 4;
+      sStride = 0;
+      dStride = 0;
+   }
 
-      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
+   srcAdr = cb->src;
+   dstAdr = cb->dst;
+
+   for (y=0; y<rows; y++)
+   {
+      for (x=0; x<words; x++)
       {
-         /* copy remaining time to ts */
-         ts.tv_sec  = rem.tv_sec;
-         ts.tv_nsec = rem.tv_nsec;
+         val = 0;
+
+         if (!(cb->info & DMA_SRC_IGNORE))
+         {
+            src = simBusToVirt(srcAdr);
+
+            if (src == systReg + SYST_CLO) val = tick;
+            else if (src) val = *src;
+         }
+
+         if (!(cb->info & DMA_DEST_IGNORE))
+         {
+            dst = simBusToVirt(dstAdr);
+
+            if (dst) simWrite(dst, val);
+         }
+
+         if (cb->info & DMA_SRC_INC)  srcAdr += 4;
+         if (cb->info & DMA_DEST_INC) dstAdr += 4;
       }
+
+      srcAdr += sStride;
+      dstAdr += dStride;
    }
 }
 
 /* ----------------------------------------------------------------------- */
 
-void rawDumpWave(void)
+static uint64_t simPeriodNanos(uint32_t info)
 {
-   int i;
-
-   unsigned numWaves, t;
+   unsigned periph, mainPeriph;
 
-   rawWave_t *waves;
+   periph = (info >> 16) & 0x1F;
 
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
+   if (gpioCfg.clockPeriph == PI_CLOCK_PCM) mainPeriph = 2;
+   else                                     mainPeriph = 5;
 
-   t = 0;
+   /* the main clock paces sampling, the other clock paces waves */
 
-   for (i=0; i<numWaves; i++)
-   {
-      fprintf(stderr, "%10u %08X %08X %08X %10u\n",
-         t, waves[i].gpioOn, waves[i].gpioOff,
-         waves[i].flags, waves[i].usDelay);
-      t += waves[i].usDelay;
-   }
+   if (periph == mainPeriph) return gpioCfg.clockMicros * THOUSAND;
+   else                      return PI_WF_MICROS * THOUSAND;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void rawDumpScript(unsigned script_id)
+static void simDMAStep(volatile uint32_t *ch, simDMA_t *d, uint64_t now)
 {
-   int i;
+   rawCbs_t *cb;
+   uint32_t cbAdr;
+   int n;
 
-   if (script_id >= PI_MAX_SCRIPTS) return;
+   if ((!(ch[DMA_CS] & DMA_ACTIVE)) || (!ch[DMA_CONBLK_AD]))
+   {
+      d->active = 0;
+      return;
+   }
 
-   if (gpioScript[script_id].state == PI_SCRIPT_IN_USE)
+   if (!d->active)
    {
+      d->active   = 1;
+      d->pending  = 0;
+      d->deadline = now;
+   }
 
-      for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
+   for (n=0; n<SIM_CBS_PER_PASS; n++)
+   {
+      if (now < d->deadline) return;
+
+      cbAdr = ch[DMA_CONBLK_AD];
+
+      cb = (rawCbs_t *)simBusToVirt(cbAdr);
+
+      if (cb == NULL)
       {
-         fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]);
+         DBG(DBG_ALWAYS, "bad CB address %08X", cbAdr);
+         ch[DMA_DEBUG] |= DMA_DEBUG_READ_ERR;
+         ch[DMA_CS] &= ~DMA_ACTIVE;
+         d->active = 0;
+         return;
       }
 
-      fprintf(stderr, "\n");
+      if (d->pending && (d->cbAdr == cbAdr))
+      {
+         /* paced CB has finished, move on */
 
-      for (i=0; i<PI_MAX_SCRIPT_VARS; i++)
+         d->pending = 0;
+      }
+      else if (cb->info & DMA_DEST_DREQ)
       {
-         fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]);
+         /* one word per peripheral clock period */
+
+         if ((now - d->deadline) > SIM_RESYNC_NANOS) d->deadline = now;
+
+         d->deadline += (cb->length / BPD) * simPeriodNanos(cb->info);
+         d->pending = 1;
+         d->cbAdr   = cbAdr;
+
+         continue;
       }
+      else
+      {
+         d->pending = 0;
 
-      fprintf(stderr, "\n");
+         simTransfer(cb, d->deadline / THOUSAND);
+      }
 
-      for (i=0; i<gpioScript[script_id].script.instrs; i++)
+      ch[DMA_CONBLK_AD] = cb->next;
+
+      if (!cb->next)
       {
-         fprintf(stderr,
-            "c%d=[%"PRIdPTR", %"PRIdPTR"(%d), %"PRIdPTR"(%d), %"PRIdPTR", %"PRIdPTR"]\n",
-            i,
-            gpioScript[script_id].script.instr[i].p[0],
-            gpioScript[script_id].script.instr[i].p[1],
-            gpioScript[script_id].script.instr[i].opt[1],
-            gpioScript[script_id].script.instr[i].p[2],
-            gpioScript[script_id].script.instr[i].opt[2],
-            gpioScript[script_id].script.instr[i].p[3],
-            gpioScript[script_id].script.instr[i].p[4]);
+         ch[DMA_CS] = (ch[DMA_CS] & ~DMA_ACTIVE) | DMA_END_FLAG;
+         d->active = 0;
+         return;
       }
    }
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
-int gpioInitialise(void)
+static void * pthSimThread(void *x)
 {
-   int status;
+   simDMA_t dma[SIM_DMA_CHANNELS];
+   uint64_t now, last, t;
+   struct timespec ts;
+   int i;
 
-   if (libInitialised) return PIGPIO_VERSION;
+   memset(dma, 0, sizeof(dma));
 
-   DBG(DBG_STARTUP, "not initialised, initialising");
+   /* sleep for as little longer than asked as the kernel allows */
 
-   runState = PI_STARTING;
+   prctl(PR_SET_TIMERSLACK, 1);
 
-   status = initInitialise();
+   ts.tv_sec  = 0;
+   ts.tv_nsec = SIM_SLEEP_NANOS;
 
-   if (status < 0)
-   {
-      runState = PI_ENDING;
-      initReleaseResources();
-   }
-   else
+   last = simNanos();
+
+   while (1)
    {
-      libInitialised = 1;
+      pthread_testcancel();
 
-      runState = PI_RUNNING;
+      now = simNanos();
 
-      if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+      /*
+         Step every channel through the time slept together so that
+         the levels a wave writes are sampled in the order written.
+      */
+
+      t = last;
+
+      do
       {
-         while (pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
+         t += SIM_STEP_NANOS;
+
+         if (t > now) t = now;
+
+         systReg[SYST_CLO] = t / THOUSAND;
+         systReg[SYST_CHI] = (t / THOUSAND) >> 32;
+
+         simGpioUpdate();
+
+         for (i=0; i<SIM_DMA_CHANNELS; i++)
+            simDMAStep(dmaReg + (i * 0x40), &dma[i], t);
       }
+      while (t < now);
 
+      last = now;
+
+      nanosleep(&ts, NULL);
    }
 
-   return status;
+   return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-void gpioTerminate(void)
+static int simStart(void)
 {
-   int i;
+   pthread_attr_t pthAttr;
 
-   DBG(DBG_USER, "");
+   DBG(DBG_STARTUP, "");
 
-   if (!libInitialised) return;
+   if (pthread_attr_init(&pthAttr))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
 
-   DBG(DBG_STARTUP, "initialised, terminating");
+   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
 
-   runState = PI_ENDING;
+   if (pthread_create(&pthSim, &pthAttr, pthSimThread, NULL))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_create sim failed (%m)");
 
-   gpioMaskSet = 0;
+   pthSimRunning = PI_THREAD_RUNNING;
 
-   /* reset DMA */
+   /* wait for the system timer to start */
 
-   if (dmaReg != MAP_FAILED)
-   {
-      initKillDMA(dmaIn);
-      initKillDMA(dmaOut);
-   }
+   while (!systReg[SYST_CLO]) usleep(100);
 
-#ifndef EMBEDDED_IN_VM
-   if ((gpioCfg.internals & PI_CFG_STATS) &&
-       (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER)))
-   {
-      fprintf(stderr,
-         "\n#####################################################\n");
-      fprintf(stderr, "pigpio version=%d internals=%X\n",
-         PIGPIO_VERSION, gpioCfg.internals);
+   return 0;
+}
 
-      fprintf(stderr,
-         "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
-         gpioCfg.clockMicros, gpioCfg.memAllocMode,
-         gpioStats.dmaInitCbsCount, gpioStats.DMARestarts);
+/* ----------------------------------------------------------------------- */
 
-      fprintf(stderr,
-         "samples %u maxSamples %u maxEmit %u emitFrags %u\n",
-         gpioStats.numSamples, gpioStats.maxSamples,
-         gpioStats.maxEmit, gpioStats.emitFrags);
+static int simAllocBlock(int block)
+{
+   int n;
+   unsigned page;
+   char *virtualAdr;
 
-      fprintf(stderr, "cbTicks %d, cbCalls %u\n",
-         gpioStats.cbTicks, gpioStats.cbCalls);
+   DBG(DBG_STARTUP, "block=%d", block);
 
-      fprintf(stderr, "pipe: good %u, short %u, would block %u\n",
-         gpioStats.goodPipeWrite, gpioStats.shortPipeWrite,
-         gpioStats.wouldBlockPipeWrite);
+   virtualAdr = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE,
+       -1, 0);
 
-      fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n",
-         gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
+   if (virtualAdr == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap sim block %d failed (%m)", block);
 
-      for (i=0; i< TICKSLOTS; i++)
-         fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
+   page = block * PAGES_PER_BLOCK;
 
-      fprintf(stderr,
-         "\n#####################################################\n\n\n");
+   for (n=0; n<PAGES_PER_BLOCK; n++)
+   {
+      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
+      dmaBus[page+n] =
+         (dmaPage_t *)(uintptr_t)(SIM_DRAM_BUS + ((page+n) * PAGE_SIZE));
+      virtualAdr += PAGE_SIZE;
    }
 
-#endif
-   initReleaseResources();
-
-   fflush(NULL);
-
-   libInitialised = 0;
+   return 0;
 }
 
-static void switchFunctionOff(unsigned gpio)
+/* ======================================================================= */
+
+static void initCheckLockFile(void)
 {
-   switch (gpioInfo[gpio].is)
+   int fd;
+   int count;
+   int pid;
+   int err;
+   int delete;
+   char str[20];
+
+   fd = open(PI_LOCKFILE, O_RDONLY);
+
+   if (fd != -1)
    {
-      case GPIO_SERVO:
-         /* switch servo off */
-         myGpioSetServo(gpio, gpioInfo[gpio].width, 0);
-         gpioInfo[gpio].width = 0;
-         break;
+      DBG(DBG_STARTUP, "lock file exists");
+      delete = 1;
 
-      case GPIO_PWM:
-         /* switch pwm off */
-         myGpioSetPwm(gpio, gpioInfo[gpio].width, 0);
-         gpioInfo[gpio].width = 0;
-         break;
+      count = read(fd, str, sizeof(str)-1);
 
-      case GPIO_HW_CLK:
-         /* No longer disable clock hardware, doing that was a bug. */
-         gpioInfo[gpio].width = 0;
-         break;
+      if (count)
+      {
+         pid = atoi(str);
+         err = kill(pid, 0);
+         if (!err) delete = 0; /* process still exists */
+         DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
+      }
 
-      case GPIO_HW_PWM:
-         /* No longer disable PWM hardware, doing that was a bug. */
-         gpioInfo[gpio].width = 0;
-         break;
+      close(fd);
+      DBG(DBG_STARTUP, "lock file delete=%d", delete);
+
+      if (delete) unlink(PI_LOCKFILE);
    }
 }
 
-static void stopHardwarePWM(void)
+static int initGrabLockFile(void)
 {
-   unsigned i, pwm;
+   int fd;
+   int lockResult;
+   char pidStr[20];
 
-   for (i=0; i<= PI_MAX_GPIO; i++)
+   initCheckLockFile();
+
+   /* try to grab the lock file */
+
+   fd = open(PI_LOCKFILE, O_WRONLY|O_CREAT|O_EXCL|O_TRUNC, 0644);
+
+   if (fd != -1)
    {
-      if (gpioInfo[i].is == GPIO_HW_PWM)
-      {
-         pwm = (PWMDef[i] >> 4) & 3;
+      lockResult = flock(fd, LOCK_EX|LOCK_NB);
 
-         if (pwm == 0) pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
-         else          pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
+      if(lockResult == 0)
+      {
+         sprintf(pidStr, "%d\n", (int)getpid());
 
-         gpioInfo[i].width = 0;
-         gpioInfo[i].is = GPIO_UNDEFINED;
+         if (write(fd, pidStr, strlen(pidStr)) == -1)
+         {
+            /* ignore errors */
+         }
+      }
+      else
+      {
+         close(fd);
+         return -1;
       }
    }
+
+   return fd;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioSetMode(unsigned gpio, unsigned mode)
+static uint32_t * initMapMem(int fd, uint32_t addr, uint32_t len)
 {
-   int reg, shift, old_mode;
-
-   DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
-
-   CHECK_INITED;
+    if (gpioCfg.internals & PI_CFG_SIMULATE)
+    {
+       return (uint32_t *) mmap(0, len,
+          PROT_READ|PROT_WRITE,
+          MAP_SHARED|MAP_ANONYMOUS,
+          -1, 0);
+    }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+    return (uint32_t *) mmap(0, len,
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_LOCKED,
+       fd, addr);
+}
 
-   if (mode > PI_ALT3)
-      SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
+/* ----------------------------------------------------------------------- */
 
-   reg   =  gpio/10;
-   shift = (gpio%10) * 3;
+static int initCheckPermitted(void)
+{
+   DBG(DBG_STARTUP, "");
 
-   old_mode = (gpioReg[reg] >> shift) & 7;
+   if (gpioCfg.internals & PI_CFG_SIMULATE) return 0;
 
-   if (mode != old_mode)
+   if (!pi_ispi)
    {
-      switchFunctionOff(gpio);
-
-      gpioInfo[gpio].is = GPIO_UNDEFINED;
+      DBG(DBG_ALWAYS,
+         "\n" \
+         "+---------------------------------------------------------+\n" \
+         "|Sorry, this system does not appear to be a raspberry pi. |\n" \
+         "|aborting.                                                |\n" \
+         "+---------------------------------------------------------+\n\n");
+      return -1;
    }
 
-   gpioReg[reg] = (gpioReg[reg] & ~(7<<shift)) | (mode<<shift);
-
+   if ((fdMem = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
+   {
+      DBG(DBG_ALWAYS,
+         "\n" \
+         "+---------------------------------------------------------+\n" \
+         "|Sorry, you don't have permission to run this program.    |\n" \
+         "|Try running as root, e.g. precede the command with sudo. |\n" \
+         "+---------------------------------------------------------+\n\n");
+      return -1;
+   }
    return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioGetMode(unsigned gpio)
+static int initPeripherals(void)
 {
-   int reg, shift;
+   DBG(DBG_STARTUP, "");
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
 
-   CHECK_INITED;
+   if (gpioReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
 
-   reg   =  gpio/10;
-   shift = (gpio%10) * 3;
+   if (dmaReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
 
-   return (gpioReg[reg] >> shift) & 7;
-}
+   /* we should know if we are running on a BCM2711 by now */
 
+   if (gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET)
+   {
+      if (pi_is_2711)
+         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
+      else
+         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+   }
+      
+   if (gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET)
+   {
+      if (pi_is_2711)
+         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
+      else
+         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+   }
+      
+   dmaIn =  dmaReg + (gpioCfg.DMAprimaryChannel   * 0x40);
+   dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
 
-/* ----------------------------------------------------------------------- */
+   DBG(DBG_STARTUP, "DMA #%d @ %08"PRIXPTR,
+      gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
 
-int gpioSetPullUpDown(unsigned gpio, unsigned pud)
-{
-   int shift = (gpio & 0xf) << 1;
-   uint32_t bits;
-   uint32_t pull;
+   DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
 
-   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
+   clkReg  = initMapMem(fdMem, CLK_BASE,  CLK_LEN);
 
-   CHECK_INITED;
+   if (clkReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   systReg  = initMapMem(fdMem, SYST_BASE,  SYST_LEN);
 
-   if (pud > PI_PUD_UP)
-      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
+   if (systReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
 
-   if (pi_is_2711)
-   {
-      switch (pud)
-      {
-         case PI_PUD_OFF:  pull = 0; break;
-         case PI_PUD_UP:   pull = 1; break;
-         case PI_PUD_DOWN: pull = 2; break;
-      }
+   spiReg  = initMapMem(fdMem, SPI_BASE,  SPI_LEN);
 
-      bits = *(gpioReg + GPPUPPDN0 + (gpio>>4));
-      bits &= ~(3 << shift);
-      bits |= (pull << shift);
-      *(gpioReg + GPPUPPDN0 + (gpio>>4)) = bits;
-   }
-   else
-   {
-      *(gpioReg + GPPUD) = pud;
+   if (spiReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
 
-      myGpioDelay(1);
+   pwmReg  = initMapMem(fdMem, PWM_BASE,  PWM_LEN);
 
-      *(gpioReg + GPPUDCLK0 + BANK) = BIT;
+   if (pwmReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
 
-      myGpioDelay(1);
+   pcmReg  = initMapMem(fdMem, PCM_BASE,  PCM_LEN);
 
-      *(gpioReg + GPPUD) = 0;
+   if (pcmReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
 
-      *(gpioReg + GPPUDCLK0 + BANK) = 0;
-   }
+   auxReg  = initMapMem(fdMem, AUX_BASE,  AUX_LEN);
 
-   return 0;
-}
+   if (auxReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
 
+   padsReg  = initMapMem(fdMem, PADS_BASE,  PADS_LEN);
 
-/* ----------------------------------------------------------------------- */
+   if (padsReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
 
-int gpioRead(unsigned gpio)
-{
-   DBG(DBG_USER, "gpio=%d", gpio);
+   bscsReg  = initMapMem(fdMem, BSCS_BASE,  BSCS_LEN);
 
-   CHECK_INITED;
+   if (bscsReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   if (gpioCfg.internals & PI_CFG_SIMULATE) return simStart();
 
-   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
-   else                                         return PI_OFF;
+   return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioWrite(unsigned gpio, unsigned level)
+static int initZaps
+   (int  pmapFd, void *virtualBase, int  basePage, int  pages)
 {
-   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
-
-   CHECK_INITED;
+   int n;
+   uintptr_t index;
+   off_t offset;
+   ssize_t t;
+   uint32_t physical;
+   int status;
+   uintptr_t pageAdr;
+   unsigned long long pa;
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   DBG(DBG_STARTUP, "");
 
-   if (level > PI_ON)
-      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
+   status = 0;
 
-   if (gpio <= PI_MAX_GPIO)
-   {
-      if (gpioInfo[gpio].is != GPIO_WRITE)
-      {
-         /* stop a glitch between setting mode then level */
-         if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-         else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   pageAdr = (uintptr_t) dmaVirt[basePage];
 
-         switchFunctionOff(gpio);
+   index  = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
 
-         gpioInfo[gpio].is = GPIO_WRITE;
-      }
-   }
+   offset = lseek(pmapFd, index, SEEK_SET);
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   if (offset != index)
+      SOFT_ERROR(PI_INIT_FAILED, "lseek pagemap failed (%m)");
 
-   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   for (n=0; n<pages; n++)
+   {
+      t = read(pmapFd, &pa, sizeof(pa));
 
-   return 0;
-}
+      if (t != sizeof(pa))
+         SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
 
+      DBG(DBG_STARTUP, "pf%d=%016llX", n, pa);
 
-/* ----------------------------------------------------------------------- */
+      physical = 0x3FFFFFFF & (PAGE_SIZE * (pa & 0xFFFFFFFF));
 
-int gpioPWM(unsigned gpio, unsigned val)
-{
-   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
+      if (physical)
+      {
+         //cast twice to suppress warning, I belive this is ok as these
+         //are bus addresses, not virtual addresses. --plugwash
+         dmaBus[basePage+n] = (dmaPage_t *)(uintptr_t) (physical | pi_dram_bus);
 
-   CHECK_INITED;
+         dmaVirt[basePage+n] = mmap
+         (
+            (void *)pageAdr,
+            PAGE_SIZE,
+            PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED|MAP_LOCKED|MAP_NORESERVE,
+            fdMem,
+            physical
+         );
+      }
+      else status = 1;
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      pageAdr += PAGE_SIZE;
+   }
 
-   if (val > gpioInfo[gpio].range)
-      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
+   return status;
+}
 
-   if (gpioInfo[gpio].is != GPIO_PWM)
-   {
-      switchFunctionOff(gpio);
+/* ----------------------------------------------------------------------- */
 
-      gpioInfo[gpio].is = GPIO_PWM;
+static int initPagemapBlock(int block)
+{
+   int trys, ok;
+   unsigned pageNum;
 
-      if (!val) myGpioWrite(gpio, 0);
-   }
+   DBG(DBG_STARTUP, "block=%d", block);
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   dmaPMapBlk[block] = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
+       -1, 0);
 
-   myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+   if (dmaPMapBlk[block] == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
 
-   gpioInfo[gpio].width=val;
+   /* force allocation of physical memory */
 
-   return 0;
-}
+   memset((void *)dmaPMapBlk[block], 0xAA, (PAGES_PER_BLOCK*PAGE_SIZE));
 
-/* ----------------------------------------------------------------------- */
+   memset((void *)dmaPMapBlk[block], 0xFF, (PAGES_PER_BLOCK*PAGE_SIZE));
 
-int gpioGetPWMdutycycle(unsigned gpio)
-{
-   unsigned pwm;
+   memset((void *)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK*PAGE_SIZE));
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   pageNum = block * PAGES_PER_BLOCK;
 
-   CHECK_INITED;
+   dmaVirt[pageNum] = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
+       -1, 0);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if (dmaVirt[pageNum] == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
 
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_PWM:
-         return gpioInfo[gpio].width;
+   munmap(dmaVirt[pageNum], PAGES_PER_BLOCK*PAGE_SIZE);
 
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_duty[pwm];
+   trys = 0;
+   ok = 0;
 
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE/2;
+   while ((trys < 10) && !ok)
+   {
+      if (initZaps(fdPmap,
+                    dmaPMapBlk[block],
+                    pageNum,
+                    PAGES_PER_BLOCK) == 0) ok = 1;
+      else myGpioDelay(50000);
 
-      default:
-         SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
+      ++trys;
    }
-}
 
+   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
 
-/* ----------------------------------------------------------------------- */
+   return 0;
+}
 
-int gpioSetPWMrange(unsigned gpio, unsigned range)
+static int initMboxBlock(int block)
 {
-   int oldWidth, newWidth;
+   int n, ok;
+   unsigned page;
+   uintptr_t virtualAdr;
+   uintptr_t busAdr;
 
-   DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
+   DBG(DBG_STARTUP, "block=%d", block);
 
-   CHECK_INITED;
+   ok = mbDMAAlloc
+      (&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
 
-   if ((range < PI_MIN_DUTYCYCLE_RANGE)  || (range > PI_MAX_DUTYCYCLE_RANGE))
-      SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
+   page = block * PAGES_PER_BLOCK;
 
-   oldWidth = gpioInfo[gpio].width;
+   virtualAdr = (uintptr_t) dmaMboxBlk[block].virtual_addr;
+   busAdr = dmaMboxBlk[block].bus_addr;
 
-   if (oldWidth)
+   for (n=0; n<PAGES_PER_BLOCK; n++)
    {
-      if (gpioInfo[gpio].is == GPIO_PWM)
-      {
-         newWidth = (range * oldWidth) / gpioInfo[gpio].range;
-
-         myGpioSetPwm(gpio, oldWidth, 0);
-         gpioInfo[gpio].range = range;
-         gpioInfo[gpio].width = newWidth;
-         myGpioSetPwm(gpio, 0, newWidth);
-      }
+      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
+      dmaBus[page+n] = (dmaPage_t *) busAdr;
+      virtualAdr += PAGE_SIZE;
+      busAdr += PAGE_SIZE;
    }
 
-   gpioInfo[gpio].range = range;
-
-   /* return the actual range for the current gpio frequency */
-
-   return pwmRealRange[gpioInfo[gpio].freqIdx];
+   return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioGetPWMrange(unsigned gpio)
+static int initAllocDMAMem(void)
 {
-   DBG(DBG_USER, "gpio=%d", gpio);
-
-   CHECK_INITED;
+   int i, servoCycles, superCycles;
+   int status;
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   DBG(DBG_STARTUP, "");
 
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_HW_PWM:
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE;
+   /* Calculate the number of blocks needed for buffers.  The number
+      of blocks must be a multiple of the 20ms servo cycle.
+   */
 
-      default:
-         return gpioInfo[gpio].range;
-   }
-}
+   servoCycles = gpioCfg.bufferMilliseconds / 20;
+   if           (gpioCfg.bufferMilliseconds % 20) servoCycles++;
 
+   bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
 
-/* ----------------------------------------------------------------------- */
+   superCycles = bufferCycles / SUPERCYCLE;
+   if           (bufferCycles % SUPERCYCLE) superCycles++;
 
-int gpioGetPWMrealRange(unsigned gpio)
-{
-   unsigned pwm;
+   bufferCycles = SUPERCYCLE * superCycles;
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
 
-   CHECK_INITED;
+   DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d",
+      gpioCfg.bufferMilliseconds, gpioCfg.clockMicros,
+      bufferBlocks, bufferCycles);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   /* allocate memory for pointers to virtual and bus memory pages */
 
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_real_range[pwm];
+   dmaVirt = mmap(
+       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+       PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+       -1, 0);
 
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE;
+   if (dmaVirt == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
 
-      default:
-         return pwmRealRange[gpioInfo[gpio].freqIdx];
+   dmaBus = mmap(
+       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+       PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+       -1, 0);
+
+   if (dmaBus == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
+
+   dmaIVirt = (dmaIPage_t **) dmaVirt;
+   dmaIBus  = (dmaIPage_t **) dmaBus;
+
+   dmaOVirt = (dmaOPage_t **)(dmaVirt + (PAGES_PER_BLOCK*bufferBlocks));
+   dmaOBus  = (dmaOPage_t **)(dmaBus  + (PAGES_PER_BLOCK*bufferBlocks));
+
+   if (gpioCfg.internals & PI_CFG_SIMULATE)
+   {
+      /* process memory stands in for DMA memory */
+
+      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      {
+         status = simAllocBlock(i);
+         if (status < 0) return status;
+      }
+
+      simDMAPages = PAGES_PER_BLOCK * (bufferBlocks+PI_WAVE_BLOCKS);
    }
-}
+   else if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
+       ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) &&
+        (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS)))
+   {
+      /* pagemap allocation of DMA memory */
 
+      dmaPMapBlk = mmap(
+          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
+          PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+          -1, 0);
 
-/* ----------------------------------------------------------------------- */
+      if (dmaPMapBlk == MAP_FAILED)
+         SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
 
-int gpioSetPWMfrequency(unsigned gpio, unsigned frequency)
-{
-   int i, width;
-   unsigned diff, best, idx;
+      fdPmap = open("/proc/self/pagemap", O_RDONLY);
 
-   DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
+      if (fdPmap < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
 
-   CHECK_INITED;
+      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      {
+         status = initPagemapBlock(i);
+         if (status < 0)
+         {
+            close(fdPmap);
+            return status;
+         }
+      }
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      close(fdPmap);
 
-   if      (frequency > pwmFreq[0])           idx = 0;
-   else if (frequency < pwmFreq[PWM_FREQS-1]) idx = PWM_FREQS-1;
+      DBG(DBG_STARTUP, "dmaPMapBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
+         (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
+   }
    else
    {
-      best = 100000; /* impossibly high frequency difference */
-      idx = 0;
+      /* mailbox allocation of DMA memory */
 
-      for (i=0; i<PWM_FREQS; i++)
-      {
-         if (frequency > pwmFreq[i]) diff = frequency - pwmFreq[i];
-         else                        diff = pwmFreq[i] - frequency;
+      dmaMboxBlk = mmap(
+          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t),
+          PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+          -1, 0);
 
-         if (diff < best)
+      if (dmaMboxBlk == MAP_FAILED)
+         SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
+
+      fdMbox = mbOpen();
+
+      if (fdMbox < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
+
+      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      {
+         status = initMboxBlock(i);
+         if (status < 0)
          {
-            best = diff;
-            idx = i;
+            mbClose(fdMbox);
+            return status;
          }
       }
+
+      mbClose(fdMbox);
+
+      DBG(DBG_STARTUP, "dmaMboxBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
+         (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
    }
 
-   width = gpioInfo[gpio].width;
+   DBG(DBG_STARTUP,
+      "gpioReg=%08"PRIXPTR" pwmReg=%08"PRIXPTR" pcmReg=%08"PRIXPTR" clkReg=%08"PRIXPTR" auxReg=%08"PRIXPTR,
+      (uintptr_t)gpioReg, (uintptr_t)pwmReg,
+      (uintptr_t)pcmReg,  (uintptr_t)clkReg, (uintptr_t)auxReg);
 
-   if (width)
+   for (i=0; i<DMAI_PAGES; i++)
+      DBG(DBG_STARTUP, "dmaIBus[%d]=%08"PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+
+   if (gpioCfg.dbgLevel >= DBG_DMACBS)
    {
-      if (gpioInfo[gpio].is == GPIO_PWM)
-      {
-         myGpioSetPwm(gpio, width, 0);
-         gpioInfo[gpio].freqIdx = idx;
-         myGpioSetPwm(gpio, 0, width);
-      }
+      fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
+      for (i=0; i<NUM_CBS; i++) dmaCbPrint(i);
    }
 
-   gpioInfo[gpio].freqIdx = idx;
-
-   return pwmFreq[idx];
+   return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioGetPWMfrequency(unsigned gpio)
+static void initPWM(unsigned bits)
 {
-   unsigned pwm, clock;
+   DBG(DBG_STARTUP, "bits=%d", bits);
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   /* reset PWM */
 
-   CHECK_INITED;
+   pwmReg[PWM_CTL] = 0;
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   myGpioDelay(10);
 
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_freq[pwm];
+   pwmReg[PWM_STA] = -1;
 
-      case GPIO_HW_CLK:
-         clock = (clkDef[gpio] >> 4) & 3;
-         return hw_clk_freq[clock];
+   myGpioDelay(10);
 
-      default:
-         return pwmFreq[gpioInfo[gpio].freqIdx];
-   }
-}
+   /* set number of bits to transmit */
 
+   pwmReg[PWM_RNG1] = bits;
 
-/* ----------------------------------------------------------------------- */
+   myGpioDelay(10);
 
-int gpioServo(unsigned gpio, unsigned val)
-{
-   DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
+   dmaIVirt[0]->periphData = 1;
 
-   CHECK_INITED;
+   /* enable PWM DMA, raise panic and dreq thresholds to 15 */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   pwmReg[PWM_DMAC] = PWM_DMAC_ENAB      |
+                      PWM_DMAC_PANIC(15) |
+                      PWM_DMAC_DREQ(15);
 
-   if ((val!=PI_SERVO_OFF) && (val<PI_MIN_SERVO_PULSEWIDTH))
-      SOFT_ERROR(PI_BAD_PULSEWIDTH,
-         "gpio %d, bad pulsewidth (%d)", gpio, val);
+   myGpioDelay(10);
 
-   if (val>PI_MAX_SERVO_PULSEWIDTH)
-      SOFT_ERROR(PI_BAD_PULSEWIDTH,
-         "gpio %d, bad pulsewidth (%d)", gpio, val);
+   /* clear PWM fifo */
 
-   if (gpioInfo[gpio].is != GPIO_SERVO)
-   {
-      switchFunctionOff(gpio);
+   pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
 
-      gpioInfo[gpio].is = GPIO_SERVO;
+   myGpioDelay(10);
 
-      if (!val) myGpioWrite(gpio, 0);
-   }
+   /* enable PWM channel 1 and use fifo */
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+}
 
-   myGpioSetServo(gpio, gpioInfo[gpio].width, val);
+/* ----------------------------------------------------------------------- */
 
-   gpioInfo[gpio].width=val;
+static void initPCM(unsigned bits)
+{
+   DBG(DBG_STARTUP, "bits=%d", bits);
 
-   return 0;
-}
+   /* disable PCM so we can modify the regs */
 
+   pcmReg[PCM_CS] = 0;
 
-/* ----------------------------------------------------------------------- */
+   myGpioDelay(1000);
 
-int gpioGetServoPulsewidth(unsigned gpio)
-{
-   DBG(DBG_USER, "gpio=%d", gpio);
+   pcmReg[PCM_FIFO]   = 0;
+   pcmReg[PCM_MODE]   = 0;
+   pcmReg[PCM_RXC]    = 0;
+   pcmReg[PCM_TXC]    = 0;
+   pcmReg[PCM_DREQ]   = 0;
+   pcmReg[PCM_INTEN]  = 0;
+   pcmReg[PCM_INTSTC] = 0;
+   pcmReg[PCM_GRAY]   = 0;
 
-   CHECK_INITED;
+   myGpioDelay(1000);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits-1); /* # bits in frame */
 
-   if (gpioInfo[gpio].is != GPIO_SERVO)
-      SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
+   /* enable channel 1 with # bits width */
 
-   return gpioInfo[gpio].width;
-}
+   pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits-8);
 
+   pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
 
-/* ----------------------------------------------------------------------- */
+   myGpioDelay(1000);
 
-int gpioWaveClear(void)
-{
-   DBG(DBG_USER, "");
+   pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
 
-   CHECK_INITED;
+   pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
 
-   wfcur = 0;
+   pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
 
-   wfStats.micros = 0;
-   wfStats.pulses = 0;
-   wfStats.cbs    = 0;
+   /* enable PCM */
 
-   waveOutBotCB  = PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE;
-   waveOutBotOOL = PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE;
-   waveOutTopOOL = NUM_WAVE_OOL;
+   pcmReg[PCM_CS] |= PCM_CS_EN;
 
-   waveOutCount = 0;
+   /* enable tx */
 
-   waveEndPtr = NULL;
+   pcmReg[PCM_CS] |= PCM_CS_TXON;
 
-   return 0;
+   dmaIVirt[0]->periphData = 0x0F;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveAddNew(void)
+static void initHWClk
+   (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH)
 {
-   DBG(DBG_USER, "");
+   DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d",
+      clkCtl, clkDiv, clkSrc, divI, divF, MASH);
 
-   CHECK_INITED;
+   /* kill the clock if busy, anything else isn't reliable */
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   if (clkReg[clkCtl] & CLK_CTL_BUSY)
+   {
+      do
+      {
+         clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL;
+      }
+      while (clkReg[clkCtl] & CLK_CTL_BUSY);
+   }
 
-   wfcur = 0;
+   clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
 
-   wfStats.micros = 0;
-   wfStats.pulses = 0;
-   wfStats.cbs    = 0;
+   usleep(10);
 
-   return 0;
-}
+   clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
 
-/* ----------------------------------------------------------------------- */
+   usleep(10);
 
-int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses)
-{
-   int p;
+   clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
+}
 
-   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR, numPulses, (uintptr_t)pulses);
+static void initClock(int mainClock)
+{
+   const unsigned BITS=10;
+   int clockPWM;
+   unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
+   char *per;
+   unsigned micros;
 
-   CHECK_INITED;
+   DBG(DBG_STARTUP, "mainClock=%d", mainClock);
 
-   if (numPulses > PI_WAVE_MAX_PULSES)
-      SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
+   if (mainClock) micros = gpioCfg.clockMicros;
+   else           micros = PI_WF_MICROS;
 
-   if (!pulses) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+   clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
 
-   for (p=0; p<numPulses; p++)
+   if (clockPWM)
    {
-      wf[2][p].gpioOff = pulses[p].gpioOff;
-      wf[2][p].gpioOn  = pulses[p].gpioOn;
-      wf[2][p].usDelay = pulses[p].usDelay;
-      wf[2][p].flags   = 0;
+      clkCtl = CLK_PWMCTL;
+      clkDiv = CLK_PWMDIV;
+      per = "PWM";
+   }
+   else
+   {
+      clkCtl = CLK_PCMCTL;
+      clkDiv = CLK_PCMDIV;
+      per = "PCM";
    }
 
-   return rawWaveAddGeneric(numPulses, wf[2]);
+   clkSrc  = CLK_CTL_SRC_PLLD;
+   clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */ 
+   clkBits = BITS;        /* 10/BITS MHz - 1/BITS MHz */
+   clkDivF = 0;
+   clkMash = 0;
+
+   DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d",
+      per, clkDivI, clkDivF, clkMash, clkBits);
+
+   initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
+
+   if (clockPWM) initPWM(BITS);
+   else          initPCM(BITS);
+
+   myGpioDelay(2000);
+}
+
+static void initKillDMA(volatile uint32_t *dmaAddr)
+{
+   dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
+   dmaAddr[DMA_CS] = 0;
+   dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
+
+   dmaAddr[DMA_CONBLK_AD] = 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveAddSerial
-   (unsigned gpio,
-    unsigned baud,
-    unsigned data_bits,
-    unsigned stop_bits,
-    unsigned offset,
-    unsigned numBytes,
-    char     *bstr)
+static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr)
 {
-   int i, b, p, lev, c, v;
+   DBG(DBG_STARTUP, "");
 
-   uint16_t *wstr = (uint16_t *)bstr;
-   uint32_t *lstr = (uint32_t *)bstr;
+   initKillDMA(dmaAddr);
 
-   unsigned bitDelay[32];
+   dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
 
-   DBG(DBG_USER,
-      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
-      gpio, baud, data_bits, stop_bits, offset,
-      numBytes, myBuf2Str(numBytes, (char *)bstr));
+   dmaAddr[DMA_CONBLK_AD] = cbAddr;
 
-   CHECK_INITED;
+   /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR            |
+                        DMA_DEBUG_FIFO_ERR            |
+                        DMA_DEBUG_RD_LST_NOT_SET_ERR;
 
-   if ((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
 
-   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
-       (data_bits > PI_MAX_WAVE_DATABITS))
-      SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
+   dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES    |
+                     DMA_PANIC_PRIORITY(8) |
+                     DMA_PRIORITY(8)       |
+                     DMA_ACTIVE;
+}
 
-   if ((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) ||
-       (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
-      SOFT_ERROR(PI_BAD_STOPBITS,
-         "bad number of (half) stop bits (%d)", stop_bits);
+/* ----------------------------------------------------------------------- */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+static void initClearGlobals(void)
+{
+   int i;
 
-   if (numBytes > PI_WAVE_MAX_CHARS)
-      SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+   DBG(DBG_STARTUP, "");
 
-   if (offset > PI_WAVE_MAX_MICROS)
-      SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
+   statsClear();
 
-   if (data_bits > 8) numBytes /= 2;
-   if (data_bits > 16) numBytes /= 2;
+   alertBits   = 0;
+   monitorBits = 0;
+   notifyBits  = 0;
+   scriptBits  = 0;
+   gFilterBits = 0;
+   nFilterBits = 0;
+   wdogBits    = 0;
 
-   if (!numBytes) return 0;
+   pthAlertRunning  = PI_THREAD_NONE;
+   pthDispatchRunning = PI_THREAD_NONE;
+   pthNotifyRunning = PI_THREAD_NONE;
+   pthFifoRunning   = PI_THREAD_NONE;
+   pthSocketRunning = PI_THREAD_NONE;
+   pthSimRunning    = PI_THREAD_NONE;
+   pthTimerRunning  = PI_THREAD_NONE;
 
-   waveBitDelay(baud, data_bits, stop_bits, bitDelay);
+   alertRingHead = 0;
+   alertRingTail = 0;
 
-   p = 0;
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
 
-   wf[2][p].gpioOn  = (1<<gpio);
-   wf[2][p].gpioOff = 0;
-   wf[2][p].flags   = 0;
+   wfcur=0;
 
-   if (offset > bitDelay[0]) wf[2][p].usDelay = offset;
-   else                      wf[2][p].usDelay = bitDelay[0];
+   wfStats.micros     = 0;
+   wfStats.highMicros = 0;
+   wfStats.maxMicros  = PI_WAVE_MAX_MICROS;
 
-   for (i=0; i<numBytes; i++)
-   {
-      p++;
+   wfStats.pulses     = 0;
+   wfStats.highPulses = 0;
+   wfStats.maxPulses  = PI_WAVE_MAX_PULSES;
 
-      /* start bit */
+   wfStats.cbs        = 0;
+   wfStats.highCbs    = 0;
+   wfStats.maxCbs     = (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE);
 
-      wf[2][p].gpioOn = 0;
-      wf[2][p].gpioOff = (1<<gpio);
-      wf[2][p].usDelay = bitDelay[0];
-      wf[2][p].flags   = 0;
+   gpioGetSamples.func     = NULL;
+   gpioGetSamples.ex       = 0;
+   gpioGetSamples.userdata = NULL;
+   gpioGetSamples.bits     = 0;
 
-      lev = 0;
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      wfRx[i].mode      = PI_WFRX_NONE;
+      pthread_mutex_init(&wfRx[i].mutex, NULL);
+      gpioAlert[i].func = NULL;
+   }
 
-      if      (data_bits <  9) c = bstr[i];
-      else if (data_bits < 17) c = wstr[i];
-      else                  c = lstr[i];
+   for (i=0; i<=PI_MAX_GPIO; i++)
+   {
+      gpioInfo [i].is      = GPIO_UNDEFINED;
+      gpioInfo [i].width   = 0;
+      gpioInfo [i].range   = PI_DEFAULT_DUTYCYCLE_RANGE;
+      gpioInfo [i].freqIdx = DEFAULT_PWM_IDX;
+      gpioInfo [i].pud     = PI_PUD_UNKNOWN;
+   }
 
-      for (b=0; b<data_bits; b++)
-      {
-         if (c & (1<<b)) v=1; else v=0;
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      gpioNotify[i].seqno = 0;
+      gpioNotify[i].state = PI_NOTIFY_CLOSED;
+   }
 
-         if (v == lev) wf[2][p].usDelay += bitDelay[b+1];
-         else
-         {
-            p++;
+   notifyOpenSlots = 0;
 
-            lev = v;
+   for (i=0; i<32; i++)
+   {
+      notifyGpioSlots[i]  = 0;
+      notifyEventSlots[i] = 0;
+      scriptGpioSlots[i]  = 0;
+      scriptEventSlots[i] = 0;
+   }
 
-            if (lev)
-            {
-               wf[2][p].gpioOn  = (1<<gpio);
-               wf[2][p].gpioOff = 0;
-               wf[2][p].flags   = 0;
-            }
-            else
-            {
-               wf[2][p].gpioOn  = 0;
-               wf[2][p].gpioOff = (1<<gpio);
-               wf[2][p].flags   = 0;
-            }
+   for (i=0; i<=PI_MAX_SIGNUM; i++)
+   {
+      gpioSignal[i].func     = NULL;
+      gpioSignal[i].ex       = 0;
+      gpioSignal[i].userdata = NULL;
+   }
 
-            wf[2][p].usDelay = bitDelay[b+1];
-         }
-      }
+   for (i=0; i<PI_TIMER_SLOTS; i++)
+   {
+      gpioTimer[i].running = 0;
+      gpioTimer[i].func    = NULL;
+      gpioTimer[i].heapPos = -1;
+   }
 
-      /* stop bit */
+   timerHeapLen = 0;
+   timerActive  = -1;
 
-      if (lev) wf[2][p].usDelay += bitDelay[data_bits+1];
-      else
-      {
-         p++;
+   for (i=0; i<=PI_MAX_EVENT; i++)
+   {
+      eventAlert[i].func      = NULL;
+      eventAlert[i].ignore    = 0;
+      eventAlert[i].fired     = 0;
+   }
 
-         wf[2][p].gpioOn  = (1<<gpio);
-         wf[2][p].gpioOff = 0;
-         wf[2][p].usDelay = bitDelay[data_bits+1];
-         wf[2][p].flags   = 0;
-      }
+   /* calculate the usable PWM frequencies */
+
+   for (i=0; i<PWM_FREQS; i++)
+   {
+      pwmFreq[i]=
+         (1000000.0/
+            ((float)PULSE_PER_CYCLE*gpioCfg.clockMicros*pwmCycles[i]))+0.5;
+
+      DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
    }
 
-   p++;
+   inpFifo = NULL;
+   outFifo = NULL;
 
-   wf[2][p].gpioOn  = (1<<gpio);
-   wf[2][p].gpioOff = 0;
-   wf[2][p].usDelay = bitDelay[0];
-   wf[2][p].flags   = 0;
+   fdLock       = -1;
+   fdMem        = -1;
+   fdSock       = -1;
+   fdUnix       = -1;
+   fdEpoll      = -1;
+   fdSockStop   = -1;
 
-   return rawWaveAddGeneric(p, wf[2]);
+   sockStopping = 0;
+
+   dmaMboxBlk = MAP_FAILED;
+   dmaPMapBlk = MAP_FAILED;
+   dmaVirt = MAP_FAILED;
+   dmaBus  = MAP_FAILED;
+
+   auxReg  = MAP_FAILED;
+   clkReg  = MAP_FAILED;
+   dmaReg  = MAP_FAILED;
+   gpioReg = MAP_FAILED;
+   pcmReg  = MAP_FAILED;
+   pwmReg  = MAP_FAILED;
+   systReg = MAP_FAILED;
+   spiReg  = MAP_FAILED;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int rawWaveAddSPI(
-   rawSPI_t *spi,
-   unsigned offset,
-   unsigned spiSS,
-   char *buf,
-   unsigned spiTxBits,
-   unsigned spiBitFirst,
-   unsigned spiBitLast,
-   unsigned spiBits)
+static void initReleaseResources(void)
 {
-   int p, bit, dbv, halfbit;
-   int rising_edge[2], read_cycle[2];
-   uint32_t on_bits, off_bits;
-   int tx_bit_pos;
-
-   DBG(DBG_USER,
-      "spi=%08"PRIXPTR" off=%d spiSS=%d tx=%08"PRIXPTR", num=%d fb=%d lb=%d spiBits=%d",
-      (uintptr_t)spi, offset, spiSS, (uintptr_t)buf, spiTxBits,
-      spiBitFirst, spiBitLast, spiBits);
-
-   CHECK_INITED;
+   int i;
+   sockConn_t *conn;
 
-   if (spiSS > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
+   DBG(DBG_STARTUP, "");
 
-   /*
-   CPOL CPHA
-    0    0   read rising/write falling
-    0    1   read falling/write rising
-    1    0   read falling/write rising
-    1    1   read rising/write falling
-   */
+   /* shut down running threads */
 
-   if (spi->clk_pol) {rising_edge[0] = 0; rising_edge[1] = 1;}
-   else              {rising_edge[0] = 1; rising_edge[1] = 0;}
+   closeOrphanedCommandShm(-1);
 
-   if (spi->clk_pha) {read_cycle[0] = 0; read_cycle[1] = 1;}
-   else              {read_cycle[0] = 1; read_cycle[1] = 0;}
+   for (i=0; i<=PI_MAX_GPIO; i++)
+   {
+      if (gpioISR[i].pth)
+      {
+         /* destroy thread, unexport GPIO */
 
-   p = 0;
+         gpioSetISRFunc(i, 0, 0, NULL);
+      }
+   }
 
-   if (offset)
+   if (pthTimerRunning != PI_THREAD_NONE)
    {
-      wf[2][p].gpioOn  = 0;
-      wf[2][p].gpioOff = 0;
-      wf[2][p].flags   = 0;
-      wf[2][p].usDelay = offset;
-      p++;
+      pthread_cancel(pthTimer);
+      pthread_join(pthTimer, NULL);
+      pthread_cond_destroy(&timerCond);
+      pthTimerRunning = PI_THREAD_NONE;
    }
 
-   on_bits = 0;
-   off_bits = 0;
-
-   tx_bit_pos = 0;
+   for (i=0; i<PI_TIMER_SLOTS; i++)
+   {
+      gpioTimer[i].running = 0;
+      gpioTimer[i].heapPos = -1;
+   }
 
-   /* preset initial mosi bit */
+   timerHeapLen = 0;
+   timerActive  = -1;
 
-   if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
+   if (pthAlertRunning != PI_THREAD_NONE)
    {
-      on_bits  |= (1<<(spi->mosi));
-      dbv = 1;
+      pthread_cancel(pthAlert);
+      pthread_join(pthAlert, NULL);
+      pthAlertRunning = PI_THREAD_NONE;
    }
-   else
+
+   if (pthDispatchRunning != PI_THREAD_NONE)
    {
-      off_bits |= (1<<(spi->mosi));
-      dbv = 0;
+      pthread_cancel(pthDispatch);
+      pthread_join(pthDispatch, NULL);
+      pthDispatchRunning = PI_THREAD_NONE;
+      sem_destroy(&alertRingSem);
    }
 
-   if (!spi->clk_pha) tx_bit_pos ++;
+   if (pthNotifyRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthNotify);
+      pthread_join(pthNotify, NULL);
+      pthNotifyRunning = PI_THREAD_NONE;
+      sem_destroy(&notifyWriteSem);
+   }
 
-   if (spi->ss_pol) off_bits |= (1<<spiSS);
-   else             on_bits  |= (1<<spiSS);
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (gpioNotify[i].ring)
+      {
+         free(gpioNotify[i].ring);
+         gpioNotify[i].ring = NULL;
+      }
 
-   if (spi->clk_pol) on_bits  |= (1<<(spi->clk));
-   else              off_bits |= (1<<(spi->clk));
+      if (gpioNotify[i].shm) notifyShmClose(i);
+   }
 
-   wf[2][p].gpioOn  = on_bits;
-   wf[2][p].gpioOff = off_bits;
-   wf[2][p].flags   = 0;
+   if (pthFifoRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthFifo);
+      pthread_join(pthFifo, NULL);
+      pthFifoRunning = PI_THREAD_NONE;
+   }
 
-   if (spi->clk_us > spi->ss_us) wf[2][p].usDelay = spi->clk_us;
-   else                          wf[2][p].usDelay = spi->ss_us;
+   if (pthSocketRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthSocket);
+      pthread_join(pthSocket, NULL);
+      pthSocketRunning = PI_THREAD_NONE;
+   }
 
-   p++;
+   /*
+      A worker finishes the command in hand before it sees fdSockStop.
+      A helper thread may be in a long command, it is not waited for
+      and closes its own connection.
+   */
 
-   for (bit=1; bit<=spiBits; bit++)
-   {
-      for (halfbit=0; halfbit<2; halfbit++)
-      {
-         wf[2][p].usDelay = spi->clk_us;
-         wf[2][p].flags = 0;
+   pthread_mutex_lock(&sockConnMutex);
+   sockStopping = 1;
+   pthread_mutex_unlock(&sockConnMutex);
 
-         on_bits = 0;
-         off_bits = 0;
+   if (fdSockStop != -1) eventfd_write(fdSockStop, 1);
 
-         if (read_cycle[halfbit])
-         {
-            if ((bit>=spiBitFirst) && (bit<=spiBitLast))
-               wf[2][p].flags = WAVE_FLAG_READ;
-         }
-         else
-         {
-            if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
-            {
-               if (!dbv) on_bits  |= (1<<(spi->mosi));
-               dbv = 1;
-            }
-            else
-            {
-               if (dbv) off_bits |= (1<<(spi->mosi));
-               dbv = 0;
-            }
+   for (i=0; i<sockWorkers; i++) pthread_join(pthSockWorker[i], NULL);
 
-            ++tx_bit_pos;
-         }
+   sockWorkers = 0;
 
-         if (rising_edge[halfbit]) on_bits  |= (1<<(spi->clk));
-         else                      off_bits |= (1<<(spi->clk));
+   while (1)
+   {
+      pthread_mutex_lock(&sockConnMutex);
+      for (conn=sockConns; conn && conn->busy; conn=conn->next);
+      pthread_mutex_unlock(&sockConnMutex);
 
-         wf[2][p].gpioOn = on_bits;
-         wf[2][p].gpioOff = off_bits;
+      if (conn == NULL) break;
 
-         p++;
-      }
+      sockConnClose(conn);
    }
 
-   on_bits = 0;
-   off_bits = 0;
-
-   if (spi->ss_pol) on_bits  |= (1<<spiSS);
-   else             off_bits |= (1<<spiSS);
+   if (fdEpoll != -1)
+   {
+      close(fdEpoll);
+      fdEpoll = -1;
+   }
 
-   wf[2][p].gpioOn  = on_bits;
-   wf[2][p].gpioOff = off_bits;
-   wf[2][p].flags   = 0;
-   wf[2][p].usDelay = 0;
+   if (fdSockStop != -1)
+   {
+      close(fdSockStop);
+      fdSockStop = -1;
+   }
 
-   p++;
+   for (i=0; i<PI_WAVE_BUILDERS; i++)
+   {
+      if (waveBuilder[i].state == PI_WAVE_BUILDER_OPENED)
+         gpioWaveBuilderClose(i);
+   }
 
-   return rawWaveAddGeneric(p, wf[2]);
-}
+   waveCacheRelease();
 
-/* ----------------------------------------------------------------------- */
+   waveStreamRelease();
 
-int gpioWaveCreate(void)
-{
-   int i, wid;
-   int numCB, numBOOL, numTOOL;
-   int CB, BOOL, TOOL;
+   /* last, other threads may be waiting on the simulated timer */
 
-   DBG(DBG_USER, "");
+   if (pthSimRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthSim);
+      pthread_join(pthSim, NULL);
+      pthSimRunning = PI_THREAD_NONE;
+   }
 
-   CHECK_INITED;
+   simDMAPages = 0;
 
-   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+   /* release mmap'd memory */
 
-   /* What resources are needed? */
+   if (auxReg  != MAP_FAILED) munmap((void *)auxReg,  AUX_LEN);
+   if (bscsReg != MAP_FAILED) munmap((void *)bscsReg, BSCS_LEN);
+   if (clkReg  != MAP_FAILED) munmap((void *)clkReg,  CLK_LEN);
+   if (dmaReg  != MAP_FAILED) munmap((void *)dmaReg,  DMA_LEN);
+   if (gpioReg != MAP_FAILED) munmap((void *)gpioReg, GPIO_LEN);
+   if (pcmReg  != MAP_FAILED) munmap((void *)pcmReg,  PCM_LEN);
+   if (pwmReg  != MAP_FAILED) munmap((void *)pwmReg,  PWM_LEN);
+   if (systReg != MAP_FAILED) munmap((void *)systReg, SYST_LEN);
+   if (spiReg  != MAP_FAILED) munmap((void *)spiReg,  SPI_LEN);
 
-      waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+   auxReg  = MAP_FAILED;
+   bscsReg = MAP_FAILED;
+   clkReg  = MAP_FAILED;
+   dmaReg  = MAP_FAILED;
+   gpioReg = MAP_FAILED;
+   pcmReg  = MAP_FAILED;
+   pwmReg  = MAP_FAILED;
+   systReg = MAP_FAILED;
+   spiReg  = MAP_FAILED;
 
-   wid = -1;
+   if (dmaBus != MAP_FAILED)
+   {
+      munmap(dmaBus,
+         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+   }
 
-   /* Is there an exact fit with a deleted wave. */
+   dmaBus = MAP_FAILED;
 
-   for (i=0; i<waveOutCount; i++)
+   if (dmaVirt != MAP_FAILED)
    {
-      if (waveInfo[i].deleted             &&
-         (waveInfo[i].numCB   == numCB)   &&
-         (waveInfo[i].numBOOL == numBOOL) &&
-         (waveInfo[i].numTOOL == numTOOL))
+      for (i=0; i<PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS); i++)
       {
-         /* Reuse the deleted waves resources. */
-         wid = i;
-         break;
+         munmap(dmaVirt[i], PAGE_SIZE);
       }
+
+      munmap(dmaVirt,
+         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
    }
 
-   if (wid == -1)
+   dmaVirt = MAP_FAILED;
+
+   if (dmaPMapBlk != MAP_FAILED)
    {
-      /* Are there enough spare resources? */
+      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      {
+         munmap(dmaPMapBlk[i], PAGES_PER_BLOCK*PAGE_SIZE);
+      }
 
-      if ((numCB+waveOutBotCB) > NUM_WAVE_CBS)
-         return PI_TOO_MANY_CBS;
+      munmap(dmaPMapBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+   }
 
-      if ((numBOOL+waveOutBotOOL) > (waveOutTopOOL-numTOOL))
-         return PI_TOO_MANY_OOL;
+   dmaPMapBlk = MAP_FAILED;
 
-      if (wid >= PI_MAX_WAVES)
-         return PI_NO_WAVEFORM_ID;
+   if (dmaMboxBlk != MAP_FAILED)
+   {
+      fdMbox = mbOpen();
 
-      wid = waveOutCount++;
+      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      {
+         mbDMAFree(&dmaMboxBlk[bufferBlocks+PI_WAVE_BLOCKS-i-1]);
+      }
 
-      waveInfo[wid].botCB  = waveOutBotCB;
-      waveInfo[wid].topCB  = waveOutBotCB + numCB -1;
-      waveInfo[wid].botOOL = waveOutBotOOL;
-      waveInfo[wid].topOOL = waveOutTopOOL;
-      waveInfo[wid].numCB = numCB;
-      waveInfo[wid].numBOOL = numBOOL;
-      waveInfo[wid].numTOOL = numTOOL;
+      mbClose(fdMbox);
 
-      waveOutBotCB += numCB;
-      waveOutBotOOL += numBOOL;
-      waveOutTopOOL -= numTOOL;
+      munmap(dmaMboxBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t));
    }
 
-   /* Must be room if got this far. */
+   dmaMboxBlk = MAP_FAILED;
 
-   CB   = waveInfo[wid].botCB;
-   BOOL = waveInfo[wid].botOOL;
-   TOOL = waveInfo[wid].topOOL;
+   if (inpFifo != NULL)
+   {
+      fclose(inpFifo);
+      unlink(PI_INPFIFO);
+      inpFifo = NULL;
+   }
 
-   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, 0, 0, 0);
+   if (outFifo != NULL)
+   {
+      fclose(outFifo);
+      unlink(PI_OUTFIFO);
+      outFifo = NULL;
+   }
 
-   /* Sanity check. */
+   if (fdMem != -1)
+   {
+      close(fdMem);
+      fdMem = -1;
+   }
 
-   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
-        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
-        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
+   if (fdLock != -1)
    {
-      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
-         numCB,   CB-waveInfo[wid].botCB,
-         numBOOL, BOOL-waveInfo[wid].botOOL,
-         numTOOL, waveInfo[wid].topOOL-TOOL);
+      close(fdLock);
+      unlink(PI_LOCKFILE);
+      fdLock = -1;
    }
 
-   DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid,
-      numCB, numBOOL, numTOOL);
+   if (fdSock != -1)
+   {
+      close(fdSock);
+      fdSock = -1;
+   }
 
-   waveInfo[wid].deleted = 0;
+   if (fdUnix != -1)
+   {
+      close(fdUnix);
+      unlink(sockPath);
+      fdUnix = -1;
+   }
 
-   /* Consume waves. */
+   if (fdPmap != -1)
+   {
+      close(fdPmap);
+      fdPmap = -1;
+   }
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   if (fdMbox != -1)
+   {
+      close(fdMbox);
+      fdMbox = -1;
+   }
 
-   wfcur = 0;
+   gpioStats.DMARestarts = 0;
+   gpioStats.dmaInitCbsCount = 0;
 
-   return wid;
+   numSockNetAddr = 0;
 }
 
-int gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL)
+int initInitialise(void)
 {
-   int i, wid;
-   int numCB, numBOOL, numTOOL;
-   int CB, BOOL, TOOL;
-
-   DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
-
-   CHECK_INITED;
-
-   if (pctCB < 0 || pctCB > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
-   if (pctBOOL < 0 || pctBOOL > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
-   if (pctTOOL < 0 || pctTOOL > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
-
-   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+   int i;
+   unsigned rev, model;
+   struct sockaddr_in server;
+   struct sockaddr_in6 server6;
+   struct sockaddr_un serverUnix;
+   char * portStr;
+   unsigned port;
+   struct sched_param param;
+   pthread_attr_t pthAttr;
 
-   /* What resources are needed? */
-   waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+   DBG(DBG_STARTUP, "");
 
-   /* Amount of pad required */
-   CB = (NUM_WAVE_CBS - PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE) * pctCB / 100;
-   BOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctBOOL /100;
-   TOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctTOOL /100;
+   waveClockInited = 0;
+   PWMClockInited = 0;
 
-   /* Reject if wave is too big */
-   if (numCB > CB) return PI_TOO_MANY_CBS;
-   if (numBOOL > BOOL) return PI_TOO_MANY_OOL;
-   if (numTOOL > TOOL) return PI_TOO_MANY_OOL;
+   clock_gettime(CLOCK_REALTIME, &libStarted);
 
-   /* Set the padding */
-   numCB = CB;
-   numBOOL = BOOL;
-   numTOOL = TOOL;
+   rev = gpioHardwareRevision();
 
+   initClearGlobals();
 
-   wid = -1;
+   if (initCheckPermitted() < 0) return PI_INIT_FAILED;
 
-   /* Is there an exact fit with a deleted wave. */
+   /* simulated instances don't contend for the hardware */
 
-   for (i=0; i<waveOutCount; i++)
+   if (!(gpioCfg.internals & PI_CFG_SIMULATE))
    {
-      if (waveInfo[i].deleted             &&
-         (waveInfo[i].numCB   == numCB)   &&
-         (waveInfo[i].numBOOL == numBOOL) &&
-         (waveInfo[i].numTOOL == numTOOL))
-      {
-         /* Reuse the deleted waves resources. */
-         wid = i;
-         break;
-      }
+      fdLock = initGrabLockFile();
+
+      if (fdLock < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
    }
 
-   if (wid == -1)
+   if (!gpioMaskSet)
    {
-      /* Are there enough spare resources? */
+      if      (rev ==  0) gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+      else if (rev <   4) gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
+      else if (rev <  16) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+      else if (rev == 17) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+      else if (rev  < 20) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+      else if (rev == 20) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+      else if (rev == 21) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+      else
+      {
+         model = (rev >> 4) & 0xFF;
 
-      if ((numCB+waveOutBotCB) > NUM_WAVE_CBS)
-         return PI_TOO_MANY_CBS;
+         /* model
+         0=A 1=B
+         2=A+ 3=B+
+         4=Pi2B
+         5=Alpha
+         6=Compute Module
+         7=Unknown
+         8=Pi3B
+         9=Zero
+         12=Zero W
+         13=Pi3B+
+         14=Pi3A+
+         17=Pi4B
+         */
+         if      (model <  2) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+         else if (model <  4) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+         else if (model == 4) gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
 
-      if ((numBOOL+waveOutBotOOL) > (waveOutTopOOL-numTOOL))
-         return PI_TOO_MANY_OOL;
+         else if (model == 6
+               || model ==10
+               || model ==16) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
 
-      if (wid >= PI_MAX_WAVES)
-         return PI_NO_WAVEFORM_ID;
+         else if (model == 8
+               || model ==13
+               || model ==14) gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
 
-      wid = waveOutCount++;
+         else if (model == 9
+               || model ==12) gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
 
-      waveInfo[wid].botCB  = waveOutBotCB;
-      waveInfo[wid].topCB  = waveOutBotCB + numCB -1;
-      waveInfo[wid].botOOL = waveOutBotOOL;
-      waveInfo[wid].topOOL = waveOutTopOOL;
-      waveInfo[wid].numCB = numCB;
-      waveInfo[wid].numBOOL = numBOOL;
-      waveInfo[wid].numTOOL = numTOOL;
+         else if (model ==17) gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
+         else                 gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+      }
 
-      waveOutBotCB += numCB;
-      waveOutBotOOL += numBOOL;
-      waveOutTopOOL -= numTOOL;
+      gpioMaskSet = 1;
    }
 
-   /* Must be room if got this far. */
+#ifndef EMBEDDED_IN_VM
+   if (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
+      sigSetHandler();
+#endif
 
-   CB   = waveInfo[wid].botCB;
-   BOOL = waveInfo[wid].botOOL;
-   TOOL = waveInfo[wid].topOOL;
+   if (initPeripherals() < 0) return PI_INIT_FAILED;
 
-   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, numCB, numBOOL, numTOOL);
+   if (initAllocDMAMem() < 0) return PI_INIT_FAILED;
 
-   /* Sanity check. */
+   /* done with /dev/mem */
 
-   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
-        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
-        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
+   if (fdMem != -1)
    {
-      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
-         numCB,   CB-waveInfo[wid].botCB,
-         numBOOL, BOOL-waveInfo[wid].botOOL,
-         numTOOL, waveInfo[wid].topOOL-TOOL);
+      close(fdMem);
+      fdMem = -1;
    }
 
-   DBG(DBG_USER, "Wave padding: wid=%d CBs %d BOOL %d TOOL %d", wid,
-      numCB, numBOOL, numTOOL);
+   param.sched_priority = sched_get_priority_max(SCHED_FIFO);
 
-   waveInfo[wid].deleted = 0;
+   if (gpioCfg.internals & PI_CFG_RT_PRIORITY)
+      sched_setscheduler(0, SCHED_FIFO, &param);
 
-   /* Consume waves. */
+   initClock(1); /* initialise main clock */
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   atexit(gpioTerminate);
 
-   wfcur = 0;
+   if (pthread_attr_init(&pthAttr))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
 
-   return wid;
-}
-/* ----------------------------------------------------------------------- */
+   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
 
-int gpioWaveDelete(unsigned wave_id)
-{
-   DBG(DBG_USER, "wave id=%d", wave_id);
+   if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+   {
+      if (sem_init(&alertRingSem, 0, 0))
+         SOFT_ERROR(PI_INIT_FAILED, "sem_init alert ring failed (%m)");
 
-   CHECK_INITED;
+      if (pthread_create(&pthDispatch, &pthAttr, pthDispatchThread, &i))
+      {
+         sem_destroy(&alertRingSem);
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create dispatch failed (%m)");
+      }
 
-   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
-      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+      pthDispatchRunning = PI_THREAD_STARTED;
 
-   waveInfo[wave_id].deleted = 1;
+      if (sem_init(&notifyWriteSem, 0, 0))
+         SOFT_ERROR(PI_INIT_FAILED, "sem_init notify failed (%m)");
 
-   if (wave_id == (waveOutCount-1))
-   {
-      /* top wave deleted, garbage collect any other deleted waves */
+      if (pthread_create(&pthNotify, &pthAttr, pthNotifyThread, &i))
+      {
+         sem_destroy(&notifyWriteSem);
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create notify failed (%m)");
+      }
 
-      while ((wave_id > 0) && (waveInfo[wave_id-1].deleted)) --wave_id;
+      pthNotifyRunning = PI_THREAD_STARTED;
 
-      waveOutBotCB  = waveInfo[wave_id].botCB;
-      waveOutBotOOL = waveInfo[wave_id].botOOL;
-      waveOutTopOOL = waveInfo[wave_id].topOOL;
+      if (pthread_create(&pthAlert, &pthAttr, pthAlertThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
 
-      waveOutCount = wave_id;
+      pthAlertRunning = PI_THREAD_STARTED;
    }
 
-   return 0;
-}
+   if (!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF))
+   {
+      if (pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
 
-/* ----------------------------------------------------------------------- */
+      pthFifoRunning = PI_THREAD_STARTED;
+   }
 
-int gpioWaveTxStart(unsigned wave_mode)
-{
-   /* This function is deprecated and has been removed. */
+   if (!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF))
+   {
+      portStr = getenv(PI_ENVPORT);
+      if (portStr) port = atoi(portStr); else port = gpioCfg.socketPort;
 
-   CHECK_INITED;
+      // Accept connections on IPv6, unless we have an IPv4-only whitelist
+      if (!numSockNetAddr)
+      {
+         fdSock = socket(AF_INET6, SOCK_STREAM , 0);
 
-   SOFT_ERROR(PI_DEPRECATED, "deprected function removed");
-}
+         if (fdSock != -1)
+         {
+            bzero((char *)&server6, sizeof(server6));
+            server6.sin6_family = AF_INET6;
+            if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
+            {
+               server6.sin6_addr = in6addr_loopback;
+            }
+            else
+            {
+               server6.sin6_addr = in6addr_any;
+            }
+            server6.sin6_port = htons(port);
 
-/* ----------------------------------------------------------------------- */
+            int opt = 1;
+            setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            if (bind(fdSock,(struct sockaddr *)&server6, sizeof(server6)) < 0)
+               SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+         }
+      }
 
-int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode)
-{
-   rawCbs_t *p=NULL;
+      if (numSockNetAddr || fdSock == -1)
+      {
+         fdSock = socket(AF_INET , SOCK_STREAM , 0);
 
-   DBG(DBG_USER, "wave_id=%d wave_mode=%d", wave_id, wave_mode);
+         if (fdSock == -1)
+            SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
+         else
+         {
+           int opt = 1;
+           setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+         }
+         server.sin_family = AF_INET;
+         if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
+         {
+            server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+         }
+         else
+         {
+            server.sin_addr.s_addr = htonl(INADDR_ANY);
+         }
+         server.sin_port = htons(port);
 
-   CHECK_INITED;
+         if (bind(fdSock,(struct sockaddr *)&server , sizeof(server)) < 0)
+            SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+      }
 
-   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
-      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+      /*
+         The Unix domain socket can't be restricted by address so
+         it isn't offered when only some addresses are allowed.
+      */
 
-   if (wave_mode > PI_WAVE_MODE_REPEAT_SYNC)
-      SOFT_ERROR(PI_BAD_WAVE_MODE, "bad wave mode (%d)", wave_mode);
+      if (!(gpioCfg.ifFlags & PI_DISABLE_UNIX_IF) && !numSockNetAddr)
+      {
+         fdUnix = socket(AF_UNIX, SOCK_STREAM, 0);
 
-   if (!waveClockInited)
-   {
-      stopHardwarePWM();
-      initClock(0); /* initialise secondary clock */
-      waveClockInited = 1;
-      PWMClockInited = 0;
-   }
+         if (fdUnix == -1)
+            SOFT_ERROR(PI_INIT_FAILED, "unix socket failed (%m)");
 
-   if (wave_mode < PI_WAVE_MODE_ONE_SHOT_SYNC) initKillDMA(dmaOut);
+         bzero((char *)&serverUnix, sizeof(serverUnix));
+         serverUnix.sun_family = AF_UNIX;
+         strcpy(serverUnix.sun_path, sockPath);
 
-   p = rawWaveCBAdr(waveInfo[wave_id].topCB);
+         unlink(sockPath);
 
-   if ((wave_mode & 1) == PI_WAVE_MODE_ONE_SHOT)
-      p->next = 0;
-   else
-      p->next = waveCbPOadr(waveInfo[wave_id].botCB+1);
+         if (bind(fdUnix, (struct sockaddr *)&serverUnix,
+                  sizeof(serverUnix)) < 0)
+            SOFT_ERROR(PI_INIT_FAILED, "bind to %s failed (%m)", sockPath);
 
-   if (waveEndPtr && (wave_mode > PI_WAVE_MODE_REPEAT))
-   {
-      *waveEndPtr = waveCbPOadr(waveInfo[wave_id].botCB+1);
+         /* as open as the socket port */
 
-      if (!dmaOut[DMA_CONBLK_AD])
-      {
-         initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+         chmod(sockPath, 0666);
       }
-   }
-   else
-   {
-      initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+
+      if (pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
+
+      pthSocketRunning = PI_THREAD_STARTED;
    }
 
-   waveEndPtr = &p->next;
+   myGpioDelay(1000);
 
-   /* for compatability with the deprecated gpioWaveTxStart return the
-      number of cbs
-   */
-   return (waveInfo[wave_id].topCB - waveInfo[wave_id].botCB) + 1;
+   dmaInitCbs();
+
+   flushMemory();
+
+   //cast twice to suppress compiler warning, I belive this cast
+   //is ok because dmaIBus contains bus addresses, not virtual
+   //addresses.
+   initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+
+   return PIGPIO_VERSION;
 }
 
 
-/* ----------------------------------------------------------------------- */
+/* ======================================================================= */
 
-static int chainGetCB(int n)
+int getBitInBytes(int bitPos, char *buf, int numBits)
 {
-   int block, index;
+   int bitp, bufp;
 
-   if (n < (WCB_CHAIN_CBS * PI_WAVE_COUNT_PAGES))
+   if (bitPos < numBits)
    {
-      block = n / WCB_CHAIN_CBS;
-      index = n % WCB_CHAIN_CBS;
-      return (block*CBS_PER_OPAGE) + WCB_COUNTER_CBS + index;
+      bufp =      bitPos / 8;
+      bitp = 7 - (bitPos % 8);
+      if (buf[bufp] & (1<<bitp)) return 1;
    }
-   return -1;
+
+   return 0;
 }
 
-static void chainSetVal(int n, uint32_t val)
+/* ----------------------------------------------------------------------- */
+
+void putBitInBytes(int bitPos, char *buf, int bit)
 {
-   int block, index;
-   uint32_t *p;
+   int bitp, bufp;
 
-   if (n < (WCB_CHAIN_OOL * PI_WAVE_COUNT_PAGES))
-   {
-      block = n / WCB_CHAIN_OOL;
-      index = n % WCB_CHAIN_OOL;
-      p = (uint32_t *) dmaOVirt[block] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
-      p[index] = val;
-   }
+   bufp =      bitPos / 8;
+   bitp = 7 - (bitPos % 8);
+
+   if (bit) buf[bufp] |=   (1<<bitp);
+   else     buf[bufp] &= (~(1<<bitp));
 }
 
-static uint32_t chainGetValPadr(int n)
+/* ----------------------------------------------------------------------- */
+
+uint32_t rawWaveGetOOL(int pos)
 {
-   int block, index;
-   uint32_t *p;
+   int page, slot;
 
-   if (n < (WCB_CHAIN_OOL * PI_WAVE_COUNT_PAGES))
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
    {
-      block = n / WCB_CHAIN_OOL;
-      index = n % WCB_CHAIN_OOL;
-      p = (uint32_t *) dmaOBus[block] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
-      //cast twice to suppress warning, I belive this is ok as dmaOBus
-      //contains bus addresses not virtual addresses.
-      return (uint32_t)(uintptr_t) (p + index);
+      waveOOLPageSlot(pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
    }
-   return 0;
-}
 
-static uint32_t chainGetCntVal(int counter, int slot)
-{
-   uint32_t *p;
-   int page, offset;
-   page = counter / 2;
-   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
-   p = (uint32_t *) dmaOVirt[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
-   return p[WCB_CHAIN_OOL+ offset + slot];
+   return -1;
 }
 
-static void chainSetCntVal(int counter, int slot, uint32_t value)
-{
-   uint32_t *p;
-   int page, offset;
-   page = counter / 2;
-   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
-   p = (uint32_t *) dmaOVirt[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
-   p[WCB_CHAIN_OOL + offset + slot] = value;
-}
+/* ----------------------------------------------------------------------- */
 
-static uint32_t chainGetCntValPadr(int counter, int slot)
+void rawWaveSetOOL(int pos, uint32_t value)
 {
-   uint32_t *p;
-   int page, offset;
-   page = counter / 2;
-   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
-   p = (uint32_t *) dmaOBus[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
-   //cast twice to suppress warning, I belive this is ok as dmaOBus
-   //contains bus addresses not virtual addresses. --plugwash
-   return (uint32_t)(uintptr_t)(p + WCB_CHAIN_OOL + offset + slot);
+   int page, slot;
+
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
 }
 
-static int chainGetCntCB(int counter)
+
+/* ----------------------------------------------------------------------- */
+
+uint32_t rawWaveGetOut(int pos)
 {
-   int page, offset;
-   page = counter / 2;
-   offset = (counter % 2 ? WCB_CNT_CBS : 0);
-   return ((page * CBS_PER_OPAGE) + offset);
+   int page, slot;
+
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
+   }
+
+   return -1;
 }
 
-static void chainMakeCounter(
-   unsigned counter,
-   unsigned blklen,
-   unsigned blocks,
-   unsigned count,
-   uint32_t repeat,
-   uint32_t next)
+/* ----------------------------------------------------------------------- */
+
+void rawWaveSetOut(int pos, uint32_t value)
 {
-   rawCbs_t *p=NULL;
+   int page, slot;
 
-   int b, baseCB, dig;
-   uint32_t nxt;
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
+}
 
-   int botCB;
 
-   botCB  = chainGetCntCB(counter);
+/* ----------------------------------------------------------------------- */
 
-   baseCB = botCB;
+uint32_t rawWaveGetIn(int pos)
+{
+   int page, slot;
 
-   /* set up all the OOLs */
-   for (b=0; b < (blocks*(blklen+1)); b++) chainSetCntVal(counter, b, repeat);
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
+   }
 
-   for (b=0; b<blocks; b++)
-      chainSetCntVal(counter,
-         ((b*(blklen+1))+blklen),
-         waveCbPOadr(baseCB+((b*3)+3)));
+   return -1;
+}
 
-   for (b=0; b<blocks; b++)
-   {
-      /* copy BOTTOM to NEXT */
+/* ----------------------------------------------------------------------- */
 
-      p = rawWaveCBAdr(botCB++);
+void rawWaveSetIn(int pos, uint32_t value)
+{
+   int page, slot;
 
-      p->info = NORMAL_DMA;
+   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
+}
 
-      p->src = chainGetCntValPadr(counter, b*(blklen+1));
-      p->dst = (waveCbPOadr(botCB+1) + 20);
+/* ----------------------------------------------------------------------- */
 
-      p->length = 4;
-      p->next   = waveCbPOadr(botCB);
+rawWaveInfo_t rawWaveInfo(int wave_id)
+{
+   rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
 
-      /* copy BOTTOM to TOP */
+   if ((wave_id >=0) && (wave_id < PI_MAX_WAVES)) return waveInfo[wave_id];
+   else                                           return dummy;
+}
 
-      p = rawWaveCBAdr(botCB++);
+/* ----------------------------------------------------------------------- */
 
-      p->info   = NORMAL_DMA;
+double time_time(void)
+{
+   struct timeval tv;
+   double t;
 
-      p->src = chainGetCntValPadr(counter, b*(blklen+1));
-      p->dst = chainGetCntValPadr(counter, (b*(blklen+1))+blklen);
+   gettimeofday(&tv, 0);
 
-      p->length = 4;
-      p->next   = waveCbPOadr(botCB);
+   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
 
-      /* shift all down one */
+   return t;
+}
 
-      p = rawWaveCBAdr(botCB++);
+/* ----------------------------------------------------------------------- */
 
-      p->info   = NORMAL_DMA|DMA_SRC_INC|DMA_DEST_INC;
+void time_sleep(double seconds)
+{
+   struct timespec ts, rem;
 
-      p->src = chainGetCntValPadr(counter, ((b*(blklen+1))+1));
-      p->dst = chainGetCntValPadr(counter, ((b*(blklen+1))+0));
+   if (seconds > 0.0)
+   {
+      ts.tv_sec = seconds;
+      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
 
-      p->length = blklen*4;
-      p->next   = repeat;
+      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
+      {
+         /* copy remaining time to ts */
+         ts.tv_sec  = rem.tv_sec;
+         ts.tv_nsec = rem.tv_nsec;
+      }
    }
+}
 
-   /* reset the counter */
+/* ----------------------------------------------------------------------- */
 
-   p = rawWaveCBAdr(botCB);
+void rawDumpWave(void)
+{
+   int i;
 
-   p->info = NORMAL_DMA|DMA_SRC_INC|DMA_DEST_INC;
+   unsigned numWaves, t;
 
-   p->src = chainGetCntValPadr(counter, blocks*(blklen+1));
-   p->dst = chainGetCntValPadr(counter, 0);
+   rawWave_t *waves;
 
-   p->length = blocks*(blklen+1)*4;
-   p->next   = next;
+   numWaves = wfc[wfcur];
+   waves    = wf [wfcur];
 
-   b = 0;
+   t = 0;
 
-   while (count && (b<blocks))
+   for (i=0; i<numWaves; i++)
    {
-      dig = count % blklen;
-      count /= blklen;
-
-      if (count) nxt = chainGetCntVal(counter, (b*(blklen+1))+blklen);
-      else       nxt = waveCbPOadr(botCB);
-
-      chainSetCntVal(counter, b*(blklen+1)+dig, nxt);
-
-      b++;
+      fprintf(stderr, "%10u %08X %08X %08X %10u\n",
+         t, waves[i].gpioOn, waves[i].gpioOff,
+         waves[i].flags, waves[i].usDelay);
+      t += waves[i].usDelay;
    }
-
-   /* copy all the OOLs */
-   for (b=0; b < (blocks*(blklen+1)); b++)
-      chainSetCntVal(
-         counter, b+(blocks*(blklen+1)), chainGetCntVal(counter, b));
 }
 
+/* ----------------------------------------------------------------------- */
 
-int gpioWaveChain(char *buf, unsigned bufSize)
+void rawDumpScript(unsigned script_id)
 {
-   unsigned blklen=16, blocks=4;
-   int cb, chaincb;
-   rawCbs_t *p;
-   int i, wid, cmd, loop, counters;
-   unsigned cycles, delayCBs, dcb, delayLeft;
-   uint32_t repeat, next, *endPtr;
-   int stk_pos[10], stk_lev=0;
+   int i;
 
-   cb = 0;
-   loop = -1;
+   if (script_id >= PI_MAX_SCRIPTS) return;
 
-   DBG(DBG_USER, "bufSize=%d [%s]", bufSize, myBuf2Str(bufSize, buf));
+   if (gpioScript[script_id].state == PI_SCRIPT_IN_USE)
+   {
 
-   CHECK_INITED;
+      for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
+      {
+         fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]);
+      }
 
-   if (!waveClockInited)
-   {
-      stopHardwarePWM();
-      initClock(0); /* initialise secondary clock */
-      waveClockInited = 1;
-      PWMClockInited = 0;
+      fprintf(stderr, "\n");
+
+      for (i=0; i<PI_MAX_SCRIPT_VARS; i++)
+      {
+         fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]);
+      }
+
+      fprintf(stderr, "\n");
+
+      for (i=0; i<gpioScript[script_id].script.instrs; i++)
+      {
+         fprintf(stderr,
+            "c%d=[%"PRIdPTR", %"PRIdPTR"(%d), %"PRIdPTR"(%d), %"PRIdPTR", %"PRIdPTR"]\n",
+            i,
+            gpioScript[script_id].script.instr[i].p[0],
+            gpioScript[script_id].script.instr[i].p[1],
+            gpioScript[script_id].script.instr[i].opt[1],
+            gpioScript[script_id].script.instr[i].p[2],
+            gpioScript[script_id].script.instr[i].opt[2],
+            gpioScript[script_id].script.instr[i].p[3],
+            gpioScript[script_id].script.instr[i].p[4]);
+      }
    }
+}
 
-   initKillDMA(dmaOut);
+/* ======================================================================= */
 
-   waveEndPtr = NULL;
-   endPtr = NULL;
+int gpioInitialise(void)
+{
+   int status;
 
-   /* add delay cb at start of DMA */
+   if (libInitialised) return PIGPIO_VERSION;
 
-   p = rawWaveCBAdr(chainGetCB(cb++));
+   DBG(DBG_STARTUP, "not initialised, initialising");
 
-   /* use the secondary clock */
+   runState = PI_STARTING;
 
-   if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
+   status = initInitialise();
+
+   if (status < 0)
    {
-      p->info = NORMAL_DMA | TIMED_DMA(2);
-      p->dst  = PCM_TIMER;
+      runState = PI_ENDING;
+      initReleaseResources();
    }
    else
    {
-      p->info = NORMAL_DMA | TIMED_DMA(5);
-      p->dst  = PWM_TIMER;
-   }
-
-   //cast twice to suppress warning, I belive this is ok as dmaOBus
-   //contains bus addresses not virtual addresses. --plugwash
-   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-   p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
-   p->next   = waveCbPOadr(chainGetCB(cb));
-
-   counters = 0;
-   wid = -1;
-
-   i = 0;
+      libInitialised = 1;
 
-   while (i<bufSize)
-   {
-      wid = (unsigned)buf[i];
+      runState = PI_RUNNING;
 
-      if (wid == 255) /* wave command */
+      if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
       {
-         if ((i+2) > bufSize)
-            SOFT_ERROR(PI_BAD_CHAIN_CMD,
-               "incomplete chain command (at %d)", i);
-
-         cmd = buf[i+1];
-
-         if (cmd == 0) /* loop begin */
-         {
-            if (stk_lev >= (sizeof(stk_pos)/sizeof(int)))
-               SOFT_ERROR(PI_CHAIN_NESTING,
-                  "chain counters nested too deep (at %d)", i);
+         while (pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
+      }
 
-            stk_pos[stk_lev++] = cb;
+   }
 
-            i += 2;
-         }
-         else if (cmd == 1) /* loop end */
-         {
-            if (counters >= WCB_COUNTERS)
-               SOFT_ERROR(PI_CHAIN_COUNTER,
-                  "too many chain counters (at %d)", i);
+   return status;
+}
 
-            if ((i+4) > bufSize)
-               SOFT_ERROR(PI_BAD_CHAIN_CMD,
-                  "incomplete chain command (at %d)", i);
 
-            loop = 0;
-            if (--stk_lev >= 0) loop = stk_pos[stk_lev];
+/* ----------------------------------------------------------------------- */
 
-            if ((loop < 1) || (loop == cb))
-               SOFT_ERROR(PI_BAD_CHAIN_LOOP,
-                  "empty chain loop (at %d)", i);
+void gpioTerminate(void)
+{
+   int i;
 
-            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+   DBG(DBG_USER, "");
 
-            i += 4;
+   if (!libInitialised) return;
 
-            if (cycles > PI_MAX_WAVE_CYCLES)
-               SOFT_ERROR(PI_CHAIN_LOOP_CNT,
-                  "bad chain loop count (%d)", cycles);
+   DBG(DBG_STARTUP, "initialised, terminating");
 
-            if (cycles == 0)
-            {
-               /* Skip the complete loop block.  Change
-                  the next pointing to the start of the
-                  loop block to the current cb.
-               */
-               p = rawWaveCBAdr(chainGetCB(loop));
-               p->next = waveCbPOadr(chainGetCB(cb));
-            }
-            else if (cycles == 1)
-            {
-               /* Nothing to do, no need for a counter. */
-            }
-            else
-            {
-               chaincb = chainGetCB(cb++);
-               if (chaincb < 0)
-                  SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+   runState = PI_ENDING;
 
-               p = rawWaveCBAdr(chaincb);
+   gpioMaskSet = 0;
 
-               repeat = waveCbPOadr(chainGetCB(loop));
+   /* reset DMA */
 
-                /* Need to check next cb as well. */
+   if (dmaReg != MAP_FAILED)
+   {
+      initKillDMA(dmaIn);
+      initKillDMA(dmaOut);
+   }
 
-               chaincb = chainGetCB(cb);
+#ifndef EMBEDDED_IN_VM
+   if ((gpioCfg.internals & PI_CFG_STATS) &&
+       (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER)))
+   {
+      fprintf(stderr,
+         "\n#####################################################\n");
+      fprintf(stderr, "pigpio version=%d internals=%X\n",
+         PIGPIO_VERSION, gpioCfg.internals);
 
-               if (chaincb < 0)
-                  SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+      fprintf(stderr,
+         "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
+         gpioCfg.clockMicros, gpioCfg.memAllocMode,
+         gpioStats.dmaInitCbsCount, gpioStats.DMARestarts);
 
-               next = waveCbPOadr(chainGetCB(cb));
+      fprintf(stderr,
+         "samples %u maxSamples %u maxEmit %u emitFrags %u\n",
+         gpioStats.numSamples, gpioStats.maxSamples,
+         gpioStats.maxEmit, gpioStats.emitFrags);
 
-               /* dummy src and dest */
-               p->info = NORMAL_DMA;
-               //cast twice to suppress warning, I belive this is ok as dmaOBus
-               //contains bus addresses not virtual addresses. --plugwash
-               p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-               p->dst = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-               p->length = 4;
-               p->next = waveCbPOadr(chainGetCntCB(counters));
+      fprintf(stderr, "cbTicks %d, cbCalls %u\n",
+         gpioStats.cbTicks, gpioStats.cbCalls);
 
-               chainMakeCounter(counters, blklen, blocks,
-                            cycles-1, repeat, next);
+      fprintf(stderr, "pipe: good %u, short %u, would block %u\n",
+         gpioStats.goodPipeWrite, gpioStats.shortPipeWrite,
+         gpioStats.wouldBlockPipeWrite);
 
-               counters++;
-            }
-         }
-         else if (cmd == 2) /* delay us */
-         {
-            if ((i+4) > bufSize)
-               SOFT_ERROR(PI_BAD_CHAIN_CMD,
-                  "incomplete chain command (at %d)", i);
+      fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n",
+         gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
 
-            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+      fprintf(stderr, "alert ring: full %u, dropped %u, max used %u/%d\n",
+         gpioStats.alertRingFull, gpioStats.alertRingDropped,
+         gpioStats.alertRingMaxUsed, ALERT_RING_SLOTS);
 
-            i += 4;
+      fprintf(stderr, "notify: dropped reports %u\n",
+         gpioStats.notifyDropped);
 
-            if (cycles > PI_MAX_WAVE_DELAY)
-               SOFT_ERROR(PI_BAD_CHAIN_DELAY,
-                  "bad chain delay micros (%d)", cycles);
+      for (i=0; i< TICKSLOTS; i++)
+         fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
 
-            if (cycles)
-            {
-               delayLeft = cycles;
-               delayCBs = waveDelayCBs(delayLeft);
-               for (dcb=0; dcb<delayCBs; dcb++)
-               {
-                  chaincb = chainGetCB(cb++);
+      fprintf(stderr,
+         "\n#####################################################\n\n\n");
+   }
 
-                  if (chaincb < 0)
-                     SOFT_ERROR(
-                        PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+#endif
+   initReleaseResources();
 
-                  p = rawWaveCBAdr(chaincb);
+   fflush(NULL);
 
-                  /* use the secondary clock */
+   libInitialised = 0;
+}
 
-                  if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
-                  {
-                     p->info = NORMAL_DMA | TIMED_DMA(2);
-                     p->dst  = PCM_TIMER;
-                  }
-                  else
-                  {
-                     p->info = NORMAL_DMA | TIMED_DMA(5);
-                     p->dst  = PWM_TIMER;
-                  }
-
-                  //cast twice to suppress warning, I belive this is ok as dmaOBus
-                  //contains bus addresses not virtual addresses. --plugwash
-                  p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-
-                  p->length = BPD * delayLeft / PI_WF_MICROS;
-
-                  if ((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) &&
-                      (p->length > DMA_LITE_MAX))
-                  {
-                     p->length = DMA_LITE_MAX;
-                  }
-
-                  delayLeft -= (p->length / BPD);
-
-                  p->next = waveCbPOadr(chainGetCB(cb));
-               }
-            }
-         }
-         else if (cmd == 3) /* repeat loop forever */
-         {
-            i += 2;
-
-            loop = 0;
-            if (--stk_lev >= 0) loop = stk_pos[stk_lev];
+static void switchFunctionOff(unsigned gpio)
+{
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_SERVO:
+         /* switch servo off */
+         myGpioSetServo(NULL, gpio, gpioInfo[gpio].width, 0);
+         gpioInfo[gpio].width = 0;
+         break;
 
-            if ((loop < 1) || (loop == cb))
-               SOFT_ERROR(PI_BAD_CHAIN_LOOP,
-                  "empty chain loop (at %d)", i);
+      case GPIO_PWM:
+         /* switch pwm off */
+         myGpioSetPwm(NULL, gpio, gpioInfo[gpio].width, 0);
+         gpioInfo[gpio].width = 0;
+         break;
 
-            chaincb = chainGetCB(cb++);
-            if (chaincb < 0)
-               SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+      case GPIO_HW_CLK:
+         /* No longer disable clock hardware, doing that was a bug. */
+         gpioInfo[gpio].width = 0;
+         break;
 
-            if (i < bufSize)
-               SOFT_ERROR(PI_BAD_FOREVER,
-                  "loop forever must be last command");
+      case GPIO_HW_PWM:
+         /* No longer disable PWM hardware, doing that was a bug. */
+         gpioInfo[gpio].width = 0;
+         break;
+   }
+}
 
-            p = rawWaveCBAdr(chaincb);
+static void stopHardwarePWM(void)
+{
+   unsigned i, pwm;
 
-            /* dummy src and dest */
-            p->info = NORMAL_DMA;
-            //cast twice to suppress warning, I belive this is ok as dmaOBus
-            //contains bus addresses not virtual addresses. --plugwash
-            p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-            p->dst = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-            p->length = 4;
-            p->next = waveCbPOadr(chainGetCB(loop));
-            endPtr = &p->next;
-         }
-         else
-            SOFT_ERROR(PI_BAD_CHAIN_CMD,
-               "unknown chain command (255 %d)", cmd);
-      }
-      else if ((wid >= waveOutCount) || waveInfo[wid].deleted)
-         SOFT_ERROR(PI_BAD_WAVE_ID, "undefined wave (%d)", wid);
-      else
+   for (i=0; i<= PI_MAX_GPIO; i++)
+   {
+      if (gpioInfo[i].is == GPIO_HW_PWM)
       {
-         chaincb = chainGetCB(cb++);
-
-         if (chaincb < 0)
-            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
-
-         p = rawWaveCBAdr(chaincb);
-
-         chaincb = chainGetCB(cb);
+         pwm = (PWMDef[i] >> 4) & 3;
 
-         if (chaincb < 0)
-            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+         if (pwm == 0) pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
+         else          pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
 
-         chainSetVal(cb-1, waveCbPOadr(chaincb));
+         gpioInfo[i].width = 0;
+         gpioInfo[i].is = GPIO_UNDEFINED;
+      }
+   }
+}
 
-         /* patch next of wid topCB to next cb */
+/* ----------------------------------------------------------------------- */
 
-         p->info   = NORMAL_DMA;
-         p->src    = chainGetValPadr(cb-1); /* this next */
-         p->dst    = waveCbPOadr(waveInfo[wid].topCB) + 20; /* wid next */
-         p->length = 4;
-         p->next   = waveCbPOadr(waveInfo[wid].botCB+1);
+int gpioSetMode(unsigned gpio, unsigned mode)
+{
+   int reg, shift, old_mode;
 
-         i += 1;
-      }
-   }
+   DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
 
-   chaincb = chainGetCB(cb++);
+   CHECK_INITED;
 
-   if (chaincb < 0)
-      SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   p = rawWaveCBAdr(chaincb);
+   if (mode > PI_ALT3)
+      SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
 
-   p->info   = NORMAL_DMA;
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
 
-   //cast twice to suppress warning, I belive this is ok as dmaOBus
-   //contains bus addresses not virtual addresses. --plugwash
-   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-   p->dst    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
-   p->length = 4;
-   p->next = 0;
+   old_mode = (gpioReg[reg] >> shift) & 7;
 
-   if (!endPtr) endPtr = &p->next;
+   if (mode != old_mode)
+   {
+      switchFunctionOff(gpio);
 
-   initDMAgo((uint32_t *)dmaOut, waveCbPOadr(chainGetCB(0)));
+      gpioInfo[gpio].is = GPIO_UNDEFINED;
+   }
 
-   waveEndPtr = endPtr;
+   gpioReg[reg] = (gpioReg[reg] & ~(7<<shift)) | (mode<<shift);
 
    return 0;
 }
 
-/*-------------------------------------------------------------------------*/
 
-int gpioWaveTxBusy(void)
+/* ----------------------------------------------------------------------- */
+
+int gpioGetMode(unsigned gpio)
 {
-   DBG(DBG_USER, "");
+   int reg, shift;
+
+   DBG(DBG_USER, "gpio=%d", gpio);
 
    CHECK_INITED;
 
-   if (dmaOut[DMA_CONBLK_AD])
-      return 1;
-   else
-      return 0;
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
+
+   return (gpioReg[reg] >> shift) & 7;
 }
 
-/*-------------------------------------------------------------------------*/
 
-int gpioWaveTxAt(void)
+/* ----------------------------------------------------------------------- */
+
+int gpioSetPullUpDown(unsigned gpio, unsigned pud)
 {
-   int i, cb;
+   int shift = (gpio & 0xf) << 1;
+   uint32_t bits;
+   uint32_t pull;
 
-   DBG(DBG_USER, "");
+   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
 
    CHECK_INITED;
 
-   cb = dmaNowAtOCB();
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   if (cb < 0) return -cb;
+   if (pud > PI_PUD_UP)
+      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
 
-   for (i=0; i<PI_MAX_WAVES; i++)
+   if (pi_is_2711)
    {
-      if ( !waveInfo[i].deleted &&
-          (cb >= waveInfo[i].botCB) &&
-          (cb <= waveInfo[i].topCB) ) return i;
+      switch (pud)
+      {
+         case PI_PUD_OFF:  pull = 0; break;
+         case PI_PUD_UP:   pull = 1; break;
+         case PI_PUD_DOWN: pull = 2; break;
+      }
+
+      bits = *(gpioReg + GPPUPPDN0 + (gpio>>4));
+      bits &= ~(3 << shift);
+      bits |= (pull << shift);
+      *(gpioReg + GPPUPPDN0 + (gpio>>4)) = bits;
    }
+   else
+   {
+      *(gpioReg + GPPUD) = pud;
 
-   return PI_WAVE_NOT_FOUND;
-}
+      myGpioDelay(1);
 
-/* ----------------------------------------------------------------------- */
+      *(gpioReg + GPPUDCLK0 + BANK) = BIT;
 
-int gpioWaveTxStop(void)
-{
-   DBG(DBG_USER, "");
+      myGpioDelay(1);
 
-   CHECK_INITED;
+      *(gpioReg + GPPUD) = 0;
 
-   initKillDMA(dmaOut);
+      *(gpioReg + GPPUDCLK0 + BANK) = 0;
+   }
 
-   waveEndPtr = NULL;
+   gpioInfo[gpio].pud = pud;
 
    return 0;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveGetMicros(void)
+int gpioRead(unsigned gpio)
 {
-   DBG(DBG_USER, "");
+   DBG(DBG_USER, "gpio=%d", gpio);
 
    CHECK_INITED;
 
-   return wfStats.micros;
-}
-
-/* ----------------------------------------------------------------------- */
-
-int gpioWaveGetHighMicros(void)
-{
-   DBG(DBG_USER, "");
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   CHECK_INITED;
+   if (pthSimRunning) simGpioUpdate();
 
-   return wfStats.highMicros;
+   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
+   else                                         return PI_OFF;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveGetMaxMicros(void)
+int gpioWrite(unsigned gpio, unsigned level)
 {
-   DBG(DBG_USER, "");
+   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
 
    CHECK_INITED;
 
-   return wfStats.maxMicros;
-}
-
-/* ----------------------------------------------------------------------- */
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-int gpioWaveGetPulses(void)
-{
-   DBG(DBG_USER, "");
+   if (level > PI_ON)
+      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
 
-   CHECK_INITED;
-
-   return wfStats.pulses;
-}
-
-/* ----------------------------------------------------------------------- */
-
-int gpioWaveGetHighPulses(void)
-{
-   DBG(DBG_USER, "");
+   if (gpio <= PI_MAX_GPIO)
+   {
+      if (gpioInfo[gpio].is != GPIO_WRITE)
+      {
+         /* stop a glitch between setting mode then level */
+         if (level == PI_OFF) myGpioOut(GPCLR0 + BANK, BIT);
+         else                 myGpioOut(GPSET0 + BANK, BIT);
 
-   CHECK_INITED;
+         switchFunctionOff(gpio);
 
-   return wfStats.highPulses;
-}
+         gpioInfo[gpio].is = GPIO_WRITE;
+      }
+   }
 
-/* ----------------------------------------------------------------------- */
+   myGpioSetMode(gpio, PI_OUTPUT);
 
-int gpioWaveGetMaxPulses(void)
-{
-   DBG(DBG_USER, "");
+   if (level == PI_OFF) myGpioOut(GPCLR0 + BANK, BIT);
+   else                 myGpioOut(GPSET0 + BANK, BIT);
 
-   CHECK_INITED;
+   if (pthSimRunning) simGpioUpdate();
 
-   return wfStats.maxPulses;
+   return 0;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveGetCbs(void)
+static void pwmBatchWrite(pwmBatch_t *batch)
 {
-   DBG(DBG_USER, "");
-
-   CHECK_INITED;
+   int n, level, pos, page, slot, gpio, i;
+   volatile uint32_t *word;
 
-   return wfStats.cbs;
-}
+   /*
+      Write each changed slot once, starting where the DMA is now and
+      in the order it will reach them.  The CPU stays well ahead of
+      the DMA so every PWM and servo cycle it starts after this point
+      sees all the changes.
+   */
 
-/* ----------------------------------------------------------------------- */
+   level = dmaCurrentSlot(dmaNowAtICB()) % SUPERLEVEL;
 
-int gpioWaveGetHighCbs(void)
-{
-   DBG(DBG_USER, "");
+   for (n=0; n<SUPERLEVEL; n++)
+   {
+      if (!(level % PULSE_PER_CYCLE))
+      {
+         /* the gpioOn slot read at the start of this cycle */
 
-   CHECK_INITED;
+         pos = level / PULSE_PER_CYCLE;
 
-   return wfStats.highCbs;
-}
+         if (batch->onSet[pos] | batch->onClr[pos])
+         {
+            page = pos/ON_PER_IPAGE;
+            slot = pos%ON_PER_IPAGE;
 
-/* ----------------------------------------------------------------------- */
+            word = &dmaIVirt[page]->gpioOn[slot];
 
-int gpioWaveGetMaxCbs(void)
-{
-   DBG(DBG_USER, "");
+            *word = (*word & ~batch->onClr[pos]) | batch->onSet[pos];
 
-   CHECK_INITED;
+            batch->onSet[pos] = 0;
+            batch->onClr[pos] = 0;
+         }
+      }
 
-   return wfStats.maxCbs;
-}
+      /* the gpioOff slot read at the end of this level */
 
-/* ----------------------------------------------------------------------- */
+      pos = level + 1;
 
-static int read_SDA(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SDA, PI_INPUT);
-   return myGpioRead(w->I.SDA);
-}
+      if (batch->offSet[pos] | batch->offClr[pos])
+      {
+         myOffPageSlot(pos, &page, &slot);
 
-static void set_SDA(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SDA, PI_INPUT);
-}
+         word = &dmaIVirt[page]->gpioOff[slot];
 
-static void clear_SDA(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SDA, PI_OUTPUT);
-   myGpioWrite(w->I.SDA, 0);
-}
+         *word = (*word & ~batch->offClr[pos]) | batch->offSet[pos];
 
-static void clear_SCL(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SCL, PI_OUTPUT);
-   myGpioWrite(w->I.SCL, 0);
-}
+         batch->offSet[pos] = 0;
+         batch->offClr[pos] = 0;
+      }
 
-static void I2C_delay(wfRx_t *w)
-{
-   myGpioDelay(w->I.delay);
-}
+      if (++level >= SUPERLEVEL) level = 0;
+   }
 
-static void I2C_clock_stretch(wfRx_t *w)
-{
-   uint32_t now, max_stretch=100000;
+   if (batch->gpioClr)
+   {
+      myGpioOut(GPCLR0, batch->gpioClr);
+      myGpioOut(GPCLR0, batch->gpioClr);
 
-   myGpioSetMode(w->I.SCL, PI_INPUT);
-   now = gpioTick();
-   while ((myGpioRead(w->I.SCL) == 0) && ((gpioTick()-now) < max_stretch));
-}
+      if (pthSimRunning) simGpioUpdate();
+   }
 
-static void I2CStart(wfRx_t *w)
-{
-   if (w->I.started)
+   if (batch->servoOff)
    {
-      set_SDA(w);
-      I2C_delay(w);
-      I2C_clock_stretch(w);
-      I2C_delay(w);
-   }
+      /* if in pulse then delay for the last cycle to complete */
 
-   clear_SDA(w);
-   I2C_delay(w);
-   clear_SCL(w);
-   I2C_delay(w);
+      if (*(gpioReg + GPLEV0) & batch->servoOff)
+         myGpioDelay(PI_MAX_SERVO_PULSEWIDTH);
 
-   w->I.started = 1;
-}
+      for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+      {
+         if ((batch->servoOff & (1<<gpio)) && gpioInfo[gpio].deferOff)
+         {
+            for (i=0; i<SUPERLEVEL; i+=gpioInfo[gpio].deferRng)
+               myClearGpioOff(NULL, gpio, i+gpioInfo[gpio].deferOff);
 
-static void I2CStop(wfRx_t *w)
-{
-   clear_SDA(w);
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   I2C_delay(w);
-   set_SDA(w);
-   I2C_delay(w);
+            gpioInfo[gpio].deferOff = 0;
+         }
+      }
+   }
 
-   w->I.started = 0;
+   batch->gpioClr  = 0;
+   batch->servoOff = 0;
 }
 
-static void I2CPutBit(wfRx_t *w, int bit)
-{
-   if (bit) set_SDA(w);
-   else     clear_SDA(w);
-
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   I2C_delay(w);
-   clear_SCL(w);
-}
+/* ----------------------------------------------------------------------- */
 
-static int I2CGetBit(wfRx_t *w)
+int gpioPWM(unsigned gpio, unsigned val)
 {
-   int bit;
+   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
 
-   set_SDA(w); /* let SDA float */
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   bit = read_SDA(w);
-   I2C_delay(w);
-   clear_SCL(w);
+   CHECK_INITED;
 
-   return bit;
-}
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-static int I2CPutByte(wfRx_t *w, int byte)
-{
-   int bit, nack;
+   if (val > gpioInfo[gpio].range)
+      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
 
-   for(bit=0; bit<8; bit++)
+   if (gpioInfo[gpio].is != GPIO_PWM)
    {
-      I2CPutBit(w, byte & 0x80);
-      byte <<= 1;
-   }
+      switchFunctionOff(gpio);
 
-   nack = I2CGetBit(w);
+      gpioInfo[gpio].is = GPIO_PWM;
 
-   return nack;
-}
+      if (!val) myGpioWrite(gpio, 0);
+   }
 
-static uint8_t I2CGetByte(wfRx_t *w, int nack)
-{
-   int bit, byte=0;
+   myGpioSetMode(gpio, PI_OUTPUT);
 
-   for (bit=0; bit<8; bit++)
-   {
-      byte = (byte << 1) | I2CGetBit(w);
-   }
+   myGpioSetPwm(NULL, gpio, gpioInfo[gpio].width, val);
 
-   I2CPutBit(w, nack);
+   gpioInfo[gpio].width=val;
 
-   return byte;
+   return 0;
 }
 
-/*-------------------------------------------------------------------------*/
+/* ----------------------------------------------------------------------- */
 
-int bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud)
+int gpioPWMMulti(unsigned count, gpioWidth_t *widths)
 {
-   DBG(DBG_USER, "SDA=%d SCL=%d baud=%d", SDA, SCL, baud);
+   int i;
+   unsigned gpio, val;
+
+   DBG(DBG_USER, "count=%d widths=%08"PRIXPTR, count, (uintptr_t)widths);
 
    CHECK_INITED;
 
-   if (SDA > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SDA (%d)", SDA);
+   /* check everything before changing anything */
 
-   if (SCL > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SCL (%d)", SCL);
+   for (i=0; i<count; i++)
+   {
+      gpio = widths[i].gpio;
+      val  = widths[i].width;
 
-   if ((baud < PI_BB_I2C_MIN_BAUD) || (baud > PI_BB_I2C_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_I2C_BAUD,
-         "SDA %d, bad baud rate (%d)", SDA, baud);
+      if (gpio > PI_MAX_USER_GPIO)
+         SOFT_ERROR(PI_BAD_USER_GPIO, "entry %d, bad gpio (%d)", i, gpio);
 
-   if (wfRx[SDA].mode != PI_WFRX_NONE)
-      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", SDA);
+      if (val > gpioInfo[gpio].range)
+         SOFT_ERROR(PI_BAD_DUTYCYCLE,
+            "entry %d, gpio %d, bad dutycycle (%d)", i, gpio, val);
+   }
 
-   if ((wfRx[SCL].mode != PI_WFRX_NONE)  || (SCL == SDA))
-      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", SCL);
+   pthread_mutex_lock(&pwmBatchMutex);
 
-   wfRx[SDA].gpio = SDA;
-   wfRx[SDA].mode = PI_WFRX_I2C_SDA;
-   wfRx[SDA].baud = baud;
+   for (i=0; i<count; i++)
+   {
+      gpio = widths[i].gpio;
+      val  = widths[i].width;
 
-   wfRx[SDA].I.started = 0;
-   wfRx[SDA].I.SDA = SDA;
-   wfRx[SDA].I.SCL = SCL;
-   wfRx[SDA].I.delay = 500000 / baud;
-   wfRx[SDA].I.SDAMode = gpioGetMode(SDA);
-   wfRx[SDA].I.SCLMode = gpioGetMode(SCL);
+      if (gpioInfo[gpio].is != GPIO_PWM)
+      {
+         switchFunctionOff(gpio);
 
-   wfRx[SCL].gpio = SCL;
-   wfRx[SCL].mode = PI_WFRX_I2C_SCL;
+         gpioInfo[gpio].is = GPIO_PWM;
 
-   myGpioSetMode(SDA, PI_INPUT);
-   myGpioSetMode(SCL, PI_INPUT);
+         if (!val) myGpioWrite(gpio, 0);
+      }
+
+      myGpioSetMode(gpio, PI_OUTPUT);
+
+      myGpioSetPwm(&pwmBatch, gpio, gpioInfo[gpio].width, val);
+
+      gpioInfo[gpio].width=val;
+   }
+
+   pwmBatchWrite(&pwmBatch);
+
+   pthread_mutex_unlock(&pwmBatchMutex);
 
    return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int bbI2CClose(unsigned SDA)
+int gpioGetPWMdutycycle(unsigned gpio)
 {
-   DBG(DBG_USER, "SDA=%d", SDA);
+   unsigned pwm;
+
+   DBG(DBG_USER, "gpio=%d", gpio);
 
    CHECK_INITED;
 
-   if (SDA > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", SDA);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   switch(wfRx[SDA].mode)
+   switch (gpioInfo[gpio].is)
    {
-      case PI_WFRX_I2C_SDA:
-
-         myGpioSetMode(wfRx[SDA].I.SDA, wfRx[SDA].I.SDAMode);
-         myGpioSetMode(wfRx[SDA].I.SCL, wfRx[SDA].I.SCLMode);
+      case GPIO_PWM:
+         return gpioInfo[gpio].width;
 
-         wfRx[wfRx[SDA].I.SDA].mode = PI_WFRX_NONE;
-         wfRx[wfRx[SDA].I.SCL].mode = PI_WFRX_NONE;
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_duty[pwm];
 
-         break;
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE/2;
 
       default:
-
-         SOFT_ERROR(PI_NOT_I2C_GPIO, "no I2C on gpio (%d)", SDA);
-
-         break;
-
+         SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
    }
-
-   return 0;
 }
 
-/*-------------------------------------------------------------------------*/
 
-int bbI2CZip(
-   unsigned SDA,
-   char *inBuf,
-   unsigned inLen,
-   char *outBuf,
-   unsigned outLen)
+/* ----------------------------------------------------------------------- */
+
+int gpioSetPWMrange(unsigned gpio, unsigned range)
 {
-   int i, ack, inPos, outPos, status, bytes;
-   int addr, flags, esc, setesc;
-   wfRx_t *w;
+   int oldWidth, newWidth;
 
-   DBG(DBG_USER, "gpio=%d inBuf=%s outBuf=%08"PRIXPTR" len=%d",
-      SDA, myBuf2Str(inLen, (char *)inBuf), (uintptr_t)outBuf, outLen);
+   DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
 
    CHECK_INITED;
 
-   if (SDA > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", SDA);
-
-   if (wfRx[SDA].mode != PI_WFRX_I2C_SDA)
-      SOFT_ERROR(PI_NOT_I2C_GPIO, "no I2C on gpio (%d)", SDA);
-
-   if (!inBuf || !inLen)
-      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
-
-   if (!outBuf && outLen)
-      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
-
-   w = &wfRx[SDA];
-
-   inPos = 0;
-   outPos = 0;
-   status = 0;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   addr = 0;
-   flags = 0;
-   esc = 0;
-   setesc = 0;
+   if ((range < PI_MIN_DUTYCYCLE_RANGE)  || (range > PI_MAX_DUTYCYCLE_RANGE))
+      SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
 
-   wfRx_lock(SDA);
+   oldWidth = gpioInfo[gpio].width;
 
-   while (!status && (inPos < inLen))
+   if (oldWidth)
    {
-      DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x",
-         status, inPos, inLen, inBuf[inPos], addr, flags);
-
-      switch (inBuf[inPos++])
+      if (gpioInfo[gpio].is == GPIO_PWM)
       {
-         case PI_I2C_END:
-            status = 1;
-            break;
+         newWidth = (range * oldWidth) / gpioInfo[gpio].range;
 
-         case PI_I2C_START:
-            I2CStart(w);
-            break;
+         myGpioSetPwm(NULL, gpio, oldWidth, 0);
+         gpioInfo[gpio].range = range;
+         gpioInfo[gpio].width = newWidth;
+         myGpioSetPwm(NULL, gpio, 0, newWidth);
+      }
+   }
 
-         case PI_I2C_STOP:
-            I2CStop(w);
-            break;
+   gpioInfo[gpio].range = range;
 
-         case PI_I2C_ADDR:
-            addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-            if (addr < 0) status = PI_BAD_I2C_CMD;
-            break;
+   /* return the actual range for the current gpio frequency */
 
-         case PI_I2C_FLAGS:
-            /* cheat to force two byte flags */
-            esc = 1;
-            flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-            if (flags < 0) status = PI_BAD_I2C_CMD;
-            break;
+   return pwmRealRange[gpioInfo[gpio].freqIdx];
+}
 
-         case PI_I2C_ESC:
-            setesc = 1;
-            break;
 
-         case PI_I2C_READ:
+/* ----------------------------------------------------------------------- */
 
-            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+int gpioGetPWMrange(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-            if (bytes >= 0) ack = I2CPutByte(w, (addr<<1)|1);
+   CHECK_INITED;
 
-            if (bytes > 0)
-            {
-               if (!ack)
-               {
-                  if ((bytes + outPos) <= outLen)
-                  {
-                     for (i=0; i<(bytes-1); i++)
-                     {
-                        outBuf[outPos++] = I2CGetByte(w, 0);
-                     }
-                     outBuf[outPos++] = I2CGetByte(w, 1);
-                  }
-                  else status = PI_BAD_I2C_RLEN;
-               }
-               else status = PI_I2C_READ_FAILED;
-            }
-            else status = PI_BAD_I2C_CMD;
-            break;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-         case PI_I2C_WRITE:
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_HW_PWM:
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE;
 
-            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+      default:
+         return gpioInfo[gpio].range;
+   }
+}
 
-            if (bytes >= 0) ack = I2CPutByte(w, addr<<1);
 
-            if (bytes > 0)
-            {
-               if (!ack)
-               {
-                  if ((bytes + inPos) <= inLen)
-                  {
-                     for (i=0; i<(bytes-1); i++)
-                     {
-                        ack = I2CPutByte(w, inBuf[inPos++]);
-                        if (ack) status = PI_I2C_WRITE_FAILED;
-                     }
-                     ack = I2CPutByte(w, inBuf[inPos++]);
-                  }
-                  else status = PI_BAD_I2C_WLEN;
-               } else status = PI_I2C_WRITE_FAILED;
-            }
-            else status = PI_BAD_I2C_CMD;
-            break;
+/* ----------------------------------------------------------------------- */
 
-         default:
-            status = PI_BAD_I2C_CMD;
-      }
+int gpioGetPWMrealRange(unsigned gpio)
+{
+   unsigned pwm;
 
-      if (setesc) esc = 1; else esc = 0;
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-      setesc = 0;
-   }
+   CHECK_INITED;
 
-   wfRx_unlock(SDA);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if (status >= 0) status = outPos;
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_real_range[pwm];
 
-   return status;
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE;
+
+      default:
+         return pwmRealRange[gpioInfo[gpio].freqIdx];
+   }
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-void bscInit(int mode)
+int gpioSetPWMfrequency(unsigned gpio, unsigned frequency)
 {
-   int sda, scl, mosi, miso, ce;
+   int i, width;
+   unsigned diff, best, idx;
 
-   bscsReg[BSC_CR]=0; /* clear device */
-   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
-   bscsReg[BSC_SLV]=0; /* clear I2C slave address */
-   bscsReg[BSC_IMSC]=0xf; /* mask off all interrupts */
-   bscsReg[BSC_ICR]=0x0f; /* clear all interrupts */
+   DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
 
-   if (pi_is_2711)
-   {
-      sda = BSC_SDA_2711;
-      scl = BSC_SCL_SCLK_2711;
-      mosi = BSC_MOSI_2711;
-      miso = BSC_MISO_2711;
-      ce = BSC_CE_N_2711;
-   }
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if      (frequency > pwmFreq[0])           idx = 0;
+   else if (frequency < pwmFreq[PWM_FREQS-1]) idx = PWM_FREQS-1;
    else
    {
-      sda = BSC_SDA;
-      scl = BSC_SCL_SCLK;
-      mosi = BSC_MOSI;
-      miso = BSC_MISO;
-      ce = BSC_CE_N;
-   }
+      best = 100000; /* impossibly high frequency difference */
+      idx = 0;
 
+      for (i=0; i<PWM_FREQS; i++)
+      {
+         if (frequency > pwmFreq[i]) diff = frequency - pwmFreq[i];
+         else                        diff = pwmFreq[i] - frequency;
 
-   if (mode > 1) /* SPI uses all GPIO */
-   {
-      gpioSetMode(scl, PI_ALT3);
-      gpioSetMode(mosi, PI_ALT3);
-      gpioSetMode(miso, PI_ALT3);
-      gpioSetMode(ce, PI_ALT3);
+         if (diff < best)
+         {
+            best = diff;
+            idx = i;
+         }
+      }
    }
-   else
+
+   width = gpioInfo[gpio].width;
+
+   if (width)
    {
-      gpioSetMode(scl, PI_ALT3);
-      gpioSetMode(sda, PI_ALT3);
+      if (gpioInfo[gpio].is == GPIO_PWM)
+      {
+         myGpioSetPwm(NULL, gpio, width, 0);
+         gpioInfo[gpio].freqIdx = idx;
+         myGpioSetPwm(NULL, gpio, 0, width);
+      }
    }
+
+   gpioInfo[gpio].freqIdx = idx;
+
+   return pwmFreq[idx];
 }
 
-void bscTerm(int mode)
+
+/* ----------------------------------------------------------------------- */
+
+int gpioGetPWMfrequency(unsigned gpio)
 {
-   int sda, scl, mosi, miso, ce;
+   unsigned pwm, clock;
 
-   bscsReg[BSC_CR] = 0; /* clear device */
-   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
-   bscsReg[BSC_SLV]=0; /* clear I2C slave address */
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   if (pi_is_2711)
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   switch (gpioInfo[gpio].is)
    {
-      sda = BSC_SDA_2711;
-      scl = BSC_SCL_SCLK_2711;
-      mosi = BSC_MOSI_2711;
-      miso = BSC_MISO_2711;
-      ce = BSC_CE_N_2711;
-   }
-   else
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_freq[pwm];
+
+      case GPIO_HW_CLK:
+         clock = (clkDef[gpio] >> 4) & 3;
+         return hw_clk_freq[clock];
+
+      default:
+         return pwmFreq[gpioInfo[gpio].freqIdx];
+   }
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioServo(unsigned gpio, unsigned val)
+{
+   DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if ((val!=PI_SERVO_OFF) && (val<PI_MIN_SERVO_PULSEWIDTH))
+      SOFT_ERROR(PI_BAD_PULSEWIDTH,
+         "gpio %d, bad pulsewidth (%d)", gpio, val);
+
+   if (val>PI_MAX_SERVO_PULSEWIDTH)
+      SOFT_ERROR(PI_BAD_PULSEWIDTH,
+         "gpio %d, bad pulsewidth (%d)", gpio, val);
+
+   if (gpioInfo[gpio].is != GPIO_SERVO)
    {
-      sda = BSC_SDA;
-      scl = BSC_SCL_SCLK;
-      mosi = BSC_MOSI;
-      miso = BSC_MISO;
-      ce = BSC_CE_N;
+      switchFunctionOff(gpio);
+
+      gpioInfo[gpio].is = GPIO_SERVO;
+
+      if (!val) myGpioWrite(gpio, 0);
    }
 
+   myGpioSetMode(gpio, PI_OUTPUT);
 
-   if (mode > 1)
+   myGpioSetServo(NULL, gpio, gpioInfo[gpio].width, val);
+
+   gpioInfo[gpio].width=val;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioServoMulti(unsigned count, gpioWidth_t *widths)
+{
+   int i;
+   unsigned gpio, val;
+
+   DBG(DBG_USER, "count=%d widths=%08"PRIXPTR, count, (uintptr_t)widths);
+
+   CHECK_INITED;
+
+   /* check everything before changing anything */
+
+   for (i=0; i<count; i++)
    {
-      gpioSetMode(scl, PI_INPUT);
-      gpioSetMode(mosi, PI_INPUT);
-      gpioSetMode(miso, PI_INPUT);
-      gpioSetMode(ce, PI_INPUT);
+      gpio = widths[i].gpio;
+      val  = widths[i].width;
+
+      if (gpio > PI_MAX_USER_GPIO)
+         SOFT_ERROR(PI_BAD_USER_GPIO, "entry %d, bad gpio (%d)", i, gpio);
+
+      if (((val!=PI_SERVO_OFF) && (val<PI_MIN_SERVO_PULSEWIDTH)) ||
+          (val>PI_MAX_SERVO_PULSEWIDTH))
+         SOFT_ERROR(PI_BAD_PULSEWIDTH,
+            "entry %d, gpio %d, bad pulsewidth (%d)", i, gpio, val);
    }
-   else
+
+   pthread_mutex_lock(&pwmBatchMutex);
+
+   for (i=0; i<count; i++)
    {
-      gpioSetMode(sda, PI_INPUT);
-      gpioSetMode(scl, PI_INPUT);
+      gpio = widths[i].gpio;
+      val  = widths[i].width;
+
+      if (gpioInfo[gpio].is != GPIO_SERVO)
+      {
+         switchFunctionOff(gpio);
+
+         gpioInfo[gpio].is = GPIO_SERVO;
+
+         if (!val) myGpioWrite(gpio, 0);
+      }
+
+      myGpioSetMode(gpio, PI_OUTPUT);
+
+      myGpioSetServo(&pwmBatch, gpio, gpioInfo[gpio].width, val);
 
+      gpioInfo[gpio].width=val;
    }
+
+   pwmBatchWrite(&pwmBatch);
+
+   pthread_mutex_unlock(&pwmBatchMutex);
+
+   return 0;
 }
 
-int bscXfer(bsc_xfer_t *xfer)
-{
-   static int bscMode = 0;
 
-   int copied=0;
-   int active, mode;
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_USER, "control=0x%X (sa=0x%X, cr=0x%X) tx=%d [%s]",
-      xfer->control,
-      ((xfer->control)>>16) & 127,
-      (xfer->control) & 0x3fff,
-      xfer->txCnt,
-      myBuf2Str(xfer->txCnt, (char *)xfer->txBuf));
+int gpioGetServoPulsewidth(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
 
    CHECK_INITED;
 
-   eventAlert[PI_EVENT_BSC].ignore = 1;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if (xfer->control)
+   if (gpioInfo[gpio].is != GPIO_SERVO)
+      SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
+
+   return gpioInfo[gpio].width;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+static void waveFreeReset(waveFree_t *f, int start, int count)
+{
+   f->num = 0;
+
+   if (count > 0)
    {
-      /*
-         bscMode (0=None, 1=I2C, 2=SPI) tracks which GPIO have been
-         set to BSC mode
-      */
-      if (xfer->control & 2) mode = 2; /* SPI */
-      else                   mode = 1; /* assume I2C */
+      f->range[0].start = start;
+      f->range[0].count = count;
+      f->num = 1;
+   }
+}
 
-      if (mode > bscMode)
+/* ----------------------------------------------------------------------- */
+
+static int waveFreeGet(waveFree_t *f, int count)
+{
+   int i, best, start;
+
+   if (count <= 0) return 0;
+
+   /* best fit, the smallest free range which is large enough */
+
+   best = -1;
+
+   for (i=0; i<f->num; i++)
+   {
+      if ((f->range[i].count >= count) &&
+          ((best < 0) || (f->range[i].count < f->range[best].count)))
       {
-         bscInit(mode);
-         bscMode = mode;
+         best = i;
+
+         if (f->range[i].count == count) break;
       }
    }
-   else
+
+   if (best < 0) return -1;
+
+   start = f->range[best].start;
+
+   f->range[best].start += count;
+   f->range[best].count -= count;
+
+   if (f->range[best].count == 0)
    {
-      if (bscMode) bscTerm(bscMode);
-      bscMode = 0;
-      return 0; /* leave ignore set */
+      f->num--;
+
+      memmove(&f->range[best], &f->range[best+1],
+         (f->num - best) * sizeof(waveRange_t));
    }
 
-   xfer->rxCnt = 0;
+   return start;
+}
 
-   bscsReg[BSC_SLV] = ((xfer->control)>>16) & 127;
-   bscsReg[BSC_CR] = (xfer->control) & 0x3fff;
-   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
+/* ----------------------------------------------------------------------- */
 
-   active = 1;
+static void waveFreePut(waveFree_t *f, int start, int count)
+{
+   int i;
 
-   while (active)
+   if (count <= 0) return;
+
+   /* i is the first free range above the one being freed */
+
+   for (i=0; i<f->num; i++) if (f->range[i].start > start) break;
+
+   if (i && ((f->range[i-1].start + f->range[i-1].count) == start))
    {
-      active = 0;
+      /* join the range below, and the one above if it now touches */
 
-      while ((copied < xfer->txCnt) &&
-             (!(bscsReg[BSC_FR] & BSC_FR_TXFF)))
-      {
-         bscsReg[BSC_DR] = xfer->txBuf[copied++];
-         active = 1;
-      }
+      f->range[i-1].count += count;
 
-      while ((xfer->rxCnt < BSC_FIFO_SIZE) &&
-             (!(bscsReg[BSC_FR] & BSC_FR_RXFE)))
+      if ((i < f->num) && ((start + count) == f->range[i].start))
       {
-         xfer->rxBuf[xfer->rxCnt++] = bscsReg[BSC_DR];
-         active = 1;
-      }
+         f->range[i-1].count += f->range[i].count;
 
-      if (!active)
-      {
-         active = bscsReg[BSC_FR] & (BSC_FR_RXBUSY | BSC_FR_TXBUSY);
+         f->num--;
+
+         memmove(&f->range[i], &f->range[i+1],
+            (f->num - i) * sizeof(waveRange_t));
       }
+   }
+   else if ((i < f->num) && ((start + count) == f->range[i].start))
+   {
+      f->range[i].start = start;
+      f->range[i].count += count;
+   }
+   else
+   {
+      memmove(&f->range[i+1], &f->range[i],
+         (f->num - i) * sizeof(waveRange_t));
 
-      if (active) myGpioSleep(0, 20);
+      f->range[i].start = start;
+      f->range[i].count = count;
+
+      f->num++;
    }
+}
 
-   bscFR = bscsReg[BSC_FR] & 0xffff;
+/* ----------------------------------------------------------------------- */
 
-   eventAlert[PI_EVENT_BSC].ignore = 0;
+int gpioWaveClear(void)
+{
+   DBG(DBG_USER, "");
 
-   return (copied<<16) | bscFR;
+   CHECK_INITED;
+
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
+
+   wfcur = 0;
+
+   wfStats.micros = 0;
+   wfStats.pulses = 0;
+   wfStats.cbs    = 0;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   /* the stream's segments go with the waves */
+
+   if (waveStream.running) initKillDMA(dmaOut);
+
+   waveStreamRelease();
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   waveCacheRelease();
+
+   waveFreeReset(&waveFreeCB, WAVE_BOT_CB, NUM_WAVE_CBS - WAVE_BOT_CB);
+   waveFreeReset(&waveFreeOOL, WAVE_BOT_OOL, NUM_WAVE_OOL - WAVE_BOT_OOL);
+
+   waveOutCount = 0;
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   waveEndPtr = NULL;
+
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void set_CS(wfRx_t *w)
+int gpioWaveAddNew(void)
 {
-   myGpioWrite(w->S.CS, PI_SPI_FLAGS_GET_CSPOL(w->S.spiFlags));
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
+
+   wfcur = 0;
+
+   wfStats.micros = 0;
+   wfStats.pulses = 0;
+   wfStats.cbs    = 0;
+
+   return 0;
 }
 
-static void clear_CS(wfRx_t *w)
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses)
 {
-   myGpioWrite(w->S.CS, !PI_SPI_FLAGS_GET_CSPOL(w->S.spiFlags));
+   int p;
+
+   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR, numPulses, (uintptr_t)pulses);
+
+   CHECK_INITED;
+
+   if (numPulses > PI_WAVE_MAX_PULSES)
+      SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
+
+   if (!pulses) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+
+   for (p=0; p<numPulses; p++)
+   {
+      wf[2][p].gpioOff = pulses[p].gpioOff;
+      wf[2][p].gpioOn  = pulses[p].gpioOn;
+      wf[2][p].usDelay = pulses[p].usDelay;
+      wf[2][p].flags   = 0;
+   }
+
+   return rawWaveAddGeneric(numPulses, wf[2]);
 }
 
-static void set_SCLK(wfRx_t *w)
-{
-   myGpioWrite(w->S.SCLK, !PI_SPI_FLAGS_GET_CPOL(w->S.spiFlags));
-}
+/* ----------------------------------------------------------------------- */
+
+typedef struct
+{
+   uint8_t count;
+   uint8_t bit[8];
+} waveRuns_t;
+
+static waveRuns_t waveRuns[256]; /* set bit positions of each byte */
+
+static void waveRunsInit(void)
+{
+   int v, b;
+
+   for (v=0; v<256; v++)
+   {
+      waveRuns[v].count = 0;
+
+      for (b=0; b<8; b++)
+      {
+         if (v & (1<<b)) waveRuns[v].bit[waveRuns[v].count++] = b;
+      }
+   }
+}
+
+static int waveSerialPulses
+   (rawWave_t *out,
+    unsigned gpio,
+    unsigned baud,
+    unsigned data_bits,
+    unsigned stop_bits,
+    unsigned offset,
+    unsigned numBytes,
+    char     *bstr)
+{
+   /*
+      Encodes serial data as pulses in out, which must have room for
+      numBytes*10+2 pulses.  Returns the number of pulses, not
+      counting the final idle pulse which is also written.
+
+      Each character is framed as a start bit, the data bits, and
+      a stop bit.  A pulse starts wherever the level changes, the
+      line being high before the start bit, and these changes are
+      looked up a byte at a time in waveRuns.  A pulse's delay is
+      the difference of the times its first bit and the next
+      pulse's first bit start.
+   */
+
+   static pthread_once_t runsOnce = PTHREAD_ONCE_INIT;
+
+   unsigned i, j, k, r, p, last, level, bit;
+   uint32_t c, cum[PI_MAX_WAVE_DATABITS+3];
+   uint64_t frame, edges, dataMask, frameMask;
+   waveRuns_t *runs;
+
+   uint16_t *wstr = (uint16_t *)bstr;
+   uint32_t *lstr = (uint32_t *)bstr;
+
+   unsigned bitDelay[PI_MAX_WAVE_DATABITS+2];
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if ((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
+
+   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
+       (data_bits > PI_MAX_WAVE_DATABITS))
+      SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
+
+   if ((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) ||
+       (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
+      SOFT_ERROR(PI_BAD_STOPBITS,
+         "bad number of (half) stop bits (%d)", stop_bits);
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (numBytes > PI_WAVE_MAX_CHARS)
+      SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+
+   if (offset > PI_WAVE_MAX_MICROS)
+      SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
+
+   if (data_bits > 8) numBytes /= 2;
+   if (data_bits > 16) numBytes /= 2;
+
+   if (!numBytes) return 0;
+
+   pthread_once(&runsOnce, waveRunsInit);
+
+   waveBitDelay(baud, data_bits, stop_bits, bitDelay);
+
+   /* cum[j] is the time bit j of the frame starts */
+
+   cum[0] = 0;
+
+   for (j=0; j<=(data_bits+1); j++) cum[j+1] = cum[j] + bitDelay[j];
+
+   dataMask  = ((uint64_t)1 << data_bits) - 1;
+   frameMask = ((uint64_t)1 << (data_bits + 2)) - 1;
+
+   bit = 1<<gpio;
+
+   p = 0;
+
+   out[p].gpioOn  = bit;
+   out[p].gpioOff = 0;
+   out[p].flags   = 0;
+
+   if (offset > bitDelay[0]) out[p].usDelay = offset;
+   else                      out[p].usDelay = bitDelay[0];
+
+   for (i=0; i<numBytes; i++)
+   {
+      if      (data_bits <  9) c = (uint8_t)bstr[i];
+      else if (data_bits < 17) c = wstr[i];
+      else                     c = lstr[i];
+
+      frame = ((c & dataMask) << 1) | ((uint64_t)1 << (data_bits + 1));
+
+      edges = (frame ^ ((frame << 1) | 1)) & frameMask;
+
+      /* the start bit is always the first change */
+
+      last = 0;
+
+      for (k=0; edges; k+=8, edges>>=8)
+      {
+         runs = &waveRuns[edges & 0xFF];
+
+         for (r=0; r<runs->count; r++)
+         {
+            j = k + runs->bit[r];
+
+            if (j) out[p].usDelay = cum[j] - cum[last];
+
+            p++;
+
+            level = (frame >> j) & 1;
+
+            out[p].gpioOn  = level ? bit : 0;
+            out[p].gpioOff = level ? 0 : bit;
+            out[p].flags   = 0;
+
+            last = j;
+         }
+      }
+
+      /* the stop bit ends the last pulse */
+
+      out[p].usDelay = cum[data_bits+2] - cum[last];
+   }
+
+   p++;
+
+   out[p].gpioOn  = bit;
+   out[p].gpioOff = 0;
+   out[p].usDelay = bitDelay[0];
+   out[p].flags   = 0;
+
+   return p;
+}
+
+int gpioWaveAddSerial
+   (unsigned gpio,
+    unsigned baud,
+    unsigned data_bits,
+    unsigned stop_bits,
+    unsigned offset,
+    unsigned numBytes,
+    char     *bstr)
+{
+   int p;
+
+   DBG(DBG_USER,
+      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
+      gpio, baud, data_bits, stop_bits, offset,
+      numBytes, myBuf2Str(numBytes, (char *)bstr));
+
+   CHECK_INITED;
+
+   p = waveSerialPulses(wf[2], gpio, baud, data_bits, stop_bits,
+      offset, numBytes, bstr);
+
+   if (p <= 0) return p;
+
+   return rawWaveAddGeneric(p, wf[2]);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int rawWaveAddSPI(
+   rawSPI_t *spi,
+   unsigned offset,
+   unsigned spiSS,
+   char *buf,
+   unsigned spiTxBits,
+   unsigned spiBitFirst,
+   unsigned spiBitLast,
+   unsigned spiBits)
+{
+   int p, bit, dbv, halfbit;
+   int rising_edge[2], read_cycle[2];
+   uint32_t on_bits, off_bits;
+   int tx_bit_pos;
+
+   DBG(DBG_USER,
+      "spi=%08"PRIXPTR" off=%d spiSS=%d tx=%08"PRIXPTR", num=%d fb=%d lb=%d spiBits=%d",
+      (uintptr_t)spi, offset, spiSS, (uintptr_t)buf, spiTxBits,
+      spiBitFirst, spiBitLast, spiBits);
+
+   CHECK_INITED;
+
+   if (spiSS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
+
+   /*
+   CPOL CPHA
+    0    0   read rising/write falling
+    0    1   read falling/write rising
+    1    0   read falling/write rising
+    1    1   read rising/write falling
+   */
+
+   if (spi->clk_pol) {rising_edge[0] = 0; rising_edge[1] = 1;}
+   else              {rising_edge[0] = 1; rising_edge[1] = 0;}
+
+   if (spi->clk_pha) {read_cycle[0] = 0; read_cycle[1] = 1;}
+   else              {read_cycle[0] = 1; read_cycle[1] = 0;}
+
+   p = 0;
+
+   if (offset)
+   {
+      wf[2][p].gpioOn  = 0;
+      wf[2][p].gpioOff = 0;
+      wf[2][p].flags   = 0;
+      wf[2][p].usDelay = offset;
+      p++;
+   }
+
+   on_bits = 0;
+   off_bits = 0;
+
+   tx_bit_pos = 0;
+
+   /* preset initial mosi bit */
+
+   if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
+   {
+      on_bits  |= (1<<(spi->mosi));
+      dbv = 1;
+   }
+   else
+   {
+      off_bits |= (1<<(spi->mosi));
+      dbv = 0;
+   }
+
+   if (!spi->clk_pha) tx_bit_pos ++;
+
+   if (spi->ss_pol) off_bits |= (1<<spiSS);
+   else             on_bits  |= (1<<spiSS);
+
+   if (spi->clk_pol) on_bits  |= (1<<(spi->clk));
+   else              off_bits |= (1<<(spi->clk));
+
+   wf[2][p].gpioOn  = on_bits;
+   wf[2][p].gpioOff = off_bits;
+   wf[2][p].flags   = 0;
+
+   if (spi->clk_us > spi->ss_us) wf[2][p].usDelay = spi->clk_us;
+   else                          wf[2][p].usDelay = spi->ss_us;
+
+   p++;
+
+   for (bit=1; bit<=spiBits; bit++)
+   {
+      for (halfbit=0; halfbit<2; halfbit++)
+      {
+         wf[2][p].usDelay = spi->clk_us;
+         wf[2][p].flags = 0;
+
+         on_bits = 0;
+         off_bits = 0;
+
+         if (read_cycle[halfbit])
+         {
+            if ((bit>=spiBitFirst) && (bit<=spiBitLast))
+               wf[2][p].flags = WAVE_FLAG_READ;
+         }
+         else
+         {
+            if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
+            {
+               if (!dbv) on_bits  |= (1<<(spi->mosi));
+               dbv = 1;
+            }
+            else
+            {
+               if (dbv) off_bits |= (1<<(spi->mosi));
+               dbv = 0;
+            }
+
+            ++tx_bit_pos;
+         }
+
+         if (rising_edge[halfbit]) on_bits  |= (1<<(spi->clk));
+         else                      off_bits |= (1<<(spi->clk));
+
+         wf[2][p].gpioOn = on_bits;
+         wf[2][p].gpioOff = off_bits;
+
+         p++;
+      }
+   }
+
+   on_bits = 0;
+   off_bits = 0;
+
+   if (spi->ss_pol) on_bits  |= (1<<spiSS);
+   else             off_bits |= (1<<spiSS);
+
+   wf[2][p].gpioOn  = on_bits;
+   wf[2][p].gpioOff = off_bits;
+   wf[2][p].flags   = 0;
+   wf[2][p].usDelay = 0;
+
+   p++;
+
+   return rawWaveAddGeneric(p, wf[2]);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint64_t waveHash(unsigned numPulses, rawWave_t *pulses)
+{
+   unsigned i;
+   uint64_t h;
+
+   /* FNV-1a, a word at a time */
+
+   h = 14695981039346656037ULL;
+
+   for (i=0; i<numPulses; i++)
+   {
+      h = (h ^ pulses[i].gpioOn)  * 1099511628211ULL;
+      h = (h ^ pulses[i].gpioOff) * 1099511628211ULL;
+      h = (h ^ pulses[i].usDelay) * 1099511628211ULL;
+      h = (h ^ pulses[i].flags)   * 1099511628211ULL;
+   }
+
+   return h;
+}
+
+static int waveCacheFind(unsigned numPulses, rawWave_t *pulses, uint64_t hash)
+{
+   int wid;
+
+   for (wid=0; wid<waveOutCount; wid++)
+   {
+      if (!waveInfo[wid].deleted                   &&
+          waveCache[wid].pulses                    &&
+          (waveCache[wid].hash == hash)            &&
+          (waveCache[wid].numPulses == numPulses)  &&
+          !memcmp(waveCache[wid].pulses, pulses, numPulses*sizeof(rawWave_t)))
+      {
+         return wid;
+      }
+   }
+
+   return -1;
+}
+
+static void waveCacheRelease(void)
+{
+   int wid;
+
+   for (wid=0; wid<PI_MAX_WAVES; wid++)
+   {
+      if (waveCache[wid].pulses)
+      {
+         free(waveCache[wid].pulses);
+         waveCache[wid].pulses = NULL;
+      }
+   }
+}
+
+static int waveAlloc(int numCB, int numBOOL, int numTOOL)
+{
+   int wid, CB, OOL;
+
+   /* the lowest free wave id */
+
+   for (wid=0; wid<waveOutCount; wid++) if (waveInfo[wid].deleted) break;
+
+   if (wid >= PI_MAX_WAVES) return PI_NO_WAVEFORM_ID;
+
+   CB = waveFreeGet(&waveFreeCB, numCB);
+
+   if (CB < 0) return PI_TOO_MANY_CBS;
+
+   /* the bottom and top OOL share one range, bottom up and top down */
+
+   OOL = waveFreeGet(&waveFreeOOL, numBOOL + numTOOL);
+
+   if (OOL < 0)
+   {
+      waveFreePut(&waveFreeCB, CB, numCB);
+      return PI_TOO_MANY_OOL;
+   }
+
+   if (wid == waveOutCount) waveOutCount++;
+
+   waveInfo[wid].botCB   = CB;
+   waveInfo[wid].topCB   = CB + numCB - 1;
+   waveInfo[wid].botOOL  = OOL;
+   waveInfo[wid].topOOL  = OOL + numBOOL + numTOOL;
+   waveInfo[wid].numCB   = numCB;
+   waveInfo[wid].numBOOL = numBOOL;
+   waveInfo[wid].numTOOL = numTOOL;
+   waveInfo[wid].deleted = 0;
+
+   return wid;
+}
+
+static void waveRelease(unsigned wid)
+{
+   waveFreePut(&waveFreeCB, waveInfo[wid].botCB, waveInfo[wid].numCB);
+
+   waveFreePut(&waveFreeOOL, waveInfo[wid].botOOL,
+      waveInfo[wid].topOOL - waveInfo[wid].botOOL);
+
+   if (waveCache[wid].pulses)
+   {
+      free(waveCache[wid].pulses);
+      waveCache[wid].pulses = NULL;
+   }
+
+   waveInfo[wid].deleted = 1;
+
+   /* keep the searches for a free id short */
+
+   while (waveOutCount && waveInfo[waveOutCount-1].deleted) --waveOutCount;
+}
+
+static int waveCreate(unsigned numWaves, rawWave_t *waves,
+   int padCB, int padBOOL, int padTOOL)
+{
+   int wid;
+   int numCB, numBOOL, numTOOL;
+   int CB, BOOL, TOOL;
+   uint64_t hash;
+   rawWave_t *copy;
+
+   hash = 0;
+   copy = NULL;
+
+   if (!padCB && !(gpioCfg.internals & PI_CFG_NO_WAVE_CACHE))
+   {
+      /* Is the same wave already resident? */
+
+      hash = waveHash(numWaves, waves);
+
+      wid = waveCacheFind(numWaves, waves, hash);
+
+      if (wid >= 0)
+      {
+         waveCache[wid].refs++;
+         wfStats.cacheHits++;
+
+         DBG(DBG_USER, "Wave cached: wid=%d refs %d", wid,
+            waveCache[wid].refs);
+
+         return wid;
+      }
+
+      wfStats.cacheMisses++;
+
+      /* If there's no memory for a copy the wave just isn't cached. */
+
+      copy = malloc(numWaves * sizeof(rawWave_t));
+
+      if (copy) memcpy(copy, waves, numWaves * sizeof(rawWave_t));
+   }
+
+   /* What resources are needed? */
+
+   waveCBsOOLs(numWaves, waves, &numCB, &numBOOL, &numTOOL);
+
+   if (padCB)
+   {
+      /* Reject if wave is too big */
+
+      if (numCB > padCB) return PI_TOO_MANY_CBS;
+      if (numBOOL > padBOOL) return PI_TOO_MANY_OOL;
+      if (numTOOL > padTOOL) return PI_TOO_MANY_OOL;
+
+      /* Set the padding */
+
+      numCB = padCB;
+      numBOOL = padBOOL;
+      numTOOL = padTOOL;
+   }
+
+   wid = waveAlloc(numCB, numBOOL, numTOOL);
+
+   if (wid < 0)
+   {
+      free(copy);
+      return wid;
+   }
+
+   waveCache[wid].refs      = 1;
+   waveCache[wid].hash      = hash;
+   waveCache[wid].numPulses = numWaves;
+   waveCache[wid].pulses    = copy;
+
+   CB   = waveInfo[wid].botCB;
+   BOOL = waveInfo[wid].botOOL;
+   TOOL = waveInfo[wid].topOOL;
+
+   wave2Cbs(numWaves, waves, PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL,
+      padCB, padBOOL, padTOOL);
+
+   /* Sanity check. */
+
+   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
+        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
+        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
+   {
+      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
+         numCB,   CB-waveInfo[wid].botCB,
+         numBOOL, BOOL-waveInfo[wid].botOOL,
+         numTOOL, waveInfo[wid].topOOL-TOOL);
+   }
+
+   DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid,
+      numCB, numBOOL, numTOOL);
+
+   return wid;
+}
+
+int gpioWaveCreate(void)
+{
+   int wid;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   wid = waveCreate(wfc[wfcur], wf[wfcur], 0, 0, 0);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   if (wid < 0) return wid;
+
+   /* Consume waves. */
+
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
+
+   wfcur = 0;
+
+   return wid;
+}
+
+int gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL)
+{
+   int wid;
+   int CB, BOOL, TOOL;
+
+   DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
+
+   CHECK_INITED;
+
+   if (pctCB < 0 || pctCB > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
+   if (pctBOOL < 0 || pctBOOL > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
+   if (pctTOOL < 0 || pctTOOL > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
+
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+
+   /* Amount of pad required */
+   CB = (NUM_WAVE_CBS - WAVE_BOT_CB) * pctCB / 100;
+   BOOL = (NUM_WAVE_OOL - WAVE_BOT_OOL) * pctBOOL /100;
+   TOOL = (NUM_WAVE_OOL - WAVE_BOT_OOL) * pctTOOL /100;
+
+   /* A wave always needs at least one CB */
+   if (CB == 0) return PI_TOO_MANY_CBS;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   wid = waveCreate(wfc[wfcur], wf[wfcur], CB, BOOL, TOOL);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   if (wid < 0) return wid;
+
+   /* Consume waves. */
+
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
+
+   wfcur = 0;
+
+   return wid;
+}
+
+int gpioWaveLookup(void)
+{
+   int wid;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   wid = waveCacheFind(wfc[wfcur], wf[wfcur],
+      waveHash(wfc[wfcur], wf[wfcur]));
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   if (wid < 0) return PI_WAVE_NOT_CACHED;
+
+   return wid;
+}
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveDelete(unsigned wave_id)
+{
+   DBG(DBG_USER, "wave id=%d", wave_id);
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
+   {
+      pthread_mutex_unlock(&waveAllocMutex);
+      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+   }
+
+   /* a cached wave is only deleted once each create has deleted it */
+
+   if (--waveCache[wave_id].refs == 0) waveRelease(wave_id);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int wavePos(uint32_t adr, int bot, int num, int perPage, int size,
+   uint32_t (*busAdr)(int), int *page)
+{
+   int first, pages, i, pg, pos;
+   uint32_t base;
+
+   /*
+      The position of the CB or OOL at bus address adr if it is one of
+      the num from bot, otherwise -1.  page is where the last one was
+      found, the likeliest page for the next.
+   */
+
+   if (num <= 0) return -1;
+
+   first = bot / perPage;
+   pages = ((bot + num - 1) / perPage) - first + 1;
+
+   if ((*page < first) || (*page >= (first + pages))) *page = first;
+
+   for (i=0; i<pages; i++)
+   {
+      pg = first + ((*page - first + i) % pages);
+
+      base = busAdr(pg * perPage);
+
+      if ((adr >= base) && (adr < (base + (perPage * size))))
+      {
+         *page = pg;
+
+         pos = (pg * perPage) + ((adr - base) / size);
+
+         if ((pos >= bot) && (pos < (bot + num))) return pos;
+
+         return -1;
+      }
+   }
+
+   return -1;
+}
+
+static void waveMoveCBs(unsigned wid, int bot)
+{
+   int i, old, num, pos, page;
+   rawCbs_t *p;
+
+   old = waveInfo[wid].botCB;
+   num = waveInfo[wid].numCB;
+
+   page = -1;
+
+   /* the wave only ever moves down so each CB is read before overwritten */
+
+   for (i=0; i<num; i++)
+   {
+      p = rawWaveCBAdr(bot + i);
+
+      *p = *rawWaveCBAdr(old + i);
+
+      pos = wavePos(p->next, old, num,
+         CBS_PER_OPAGE, sizeof(rawCbs_t), waveCbPOadr, &page);
+
+      if (pos >= 0) p->next = waveCbPOadr(bot + (pos - old));
+   }
+
+   waveInfo[wid].botCB = bot;
+   waveInfo[wid].topCB = bot + num - 1;
+}
+
+static void waveMoveOOL(unsigned wid, int bot)
+{
+   int i, old, num, pos, page;
+   rawCbs_t *p;
+
+   old = waveInfo[wid].botOOL;
+   num = waveInfo[wid].topOOL - old;
+
+   for (i=0; i<num; i++) waveSetOOL(bot + i, rawWaveGetOOL(old + i));
+
+   /* point the wave's CBs at the moved OOL */
+
+   page = -1;
+
+   for (i=waveInfo[wid].botCB; i<=waveInfo[wid].topCB; i++)
+   {
+      p = rawWaveCBAdr(i);
+
+      pos = wavePos(p->src, old, num,
+         OOL_PER_OPAGE, sizeof(uint32_t), waveOOLPOadr, &page);
+
+      if (pos >= 0)
+      {
+         pos += bot - old;
+
+         p->src = waveOOLPOadr(pos);
+
+         /* the off level of a 2-beat burst may now be on another page */
+
+         if (p->info == TWO_BEAT_DMA)
+            p->stride = (12<<16) + (waveOOLPOadr(pos + 1) - p->src);
+      }
+
+      pos = wavePos(p->dst, old, num,
+         OOL_PER_OPAGE, sizeof(uint32_t), waveOOLPOadr, &page);
+
+      if (pos >= 0) p->dst = waveOOLPOadr(bot + (pos - old));
+   }
+
+   waveInfo[wid].botOOL = bot;
+   waveInfo[wid].topOOL = bot + num;
+}
+
+int gpioWaveCompact(void)
+{
+   int i, n, wid, CB, OOL, moved;
+   int order[PI_MAX_WAVES];
+   char hasMoved[PI_MAX_WAVES];
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (dmaOut[DMA_CONBLK_AD])
+      SOFT_ERROR(PI_WAVE_TX_BUSY, "wave being transmitted");
+
+   /* the stream's segments are not waves and can not be moved */
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_WAVE_STREAM_OPEN, "wave stream open");
+   }
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   /* slide the waves' CBs down in address order, closing the gaps */
+
+   n = 0;
+
+   for (wid=0; wid<waveOutCount; wid++)
+   {
+      hasMoved[wid] = 0;
+
+      if (waveInfo[wid].deleted) continue;
+
+      for (i=n; i && (waveInfo[order[i-1]].botCB > waveInfo[wid].botCB); i--)
+         order[i] = order[i-1];
+
+      order[i] = wid;
+      n++;
+   }
+
+   CB = WAVE_BOT_CB;
+
+   for (i=0; i<n; i++)
+   {
+      wid = order[i];
+
+      if (waveInfo[wid].botCB != CB)
+      {
+         waveMoveCBs(wid, CB);
+         hasMoved[wid] = 1;
+      }
+
+      CB += waveInfo[wid].numCB;
+   }
+
+   /* then the OOL */
+
+   for (n=0, wid=0; wid<waveOutCount; wid++)
+   {
+      if (waveInfo[wid].deleted) continue;
+
+      for (i=n; i && (waveInfo[order[i-1]].botOOL > waveInfo[wid].botOOL); i--)
+         order[i] = order[i-1];
+
+      order[i] = wid;
+      n++;
+   }
+
+   OOL = WAVE_BOT_OOL;
+
+   for (i=0; i<n; i++)
+   {
+      wid = order[i];
+
+      if (waveInfo[wid].topOOL == waveInfo[wid].botOOL) continue;
+
+      if (waveInfo[wid].botOOL != OOL)
+      {
+         waveMoveOOL(wid, OOL);
+         hasMoved[wid] = 1;
+      }
+
+      OOL = waveInfo[wid].topOOL;
+   }
+
+   waveFreeReset(&waveFreeCB, CB, NUM_WAVE_CBS - CB);
+   waveFreeReset(&waveFreeOOL, OOL, NUM_WAVE_OOL - OOL);
+
+   /* nothing is being sent so there is no wave to sync with */
+
+   waveEndPtr = NULL;
+
+   moved = 0;
+
+   for (wid=0; wid<waveOutCount; wid++) moved += hasMoved[wid];
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return moved;
+}
+
+static void waveFreeSpace(waveFree_t *f,
+   uint32_t *total, uint32_t *largest, uint32_t *ranges)
+{
+   int i;
+
+   *total = 0;
+   *largest = 0;
+   *ranges = f->num;
+
+   for (i=0; i<f->num; i++)
+   {
+      *total += f->range[i].count;
+
+      if (f->range[i].count > *largest) *largest = f->range[i].count;
+   }
+}
+
+int gpioWaveGetSpace(gpioWaveSpace_t *space)
+{
+   int wid;
+
+   DBG(DBG_USER, "space=%08"PRIXPTR, (uintptr_t)space);
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   space->waves = 0;
+
+   for (wid=0; wid<waveOutCount; wid++)
+      if (!waveInfo[wid].deleted) space->waves++;
+
+   space->totalCBs = NUM_WAVE_CBS - WAVE_BOT_CB;
+   space->totalOOL = NUM_WAVE_OOL - WAVE_BOT_OOL;
+
+   waveFreeSpace(&waveFreeCB,
+      &space->freeCBs, &space->largestCBs, &space->rangesCBs);
+
+   waveFreeSpace(&waveFreeOOL,
+      &space->freeOOL, &space->largestOOL, &space->rangesOOL);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   return sizeof(gpioWaveSpace_t);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int waveBuilderReserve(waveBuilder_t *b, unsigned pulses)
+{
+   unsigned max, *train;
+   rawWave_t *buf;
+
+   if ((b->numTrains + 2) > b->maxTrains)
+   {
+      max = b->maxTrains ? (2 * b->maxTrains) : 32;
+
+      train = realloc(b->train, max * sizeof(unsigned));
+
+      if (train == NULL) return PI_NO_MEMORY;
+
+      b->train = train;
+      b->maxTrains = max;
+   }
+
+   if ((b->numPulses + pulses) > b->maxPulses)
+   {
+      max = b->maxPulses ? b->maxPulses : 1024;
+
+      while (max < (b->numPulses + pulses)) max *= 2;
+
+      buf = realloc(b->pulses, max * sizeof(rawWave_t));
+
+      if (buf == NULL) return PI_NO_MEMORY;
+
+      b->pulses = buf;
+      b->maxPulses = max;
+   }
+
+   return 0;
+}
+
+static void waveBuilderAddTrain(waveBuilder_t *b, unsigned numPulses)
+{
+   b->train[b->numTrains] = b->numPulses;
+   b->numPulses += numPulses;
+   b->train[++b->numTrains] = b->numPulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveBuilderOpen(void)
+{
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+   int i, slot;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   slot = -1;
+
+   pthread_mutex_lock(&mutex);
+
+   for (i=0; i<PI_WAVE_BUILDERS; i++)
+   {
+      if (waveBuilder[i].state == PI_WAVE_BUILDER_CLOSED)
+      {
+         slot = i;
+         waveBuilder[slot].state = PI_WAVE_BUILDER_RESERVED;
+         break;
+      }
+   }
+
+   pthread_mutex_unlock(&mutex);
+
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no wave builder handles");
+
+   waveBuilder[slot].numTrains = 0;
+   waveBuilder[slot].numPulses = 0;
+
+   waveBuilder[slot].state = PI_WAVE_BUILDER_OPENED;
+
+   return slot;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveBuilderAddGeneric(
+   unsigned handle, unsigned numPulses, gpioPulse_t *pulses)
+{
+   waveBuilder_t *b;
+   rawWave_t *out;
+   int p, status;
+
+   DBG(DBG_USER, "handle=%d numPulses=%u pulses=%08"PRIXPTR,
+      handle, numPulses, (uintptr_t)pulses);
+
+   CHECK_INITED;
+
+   if (handle >= PI_WAVE_BUILDERS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   b = &waveBuilder[handle];
+
+   if (b->state != PI_WAVE_BUILDER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (numPulses > PI_WAVE_MAX_PULSES)
+      SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
+
+   if (!pulses) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+
+   if (!numPulses) return b->numPulses;
+
+   if ((b->numPulses + numPulses) > PI_WAVE_BUILDER_PULSES)
+      SOFT_ERROR(PI_TOO_MANY_PULSES, "too many pulses in builder");
+
+   status = waveBuilderReserve(b, numPulses);
+
+   if (status < 0) SOFT_ERROR(status, "can't grow wave builder");
+
+   out = b->pulses + b->numPulses;
+
+   for (p=0; p<numPulses; p++)
+   {
+      out[p].gpioOff = pulses[p].gpioOff;
+      out[p].gpioOn  = pulses[p].gpioOn;
+      out[p].usDelay = pulses[p].usDelay;
+      out[p].flags   = 0;
+   }
+
+   waveBuilderAddTrain(b, numPulses);
+
+   return b->numPulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveBuilderAddSerial
+   (unsigned handle,
+    unsigned gpio,
+    unsigned baud,
+    unsigned data_bits,
+    unsigned stop_bits,
+    unsigned offset,
+    unsigned numBytes,
+    char     *bstr)
+{
+   waveBuilder_t *b;
+   int p, status;
+
+   DBG(DBG_USER,
+      "handle=%d gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d",
+      handle, gpio, baud, data_bits, stop_bits, offset, numBytes);
+
+   CHECK_INITED;
+
+   if (handle >= PI_WAVE_BUILDERS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   b = &waveBuilder[handle];
+
+   if (b->state != PI_WAVE_BUILDER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (numBytes > PI_WAVE_MAX_CHARS)
+      SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+
+   status = waveBuilderReserve(b, (numBytes * 10) + 2);
+
+   if (status < 0) SOFT_ERROR(status, "can't grow wave builder");
+
+   p = waveSerialPulses(b->pulses + b->numPulses, gpio, baud, data_bits,
+      stop_bits, offset, numBytes, bstr);
+
+   if (p < 0) return p;
+
+   if (!p) return b->numPulses;
+
+   if ((b->numPulses + p) > PI_WAVE_BUILDER_PULSES)
+      SOFT_ERROR(PI_TOO_MANY_PULSES, "too many pulses in builder");
+
+   waveBuilderAddTrain(b, p);
+
+   return b->numPulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveBuilderCreate(unsigned handle)
+{
+   waveBuilder_t *b;
+   rawWave_t *out;
+   int numOut, wid;
+
+   DBG(DBG_USER, "handle=%d", handle);
+
+   CHECK_INITED;
+
+   if (handle >= PI_WAVE_BUILDERS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   b = &waveBuilder[handle];
+
+   if (b->state != PI_WAVE_BUILDER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (b->numPulses == 0) return PI_EMPTY_WAVEFORM;
+
+   out = malloc(PI_WAVE_MAX_PULSES * sizeof(rawWave_t));
+
+   if (out == NULL) SOFT_ERROR(PI_NO_MEMORY, "can't allocate wave");
+
+   numOut = waveMergeTrains(b, out);
+
+   if (numOut < 0)
+   {
+      free(out);
+      SOFT_ERROR(numOut, "can't merge %d pulse trains", b->numTrains);
+   }
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   wid = waveCreate(numOut, out, 0, 0, 0);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   free(out);
+
+   /* consume the trains */
+
+   if (wid >= 0)
+   {
+      b->numTrains = 0;
+      b->numPulses = 0;
+   }
+
+   return wid;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveBuilderClose(unsigned handle)
+{
+   waveBuilder_t *b;
+
+   DBG(DBG_USER, "handle=%d", handle);
+
+   CHECK_INITED;
+
+   if (handle >= PI_WAVE_BUILDERS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   b = &waveBuilder[handle];
+
+   if (b->state != PI_WAVE_BUILDER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   free(b->train);
+   free(b->pulses);
+
+   b->train     = NULL;
+   b->pulses    = NULL;
+   b->maxTrains = 0;
+   b->maxPulses = 0;
+   b->numTrains = 0;
+   b->numPulses = 0;
+
+   b->state = PI_WAVE_BUILDER_CLOSED;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveTxStart(unsigned wave_mode)
+{
+   /* This function is deprecated and has been removed. */
+
+   CHECK_INITED;
+
+   SOFT_ERROR(PI_DEPRECATED, "deprected function removed");
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode)
+{
+   rawCbs_t *p=NULL;
+
+   DBG(DBG_USER, "wave_id=%d wave_mode=%d", wave_id, wave_mode);
+
+   CHECK_INITED;
+
+   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
+      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+
+   if (wave_mode > PI_WAVE_MODE_REPEAT_SYNC)
+      SOFT_ERROR(PI_BAD_WAVE_MODE, "bad wave mode (%d)", wave_mode);
+
+   /* held until the DMA is started so a stream can't open meanwhile */
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_WAVE_STREAM_OPEN, "wave stream open");
+   }
+
+   if (!waveClockInited)
+   {
+      stopHardwarePWM();
+      initClock(0); /* initialise secondary clock */
+      waveClockInited = 1;
+      PWMClockInited = 0;
+   }
+
+   if (wave_mode < PI_WAVE_MODE_ONE_SHOT_SYNC) initKillDMA(dmaOut);
+
+   p = rawWaveCBAdr(waveInfo[wave_id].topCB);
+
+   if ((wave_mode & 1) == PI_WAVE_MODE_ONE_SHOT)
+      p->next = 0;
+   else
+      p->next = waveCbPOadr(waveInfo[wave_id].botCB+1);
+
+   if (waveEndPtr && (wave_mode > PI_WAVE_MODE_REPEAT))
+   {
+      *waveEndPtr = waveCbPOadr(waveInfo[wave_id].botCB+1);
+
+      if (!dmaOut[DMA_CONBLK_AD])
+      {
+         initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+      }
+   }
+   else
+   {
+      initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+   }
+
+   waveEndPtr = &p->next;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   /* for compatability with the deprecated gpioWaveTxStart return the
+      number of cbs
+   */
+   return (waveInfo[wave_id].topCB - waveInfo[wave_id].botCB) + 1;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+static int chainGetCB(int n)
+{
+   int block, index;
+
+   if (n < (WCB_CHAIN_CBS * PI_WAVE_COUNT_PAGES))
+   {
+      block = n / WCB_CHAIN_CBS;
+      index = n % WCB_CHAIN_CBS;
+      return (block*CBS_PER_OPAGE) + WCB_COUNTER_CBS + index;
+   }
+   return -1;
+}
+
+static void chainSetVal(int n, uint32_t val)
+{
+   int block, index;
+   uint32_t *p;
+
+   if (n < (WCB_CHAIN_OOL * PI_WAVE_COUNT_PAGES))
+   {
+      block = n / WCB_CHAIN_OOL;
+      index = n % WCB_CHAIN_OOL;
+      p = (uint32_t *) dmaOVirt[block] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
+      p[index] = val;
+   }
+}
+
+static uint32_t chainGetValPadr(int n)
+{
+   int block, index;
+   uint32_t *p;
+
+   if (n < (WCB_CHAIN_OOL * PI_WAVE_COUNT_PAGES))
+   {
+      block = n / WCB_CHAIN_OOL;
+      index = n % WCB_CHAIN_OOL;
+      p = (uint32_t *) dmaOBus[block] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
+      //cast twice to suppress warning, I belive this is ok as dmaOBus
+      //contains bus addresses not virtual addresses.
+      return (uint32_t)(uintptr_t) (p + index);
+   }
+   return 0;
+}
+
+static uint32_t chainGetCntVal(int counter, int slot)
+{
+   uint32_t *p;
+   int page, offset;
+   page = counter / 2;
+   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
+   p = (uint32_t *) dmaOVirt[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
+   return p[WCB_CHAIN_OOL+ offset + slot];
+}
+
+static void chainSetCntVal(int counter, int slot, uint32_t value)
+{
+   uint32_t *p;
+   int page, offset;
+   page = counter / 2;
+   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
+   p = (uint32_t *) dmaOVirt[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
+   p[WCB_CHAIN_OOL + offset + slot] = value;
+}
+
+static uint32_t chainGetCntValPadr(int counter, int slot)
+{
+   uint32_t *p;
+   int page, offset;
+   page = counter / 2;
+   offset = (counter % 2 ? WCB_COUNTER_OOL : 0);
+   p = (uint32_t *) dmaOBus[page] + (WCB_COUNTER_CBS+WCB_CHAIN_CBS) * 8;
+   //cast twice to suppress warning, I belive this is ok as dmaOBus
+   //contains bus addresses not virtual addresses. --plugwash
+   return (uint32_t)(uintptr_t)(p + WCB_CHAIN_OOL + offset + slot);
+}
+
+static int chainGetCntCB(int counter)
+{
+   int page, offset;
+   page = counter / 2;
+   offset = (counter % 2 ? WCB_CNT_CBS : 0);
+   return ((page * CBS_PER_OPAGE) + offset);
+}
+
+static void chainMakeCounter(
+   unsigned counter,
+   unsigned blklen,
+   unsigned blocks,
+   unsigned count,
+   uint32_t repeat,
+   uint32_t next)
+{
+   rawCbs_t *p=NULL;
+
+   int b, baseCB, dig;
+   uint32_t nxt;
+
+   int botCB;
+
+   botCB  = chainGetCntCB(counter);
+
+   baseCB = botCB;
+
+   /* set up all the OOLs */
+   for (b=0; b < (blocks*(blklen+1)); b++) chainSetCntVal(counter, b, repeat);
+
+   for (b=0; b<blocks; b++)
+      chainSetCntVal(counter,
+         ((b*(blklen+1))+blklen),
+         waveCbPOadr(baseCB+((b*3)+3)));
+
+   for (b=0; b<blocks; b++)
+   {
+      /* copy BOTTOM to NEXT */
+
+      p = rawWaveCBAdr(botCB++);
+
+      p->info = NORMAL_DMA;
+
+      p->src = chainGetCntValPadr(counter, b*(blklen+1));
+      p->dst = (waveCbPOadr(botCB+1) + 20);
+
+      p->length = 4;
+      p->next   = waveCbPOadr(botCB);
+
+      /* copy BOTTOM to TOP */
+
+      p = rawWaveCBAdr(botCB++);
+
+      p->info   = NORMAL_DMA;
+
+      p->src = chainGetCntValPadr(counter, b*(blklen+1));
+      p->dst = chainGetCntValPadr(counter, (b*(blklen+1))+blklen);
+
+      p->length = 4;
+      p->next   = waveCbPOadr(botCB);
+
+      /* shift all down one */
+
+      p = rawWaveCBAdr(botCB++);
+
+      p->info   = NORMAL_DMA|DMA_SRC_INC|DMA_DEST_INC;
+
+      p->src = chainGetCntValPadr(counter, ((b*(blklen+1))+1));
+      p->dst = chainGetCntValPadr(counter, ((b*(blklen+1))+0));
+
+      p->length = blklen*4;
+      p->next   = repeat;
+   }
+
+   /* reset the counter */
+
+   p = rawWaveCBAdr(botCB);
+
+   p->info = NORMAL_DMA|DMA_SRC_INC|DMA_DEST_INC;
+
+   p->src = chainGetCntValPadr(counter, blocks*(blklen+1));
+   p->dst = chainGetCntValPadr(counter, 0);
+
+   p->length = blocks*(blklen+1)*4;
+   p->next   = next;
+
+   b = 0;
+
+   while (count && (b<blocks))
+   {
+      dig = count % blklen;
+      count /= blklen;
+
+      if (count) nxt = chainGetCntVal(counter, (b*(blklen+1))+blklen);
+      else       nxt = waveCbPOadr(botCB);
+
+      chainSetCntVal(counter, b*(blklen+1)+dig, nxt);
+
+      b++;
+   }
+
+   /* copy all the OOLs */
+   for (b=0; b < (blocks*(blklen+1)); b++)
+      chainSetCntVal(
+         counter, b+(blocks*(blklen+1)), chainGetCntVal(counter, b));
+}
+
+
+static int intWaveChain(char *buf, unsigned bufSize)
+{
+   unsigned blklen=16, blocks=4;
+   int cb, chaincb;
+   rawCbs_t *p;
+   int i, wid, cmd, loop, counters;
+   unsigned cycles, delayCBs, dcb, delayLeft;
+   uint32_t repeat, next, *endPtr;
+   int stk_pos[10], stk_lev=0;
+
+   cb = 0;
+   loop = -1;
+
+   if (!waveClockInited)
+   {
+      stopHardwarePWM();
+      initClock(0); /* initialise secondary clock */
+      waveClockInited = 1;
+      PWMClockInited = 0;
+   }
+
+   initKillDMA(dmaOut);
+
+   waveEndPtr = NULL;
+   endPtr = NULL;
+
+   /* add delay cb at start of DMA */
+
+   p = rawWaveCBAdr(chainGetCB(cb++));
+
+   /* use the secondary clock */
+
+   if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
+   {
+      p->info = NORMAL_DMA | TIMED_DMA(2);
+      p->dst  = PCM_TIMER;
+   }
+   else
+   {
+      p->info = NORMAL_DMA | TIMED_DMA(5);
+      p->dst  = PWM_TIMER;
+   }
+
+   //cast twice to suppress warning, I belive this is ok as dmaOBus
+   //contains bus addresses not virtual addresses. --plugwash
+   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
+   p->next   = waveCbPOadr(chainGetCB(cb));
+
+   counters = 0;
+   wid = -1;
+
+   i = 0;
+
+   while (i<bufSize)
+   {
+      wid = (unsigned)buf[i];
+
+      if (wid == 255) /* wave command */
+      {
+         if ((i+2) > bufSize)
+            SOFT_ERROR(PI_BAD_CHAIN_CMD,
+               "incomplete chain command (at %d)", i);
+
+         cmd = buf[i+1];
+
+         if (cmd == 0) /* loop begin */
+         {
+            if (stk_lev >= (sizeof(stk_pos)/sizeof(int)))
+               SOFT_ERROR(PI_CHAIN_NESTING,
+                  "chain counters nested too deep (at %d)", i);
+
+            stk_pos[stk_lev++] = cb;
+
+            i += 2;
+         }
+         else if (cmd == 1) /* loop end */
+         {
+            if (counters >= WCB_COUNTERS)
+               SOFT_ERROR(PI_CHAIN_COUNTER,
+                  "too many chain counters (at %d)", i);
+
+            if ((i+4) > bufSize)
+               SOFT_ERROR(PI_BAD_CHAIN_CMD,
+                  "incomplete chain command (at %d)", i);
+
+            loop = 0;
+            if (--stk_lev >= 0) loop = stk_pos[stk_lev];
+
+            if ((loop < 1) || (loop == cb))
+               SOFT_ERROR(PI_BAD_CHAIN_LOOP,
+                  "empty chain loop (at %d)", i);
+
+            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+
+            i += 4;
+
+            if (cycles > PI_MAX_WAVE_CYCLES)
+               SOFT_ERROR(PI_CHAIN_LOOP_CNT,
+                  "bad chain loop count (%d)", cycles);
+
+            if (cycles == 0)
+            {
+               /* Skip the complete loop block.  Change
+                  the next pointing to the start of the
+                  loop block to the current cb.
+               */
+               p = rawWaveCBAdr(chainGetCB(loop));
+               p->next = waveCbPOadr(chainGetCB(cb));
+            }
+            else if (cycles == 1)
+            {
+               /* Nothing to do, no need for a counter. */
+            }
+            else
+            {
+               chaincb = chainGetCB(cb++);
+               if (chaincb < 0)
+                  SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+               p = rawWaveCBAdr(chaincb);
+
+               repeat = waveCbPOadr(chainGetCB(loop));
+
+                /* Need to check next cb as well. */
+
+               chaincb = chainGetCB(cb);
+
+               if (chaincb < 0)
+                  SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+               next = waveCbPOadr(chainGetCB(cb));
+
+               /* dummy src and dest */
+               p->info = NORMAL_DMA;
+               //cast twice to suppress warning, I belive this is ok as dmaOBus
+               //contains bus addresses not virtual addresses. --plugwash
+               p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+               p->dst = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+               p->length = 4;
+               p->next = waveCbPOadr(chainGetCntCB(counters));
+
+               chainMakeCounter(counters, blklen, blocks,
+                            cycles-1, repeat, next);
+
+               counters++;
+            }
+         }
+         else if (cmd == 2) /* delay us */
+         {
+            if ((i+4) > bufSize)
+               SOFT_ERROR(PI_BAD_CHAIN_CMD,
+                  "incomplete chain command (at %d)", i);
+
+            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+
+            i += 4;
+
+            if (cycles > PI_MAX_WAVE_DELAY)
+               SOFT_ERROR(PI_BAD_CHAIN_DELAY,
+                  "bad chain delay micros (%d)", cycles);
+
+            if (cycles)
+            {
+               delayLeft = cycles;
+               delayCBs = waveDelayCBs(delayLeft);
+               for (dcb=0; dcb<delayCBs; dcb++)
+               {
+                  chaincb = chainGetCB(cb++);
+
+                  if (chaincb < 0)
+                     SOFT_ERROR(
+                        PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+                  p = rawWaveCBAdr(chaincb);
+
+                  /* use the secondary clock */
+
+                  if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
+                  {
+                     p->info = NORMAL_DMA | TIMED_DMA(2);
+                     p->dst  = PCM_TIMER;
+                  }
+                  else
+                  {
+                     p->info = NORMAL_DMA | TIMED_DMA(5);
+                     p->dst  = PWM_TIMER;
+                  }
+
+                  //cast twice to suppress warning, I belive this is ok as dmaOBus
+                  //contains bus addresses not virtual addresses. --plugwash
+                  p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+
+                  p->length = BPD * delayLeft / PI_WF_MICROS;
+
+                  if ((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) &&
+                      (p->length > DMA_LITE_MAX))
+                  {
+                     p->length = DMA_LITE_MAX;
+                  }
+
+                  delayLeft -= (p->length / BPD);
+
+                  p->next = waveCbPOadr(chainGetCB(cb));
+               }
+            }
+         }
+         else if (cmd == 3) /* repeat loop forever */
+         {
+            i += 2;
+
+            loop = 0;
+            if (--stk_lev >= 0) loop = stk_pos[stk_lev];
+
+            if ((loop < 1) || (loop == cb))
+               SOFT_ERROR(PI_BAD_CHAIN_LOOP,
+                  "empty chain loop (at %d)", i);
+
+            chaincb = chainGetCB(cb++);
+            if (chaincb < 0)
+               SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+            if (i < bufSize)
+               SOFT_ERROR(PI_BAD_FOREVER,
+                  "loop forever must be last command");
+
+            p = rawWaveCBAdr(chaincb);
+
+            /* dummy src and dest */
+            p->info = NORMAL_DMA;
+            //cast twice to suppress warning, I belive this is ok as dmaOBus
+            //contains bus addresses not virtual addresses. --plugwash
+            p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+            p->dst = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+            p->length = 4;
+            p->next = waveCbPOadr(chainGetCB(loop));
+            endPtr = &p->next;
+         }
+         else
+            SOFT_ERROR(PI_BAD_CHAIN_CMD,
+               "unknown chain command (255 %d)", cmd);
+      }
+      else if ((wid >= waveOutCount) || waveInfo[wid].deleted)
+         SOFT_ERROR(PI_BAD_WAVE_ID, "undefined wave (%d)", wid);
+      else
+      {
+         chaincb = chainGetCB(cb++);
+
+         if (chaincb < 0)
+            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+         p = rawWaveCBAdr(chaincb);
+
+         chaincb = chainGetCB(cb);
+
+         if (chaincb < 0)
+            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+         chainSetVal(cb-1, waveCbPOadr(chaincb));
+
+         /* patch next of wid topCB to next cb */
+
+         p->info   = NORMAL_DMA;
+         p->src    = chainGetValPadr(cb-1); /* this next */
+         p->dst    = waveCbPOadr(waveInfo[wid].topCB) + 20; /* wid next */
+         p->length = 4;
+         p->next   = waveCbPOadr(waveInfo[wid].botCB+1);
+
+         i += 1;
+      }
+   }
+
+   chaincb = chainGetCB(cb++);
+
+   if (chaincb < 0)
+      SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+
+   p = rawWaveCBAdr(chaincb);
+
+   p->info   = NORMAL_DMA;
+
+   //cast twice to suppress warning, I belive this is ok as dmaOBus
+   //contains bus addresses not virtual addresses. --plugwash
+   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->dst    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->length = 4;
+   p->next = 0;
+
+   if (!endPtr) endPtr = &p->next;
+
+   initDMAgo((uint32_t *)dmaOut, waveCbPOadr(chainGetCB(0)));
+
+   waveEndPtr = endPtr;
+
+   return 0;
+}
+
+int gpioWaveChain(char *buf, unsigned bufSize)
+{
+   int status;
+
+   DBG(DBG_USER, "bufSize=%d [%s]", bufSize, myBuf2Str(bufSize, buf));
+
+   CHECK_INITED;
+
+   /* held until the DMA is started so a stream can't open meanwhile */
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_WAVE_STREAM_OPEN, "wave stream open");
+   }
+
+   status = intWaveChain(buf, bufSize);
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return status;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioWaveTxBusy(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   if (dmaOut[DMA_CONBLK_AD])
+      return 1;
+   else
+      return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioWaveTxAt(void)
+{
+   int i, cb;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   cb = dmaNowAtOCB();
+
+   if (cb < 0) return -cb;
+
+   for (i=0; i<PI_MAX_WAVES; i++)
+   {
+      if ( !waveInfo[i].deleted &&
+          (cb >= waveInfo[i].botCB) &&
+          (cb <= waveInfo[i].topCB) ) return i;
+   }
+
+   return PI_WAVE_NOT_FOUND;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveTxStop(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   initKillDMA(dmaOut);
+
+   waveEndPtr = NULL;
+
+   /* drop any queued stream segments, this is not an underrun */
+
+   waveStream.running = 0;
+   waveStream.queued  = 0;
+   waveStream.tail    = waveStream.head;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+   A stream is a ring of equal segments carved from the wave CBs and
+   OOL.  Each segment holds a one shot wave padded to the segment size,
+   so its last CB is always the sentinel.  A segment is queued by
+   pointing the previous segment's sentinel at its first pulse CB,
+   skipping its start delay, so the pulses play without a gap.
+
+   waveStreamMutex guards the stream.  It is taken before
+   waveAllocMutex.
+*/
+
+static int waveStreamCB(unsigned seg)
+{
+   return waveStream.botCB + (seg * waveStream.segmentCBs);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveStreamRelease(void)
+{
+   free(waveStream.pulses);
+
+   memset(&waveStream, 0, sizeof(waveStream));
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* called with waveStreamMutex held and the stream open */
+
+static void waveStreamShut(void)
+{
+   int total;
+
+   if (waveStream.running) initKillDMA(dmaOut);
+
+   total = waveStream.segments * waveStream.segmentCBs;
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   waveFreePut(&waveFreeCB, waveStream.botCB, total);
+   waveFreePut(&waveFreeOOL, waveStream.botOOL, total);
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   waveStreamRelease();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void closeOrphanedWaveStream(int fd)
+{
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (waveStream.open && (waveStream.owner == fd))
+   {
+      DBG(DBG_USER, "closed orphaned wave stream fd=%d", fd);
+
+      waveStreamShut();
+   }
+
+   pthread_mutex_unlock(&waveStreamMutex);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveStreamReclaim(void)
+{
+   int cb;
+   unsigned seg;
+
+   if (!waveStream.queued) return;
+
+   if (!dmaOut[DMA_CONBLK_AD])
+   {
+      /* everything queued has played, the output ran dry */
+
+      waveStream.tail   = waveStream.head;
+      waveStream.queued = 0;
+
+      if (waveStream.running)
+      {
+         waveStream.running = 0;
+         waveStream.underruns++;
+      }
+
+      return;
+   }
+
+   cb = dmaNowAtOCB() - waveStream.botCB;
+
+   if ((cb < 0) || (cb >= (waveStream.segments * waveStream.segmentCBs)))
+      return;
+
+   seg = cb / waveStream.segmentCBs;
+
+   /* the segments before the one playing are free */
+
+   while ((waveStream.tail != seg) && (waveStream.queued > 1))
+   {
+      if (++waveStream.tail >= waveStream.segments) waveStream.tail = 0;
+
+      waveStream.queued--;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveStreamQueue(unsigned seg)
+{
+   rawCbs_t *p;
+   unsigned prev;
+   uint32_t sentinel;
+
+   /* the segment must be complete before the DMA can reach it */
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   if (waveStream.running)
+   {
+      if (seg) prev = seg - 1; else prev = waveStream.segments - 1;
+
+      p = rawWaveCBAdr(waveStreamCB(prev) + waveStream.segmentCBs - 1);
+
+      p->next = waveCbPOadr(waveStreamCB(seg) + 1);
+
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+      /*
+         The DMA reads next as it loads a CB.  If it had already loaded
+         the sentinel let it finish, it then either follows the link or
+         stops.
+      */
+
+      sentinel = waveCbPOadr(waveStreamCB(prev) + waveStream.segmentCBs - 1);
+
+      while (dmaOut[DMA_CONBLK_AD] == sentinel) ;
+
+      if (dmaOut[DMA_CONBLK_AD])
+      {
+         waveStream.queued++;
+         return;
+      }
+
+      /* too late, the output ran dry */
+
+      waveStream.underruns++;
+      waveStream.queued = 0;
+   }
+
+   if (!waveClockInited)
+   {
+      stopHardwarePWM();
+      initClock(0); /* initialise secondary clock */
+      waveClockInited = 1;
+      PWMClockInited = 0;
+   }
+
+   waveStream.tail    = seg;
+   waveStream.queued  = 1;
+   waveStream.running = 1;
+
+   initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveStreamCB(seg)));
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveStreamCheck(void)
+{
+   gpioWaveStreamFunc_t func;
+   void *userdata;
+   unsigned freeSegs, underruns, event;
+   int report;
+
+   if (!waveStream.open) return;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      return;
+   }
+
+   waveStreamReclaim();
+
+   report = 0;
+
+   freeSegs = waveStream.segments - waveStream.queued;
+
+   if (freeSegs < waveStream.threshold) waveStream.signalled = 0;
+
+   else if (!waveStream.signalled &&
+      (waveStream.func || (waveStream.event <= PI_MAX_EVENT)))
+   {
+      waveStream.signalled = 1;
+      report = 1;
+   }
+
+   if (waveStream.underruns != waveStream.reported)
+   {
+      waveStream.reported = waveStream.underruns;
+      report = 1;
+   }
+
+   func      = waveStream.func;
+   userdata  = waveStream.userdata;
+   underruns = waveStream.underruns;
+   event     = waveStream.event;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   if (report)
+   {
+      if (func) (func)(freeSegs, underruns, userdata);
+
+      if (event <= PI_MAX_EVENT) eventTrigger(event);
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int intWaveStreamOpen(
+   int owner, unsigned segments, unsigned segmentCBs, unsigned threshold)
+{
+   int CB, OOL, total;
+   rawWave_t *pulses;
+
+   if ((segments < PI_MIN_STREAM_SEGMENTS) ||
+       (segments > PI_MAX_STREAM_SEGMENTS) ||
+       (segmentCBs < PI_MIN_STREAM_CBS) ||
+       (threshold < 1) || (threshold > segments))
+      SOFT_ERROR(PI_BAD_WAVE_STREAM, "bad stream (%d, %d, %d)",
+         segments, segmentCBs, threshold);
+
+   if (segmentCBs > (NUM_WAVE_CBS / segments))
+      SOFT_ERROR(PI_TOO_MANY_CBS, "too many CBs (%d)", segmentCBs);
+
+   /* the dispatch thread reclaims the segments and asks for refills */
+
+   if (gpioCfg.ifFlags & PI_DISABLE_ALERT)
+      SOFT_ERROR(PI_NO_ALERTS, "alerts disabled");
+
+   total = segments * segmentCBs;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_WAVE_STREAM_OPEN, "wave stream already open");
+   }
+
+   if (dmaOut[DMA_CONBLK_AD])
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_WAVE_TX_BUSY, "wave being transmitted");
+   }
+
+   /* every pulse in a segment takes at least one CB */
+
+   pulses = malloc(segmentCBs * sizeof(rawWave_t));
+
+   if (pulses == NULL)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_MEMORY, "can't allocate stream pulses");
+   }
+
+   pthread_mutex_lock(&waveAllocMutex);
+
+   CB = waveFreeGet(&waveFreeCB, total);
+
+   if (CB >= 0)
+   {
+      OOL = waveFreeGet(&waveFreeOOL, total);
+
+      if (OOL < 0) waveFreePut(&waveFreeCB, CB, total);
+   }
+   else OOL = -1;
+
+   pthread_mutex_unlock(&waveAllocMutex);
+
+   if ((CB < 0) || (OOL < 0))
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+
+      free(pulses);
+
+      if (CB < 0) SOFT_ERROR(PI_TOO_MANY_CBS, "no space for stream CBs");
+      else        SOFT_ERROR(PI_TOO_MANY_OOL, "no space for stream OOL");
+   }
+
+   waveStream.segments   = segments;
+   waveStream.segmentCBs = segmentCBs;
+   waveStream.botCB      = CB;
+   waveStream.botOOL     = OOL;
+   waveStream.threshold  = threshold;
+   waveStream.event      = PI_WAVE_STREAM_NO_EVENT;
+   waveStream.pulses     = pulses;
+   waveStream.owner      = owner;
+   waveStream.open       = 1;
+
+   waveEndPtr = NULL;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return 0;
+}
+
+int gpioWaveStreamOpen(
+   unsigned segments, unsigned segmentCBs, unsigned threshold)
+{
+   DBG(DBG_USER, "segments=%d segmentCBs=%d threshold=%d",
+      segments, segmentCBs, threshold);
+
+   CHECK_INITED;
+
+   return intWaveStreamOpen(-1, segments, segmentCBs, threshold);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamAdd(unsigned numPulses, gpioPulse_t *pulses)
+{
+   unsigned i, n, seg, numCB, numOOL, needCB, needOOL;
+   int CB, BOOL, TOOL, status;
+   rawWave_t *w;
+
+   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR,
+      numPulses, (uintptr_t)pulses);
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStreamReclaim();
+
+   w = waveStream.pulses;
+
+   i = 0;
+
+   status = 0;
+
+   while ((i < numPulses) && (waveStream.queued < waveStream.segments))
+   {
+      /* fill a segment, leaving room for its start delay and sentinel */
+
+      n = 0;
+      numCB = 2;
+      numOOL = 0;
+
+      for (; i<numPulses; i++)
+      {
+         needOOL = 0;
+
+         if (pulses[i].gpioOn)  needOOL++;
+         if (pulses[i].gpioOff) needOOL++;
+
+         needCB = waveDelayCBs(pulses[i].usDelay);
+
+         if (needOOL) needCB++;
+
+         if (!needCB) continue; /* does nothing */
+
+         if (((numCB + needCB) > waveStream.segmentCBs) ||
+             ((numOOL + needOOL) > waveStream.segmentCBs)) break;
+
+         w[n].gpioOn  = pulses[i].gpioOn;
+         w[n].gpioOff = pulses[i].gpioOff;
+         w[n].usDelay = pulses[i].usDelay;
+         w[n].flags   = 0;
+
+         n++;
+
+         numCB  += needCB;
+         numOOL += needOOL;
+      }
+
+      if (!n)
+      {
+         /* a pulse too long for an empty segment is never accepted */
+
+         if (i >= numPulses) status = i; /* the rest do nothing */
+         else if (!status) status = PI_TOO_MANY_CBS;
+
+         break;
+      }
+
+      seg = waveStream.head;
+
+      CB   = waveStreamCB(seg);
+      BOOL = waveStream.botOOL + (seg * waveStream.segmentCBs);
+      TOOL = BOOL + waveStream.segmentCBs;
+
+      wave2Cbs(n, w, PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL,
+         waveStream.segmentCBs, waveStream.segmentCBs, 0);
+
+      if (++waveStream.head >= waveStream.segments) waveStream.head = 0;
+
+      waveStreamQueue(seg);
+
+      status = i;
+   }
+
+   if (!status) status = i; /* the ring was full */
+
+   if ((waveStream.segments - waveStream.queued) < waveStream.threshold)
+      waveStream.signalled = 0;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   if (status < 0)
+      SOFT_ERROR(status, "pulse %d too long for a segment", i);
+
+   return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamSetFunc(gpioWaveStreamFunc_t f, void *userdata)
+{
+   DBG(DBG_USER, "function=%08"PRIXPTR", userdata=%08"PRIXPTR,
+      (uintptr_t)f, (uintptr_t)userdata);
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStream.func      = f;
+   waveStream.userdata  = userdata;
+   waveStream.signalled = 0; /* ask again if already due */
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamSetEvent(unsigned event)
+{
+   DBG(DBG_USER, "event=%d", event);
+
+   CHECK_INITED;
+
+   if (event > PI_WAVE_STREAM_NO_EVENT)
+      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStream.event     = event;
+   waveStream.signalled = 0; /* ask again if already due */
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamGetFree(void)
+{
+   int freeSegs;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStreamReclaim();
+
+   freeSegs = waveStream.segments - waveStream.queued;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return freeSegs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamGetUnderruns(void)
+{
+   int underruns;
+
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStreamReclaim();
+
+   underruns = waveStream.underruns;
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return underruns;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamClose(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   pthread_mutex_lock(&waveStreamMutex);
+
+   if (!waveStream.open)
+   {
+      pthread_mutex_unlock(&waveStreamMutex);
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "no wave stream open");
+   }
+
+   waveStreamShut();
+
+   pthread_mutex_unlock(&waveStreamMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetMicros(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.micros;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetHighMicros(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.highMicros;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetMaxMicros(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.maxMicros;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetPulses(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.pulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetHighPulses(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.highPulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetMaxPulses(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.maxPulses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetCbs(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.cbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetHighCbs(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.highCbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetMaxCbs(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.maxCbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetCacheHits(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.cacheHits;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveGetCacheMisses(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_INITED;
+
+   return wfStats.cacheMisses;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int read_SDA(wfRx_t *w)
+{
+   myGpioSetMode(w->I.SDA, PI_INPUT);
+   return myGpioRead(w->I.SDA);
+}
+
+static void set_SDA(wfRx_t *w)
+{
+   myGpioSetMode(w->I.SDA, PI_INPUT);
+}
+
+static void clear_SDA(wfRx_t *w)
+{
+   myGpioSetMode(w->I.SDA, PI_OUTPUT);
+   myGpioWrite(w->I.SDA, 0);
+}
+
+static void clear_SCL(wfRx_t *w)
+{
+   myGpioSetMode(w->I.SCL, PI_OUTPUT);
+   myGpioWrite(w->I.SCL, 0);
+}
+
+static void I2C_delay(wfRx_t *w)
+{
+   myGpioDelay(w->I.delay);
+}
+
+static void I2C_clock_stretch(wfRx_t *w)
+{
+   uint32_t now, max_stretch=100000;
+
+   myGpioSetMode(w->I.SCL, PI_INPUT);
+   now = gpioTick();
+   while ((myGpioRead(w->I.SCL) == 0) && ((gpioTick()-now) < max_stretch));
+}
+
+static void I2CStart(wfRx_t *w)
+{
+   if (w->I.started)
+   {
+      set_SDA(w);
+      I2C_delay(w);
+      I2C_clock_stretch(w);
+      I2C_delay(w);
+   }
+
+   clear_SDA(w);
+   I2C_delay(w);
+   clear_SCL(w);
+   I2C_delay(w);
+
+   w->I.started = 1;
+}
+
+static void I2CStop(wfRx_t *w)
+{
+   clear_SDA(w);
+   I2C_delay(w);
+   I2C_clock_stretch(w);
+   I2C_delay(w);
+   set_SDA(w);
+   I2C_delay(w);
+
+   w->I.started = 0;
+}
+
+static void I2CPutBit(wfRx_t *w, int bit)
+{
+   if (bit) set_SDA(w);
+   else     clear_SDA(w);
+
+   I2C_delay(w);
+   I2C_clock_stretch(w);
+   I2C_delay(w);
+   clear_SCL(w);
+}
+
+static int I2CGetBit(wfRx_t *w)
+{
+   int bit;
+
+   set_SDA(w); /* let SDA float */
+   I2C_delay(w);
+   I2C_clock_stretch(w);
+   bit = read_SDA(w);
+   I2C_delay(w);
+   clear_SCL(w);
+
+   return bit;
+}
+
+static int I2CPutByte(wfRx_t *w, int byte)
+{
+   int bit, nack;
+
+   for(bit=0; bit<8; bit++)
+   {
+      I2CPutBit(w, byte & 0x80);
+      byte <<= 1;
+   }
+
+   nack = I2CGetBit(w);
+
+   return nack;
+}
+
+static uint8_t I2CGetByte(wfRx_t *w, int nack)
+{
+   int bit, byte=0;
+
+   for (bit=0; bit<8; bit++)
+   {
+      byte = (byte << 1) | I2CGetBit(w);
+   }
+
+   I2CPutBit(w, nack);
+
+   return byte;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud)
+{
+   DBG(DBG_USER, "SDA=%d SCL=%d baud=%d", SDA, SCL, baud);
+
+   CHECK_INITED;
+
+   if (SDA > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SDA (%d)", SDA);
+
+   if (SCL > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SCL (%d)", SCL);
+
+   if ((baud < PI_BB_I2C_MIN_BAUD) || (baud > PI_BB_I2C_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_I2C_BAUD,
+         "SDA %d, bad baud rate (%d)", SDA, baud);
+
+   if (wfRx[SDA].mode != PI_WFRX_NONE)
+      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", SDA);
+
+   if ((wfRx[SCL].mode != PI_WFRX_NONE)  || (SCL == SDA))
+      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", SCL);
+
+   wfRx[SDA].gpio = SDA;
+   wfRx[SDA].mode = PI_WFRX_I2C_SDA;
+   wfRx[SDA].baud = baud;
+
+   wfRx[SDA].I.started = 0;
+   wfRx[SDA].I.SDA = SDA;
+   wfRx[SDA].I.SCL = SCL;
+   wfRx[SDA].I.delay = 500000 / baud;
+   wfRx[SDA].I.SDAMode = gpioGetMode(SDA);
+   wfRx[SDA].I.SCLMode = gpioGetMode(SCL);
+
+   wfRx[SCL].gpio = SCL;
+   wfRx[SCL].mode = PI_WFRX_I2C_SCL;
+
+   myGpioSetMode(SDA, PI_INPUT);
+   myGpioSetMode(SCL, PI_INPUT);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int bbI2CClose(unsigned SDA)
+{
+   DBG(DBG_USER, "SDA=%d", SDA);
+
+   CHECK_INITED;
+
+   if (SDA > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", SDA);
+
+   switch(wfRx[SDA].mode)
+   {
+      case PI_WFRX_I2C_SDA:
+
+         myGpioSetMode(wfRx[SDA].I.SDA, wfRx[SDA].I.SDAMode);
+         myGpioSetMode(wfRx[SDA].I.SCL, wfRx[SDA].I.SCLMode);
+
+         wfRx[wfRx[SDA].I.SDA].mode = PI_WFRX_NONE;
+         wfRx[wfRx[SDA].I.SCL].mode = PI_WFRX_NONE;
+
+         break;
+
+      default:
+
+         SOFT_ERROR(PI_NOT_I2C_GPIO, "no I2C on gpio (%d)", SDA);
+
+         break;
+
+   }
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int bbI2CZip(
+   unsigned SDA,
+   char *inBuf,
+   unsigned inLen,
+   char *outBuf,
+   unsigned outLen)
+{
+   int i, ack, inPos, outPos, status, bytes;
+   int addr, flags, esc, setesc;
+   wfRx_t *w;
+
+   DBG(DBG_USER, "gpio=%d inBuf=%s outBuf=%08"PRIXPTR" len=%d",
+      SDA, myBuf2Str(inLen, (char *)inBuf), (uintptr_t)outBuf, outLen);
+
+   CHECK_INITED;
+
+   if (SDA > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", SDA);
+
+   if (wfRx[SDA].mode != PI_WFRX_I2C_SDA)
+      SOFT_ERROR(PI_NOT_I2C_GPIO, "no I2C on gpio (%d)", SDA);
+
+   if (!inBuf || !inLen)
+      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
+
+   if (!outBuf && outLen)
+      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
+
+   w = &wfRx[SDA];
+
+   inPos = 0;
+   outPos = 0;
+   status = 0;
+
+   addr = 0;
+   flags = 0;
+   esc = 0;
+   setesc = 0;
+
+   wfRx_lock(SDA);
+
+   while (!status && (inPos < inLen))
+   {
+      DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x",
+         status, inPos, inLen, inBuf[inPos], addr, flags);
+
+      switch (inBuf[inPos++])
+      {
+         case PI_I2C_END:
+            status = 1;
+            break;
+
+         case PI_I2C_START:
+            I2CStart(w);
+            break;
+
+         case PI_I2C_STOP:
+            I2CStop(w);
+            break;
+
+         case PI_I2C_ADDR:
+            addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+            if (addr < 0) status = PI_BAD_I2C_CMD;
+            break;
+
+         case PI_I2C_FLAGS:
+            /* cheat to force two byte flags */
+            esc = 1;
+            flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+            if (flags < 0) status = PI_BAD_I2C_CMD;
+            break;
+
+         case PI_I2C_ESC:
+            setesc = 1;
+            break;
+
+         case PI_I2C_READ:
+
+            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+
+            if (bytes >= 0) ack = I2CPutByte(w, (addr<<1)|1);
+
+            if (bytes > 0)
+            {
+               if (!ack)
+               {
+                  if ((bytes + outPos) <= outLen)
+                  {
+                     for (i=0; i<(bytes-1); i++)
+                     {
+                        outBuf[outPos++] = I2CGetByte(w, 0);
+                     }
+                     outBuf[outPos++] = I2CGetByte(w, 1);
+                  }
+                  else status = PI_BAD_I2C_RLEN;
+               }
+               else status = PI_I2C_READ_FAILED;
+            }
+            else status = PI_BAD_I2C_CMD;
+            break;
+
+         case PI_I2C_WRITE:
+
+            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+
+            if (bytes >= 0) ack = I2CPutByte(w, addr<<1);
+
+            if (bytes > 0)
+            {
+               if (!ack)
+               {
+                  if ((bytes + inPos) <= inLen)
+                  {
+                     for (i=0; i<(bytes-1); i++)
+                     {
+                        ack = I2CPutByte(w, inBuf[inPos++]);
+                        if (ack) status = PI_I2C_WRITE_FAILED;
+                     }
+                     ack = I2CPutByte(w, inBuf[inPos++]);
+                  }
+                  else status = PI_BAD_I2C_WLEN;
+               } else status = PI_I2C_WRITE_FAILED;
+            }
+            else status = PI_BAD_I2C_CMD;
+            break;
+
+         default:
+            status = PI_BAD_I2C_CMD;
+      }
+
+      if (setesc) esc = 1; else esc = 0;
+
+      setesc = 0;
+   }
+
+   wfRx_unlock(SDA);
+
+   if (status >= 0) status = outPos;
+
+   return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+void bscInit(int mode)
+{
+   int sda, scl, mosi, miso, ce;
+
+   bscsReg[BSC_CR]=0; /* clear device */
+   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
+   bscsReg[BSC_SLV]=0; /* clear I2C slave address */
+   bscsReg[BSC_IMSC]=0xf; /* mask off all interrupts */
+   bscsReg[BSC_ICR]=0x0f; /* clear all interrupts */
+
+   if (pi_is_2711)
+   {
+      sda = BSC_SDA_2711;
+      scl = BSC_SCL_SCLK_2711;
+      mosi = BSC_MOSI_2711;
+      miso = BSC_MISO_2711;
+      ce = BSC_CE_N_2711;
+   }
+   else
+   {
+      sda = BSC_SDA;
+      scl = BSC_SCL_SCLK;
+      mosi = BSC_MOSI;
+      miso = BSC_MISO;
+      ce = BSC_CE_N;
+   }
+
+
+   if (mode > 1) /* SPI uses all GPIO */
+   {
+      gpioSetMode(scl, PI_ALT3);
+      gpioSetMode(mosi, PI_ALT3);
+      gpioSetMode(miso, PI_ALT3);
+      gpioSetMode(ce, PI_ALT3);
+   }
+   else
+   {
+      gpioSetMode(scl, PI_ALT3);
+      gpioSetMode(sda, PI_ALT3);
+   }
+}
+
+void bscTerm(int mode)
+{
+   int sda, scl, mosi, miso, ce;
+
+   bscsReg[BSC_CR] = 0; /* clear device */
+   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
+   bscsReg[BSC_SLV]=0; /* clear I2C slave address */
+
+   if (pi_is_2711)
+   {
+      sda = BSC_SDA_2711;
+      scl = BSC_SCL_SCLK_2711;
+      mosi = BSC_MOSI_2711;
+      miso = BSC_MISO_2711;
+      ce = BSC_CE_N_2711;
+   }
+   else
+   {
+      sda = BSC_SDA;
+      scl = BSC_SCL_SCLK;
+      mosi = BSC_MOSI;
+      miso = BSC_MISO;
+      ce = BSC_CE_N;
+   }
+
+
+   if (mode > 1)
+   {
+      gpioSetMode(scl, PI_INPUT);
+      gpioSetMode(mosi, PI_INPUT);
+      gpioSetMode(miso, PI_INPUT);
+      gpioSetMode(ce, PI_INPUT);
+   }
+   else
+   {
+      gpioSetMode(sda, PI_INPUT);
+      gpioSetMode(scl, PI_INPUT);
+
+   }
+}
+
+int bscXfer(bsc_xfer_t *xfer)
+{
+   static int bscMode = 0;
+
+   int copied=0;
+   int active, mode;
+
+   DBG(DBG_USER, "control=0x%X (sa=0x%X, cr=0x%X) tx=%d [%s]",
+      xfer->control,
+      ((xfer->control)>>16) & 127,
+      (xfer->control) & 0x3fff,
+      xfer->txCnt,
+      myBuf2Str(xfer->txCnt, (char *)xfer->txBuf));
+
+   CHECK_INITED;
+
+   eventAlert[PI_EVENT_BSC].ignore = 1;
+
+   if (xfer->control)
+   {
+      /*
+         bscMode (0=None, 1=I2C, 2=SPI) tracks which GPIO have been
+         set to BSC mode
+      */
+      if (xfer->control & 2) mode = 2; /* SPI */
+      else                   mode = 1; /* assume I2C */
+
+      if (mode > bscMode)
+      {
+         bscInit(mode);
+         bscMode = mode;
+      }
+   }
+   else
+   {
+      if (bscMode) bscTerm(bscMode);
+      bscMode = 0;
+      return 0; /* leave ignore set */
+   }
+
+   xfer->rxCnt = 0;
+
+   bscsReg[BSC_SLV] = ((xfer->control)>>16) & 127;
+   bscsReg[BSC_CR] = (xfer->control) & 0x3fff;
+   bscsReg[BSC_RSR]=0; /* clear underrun and overrun errors */
+
+   active = 1;
+
+   while (active)
+   {
+      active = 0;
+
+      while ((copied < xfer->txCnt) &&
+             (!(bscsReg[BSC_FR] & BSC_FR_TXFF)))
+      {
+         bscsReg[BSC_DR] = xfer->txBuf[copied++];
+         active = 1;
+      }
+
+      while ((xfer->rxCnt < BSC_FIFO_SIZE) &&
+             (!(bscsReg[BSC_FR] & BSC_FR_RXFE)))
+      {
+         xfer->rxBuf[xfer->rxCnt++] = bscsReg[BSC_DR];
+         active = 1;
+      }
+
+      if (!active)
+      {
+         active = bscsReg[BSC_FR] & (BSC_FR_RXBUSY | BSC_FR_TXBUSY);
+      }
+
+      if (active) myGpioSleep(0, 20);
+   }
+
+   bscFR = bscsReg[BSC_FR] & 0xffff;
+
+   eventAlert[PI_EVENT_BSC].ignore = 0;
+
+   return (copied<<16) | bscFR;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void set_CS(wfRx_t *w)
+{
+   myGpioWrite(w->S.CS, PI_SPI_FLAGS_GET_CSPOL(w->S.spiFlags));
+}
+
+static void clear_CS(wfRx_t *w)
+{
+   myGpioWrite(w->S.CS, !PI_SPI_FLAGS_GET_CSPOL(w->S.spiFlags));
+}
+
+static void set_SCLK(wfRx_t *w)
+{
+   myGpioWrite(w->S.SCLK, !PI_SPI_FLAGS_GET_CPOL(w->S.spiFlags));
+}
+
+static void clear_SCLK(wfRx_t *w)
+{
+   myGpioWrite(w->S.SCLK, PI_SPI_FLAGS_GET_CPOL(w->S.spiFlags));
+}
+
+static void SPI_delay(wfRx_t *w)
+{
+   myGpioDelay(w->S.delay);
+}
+
+static void bbSPIStart(wfRx_t *w)
+{
+   clear_SCLK(w);
+
+   SPI_delay(w);
+
+   set_CS(w);
+
+   SPI_delay(w);
+}
+
+static void bbSPIStop(wfRx_t *w)
+{
+   SPI_delay(w);
+
+   clear_CS(w);
+
+   SPI_delay(w);
+
+   clear_SCLK(w);
+}
+
+static uint8_t bbSPIXferByte(wfRx_t *w, char txByte)
+{
+   uint8_t bit, rxByte=0;
+
+   if (PI_SPI_FLAGS_GET_CPHA(w->S.spiFlags))
+   {
+      /*
+      CPHA = 1
+      write on set clock
+      read on clear clock
+      */
+
+      for (bit=0; bit<8; bit++)
+      {
+         set_SCLK(w);
+
+         if (PI_SPI_FLAGS_GET_TX_LSB(w->S.spiFlags))
+         {
+            myGpioWrite(w->S.MOSI, txByte & 0x01);
+            txByte >>= 1;
+         }
+         else
+         {
+            myGpioWrite(w->S.MOSI, txByte & 0x80);
+            txByte <<= 1;
+         }
+
+         SPI_delay(w);
+
+         clear_SCLK(w);
+
+         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
+         {
+            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
+         }
+         else
+         {
+            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
+         }
+
+         SPI_delay(w);
+      }
+   }
+   else
+   {
+      /*
+      CPHA = 0
+      read on set clock
+      write on clear clock
+      */
+
+      for (bit=0; bit<8; bit++)
+      {
+         if (PI_SPI_FLAGS_GET_TX_LSB(w->S.spiFlags))
+         {
+            myGpioWrite(w->S.MOSI, txByte & 0x01);
+            txByte >>= 1;
+         }
+         else
+         {
+            myGpioWrite(w->S.MOSI, txByte & 0x80);
+            txByte <<= 1;
+         }
+
+         SPI_delay(w);
+
+         set_SCLK(w);
+
+         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
+         {
+            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
+         }
+         else
+         {
+            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
+         }
+
+         SPI_delay(w);
+
+         clear_SCLK(w);
+      }
+   }
+
+   return rxByte;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int bbSPIOpen(
+   unsigned CS, unsigned MISO, unsigned MOSI, unsigned SCLK,
+   unsigned baud, unsigned spiFlags)
+{
+   int valid;
+   uint32_t bits;
+
+   DBG(DBG_USER, "CS=%d MISO=%d MOSI=%d SCLK=%d baud=%d flags=%d",
+      CS, MISO, MOSI, SCLK, baud, spiFlags);
+
+   CHECK_INITED;
+
+   if (CS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad CS (%d)", CS);
+
+   if (MISO > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad MISO (%d)", MISO);
+
+   if (MOSI > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad MOSI (%d)", MOSI);
+
+   if (SCLK > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SCLK (%d)", SCLK);
+
+   if ((baud < PI_BB_SPI_MIN_BAUD) || (baud > PI_BB_SPI_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_SPI_BAUD, "CS %d, bad baud (%d)", CS, baud);
+
+   if (wfRx[CS].mode != PI_WFRX_NONE)
+      SOFT_ERROR(PI_GPIO_IN_USE,
+         "CS %d is already being used, mode %d", CS, wfRx[CS].mode);
+
+   valid = 0;
+
+   /* check all GPIO unique */
+
+   bits = (1<<CS) | (1<<MISO) | (1<<MOSI) | (1<<SCLK);
+
+   if (__builtin_popcount(bits) == 4)
+   {
+      if ((wfRx[MISO].mode == PI_WFRX_NONE) &&
+          (wfRx[MOSI].mode == PI_WFRX_NONE) &&
+          (wfRx[SCLK].mode == PI_WFRX_NONE))
+      {
+         valid = 1; /* first time GPIO used for SPI */
+      }
+      else
+      {
+         if ((wfRx[MISO].mode == PI_WFRX_SPI_MISO) &&
+             (wfRx[MOSI].mode == PI_WFRX_SPI_MOSI) &&
+             (wfRx[SCLK].mode == PI_WFRX_SPI_SCLK))
+         {
+            valid = 2; /* new CS for existing SPI GPIO */
+         }
+      }
+   }
+
+   if (!valid)
+   {
+      SOFT_ERROR(PI_GPIO_IN_USE,
+         "GPIO already being used (%d=%d %d=%d, %d=%d %d=%d)",
+          CS,   wfRx[CS].mode,
+          MISO, wfRx[MISO].mode,
+          MOSI, wfRx[MOSI].mode,
+          SCLK, wfRx[SCLK].mode);
+   }
+
+   wfRx[CS].mode = PI_WFRX_SPI_CS;
+   wfRx[CS].baud = baud;
+
+   wfRx[CS].S.CS = CS;
+   wfRx[CS].S.SCLK = SCLK;
+
+   wfRx[CS].S.CSMode = gpioGetMode(CS);
+   wfRx[CS].S.delay = (500000 / baud) - 1;
+   wfRx[CS].S.spiFlags = spiFlags;
+
+   /* preset CS to off */
+
+   if (PI_SPI_FLAGS_GET_CSPOL(spiFlags))
+      gpioWrite(CS, 0); /* active high */
+   else
+      gpioWrite(CS, 1); /* active low */
+
+   /* The SCLK entry is used to store full information */
+
+   if (valid == 1) /* first time GPIO for SPI */
+   {
+      wfRx[SCLK].S.usage = 1;
+
+      wfRx[SCLK].S.SCLKMode = gpioGetMode(SCLK);
+      wfRx[SCLK].S.MISOMode = gpioGetMode(MISO);
+      wfRx[SCLK].S.MOSIMode = gpioGetMode(MOSI);
+
+      wfRx[SCLK].mode = PI_WFRX_SPI_SCLK;
+      wfRx[MISO].mode = PI_WFRX_SPI_MISO;
+      wfRx[MOSI].mode = PI_WFRX_SPI_MOSI;
+
+      wfRx[SCLK].S.SCLK = SCLK;
+      wfRx[SCLK].S.MISO = MISO;
+      wfRx[SCLK].S.MOSI = MOSI;
+
+      myGpioSetMode(MISO, PI_INPUT);
+      myGpioSetMode(SCLK, PI_OUTPUT);
+      gpioWrite(MOSI, 0); /* low output */
+   }
+   else
+   {
+      wfRx[SCLK].S.usage++;
+   }
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int bbSPIClose(unsigned CS)
+{
+   int SCLK;
+
+   DBG(DBG_USER, "CS=%d", CS);
+
+   CHECK_INITED;
+
+   if (CS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", CS);
+
+   switch(wfRx[CS].mode)
+   {
+      case PI_WFRX_SPI_CS:
+
+         myGpioSetMode(wfRx[CS].S.CS, wfRx[CS].S.CSMode);
+         wfRx[CS].mode = PI_WFRX_NONE;
+
+         SCLK = wfRx[CS].S.SCLK;
+
+         if (--wfRx[SCLK].S.usage <= 0)
+         {
+            myGpioSetMode(wfRx[SCLK].S.MISO, wfRx[SCLK].S.MISOMode);
+            myGpioSetMode(wfRx[SCLK].S.MOSI, wfRx[SCLK].S.MOSIMode);
+            myGpioSetMode(wfRx[SCLK].S.SCLK, wfRx[SCLK].S.SCLKMode);
+
+            wfRx[wfRx[SCLK].S.MISO].mode = PI_WFRX_NONE;
+            wfRx[wfRx[SCLK].S.MOSI].mode = PI_WFRX_NONE;
+            wfRx[wfRx[SCLK].S.SCLK].mode = PI_WFRX_NONE;
+         }
+
+         break;
+
+      default:
+
+         SOFT_ERROR(PI_NOT_SPI_GPIO, "no SPI on gpio (%d)", CS);
+
+         break;
+
+   }
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int bbSPIXfer(
+   unsigned CS,
+   char *inBuf,
+   char *outBuf,
+   unsigned count)
+{
+   int SCLK;
+   int pos;
+   wfRx_t *w;
+
+   DBG(DBG_USER, "CS=%d inBuf=%s outBuf=%08"PRIXPTR" count=%d",
+      CS, myBuf2Str(count, (char *)inBuf), (uintptr_t)outBuf, count);
+
+   CHECK_INITED;
+
+   if (CS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", CS);
+
+   if (wfRx[CS].mode != PI_WFRX_SPI_CS)
+      SOFT_ERROR(PI_NOT_SPI_GPIO, "no SPI on gpio (%d)", CS);
+
+   if (!inBuf || !count)
+      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
+
+   if (!outBuf && count)
+      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
+
+   SCLK = wfRx[CS].S.SCLK;
+
+   wfRx[SCLK].S.CS = CS;
+   wfRx[SCLK].baud = wfRx[CS].baud;
+   wfRx[SCLK].S.delay = wfRx[CS].S.delay;
+   wfRx[SCLK].S.spiFlags = wfRx[CS].S.spiFlags;
+
+   w = &wfRx[SCLK];
+
+   wfRx_lock(SCLK);
+
+   bbSPIStart(w);
+     
+   for (pos=0; pos < count; pos++)
+   {
+      outBuf[pos] = bbSPIXferByte(w, inBuf[pos]);
+   }
+
+   bbSPIStop(w);
+
+   wfRx_unlock(SCLK);
+
+   return count;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits)
+{
+   int bitTime, timeout;
+
+   DBG(DBG_USER, "gpio=%d baud=%d data_bits=%d", gpio, baud, data_bits);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if ((baud < PI_BB_SER_MIN_BAUD) || (baud > PI_BB_SER_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_WAVE_BAUD,
+         "gpio %d, bad baud rate (%d)", gpio, baud);
+
+   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
+       (data_bits > PI_MAX_WAVE_DATABITS))
+      SOFT_ERROR(PI_BAD_DATABITS,
+         "gpio %d, bad data bits (%d)", gpio, data_bits);
+
+   if (wfRx[gpio].mode != PI_WFRX_NONE)
+      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", gpio);
+
+   bitTime = (1000 * MILLION) / baud; /* nanos */
+
+   timeout  = ((data_bits+2) * bitTime)/MILLION; /* millis */
+
+   if (timeout < 1) timeout = 1;
+
+   wfRx[gpio].gpio = gpio;
+   wfRx[gpio].mode = PI_WFRX_SERIAL;
+   wfRx[gpio].baud = baud;
+
+   wfRx[gpio].s.buf      = malloc(SRX_BUF_SIZE);
+   wfRx[gpio].s.bufSize  = SRX_BUF_SIZE;
+   wfRx[gpio].s.timeout  = timeout;
+   wfRx[gpio].s.fullBit  = bitTime;         /* nanos */
+   wfRx[gpio].s.halfBit  = (bitTime/2)+500; /* nanos (500 for rounding) */
+   wfRx[gpio].s.readPos  = 0;
+   wfRx[gpio].s.writePos = 0;
+   wfRx[gpio].s.bit      = -1;
+   wfRx[gpio].s.dataBits = data_bits;
+   wfRx[gpio].s.invert   = PI_BB_SER_NORMAL;
+
+   if      (data_bits <  9) wfRx[gpio].s.bytes = 1;
+   else if (data_bits < 17) wfRx[gpio].s.bytes = 2;
+   else                  wfRx[gpio].s.bytes = 4;
+
+   gpioSetAlertFunc(gpio, waveRxBit);
 
-static void clear_SCLK(wfRx_t *w)
-{
-   myGpioWrite(w->S.SCLK, PI_SPI_FLAGS_GET_CPOL(w->S.spiFlags));
+   return 0;
 }
 
-static void SPI_delay(wfRx_t *w)
-{
-   myGpioDelay(w->S.delay);
-}
+/*-------------------------------------------------------------------------*/
 
-static void bbSPIStart(wfRx_t *w)
+int gpioSerialReadInvert(unsigned gpio, unsigned invert)
 {
-   clear_SCLK(w);
-
-   SPI_delay(w);
+   DBG(DBG_USER, "gpio=%d invert=%d", gpio, invert);
 
-   set_CS(w);
+   CHECK_INITED;
 
-   SPI_delay(w);
-}
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-static void bbSPIStop(wfRx_t *w)
-{
-   SPI_delay(w);
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-   clear_CS(w);
+   if ((invert < PI_BB_SER_NORMAL) ||
+       (invert > PI_BB_SER_INVERT))
+      SOFT_ERROR(PI_BAD_SER_INVERT,
+         "bad invert level for gpio %d (%d)", gpio, invert);
 
-   SPI_delay(w);
+   wfRx[gpio].s.invert = invert;
 
-   clear_SCLK(w);
+   return 0;
 }
 
-static uint8_t bbSPIXferByte(wfRx_t *w, char txByte)
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialRead(unsigned gpio, void *buf, size_t bufSize)
 {
-   uint8_t bit, rxByte=0;
+   unsigned bytes=0, wpos;
+   volatile wfRx_t *w;
 
-   if (PI_SPI_FLAGS_GET_CPHA(w->S.spiFlags))
-   {
-      /*
-      CPHA = 1
-      write on set clock
-      read on clear clock
-      */
+   DBG(DBG_USER, "gpio=%d buf=%08"PRIXPTR" bufSize=%zd", gpio, (uintptr_t)buf, bufSize);
 
-      for (bit=0; bit<8; bit++)
-      {
-         set_SCLK(w);
+   CHECK_INITED;
 
-         if (PI_SPI_FLAGS_GET_TX_LSB(w->S.spiFlags))
-         {
-            myGpioWrite(w->S.MOSI, txByte & 0x01);
-            txByte >>= 1;
-         }
-         else
-         {
-            myGpioWrite(w->S.MOSI, txByte & 0x80);
-            txByte <<= 1;
-         }
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-         SPI_delay(w);
+   if (bufSize == 0)
+      SOFT_ERROR(PI_BAD_SERIAL_COUNT, "buffer size can't be zero");
 
-         clear_SCLK(w);
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
-         {
-            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
-         }
-         else
-         {
-            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
-         }
+   w = &wfRx[gpio];
 
-         SPI_delay(w);
-      }
-   }
-   else
+   if (w->s.readPos != w->s.writePos)
    {
-      /*
-      CPHA = 0
-      read on set clock
-      write on clear clock
-      */
+      wpos = w->s.writePos;
 
-      for (bit=0; bit<8; bit++)
-      {
-         if (PI_SPI_FLAGS_GET_TX_LSB(w->S.spiFlags))
-         {
-            myGpioWrite(w->S.MOSI, txByte & 0x01);
-            txByte >>= 1;
-         }
-         else
-         {
-            myGpioWrite(w->S.MOSI, txByte & 0x80);
-            txByte <<= 1;
-         }
+      if (wpos > w->s.readPos) bytes = wpos - w->s.readPos;
+      else                     bytes = w->s.bufSize - w->s.readPos;
 
-         SPI_delay(w);
+      if (bytes > bufSize) bytes = bufSize;
 
-         set_SCLK(w);
+      /* copy in multiples of the data size in bytes */
 
-         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
-         {
-            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
-         }
-         else
-         {
-            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
-         }
+      bytes = (bytes / w->s.bytes) * w->s.bytes;
 
-         SPI_delay(w);
+      if (buf) memcpy(buf, w->s.buf+w->s.readPos, bytes);
 
-         clear_SCLK(w);
-      }
-   }
+      w->s.readPos += bytes;
 
-   return rxByte;
+      if (w->s.readPos >= w->s.bufSize) w->s.readPos = 0;
+   }
+   return bytes;
 }
 
+
 /*-------------------------------------------------------------------------*/
 
-int bbSPIOpen(
-   unsigned CS, unsigned MISO, unsigned MOSI, unsigned SCLK,
-   unsigned baud, unsigned spiFlags)
+int gpioSerialReadClose(unsigned gpio)
 {
-   int valid;
-   uint32_t bits;
-
-   DBG(DBG_USER, "CS=%d MISO=%d MOSI=%d SCLK=%d baud=%d flags=%d",
-      CS, MISO, MOSI, SCLK, baud, spiFlags);
+   DBG(DBG_USER, "gpio=%d", gpio);
 
    CHECK_INITED;
 
-   if (CS > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad CS (%d)", CS);
-
-   if (MISO > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad MISO (%d)", MISO);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if (MOSI > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad MOSI (%d)", MOSI);
+   switch(wfRx[gpio].mode)
+   {
+      case PI_WFRX_NONE:
 
-   if (SCLK > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SCLK (%d)", SCLK);
+         SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-   if ((baud < PI_BB_SPI_MIN_BAUD) || (baud > PI_BB_SPI_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_SPI_BAUD, "CS %d, bad baud (%d)", CS, baud);
+         break;
 
-   if (wfRx[CS].mode != PI_WFRX_NONE)
-      SOFT_ERROR(PI_GPIO_IN_USE,
-         "CS %d is already being used, mode %d", CS, wfRx[CS].mode);
+      case PI_WFRX_SERIAL:
 
-   valid = 0;
+         free(wfRx[gpio].s.buf);
 
-   /* check all GPIO unique */
+         gpioSetWatchdog(gpio, 0); /* switch off timeouts */
 
-   bits = (1<<CS) | (1<<MISO) | (1<<MOSI) | (1<<SCLK);
+         gpioSetAlertFunc(gpio, NULL); /* cancel alert */
 
-   if (__builtin_popcount(bits) == 4)
-   {
-      if ((wfRx[MISO].mode == PI_WFRX_NONE) &&
-          (wfRx[MOSI].mode == PI_WFRX_NONE) &&
-          (wfRx[SCLK].mode == PI_WFRX_NONE))
-      {
-         valid = 1; /* first time GPIO used for SPI */
-      }
-      else
-      {
-         if ((wfRx[MISO].mode == PI_WFRX_SPI_MISO) &&
-             (wfRx[MOSI].mode == PI_WFRX_SPI_MOSI) &&
-             (wfRx[SCLK].mode == PI_WFRX_SPI_SCLK))
-         {
-            valid = 2; /* new CS for existing SPI GPIO */
-         }
-      }
-   }
+         wfRx[gpio].mode = PI_WFRX_NONE;
 
-   if (!valid)
-   {
-      SOFT_ERROR(PI_GPIO_IN_USE,
-         "GPIO already being used (%d=%d %d=%d, %d=%d %d=%d)",
-          CS,   wfRx[CS].mode,
-          MISO, wfRx[MISO].mode,
-          MOSI, wfRx[MOSI].mode,
-          SCLK, wfRx[SCLK].mode);
+         break;
    }
 
-   wfRx[CS].mode = PI_WFRX_SPI_CS;
-   wfRx[CS].baud = baud;
+   return 0;
+}
 
-   wfRx[CS].S.CS = CS;
-   wfRx[CS].S.SCLK = SCLK;
 
-   wfRx[CS].S.CSMode = gpioGetMode(CS);
-   wfRx[CS].S.delay = (500000 / baud) - 1;
-   wfRx[CS].S.spiFlags = spiFlags;
+/* ----------------------------------------------------------------------- */
 
-   /* preset CS to off */
+static int intEventSetFunc(
+   unsigned event,
+   void *   f,
+   int      user,
+   void *   userdata)
+{
+   DBG(DBG_INTERNAL, "event=%d function=%08"PRIXPTR", user=%d, userdata=%08"PRIXPTR,
+      event, (uintptr_t)f, user, (uintptr_t)userdata);
 
-   if (PI_SPI_FLAGS_GET_CSPOL(spiFlags))
-      gpioWrite(CS, 0); /* active high */
-   else
-      gpioWrite(CS, 1); /* active low */
+   eventAlert[event].ex = user;
+   eventAlert[event].userdata = userdata;
 
-   /* The SCLK entry is used to store full information */
+   eventAlert[event].func = f;
 
-   if (valid == 1) /* first time GPIO for SPI */
-   {
-      wfRx[SCLK].S.usage = 1;
+   return 0;
+}
 
-      wfRx[SCLK].S.SCLKMode = gpioGetMode(SCLK);
-      wfRx[SCLK].S.MISOMode = gpioGetMode(MISO);
-      wfRx[SCLK].S.MOSIMode = gpioGetMode(MOSI);
 
-      wfRx[SCLK].mode = PI_WFRX_SPI_SCLK;
-      wfRx[MISO].mode = PI_WFRX_SPI_MISO;
-      wfRx[MOSI].mode = PI_WFRX_SPI_MOSI;
+/* ----------------------------------------------------------------------- */
 
-      wfRx[SCLK].S.SCLK = SCLK;
-      wfRx[SCLK].S.MISO = MISO;
-      wfRx[SCLK].S.MOSI = MOSI;
+int eventSetFunc(unsigned event, eventFunc_t f)
+{
+   DBG(DBG_USER, "event=%d function=%08"PRIXPTR, event, (uintptr_t)f);
 
-      myGpioSetMode(MISO, PI_INPUT);
-      myGpioSetMode(SCLK, PI_OUTPUT);
-      gpioWrite(MOSI, 0); /* low output */
-   }
-   else
-   {
-      wfRx[SCLK].S.usage++;
-   }
+   CHECK_INITED;
+
+   if (event > PI_MAX_EVENT)
+      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+
+   intEventSetFunc(event, f, 0, NULL);
 
    return 0;
 }
 
-/*-------------------------------------------------------------------------*/
 
-int bbSPIClose(unsigned CS)
-{
-   int SCLK;
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_USER, "CS=%d", CS);
+int eventSetFuncEx(unsigned event, eventFuncEx_t f, void *userdata)
+{
+   DBG(DBG_USER, "event=%d function=%08"PRIxPTR" userdata=%08"PRIxPTR,
+      event, (uintptr_t)f, (uintptr_t)userdata);
 
    CHECK_INITED;
 
-   if (CS > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", CS);
+   if (event > PI_MAX_EVENT)
+      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
 
-   switch(wfRx[CS].mode)
-   {
-      case PI_WFRX_SPI_CS:
+   intEventSetFunc(event, f, 1, userdata);
 
-         myGpioSetMode(wfRx[CS].S.CS, wfRx[CS].S.CSMode);
-         wfRx[CS].mode = PI_WFRX_NONE;
+   return 0;
+}
 
-         SCLK = wfRx[CS].S.SCLK;
 
-         if (--wfRx[SCLK].S.usage <= 0)
-         {
-            myGpioSetMode(wfRx[SCLK].S.MISO, wfRx[SCLK].S.MISOMode);
-            myGpioSetMode(wfRx[SCLK].S.MOSI, wfRx[SCLK].S.MOSIMode);
-            myGpioSetMode(wfRx[SCLK].S.SCLK, wfRx[SCLK].S.SCLKMode);
+/* ----------------------------------------------------------------------- */
 
-            wfRx[wfRx[SCLK].S.MISO].mode = PI_WFRX_NONE;
-            wfRx[wfRx[SCLK].S.MOSI].mode = PI_WFRX_NONE;
-            wfRx[wfRx[SCLK].S.SCLK].mode = PI_WFRX_NONE;
-         }
+int eventMonitor(unsigned handle, uint32_t bits)
+{
+   DBG(DBG_USER, "handle=%d bits=%08X", handle, bits);
 
-         break;
+   CHECK_INITED;
 
-      default:
+   if (handle >= PI_NOTIFY_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-         SOFT_ERROR(PI_NOT_SPI_GPIO, "no SPI on gpio (%d)", CS);
+   if (gpioNotify[handle].state <= PI_NOTIFY_CLOSING)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-         break;
+   gpioNotify[handle].eventBits  = bits;
 
-   }
+   intNotifyBits();
 
    return 0;
 }
 
-/*-------------------------------------------------------------------------*/
 
-int bbSPIXfer(
-   unsigned CS,
-   char *inBuf,
-   char *outBuf,
-   unsigned count)
-{
-   int SCLK;
-   int pos;
-   wfRx_t *w;
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_USER, "CS=%d inBuf=%s outBuf=%08"PRIXPTR" count=%d",
-      CS, myBuf2Str(count, (char *)inBuf), (uintptr_t)outBuf, count);
+int eventTrigger(unsigned event)
+{
+   DBG(DBG_USER, "event=%d", event);
 
    CHECK_INITED;
 
-   if (CS > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", CS);
+   if (event > PI_MAX_EVENT)
+      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
 
-   if (wfRx[CS].mode != PI_WFRX_SPI_CS)
-      SOFT_ERROR(PI_NOT_SPI_GPIO, "no SPI on gpio (%d)", CS);
+   eventAlert[event].fired = 1;
 
-   if (!inBuf || !count)
-      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
+   return 0;
+}
 
-   if (!outBuf && count)
-      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
 
-   SCLK = wfRx[CS].S.SCLK;
+/* ----------------------------------------------------------------------- */
 
-   wfRx[SCLK].S.CS = CS;
-   wfRx[SCLK].baud = wfRx[CS].baud;
-   wfRx[SCLK].S.delay = wfRx[CS].S.delay;
-   wfRx[SCLK].S.spiFlags = wfRx[CS].S.spiFlags;
+static int intGpioSetAlertFunc(
+   unsigned gpio,
+   void *   f,
+   int      user,
+   void *   userdata)
+{
+   DBG(DBG_INTERNAL, "gpio=%d function=%08"PRIXPTR", user=%d, userdata=%08"PRIXPTR,
+      gpio, (uintptr_t)f, user, (uintptr_t)userdata);
 
-   w = &wfRx[SCLK];
+   gpioAlert[gpio].ex = user;
+   gpioAlert[gpio].userdata = userdata;
 
-   wfRx_lock(SCLK);
+   gpioAlert[gpio].func = f;
 
-   bbSPIStart(w);
-     
-   for (pos=0; pos < count; pos++)
+   if (f)
    {
-      outBuf[pos] = bbSPIXferByte(w, inBuf[pos]);
+      alertBits |= BIT;
+   }
+   else
+   {
+      alertBits &= ~BIT;
    }
 
-   bbSPIStop(w);
-
-   wfRx_unlock(SCLK);
+   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
 
-   return count;
+   return 0;
 }
 
-/*-------------------------------------------------------------------------*/
+/* ----------------------------------------------------------------------- */
 
-int gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits)
+int gpioSetAlertFunc(unsigned gpio, gpioAlertFunc_t f)
 {
-   int bitTime, timeout;
-
-   DBG(DBG_USER, "gpio=%d baud=%d data_bits=%d", gpio, baud, data_bits);
+   DBG(DBG_USER, "gpio=%d function=%08"PRIXPTR, gpio, (uintptr_t)f);
 
    CHECK_INITED;
 
    if (gpio > PI_MAX_USER_GPIO)
       SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if ((baud < PI_BB_SER_MIN_BAUD) || (baud > PI_BB_SER_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_WAVE_BAUD,
-         "gpio %d, bad baud rate (%d)", gpio, baud);
-
-   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
-       (data_bits > PI_MAX_WAVE_DATABITS))
-      SOFT_ERROR(PI_BAD_DATABITS,
-         "gpio %d, bad data bits (%d)", gpio, data_bits);
-
-   if (wfRx[gpio].mode != PI_WFRX_NONE)
-      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", gpio);
+   intGpioSetAlertFunc(gpio, f, 0, NULL);
 
-   bitTime = (1000 * MILLION) / baud; /* nanos */
+   return 0;
+}
 
-   timeout  = ((data_bits+2) * bitTime)/MILLION; /* millis */
 
-   if (timeout < 1) timeout = 1;
+/* ----------------------------------------------------------------------- */
 
-   wfRx[gpio].gpio = gpio;
-   wfRx[gpio].mode = PI_WFRX_SERIAL;
-   wfRx[gpio].baud = baud;
+int gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void *userdata)
+{
+   DBG(DBG_USER, "gpio=%d function=%08"PRIXPTR" userdata=%08"PRIXPTR,
+      gpio, (uintptr_t)f, (uintptr_t)userdata);
 
-   wfRx[gpio].s.buf      = malloc(SRX_BUF_SIZE);
-   wfRx[gpio].s.bufSize  = SRX_BUF_SIZE;
-   wfRx[gpio].s.timeout  = timeout;
-   wfRx[gpio].s.fullBit  = bitTime;         /* nanos */
-   wfRx[gpio].s.halfBit  = (bitTime/2)+500; /* nanos (500 for rounding) */
-   wfRx[gpio].s.readPos  = 0;
-   wfRx[gpio].s.writePos = 0;
-   wfRx[gpio].s.bit      = -1;
-   wfRx[gpio].s.dataBits = data_bits;
-   wfRx[gpio].s.invert   = PI_BB_SER_NORMAL;
+   CHECK_INITED;
 
-   if      (data_bits <  9) wfRx[gpio].s.bytes = 1;
-   else if (data_bits < 17) wfRx[gpio].s.bytes = 2;
-   else                  wfRx[gpio].s.bytes = 4;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   gpioSetAlertFunc(gpio, waveRxBit);
+   intGpioSetAlertFunc(gpio, f, 1, userdata);
 
    return 0;
 }
 
-/*-------------------------------------------------------------------------*/
-
-int gpioSerialReadInvert(unsigned gpio, unsigned invert)
+static void *pthISRThread(void *x)
 {
-   DBG(DBG_USER, "gpio=%d invert=%d", gpio, invert);
+   gpioISR_t *isr = x;
+   int fd;
+   int retval;
+   uint32_t tick;
+   int level;
+   uint32_t levels;
+   struct pollfd pfd;
+   char buf[64];
 
-   CHECK_INITED;
+   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d f=%"PRIxPTR" u=%d data=%"PRIxPTR,
+      isr->gpio, isr->edge, isr->timeout, (uintptr_t)isr->func,
+      isr->ex, (uintptr_t)isr->userdata);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   sprintf(buf, "/sys/class/gpio/gpio%d/value", isr->gpio);
 
-   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
-      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+   isr->fd = -1; /* no fd assigned */
 
-   if ((invert < PI_BB_SER_NORMAL) ||
-       (invert > PI_BB_SER_INVERT))
-      SOFT_ERROR(PI_BAD_SER_INVERT,
-         "bad invert level for gpio %d (%d)", gpio, invert);
+   if ((fd = open(buf, O_RDONLY)) < 0)
+   {
+      DBG(DBG_ALWAYS, "gpio %d not exported", isr->gpio);
+      return NULL;
+   }
 
-   wfRx[gpio].s.invert = invert;
+   isr->fd = fd; /* store fd so it can be closed */
 
-   return 0;
-}
+   pfd.fd = fd;
 
-/*-------------------------------------------------------------------------*/
+   pfd.events = POLLPRI;
 
-int gpioSerialRead(unsigned gpio, void *buf, size_t bufSize)
-{
-   unsigned bytes=0, wpos;
-   volatile wfRx_t *w;
+   lseek(fd, 0, SEEK_SET);    /* consume any prior interrupt */
+   if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
 
-   DBG(DBG_USER, "gpio=%d buf=%08"PRIXPTR" bufSize=%zd", gpio, (uintptr_t)buf, bufSize);
+   while (1)
+   {
+      retval = poll(&pfd, 1, isr->timeout); /* wait for interrupt */
 
-   CHECK_INITED;
+      tick = systReg[SYST_CLO];
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      levels = *(gpioReg + GPLEV0);
 
-   if (bufSize == 0)
-      SOFT_ERROR(PI_BAD_SERIAL_COUNT, "buffer size can't be zero");
+      if (retval >= 0)
+      {
+         lseek(fd, 0, SEEK_SET);    /* consume interrupt */
+         if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+
+         if (retval)
+         {
+            if (levels & (1<<isr->gpio)) level = PI_ON; else level = PI_OFF;
+         }
+         else level = PI_TIMEOUT;
+
+         if (isr->ex) (isr->func)(isr->gpio, level, tick, isr->userdata);
+         else         (isr->func)(isr->gpio, level, tick);
+      }
+   }
+
+   return NULL;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+static int intGpioSetISRFunc(
+   unsigned gpio,
+   unsigned edge,
+   int timeout,
+   void *f,
+   int user,
+   void *userdata)
+{
+   char buf[64];
 
-   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
-      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+   char *edge_str[]={"rising\n", "falling\n", "both\n"};
+   int fd;
+   int err;
 
-   w = &wfRx[gpio];
+   DBG(DBG_INTERNAL,
+      "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
+      gpio, edge, timeout, (uintptr_t)f, user, (uintptr_t)userdata);
 
-   if (w->s.readPos != w->s.writePos)
+   if (f)
    {
-      wpos = w->s.writePos;
+      if (!gpioISR[gpio].inited) /* export gpio if unexported */
+      {
+         fd = open("/sys/class/gpio/export", O_WRONLY);
+         if (fd < 0) return PI_BAD_ISR_INIT;
 
-      if (wpos > w->s.readPos) bytes = wpos - w->s.readPos;
-      else                     bytes = w->s.bufSize - w->s.readPos;
+         /* ignore write fail if already exported */
+         sprintf(buf, "%d\n", gpio);
+         err = write(fd, buf, strlen(buf));
+         close(fd);
 
-      if (bytes > bufSize) bytes = bufSize;
+         sprintf(buf, "/sys/class/gpio/gpio%d/direction", gpio);
+         fd = open(buf, O_WRONLY);
+         if (fd < 0) return PI_BAD_ISR_INIT;
 
-      /* copy in multiples of the data size in bytes */
+         err = write(fd, "in\n", 3);
+         close(fd);
+         if (err != 3) return PI_BAD_ISR_INIT;
 
-      bytes = (bytes / w->s.bytes) * w->s.bytes;
+         gpioISR[gpio].gpio = gpio;
+         gpioISR[gpio].edge = -1;
+         gpioISR[gpio].timeout = -1;
 
-      if (buf) memcpy(buf, w->s.buf+w->s.readPos, bytes);
+         gpioISR[gpio].inited = 1;
+      }
 
-      w->s.readPos += bytes;
+      if (gpioISR[gpio].edge != edge)
+      {
+         sprintf(buf, "/sys/class/gpio/gpio%d/edge", gpio);
+         fd = open(buf, O_WRONLY);
+         if (fd < 0) return PI_BAD_ISR_INIT;
 
-      if (w->s.readPos >= w->s.bufSize) w->s.readPos = 0;
-   }
-   return bytes;
-}
+         err = write(fd, edge_str[edge], strlen(edge_str[edge]));
+         close(fd);
+         if (err != strlen(edge_str[edge])) return PI_BAD_ISR_INIT;
 
+         gpioISR[gpio].edge = edge;
 
-/*-------------------------------------------------------------------------*/
+         if (gpioISR[gpio].pth != NULL)
+            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
+      }
 
-int gpioSerialReadClose(unsigned gpio)
-{
-   DBG(DBG_USER, "gpio=%d", gpio);
+      if (timeout <= 0) timeout = -1;
+      if (gpioISR[gpio].timeout != timeout)
+      {
+         gpioISR[gpio].timeout = timeout;
 
-   CHECK_INITED;
+         if (gpioISR[gpio].pth != NULL)
+            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
+      }
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      gpioISR[gpio].func = f;
+      gpioISR[gpio].ex = user;
+      gpioISR[gpio].userdata = userdata;
 
-   switch(wfRx[gpio].mode)
+      if (gpioISR[gpio].pth == NULL)
+         gpioISR[gpio].pth = gpioStartThread(pthISRThread, &gpioISR[gpio]);
+   }
+   else /* null function, delete ISR, unexport gpio */
    {
-      case PI_WFRX_NONE:
-
-         SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
-
-         break;
-
-      case PI_WFRX_SERIAL:
-
-         free(wfRx[gpio].s.buf);
-
-         gpioSetWatchdog(gpio, 0); /* switch off timeouts */
+      if (gpioISR[gpio].pth) /* delete any existing ISR */
+      {
+         gpioStopThread(gpioISR[gpio].pth);
 
-         gpioSetAlertFunc(gpio, NULL); /* cancel alert */
+         if (gpioISR[gpio].fd >= 0)
+         {
+            close(gpioISR[gpio].fd);
+            gpioISR[gpio].fd = -1;
+         }
 
-         wfRx[gpio].mode = PI_WFRX_NONE;
+         gpioISR[gpio].func = NULL;
+         gpioISR[gpio].pth = NULL;
+      }
 
-         break;
+      if (gpioISR[gpio].inited) /* unexport the gpio */
+      {
+         fd = open("/sys/class/gpio/unexport", O_WRONLY);
+         if (fd < 0) return PI_BAD_ISR_INIT;
+         sprintf(buf, "%d\n", gpio);
+         err = write(fd, buf, strlen(buf));
+         close(fd);
+         if (err != strlen(buf)) return PI_BAD_ISR_INIT;
+         gpioISR[gpio].inited = 0;
+      }
    }
 
    return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-static int intEventSetFunc(
-   unsigned event,
-   void *   f,
-   int      user,
-   void *   userdata)
+int gpioSetISRFunc(
+   unsigned gpio,
+   unsigned edge,
+   int timeout,
+   gpioISRFunc_t f)
 {
-   DBG(DBG_INTERNAL, "event=%d function=%08"PRIXPTR", user=%d, userdata=%08"PRIXPTR,
-      event, (uintptr_t)f, user, (uintptr_t)userdata);
+   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR,
+      gpio, edge, timeout, (uintptr_t)f);
 
-   eventAlert[event].ex = user;
-   eventAlert[event].userdata = userdata;
+   CHECK_INITED;
 
-   eventAlert[event].func = f;
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   return 0;
+   if (edge > EITHER_EDGE)
+      SOFT_ERROR(PI_BAD_EDGE, "bad ISR edge (%d)", edge);
+
+   return intGpioSetISRFunc(gpio, edge, timeout, f, 0, NULL);
 }
 
 
 /* ----------------------------------------------------------------------- */
 
-int eventSetFunc(unsigned event, eventFunc_t f)
+int gpioSetISRFuncEx(
+   unsigned gpio,
+   unsigned edge,
+   int timeout,
+   gpioAlertFuncEx_t f,
+   void *userdata)
 {
-   DBG(DBG_USER, "event=%d function=%08"PRIXPTR, event, (uintptr_t)f);
+   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" userdata=%08"PRIXPTR,
+      gpio, edge, timeout, (uintptr_t)f, (uintptr_t)userdata);
 
    CHECK_INITED;
 
-   if (event > PI_MAX_EVENT)
-      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   intEventSetFunc(event, f, 0, NULL);
+   if (edge > EITHER_EDGE)
+      SOFT_ERROR(PI_BAD_EDGE, "bad ISR edge (%d)", edge);
 
-   return 0;
+   return intGpioSetISRFunc(gpio, edge, timeout, f, 1, userdata);
 }
 
-
-/* ----------------------------------------------------------------------- */
-
-int eventSetFuncEx(unsigned event, eventFuncEx_t f, void *userdata)
+static void closeOrphanedNotifications(int slot, int fd)
 {
-   DBG(DBG_USER, "event=%d function=%08"PRIxPTR" userdata=%08"PRIxPTR,
-      event, (uintptr_t)f, (uintptr_t)userdata);
+   int i;
 
-   CHECK_INITED;
+   /* Check for and close any orphaned notifications. */
 
-   if (event > PI_MAX_EVENT)
-      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if ((i != slot) &&
+          (gpioNotify[i].state >= PI_NOTIFY_OPENED) &&
+          (gpioNotify[i].fd == fd))
+      {
+         DBG(DBG_USER, "closed orphaned fd=%d (handle=%d)", fd, i);
+         gpioNotify[i].state = PI_NOTIFY_CLOSED;
+         intNotifyBits();
+      }
+   }
+}
 
-   intEventSetFunc(event, f, 1, userdata);
+/* ----------------------------------------------------------------------- */
 
-   return 0;
+static void notifyMutex(int lock)
+{
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+   if (lock) pthread_mutex_lock(&mutex);
+   else      pthread_mutex_unlock(&mutex);
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int eventMonitor(unsigned handle, uint32_t bits)
+int gpioNotifyOpenWithSize(int bufSize)
 {
-   DBG(DBG_USER, "handle=%d bits=%08X", handle, bits);
+   int i, slot, fd;
+   char name[32];
+
+   DBG(DBG_USER, "bufSize=%d", bufSize);
 
    CHECK_INITED;
 
-   if (handle >= PI_NOTIFY_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   slot = -1;
 
-   if (gpioNotify[handle].state <= PI_NOTIFY_CLOSING)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   notifyMutex(1);
 
-   gpioNotify[handle].eventBits  = bits;
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (gpioNotify[i].state == PI_NOTIFY_CLOSED)
+      {
+         slot = i;
+         gpioNotify[slot].state = PI_NOTIFY_RESERVED;
+         break;
+      }
+   }
 
-   return 0;
-}
+   notifyMutex(0);
 
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no handle");
 
-/* ----------------------------------------------------------------------- */
+   if (!gpioNotify[slot].ring)
+   {
+      gpioNotify[slot].ring =
+         malloc(NOTIFY_RING_SIZE * sizeof(gpioReport_t));
 
-int eventTrigger(unsigned event)
-{
-   DBG(DBG_USER, "event=%d", event);
+      if (!gpioNotify[slot].ring)
+      {
+         gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+         SOFT_ERROR(PI_NO_MEMORY, "no memory for notify ring");
+      }
+   }
 
-   CHECK_INITED;
+   sprintf(name, "/dev/pigpio%d", slot);
+
+   myCreatePipe(name, 0664);
+
+   fd = open(name, O_RDWR|O_NONBLOCK);
+
+   if (fd < 0)
+   {
+      gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+      SOFT_ERROR(PI_BAD_PATHNAME, "open %s failed (%m)", name);
+   }
+
+   if (bufSize != 0)
+   {
+      i = fcntl(fd, F_SETPIPE_SZ, bufSize);
+      if (i != bufSize)
+      {
+         gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+         SOFT_ERROR(PI_BAD_PATHNAME,
+            "fcntl %s size %d failed (%m)", name, bufSize);
+      }
+   }
+
+   gpioNotify[slot].seqno = 0;
+   gpioNotify[slot].bits  = 0;
+   gpioNotify[slot].fd    = fd;
+   gpioNotify[slot].pipe  = 1;
+   gpioNotify[slot].ringHead = 0;
+   gpioNotify[slot].ringTail = 0;
+   gpioNotify[slot].ringPartial = 0;
+   gpioNotify[slot].dropped = 0;
+   gpioNotify[slot].max_emits  = MAX_EMITS;
+   gpioNotify[slot].lastReportTick = gpioTick();
+   gpioNotify[slot].state = PI_NOTIFY_OPENED;
 
-   if (event > PI_MAX_EVENT)
-      SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+   intNotifyBits();
 
-   eventAlert[event].fired = 1;
+   closeOrphanedNotifications(slot, fd);
 
-   return 0;
+   return slot;
 }
 
+int gpioNotifyOpen(void)
+{
+   return gpioNotifyOpenWithSize(0);
+}
 
 /* ----------------------------------------------------------------------- */
 
-static int intGpioSetAlertFunc(
-   unsigned gpio,
-   void *   f,
-   int      user,
-   void *   userdata)
-{
-   DBG(DBG_INTERNAL, "gpio=%d function=%08"PRIXPTR", user=%d, userdata=%08"PRIXPTR,
-      gpio, (uintptr_t)f, user, (uintptr_t)userdata);
+/*
+   Shared memory is created readable and writable only by its owner.
+   When it is opened for a socket client it is given to the user at
+   the other end of a Unix domain socket.  For any other client it
+   stays with the daemon's user.
+*/
 
-   gpioAlert[gpio].ex = user;
-   gpioAlert[gpio].userdata = userdata;
+static void shmGiveToPeer(int fd, int owner)
+{
+   struct ucred cred;
+   socklen_t len;
 
-   gpioAlert[gpio].func = f;
+   len = sizeof(cred);
 
-   if (f)
-   {
-      alertBits |= BIT;
-   }
-   else
+   if ((owner >= 0) &&
+       !getsockopt(owner, SOL_SOCKET, SO_PEERCRED, &cred, &len) &&
+       (cred.pid > 0))
    {
-      alertBits &= ~BIT;
+      if (fchown(fd, cred.uid, cred.gid))
+         DBG(DBG_ALWAYS, "fchown shm to %d failed (%m)", cred.uid);
    }
-
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
-
-   return 0;
 }
 
-/* ----------------------------------------------------------------------- */
-
-int gpioSetAlertFunc(unsigned gpio, gpioAlertFunc_t f)
+static int intNotifyOpenShm(int owner, unsigned reports)
 {
-   DBG(DBG_USER, "gpio=%d function=%08"PRIXPTR, gpio, (uintptr_t)f);
+   int i, slot, fd;
+   char name[32];
+   size_t len;
+   gpioNotifyShm_t *shm;
 
-   CHECK_INITED;
+   if (!reports) reports = PI_NOTIFY_SHM_DEFAULT;
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if ((reports < PI_NOTIFY_SHM_MIN) || (reports > PI_NOTIFY_SHM_MAX) ||
+       (reports & (reports - 1)))
+      SOFT_ERROR(PI_BAD_NOTIFY_SIZE, "bad reports (%d)", reports);
 
-   intGpioSetAlertFunc(gpio, f, 0, NULL);
+   slot = -1;
 
-   return 0;
-}
+   notifyMutex(1);
 
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (gpioNotify[i].state == PI_NOTIFY_CLOSED)
+      {
+         slot = i;
+         gpioNotify[slot].state = PI_NOTIFY_RESERVED;
+         break;
+      }
+   }
 
-/* ----------------------------------------------------------------------- */
+   notifyMutex(0);
 
-int gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void *userdata)
-{
-   DBG(DBG_USER, "gpio=%d function=%08"PRIXPTR" userdata=%08"PRIXPTR,
-      gpio, (uintptr_t)f, (uintptr_t)userdata);
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no handle");
 
-   CHECK_INITED;
+   sprintf(name, "/pigpio%d", slot);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   len = sizeof(gpioNotifyShm_t) + (reports * sizeof(gpioReport_t));
 
-   intGpioSetAlertFunc(gpio, f, 1, userdata);
+   shm_unlink(name);
 
-   return 0;
-}
+   fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
 
-static void *pthISRThread(void *x)
-{
-   gpioISR_t *isr = x;
-   int fd;
-   int retval;
-   uint32_t tick;
-   int level;
-   uint32_t levels;
-   struct pollfd pfd;
-   char buf[64];
+   if (fd < 0)
+   {
+      gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+      SOFT_ERROR(PI_NO_MEMORY, "shm_open %s failed (%m)", name);
+   }
 
-   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d f=%"PRIxPTR" u=%d data=%"PRIxPTR,
-      isr->gpio, isr->edge, isr->timeout, (uintptr_t)isr->func,
-      isr->ex, (uintptr_t)isr->userdata);
+   /* the reader needs write access for tail and waiting */
 
-   sprintf(buf, "/sys/class/gpio/gpio%d/value", isr->gpio);
+   shmGiveToPeer(fd, owner);
 
-   isr->fd = -1; /* no fd assigned */
+   shm = MAP_FAILED;
 
-   if ((fd = open(buf, O_RDONLY)) < 0)
+   if (!ftruncate(fd, len))
+      shm = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+   close(fd);
+
+   if (shm == MAP_FAILED)
    {
-      DBG(DBG_ALWAYS, "gpio %d not exported", isr->gpio);
-      return NULL;
+      shm_unlink(name);
+      gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+      SOFT_ERROR(PI_NO_MEMORY, "mmap %s failed (%m)", name);
    }
 
-   isr->fd = fd; /* store fd so it can be closed */
+   shm->size    = reports;
+   shm->head    = 0;
+   shm->tail    = 0;
+   shm->futex   = 0;
+   shm->waiting = 0;
+   __atomic_store_n(&shm->magic, PI_NOTIFY_SHM_MAGIC, __ATOMIC_RELEASE);
 
-   pfd.fd = fd;
+   gpioNotify[slot].seqno = 0;
+   gpioNotify[slot].bits  = 0;
+   gpioNotify[slot].fd    = -1;
+   gpioNotify[slot].pipe  = 0;
+   gpioNotify[slot].dropped = 0;
+   gpioNotify[slot].shm   = shm;
+   gpioNotify[slot].lastReportTick = gpioTick();
+   gpioNotify[slot].state = PI_NOTIFY_OPENED;
 
-   pfd.events = POLLPRI;
+   intNotifyBits();
 
-   lseek(fd, 0, SEEK_SET);    /* consume any prior interrupt */
-   if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+   return slot;
+}
 
-   while (1)
-   {
-      retval = poll(&pfd, 1, isr->timeout); /* wait for interrupt */
+int gpioNotifyOpenShm(unsigned reports)
+{
+   DBG(DBG_USER, "reports=%d", reports);
 
-      tick = systReg[SYST_CLO];
+   CHECK_INITED;
 
-      levels = *(gpioReg + GPLEV0);
+   return intNotifyOpenShm(-1, reports);
+}
 
-      if (retval >= 0)
+/* ----------------------------------------------------------------------- */
+
+/*
+   A shared memory command region is a single producer, single consumer
+   ring of requests.  The client fills slots and advances head, a thread
+   per region runs each request through myDoCommand, which applies the
+   same permission checks as the socket and pipe interfaces, and then
+   advances done.  When idle the thread spins briefly before sleeping
+   on head.
+*/
+
+static void cmdShmValidInit(void)
+{
+   int cmd;
+
+   for (cmd=0; cmd<CMD_SHM_CMDS; cmd++)
+   {
+      switch (cmdVerifyType(cmd))
       {
-         lseek(fd, 0, SEEK_SET);    /* consume interrupt */
-         if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+         /* no extension */
+
+         case 101:
+         case 111:
+         case 112:
+         case 121:
+         case 122:
+         case 125:
+         case 126:
+            break;
 
-         if (retval)
-         {
-            if (levels & (1<<isr->gpio)) level = PI_ON; else level = PI_OFF;
-         }
-         else level = PI_TIMEOUT;
+         default:
+            continue;
+      }
 
-         if (isr->ex) (isr->func)(isr->gpio, level, tick, isr->userdata);
-         else         (isr->func)(isr->gpio, level, tick);
+      switch (cmd)
+      {
+         case PI_CMD_NOIB:
+         case PI_CMD_BATCH:
+         case PI_CMD_SHMC:
+         case PI_CMD_SHMO:
+            break;
+
+         default:
+            if (!sockReplyHasExt(cmd)) cmdShmValid[cmd] = 1;
       }
    }
+}
 
-   return NULL;
+static int cmdShmRun(gpioCommandSlot_t *slot)
+{
+   uintptr_t p[10];
+   char buf[16];
+
+   if ((slot->cmd >= CMD_SHM_CMDS) || (!cmdShmValid[slot->cmd]))
+      return PI_BAD_SHM_CMD;
+
+   p[0] = slot->cmd;
+   p[1] = slot->p1;
+   p[2] = slot->p2;
+   p[3] = 0;
+
+   buf[0] = 0;
+
+   return myDoCommand(p, sizeof(buf)-1, buf);
 }
 
+static void cmdShmMutex(int lock)
+{
+   if (lock) pthread_mutex_lock(&cmdShmLock);
+   else      pthread_mutex_unlock(&cmdShmLock);
+}
 
-/* ----------------------------------------------------------------------- */
+static void cmdShmRelease(int handle);
 
-static int intGpioSetISRFunc(
-   unsigned gpio,
-   unsigned edge,
-   int timeout,
-   void *f,
-   int user,
-   void *userdata)
+static void *pthCmdShmThread(void *x)
 {
-   char buf[64];
+   cmdShmInfo_t *cs;
+   gpioCommandShm_t *shm;
+   uint32_t head, done, mask;
+   uint64_t spin, spinEnd;
+   struct timespec ts;
 
-   char *edge_str[]={"rising\n", "falling\n", "both\n"};
-   int fd;
-   int err;
+   cs  = x;
+   shm = cs->shm;
 
-   DBG(DBG_INTERNAL,
-      "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
-      gpio, edge, timeout, (uintptr_t)f, user, (uintptr_t)userdata);
+   /* spinning only helps if the client can run at the same time */
 
-   if (f)
-   {
-      if (!gpioISR[gpio].inited) /* export gpio if unexported */
-      {
-         fd = open("/sys/class/gpio/export", O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+   spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? CMD_SHM_SPIN_NS : 0;
 
-         /* ignore write fail if already exported */
-         sprintf(buf, "%d\n", gpio);
-         err = write(fd, buf, strlen(buf));
-         close(fd);
+   mask = shm->size - 1;
+   done = 0;
+   spinEnd = 0;
 
-         sprintf(buf, "/sys/class/gpio/gpio%d/direction", gpio);
-         fd = open(buf, O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+   while (!cs->stop)
+   {
+      head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
 
-         err = write(fd, "in\n", 3);
-         close(fd);
-         if (err != 3) return PI_BAD_ISR_INIT;
+      if (head != done)
+      {
+         /* a client which overruns the ring loses the oldest requests */
 
-         gpioISR[gpio].gpio = gpio;
-         gpioISR[gpio].edge = -1;
-         gpioISR[gpio].timeout = -1;
+         if ((head - done) > shm->size) done = head - shm->size;
 
-         gpioISR[gpio].inited = 1;
-      }
+         shm->slot[done & mask].res = cmdShmRun(&shm->slot[done & mask]);
 
-      if (gpioISR[gpio].edge != edge)
-      {
-         sprintf(buf, "/sys/class/gpio/gpio%d/edge", gpio);
-         fd = open(buf, O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+         __atomic_store_n(&shm->done, ++done, __ATOMIC_SEQ_CST);
 
-         err = write(fd, edge_str[edge], strlen(edge_str[edge]));
-         close(fd);
-         if (err != strlen(edge_str[edge])) return PI_BAD_ISR_INIT;
+         if (__atomic_load_n(&shm->resWaiting, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &shm->done, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 
-         gpioISR[gpio].edge = edge;
+         spinEnd = 0;
 
-         if (gpioISR[gpio].pth != NULL)
-            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
+         continue;
       }
 
-      if (timeout <= 0) timeout = -1;
-      if (gpioISR[gpio].timeout != timeout)
-      {
-         gpioISR[gpio].timeout = timeout;
+      if (!spinEnd) spinEnd = timerNanos() + spin;
 
-         if (gpioISR[gpio].pth != NULL)
-            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
+      if (timerNanos() < spinEnd)
+      {
+         sched_yield();
+         continue;
       }
 
-      gpioISR[gpio].func = f;
-      gpioISR[gpio].ex = user;
-      gpioISR[gpio].userdata = userdata;
+      __atomic_store_n(&shm->reqWaiting, 1, __ATOMIC_SEQ_CST);
 
-      if (gpioISR[gpio].pth == NULL)
-         gpioISR[gpio].pth = gpioStartThread(pthISRThread, &gpioISR[gpio]);
-   }
-   else /* null function, delete ISR, unexport gpio */
-   {
-      if (gpioISR[gpio].pth) /* delete any existing ISR */
+      if (__atomic_load_n(&shm->head, __ATOMIC_SEQ_CST) == done)
       {
-         gpioStopThread(gpioISR[gpio].pth);
+         /* the timeout covers a stop request racing the wait */
 
-         if (gpioISR[gpio].fd >= 0)
-         {
-            close(gpioISR[gpio].fd);
-            gpioISR[gpio].fd = -1;
-         }
+         ts.tv_sec  = 0;
+         ts.tv_nsec = CMD_SHM_WAIT_NS;
 
-         gpioISR[gpio].func = NULL;
-         gpioISR[gpio].pth = NULL;
+         syscall(SYS_futex, &shm->head, FUTEX_WAIT, done, &ts, NULL, 0);
       }
 
-      if (gpioISR[gpio].inited) /* unexport the gpio */
-      {
-         fd = open("/sys/class/gpio/unexport", O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
-         sprintf(buf, "%d\n", gpio);
-         err = write(fd, buf, strlen(buf));
-         close(fd);
-         if (err != strlen(buf)) return PI_BAD_ISR_INIT;
-         gpioISR[gpio].inited = 0;
-      }
+      __atomic_store_n(&shm->reqWaiting, 0, __ATOMIC_SEQ_CST);
+
+      spinEnd = 0;
    }
 
-   return 0;
+   if (__atomic_load_n(&cs->detached, __ATOMIC_ACQUIRE))
+   {
+      cmdShmMutex(1);
+      cmdShmRelease(cs - cmdShm);
+      if (!--cmdShmClosing) pthread_cond_broadcast(&cmdShmCond);
+      cmdShmMutex(0);
+   }
+
+   return NULL;
 }
 
-/* ----------------------------------------------------------------------- */
+/* called with cmdShmMutex held */
 
-int gpioSetISRFunc(
-   unsigned gpio,
-   unsigned edge,
-   int timeout,
-   gpioISRFunc_t f)
+static void cmdShmRelease(int handle)
 {
-   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR,
-      gpio, edge, timeout, (uintptr_t)f);
+   gpioCommandShm_t *shm;
+
+   shm = cmdShm[handle].shm;
+
+   __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+
+   munmap(shm, cmdShm[handle].len);
+
+   cmdShm[handle].shm   = NULL;
+   cmdShm[handle].state = PI_CMD_SHM_CLOSED;
+}
 
-   CHECK_INITED;
+/* called with cmdShmMutex held */
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+static void cmdShmClose(int handle, int wait)
+{
+   char name[32];
 
-   if (edge > EITHER_EDGE)
-      SOFT_ERROR(PI_BAD_EDGE, "bad ISR edge (%d)", edge);
+   DBG(DBG_INTERNAL, "close command shm %d", handle);
 
-   return intGpioSetISRFunc(gpio, edge, timeout, f, 0, NULL);
-}
+   /* the name goes at once so no new client can find the ring */
 
+   sprintf(name, "/pigpiocmd%d", handle);
 
-/* ----------------------------------------------------------------------- */
+   shm_unlink(name);
 
-int gpioSetISRFuncEx(
-   unsigned gpio,
-   unsigned edge,
-   int timeout,
-   gpioAlertFuncEx_t f,
-   void *userdata)
-{
-   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" userdata=%08"PRIXPTR,
-      gpio, edge, timeout, (uintptr_t)f, (uintptr_t)userdata);
+   /*
+      The thread may be in a long MILS or MICS.  Unless terminating
+      don't wait for it, it releases the ring itself when it stops.
+   */
 
-   CHECK_INITED;
+   if (!wait)
+   {
+      cmdShm[handle].state = PI_CMD_SHM_CLOSING;
+      cmdShmClosing++;
+      __atomic_store_n(&cmdShm[handle].detached, 1, __ATOMIC_SEQ_CST);
+   }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   __atomic_store_n(&cmdShm[handle].stop, 1, __ATOMIC_SEQ_CST);
 
-   if (edge > EITHER_EDGE)
-      SOFT_ERROR(PI_BAD_EDGE, "bad ISR edge (%d)", edge);
+   syscall(SYS_futex, &cmdShm[handle].shm->head,
+      FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
 
-   return intGpioSetISRFunc(gpio, edge, timeout, f, 1, userdata);
+   if (wait)
+   {
+      pthread_join(cmdShm[handle].thread, NULL);
+
+      cmdShmRelease(handle);
+   }
+   else pthread_detach(cmdShm[handle].thread);
 }
 
-static void closeOrphanedNotifications(int slot, int fd)
+static void closeOrphanedCommandShm(int fd)
 {
    int i;
 
-   /* Check for and close any orphaned notifications. */
+   cmdShmMutex(1);
 
-   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   for (i=0; i<PI_COMMAND_SHM_SLOTS; i++)
    {
-      if ((i != slot) &&
-          (gpioNotify[i].state >= PI_NOTIFY_OPENED) &&
-          (gpioNotify[i].fd == fd))
+      if ((cmdShm[i].state == PI_CMD_SHM_OPENED) &&
+          ((fd < 0) || (cmdShm[i].fd == fd)))
       {
-         DBG(DBG_USER, "closed orphaned fd=%d (handle=%d)", fd, i);
-         gpioNotify[i].state = PI_NOTIFY_CLOSED;
-         intNotifyBits();
+         DBG(DBG_USER, "closed orphaned command shm fd=%d (handle=%d)",
+            fd, i);
+         cmdShmClose(i, fd < 0);
       }
    }
-}
 
-/* ----------------------------------------------------------------------- */
+   /* at terminate also wait for rings closed earlier to be released */
 
-static void notifyMutex(int lock)
-{
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-   if (lock) pthread_mutex_lock(&mutex);
-   else      pthread_mutex_unlock(&mutex);
-}
+   if (fd < 0)
+   {
+      while (cmdShmClosing) pthread_cond_wait(&cmdShmCond, &cmdShmLock);
+   }
 
-/* ----------------------------------------------------------------------- */
+   cmdShmMutex(0);
+}
 
-int gpioNotifyOpenWithSize(int bufSize)
+static int intCommandOpenShm(int owner, unsigned slots)
 {
+   static pthread_once_t validOnce = PTHREAD_ONCE_INIT;
    int i, slot, fd;
    char name[32];
+   size_t len;
+   gpioCommandShm_t *shm;
 
-   DBG(DBG_USER, "bufSize=%d", bufSize);
+   if (!slots) slots = PI_COMMAND_SHM_DEFAULT;
 
-   CHECK_INITED;
+   if ((slots < PI_COMMAND_SHM_MIN) || (slots > PI_COMMAND_SHM_MAX) ||
+       (slots & (slots - 1)))
+      SOFT_ERROR(PI_BAD_SHM_SLOTS, "bad slots (%d)", slots);
+
+   pthread_once(&validOnce, cmdShmValidInit);
 
    slot = -1;
 
-   notifyMutex(1);
+   cmdShmMutex(1);
 
-   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   for (i=0; i<PI_COMMAND_SHM_SLOTS; i++)
    {
-      if (gpioNotify[i].state == PI_NOTIFY_CLOSED)
+      if (cmdShm[i].state == PI_CMD_SHM_CLOSED)
       {
          slot = i;
-         gpioNotify[slot].state = PI_NOTIFY_RESERVED;
+         cmdShm[slot].state = PI_CMD_SHM_RESERVED;
          break;
       }
    }
 
-   notifyMutex(0);
+   cmdShmMutex(0);
 
    if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no handle");
 
-   sprintf(name, "/dev/pigpio%d", slot);
+   sprintf(name, "/pigpiocmd%d", slot);
 
-   myCreatePipe(name, 0664);
+   len = sizeof(gpioCommandShm_t) + (slots * sizeof(gpioCommandSlot_t));
 
-   fd = open(name, O_RDWR|O_NONBLOCK);
+   shm_unlink(name);
+
+   fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
 
    if (fd < 0)
    {
-      gpioNotify[slot].state = PI_NOTIFY_CLOSED;
-      SOFT_ERROR(PI_BAD_PATHNAME, "open %s failed (%m)", name);
+      cmdShm[slot].state = PI_CMD_SHM_CLOSED;
+      SOFT_ERROR(PI_NO_MEMORY, "shm_open %s failed (%m)", name);
    }
 
-   if (bufSize != 0)
+   /* only the client which asked may queue requests */
+
+   shmGiveToPeer(fd, owner);
+
+   shm = MAP_FAILED;
+
+   if (!ftruncate(fd, len))
+      shm = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+   close(fd);
+
+   if (shm == MAP_FAILED)
    {
-      i = fcntl(fd, F_SETPIPE_SZ, bufSize);
-      if (i != bufSize)
-      {
-         gpioNotify[slot].state = PI_NOTIFY_CLOSED;
-         SOFT_ERROR(PI_BAD_PATHNAME,
-            "fcntl %s size %d failed (%m)", name, bufSize);
-      }
+      shm_unlink(name);
+      cmdShm[slot].state = PI_CMD_SHM_CLOSED;
+      SOFT_ERROR(PI_NO_MEMORY, "mmap %s failed (%m)", name);
    }
 
-   gpioNotify[slot].seqno = 0;
-   gpioNotify[slot].bits  = 0;
-   gpioNotify[slot].fd    = fd;
-   gpioNotify[slot].pipe  = 1;
-   gpioNotify[slot].max_emits  = MAX_EMITS;
-   gpioNotify[slot].lastReportTick = gpioTick();
-   gpioNotify[i].state = PI_NOTIFY_OPENED;
+   shm->size       = slots;
+   shm->head       = 0;
+   shm->done       = 0;
+   shm->reqWaiting = 0;
+   shm->resWaiting = 0;
 
-   closeOrphanedNotifications(slot, fd);
+   cmdShm[slot].fd   = owner;
+   cmdShm[slot].stop = 0;
+   cmdShm[slot].detached = 0;
+   cmdShm[slot].len  = len;
+   cmdShm[slot].shm  = shm;
+
+   if (pthread_create(&cmdShm[slot].thread, NULL, pthCmdShmThread,
+      &cmdShm[slot]))
+   {
+      munmap(shm, len);
+      shm_unlink(name);
+      cmdShm[slot].shm   = NULL;
+      cmdShm[slot].state = PI_CMD_SHM_CLOSED;
+      SOFT_ERROR(PI_NO_MEMORY, "command shm pthread_create failed (%m)");
+   }
+
+   __atomic_store_n(&shm->magic, PI_COMMAND_SHM_MAGIC, __ATOMIC_RELEASE);
+
+   cmdShm[slot].state = PI_CMD_SHM_OPENED;
 
    return slot;
 }
 
-int gpioNotifyOpen(void)
+int gpioCommandOpenShm(unsigned slots)
 {
-   return gpioNotifyOpenWithSize(0);
+   DBG(DBG_USER, "slots=%d", slots);
+
+   CHECK_INITED;
+
+   return intCommandOpenShm(-1, slots);
+}
+
+int gpioCommandCloseShm(unsigned handle)
+{
+   DBG(DBG_USER, "handle=%d", handle);
+
+   CHECK_INITED;
+
+   if (handle >= PI_COMMAND_SHM_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   cmdShmMutex(1);
+
+   if (cmdShm[handle].state != PI_CMD_SHM_OPENED)
+   {
+      cmdShmMutex(0);
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   }
+
+   cmdShmClose(handle, 0);
+
+   cmdShmMutex(0);
+
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -12096,14 +16957,32 @@ static int gpioNotifyOpenInBand(int fd)
 
    if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no handle");
 
+   if (!gpioNotify[slot].ring)
+   {
+      gpioNotify[slot].ring =
+         malloc(NOTIFY_RING_SIZE * sizeof(gpioReport_t));
+
+      if (!gpioNotify[slot].ring)
+      {
+         gpioNotify[slot].state = PI_NOTIFY_CLOSED;
+         SOFT_ERROR(PI_NO_MEMORY, "no memory for notify ring");
+      }
+   }
+
    gpioNotify[slot].seqno = 0;
    gpioNotify[slot].bits  = 0;
    gpioNotify[slot].fd    = fd;
    gpioNotify[slot].pipe  = 0;
+   gpioNotify[slot].ringHead = 0;
+   gpioNotify[slot].ringTail = 0;
+   gpioNotify[slot].ringPartial = 0;
+   gpioNotify[slot].dropped = 0;
    gpioNotify[slot].max_emits  = MAX_EMITS;
    gpioNotify[slot].lastReportTick = gpioTick();
    gpioNotify[slot].state = PI_NOTIFY_OPENED;
 
+   intNotifyBits();
+
    closeOrphanedNotifications(slot, fd);
 
    return slot;
@@ -12112,21 +16991,49 @@ static int gpioNotifyOpenInBand(int fd)
 
 /* ----------------------------------------------------------------------- */
 
+static void intSlotMap(volatile uint32_t *map, uint32_t *bits, int count)
+{
+   int i, b;
+   uint32_t slots[32], v;
+
+   memset(slots, 0, sizeof(slots));
+
+   for (i=0; i<count; i++)
+   {
+      v = bits[i];
+
+      while (v)
+      {
+         b = __builtin_ctz(v);
+         v &= (v - 1);
+         slots[b] |= (1u<<i);
+      }
+   }
+
+   for (b=0; b<32; b++) map[b] = slots[b];
+}
+
 static void intScriptBits(void)
 {
    int i;
    uint32_t bits;
+   uint32_t waitBits[PI_MAX_SCRIPTS];
 
    bits = 0;
 
    for (i=0; i<PI_MAX_SCRIPTS; i++)
    {
+      waitBits[i] = 0;
+
       if (gpioScript[i].state == PI_SCRIPT_IN_USE)
       {
-         bits |= gpioScript[i].waitBits;
+         waitBits[i] = gpioScript[i].waitBits;
+         bits |= waitBits[i];
       }
    }
 
+   intSlotMap(scriptGpioSlots, waitBits, PI_MAX_SCRIPTS);
+
    scriptBits = bits;
 
    monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
@@ -12137,17 +17044,23 @@ static void intScriptEventBits(void)
 {
    int i;
    uint32_t bits;
+   uint32_t eventBits[PI_MAX_SCRIPTS];
 
    bits = 0;
 
    for (i=0; i<PI_MAX_SCRIPTS; i++)
    {
+      eventBits[i] = 0;
+
       if (gpioScript[i].state == PI_SCRIPT_IN_USE)
       {
-         bits |= gpioScript[i].eventBits;
+         eventBits[i] = gpioScript[i].eventBits;
+         bits |= eventBits[i];
       }
    }
 
+   intSlotMap(scriptEventSlots, eventBits, PI_MAX_SCRIPTS);
+
    scriptEventBits = bits;
 }
 
@@ -12155,18 +17068,36 @@ static void intScriptEventBits(void)
 static void intNotifyBits(void)
 {
    int i;
-   uint32_t bits;
+   uint32_t bits, open;
+   uint32_t gpioBits[PI_NOTIFY_SLOTS];
+   uint32_t eventBits[PI_NOTIFY_SLOTS];
 
    bits = 0;
+   open = 0;
 
    for (i=0; i<PI_NOTIFY_SLOTS; i++)
    {
+      gpioBits[i] = 0;
+      eventBits[i] = 0;
+
+      if (gpioNotify[i].state >= PI_NOTIFY_CLOSING) open |= (1u<<i);
+
+      if (gpioNotify[i].state >= PI_NOTIFY_OPENED)
+      {
+         eventBits[i] = gpioNotify[i].eventBits;
+      }
+
       if (gpioNotify[i].state == PI_NOTIFY_RUNNING)
       {
-         bits |= gpioNotify[i].bits;
+         gpioBits[i] = gpioNotify[i].bits;
+         bits |= gpioBits[i];
       }
    }
 
+   intSlotMap(notifyGpioSlots, gpioBits, PI_NOTIFY_SLOTS);
+   intSlotMap(notifyEventSlots, eventBits, PI_NOTIFY_SLOTS);
+
+   notifyOpenSlots = open;
    notifyBits = bits;
 
    monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
@@ -12245,7 +17176,8 @@ int gpioNotifyClose(unsigned handle)
 
    if (gpioCfg.ifFlags & PI_DISABLE_ALERT)
    {
-      if (gpioNotify[handle].pipe)
+      if (gpioNotify[handle].shm) notifyShmClose(handle);
+      else if (gpioNotify[handle].pipe)
       {
          DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[handle].fd);
          close(gpioNotify[handle].fd);
@@ -12259,7 +17191,7 @@ int gpioNotifyClose(unsigned handle)
    }
    else
    {
-      /* actual close done in alert thread */
+      /* actual close done in notify writer thread */
    }
 
    return 0;
@@ -12283,13 +17215,17 @@ int gpioTrigger(unsigned gpio, unsigned pulseLen, unsigned level)
       SOFT_ERROR(PI_BAD_PULSELEN,
          "gpio %d, bad pulseLen (%d)", gpio, pulseLen);
 
-   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   if (level == PI_OFF) myGpioOut(GPCLR0 + BANK, BIT);
+   else                 myGpioOut(GPSET0 + BANK, BIT);
+
+   if (pthSimRunning) simGpioUpdate();
 
    myGpioDelay(pulseLen);
 
-   if (level != PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   if (level != PI_OFF) myGpioOut(GPCLR0 + BANK, BIT);
+   else                 myGpioOut(GPSET0 + BANK, BIT);
+
+   if (pthSimRunning) simGpioUpdate();
 
    return 0;
 }
@@ -12374,164 +17310,309 @@ int gpioGlitchFilter(unsigned gpio, unsigned steady)
    if (steady) gFilterBits |= (1<<gpio);
    else        gFilterBits &= (~(1<<gpio));
 
-   return 0;
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSetGetSamplesFunc(gpioGetSamplesFunc_t f, uint32_t bits)
+{
+   DBG(DBG_USER, "function=%08"PRIXPTR" bits=%08X", (uintptr_t)f, bits);
+
+   CHECK_INITED;
+
+   gpioGetSamples.ex       = 0;
+   gpioGetSamples.userdata = NULL;
+   gpioGetSamples.func     = f;
+
+   if (f) gpioGetSamples.bits = bits;
+   else   gpioGetSamples.bits = 0;
+
+   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f,
+                            uint32_t bits,
+                            void * userdata)
+{
+   DBG(DBG_USER, "function=%08"PRIXPTR" bits=%08X", (uintptr_t)f, bits);
+
+   CHECK_INITED;
+
+   gpioGetSamples.ex       = 1;
+   gpioGetSamples.userdata = userdata;
+   gpioGetSamples.func     = f;
+
+   if (f) gpioGetSamples.bits = bits;
+   else   gpioGetSamples.bits = 0;
+
+   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+static int timerSchedule(unsigned id,
+                         unsigned micros,
+                         void *f,
+                         int user,
+                         void *userdata)
+{
+   /* must be called with timerMutex held */
+
+   pthread_attr_t pthAttr;
+   pthread_condattr_t condAttr;
+   gpioTimer_t *tp;
+
+   if (pthTimerRunning == PI_THREAD_NONE)
+   {
+      pthread_condattr_init(&condAttr);
+      pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+      pthread_cond_init(&timerCond, &condAttr);
+      pthread_condattr_destroy(&condAttr);
+
+      if (pthread_attr_init(&pthAttr))
+         SOFT_ERROR(PI_TIMER_FAILED,
+            "pthread_attr_init failed (%m)");
+
+      if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+         SOFT_ERROR(PI_TIMER_FAILED,
+            "pthread_attr_setstacksize failed (%m)");
+
+      if (pthread_create(&pthTimer, &pthAttr, pthTimerThread, NULL))
+         SOFT_ERROR(PI_TIMER_FAILED, "timer thread create failed (%m)");
+
+      pthTimerRunning = PI_THREAD_RUNNING;
+   }
+
+   tp = &gpioTimer[id];
+
+   if (!tp->running)
+   {
+      tp->calls    = 0;
+      tp->missed   = 0;
+      tp->lateMin  = 0;
+      tp->lateMax  = 0;
+      tp->lateSum  = 0;
+      tp->lateLast = 0;
+
+      tp->heapPos  = timerHeapLen++;
+      timerHeap[tp->heapPos] = id;
+   }
+
+   tp->id       = id;
+   tp->func     = f;
+   tp->ex       = user;
+   tp->userdata = userdata;
+   tp->period   = (uint64_t)micros * THOUSAND;
+   tp->due      = timerNanos() + tp->period;
+   tp->running  = 1;
+
+   timerHeapUp(tp->heapPos);
+   timerHeapDown(tp->heapPos);
+
+   pthread_cond_signal(&timerCond);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void timerCancel(unsigned id)
+{
+   /* must be called with timerMutex held */
+
+   if (!gpioTimer[id].running) return;
+
+   timerHeapRemove(id);
+
+   gpioTimer[id].running = 0;
+
+   /* a callback may cancel its own timer, otherwise let it finish */
+
+   if ((pthTimerRunning != PI_THREAD_NONE) &&
+       !pthread_equal(pthread_self(), pthTimer))
+   {
+      while (timerActive == id)
+         pthread_cond_wait(&timerDone, &timerMutex);
+   }
+
+   gpioTimer[id].func = NULL;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int intGpioSetTimerFunc(unsigned id,
+                               unsigned millis,
+                               void *f,
+                               int user,
+                               void *userdata)
+{
+   int status;
+
+   DBG(DBG_INTERNAL, "id=%d millis=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
+      id, millis, (uintptr_t)f, user, (uintptr_t)userdata);
+
+   status = 0;
+
+   pthread_mutex_lock(&timerMutex);
+
+   if (f) status = timerSchedule(id, millis * THOUSAND, f, user, userdata);
+   else   timerCancel(id);
+
+   pthread_mutex_unlock(&timerMutex);
+
+   return status;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-int gpioSetGetSamplesFunc(gpioGetSamplesFunc_t f, uint32_t bits)
+int gpioSetTimerFunc(unsigned id, unsigned millis, gpioTimerFunc_t f)
 {
-   DBG(DBG_USER, "function=%08"PRIXPTR" bits=%08X", (uintptr_t)f, bits);
+   DBG(DBG_USER, "id=%d millis=%d function=%08"PRIXPTR, id, millis, (uintptr_t)f);
 
    CHECK_INITED;
 
-   gpioGetSamples.ex       = 0;
-   gpioGetSamples.userdata = NULL;
-   gpioGetSamples.func     = f;
-
-   if (f) gpioGetSamples.bits = bits;
-   else   gpioGetSamples.bits = 0;
+   if (id > PI_MAX_TIMER)
+      SOFT_ERROR(PI_BAD_TIMER, "bad timer id (%d)", id);
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   if (f)
+   {
+      if ((millis < PI_MIN_MS) || (millis > PI_MAX_MS))
+         SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
+   }
 
-   return 0;
+   return intGpioSetTimerFunc(id, millis, f, 0, NULL);
 }
 
 
 /* ----------------------------------------------------------------------- */
 
-int gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f,
-                            uint32_t bits,
-                            void * userdata)
+int gpioSetTimerFuncEx(unsigned id, unsigned millis, gpioTimerFuncEx_t f,
+                       void * userdata)
 {
-   DBG(DBG_USER, "function=%08"PRIXPTR" bits=%08X", (uintptr_t)f, bits);
+   DBG(DBG_USER, "id=%d millis=%d function=%08"PRIXPTR", userdata=%08"PRIXPTR,
+      id, millis, (uintptr_t)f, (uintptr_t)userdata);
 
    CHECK_INITED;
 
-   gpioGetSamples.ex       = 1;
-   gpioGetSamples.userdata = userdata;
-   gpioGetSamples.func     = f;
-
-   if (f) gpioGetSamples.bits = bits;
-   else   gpioGetSamples.bits = 0;
+   if (id > PI_MAX_TIMER)
+      SOFT_ERROR(PI_BAD_TIMER, "bad timer id (%d)", id);
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   if ((millis < PI_MIN_MS) || (millis > PI_MAX_MS))
+      SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
 
-   return 0;
+   return intGpioSetTimerFunc(id, millis, f, 1, userdata);
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-static int intGpioSetTimerFunc(unsigned id,
-                               unsigned millis,
-                               void *f,
-                               int user,
-                               void *userdata)
+int gpioTimerStart(unsigned micros, gpioTimerFuncEx_t f, void *userdata)
 {
-   pthread_attr_t pthAttr;
+   int i, slot, status;
 
-   DBG(DBG_INTERNAL, "id=%d millis=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
-      id, millis, (uintptr_t)f, user, (uintptr_t)userdata);
+   DBG(DBG_USER, "micros=%d function=%08"PRIXPTR", userdata=%08"PRIXPTR,
+      micros, (uintptr_t)f, (uintptr_t)userdata);
 
-   gpioTimer[id].id   = id;
+   CHECK_INITED;
 
-   if (f)
-   {
-      gpioTimer[id].func     = f;
-      gpioTimer[id].ex       = user;
-      gpioTimer[id].userdata = userdata;
-      gpioTimer[id].millis   = millis;
+   if ((micros < PI_MIN_TIMER_MICROS) || (micros > PI_MAX_TIMER_MICROS))
+      SOFT_ERROR(PI_BAD_TIMER_MICROS, "bad micros (%d)", micros);
 
-      if (!gpioTimer[id].running)
-      {
-         if (pthread_attr_init(&pthAttr))
-            SOFT_ERROR(PI_TIMER_FAILED,
-               "pthread_attr_init failed (%m)");
+   if (!f) SOFT_ERROR(PI_TIMER_FAILED, "no function");
 
-         if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
-            SOFT_ERROR(PI_TIMER_FAILED,
-               "pthread_attr_setstacksize failed (%m)");
+   slot   = -1;
+   status = 0;
 
-         if (pthread_create(
-            &gpioTimer[id].pthId, &pthAttr, pthTimerTick, &gpioTimer[id]))
-               SOFT_ERROR(PI_TIMER_FAILED,
-                  "timer %d, create failed (%m)", id);
+   pthread_mutex_lock(&timerMutex);
 
-         gpioTimer[id].running = 1;
-      }
-   }
-   else
+   for (i=PI_MAX_TIMER+1; i<PI_TIMER_SLOTS; i++)
    {
-      if (gpioTimer[id].running)
+      if (!gpioTimer[i].running)
       {
+         slot = i;
+         status = timerSchedule(slot, micros, f, 1, userdata);
+         break;
+      }
+   }
 
-         /* destroy thread */
-
-         if (pthread_self() == gpioTimer[id].pthId)
-         {
-            gpioTimer[id].running = 0;
-            gpioTimer[id].func    = 0;
-            pthread_exit(NULL);
-         }
-         else
-         {
-            if (pthread_cancel(gpioTimer[id].pthId))
-               SOFT_ERROR(PI_TIMER_FAILED, "timer %d, cancel failed (%m)", id);
+   pthread_mutex_unlock(&timerMutex);
 
-            if (pthread_join(gpioTimer[id].pthId, NULL))
-               SOFT_ERROR(PI_TIMER_FAILED, "timer %d, join failed (%m)", id);
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no timer slots");
 
-            gpioTimer[id].running = 0;
-            gpioTimer[id].func    = 0;
-         }
-      }
-   }
+   if (status < 0) return status;
 
-   return 0;
+   return slot;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioSetTimerFunc(unsigned id, unsigned millis, gpioTimerFunc_t f)
+int gpioTimerStop(unsigned handle)
 {
-   DBG(DBG_USER, "id=%d millis=%d function=%08"PRIXPTR, id, millis, (uintptr_t)f);
+   DBG(DBG_USER, "handle=%d", handle);
 
    CHECK_INITED;
 
-   if (id > PI_MAX_TIMER)
-      SOFT_ERROR(PI_BAD_TIMER, "bad timer id (%d)", id);
+   if ((handle <= PI_MAX_TIMER) || (handle >= PI_TIMER_SLOTS))
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (f)
+   pthread_mutex_lock(&timerMutex);
+
+   if (!gpioTimer[handle].running)
    {
-      if ((millis < PI_MIN_MS) || (millis > PI_MAX_MS))
-         SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
+      pthread_mutex_unlock(&timerMutex);
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
    }
 
-   intGpioSetTimerFunc(id, millis, f, 0, NULL);
+   timerCancel(handle);
+
+   pthread_mutex_unlock(&timerMutex);
 
    return 0;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioSetTimerFuncEx(unsigned id, unsigned millis, gpioTimerFuncEx_t f,
-                       void * userdata)
+int gpioTimerJitter(unsigned timer, gpioTimerJitter_t *jitter)
 {
-   DBG(DBG_USER, "id=%d millis=%d function=%08"PRIXPTR", userdata=%08"PRIXPTR,
-      id, millis, (uintptr_t)f, (uintptr_t)userdata);
+   gpioTimer_t *tp;
+
+   DBG(DBG_USER, "timer=%d jitter=%08"PRIXPTR, timer, (uintptr_t)jitter);
 
    CHECK_INITED;
 
-   if (id > PI_MAX_TIMER)
-      SOFT_ERROR(PI_BAD_TIMER, "bad timer id (%d)", id);
+   if (timer >= PI_TIMER_SLOTS)
+      SOFT_ERROR(PI_BAD_TIMER, "bad timer (%d)", timer);
 
-   if ((millis < PI_MIN_MS) || (millis > PI_MAX_MS))
-      SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
+   if (!jitter) SOFT_ERROR(PI_BAD_POINTER, "NULL jitter");
+
+   tp = &gpioTimer[timer];
+
+   pthread_mutex_lock(&timerMutex);
+
+   if (!tp->running)
+   {
+      pthread_mutex_unlock(&timerMutex);
+      SOFT_ERROR(PI_BAD_TIMER, "timer %d not running", timer);
+   }
 
-   intGpioSetTimerFunc(id, millis, f, 1, userdata);
+   jitter->micros   = tp->period / THOUSAND;
+   jitter->calls    = tp->calls;
+   jitter->missed   = tp->missed;
+   jitter->lateMin  = tp->lateMin;
+   jitter->lateMax  = tp->lateMax;
+   jitter->lateMean = tp->calls ? tp->lateSum / tp->calls : 0;
+   jitter->lateLast = tp->lateLast;
+
+   pthread_mutex_unlock(&timerMutex);
 
    return 0;
 }
@@ -12630,6 +17711,8 @@ int gpioStoreScript(char *script)
 
    status = cmdParseScript(script, &s->script, 0);
 
+   if (status == 0) status = scrCompile(s);
+
    if (status == 0)
    {
       s->request   = PI_SCRIPT_HALT;
@@ -12650,6 +17733,8 @@ int gpioStoreScript(char *script)
    {
       if (s->script.par) free(s->script.par);
       s->script.par = NULL;
+      if (s->code) free(s->code);
+      s->code = NULL;
       gpioScript[slot].state = PI_SCRIPT_FREE;
    }
 
@@ -12830,6 +17915,10 @@ int gpioDeleteScript(unsigned script_id)
 
       gpioScript[script_id].script.par = NULL;
 
+      if (gpioScript[script_id].code) free(gpioScript[script_id].code);
+
+      gpioScript[script_id].code = NULL;
+
       gpioScript[script_id].state = PI_SCRIPT_FREE;
 
       return 0;
@@ -12889,6 +17978,8 @@ uint32_t gpioRead_Bits_0_31(void)
 
    CHECK_INITED;
 
+   if (pthSimRunning) simGpioUpdate();
+
    return (*(gpioReg + GPLEV0));
 }
 
@@ -12901,6 +17992,8 @@ uint32_t gpioRead_Bits_32_53(void)
 
    CHECK_INITED;
 
+   if (pthSimRunning) simGpioUpdate();
+
    return (*(gpioReg + GPLEV1));
 }
 
@@ -12913,7 +18006,9 @@ int gpioWrite_Bits_0_31_Clear(uint32_t bits)
 
    CHECK_INITED;
 
-   *(gpioReg + GPCLR0) = bits;
+   myGpioOut(GPCLR0, bits);
+
+   if (pthSimRunning) simGpioUpdate();
 
    return 0;
 }
@@ -12927,7 +18022,9 @@ int gpioWrite_Bits_32_53_Clear(uint32_t bits)
 
    CHECK_INITED;
 
-   *(gpioReg + GPCLR1) = bits;
+   myGpioOut(GPCLR1, bits);
+
+   if (pthSimRunning) simGpioUpdate();
 
    return 0;
 }
@@ -12941,7 +18038,9 @@ int gpioWrite_Bits_0_31_Set(uint32_t bits)
 
    CHECK_INITED;
 
-   *(gpioReg + GPSET0) = bits;
+   myGpioOut(GPSET0, bits);
+
+   if (pthSimRunning) simGpioUpdate();
 
    return 0;
 }
@@ -12955,7 +18054,201 @@ int gpioWrite_Bits_32_53_Set(uint32_t bits)
 
    CHECK_INITED;
 
-   *(gpioReg + GPSET1) = bits;
+   myGpioOut(GPSET1, bits);
+
+   if (pthSimRunning) simGpioUpdate();
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSnapshot(gpioStatus_t *status)
+{
+   int gpio, pwm, clock;
+   uint32_t level[2], pull;
+
+   DBG(DBG_USER, "status=%08"PRIXPTR, (uintptr_t)status);
+
+   CHECK_INITED;
+
+   if (pthSimRunning) simGpioUpdate();
+
+   level[0] = *(gpioReg + GPLEV0);
+   level[1] = *(gpioReg + GPLEV1);
+
+   memset(status, 0, (PI_MAX_GPIO+1) * sizeof(gpioStatus_t));
+
+   for (gpio=0; gpio<=PI_MAX_GPIO; gpio++)
+   {
+      status[gpio].mode  = (gpioReg[gpio/10] >> ((gpio%10) * 3)) & 7;
+      status[gpio].level = (level[BANK] & BIT) ? PI_ON : PI_OFF;
+      status[gpio].use   = gpioInfo[gpio].is;
+
+      if (pi_is_2711)
+      {
+         pull = (*(gpioReg + GPPUPPDN0 + (gpio>>4)) >> ((gpio & 0xf) << 1)) & 3;
+
+         switch (pull)
+         {
+            case 0:  status[gpio].pud = PI_PUD_OFF;     break;
+            case 1:  status[gpio].pud = PI_PUD_UP;      break;
+            case 2:  status[gpio].pud = PI_PUD_DOWN;    break;
+            default: status[gpio].pud = PI_PUD_UNKNOWN; break;
+         }
+      }
+      else status[gpio].pud = gpioInfo[gpio].pud;
+
+      if (gpio > PI_MAX_USER_GPIO) continue;
+
+      switch (gpioInfo[gpio].is)
+      {
+         case GPIO_PWM:
+            status[gpio].dutycycle = gpioInfo[gpio].width;
+            break;
+
+         case GPIO_SERVO:
+            status[gpio].pulsewidth = gpioInfo[gpio].width;
+            break;
+
+         case GPIO_HW_PWM:
+            pwm = (PWMDef[gpio] >> 4) & 3;
+            status[gpio].dutycycle = hw_pwm_duty[pwm];
+            status[gpio].range     = PI_HW_PWM_RANGE;
+            status[gpio].frequency = hw_pwm_freq[pwm];
+            break;
+
+         case GPIO_HW_CLK:
+            clock = (clkDef[gpio] >> 4) & 3;
+            status[gpio].dutycycle = PI_HW_PWM_RANGE/2;
+            status[gpio].range     = PI_HW_PWM_RANGE;
+            status[gpio].frequency = hw_clk_freq[clock];
+            break;
+      }
+
+      if (!status[gpio].range)
+      {
+         status[gpio].range     = gpioInfo[gpio].range;
+         status[gpio].frequency = pwmFreq[gpioInfo[gpio].freqIdx];
+      }
+
+      if (wdogBits & BIT)
+         status[gpio].watchdog = gpioAlert[gpio].wdSteadyUs / 1000;
+
+      if (gFilterBits & BIT)
+         status[gpio].glitch = gpioAlert[gpio].gfSteadyUs;
+
+      if (nFilterBits & BIT)
+      {
+         status[gpio].noiseSteady = gpioAlert[gpio].nfSteadyUs;
+         status[gpio].noiseActive = gpioAlert[gpio].nfActiveUs;
+      }
+   }
+
+   return PI_MAX_GPIO+1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioApply(unsigned count, gpioApply_t *apply)
+{
+   int i, res;
+   gpioApply_t *a;
+   unsigned range[PI_MAX_USER_GPIO+1];
+
+   DBG(DBG_USER, "count=%d apply=%08"PRIXPTR, count, (uintptr_t)apply);
+
+   CHECK_INITED;
+
+   /* check everything before changing anything */
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++) range[i] = gpioInfo[i].range;
+
+   for (i=0; i<count; i++)
+   {
+      a = &apply[i];
+
+      if (a->gpio > PI_MAX_GPIO)
+         SOFT_ERROR(PI_BAD_GPIO, "entry %d, bad gpio (%d)", i, a->gpio);
+
+      if (a->what & ~PI_APPLY_ALL)
+         SOFT_ERROR(PI_BAD_PARAM, "entry %d, bad what (%X)", i, a->what);
+
+      if ((a->what & PI_APPLY_MODE) && (a->mode > PI_ALT3))
+         SOFT_ERROR(PI_BAD_MODE, "entry %d, bad mode (%d)", i, a->mode);
+
+      if ((a->what & PI_APPLY_PUD) && (a->pud > PI_PUD_UP))
+         SOFT_ERROR(PI_BAD_PUD, "entry %d, bad pud (%d)", i, a->pud);
+
+      if ((a->what & PI_APPLY_LEVEL) && (a->level > PI_ON))
+         SOFT_ERROR(PI_BAD_LEVEL, "entry %d, bad level (%d)", i, a->level);
+
+      if (!(a->what & (PI_APPLY_RANGE | PI_APPLY_FREQUENCY |
+                       PI_APPLY_DUTYCYCLE | PI_APPLY_PULSEWIDTH)))
+         continue;
+
+      /* PWM and servo settings are only held for the user GPIO */
+
+      if (a->gpio > PI_MAX_USER_GPIO)
+         SOFT_ERROR(PI_BAD_USER_GPIO, "entry %d, bad gpio (%d)", i, a->gpio);
+
+      if (a->what & PI_APPLY_RANGE)
+      {
+         if ((a->range < PI_MIN_DUTYCYCLE_RANGE) ||
+             (a->range > PI_MAX_DUTYCYCLE_RANGE))
+            SOFT_ERROR(PI_BAD_DUTYRANGE,
+               "entry %d, bad range (%d)", i, a->range);
+
+         range[a->gpio] = a->range;
+      }
+
+      if ((a->what & PI_APPLY_DUTYCYCLE) && (a->dutycycle > range[a->gpio]))
+         SOFT_ERROR(PI_BAD_DUTYCYCLE,
+            "entry %d, bad dutycycle (%d)", i, a->dutycycle);
+
+      if ((a->what & PI_APPLY_PULSEWIDTH) &&
+          (((a->pulsewidth != PI_SERVO_OFF) &&
+            (a->pulsewidth < PI_MIN_SERVO_PULSEWIDTH)) ||
+           (a->pulsewidth > PI_MAX_SERVO_PULSEWIDTH)))
+         SOFT_ERROR(PI_BAD_PULSEWIDTH,
+            "entry %d, bad pulsewidth (%d)", i, a->pulsewidth);
+   }
+
+   for (i=0; i<count; i++)
+   {
+      a = &apply[i];
+
+      res = 0;
+
+      if (a->what & PI_APPLY_MODE)
+         res = gpioSetMode(a->gpio, a->mode);
+
+      if ((!res) && (a->what & PI_APPLY_PUD))
+         res = gpioSetPullUpDown(a->gpio, a->pud);
+
+      if ((!res) && (a->what & PI_APPLY_LEVEL))
+         res = gpioWrite(a->gpio, a->level);
+
+      if ((!res) && (a->what & PI_APPLY_RANGE))
+      {
+         res = gpioSetPWMrange(a->gpio, a->range);
+         if (res > 0) res = 0;
+      }
+
+      if ((!res) && (a->what & PI_APPLY_FREQUENCY))
+      {
+         res = gpioSetPWMfrequency(a->gpio, a->frequency);
+         if (res > 0) res = 0;
+      }
+
+      if ((!res) && (a->what & PI_APPLY_DUTYCYCLE))
+         res = gpioPWM(a->gpio, a->dutycycle);
+
+      if ((!res) && (a->what & PI_APPLY_PULSEWIDTH))
+         res = gpioServo(a->gpio, a->pulsewidth);
+
+      if (res < 0) return res;
+   }
 
    return 0;
 }
@@ -13685,6 +18978,86 @@ unsigned gpioVersion(void)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+static void statsRecord(volatile gpioHistogram_t *h, uint32_t value)
+{
+   int b;
+   uint32_t v;
+
+   /* bucket 0 counts 0, bucket n counts 2^(n-1) to 2^n - 1 */
+
+   for (b=0, v=value; v && (b < (PI_STATS_BUCKETS-1)); b++) v >>= 1;
+
+   h->count++;
+   h->bucket[b]++;
+
+   if (value > h->max) h->max = value;
+}
+
+static void statsClear(void)
+{
+   memset((void *)&gpioStats, 0, sizeof(gpioStats));
+
+   gpioStats.startNanos = timerNanos();
+}
+
+int gpioStatistics(gpioStatistics_t *stats, unsigned clear)
+{
+   int i;
+
+   DBG(DBG_USER, "stats=%08"PRIXPTR" clear=%d", (uintptr_t)stats, clear);
+
+   CHECK_INITED;
+
+   if (clear > 1)
+      SOFT_ERROR(PI_BAD_PARAM, "bad clear (%d)", clear);
+
+   stats->version = PI_STATS_VERSION;
+   stats->size    = sizeof(gpioStatistics_t);
+   stats->seconds = (timerNanos() - gpioStats.startNanos) / BILLION;
+   stats->micros  = gpioCfg.clockMicros;
+
+   stats->alertTicks          = gpioStats.alertTicks;
+   stats->lateTicks           = gpioStats.lateTicks;
+   stats->moreToDo            = gpioStats.moreToDo;
+   stats->numSamples          = gpioStats.numSamples;
+   stats->maxSamples          = gpioStats.maxSamples;
+   stats->maxEmit             = gpioStats.maxEmit;
+   stats->emitFrags           = gpioStats.emitFrags;
+   stats->cbTicks             = gpioStats.cbTicks;
+   stats->cbCalls             = gpioStats.cbCalls;
+   stats->DMARestarts         = gpioStats.DMARestarts;
+   stats->dmaInitCbsCount     = gpioStats.dmaInitCbsCount;
+   stats->goodPipeWrite       = gpioStats.goodPipeWrite;
+   stats->shortPipeWrite      = gpioStats.shortPipeWrite;
+   stats->wouldBlockPipeWrite = gpioStats.wouldBlockPipeWrite;
+   stats->alertRingFull       = gpioStats.alertRingFull;
+   stats->alertRingDropped    = gpioStats.alertRingDropped;
+   stats->alertRingMaxUsed    = gpioStats.alertRingMaxUsed;
+   stats->notifyDropped       = gpioStats.notifyDropped;
+
+   stats->alertPeriod   = gpioStats.alertPeriod;
+   stats->alertSamples  = gpioStats.alertSamples;
+   stats->emit          = gpioStats.emit;
+   stats->notifyLatency = gpioStats.notifyLatency;
+   stats->command       = gpioStats.command;
+
+   for (i=0; i<PI_STATS_GPIOS; i++)
+      stats->callback[i] = gpioStats.callback[i];
+
+   for (i=0; i<PI_STATS_COMMANDS; i++)
+   {
+      stats->commandCalls[i] = gpioStats.commandCalls[i];
+      stats->commandMax[i]   = gpioStats.commandMax[i];
+   }
+
+   if (clear) statsClear();
+
+   return sizeof(gpioStatistics_t);
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 /*
@@ -13768,6 +19141,12 @@ unsigned gpioHardwareRevision(void)
    pi_ispi = 0;
    rev &= 0xFFFFFF; /* mask out warranty bit */
 
+   if ((rev == 0) && (gpioCfg.internals & PI_CFG_SIMULATE))
+   {
+      DBG(DBG_USER, "simulating revision=%x", SIM_HARDWARE_REV);
+      rev = SIM_HARDWARE_REV;
+   }
+
    /* Decode revision code */
 
    if ((rev & 0x800000) == 0) /* old rev code */
@@ -13947,7 +19326,7 @@ int gpioCfgInterfaces(unsigned ifFlags)
 
    CHECK_NOT_INITED;
 
-   if (ifFlags > 15)
+   if (ifFlags > 31)
       SOFT_ERROR(PI_BAD_IF_FLAGS, "bad ifFlags (%X)", ifFlags);
 
    gpioCfg.ifFlags = ifFlags;
@@ -13972,6 +19351,40 @@ int gpioCfgSocketPort(unsigned port)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgSocketPath(char *path)
+{
+   DBG(DBG_USER, "path=%s", path ? path : "NULL");
+
+   CHECK_NOT_INITED;
+
+   if ((path == NULL) || (!path[0]) || (strlen(path) > PI_MAX_SOCKET_PATH))
+      SOFT_ERROR(PI_BAD_SOCKET_PATH, "bad socket path");
+
+   strcpy(sockPath, path);
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgSocketWorkers(unsigned workers)
+{
+   DBG(DBG_USER, "workers=%d", workers);
+
+   CHECK_NOT_INITED;
+
+   if ((workers < PI_MIN_SOCKET_WORKERS) || (workers > PI_MAX_SOCKET_WORKERS))
+      SOFT_ERROR(PI_BAD_SOCKET_WORKERS, "bad workers (%d)", workers);
+
+   gpioCfg.socketWorkers = workers;
+
+   return 0;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 int gpioCfgMemAlloc(unsigned memAllocMode)
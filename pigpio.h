@@ -117,6 +117,16 @@ gpioCfgSetInternals(cfg);
 int status = gpioInitialise();
 . .
 
+Setting PI_CFG_SIMULATE (1<<11) in the same way runs the library
+against simulated peripherals and a software DMA engine instead of
+/dev/mem.  This allows the library and daemon to be exercised on hosts
+which are not a Pi.  Building with PIGPIO_SIM defined makes this the
+default.
+
+Setting PI_CFG_NO_WAVE_CACHE (1<<12) gives every created waveform its
+own wave id and resources, even if an identical one already exists
+(see [*gpioWaveCreate*]).
+
 TEXT*/
 
 /*OVERVIEW
@@ -139,6 +149,7 @@ gpioWrite                  Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 gpioPWM                    Start/stop PWM pulses on a GPIO
+gpioPWMMulti               Start/stop PWM pulses on many GPIO at once
 gpioSetPWMfrequency        Configure PWM frequency for a GPIO
 gpioSetPWMrange            Configure PWM range for a GPIO
 
@@ -151,6 +162,7 @@ gpioGetPWMrealRange        Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 gpioServo                  Start/stop servo pulses on a GPIO
+gpioServoMulti             Start/stop servo pulses on many GPIO at once
 
 gpioGetServoPulsewidth     Get pulsewidth setting on a GPIO
 
@@ -169,11 +181,17 @@ gpioWrite_Bits_32_53_Clear Clear selected GPIO in bank 2
 gpioWrite_Bits_0_31_Set    Set selected GPIO in bank 1
 gpioWrite_Bits_32_53_Set   Set selected GPIO in bank 2
 
+gpioSnapshot               Get the settings and levels of all GPIO
+gpioApply                  Configure many GPIO at once
+
 gpioSetAlertFunc           Request a GPIO level change callback
 gpioSetAlertFuncEx         Request a GPIO change callback, extended
 
 gpioSetTimerFunc           Request a regular timed callback
 gpioSetTimerFuncEx         Request a regular timed callback, extended
+gpioTimerStart             Start a microsecond period timer
+gpioTimerStop              Stop a timer started by gpioTimerStart
+gpioTimerJitter            Get the callback lateness of a timer
 
 gpioStartThread            Start a new thread
 gpioStopThread             Stop a previously started thread
@@ -183,9 +201,13 @@ ADVANCED
 gpioNotifyOpen             Request a notification handle
 gpioNotifyClose            Close a notification
 gpioNotifyOpenWithSize     Request a notification with sized pipe
+gpioNotifyOpenShm          Request a notification in shared memory
 gpioNotifyBegin            Start notifications for selected GPIO
 gpioNotifyPause            Pause notifications
 
+gpioCommandOpenShm         Request a shared memory command region
+gpioCommandCloseShm        Close a shared memory command region
+
 gpioHardwareClock          Start hardware clock on supported GPIO
 
 gpioHardwarePWM            Start hardware PWM on supported GPIO
@@ -334,7 +356,16 @@ gpioWaveAddSerial          Adds serial data to the waveform
 
 gpioWaveCreate             Creates a waveform from added data
 gpioWaveCreatePad          Creates a waveform of fixed size from added data
+gpioWaveLookup             Finds a waveform with the added data
 gpioWaveDelete             Deletes a waveform
+gpioWaveCompact            Moves waveforms together to join free space
+gpioWaveGetSpace           Gets the waveform space free
+
+gpioWaveBuilderOpen        Opens a wave builder
+gpioWaveBuilderAddGeneric  Adds a pulse train to a wave builder
+gpioWaveBuilderAddSerial   Adds serial data to a wave builder
+gpioWaveBuilderCreate      Creates a waveform from a wave builder
+gpioWaveBuilderClose       Closes a wave builder
 
 gpioWaveTxSend             Transmits a waveform
 
@@ -346,10 +377,21 @@ gpioWaveTxBusy             Checks to see if the waveform has ended
 
 gpioWaveTxStop             Aborts the current waveform
 
+gpioWaveStreamOpen         Opens a ring for streaming pulses
+gpioWaveStreamAdd          Queues pulses on the stream
+gpioWaveStreamSetFunc      Sets a function called to refill the stream
+gpioWaveStreamSetEvent     Sets an event triggered to refill the stream
+gpioWaveStreamGetFree      Gets the free stream segments
+gpioWaveStreamGetUnderruns Gets the times the stream ran dry
+gpioWaveStreamClose        Closes the stream
+
 gpioWaveGetCbs             Length in CBs of the current waveform
 gpioWaveGetHighCbs         Length of longest waveform so far
 gpioWaveGetMaxCbs          Absolute maximum allowed CBs
 
+gpioWaveGetCacheHits       Waveforms created which already existed
+gpioWaveGetCacheMisses     Waveforms created which did not exist
+
 gpioWaveGetMicros          Length in micros of the current waveform
 gpioWaveGetHighMicros      Length of longest waveform so far
 gpioWaveGetMaxMicros       Absolute maximum allowed micros
@@ -366,6 +408,7 @@ gpioTick                   Get current tick (microseconds)
 
 gpioHardwareRevision       Get hardware revision
 gpioVersion                Get the pigpio version
+gpioStatistics             Get the run time statistics
 
 getBitInBytes              Get the value of a bit
 putBitInBytes              Set the value of a bit
@@ -385,6 +428,8 @@ gpioCfgDMAchannels         Configure the DMA channels
 gpioCfgPermissions         Configure the GPIO access permissions
 gpioCfgInterfaces          Configure user interfaces
 gpioCfgSocketPort          Configure socket port
+gpioCfgSocketPath          Configure Unix domain socket path
+gpioCfgSocketWorkers       Configure socket worker threads
 gpioCfgMemAlloc            Configure DMA memory allocation mode
 gpioCfgNetAddr             Configure allowed network addresses
 
@@ -451,6 +496,146 @@ typedef struct
    uint32_t level;
 } gpioReport_t;
 
+typedef struct
+{
+   uint32_t magic;   /* PI_NOTIFY_SHM_MAGIC */
+   uint32_t size;    /* number of reports, a power of 2 */
+   uint32_t head;    /* reports written, updated by pigpio */
+   uint32_t tail;    /* reports read, updated by the reader */
+   uint32_t futex;   /* incremented by pigpio after each batch */
+   uint32_t waiting; /* set by the reader while it sleeps on futex */
+   uint32_t pad[2];
+   gpioReport_t report[];
+} gpioNotifyShm_t;
+
+typedef struct
+{
+   uint32_t cmd;
+   uint32_t p1;
+   uint32_t p2;
+   int32_t  res;     /* written by pigpio */
+} gpioCommandSlot_t;
+
+typedef struct
+{
+   uint32_t magic;      /* PI_COMMAND_SHM_MAGIC */
+   uint32_t size;       /* number of slots, a power of 2 */
+   uint32_t head;       /* requests written, updated by the client */
+   uint32_t done;       /* requests completed, updated by pigpio */
+   uint32_t reqWaiting; /* set by pigpio while it sleeps on head */
+   uint32_t resWaiting; /* set by the client while it sleeps on done */
+   uint32_t pad[2];
+   gpioCommandSlot_t slot[];
+} gpioCommandShm_t;
+
+typedef struct
+{
+   uint32_t micros;   /* period */
+   uint32_t calls;    /* callbacks made */
+   uint32_t missed;   /* periods skipped because the timer ran late */
+   uint32_t lateMin;  /* callback lateness in nanoseconds */
+   uint32_t lateMax;
+   uint32_t lateMean;
+   uint32_t lateLast;
+} gpioTimerJitter_t;
+
+typedef struct
+{
+   uint32_t mode;        /* PI_INPUT, PI_OUTPUT, PI_ALT0-5 */
+   uint32_t pud;         /* PI_PUD_OFF/DOWN/UP or PI_PUD_UNKNOWN */
+   uint32_t level;
+   uint32_t use;         /* PI_USE_* */
+   uint32_t dutycycle;   /* PWM dutycycle, 0 if not PWM */
+   uint32_t range;       /* PWM range */
+   uint32_t frequency;   /* PWM frequency */
+   uint32_t pulsewidth;  /* servo pulsewidth, 0 if not servo */
+   uint32_t watchdog;    /* milliseconds, 0 if none */
+   uint32_t glitch;      /* glitch filter steady micros, 0 if none */
+   uint32_t noiseSteady; /* noise filter micros, 0 if none */
+   uint32_t noiseActive;
+} gpioStatus_t;
+
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t what;        /* PI_APPLY_* bits of the settings to make */
+   uint32_t mode;
+   uint32_t pud;
+   uint32_t level;
+   uint32_t range;
+   uint32_t frequency;
+   uint32_t dutycycle;
+   uint32_t pulsewidth;
+} gpioApply_t;
+
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t width;       /* PWM dutycycle or servo pulsewidth */
+} gpioWidth_t;
+
+#define PI_STATS_VERSION   2
+#define PI_STATS_BUCKETS  16
+#define PI_STATS_GPIOS    32
+#define PI_STATS_COMMANDS 256
+
+typedef struct
+{
+   uint32_t count;       /* values recorded */
+   uint32_t max;
+   uint32_t bucket[PI_STATS_BUCKETS]; /* see gpioStatistics */
+} gpioHistogram_t;
+
+typedef struct
+{
+   uint32_t version;     /* PI_STATS_VERSION */
+   uint32_t size;        /* sizeof(gpioStatistics_t) */
+   uint32_t seconds;     /* since started or last cleared */
+   uint32_t micros;      /* sample rate */
+
+   uint32_t alertTicks;
+   uint32_t lateTicks;
+   uint32_t moreToDo;
+   uint32_t numSamples;
+   uint32_t maxSamples;
+   uint32_t maxEmit;
+   uint32_t emitFrags;
+   uint32_t cbTicks;
+   uint32_t cbCalls;
+   uint32_t DMARestarts;
+   uint32_t dmaInitCbsCount;
+   uint32_t goodPipeWrite;
+   uint32_t shortPipeWrite;
+   uint32_t wouldBlockPipeWrite;
+   uint32_t alertRingFull;
+   uint32_t alertRingDropped;
+   uint32_t alertRingMaxUsed;
+   uint32_t notifyDropped;
+
+   gpioHistogram_t alertPeriod;   /* sampling loop period, micros */
+   gpioHistogram_t alertSamples;  /* samples read per loop */
+   gpioHistogram_t emit;          /* alert dispatch of a block, micros */
+   gpioHistogram_t notifyLatency; /* sample to notification write, micros */
+   gpioHistogram_t command;       /* command execution, micros */
+   gpioHistogram_t callback[PI_STATS_GPIOS]; /* alert callback, micros */
+
+   uint32_t commandCalls[PI_STATS_COMMANDS];
+   uint32_t commandMax[PI_STATS_COMMANDS]; /* micros */
+} gpioStatistics_t;
+
+typedef struct
+{
+   uint32_t waves;       /* waves created and not deleted */
+   uint32_t totalCBs;    /* DMA control blocks available to waves */
+   uint32_t freeCBs;
+   uint32_t largestCBs;  /* largest contiguous run of free CBs */
+   uint32_t rangesCBs;   /* contiguous runs of free CBs */
+   uint32_t totalOOL;    /* OOL available to waves */
+   uint32_t freeOOL;
+   uint32_t largestOOL;
+   uint32_t rangesOOL;
+} gpioWaveSpace_t;
+
 typedef struct
 {
    uint32_t gpioOn;
@@ -581,6 +766,10 @@ typedef void (*gpioGetSamplesFuncEx_t) (const gpioSample_t *samples,
                                         int                 numSamples,
                                         void               *userdata);
 
+typedef void (*gpioWaveStreamFunc_t)   (unsigned freeSegments,
+                                        unsigned underruns,
+                                        void    *userdata);
+
 typedef void *(gpioThreadFunc_t) (void *);
 
 
@@ -625,6 +814,31 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_PUD_DOWN 1
 #define PI_PUD_UP   2
 
+#define PI_PUD_UNKNOWN 3
+
+/* use: what a GPIO is being driven as */
+
+#define PI_USE_NONE   0
+#define PI_USE_WRITE  1
+#define PI_USE_PWM    2
+#define PI_USE_SERVO  3
+#define PI_USE_HW_CLK 4
+#define PI_USE_HW_PWM 5
+#define PI_USE_SPI    6
+#define PI_USE_I2C    7
+
+/* what: settings made by gpioApply, in this order */
+
+#define PI_APPLY_MODE       (1<<0)
+#define PI_APPLY_PUD        (1<<1)
+#define PI_APPLY_LEVEL      (1<<2)
+#define PI_APPLY_RANGE      (1<<3)
+#define PI_APPLY_FREQUENCY  (1<<4)
+#define PI_APPLY_DUTYCYCLE  (1<<5)
+#define PI_APPLY_PULSEWIDTH (1<<6)
+
+#define PI_APPLY_ALL        127
+
 /* dutycycle: 0-range */
 
 #define PI_DEFAULT_DUTYCYCLE_RANGE   255
@@ -656,15 +870,31 @@ typedef void *(gpioThreadFunc_t) (void *);
 
 #define PI_NOTIFY_SLOTS  32
 
+#define PI_NTFY_FLAGS_OVFL     (1 <<8)
 #define PI_NTFY_FLAGS_EVENT    (1 <<7)
 #define PI_NTFY_FLAGS_ALIVE    (1 <<6)
 #define PI_NTFY_FLAGS_WDOG     (1 <<5)
 #define PI_NTFY_FLAGS_BIT(x) (((x)<<0)&31)
 
+#define PI_NOTIFY_SHM_MAGIC   0x4E504750
+#define PI_NOTIFY_SHM_MIN     16
+#define PI_NOTIFY_SHM_MAX     1048576
+#define PI_NOTIFY_SHM_DEFAULT 4096
+
+#define PI_COMMAND_SHM_SLOTS   8
+
+#define PI_COMMAND_SHM_MAGIC   0x43504750
+#define PI_COMMAND_SHM_MIN     16
+#define PI_COMMAND_SHM_MAX     4096
+#define PI_COMMAND_SHM_DEFAULT 64
+
 #define PI_WAVE_BLOCKS     4
 #define PI_WAVE_MAX_PULSES (PI_WAVE_BLOCKS * 3000)
 #define PI_WAVE_MAX_CHARS  (PI_WAVE_BLOCKS *  300)
 
+#define PI_WAVE_BUILDERS       16
+#define PI_WAVE_BUILDER_PULSES (PI_WAVE_MAX_PULSES * 8)
+
 #define PI_BB_I2C_MIN_BAUD     50
 #define PI_BB_I2C_MAX_BAUD 500000
 
@@ -710,6 +940,14 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_WAVE_NOT_FOUND  9998 /* Transmitted wave not found. */
 #define PI_NO_TX_WAVE      9999 /* No wave being transmitted. */
 
+/* wave stream */
+
+#define PI_MIN_STREAM_SEGMENTS  2
+#define PI_MAX_STREAM_SEGMENTS 64
+#define PI_MIN_STREAM_CBS       3
+
+#define PI_WAVE_STREAM_NO_EVENT 32
+
 /* Files, I2C, SPI, SER */
 
 #define PI_FILE_SLOTS 16
@@ -829,6 +1067,15 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_MIN_TIMER 0
 #define PI_MAX_TIMER 9
 
+/* timer handles: PI_MAX_TIMER+1 to PI_TIMER_SLOTS-1 */
+
+#define PI_TIMER_SLOTS 1024
+
+/* timer micros: 100-60000000 */
+
+#define PI_MIN_TIMER_MICROS 100
+#define PI_MAX_TIMER_MICROS 60000000
+
 /* millis: 10-60000 */
 
 #define PI_MIN_MS 10
@@ -883,6 +1130,15 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_MIN_SOCKET_PORT 1024
 #define PI_MAX_SOCKET_PORT 32000
 
+/* socket path */
+
+#define PI_MAX_SOCKET_PATH 107
+
+/* socket workers */
+
+#define PI_MIN_SOCKET_WORKERS 1
+#define PI_MAX_SOCKET_WORKERS 64
+
 
 /* ifFlags: */
 
@@ -890,6 +1146,7 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_DISABLE_SOCK_IF   2
 #define PI_LOCALHOST_SOCK_IF 4
 #define PI_DISABLE_ALERT     8
+#define PI_DISABLE_UNIX_IF   16
 
 /* memAllocMode */
 
@@ -909,8 +1166,10 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_CFG_RT_PRIORITY       (1<<8)
 #define PI_CFG_STATS             (1<<9)
 #define PI_CFG_NOSIGHANDLER      (1<<10)
+#define PI_CFG_SIMULATE          (1<<11)
+#define PI_CFG_NO_WAVE_CACHE     (1<<12)
 
-#define PI_CFG_ILLEGAL_VAL       (1<<11)
+#define PI_CFG_ILLEGAL_VAL       (1<<13)
 
 
 /* gpioISR */
@@ -1142,6 +1401,34 @@ gpioPWM(23, 0);   // Sets GPIO23 full off.
 D*/
 
 
+/*F*/
+int gpioPWMMulti(unsigned count, gpioWidth_t *widths);
+/*D
+Sets the PWM dutycycles of many GPIO together.
+
+. .
+ count: the number of entries in widths
+widths: an array of [*gpioWidth_t*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO or PI_BAD_DUTYCYCLE.
+
+Each entry is treated as by [*gpioPWM*] but the new dutycycles are
+written to the DMA control blocks in a single pass, in the order the
+DMA reaches them, so every change takes effect at the same point in
+the pulse stream.  No PWM cycle is generated with some of the GPIO
+changed and others not.
+
+Every entry is checked before any dutycycle is changed.
+
+...
+gpioWidth_t w[3]={{17, 255}, {18, 128}, {23, 0}};
+
+gpioPWMMulti(3, w); // GPIO17 full on, GPIO18 half on, GPIO23 off.
+...
+D*/
+
+
 /*F*/
 int gpioGetPWMdutycycle(unsigned user_gpio);
 /*D
@@ -1384,6 +1671,34 @@ e.g. gpioPWM(25, 1500) will set a 1500 us pulse.
 D*/
 
 
+/*F*/
+int gpioServoMulti(unsigned count, gpioWidth_t *widths);
+/*D
+Sets the servo pulsewidths of many GPIO together.
+
+. .
+ count: the number of entries in widths
+widths: an array of [*gpioWidth_t*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO or PI_BAD_PULSEWIDTH.
+
+Each entry is treated as by [*gpioServo*] but the new pulsewidths are
+written to the DMA control blocks in a single pass, in the order the
+DMA reaches them, so every servo moves on the same pulse.
+
+A servo switched off (pulsewidth 0) finishes any pulse in progress.
+
+Every entry is checked before any pulsewidth is changed.
+
+...
+gpioWidth_t w[2]={{17, 1000}, {23, 2000}};
+
+gpioServoMulti(2, w); // Move both servos in the same 20 ms frame.
+...
+D*/
+
+
 /*F*/
 int gpioGetServoPulsewidth(unsigned user_gpio);
 /*D
@@ -1457,6 +1772,12 @@ once per level change since the last time the thread was activated.
 i.e. The active alert functions will get all level changes but there
 will be a latency.
 
+Sampling carries on while the alert functions run.  If they are too
+slow to keep up, the level changes sampled while the alert thread is
+behind are discarded rather than delaying sampling.  The level changes
+already waiting are still reported.  The number discarded is given
+by alertRingDropped (see [*gpioStatistics*]).
+
 If you want to track the level of more than one GPIO do so by
 maintaining the state in the callback.  Do not use [*gpioRead*].
 Remember the event that triggered the callback may have
@@ -1692,6 +2013,48 @@ See [*gpioNotifyOpen*] for further details.
 D*/
 
 
+/*F*/
+int gpioNotifyOpenShm(unsigned reports);
+/*D
+This function requests a free notification handle whose reports
+are delivered through shared memory rather than a pipe.
+
+. .
+reports: 0 (for the default of PI_NOTIFY_SHM_DEFAULT) or a power
+         of 2 in the range PI_NOTIFY_SHM_MIN-PI_NOTIFY_SHM_MAX
+. .
+
+Returns a handle greater than or equal to zero if OK,
+otherwise PI_NO_HANDLE, PI_BAD_NOTIFY_SIZE, or PI_NO_MEMORY.
+
+The reports for handle x are written to the POSIX shared memory
+object /pigpiox (normally visible as /dev/shm/pigpiox).  The object
+holds a gpioNotifyShm_t header followed by a ring of reports[]
+gpioReport_t entries.  The object must be mapped read/write.
+
+The object is readable and writable only by its owner.  When opened
+with the PI_CMD_NOS command over a Unix domain socket it is owned by
+the user of the connecting process, otherwise by the user running
+pigpio.
+
+pigpio stores each report at report[head % size] and then advances
+head.  The reader consumes reports from report[tail % size] and
+advances tail.  Both are free running counters.  If the ring is full
+reports are dropped and a PI_NTFY_FLAGS_OVFL report is added once
+there is room (see [*gpioNotifyBegin*]).
+
+To wait for reports a reader reads futex, sets waiting to 1, checks
+head once more, and then FUTEX_WAITs on futex (not a private futex)
+with the value read.  It should clear waiting when it wakes.  pigpio
+increments futex after each batch of reports and wakes the reader if
+waiting is set.
+
+The notifications are started and stopped with [*gpioNotifyBegin*],
+[*gpioNotifyPause*], and [*gpioNotifyClose*] as usual.  The object is
+removed when the handle is closed.
+D*/
+
+
 /*F*/
 int gpioNotifyBegin(unsigned handle, uint32_t bits);
 /*D
@@ -1723,8 +2086,8 @@ typedef struct
 seqno: starts at 0 each time the handle is opened and then increments
 by one for each report.
 
-flags: three flags are defined, PI_NTFY_FLAGS_WDOG,
-PI_NTFY_FLAGS_ALIVE, and PI_NTFY_FLAGS_EVENT.
+flags: four flags are defined, PI_NTFY_FLAGS_WDOG,
+PI_NTFY_FLAGS_ALIVE, PI_NTFY_FLAGS_EVENT, and PI_NTFY_FLAGS_OVFL.
 
 If bit 5 is set (PI_NTFY_FLAGS_WDOG) then bits 0-4 of the flags
 indicate a GPIO which has had a watchdog timeout.
@@ -1736,6 +2099,11 @@ of other notification activity.
 If bit 7 is set (PI_NTFY_FLAGS_EVENT) then bits 0-4 of the flags
 indicate an event which has been triggered.
 
+If bit 8 is set (PI_NTFY_FLAGS_OVFL) then reports were discarded
+because the pipe/socket was not being read quickly enough.  The tick
+is that of the first discarded report and the level is the number of
+reports discarded.
+
 tick: the number of microseconds since system boot.  It wraps around
 after 1h12m.
 
@@ -1792,11 +2160,73 @@ gpioNotifyClose(h);
 D*/
 
 
+/*F*/
+int gpioCommandOpenShm(unsigned slots);
+/*D
+This function opens a region of shared memory through which a local
+process may issue commands without a socket or pipe round trip.
+
+. .
+slots: 0 (for the default of PI_COMMAND_SHM_DEFAULT) or a power
+       of 2 in the range PI_COMMAND_SHM_MIN-PI_COMMAND_SHM_MAX
+. .
+
+Returns a handle greater than or equal to zero if OK,
+otherwise PI_NO_HANDLE, PI_BAD_SHM_SLOTS, or PI_NO_MEMORY.
+
+The region for handle x is the POSIX shared memory object
+/pigpiocmdx (normally visible as /dev/shm/pigpiocmdx).  It holds a
+gpioCommandShm_t header followed by a ring of slots[]
+gpioCommandSlot_t entries and must be mapped read/write.
+
+The region is readable and writable only by its owner.  When opened
+with the PI_CMD_SHMO command over a Unix domain socket it is owned
+by the user of the connecting process, otherwise by the user running
+pigpio.
+
+The client (the single producer) fills in cmd, p1, and p2 of
+slot[head % size] and then advances head.  A thread of pigpio (the
+single consumer) runs each request with the same checks as for the
+socket and pipe interfaces, stores the result in res, and then
+advances done.  Both are free running counters.  The client must
+not have more than size requests outstanding.
+
+Only commands without extensions may be used, others give
+PI_BAD_SHM_CMD.
+
+After advancing head the client wakes pigpio with FUTEX_WAKE on
+head (not a private futex) if reqWaiting is set.  To wait for a
+result the client sets resWaiting to 1, checks done once more, and
+then FUTEX_WAITs on done with the value read.  pigpio wakes the
+client if resWaiting is set after advancing done.
+
+A region opened with the PI_CMD_SHMO socket command is closed when
+the socket closes.  The name is removed at once and magic is cleared
+once any request being run has finished.
+D*/
+
+
+/*F*/
+int gpioCommandCloseShm(unsigned handle);
+/*D
+This function closes a shared memory command region.
+
+. .
+handle: >=0, as returned by [*gpioCommandOpenShm*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+Requests already in the ring may or may not be run.  The shared
+memory object is removed.
+D*/
+
+
 /*F*/
 int gpioWaveClear(void);
 /*D
 This function clears all waveforms and any data added by calls to the
-[*gpioWaveAdd**] functions.
+[*gpioWaveAdd**] functions.  Any wave stream is closed.
 
 Returns 0 if OK.
 
@@ -1959,13 +2389,21 @@ function.
 As many waveforms may be created as there is space available.  The
 wave id is passed to [*gpioWaveTxSend*] to specify the waveform to transmit.
 
+If a waveform with exactly the same pulses already exists its wave id
+is returned and no new waveform is built.  Each wave id returned must
+be deleted once with [*gpioWaveDelete*]; the waveform is only removed
+when the last is deleted.  [*gpioWaveGetCacheHits*] and
+[*gpioWaveGetCacheMisses*] count the creates which found and did not
+find an existing waveform.  Set PI_CFG_NO_WAVE_CACHE with
+[*gpioCfgSetInternals*] to always build a new waveform.
+
 Normal usage would be
 
 Step 1. [*gpioWaveClear*] to clear all waveforms and added data.
 
 Step 2. [*gpioWaveAdd**] calls to supply the waveform data.
 
-Step 3. [*gpioWaveCreate*] to create the waveform and get a unique id
+Step 3. [*gpioWaveCreate*] to create the waveform and get its id
 
 Repeat steps 2 and 3 as needed.
 
@@ -2043,30 +2481,222 @@ This buffer structure allows the transmission of infinite wave sequences.
 
 D*/
 
+/*F*/
+int gpioWaveLookup(void);
+/*D
+This function finds an existing waveform with the same pulses as
+those provided by the prior calls to the [*gpioWaveAdd**] functions.
+
+The added data is not consumed and the waveform is not referenced,
+so the wave id should not be deleted.  Call [*gpioWaveCreate*] to
+take a reference to the waveform, which will then cost little.
+
+Returns the wave id if found, otherwise PI_EMPTY_WAVEFORM or
+PI_WAVE_NOT_CACHED.
+D*/
+
+
 /*F*/
 int gpioWaveDelete(unsigned wave_id);
 /*D
 This function deletes the waveform with id wave_id.
 
-The wave is flagged for deletion.  The resources used by the wave
-will only be reused when either of the following apply.
-
-- all waves with higher numbered wave ids have been deleted or have
-been flagged for deletion.
+If [*gpioWaveCreate*] returned wave_id more than once, because the
+same waveform was created again, this only drops one reference and
+the waveform remains until deleted once for each create.
 
-- a new wave is created which uses exactly the same resources as
-the current wave (see the C source for gpioWaveCreate for details).
+The DMA control blocks (CBs) and OOL used by the wave are freed
+immediately and joined to any free space either side, so they may be
+used by the next wave created.  A wave must not be deleted while it
+is being transmitted.
 
 . .
 wave_id: >=0, as returned by [*gpioWaveCreate*]
 . .
 
-Wave ids are allocated in order, 0, 1, 2, etc.
+A new wave is given the lowest free wave id, 0, 1, 2, etc.
 
 Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
 D*/
 
 
+/*F*/
+int gpioWaveCompact(void);
+/*D
+This function moves the waveforms which have been created so that
+the DMA control blocks (CBs) and OOL they use are contiguous, leaving
+a single range of each free.
+
+A wave is created in the smallest free range large enough to hold
+it, but after many waves of varying size have been created and
+deleted the free space may be split into ranges too small for a
+large wave (see [*gpioWaveGetSpace*]).  Compacting joins them.
+
+Wave ids are unchanged.  The waves can not be moved while any wave
+is being transmitted or a wave stream is open.
+
+Returns the number of waves moved if OK, otherwise PI_WAVE_TX_BUSY or
+PI_WAVE_STREAM_OPEN.
+D*/
+
+
+/*F*/
+int gpioWaveGetSpace(gpioWaveSpace_t *space);
+/*D
+This function gets the DMA control blocks (CBs) and OOL free for
+new waveforms.
+
+. .
+space: a [*gpioWaveSpace_t*] to receive the free space
+. .
+
+Returns the size of a gpioWaveSpace_t.
+
+The free CBs and OOL may be split into several ranges.  A wave needs
+a single range of each, so the largest wave which can be created is
+limited by largestCBs and largestOOL rather than freeCBs and freeOOL.
+If those are much smaller the free space is fragmented and
+[*gpioWaveCompact*] may be used to join it.
+
+...
+gpioWaveSpace_t s;
+
+gpioWaveGetSpace(&s);
+
+printf("%u of %u CBs free in %u ranges, largest %u\n",
+   s.freeCBs, s.totalCBs, s.rangesCBs, s.largestCBs);
+...
+D*/
+
+
+/*F*/
+int gpioWaveBuilderOpen(void);
+/*D
+This function opens a wave builder.  A wave builder collects pulse
+trains which are merged in time order when the waveform is created.
+
+Returns a handle (>=0) if OK, otherwise PI_NO_HANDLE.
+
+[*gpioWaveAddGeneric*] and [*gpioWaveAddSerial*] merge each addition
+into the whole of the current waveform, so the time taken to build a
+waveform from many additions grows with the square of their number.
+A wave builder keeps the trains apart and merges them all once in
+[*gpioWaveBuilderCreate*].
+
+Each builder is independent of the others and of the current
+waveform, so several waveforms may be prepared at the same time.
+
+...
+h = gpioWaveBuilderOpen();
+
+for (i=0; i<16; i++)
+   gpioWaveBuilderAddSerial(h, gpio[i], 9600, 8, 2, 0, len[i], msg[i]);
+
+gpioWaveBuilderAddGeneric(h, numPulses, pwmPulses);
+
+wid = gpioWaveBuilderCreate(h);
+
+gpioWaveBuilderClose(h);
+...
+D*/
+
+
+/*F*/
+int gpioWaveBuilderAddGeneric(
+   unsigned handle, unsigned numPulses, gpioPulse_t *pulses);
+/*D
+This function adds a pulse train to a wave builder.
+
+. .
+   handle: >=0, as returned by [*gpioWaveBuilderOpen*]
+numPulses: the number of pulses
+   pulses: an array of pulses
+. .
+
+Returns the total number of pulses held by the builder if OK,
+otherwise PI_BAD_HANDLE, PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+The train starts at the start of the waveform and is merged with
+the builder's other trains by [*gpioWaveBuilderCreate*].  As with
+[*gpioWaveAddGeneric*] the first pulse should consist of a delay
+if the train is intended to start later.
+
+A builder may hold at most PI_WAVE_BUILDER_PULSES pulses.
+D*/
+
+
+/*F*/
+int gpioWaveBuilderAddSerial
+   (unsigned handle,
+    unsigned user_gpio,
+    unsigned baud,
+    unsigned data_bits,
+    unsigned stop_bits,
+    unsigned offset,
+    unsigned numBytes,
+    char     *str);
+/*D
+This function adds a pulse train representing serial data to a
+wave builder.  The serial data starts offset microseconds from the
+start of the waveform.
+
+. .
+   handle: >=0, as returned by [*gpioWaveBuilderOpen*]
+user_gpio: 0-31
+     baud: 50-1000000
+data_bits: 1-32
+stop_bits: 2-8
+   offset: >=0
+ numBytes: >=1
+      str: an array of chars (which may contain nulls)
+. .
+
+Returns the total number of pulses held by the builder if OK,
+otherwise PI_BAD_HANDLE, PI_BAD_USER_GPIO, PI_BAD_WAVE_BAUD,
+PI_BAD_DATABITS, PI_BAD_STOPBITS, PI_TOO_MANY_CHARS,
+PI_BAD_SER_OFFSET, PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+The data is formatted as for [*gpioWaveAddSerial*].
+D*/
+
+
+/*F*/
+int gpioWaveBuilderCreate(unsigned handle);
+/*D
+This function merges the pulse trains added to a wave builder and
+creates a waveform from the result.
+
+. .
+handle: >=0, as returned by [*gpioWaveBuilderOpen*]
+. .
+
+Returns the new waveform id if OK, otherwise PI_BAD_HANDLE,
+PI_EMPTY_WAVEFORM, PI_TOO_MANY_PULSES, PI_NO_MEMORY,
+PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
+
+The trains are merged in a single pass, pulses due at the same time
+being combined as [*gpioWaveAddGeneric*] does.  The waveform is the
+same as that made by adding each train in turn to a new waveform
+and calling [*gpioWaveCreate*].
+
+The trains are consumed if the waveform is created, leaving the
+builder open and empty.  The current waveform is not affected.
+D*/
+
+
+/*F*/
+int gpioWaveBuilderClose(unsigned handle);
+/*D
+This function closes a wave builder and frees its pulse trains.
+
+. .
+handle: >=0, as returned by [*gpioWaveBuilderOpen*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+D*/
+
+
 /*F*/
 int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode);
 /*D
@@ -2087,7 +2717,7 @@ wave_mode: PI_WAVE_MODE_ONE_SHOT, PI_WAVE_MODE_REPEAT,
 . .
 
 Returns the number of DMA control blocks in the waveform if OK,
-otherwise PI_BAD_WAVE_ID, or PI_BAD_WAVE_MODE.
+otherwise PI_BAD_WAVE_ID, PI_BAD_WAVE_MODE, or PI_WAVE_STREAM_OPEN.
 D*/
 
 
@@ -2108,7 +2738,8 @@ bufSize: the number of bytes in buf
 . .
 
 Returns 0 if OK, otherwise PI_CHAIN_NESTING, PI_CHAIN_LOOP_CNT, PI_BAD_CHAIN_LOOP, PI_BAD_CHAIN_CMD, PI_CHAIN_COUNTER,
-PI_BAD_CHAIN_DELAY, PI_CHAIN_TOO_BIG, or PI_BAD_WAVE_ID.
+PI_BAD_CHAIN_DELAY, PI_CHAIN_TOO_BIG, PI_BAD_WAVE_ID, or
+PI_WAVE_STREAM_OPEN.
 
 Each wave is transmitted in the order specified.  A wave may
 occur multiple times per chain.
@@ -2175,51 +2806,212 @@ int main(int argc, char *argv[])
       255, 2, 0x20, 0x4E,           // delay 20000us
       wid[0], wid[0], wid[0],       // transmit waves 0+0+0
 
-      }, 46);
+      }, 46);
+
+   while (gpioWaveTxBusy()) time_sleep(0.1);
+
+   for (i=0; i<WAVES; i++) gpioWaveDelete(wid[i]);
+
+   printf("stop piscope, press return"); getchar();
+
+   gpioTerminate();
+}
+...
+D*/
+
+
+/*F*/
+int gpioWaveTxAt(void);
+/*D
+This function returns the id of the waveform currently being
+transmitted using [*gpioWaveTxSend*].  Chained waves are not supported.
+
+Returns the waveform id or one of the following special values:
+
+PI_WAVE_NOT_FOUND (9998) - transmitted wave not found. 
+PI_NO_TX_WAVE (9999) - no wave being transmitted.
+D*/
+
+
+/*F*/
+int gpioWaveTxBusy(void);
+/*D
+This function checks to see if a waveform is currently being
+transmitted.
+
+Returns 1 if a waveform is currently being transmitted, otherwise 0.
+D*/
+
+
+/*F*/
+int gpioWaveTxStop(void);
+/*D
+This function aborts the transmission of the current waveform.
+
+Returns 0 if OK.
+
+This function is intended to stop a waveform started in repeat mode.
+
+It also stops a wave stream (see [*gpioWaveStreamOpen*]) and drops
+its queued pulses.  The stream stays open.
+D*/
+
+
+/*F*/
+int gpioWaveStreamOpen(
+   unsigned segments, unsigned segmentCBs, unsigned threshold);
+/*D
+This function opens a wave stream, which transmits pulses as they are
+queued rather than as a finished waveform.
+
+. .
+  segments: 2-64, the segments in the ring
+segmentCBs: >=3, the DMA control blocks (CBs) in each segment
+ threshold: 1-segments, the free segments which ask for a refill
+. .
+
+Returns 0 if OK, otherwise PI_BAD_WAVE_STREAM, PI_WAVE_STREAM_OPEN,
+PI_WAVE_TX_BUSY, PI_TOO_MANY_CBS, PI_TOO_MANY_OOL, PI_NO_MEMORY, or
+PI_NO_ALERTS.
+
+The stream is a ring of segments taken from the waveform space, each
+of segmentCBs CBs and as many OOL.  Pulses queued with
+[*gpioWaveStreamAdd*] fill the free segments in turn, and each
+segment is linked to the last while the earlier ones play, so the
+output continues without a gap for as long as pulses are queued in
+time.  A segment is free again once it has played.
+
+When the free segments rise to threshold the stream asks for a refill
+by calling the function set by [*gpioWaveStreamSetFunc*] and
+triggering the event set by [*gpioWaveStreamSetEvent*].  It asks
+again only after the free segments have fallen below threshold.
+
+If the output plays every queued segment it stops.  This is counted
+as an underrun (see [*gpioWaveStreamGetUnderruns*]) and also asks for
+a refill.  The next pulses queued start the output again after a
+20 microsecond delay.  The end of a stream counts as an underrun.
+
+There is one stream.  While it is open [*gpioWaveTxSend*] and
+[*gpioWaveChain*] fail with PI_WAVE_STREAM_OPEN and the waveforms can
+not be compacted.  No waveform may be transmitting when it is opened.
+
+A stream opened by a socket client is closed when that client
+disconnects.
+
+The stream is serviced by the thread which calls the alert functions,
+so it can not be opened if alerts are disabled (PI_DISABLE_ALERT).
+
+Long stepper motor profiles and continuous bit banged protocols are
+typical uses.
+
+...
+static void refill(unsigned freeSegments, unsigned underruns, void *u)
+{
+   // queue the next pulses, perhaps from a buffer filled elsewhere
+}
+
+gpioWaveStreamOpen(8, 200, 4);
+
+gpioWaveStreamSetFunc(refill, NULL);
+...
+D*/
+
+
+/*F*/
+int gpioWaveStreamAdd(unsigned numPulses, gpioPulse_t *pulses);
+/*D
+This function queues pulses on the wave stream.
+
+. .
+numPulses: the number of pulses
+   pulses: an array of pulses
+. .
+
+Returns the number of pulses queued if OK, otherwise
+PI_NO_WAVE_STREAM or PI_TOO_MANY_CBS.
+
+The pulses fill as many free segments as they need and the output
+starts if it has stopped.  If there are not enough free segments for
+all the pulses the leading ones are queued and their number returned,
+which may be 0 when the ring is full.  The rest should be queued
+when the stream asks for a refill.
+
+Each pulse is as for [*gpioWaveAddGeneric*], and the pulses follow on
+from those queued before.  A pulse whose delay needs more CBs than a
+segment can hold is never queued, PI_TOO_MANY_CBS is returned if it
+is the first.
+D*/
+
 
-   while (gpioWaveTxBusy()) time_sleep(0.1);
+/*F*/
+int gpioWaveStreamSetFunc(gpioWaveStreamFunc_t f, void *userdata);
+/*D
+This function sets the function called when the wave stream asks for
+a refill.
 
-   for (i=0; i<WAVES; i++) gpioWaveDelete(wid[i]);
+. .
+       f: the function to call, or NULL to cancel
+userdata: pointer to arbitrary user data
+. .
 
-   printf("stop piscope, press return"); getchar();
+Returns 0 if OK, otherwise PI_NO_WAVE_STREAM.
 
-   gpioTerminate();
-}
-...
+The function is passed the free segments, the underruns so far, and
+the userdata.  It is called from the thread which calls the alert
+functions, within a millisecond or so of the refill being due.
+
+If the free segments are already at threshold the function is called
+at the next check, within a millisecond or so.
 D*/
 
 
 /*F*/
-int gpioWaveTxAt(void);
+int gpioWaveStreamSetEvent(unsigned event);
 /*D
-This function returns the id of the waveform currently being
-transmitted using [*gpioWaveTxSend*].  Chained waves are not supported.
+This function sets the event triggered when the wave stream asks for
+a refill.
 
-Returns the waveform id or one of the following special values:
+. .
+event: 0-31, or PI_WAVE_STREAM_NO_EVENT to cancel
+. .
 
-PI_WAVE_NOT_FOUND (9998) - transmitted wave not found. 
-PI_NO_TX_WAVE (9999) - no wave being transmitted.
+Returns 0 if OK, otherwise PI_BAD_EVENT_ID or PI_NO_WAVE_STREAM.
+
+A remote client can not be called directly, it uses the event instead
+(see [*eventSetFunc*]).
+
+If the free segments are already at threshold the event is triggered
+at the next check, within a millisecond or so.
 D*/
 
 
 /*F*/
-int gpioWaveTxBusy(void);
+int gpioWaveStreamGetFree(void);
 /*D
-This function checks to see if a waveform is currently being
-transmitted.
+This function returns the number of free wave stream segments if OK,
+otherwise PI_NO_WAVE_STREAM.
+D*/
 
-Returns 1 if a waveform is currently being transmitted, otherwise 0.
+
+/*F*/
+int gpioWaveStreamGetUnderruns(void);
+/*D
+This function returns the number of times the wave stream output has
+run out of queued pulses and stopped if OK, otherwise
+PI_NO_WAVE_STREAM.
 D*/
 
 
 /*F*/
-int gpioWaveTxStop(void);
+int gpioWaveStreamClose(void);
 /*D
-This function aborts the transmission of the current waveform.
+This function closes the wave stream.  Any pulses still queued are
+dropped and the segments are returned to the waveform space.
 
-Returns 0 if OK.
+Returns 0 if OK, otherwise PI_NO_WAVE_STREAM.
 
-This function is intended to stop a waveform started in repeat mode.
+To let the queued pulses finish wait until [*gpioWaveStreamGetFree*]
+returns the number of segments.
 D*/
 
 
@@ -2293,6 +3085,24 @@ control blocks.
 D*/
 
 
+/*F*/
+int gpioWaveGetCacheHits(void);
+/*D
+This function returns the number of times [*gpioWaveCreate*] (or
+[*gpioWaveBuilderCreate*]) found that the waveform already existed and
+returned its wave id rather than building a new one.
+D*/
+
+
+/*F*/
+int gpioWaveGetCacheMisses(void);
+/*D
+This function returns the number of times [*gpioWaveCreate*] (or
+[*gpioWaveBuilderCreate*]) built a new waveform because no identical
+waveform existed.
+D*/
+
+
 /*F*/
 int gpioSerialReadOpen(unsigned user_gpio, unsigned baud, unsigned data_bits);
 /*D
@@ -3734,6 +4544,13 @@ One function may be registered per timer.
 
 The timer may be cancelled by passing NULL as the function.
 
+All timers, including those started by [*gpioTimerStart*], are run
+by a single thread.  Each callback is due one period after the
+previous deadline, so the timer does not drift however long the
+callback takes.  A callback which delays the thread delays the other
+timers.  If a timer falls more than a period behind the missed
+periods are skipped.
+
 ...
 void bFunction(void)
 {
@@ -3770,6 +4587,97 @@ See [*gpioSetTimerFunc*] for further details.
 D*/
 
 
+/*F*/
+int gpioTimerStart(unsigned micros, gpioTimerFuncEx_t f, void *userdata);
+/*D
+Starts a timer which calls a function (a callback) every micros
+microseconds.
+
+. .
+  micros: 100-60000000
+       f: the function to call
+userdata: a pointer to arbitrary user data
+. .
+
+Returns a handle (greater than PI_MAX_TIMER) if OK, otherwise
+PI_BAD_TIMER_MICROS, PI_NO_HANDLE, or PI_TIMER_FAILED.
+
+Up to PI_TIMER_SLOTS-PI_MAX_TIMER-1 timers may be started.  The
+function is passed the userdata pointer.
+
+The timer is stopped with [*gpioTimerStop*].
+
+See [*gpioSetTimerFunc*] for further details.
+
+...
+void aFunction(void *userdata)
+{
+   (*(int *)userdata)++;
+}
+
+int count = 0;
+
+// call aFunction every 250 microseconds
+h = gpioTimerStart(250, aFunction, &count);
+...
+D*/
+
+
+/*F*/
+int gpioTimerStop(unsigned handle);
+/*D
+Stops a timer started by [*gpioTimerStart*].
+
+. .
+handle: >PI_MAX_TIMER, as returned by [*gpioTimerStart*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+The function will not be called once gpioTimerStop returns, unless
+gpioTimerStop is called from a timer callback.
+D*/
+
+
+/*F*/
+int gpioTimerJitter(unsigned timer, gpioTimerJitter_t *jitter);
+/*D
+Returns the callback timing statistics of a running timer.
+
+. .
+ timer: 0-9, or a handle returned by [*gpioTimerStart*]
+jitter: where to store the statistics
+. .
+
+Returns 0 if OK, otherwise PI_BAD_TIMER or PI_BAD_POINTER.
+
+. .
+typedef struct
+{
+   uint32_t micros;   // period
+   uint32_t calls;    // callbacks made
+   uint32_t missed;   // periods skipped because the timer ran late
+   uint32_t lateMin;  // callback lateness in nanoseconds
+   uint32_t lateMax;
+   uint32_t lateMean;
+   uint32_t lateLast;
+} gpioTimerJitter_t;
+. .
+
+The lateness of a callback is the time between its deadline and the
+timer thread starting the call.  The statistics are reset when the
+timer is started.
+
+...
+gpioTimerJitter_t j;
+
+if (gpioTimerJitter(h, &j) == 0)
+   printf("%u calls, mean %u ns late, max %u ns late\n",
+      j.calls, j.lateMean, j.lateMax);
+...
+D*/
+
+
 /*F*/
 pthread_t *gpioStartThread(gpioThreadFunc_t f, void *userdata);
 /*D
@@ -4071,6 +4979,79 @@ gpioWrite_Bits_32_53_Set((1<<(32-32)) | (1<<(40-32)) | (1<<(53-32)));
 ...
 D*/
 
+/*F*/
+int gpioSnapshot(gpioStatus_t *status);
+/*D
+Gets the mode, pull, level, and PWM, servo, watchdog, and filter
+settings of every GPIO in one call.
+
+. .
+status: an array of PI_MAX_GPIO+1 [*gpioStatus_t*] to receive the
+        settings, status[g] being those of GPIO g
+. .
+
+Returns the number of GPIO reported (PI_MAX_GPIO+1) if OK.
+
+The pull is that last set by [*gpioSetPullUpDown*] (PI_PUD_UNKNOWN
+if none has been set) except on the BCM2711 where it is read from
+the hardware.
+
+use is what the GPIO is being driven as, one of PI_USE_NONE,
+PI_USE_WRITE, PI_USE_PWM, PI_USE_SERVO, PI_USE_HW_CLK, PI_USE_HW_PWM,
+PI_USE_SPI, or PI_USE_I2C.
+
+The PWM, servo, watchdog, and filter settings are only held for the
+user GPIO (0-31).  They are 0 for the other GPIO.
+
+...
+gpioStatus_t status[PI_MAX_GPIO+1];
+
+gpioSnapshot(status);
+
+if (status[4].use == PI_USE_PWM)
+   printf("GPIO 4 dutycycle %d\n", status[4].dutycycle);
+...
+D*/
+
+/*F*/
+int gpioApply(unsigned count, gpioApply_t *apply);
+/*D
+Makes the settings described by an array of [*gpioApply_t*], each
+of which may set the mode, pull, level, and PWM or servo settings of
+one GPIO.
+
+. .
+count: the number of entries in apply
+apply: an array of [*gpioApply_t*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_GPIO, PI_BAD_USER_GPIO,
+PI_BAD_MODE, PI_BAD_PUD, PI_BAD_LEVEL, PI_BAD_DUTYRANGE,
+PI_BAD_DUTYCYCLE, PI_BAD_PULSEWIDTH, PI_BAD_PARAM, or an error from
+the function making a setting.
+
+what selects the settings made for an entry.  It is a combination of
+PI_APPLY_MODE, PI_APPLY_PUD, PI_APPLY_LEVEL, PI_APPLY_RANGE,
+PI_APPLY_FREQUENCY, PI_APPLY_DUTYCYCLE, and PI_APPLY_PULSEWIDTH.  The
+settings of an entry are made in that order using [*gpioSetMode*],
+[*gpioSetPullUpDown*], [*gpioWrite*], [*gpioSetPWMrange*],
+[*gpioSetPWMfrequency*], [*gpioPWM*], and [*gpioServo*].
+
+Every entry is checked before any setting is made, a dutycycle
+against the range the GPIO will have when it is set.  If a setting
+then fails the remaining entries are not applied.
+
+...
+gpioApply_t apply[2] =
+{
+   {17, PI_APPLY_MODE|PI_APPLY_PUD, PI_INPUT, PI_PUD_UP},
+   {18, PI_APPLY_RANGE|PI_APPLY_DUTYCYCLE, 0, 0, 0, 1000, 0, 250},
+};
+
+gpioApply(2, apply);
+...
+D*/
+
 /*F*/
 int gpioHardwareClock(unsigned gpio, unsigned clkfreq);
 /*D
@@ -4306,6 +5287,54 @@ Returns the pigpio version.
 D*/
 
 
+/*F*/
+int gpioStatistics(gpioStatistics_t *stats, unsigned clear);
+/*D
+Copies the library's run time statistics.
+
+. .
+stats: a [*gpioStatistics_t*] to receive the statistics
+clear: 1 to zero the statistics once copied, otherwise 0
+. .
+
+Returns the size of a gpioStatistics_t if OK, otherwise PI_BAD_PARAM.
+
+The statistics are gathered continuously, not only when PI_CFG_STATS
+is set, so they may be used to watch a long running process for
+signs of overload before it starts to lose level changes.
+
+version is PI_STATS_VERSION.  Fields are only ever added to the end
+of gpioStatistics_t and a new version number used, so a reader can
+use version and size to tell which fields are present.
+
+Besides the counters printed at termination when PI_CFG_STATS is set
+there are histograms of
+
+. .
+alertPeriod   micros between passes of the sampling loop
+alertSamples  samples read from the DMA buffer by each pass
+emit          micros taken to dispatch a block of samples
+notifyLatency micros from a level change to its notification write
+command       micros taken to execute a command
+callback      micros taken by the alert callback, for each GPIO
+. .
+
+and a count and the longest execution in micros of each command, by
+command number.  Version 1 held only the first 128 commands.
+
+Bucket 0 of a histogram counts zero values.  Bucket n counts values
+from 2^(n-1) to 2^n - 1 and the last bucket all larger values.
+
+...
+gpioStatistics_t s;
+
+gpioStatistics(&s, 0);
+
+printf("alert loop period max %u micros\n", s.alertPeriod.max);
+...
+D*/
+
+
 /*F*/
 int gpioGetPad(unsigned pad);
 /*D
@@ -4919,6 +5948,60 @@ The default setting is to use port 8888.
 D*/
 
 
+/*F*/
+int gpioCfgSocketPath(char *path);
+/*D
+Configures pigpio to listen on a Unix domain socket at the specified
+path as well as on the socket port.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+path: the file system path of the socket, at most 107 characters.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_SOCKET_PATH.
+
+The default setting is to use /var/run/pigpio.sock.
+
+The Unix domain socket carries the same commands as the socket port
+but local clients avoid the cost of the TCP/IP stack.  pigpiod_if2,
+pigpio.py, and pigs connect to it when given an address of the form
+unix:path (unix: alone uses the default path).
+
+Any file at the path is removed when pigpio starts.  The socket is
+made accessible to all users, as is the socket port, and is removed
+by [*gpioTerminate*].
+
+The Unix domain socket is not created if [*gpioCfgNetAddr*] has
+restricted the addresses which may use the socket interface.
+D*/
+
+
+/*F*/
+int gpioCfgSocketWorkers(unsigned workers);
+/*D
+Configures the number of threads which service socket connections.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+workers: 1-64
+. .
+
+Returns 0 if OK, otherwise PI_BAD_SOCKET_WORKERS.
+
+The default setting is 4 threads.
+
+A worker runs one command at a time for whichever connection has a
+complete command waiting.  A command which may block, such as MILS,
+MICS, an I2C or SPI transfer, or a batch containing one, is instead
+run on a thread started for it, so it does not hold up the commands
+of other connections.  More workers only help when many clients
+issue quick commands at the same time.
+D*/
+
+
 /*F*/
 int gpioCfgInterfaces(unsigned ifFlags);
 /*D
@@ -4927,14 +6010,18 @@ Configures pigpio support of the fifo and socket interfaces.
 This function is only effective if called before [*gpioInitialise*].
 
 . .
-ifFlags: 0-7
+ifFlags: 0-31
 . .
 
-The default setting (0) is that both interfaces are enabled.
+The default setting (0) is that all interfaces are enabled.
 
 Or in PI_DISABLE_FIFO_IF to disable the pipe interface.
 
-Or in PI_DISABLE_SOCK_IF to disable the socket interface.
+Or in PI_DISABLE_SOCK_IF to disable the socket interface.  This
+disables the Unix domain socket as well.
+
+Or in PI_DISABLE_UNIX_IF to disable the Unix domain socket (see
+[*gpioCfgSocketPath*]).
 
 Or in PI_LOCALHOST_SOCK_IF to disable remote socket
 access (this means that the socket interface is only
@@ -4974,6 +6061,10 @@ This function is only effective if called before [*gpioInitialise*].
 numSockAddr: 0-256 (0 means all addresses allowed)
    sockAddr: an array of permitted network addresses.
 . .
+
+If any addresses are given the Unix domain socket (see
+[*gpioCfgSocketPath*]) is not created as it can't be restricted
+by address.
 D*/
 
 
@@ -5295,6 +6386,9 @@ The number of microseconds level changes are reported for once
 a noise filter has been triggered (by [*steady*] microseconds of
 a stable level).
 
+*apply::
+An array of [*gpioApply_t*] describing the settings to make.
+
 arg1::
 
 An unsigned argument passed to a user customised function.  Its
@@ -5398,6 +6492,9 @@ char::
 
 A single character, an 8 bit quantity able to store 0-255.
 
+clear::0-1
+1 to zero the statistics once they have been copied.
+
 clkfreq::4689-250M (13184-375M for the BCM2711)
 
 The hardware clock frequency.
@@ -5410,7 +6507,8 @@ PI_HW_CLK_MAX_FREQ_2711 375000000
 
 count::
 The number of bytes to be transferred in an I2C, SPI, or Serial
-command.
+command, or the number of entries in a [*gpioApply*], [*gpioPWMMulti*],
+or [*gpioServoMulti*] array.
 
 CS::
 The GPIO used for the slave select signal when bit banging SPI.
@@ -5527,6 +6625,22 @@ typedef void (*eventFuncEx_t)
    (int event, int level, uint32_t tick, void *userdata);
 . .
 
+gpioApply_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t what;
+   uint32_t mode;
+   uint32_t pud;
+   uint32_t level;
+   uint32_t range;
+   uint32_t frequency;
+   uint32_t dutycycle;
+   uint32_t pulsewidth;
+} gpioApply_t;
+. .
+
 gpioCfg*::
 
 These functions are only effective if called before [*gpioInitialise*].
@@ -5538,6 +6652,8 @@ These functions are only effective if called before [*gpioInitialise*].
 [*gpioCfgPermissions*] 
 [*gpioCfgInterfaces*] 
 [*gpioCfgSocketPort*] 
+[*gpioCfgSocketPath*] 
+[*gpioCfgSocketWorkers*] 
 [*gpioCfgMemAlloc*]
 
 gpioGetSamplesFunc_t::
@@ -5552,6 +6668,16 @@ typedef void (*gpioGetSamplesFuncEx_t)
    (const gpioSample_t *samples, int numSamples, void *userdata);
 . .
 
+gpioHistogram_t::
+. .
+typedef struct
+{
+   uint32_t count;
+   uint32_t max;
+   uint32_t bucket[PI_STATS_BUCKETS];
+} gpioHistogram_t;
+. .
+
 gpioISRFunc_t::
 . .
 typedef void (*gpioISRFunc_t)
@@ -5593,6 +6719,65 @@ gpioSignalFuncEx_t::
 typedef void (*gpioSignalFuncEx_t) (int signum, void *userdata);
 . .
 
+gpioStatistics_t::
+. .
+typedef struct
+{
+   uint32_t version;
+   uint32_t size;
+   uint32_t seconds;
+   uint32_t micros;
+
+   uint32_t alertTicks;
+   uint32_t lateTicks;
+   uint32_t moreToDo;
+   uint32_t numSamples;
+   uint32_t maxSamples;
+   uint32_t maxEmit;
+   uint32_t emitFrags;
+   uint32_t cbTicks;
+   uint32_t cbCalls;
+   uint32_t DMARestarts;
+   uint32_t dmaInitCbsCount;
+   uint32_t goodPipeWrite;
+   uint32_t shortPipeWrite;
+   uint32_t wouldBlockPipeWrite;
+   uint32_t alertRingFull;
+   uint32_t alertRingDropped;
+   uint32_t alertRingMaxUsed;
+   uint32_t notifyDropped;
+
+   gpioHistogram_t alertPeriod;
+   gpioHistogram_t alertSamples;
+   gpioHistogram_t emit;
+   gpioHistogram_t notifyLatency;
+   gpioHistogram_t command;
+   gpioHistogram_t callback[PI_STATS_GPIOS];
+
+   uint32_t commandCalls[PI_STATS_COMMANDS];
+   uint32_t commandMax[PI_STATS_COMMANDS];
+} gpioStatistics_t;
+. .
+
+gpioStatus_t::
+. .
+typedef struct
+{
+   uint32_t mode;
+   uint32_t pud;
+   uint32_t level;
+   uint32_t use;
+   uint32_t dutycycle;
+   uint32_t range;
+   uint32_t frequency;
+   uint32_t pulsewidth;
+   uint32_t watchdog;
+   uint32_t glitch;
+   uint32_t noiseSteady;
+   uint32_t noiseActive;
+} gpioStatus_t;
+. .
+
 gpioThreadFunc_t::
 . .
 typedef void *(gpioThreadFunc_t) (void *);
@@ -5608,6 +6793,20 @@ gpioTimerFuncEx_t::
 typedef void (*gpioTimerFuncEx_t) (void *userdata);
 . .
 
+gpioTimerJitter_t::
+. .
+typedef struct
+{
+   uint32_t micros;
+   uint32_t calls;
+   uint32_t missed;
+   uint32_t lateMin;
+   uint32_t lateMax;
+   uint32_t lateMean;
+   uint32_t lateLast;
+} gpioTimerJitter_t;
+. .
+
 gpioWaveAdd*::
 
 One of
@@ -5616,6 +6815,37 @@ One of
 [*gpioWaveAddGeneric*] 
 [*gpioWaveAddSerial*]
 
+gpioWaveSpace_t::
+. .
+typedef struct
+{
+   uint32_t waves;
+   uint32_t totalCBs;
+   uint32_t freeCBs;
+   uint32_t largestCBs;
+   uint32_t rangesCBs;
+   uint32_t totalOOL;
+   uint32_t freeOOL;
+   uint32_t largestOOL;
+   uint32_t rangesOOL;
+} gpioWaveSpace_t;
+. .
+
+gpioWaveStreamFunc_t::
+. .
+typedef void (*gpioWaveStreamFunc_t)
+   (unsigned freeSegments, unsigned underruns, void *userdata);
+. .
+
+gpioWidth_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t width;
+} gpioWidth_t;
+. .
+
 handle::>=0
 
 A number referencing an object opened by one of
@@ -5624,7 +6854,10 @@ A number referencing an object opened by one of
 [*gpioNotifyOpen*] 
 [*i2cOpen*] 
 [*serOpen*] 
-[*spiOpen*]
+[*spiOpen*] 
+[*gpioTimerStart*]
+[*gpioCommandOpenShm*]
+[*gpioWaveBuilderOpen*]
 
 i2cAddr:: 0-0x7F
 The address of a device on the I2C bus.
@@ -5641,10 +6874,13 @@ i2cReg:: 0-255
 
 A register of an I2C device.
 
-ifFlags::0-3
+ifFlags::0-31
 . .
-PI_DISABLE_FIFO_IF 1
-PI_DISABLE_SOCK_IF 2
+PI_DISABLE_FIFO_IF   1
+PI_DISABLE_SOCK_IF   2
+PI_LOCALHOST_SOCK_IF 4
+PI_DISABLE_ALERT     8
+PI_DISABLE_UNIX_IF   16
 . .
 
 *inBuf::
@@ -5662,6 +6898,10 @@ A 32-bit signed value.
 invert::
 A flag used to set normal or inverted bit bang serial data level logic.
 
+*jitter::
+A pointer to a [*gpioTimerJitter_t*] used to return the callback
+timing statistics of a timer.
+
 level::
 The level of a GPIO.  Low or High.
 
@@ -5795,6 +7035,10 @@ high and low levels.
 *param::
 An array of script parameters.
 
+*path::
+The file system path of the Unix domain socket.  Defaults to
+/var/run/pigpio.sock.
+
 pctBOOL:: 0-100
 percent On-Off-Level (OOL) buffer to consume for wave output.
 
@@ -5844,6 +7088,9 @@ PI_PUD_DOWN 1
 PI_PUD_UP 2
 . .
 
+[*gpioSnapshot*] reports PI_PUD_UNKNOWN (3) for a pull it does not
+know.
+
 pulseLen::
 
 1-100, the length of a trigger pulse in microseconds.
@@ -5994,6 +7241,13 @@ seekOffset::
 The number of bytes to move forward (positive) or backwards (negative)
 from the seek position (start, current, or end of file).
 
+segmentCBs:: >=PI_MIN_STREAM_CBS
+The DMA control blocks (CBs) in each segment of a wave stream.  Each
+segment also has as many OOL.
+
+segments:: 2-64
+The number of segments in the ring of a wave stream.
+
 *segs::
 An array of segments which make up a combined I2C transaction.
 
@@ -6012,6 +7266,16 @@ PI_MIN_SIGNUM 0
 PI_MAX_SIGNUM 63
 . .
 
+slots::
+The number of request slots in a shared memory command region,
+0 for the default or a power of 2.
+
+. .
+PI_COMMAND_SHM_MIN        16
+PI_COMMAND_SHM_MAX      4096
+PI_COMMAND_SHM_DEFAULT    64
+. .
+
 size_t::
 
 A standard type used to indicate the size of an object in bytes.
@@ -6022,6 +7286,9 @@ as 32 bit numbers.
 
 E.g. address 192.168.1.66 would be encoded as 0x4201a8c0.
 
+*space::
+A pointer to a [*gpioWaveSpace_t*] to receive the free waveform space.
+
 *spi::
 A pointer to a [*rawSPI_t*] structure.
 
@@ -6053,6 +7320,9 @@ The number of microseconds level changes must be stable for
 before reporting the level changed ([*gpioGlitchFilter*]) or triggering
 the active part of a noise filter ([*gpioNoiseFilter*]).
 
+*stats::
+A [*gpioStatistics_t*] to receive the run time statistics.
+
 stop_bits::2-8
 The number of (half) stop bits to be used when adding serial data
 to a waveform.
@@ -6062,9 +7332,17 @@ PI_MIN_WAVE_HALFSTOPBITS 2
 PI_MAX_WAVE_HALFSTOPBITS 8
 . .
 
+*status::
+An array of PI_MAX_GPIO+1 [*gpioStatus_t*] to receive the settings
+of each GPIO.
+
 *str::
 An array of characters.
 
+threshold:: 1-segments
+The number of free wave stream segments at which the stream asks for
+a refill.
+
 timeout::
 A GPIO level change timeout in milliseconds.
 
@@ -6086,6 +7364,9 @@ PI_MIN_TIMER 0
 PI_MAX_TIMER 9
 . .
 
+or a handle returned by [*gpioTimerStart*] (PI_MAX_TIMER+1 to
+PI_TIMER_SLOTS-1).
+
 timetype::
 . .
 PI_TIME_RELATIVE 0
@@ -6168,6 +7449,13 @@ PI_WAVE_MODE_ONE_SHOT_SYNC 2
 PI_WAVE_MODE_REPEAT_SYNC   3
 . .
 
+workers:: 1-64
+The number of threads servicing socket connections.  Defaults to 4.
+
+*widths::
+An array of [*gpioWidth_t*] giving the PWM dutycycle or servo pulsewidth
+to set for each GPIO.
+
 wVal::0-65535 (Hex 0x0-0xFFFF, Octal 0-0177777)
 
 A 16-bit word value.
@@ -6317,6 +7605,39 @@ PARAMS*/
 #define PI_CMD_PROCU 117
 #define PI_CMD_WVCAP 118
 
+#define PI_CMD_NOS   119
+
+#define PI_CMD_BATCH 120
+
+#define PI_CMD_SHMO  121
+#define PI_CMD_SHMC  122
+
+#define PI_CMD_GSNAP  123
+#define PI_CMD_GAPPLY 124
+
+#define PI_CMD_PWMM   125
+#define PI_CMD_SERVOM 126
+
+#define PI_CMD_STATS  127
+
+#define PI_CMD_WVBNEW 128
+#define PI_CMD_WVBAG  129
+#define PI_CMD_WVBAS  130
+#define PI_CMD_WVBCRE 131
+#define PI_CMD_WVBDEL 132
+
+#define PI_CMD_WVSPC  133
+#define PI_CMD_WVCMP  134
+
+#define PI_CMD_WVLKP  135
+#define PI_CMD_WVSCH  136
+
+#define PI_CMD_WVSOP  137
+#define PI_CMD_WVSAD  138
+#define PI_CMD_WVSEV  139
+#define PI_CMD_WVSST  140
+#define PI_CMD_WVSCL  141
+
 /*DEF_E*/
 
 /*
@@ -6329,6 +7650,29 @@ The socket should be dedicated to receiving notifications
 after this command is issued.
 */
 
+/*
+PI CMD_BATCH only works on the socket interface.
+It runs several commands in one exchange.  p1 is the number
+of commands and the extension holds the commands one after
+another, each as a 16 byte command followed by its own
+extension (p3 bytes).
+
+The commands are run in order.  The reply extension holds,
+for each command, its 4 byte result followed by any data the
+command returns.  PI_CMD_NOIB, PI_CMD_BATCH, PI_CMD_NOS,
+PI_CMD_SHMO, and PI_CMD_WVSOP may not be batched and give
+PI_BAD_BATCH.  The reply is limited to CMD_MAX_EXTENSION bytes,
+commands which do not fit are not run.  p3 of the reply is the reply extension length, or
+PI_BAD_BATCH if the commands are malformed.
+*/
+
+/*
+PI CMD_SHMO on the socket interface ties the shared memory
+command region to the socket, the region is closed when the
+socket closes.  Commands in the region are limited to those
+without extensions, the others give PI_BAD_SHM_CMD.
+*/
+
 /* pseudo commands */
 
 #define PI_CMD_SCRIPT 800
@@ -6528,6 +7872,19 @@ after this command is issued.
 #define PI_CMD_INTERRUPTED -144 // Used by Python
 #define PI_NOT_ON_BCM2711  -145 // not available on BCM2711
 #define PI_ONLY_ON_BCM2711 -146 // only available on BCM2711
+#define PI_BAD_NOTIFY_SIZE -147 // bad notification shared memory size
+#define PI_BAD_BATCH       -148 // bad batched command
+#define PI_BAD_TIMER_MICROS -149 // timer micros not 100-60000000
+#define PI_BAD_SOCKET_PATH -150 // socket path empty or too long
+#define PI_BAD_SHM_SLOTS   -151 // bad command shared memory slots
+#define PI_BAD_SHM_CMD     -152 // command not allowed in shared memory
+#define PI_WAVE_TX_BUSY    -153 // wave being transmitted
+#define PI_WAVE_NOT_CACHED -154 // no waveform with the same pulses
+#define PI_WAVE_STREAM_OPEN -155 // wave stream open
+#define PI_NO_WAVE_STREAM  -156 // no wave stream open
+#define PI_BAD_WAVE_STREAM -157 // bad wave stream segments, CBs, or threshold
+#define PI_BAD_SOCKET_WORKERS -158 // socket workers not 1-64
+#define PI_NO_ALERTS       -159 // alerts are disabled
 
 #define PI_PIGIF_ERR_0    -2000
 #define PI_PIGIF_ERR_99   -2099
@@ -6553,6 +7910,8 @@ after this command is issued.
 #define PI_DEFAULT_SOCKET_PORT             8888
 #define PI_DEFAULT_SOCKET_PORT_STR         "8888"
 #define PI_DEFAULT_SOCKET_ADDR_STR         "localhost"
+#define PI_DEFAULT_SOCKET_PATH             "/var/run/pigpio.sock"
+#define PI_DEFAULT_SOCKET_WORKERS          4
 #define PI_DEFAULT_UPDATE_MASK_UNKNOWN     0x0000000FFFFFFCLL
 #define PI_DEFAULT_UPDATE_MASK_B1          0x03E7CF93
 #define PI_DEFAULT_UPDATE_MASK_A_B2        0xFBC7CF9C
@@ -6564,7 +7923,11 @@ after this command is issued.
 #define PI_DEFAULT_UPDATE_MASK_COMPUTE     0x00FFFFFFFFFFFFLL
 #define PI_DEFAULT_MEM_ALLOC_MODE          PI_MEM_ALLOC_AUTO
 
+#ifdef PIGPIO_SIM
+#define PI_DEFAULT_CFG_INTERNALS           PI_CFG_SIMULATE
+#else
 #define PI_DEFAULT_CFG_INTERNALS           0
+#endif
 
 /*DEF_E*/
 
@@ -113,6 +113,7 @@ write                     Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 set_PWM_dutycycle         Start/stop PWM pulses on a GPIO
+set_PWM_dutycycles        Start/stop PWM pulses on many GPIO at once
 set_PWM_frequency         Set PWM frequency of a GPIO
 set_PWM_range             Configure PWM range of a GPIO
 
@@ -125,6 +126,7 @@ get_PWM_real_range        Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 set_servo_pulsewidth      Start/Stop servo pulses on a GPIO
+set_servo_pulsewidths     Start/Stop servo pulses on many GPIO at once
 
 get_servo_pulsewidth      Get servo pulsewidth set on a GPIO
 
@@ -143,6 +145,9 @@ clear_bank_2              Clear selected GPIO in bank 2
 set_bank_1                Set selected GPIO in bank 1
 set_bank_2                Set selected GPIO in bank 2
 
+gpio_snapshot             Get the settings and levels of all GPIO
+gpio_apply                Configure many GPIO at once
+
 callback                  Create GPIO level change callback
 
 wait_for_edge             Wait for GPIO level change
@@ -289,7 +294,16 @@ wave_add_serial           Adds serial data to the waveform
 
 wave_create               Creates a waveform from added data
 wave_create_and_pad       Creates a waveform of fixed size from added data
+wave_lookup               Finds a waveform with the added data
 wave_delete               Deletes a waveform
+wave_compact              Moves waveforms together to join free space
+wave_get_space            Gets the waveform space free
+
+wave_builder_open         Opens a wave builder
+wave_builder_add_generic  Adds a pulse train to a wave builder
+wave_builder_add_serial   Adds serial data to a wave builder
+wave_builder_create       Creates a waveform from a wave builder
+wave_builder_close        Closes a wave builder
 
 wave_send_once            Transmits a waveform once
 wave_send_repeat          Transmits a waveform repeatedly
@@ -303,9 +317,19 @@ wave_tx_busy              Checks to see if a waveform has ended
 
 wave_tx_stop              Aborts the current waveform
 
+wave_stream_open          Opens a ring for streaming pulses
+wave_stream_add           Queues pulses on the stream
+wave_stream_set_event     Sets an event triggered to refill the stream
+wave_stream_get_free      Gets the free stream segments
+wave_stream_get_underruns Gets the times the stream ran dry
+wave_stream_close         Closes the stream
+
 wave_get_cbs              Length in cbs of the current waveform
 wave_get_max_cbs          Absolute maximum allowed cbs
 
+wave_get_cache_hits       Waveforms created which already existed
+wave_get_cache_misses     Waveforms created which did not exist
+
 wave_get_micros           Length in microseconds of the current waveform
 wave_get_max_micros       Absolute maximum allowed micros
 
@@ -318,6 +342,7 @@ get_current_tick          Get current tick (microseconds)
 
 get_hardware_revision     Get hardware revision
 get_pigpio_version        Get the pigpio version
+get_statistics            Get the daemon's run time statistics
 
 pigpio.error_text         Gets error text from error number
 pigpio.tickDiff           Returns difference between two ticks
@@ -370,6 +395,31 @@ PUD_OFF  = 0
 PUD_DOWN = 1
 PUD_UP   = 2
 
+PUD_UNKNOWN = 3
+
+# GPIO use (gpio_snapshot)
+
+USE_NONE   = 0
+USE_WRITE  = 1
+USE_PWM    = 2
+USE_SERVO  = 3
+USE_HW_CLK = 4
+USE_HW_PWM = 5
+USE_SPI    = 6
+USE_I2C    = 7
+
+# settings made by gpio_apply
+
+APPLY_MODE       = (1 << 0)
+APPLY_PUD        = (1 << 1)
+APPLY_LEVEL      = (1 << 2)
+APPLY_RANGE      = (1 << 3)
+APPLY_FREQUENCY  = (1 << 4)
+APPLY_DUTYCYCLE  = (1 << 5)
+APPLY_PULSEWIDTH = (1 << 6)
+
+APPLY_ALL        = 127
+
 # script run status
 
 PI_SCRIPT_INITING=0
@@ -380,6 +430,7 @@ PI_SCRIPT_FAILED =4
 
 # notification flags
 
+NTFY_FLAGS_OVFL  = (1 << 8)
 NTFY_FLAGS_EVENT = (1 << 7)
 NTFY_FLAGS_ALIVE = (1 << 6)
 NTFY_FLAGS_WDOG  = (1 << 5)
@@ -395,6 +446,8 @@ WAVE_MODE_REPEAT_SYNC  =3
 WAVE_NOT_FOUND = 9998 # Transmitted wave not found.
 NO_TX_WAVE     = 9999 # No wave being transmitted.
 
+WAVE_STREAM_NO_EVENT = 32
+
 FILE_READ=1
 FILE_WRITE=2
 FILE_RW=3
@@ -424,6 +477,8 @@ EVENT_BSC = 31
 
 _SOCK_CMD_LEN = 16
 
+_SOCK_PATH = "/var/run/pigpio.sock"
+
 # pigpio command numbers
 
 _PI_CMD_MODES= 0
@@ -574,6 +629,32 @@ _PI_CMD_EVT  =116
 _PI_CMD_PROCU=117
 _PI_CMD_WVCAP=118
 
+_PI_CMD_GSNAP =123
+_PI_CMD_GAPPLY=124
+
+_PI_CMD_PWMM  =125
+_PI_CMD_SERVOM=126
+
+_PI_CMD_STATS =127
+
+_PI_CMD_WVBNEW=128
+_PI_CMD_WVBAG =129
+_PI_CMD_WVBAS =130
+_PI_CMD_WVBCRE=131
+_PI_CMD_WVBDEL=132
+
+_PI_CMD_WVSPC =133
+_PI_CMD_WVCMP =134
+
+_PI_CMD_WVLKP =135
+_PI_CMD_WVSCH =136
+
+_PI_CMD_WVSOP =137
+_PI_CMD_WVSAD =138
+_PI_CMD_WVSEV =139
+_PI_CMD_WVSST =140
+_PI_CMD_WVSCL =141
+
 # pigpio error numbers
 
 _PI_INIT_FAILED     =-1
@@ -723,6 +804,19 @@ PI_BAD_EVENT_ID     =-143
 PI_CMD_INTERRUPTED  =-144
 PI_NOT_ON_BCM2711   =-145
 PI_ONLY_ON_BCM2711  =-146
+PI_BAD_NOTIFY_SIZE  =-147
+PI_BAD_BATCH        =-148
+PI_BAD_TIMER_MICROS =-149
+PI_BAD_SOCKET_PATH  =-150
+PI_BAD_SHM_SLOTS    =-151
+PI_BAD_SHM_CMD      =-152
+PI_WAVE_TX_BUSY     =-153
+PI_WAVE_NOT_CACHED  =-154
+PI_WAVE_STREAM_OPEN =-155
+PI_NO_WAVE_STREAM   =-156
+PI_BAD_WAVE_STREAM  =-157
+PI_BAD_SOCKET_WORKERS=-158
+PI_NO_ALERTS        =-159
 
 # pigpio error text
 
@@ -871,6 +965,19 @@ _errors=[
    [PI_CMD_INTERRUPTED   , "pigpio command interrupted"],
    [PI_NOT_ON_BCM2711    , "not available on BCM2711"],
    [PI_ONLY_ON_BCM2711   , "only available on BCM2711"],
+   [PI_BAD_NOTIFY_SIZE   , "bad notification shared memory size"],
+   [PI_BAD_BATCH         , "bad batched command"],
+   [PI_BAD_TIMER_MICROS  , "timer micros not 100-60000000"],
+   [PI_BAD_SOCKET_PATH   , "socket path empty or too long"],
+   [PI_BAD_SHM_SLOTS     , "bad command shared memory slots"],
+   [PI_BAD_SHM_CMD       , "command not allowed in shared memory"],
+   [PI_WAVE_TX_BUSY      , "wave being transmitted"],
+   [PI_WAVE_NOT_CACHED   , "no waveform with the same pulses"],
+   [PI_WAVE_STREAM_OPEN  , "wave stream open"],
+   [PI_NO_WAVE_STREAM    , "no wave stream open"],
+   [PI_BAD_WAVE_STREAM   , "bad wave stream segments, CBs, or threshold"],
+   [PI_BAD_SOCKET_WORKERS, "socket workers not 1-64"],
+   [PI_NO_ALERTS         , "alerts are disabled"],
 ]
 
 _except_a = "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n{}"
@@ -1011,6 +1118,23 @@ def _u2i(uint32):
          raise error(error_text(v))
    return v
 
+def _pigpio_connect(host, port):
+   """
+   Connects to the pigpio daemon.  A host of the form unix:path
+   connects to the daemon's Unix domain socket at path (unix: alone
+   uses the default path) and port is ignored.
+   """
+   if host.startswith("unix:"):
+      s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+      try:
+         s.connect(host[5:] or _SOCK_PATH)
+      except socket.error:
+         s.close()
+         raise
+   else:
+      s = socket.create_connection((host, port), None)
+   return s
+
 def _pigpio_command(sl, cmd, p1, p2):
    """
    Runs a pigpio socket command.
@@ -1130,7 +1254,7 @@ class _callback_thread(threading.Thread):
       self.event_bits = 0
       self.callbacks = []
       self.events = []
-      self.sl.s = socket.create_connection((host, port), None)
+      self.sl.s = _pigpio_connect(host, port)
       self.lastLevel = _pigpio_command(self.sl,  _PI_CMD_BR1, 0, 0)
       self.handle = _u2i(_pigpio_command(self.sl, _PI_CMD_NOIB, 0, 0))
       self.go = True
@@ -1480,6 +1604,40 @@ class pi():
       return _u2i(_pigpio_command(
          self.sl, _PI_CMD_PWM, user_gpio, int(dutycycle)))
 
+   def _set_widths(self, cmd, settings):
+      # pigpio message format
+
+      # I p1 0
+      # I p2 0
+      # I p3 settings * 8
+      ## extension ##
+      # II gpio/width
+      if len(settings):
+         ext = bytearray()
+         for gpio, width in settings:
+            ext.extend(struct.pack("2I", gpio, int(width)))
+         extents = [ext]
+         return _u2i(_pigpio_command_ext(
+            self.sl, cmd, 0, 0, len(ext), extents))
+      else:
+         return 0
+
+   def set_PWM_dutycycles(self, settings):
+      """
+      Sets the PWM dutycycles of many GPIO in one command.
+
+      settings:= a list of (user_gpio, dutycycle) tuples.
+
+      Each tuple is treated as by [*set_PWM_dutycycle*].  The new
+      dutycycles all take effect on the same PWM cycle.  Every entry
+      is checked before any dutycycle is changed.
+
+      ...
+      pi.set_PWM_dutycycles([(4, 64), (17, 128), (18, 0)])
+      ...
+      """
+      return self._set_widths(_PI_CMD_PWMM, settings)
+
    def get_PWM_dutycycle(self, user_gpio):
       """
       Returns the PWM dutycycle being used on the GPIO.
@@ -1678,6 +1836,22 @@ class pi():
       return _u2i(_pigpio_command(
          self.sl, _PI_CMD_SERVO, user_gpio, int(pulsewidth)))
 
+   def set_servo_pulsewidths(self, settings):
+      """
+      Sets the servo pulsewidths of many GPIO in one command.
+
+      settings:= a list of (user_gpio, pulsewidth) tuples.
+
+      Each tuple is treated as by [*set_servo_pulsewidth*].  Every
+      servo moves on the same pulse.  Every entry is checked before
+      any pulsewidth is changed.
+
+      ...
+      pi.set_servo_pulsewidths([(17, 1000), (23, 2000)])
+      ...
+      """
+      return self._set_widths(_PI_CMD_SERVOM, settings)
+
    def get_servo_pulsewidth(self, user_gpio):
       """
       Returns the servo pulsewidth being used on the GPIO.
@@ -1728,8 +1902,9 @@ class pi():
       seqno: starts at 0 each time the handle is opened and then
       increments by one for each report.
 
-      flags: three flags are defined, PI_NTFY_FLAGS_WDOG,
-      PI_NTFY_FLAGS_ALIVE, and PI_NTFY_FLAGS_EVENT.
+      flags: four flags are defined, PI_NTFY_FLAGS_WDOG,
+      PI_NTFY_FLAGS_ALIVE, PI_NTFY_FLAGS_EVENT, and
+      PI_NTFY_FLAGS_OVFL.
 
       If bit 5 is set (PI_NTFY_FLAGS_WDOG) then bits 0-4 of the
       flags indicate a GPIO which has had a watchdog timeout.
@@ -1741,6 +1916,11 @@ class pi():
       If bit 7 is set (PI_NTFY_FLAGS_EVENT) then bits 0-4 of the
       flags indicate an event which has been triggered.
 
+      If bit 8 is set (PI_NTFY_FLAGS_OVFL) then reports were
+      discarded because the pipe/socket was not being read quickly
+      enough.  The tick is that of the first discarded report and
+      the level is the number of reports discarded.
+
 
       tick: the number of microseconds since system boot.  It wraps
       around after 1h12m.
@@ -1935,6 +2115,85 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_BS2, bits, 0))
 
+   def gpio_snapshot(self):
+      """
+      Gets the mode, pull, level, and PWM, servo, watchdog, and
+      filter settings of every GPIO in one command.
+
+      Returns a list with an entry for each GPIO (54 entries).  Each
+      entry is a tuple of
+
+      (mode, pud, level, use, dutycycle, range, frequency,
+       pulsewidth, watchdog, glitch, noise_steady, noise_active)
+
+      pud is PUD_UNKNOWN if the pull is not known.  use is one of
+      USE_NONE, USE_WRITE, USE_PWM, USE_SERVO, USE_HW_CLK,
+      USE_HW_PWM, USE_SPI, or USE_I2C.  dutycycle and pulsewidth are
+      0 unless the GPIO is being used for PWM or servo pulses.
+      watchdog is in milliseconds and the filter settings in
+      microseconds, all 0 if not set.  The PWM, servo, watchdog, and
+      filter settings are 0 for GPIO 32-53.
+
+      ...
+      for g, st in enumerate(pi.gpio_snapshot()):
+         print(g, st[0], st[2])
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      rdata = ""
+      with self.sl.l:
+         bytes = u2i(
+            _pigpio_command_nolock(self.sl, _PI_CMD_GSNAP, 0, 0))
+         if bytes > 0:
+            rdata = self._rxbuf(bytes)
+      _u2i(bytes)
+      return [struct.unpack_from("12I", rdata, i)
+         for i in range(0, bytes, 48)]
+
+   def gpio_apply(self, settings):
+      """
+      Makes the settings for many GPIO in one command.
+
+      settings:= a list of tuples, one for each GPIO to change.
+
+      Each tuple is
+
+      (gpio, what, mode, pud, level, range, frequency, dutycycle,
+       pulsewidth)
+
+      and may be shortened if the later values are not needed.  what
+      is a combination of APPLY_MODE, APPLY_PUD, APPLY_LEVEL,
+      APPLY_RANGE, APPLY_FREQUENCY, APPLY_DUTYCYCLE, and
+      APPLY_PULSEWIDTH selecting the settings made, in that order.
+
+      Every entry is checked before any setting is made.
+
+      ...
+      pi.gpio_apply([
+         (17, pigpio.APPLY_MODE|pigpio.APPLY_PUD, pigpio.INPUT,
+            pigpio.PUD_UP),
+         (18, pigpio.APPLY_RANGE|pigpio.APPLY_DUTYCYCLE, 0, 0, 0,
+            1000, 0, 250)])
+      ...
+      """
+      # pigpio message format
+
+      # I p1 0
+      # I p2 0
+      # I p3 settings * 36
+      ## extension ##
+      # IIIIIIIII gpio/what/mode/pud/level/range/freq/duty/pulsewidth
+      if len(settings):
+         ext = bytearray()
+         for st in settings:
+            st = tuple(st) + (0,) * (9 - len(st))
+            ext.extend(struct.pack("9I", *st))
+         extents = [ext]
+         return _u2i(_pigpio_command_ext(
+            self.sl, _PI_CMD_GAPPLY, 0, 0, len(ext), extents))
+      else:
+         return 0
+
    def hardware_clock(self, gpio, clkfreq):
       """
       Starts a hardware clock on a GPIO at the specified frequency.
@@ -2099,6 +2358,74 @@ class pi():
       """
       return _pigpio_command(self.sl, _PI_CMD_PIGPV, 0, 0)
 
+   def get_statistics(self, clear=False):
+      """
+      Returns the daemon's run time statistics as a dictionary.
+
+      clear:= True to zero the statistics once read.
+
+      The counters (alertTicks, numSamples, notifyDropped, ...) are
+      those printed by the daemon at exit when PI_CFG_STATS is set.
+      version, seconds (since started or cleared), and micros (the
+      sample rate) are also given.
+
+      alertPeriod, alertSamples, emit, notifyLatency, and command are
+      histograms, each a tuple of (count, max, buckets).  buckets is
+      a list of 16 counts, the first of zero values, the nth of values
+      from 2**(n-1) to 2**n-1, and the last of all larger values.
+      Times are in microseconds.
+
+      callback is a list of 32 histograms, one for each GPIO's alert
+      callback.  commands is a dictionary mapping each command number
+      used to a tuple of (calls, longest microseconds).
+
+      ...
+      s = pi.get_statistics()
+      print(s["alertPeriod"][1]) # longest sampling loop period
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      rdata = ""
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(
+            self.sl, _PI_CMD_STATS, int(bool(clear)), 0))
+         if bytes > 0:
+            rdata = self._rxbuf(bytes)
+      _u2i(bytes)
+
+      names = ("version", "size", "seconds", "micros",
+         "alertTicks", "lateTicks", "moreToDo", "numSamples",
+         "maxSamples", "maxEmit", "emitFrags", "cbTicks", "cbCalls",
+         "DMARestarts", "dmaInitCbsCount", "goodPipeWrite",
+         "shortPipeWrite", "wouldBlockPipeWrite", "alertRingFull",
+         "alertRingDropped", "alertRingMaxUsed", "notifyDropped")
+
+      v = struct.unpack_from("{}I".format(bytes // 4), rdata)
+
+      stats = dict(zip(names, v))
+      pos = len(names)
+
+      def histogram(pos):
+         return (v[pos], v[pos+1], list(v[pos+2:pos+18])), pos + 18
+
+      for name in ("alertPeriod", "alertSamples", "emit",
+                   "notifyLatency", "command"):
+         stats[name], pos = histogram(pos)
+
+      stats["callback"] = []
+      for g in range(32):
+         h, pos = histogram(pos)
+         stats["callback"].append(h)
+
+      # version 1 held only the first 128 commands
+      n = 256 if stats["version"] > 1 else 128
+      calls = v[pos:pos+n]
+      longest = v[pos+n:pos+n+n]
+      stats["commands"] = {
+         c: (calls[c], longest[c]) for c in range(n) if calls[c]}
+
+      return stats
+
    def wave_clear(self):
       """
       Clears all waveforms and any data added by calls to the
@@ -2274,13 +2601,18 @@ class pi():
       The wave id is passed to [*wave_send_**] to specify the waveform
       to transmit.
 
+      If a waveform with exactly the same pulses already exists its
+      wave id is returned and no new waveform is built.  Each wave id
+      returned must be deleted once with [*wave_delete*]; the waveform
+      is only removed when the last is deleted.
+
       Normal usage would be
 
       Step 1. [*wave_clear*] to clear all waveforms and added data.
 
       Step 2. [*wave_add_**] calls to supply the waveform data.
 
-      Step 3. [*wave_create*] to create the waveform and get a unique id
+      Step 3. [*wave_create*] to create the waveform and get its id
 
       Repeat steps 2 and 3 as needed.
 
@@ -2351,22 +2683,44 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_WVCAP, percent, 0))
 
+   def wave_lookup(self):
+      """
+      Finds an existing waveform with the same pulses as those
+      provided by the prior calls to the [*wave_add_**] functions.
+
+      Returns the wave id if found, otherwise PI_EMPTY_WAVEFORM or
+      PI_WAVE_NOT_CACHED.
+
+      The added data is not consumed and the waveform is not
+      referenced, so the wave id should not be deleted.  Call
+      [*wave_create*] to take a reference to the waveform, which will
+      then cost little.
+
+      ...
+      try:
+         wid = pi.wave_lookup()
+      except pigpio.error:
+         wid = None
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVLKP, 0, 0))
+
    def wave_delete(self, wave_id):
       """
       This function deletes the waveform with id wave_id.
 
       wave_id:= >=0 (as returned by a prior call to [*wave_create*]).
 
-      Wave ids are allocated in order, 0, 1, 2, etc.
-
-      The wave is flagged for deletion.  The resources used by the wave
-      will only be reused when either of the following apply.
+      If [*wave_create*] returned wave_id more than once, because the
+      same waveform was created again, this only drops one reference
+      and the waveform remains until deleted once for each create.
 
-      - all waves with higher numbered wave ids have been deleted or have
-      been flagged for deletion.
+      A new wave is given the lowest free wave id, 0, 1, 2, etc.
 
-      - a new wave is created which uses exactly the same resources as
-      the current wave (see the C source for gpioWaveCreate for details).
+      The DMA control blocks (CBs) and OOL used by the wave are freed
+      immediately and joined to any free space either side, so they
+      may be used by the next wave created.  A wave must not be
+      deleted while it is being transmitted.
 
       ...
       pi.wave_delete(6) # delete waveform with id 6
@@ -2376,6 +2730,164 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_WVDEL, wave_id, 0))
 
+   def wave_compact(self):
+      """
+      Moves the waveforms which have been created so that the DMA
+      control blocks (CBs) and OOL they use are contiguous, leaving
+      a single range of each free.
+
+      Deleting waves of varying size may leave the free space split
+      into ranges too small for a large wave (see [*wave_get_space*]).
+      Compacting joins them.  Wave ids are unchanged.  The waves can
+      not be moved while any wave is being transmitted or a wave
+      stream is open.
+
+      Returns the number of waves moved.
+
+      ...
+      if pi.wave_get_space()["largestCBs"] < 1000:
+         pi.wave_compact()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVCMP, 0, 0))
+
+   def wave_get_space(self):
+      """
+      Returns the DMA control blocks (CBs) and OOL free for new
+      waveforms as a dictionary.
+
+      waves is the number of waves created and not deleted.  For CBs
+      and for OOL there is the total available to waves (totalCBs,
+      totalOOL), the number free (freeCBs, freeOOL), the largest
+      contiguous run free (largestCBs, largestOOL), and the number
+      of runs free (rangesCBs, rangesOOL).
+
+      A wave needs a single run of CBs and of OOL, so the largest wave
+      which can be created is limited by largestCBs and largestOOL.
+
+      ...
+      s = pi.wave_get_space()
+      print(s["freeCBs"], s["largestCBs"])
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      rdata = ""
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(self.sl, _PI_CMD_WVSPC, 0, 0))
+         if bytes > 0:
+            rdata = self._rxbuf(bytes)
+      _u2i(bytes)
+
+      names = ("waves", "totalCBs", "freeCBs", "largestCBs", "rangesCBs",
+         "totalOOL", "freeOOL", "largestOOL", "rangesOOL")
+
+      v = struct.unpack_from("{}I".format(len(names)), rdata)
+
+      return dict(zip(names, v))
+
+   def wave_builder_open(self):
+      """
+      Opens a wave builder.  A wave builder collects pulse trains
+      which are merged in time order, in a single pass, when the
+      waveform is created.  Several builders may be prepared at
+      the same time.
+
+      Returns a handle (>=0) if OK, otherwise PI_NO_HANDLE.
+
+      ...
+      h = pi.wave_builder_open()
+
+      for g, msg in messages:
+         pi.wave_builder_add_serial(h, g, 9600, msg)
+
+      wid = pi.wave_builder_create(h)
+
+      pi.wave_builder_close(h)
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVBNEW, 0, 0))
+
+   def wave_builder_add_generic(self, handle, pulses):
+      """
+      Adds a pulse train to a wave builder.
+
+      handle:= >=0 (as returned by a prior call to
+                [*wave_builder_open*]).
+      pulses:= list of pulses starting at the start of the waveform.
+
+      Returns the total number of pulses held by the builder.
+      """
+      # pigpio message format
+
+      # I p1 handle
+      # I p2 0
+      # I p3 pulses * 12
+      ## extension ##
+      # III on/off/delay * pulses
+      ext = bytearray()
+      for p in pulses:
+         ext.extend(struct.pack("III", p.gpio_on, p.gpio_off, p.delay))
+      return _u2i(_pigpio_command_ext(
+         self.sl, _PI_CMD_WVBAG, handle, 0, len(ext), [ext]))
+
+   def wave_builder_add_serial(
+      self, handle, user_gpio, baud, data, offset=0, bb_bits=8, bb_stop=2):
+      """
+      Adds a pulse train representing serial data to a wave builder.
+      The serial data starts [*offset*] microseconds from the start
+      of the waveform.
+
+         handle:= >=0 (as returned by a prior call to
+                   [*wave_builder_open*]).
+      user_gpio:= GPIO to transmit data.
+           baud:= 50-1000000 bits per second.
+           data:= the bytes to write.
+         offset:= number of microseconds from the start of the
+                  waveform, default 0.
+        bb_bits:= number of data bits, default 8.
+        bb_stop:= number of stop half bits, default 2.
+
+      Returns the total number of pulses held by the builder.
+
+      The data is formatted as for [*wave_add_serial*].
+      """
+      # pigpio message format
+
+      # I p1 handle
+      # I p2 gpio
+      # I p3 len+16
+      ## extension ##
+      # I baud
+      # I bb_bits
+      # I bb_stop
+      # I offset
+      # s len data bytes
+      extents = [struct.pack("IIII", baud, bb_bits, bb_stop, offset), data]
+      return _u2i(_pigpio_command_ext(
+         self.sl, _PI_CMD_WVBAS, handle, user_gpio, len(data)+16, extents))
+
+   def wave_builder_create(self, handle):
+      """
+      Merges the pulse trains added to a wave builder and creates a
+      waveform from the result.
+
+      handle:= >=0 (as returned by a prior call to
+                [*wave_builder_open*]).
+
+      Returns a wave id (>=0) if OK.  The trains are consumed,
+      leaving the builder open and empty.
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVBCRE, handle, 0))
+
+   def wave_builder_close(self, handle):
+      """
+      Closes a wave builder.
+
+      handle:= >=0 (as returned by a prior call to
+                [*wave_builder_open*]).
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVBDEL, handle, 0))
+
    def wave_tx_start(self): # DEPRECATED
       """
       This function is deprecated and has been removed.
@@ -2510,9 +3022,132 @@ class pi():
 
       pi.wave_tx_stop()
       ...
+
+      It also stops a wave stream (see [*wave_stream_open*]) and
+      drops its queued pulses.  The stream stays open.
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_WVHLT, 0, 0))
 
+   def wave_stream_open(self, segments, segment_cbs, threshold):
+      """
+      Opens a wave stream, which transmits pulses as they are
+      queued rather than as a finished waveform.
+
+         segments:= 2-64, the segments in the ring.
+      segment_cbs:= >=3, the DMA control blocks (CBs) in each segment.
+        threshold:= 1-segments, the free segments which ask for
+                    a refill.
+
+      The stream is a ring of segments taken from the waveform
+      space.  Pulses queued with [*wave_stream_add*] fill the free
+      segments in turn and play without a gap for as long as they
+      are queued in time.
+
+      When the free segments rise to threshold, or the output runs
+      out of pulses, the event set by [*wave_stream_set_event*] is
+      triggered.
+
+      While the stream is open the waveforms can not be transmitted
+      and PI_WAVE_STREAM_OPEN is returned.
+
+      The stream is closed if this connection closes.  It can not
+      be opened if the daemon was started with alerts disabled
+      (pigpiod -m).
+
+      ...
+      pi.wave_stream_open(8, 200, 4)
+      pi.wave_stream_set_event(5)
+      cb = pi.event_callback(5, refill)
+      ...
+      """
+      # pigpio message format
+
+      # I p1 segments
+      # I p2 segment_cbs
+      # I p3 4
+      ## extension ##
+      # I threshold
+      extents = [struct.pack("I", threshold)]
+      return _u2i(_pigpio_command_ext(
+         self.sl, _PI_CMD_WVSOP, segments, segment_cbs, 4, extents))
+
+   def wave_stream_add(self, pulses):
+      """
+      Queues a list of pulses on the wave stream.
+
+      pulses:= list of pulses to queue.
+
+      Returns the number of pulses queued.  If there are not enough
+      free segments for all the pulses the leading ones are queued,
+      which may be none when the ring is full.  The rest should be
+      queued when the stream asks for a refill.
+
+      ...
+      n = pi.wave_stream_add(steps)
+      steps = steps[n:]
+      ...
+      """
+      # pigpio message format
+
+      # I p1 0
+      # I p2 0
+      # I p3 pulses * 12
+      ## extension ##
+      # III on/off/delay * pulses
+      if len(pulses):
+         ext = bytearray()
+         for p in pulses:
+            ext.extend(struct.pack("III", p.gpio_on, p.gpio_off, p.delay))
+         extents = [ext]
+         return _u2i(_pigpio_command_ext(
+            self.sl, _PI_CMD_WVSAD, 0, 0, len(pulses)*12, extents))
+      else:
+         return 0
+
+   def wave_stream_set_event(self, event):
+      """
+      Sets the event triggered when the wave stream asks for a
+      refill.
+
+      event:= 0-31, or WAVE_STREAM_NO_EVENT to cancel.
+
+      ...
+      pi.wave_stream_set_event(5)
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSEV, event, 0))
+
+   def wave_stream_get_free(self):
+      """
+      Returns the number of free wave stream segments.
+
+      ...
+      free = pi.wave_stream_get_free()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSST, 0, 0))
+
+   def wave_stream_get_underruns(self):
+      """
+      Returns the number of times the wave stream output has run
+      out of queued pulses and stopped.  The end of a stream counts.
+
+      ...
+      underruns = pi.wave_stream_get_underruns()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSST, 1, 0))
+
+   def wave_stream_close(self):
+      """
+      Closes the wave stream.  Any pulses still queued are dropped.
+
+      ...
+      pi.wave_stream_close()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSCL, 0, 0))
+
    def wave_chain(self, data):
       """
       This function transmits a chain of waveforms.
@@ -2672,6 +3307,29 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSC, 2, 0))
 
+   def wave_get_cache_hits(self):
+      """
+      Returns the number of times [*wave_create*] found that the
+      waveform already existed and returned its wave id rather than
+      building a new one.
+
+      ...
+      hits = pi.wave_get_cache_hits()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSCH, 0, 0))
+
+   def wave_get_cache_misses(self):
+      """
+      Returns the number of times [*wave_create*] built a new
+      waveform because no identical waveform existed.
+
+      ...
+      misses = pi.wave_get_cache_misses()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_WVSCH, 1, 0))
+
    def i2c_open(self, i2c_bus, i2c_address, i2c_flags=0):
       """
       Returns a handle (>=0) for the device at the I2C bus address.
@@ -5183,7 +5841,9 @@ class pi():
 
       host:= the host name of the Pi on which the pigpio daemon is
              running.  The default is localhost unless overridden by
-             the PIGPIO_ADDR environment variable.
+             the PIGPIO_ADDR environment variable.  unix:path
+             connects to the daemon's Unix domain socket at path
+             on the local Pi (unix: alone uses /var/run/pigpio.sock).
 
       port:= the port number on which the pigpio daemon is listening.
              The default is 8888 unless overridden by the PIGPIO_PORT
@@ -5201,6 +5861,7 @@ class pi():
       pi = pigio.pi()              # use defaults
       pi = pigpio.pi('mypi')       # specify host, default port
       pi = pigpio.pi('mypi', 7777) # specify host and port
+      pi = pigpio.pi('unix:')      # local Unix domain socket
 
       pi = pigpio.pi()             # exit script if no connection
       if not pi.connected:
@@ -5221,10 +5882,11 @@ class pi():
       self._port = port
 
       try:
-         self.sl.s = socket.create_connection((host, port), None)
+         self.sl.s = _pigpio_connect(host, port)
 
          # Disable the Nagle algorithm.
-         self.sl.s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+         if not host.startswith("unix:"):
+            self.sl.s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
          self._notify = _callback_thread(self.sl, host, port)
 
@@ -5343,6 +6005,9 @@ def xref():
    byte_val: 0-255
    A whole number.
 
+   clear: True or False
+   True to zero the statistics once they have been read.
+
    clkfreq: 4689-250M (13184-375M for the BCM2711)
    The hardware clock frequency.
 
@@ -5501,6 +6166,19 @@ def xref():
    PI_CMD_INTERRUPTED = -144
    PI_NOT_ON_BCM2711   = -145
    PI_ONLY_ON_BCM2711  = -146
+   PI_BAD_NOTIFY_SIZE  = -147
+   PI_BAD_BATCH        = -148
+   PI_BAD_TIMER_MICROS = -149
+   PI_BAD_SOCKET_PATH  = -150
+   PI_BAD_SHM_SLOTS    = -151
+   PI_BAD_SHM_CMD      = -152
+   PI_WAVE_TX_BUSY     = -153
+   PI_WAVE_NOT_CACHED  = -154
+   PI_WAVE_STREAM_OPEN = -155
+   PI_NO_WAVE_STREAM   = -156
+   PI_BAD_WAVE_STREAM  = -157
+   PI_BAD_SOCKET_WORKERS = -158
+   PI_NO_ALERTS        = -159
    . .
 
    event:0-31
@@ -5588,6 +6266,7 @@ def xref():
    [*notify_open*]
    [*serial_open*]
    [*spi_open*]
+   [*wave_builder_open*]
 
    host:
    The name or IP address of the Pi running the pigpio daemon.
@@ -5683,6 +6362,9 @@ def xref():
    PUD_UP = 2
    . .
 
+   [*gpio_snapshot*] reports PUD_UNKNOWN (3) for a pull it does
+   not know.
+
    pulse_len: 1-100
    The length of the trigger pulse in microseconds.
 
@@ -5740,12 +6422,23 @@ def xref():
    The number of bytes to move forward (positive) or backwards
    (negative) from the seek position (start, current, or end of file).
 
+   segment_cbs: >=3
+   The DMA control blocks (CBs) in each segment of a wave stream.
+
+   segments: 2-64
+   The number of segments in the ring of a wave stream.
+
    ser_flags: 32 bit
    No serial flags are currently defined.
 
    serial_*:
    One of the serial_ functions.
 
+   settings:
+   A list of tuples each describing the settings to make for one
+   GPIO, see [*gpio_apply*], [*set_PWM_dutycycles*], and
+   [*set_servo_pulsewidths*].
+
    shellscr:
    The name of a shell script.  The script must exist
    in /opt/pigpio/cgi and must be executable.
@@ -5774,6 +6467,10 @@ def xref():
    t2:
    A tick (later).
 
+   threshold: 1-segments
+   The number of free wave stream segments at which the stream
+   asks for a refill.
+
    tty:
    A Pi serial tty device, e.g. /dev/ttyAMA0, /dev/ttyUSB0
 
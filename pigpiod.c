@@ -59,6 +59,8 @@ static int      foreground             = PI_DEFAULT_FOREGROUND;
 static unsigned DMAprimaryChannel      = PI_DEFAULT_DMA_NOT_SET;
 static unsigned DMAsecondaryChannel    = PI_DEFAULT_DMA_NOT_SET;
 static unsigned socketPort             = PI_DEFAULT_SOCKET_PORT;
+static char    *socketPath             = PI_DEFAULT_SOCKET_PATH;
+static unsigned socketWorkers          = PI_DEFAULT_SOCKET_WORKERS;
 static unsigned memAllocMode           = PI_DEFAULT_MEM_ALLOC_MODE;
 static uint64_t updateMask             = -1;
 
@@ -107,13 +109,16 @@ void usage()
       "   -p value,   socket port, 1024-32000,           default 8888\n" \
       "   -s value,   sample rate, 1, 2, 4, 5, 8, or 10, default 5\n" \
       "   -t value,   clock peripheral, 0=PWM 1=PCM,     default PCM\n" \
+      "   -u path,    unix socket path,                  default %s\n" \
+      "   -U,         disable unix socket interface,     default enabled\n" \
       "   -v, -V,     display pigpio version and exit\n" \
+      "   -w value,   socket worker threads, 1-64,       default 4\n" \
       "   -x mask,    GPIO which may be updated,         default board GPIO\n" \
       "EXAMPLE\n" \
       "sudo pigpiod -s 2 -b 200 -f\n" \
       "  Set a sample rate of 2 microseconds with a 200 millisecond\n" \
       "  buffer.  Disable the fifo interface.\n" \
-   "\n", PIGPIO_VERSION);
+   "\n", PIGPIO_VERSION, PI_DEFAULT_SOCKET_PATH);
 }
 
 static uint64_t getNum(char *str, int *err)
@@ -163,7 +168,7 @@ static void initOpts(int argc, char *argv[])
    uint32_t addr;
    int64_t mask;
 
-   while ((opt = getopt(argc, argv, "a:b:c:d:e:fgkln:mp:s:t:x:vV")) != -1)
+   while ((opt = getopt(argc, argv, "a:b:c:d:e:fgkln:mp:s:t:u:Uw:x:vV")) != -1)
    {
       switch (opt)
       {
@@ -263,12 +268,29 @@ static void initOpts(int argc, char *argv[])
             else fatal("invalid -t option (%d)", i);
             break;
 
+         case 'u':
+            if (optarg[0] && (strlen(optarg) <= PI_MAX_SOCKET_PATH))
+               socketPath = optarg;
+            else fatal("invalid -u option (%s)", optarg);
+            break;
+
+         case 'U':
+            ifFlags |= PI_DISABLE_UNIX_IF;
+            break;
+
          case 'v':
          case 'V':
             printf("%d\n", PIGPIO_VERSION);
             exit(EXIT_SUCCESS);
             break;
 
+         case 'w':
+            i = getNum(optarg, &err);
+            if ((i >= PI_MIN_SOCKET_WORKERS) && (i <= PI_MAX_SOCKET_WORKERS))
+               socketWorkers = i;
+            else fatal("invalid -w option (%d)", i);
+            break;
+
          case 'x':
             mask = getNum(optarg, &err);
             if (!err)
@@ -358,6 +380,10 @@ int main(int argc, char **argv)
 
    gpioCfgSocketPort(socketPort);
 
+   gpioCfgSocketPath(socketPath);
+
+   gpioCfgSocketWorkers(socketWorkers);
+
    gpioCfgMemAlloc(memAllocMode);
 
    if (updateMaskSet) gpioCfgPermissions(updateMask);
@@ -252,7 +252,7 @@ static void dispatch_notification(gpioReport_t *r)
          p = p->next;
       }
    }
-   else
+   else if ((r->flags) & PI_NTFY_FLAGS_WDOG)
    {
       g = (r->flags) & 31;
 
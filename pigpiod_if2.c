@@ -37,13 +37,19 @@ For more information, please refer to <http://unlicense.org/>
 #include <time.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <arpa/inet.h>
 
@@ -58,6 +64,20 @@ For more information, please refer to <http://unlicense.org/>
 
 #define MAX_PI 32
 
+#define QUEUE_NONE     0
+#define QUEUE_BATCH    1
+#define QUEUE_PIPELINE 2
+
+#define PIPELINE_MAX 256 /* responses outstanding before some are read */
+
+#define NOTIFY_WORKERS 4 /* default maximum callback dispatch threads */
+
+#define NOTIFY_CMD 0x10000 /* epoll event is for the command socket */
+
+#define ASYNC_MAX 256 /* asynchronous requests outstanding before a read */
+
+#define CMD_SHM_SPIN 0.00005 /* seconds to spin for a shm command result */
+
 typedef void (*CBF_t) ();
 
 struct callback_s
@@ -87,6 +107,97 @@ struct evtCallback_s
    evtCallback_t *next;
 };
 
+typedef struct
+{
+   int       mode;
+   pthread_t thread;    /* the thread queuing commands */
+   char     *frame;     /* batched commands not yet sent */
+   int       frameLen;
+   int       frameSize;
+   int       queued;    /* commands in frame */
+   int       sent;      /* pipelined commands awaiting a response */
+   int      *res;       /* results not yet returned */
+   int       resLen;
+   int       resSize;
+} queue_t;
+
+typedef struct
+{
+   int got;             /* bytes of report[] filled */
+   gpioReport_t report[PI_MAX_REPORTS_PER_READ];
+} notifyBuf_t;
+
+typedef struct
+{
+   pthread_cond_t cond; /* CLOCK_MONOTONIC */
+   int triggered;
+} wfe_t;
+
+typedef struct asyncReq_s asyncReq_t;
+
+struct asyncReq_s
+{
+   asyncReq_t   *next;
+   unsigned      id;
+   int           res;
+   char         *buf;      /* receives any returned data */
+   unsigned      count;
+   asyncCBFunc_t f;        /* NULL to complete to async_wait */
+   void         *userdata;
+};
+
+typedef struct
+{
+   asyncReq_t *first;
+   asyncReq_t *last;
+} asyncList_t;
+
+typedef struct
+{
+   asyncList_t    pending;    /* sent, in order, under gCmdMutex */
+   int            count;      /* requests pending */
+   int            broken;     /* a response could not be read */
+   int            armed;      /* command socket armed in gEpoll */
+   int            kick;       /* a worker found gCmdMutex taken */
+   unsigned       nextId;
+   asyncList_t    ready;      /* callbacks to call, under gAsyncMutex */
+   asyncList_t    done;       /* completions for async_wait */
+   int            delivering; /* a thread is calling the callbacks */
+   pthread_cond_t cond;       /* CLOCK_MONOTONIC, signals done */
+} async_t;
+
+typedef struct
+{
+   CBF_t f;
+   void *user;
+   int   ex;
+   int   edge;
+} cbEntry_t;
+
+typedef struct
+{
+   gpioNotifyShm_t *shm;
+   size_t           len;  /* bytes mapped */
+   uint32_t         size; /* reports, as checked when attached */
+} notifyShm_t;
+
+typedef struct cbTable_s cbTable_t;
+
+/*
+   A snapshot of the callbacks of one pi, indexed by GPIO (or event).
+   Tables are never changed once published.  Registration builds a
+   new table and swaps it in, and the old one is freed once the notify
+   thread can no longer be using it.
+*/
+
+struct cbTable_s
+{
+   cbTable_t *retired;  /* next table awaiting free */
+   uint32_t   bits;     /* GPIO (or events) with callbacks */
+   int        first[33];/* entries for bit b are first[b] to first[b+1]-1 */
+   cbEntry_t  entry[];
+};
+
 /* GLOBALS ---------------------------------------------------------------- */
 
 static int             gPiInUse     [MAX_PI];
@@ -99,743 +210,2354 @@ static uint32_t        gEventBits   [MAX_PI];
 static uint32_t        gNotifyBits  [MAX_PI];
 static uint32_t        gLastLevel   [MAX_PI];
 
-static pthread_t       *gPthNotify  [MAX_PI];
+static notifyBuf_t    *gNotifyBuf  [MAX_PI];
+static int             gNotifyOn   [MAX_PI]; /* registered with gEpoll */
+static uint32_t        gNotifyGen  [MAX_PI]; /* tags this connection's events */
+static int             gNotifyBusy [MAX_PI]; /* a worker is dispatching */
+static pthread_t       gDispatcher [MAX_PI]; /* ... and which one */
+static int             gCmdBusy    [MAX_PI]; /* a worker is reading replies */
+static pthread_t       gCmdWorker  [MAX_PI]; /* ... and which one */
 
 static pthread_mutex_t gCmdMutex    [MAX_PI];
 static int             gCancelState [MAX_PI];
 
-static callback_t *gCallBackFirst = 0;
-static callback_t *gCallBackLast  = 0;
+static queue_t         gQueue       [MAX_PI];
 
-static evtCallback_t *geCallBackFirst = 0;
-static evtCallback_t *geCallBackLast  = 0;
+static async_t         gAsync       [MAX_PI];
 
-/* PRIVATE ---------------------------------------------------------------- */
+static gpioCommandShm_t *gCmdShm     [MAX_PI]; /* set if commands use shm */
+static size_t          gCmdShmLen   [MAX_PI];
+static int             gCmdShmHandle[MAX_PI];
+static int             gCmdShmSpin = -1;
 
-static void _pml(int pi)
-{
-   int cancelState;
+static pthread_mutex_t gAsyncMutex = PTHREAD_MUTEX_INITIALIZER;
 
-   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
-   pthread_mutex_lock(&gCmdMutex[pi]);
-   gCancelState[pi] = cancelState;
-}
+static pthread_mutex_t gQueueMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static void _pmu(int pi)
-{
-   int cancelState;
+static pthread_mutex_t gWfeMutex = PTHREAD_MUTEX_INITIALIZER;
 
-   cancelState = gCancelState[pi];
-   pthread_mutex_unlock(&gCmdMutex[pi]);
-   pthread_setcancelstate(cancelState, NULL);
-}
+/*
+   The ring size of each attached notification is kept here.  The
+   size in the shared memory is not trusted once checked against the
+   mapping.
+*/
 
-static int pigpio_command(int pi, int command, int p1, int p2, int rl)
-{
-   cmdCmd_t cmd;
+static notifyShm_t     gNotifyShm[PI_NOTIFY_SLOTS];
+static pthread_mutex_t gNotifyShmMutex = PTHREAD_MUTEX_INITIALIZER;
 
-   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
-      return pigif_unconnected_pi;
+/*
+   The notification sockets of all Pis share one epoll set.  A pool of
+   worker threads waits on the set, each connection being armed one
+   shot so that only one worker at a time reads and dispatches a Pi's
+   reports, keeping its callbacks in order.
+*/
 
-   cmd.cmd = command;
-   cmd.p1  = p1;
-   cmd.p2  = p2;
-   cmd.res = 0;
+static int             gEpoll = -1;
+static int             gNotifying;      /* connections registered */
+static int             gWorkers;        /* worker threads started */
+static int             gMaxWorkers = NOTIFY_WORKERS;
+static pthread_t      *gWorker     [MAX_PI];
+static pthread_mutex_t gNotifyMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gNotifyIdle  = PTHREAD_COND_INITIALIZER;
 
-   _pml(pi);
+static cbTable_t      *gCallbacks   [MAX_PI]; /* read by dispatch */
+static cbTable_t      *gEvtCallbacks[MAX_PI];
+static cbTable_t      *gRetired     [MAX_PI]; /* freed by notify thread */
+static uint32_t        gDispatchSeq [MAX_PI]; /* odd while dispatching */
 
-   if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
-   {
-      _pmu(pi);
-      return pigif_bad_send;
-   }
+/* the registration lists and tables are changed under gCallbackMutex */
 
-   if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
-   {
-      _pmu(pi);
-      return pigif_bad_recv;
-   }
+static pthread_mutex_t gCallbackMutex = PTHREAD_MUTEX_INITIALIZER;
 
-   if (rl) _pmu(pi);
+static int gCallbackId = 0;
+static int gEvtCallbackId = 0;
 
-   return cmd.res;
-}
+static callback_t *gCallBackFirst = 0;
+static callback_t *gCallBackLast  = 0;
 
-static int pigpio_notify(int pi)
+static evtCallback_t *geCallBackFirst = 0;
+static evtCallback_t *geCallBackLast  = 0;
+
+/* PRIVATE ---------------------------------------------------------------- */
+
+static int queue_owned(int pi)
 {
-   cmdCmd_t cmd;
+   return (gQueue[pi].mode != QUEUE_NONE) &&
+          pthread_equal(gQueue[pi].thread, pthread_self());
+}
 
-   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
-      return pigif_unconnected_pi;
+static int recvMax(int pi, void *buf, int bufsize, int sent)
+{
+   /*
+   Copy at most bufSize bytes from the receieved message to
+   buf.  Discard the rest of the message.
+   */
+   uint8_t scratch[4096];
+   int remaining, fetch, count;
 
-   cmd.cmd = PI_CMD_NOIB;
-   cmd.p1  = 0;
-   cmd.p2  = 0;
-   cmd.res = 0;
+   if (sent < bufsize) count = sent; else count = bufsize;
 
-   _pml(pi);
+   if (count) recv(gPigCommand[pi], buf, count, MSG_WAITALL);
 
-   if (send(gPigNotify[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
-   {
-      _pmu(pi);
-      return pigif_bad_send;
-   }
+   remaining = sent - count;
 
-   if (recv(gPigNotify[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
+   while (remaining)
    {
-      _pmu(pi);
-      return pigif_bad_recv;
+      fetch = remaining;
+      if (fetch > sizeof(scratch)) fetch = sizeof(scratch);
+      recv(gPigCommand[pi], scratch, fetch, MSG_WAITALL);
+      remaining -= fetch;
    }
 
-   _pmu(pi);
-
-   return cmd.res;
+   return count;
 }
 
-static int pigpio_command_ext
-   (int pi, int command, int p1, int p2, int p3,
-    int extents, gpioExtent_t *ext, int rl)
+static void async_append(asyncList_t *l, asyncReq_t *r)
 {
-   int i;
-   cmdCmd_t cmd;
+   r->next = NULL;
 
-   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
-      return pigif_unconnected_pi;
+   if (l->last) l->last->next = r;
+   else         l->first = r;
 
-   cmd.cmd = command;
-   cmd.p1  = p1;
-   cmd.p2  = p2;
-   cmd.p3  = p3;
+   l->last = r;
+}
 
-   _pml(pi);
+static asyncReq_t *async_pop(asyncList_t *l)
+{
+   asyncReq_t *r;
 
-   if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
-   {
-      _pmu(pi);
-      return pigif_bad_send;
-   }
+   r = l->first;
 
-   for (i=0; i<extents; i++)
+   if (r)
    {
-      if (send(gPigCommand[pi], ext[i].ptr, ext[i].size, 0) != ext[i].size)
-      {
-         _pmu(pi);
-         return pigif_bad_send;
-      }
-   }
+      l->first = r->next;
 
-   if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
-   {
-      _pmu(pi);
-      return pigif_bad_recv;
+      if (l->first == NULL) l->last = NULL;
    }
-   if (rl) _pmu(pi);
 
-   return cmd.res;
+   return r;
 }
 
-static int pigpioOpenSocket(const char *addrStr, const char *portStr)
+static void async_arm(int pi, int on)
 {
-   int sock, err, opt;
-   struct addrinfo hints, *res, *rp;
+   /* called with gCmdMutex held */
 
-   memset (&hints, 0, sizeof (hints));
+   struct epoll_event ev;
 
-   hints.ai_family   = PF_UNSPEC;
-   hints.ai_socktype = SOCK_STREAM;
-   hints.ai_flags   |= AI_CANONNAME;
+   if (!gNotifyOn[pi]) return;
 
-   err = getaddrinfo (addrStr, portStr, &hints, &res);
+   ev.events = EPOLLONESHOT;
 
-   if (err) return pigif_bad_getaddrinfo;
+   if (on) ev.events |= EPOLLIN;
 
-   for (rp=res; rp!=NULL; rp=rp->ai_next)
-   {
-      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+   ev.data.u64 = ((uint64_t)gNotifyGen[pi] << 32) | NOTIFY_CMD | pi;
 
-      if (sock == -1) continue;
+   epoll_ctl(gEpoll, EPOLL_CTL_MOD, gPigCommand[pi], &ev);
 
-      /* Disable the Nagle algorithm. */
-      opt = 1;
-      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+   gAsync[pi].armed = on;
+}
 
-      if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) break;
-   }
+static void async_complete(int pi, asyncReq_t *r)
+{
+   async_t *a;
 
-   freeaddrinfo(res);
+   a = &gAsync[pi];
 
-   if (rp == NULL) return pigif_bad_connect;
+   pthread_mutex_lock(&gAsyncMutex);
 
-   return sock;
+   if (r->f) async_append(&a->ready, r);
+   else
+   {
+      async_append(&a->done, r);
+      pthread_cond_broadcast(&a->cond);
+   }
+
+   pthread_mutex_unlock(&gAsyncMutex);
 }
 
-static void dispatch_notification(int pi, gpioReport_t *r)
+static void async_read(int pi, int wait)
 {
-   callback_t *p;
-   evtCallback_t *ep;
-   uint32_t changed;
-   int l, g;
-
-/*
-   printf("s=%4x f=%4x t=%10u l=%8x\n",
-      r->seqno, r->flags, r->tick, r->level);
-*/
-
-   if (r->flags == 0)
-   {
-      changed = (r->level ^ gLastLevel[pi]) & gNotifyBits[pi];
+   /*
+      Called with gCmdMutex held.  Reads the responses to asynchronous
+      requests in the order the requests were sent.  If wait is set all
+      are read, otherwise only those which have arrived.
+   */
 
-      gLastLevel[pi] = r->level;
+   async_t *a;
+   asyncReq_t *r;
+   cmdCmd_t cmd;
+   char c;
 
-      p = gCallBackFirst;
+   a = &gAsync[pi];
 
-      while (p)
-      {
-         if (((p->pi) == pi) && (changed & (1<<(p->gpio))))
-         {
-            if ((r->level) & (1<<(p->gpio))) l = 1; else l = 0;
-            if ((p->edge) ^ l)
-            {
-               if (p->ex) (p->f)(pi, p->gpio, l, r->tick, p->user);
-               else       (p->f)(pi, p->gpio, l, r->tick);
-            }
-         }
-         p = p->next;
-      }
-   }
-   else
+   while (a->pending.first)
    {
-      if ((r->flags) & PI_NTFY_FLAGS_WDOG)
+      if (!a->broken)
       {
-         g = (r->flags) & 31;
+         if (!wait &&
+             (recv(gPigCommand[pi], &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0) &&
+             ((errno == EAGAIN) || (errno == EINTR)))
+            break;
+
+         if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) !=
+               sizeof(cmd))
+            a->broken = 1;
+      }
 
-         p = gCallBackFirst;
+      r = async_pop(&a->pending);
+      a->count--;
 
-         while (p)
-         {
-            if (((p->pi) == pi) && ((p->gpio) == g))
-            {
-               if (p->ex) (p->f)(pi, g, PI_TIMEOUT, r->tick, p->user);
-               else       (p->f)(pi, g, PI_TIMEOUT, r->tick);
-            }
-            p = p->next;
-         }
-      }
-      else if ((r->flags) & PI_NTFY_FLAGS_EVENT)
+      if (a->broken) r->res = pigif_bad_recv;
+      else
       {
-         g = (r->flags) & 31;
-
-         ep = geCallBackFirst;
+         r->res = cmd.res;
 
-         while (ep)
-         {
-            if (((ep->pi) == pi) && ((ep->event) == g))
-            {
-               if (ep->ex) (ep->f)(pi, g, r->tick, ep->user);
-               else        (ep->f)(pi, g, r->tick);
-            }
-            ep = ep->next;
-         }
+         if (r->buf && (r->res > 0))
+            r->res = recvMax(pi, r->buf, r->count, r->res);
       }
+
+      async_complete(pi, r);
    }
 }
 
-static void *pthNotifyThread(void *x)
+static void async_deliver(int pi)
 {
-   static int got = 0;
-   int pi;
-   int bytes, r;
-   gpioReport_t report[PI_MAX_REPORTS_PER_READ];
+   async_t *a;
+   asyncReq_t *r;
 
-   pi = *((int*)x);
-   free(x); /* memory allocated in pigpio_start */
+   /* one thread at a time calls the callbacks of a pi, in order */
 
-   while (1)
-   {
-      bytes = read(gPigNotify[pi], (char*)&report+got, sizeof(report)-got);
+   a = &gAsync[pi];
 
-      if (bytes > 0) got += bytes;
-      else break;
+   pthread_mutex_lock(&gAsyncMutex);
 
-      r = 0;
+   if (!a->delivering)
+   {
+      a->delivering = 1;
 
-      while (got >= sizeof(gpioReport_t))
+      while ((r = async_pop(&a->ready)))
       {
-         dispatch_notification(pi, &report[r]);
+         pthread_mutex_unlock(&gAsyncMutex);
 
-         r++;
+         (r->f)(pi, r->id, r->res, r->userdata);
 
-         got -= sizeof(gpioReport_t);
+         free(r);
+
+         pthread_mutex_lock(&gAsyncMutex);
       }
 
-      /* copy any partial report to start of array */
-      
-      if (got && r) report[0] = report[r];
+      a->delivering = 0;
    }
 
-   fprintf(stderr, "notify thread for pi %d broke with read error %d\n",
-      pi, bytes);
-
-   while (1) sleep(1);
-
-   return NULL;
+   pthread_mutex_unlock(&gAsyncMutex);
 }
 
-static void findNotifyBits(int pi)
+static void async_release(int pi)
 {
-   callback_t *p;
-   uint32_t bits = 0;
+   async_t *a;
 
-   p = gCallBackFirst;
+   /*
+      Unlocks gCmdMutex.  Responses which have arrived are read first
+      and the socket is armed so that a worker reads the rest.  A worker
+      which found the lock taken sets kick and leaves the reading to us.
+   */
 
-   while (p)
-   {
-      if (p->pi == pi) bits |= (1<<(p->gpio));
-      p = p->next;
-   }
+   a = &gAsync[pi];
 
-   if (bits != gNotifyBits[pi])
+   do
    {
-      gNotifyBits[pi] = bits;
-      pigpio_command(pi, PI_CMD_NB, gPigHandle[pi], gNotifyBits[pi], 1);
+      __atomic_store_n(&a->kick, 0, __ATOMIC_SEQ_CST);
+
+      if (a->count) async_read(pi, 0);
+
+      if (a->count) async_arm(pi, 1);
+      else if (a->armed) async_arm(pi, 0);
+
+      pthread_mutex_unlock(&gCmdMutex[pi]);
+
+      if (a->ready.first) async_deliver(pi);
    }
+   while (__atomic_load_n(&a->kick, __ATOMIC_SEQ_CST) &&
+          (pthread_mutex_trylock(&gCmdMutex[pi]) == 0));
 }
 
-static void _wfe(
-   int pi, unsigned user_gpio, unsigned level, uint32_t tick, void *user)
+static void async_init(int pi)
 {
-   *(int *)user = 1;
+   pthread_condattr_t attr;
+   async_t *a;
+
+   a = &gAsync[pi];
+
+   a->count  = 0;
+   a->broken = 0;
+   a->armed  = 0;
+
+   a->pending.first = NULL;
+   a->pending.last  = NULL;
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&a->cond, &attr);
+   pthread_condattr_destroy(&attr);
 }
 
-static int intCallback(
-   int pi, unsigned user_gpio, unsigned edge, void *f, void *user, int ex)
+static void async_event(int pi)
 {
-   static int id = 0;
-   callback_t *p;
+   /* called by a worker when a response arrives */
 
-   if ((user_gpio >=0) && (user_gpio < 32) && (edge >=0) && (edge <= 2) && f)
+   __atomic_store_n(&gAsync[pi].kick, 1, __ATOMIC_SEQ_CST);
+
+   if (pthread_mutex_trylock(&gCmdMutex[pi]) == 0)
    {
-      /* prevent duplicates */
+      gAsync[pi].armed = 0; /* one shot */
 
-      p = gCallBackFirst;
+      async_release(pi);
+   }
+}
 
-      while (p)
-      {
-         if ((p->pi   == pi)        &&
-             (p->gpio == user_gpio) &&
-             (p->edge == edge)      &&
-             (p->f    == f))
-         {
-            return pigif_duplicate_callback;
-         }
-         p = p->next;
-      }
+static void _pml(int pi)
+{
+   int cancelState;
 
-      p = malloc(sizeof(callback_t));
+   /* a pipelining thread holds the lock until pipeline_end */
 
-      if (p)
-      {
-         if (!gCallBackFirst) gCallBackFirst = p;
+   if (queue_owned(pi) && (gQueue[pi].mode == QUEUE_PIPELINE)) return;
 
-         p->id = id++;
-         p->pi = pi;
-         p->gpio = user_gpio;
-         p->edge = edge;
-         p->f = f;
-         p->user = user;
-         p->ex = ex;
-         p->next = 0;
-         p->prev = gCallBackLast;
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+   pthread_mutex_lock(&gCmdMutex[pi]);
+   gCancelState[pi] = cancelState;
 
-         if (p->prev) (p->prev)->next = p;
-         gCallBackLast = p;
+   /* the responses to earlier asynchronous requests come first */
 
-         findNotifyBits(pi);
+   if (gAsync[pi].count) async_read(pi, 1);
+}
 
-         return p->id;
-      }
+static void _pmu(int pi)
+{
+   int cancelState;
 
-      return pigif_bad_malloc;
-   }
+   if (queue_owned(pi) && (gQueue[pi].mode == QUEUE_PIPELINE)) return;
 
-   return pigif_bad_callback;
+   cancelState = gCancelState[pi];
+   async_release(pi);
+   pthread_setcancelstate(cancelState, NULL);
 }
 
-static void findEventBits(int pi)
+static int queue_result(int pi, int res)
 {
-   evtCallback_t *ep;
-   uint32_t bits = 0;
+   queue_t *q;
+   int *r;
 
-   ep = geCallBackFirst;
+   q = &gQueue[pi];
 
-   while (ep)
+   if (q->resLen >= q->resSize)
    {
-      if (ep->pi == pi) bits |= (1<<(ep->event));
-      ep = ep->next;
-   }
+      r = realloc(q->res, (q->resSize + 64) * 2 * sizeof(int));
 
-   if (bits != gEventBits[pi])
-   {
-      gEventBits[pi] = bits;
-      pigpio_command(pi, PI_CMD_EVM, gPigHandle[pi], gEventBits[pi], 1);
+      if (r == NULL) return pigif_bad_malloc;
+
+      q->res = r;
+      q->resSize = (q->resSize + 64) * 2;
    }
-}
 
-static void _ewfe(
-   int pi, unsigned event, uint32_t tick, void *user)
-{
-   *(int *)user = 1;
+   q->res[q->resLen++] = res;
+
+   return 0;
 }
 
-static int intEventCallback(
-   int pi, unsigned event, void *f, void *user, int ex)
+static int queue_send_batch(int pi)
 {
-   static int id = 0;
-   evtCallback_t *ep;
+   queue_t *q;
+   cmdCmd_t cmd;
+   int32_t *reply;
+   int i, status, replies;
 
-   if ((event >=0) && (event < 32) && f)
-   {
-      /* prevent duplicates */
+   q = &gQueue[pi];
 
-      ep = geCallBackFirst;
+   if (!q->queued) return 0;
 
-      while (ep)
-      {
-         if ((ep->pi    == pi)    &&
-             (ep->event == event) &&
-             (ep->f     == f))
-         {
-            return pigif_duplicate_callback;
-         }
-         ep = ep->next;
-      }
+   cmd.cmd = PI_CMD_BATCH;
+   cmd.p1  = q->queued;
+   cmd.p2  = 0;
+   cmd.p3  = q->frameLen;
 
-      ep = malloc(sizeof(evtCallback_t));
+   status = 0;
+   replies = 0;
+   reply = NULL;
 
-      if (ep)
-      {
-         if (!geCallBackFirst) geCallBackFirst = ep;
+   _pml(pi);
 
-         ep->id = id++;
-         ep->pi = pi;
-         ep->event = event;
-         ep->f = f;
-         ep->user = user;
-         ep->ex = ex;
-         ep->next = 0;
-         ep->prev = geCallBackLast;
+   if ((send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd)) ||
+       (send(gPigCommand[pi], q->frame, q->frameLen, 0) != q->frameLen))
+   {
+      status = pigif_bad_send;
+   }
+   else if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) !=
+               sizeof(cmd))
+   {
+      status = pigif_bad_recv;
+   }
+   else if (((int)cmd.res) < 0) status = cmd.res;
+   else if (cmd.res)
+   {
+      /* queued commands return no data, just a result each */
 
-         if (ep->prev) (ep->prev)->next = ep;
-         geCallBackLast = ep;
+      reply = malloc(cmd.res);
 
-         findEventBits(pi);
+      if (reply == NULL) status = pigif_bad_malloc;
+      else if (recv(gPigCommand[pi], reply, cmd.res, MSG_WAITALL) != cmd.res)
+         status = pigif_bad_recv;
+      else replies = cmd.res / 4;
+   }
 
-         return ep->id;
-      }
+   _pmu(pi);
 
-      return pigif_bad_malloc;
+   for (i=0; i<q->queued; i++)
+   {
+      if (i < replies) queue_result(pi, reply[i]);
+      else if (status) queue_result(pi, status);
+      else queue_result(pi, PI_BAD_BATCH);
    }
 
-   return pigif_bad_callback;
+   free(reply);
+
+   q->queued = 0;
+   q->frameLen = 0;
+
+   return status;
 }
 
-static int recvMax(int pi, void *buf, int bufsize, int sent)
+static int queue_collect(int pi)
 {
-   /*
-   Copy at most bufSize bytes from the receieved message to
-   buf.  Discard the rest of the message.
-   */
-   uint8_t scratch[4096];
-   int remaining, fetch, count;
-
-   if (sent < bufsize) count = sent; else count = bufsize;
+   queue_t *q;
+   cmdCmd_t cmd;
+   int status;
 
-   if (count) recv(gPigCommand[pi], buf, count, MSG_WAITALL);
+   q = &gQueue[pi];
 
-   remaining = sent - count;
+   status = 0;
 
-   while (remaining)
+   while (q->sent)
    {
-      fetch = remaining;
-      if (fetch > sizeof(scratch)) fetch = sizeof(scratch);
-      recv(gPigCommand[pi], scratch, fetch, MSG_WAITALL);
-      remaining -= fetch;
+      if (!status &&
+          (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) !=
+             sizeof(cmd)))
+      {
+         status = pigif_bad_recv;
+      }
+
+      if (status) queue_result(pi, status);
+      else        queue_result(pi, cmd.res);
+
+      q->sent--;
    }
 
-   return count;
+   return status;
 }
 
-/* PUBLIC ----------------------------------------------------------------- */
-
-double time_time(void)
+static int queue_sync(int pi)
 {
-   struct timeval tv;
-   double t;
-
-   gettimeofday(&tv, 0);
+   /* send or collect everything queued so far */
 
-   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
-
-   return t;
+   if (gQueue[pi].mode == QUEUE_BATCH) return queue_send_batch(pi);
+   else                                return queue_collect(pi);
 }
 
-void time_sleep(double seconds)
+static int queue_command
+   (int pi, int command, int p1, int p2, int p3,
+    int extents, gpioExtent_t *ext)
 {
-   struct timespec ts, rem;
+   queue_t *q;
+   cmdCmd_t cmd;
+   char *frame;
+   int i, size;
 
-   if (seconds > 0.0)
+   q = &gQueue[pi];
+
+   cmd.cmd = command;
+   cmd.p1  = p1;
+   cmd.p2  = p2;
+   cmd.p3  = p3;
+
+   if (q->mode == QUEUE_BATCH)
    {
-      ts.tv_sec = seconds;
-      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
+      size = sizeof(cmd) + p3;
 
-      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
+      if (size >= CMD_MAX_EXTENSION) return PI_BAD_BATCH;
+
+      if ((q->frameLen + size) >= CMD_MAX_EXTENSION) queue_send_batch(pi);
+
+      if ((q->frameLen + size) > q->frameSize)
       {
-         /* copy remaining time to ts */
-         ts.tv_sec  = rem.tv_sec;
-         ts.tv_nsec = rem.tv_nsec;
+         frame = realloc(q->frame, q->frameLen + size + 1024);
+
+         if (frame == NULL) return pigif_bad_malloc;
+
+         q->frame = frame;
+         q->frameSize = q->frameLen + size + 1024;
       }
-   }
-}
 
-char *pigpio_error(int errnum)
-{
-   if (errnum > -1000) return cmdErrStr(errnum);
+      memcpy(q->frame + q->frameLen, &cmd, sizeof(cmd));
+
+      q->frameLen += sizeof(cmd);
+
+      for (i=0; i<extents; i++)
+      {
+         memcpy(q->frame + q->frameLen, ext[i].ptr, ext[i].size);
+
+         q->frameLen += ext[i].size;
+      }
+
+      q->queued++;
+   }
    else
    {
-      switch(errnum)
-      {
-         case pigif_bad_send:
-            return "failed to send to pigpiod";
-         case pigif_bad_recv:
-            return "failed to receive from pigpiod";
-         case pigif_bad_getaddrinfo:
-            return "failed to find address of pigpiod";
-         case pigif_bad_connect:
-            return "failed to connect to pigpiod";
-         case pigif_bad_socket:
-            return "failed to create socket";
-         case pigif_bad_noib:
-            return "failed to open notification in band";
-         case pigif_duplicate_callback:
-            return "identical callback exists";
-         case pigif_bad_malloc:
-            return "failed to malloc";
-         case pigif_bad_callback:
-            return "bad callback parameter";
-         case pigif_notify_failed:
-            return "failed to create notification thread";
-         case pigif_callback_not_found:
-            return "callback not found";
-         case pigif_unconnected_pi:
-            return "not connected to Pi";
-         case pigif_too_many_pis:
-            return "too many connected Pis";
+      /* don't let the responses back up into the daemon */
 
-         default:
-            return "unknown error";
+      if (q->sent >= PIPELINE_MAX) queue_collect(pi);
+
+      if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
+         return pigif_bad_send;
+
+      for (i=0; i<extents; i++)
+      {
+         if (send(gPigCommand[pi], ext[i].ptr, ext[i].size, 0) !=
+                ext[i].size)
+            return pigif_bad_send;
       }
+
+      q->sent++;
    }
-}
 
-unsigned pigpiod_if_version(void)
-{
-   return PIGPIOD_IF2_VERSION;
+   return 0;
 }
 
-pthread_t *start_thread(gpioThreadFunc_t thread_func, void *userdata)
+/*
+   With a shared memory command region open, commands without
+   extensions are written to the region instead of the socket.  The
+   daemon's thread is spun on briefly and then slept on.  Anything it
+   rejects is sent on the socket as usual.
+*/
+
+static int cmd_shm_command(int pi, int command, int p1, int p2)
 {
-   pthread_t *pth;
-   pthread_attr_t pthAttr;
+   gpioCommandShm_t *shm;
+   gpioCommandSlot_t *slot;
+   uint32_t head;
+   double spinEnd;
+   struct timespec ts;
+   char c;
 
-   pth = malloc(sizeof(pthread_t));
+   /* spinning only helps if the daemon can run at the same time */
 
-   if (pth)
+   if (gCmdShmSpin < 0)
+      gCmdShmSpin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? 1 : 0;
+
+   shm = gCmdShm[pi];
+
+   head = shm->head;
+
+   slot = &shm->slot[head & (shm->size - 1)];
+
+   slot->cmd = command;
+   slot->p1  = p1;
+   slot->p2  = p2;
+
+   __atomic_store_n(&shm->head, ++head, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&shm->reqWaiting, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &shm->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+   spinEnd = 0.0;
+
+   while (__atomic_load_n(&shm->done, __ATOMIC_ACQUIRE) != head)
    {
-      if (pthread_attr_init(&pthAttr))
-      {
-         perror("pthread_attr_init failed");
-         free(pth);
-         return NULL;
-      }
+      if (spinEnd == 0.0)
+         spinEnd = time_time() + (gCmdShmSpin ? CMD_SHM_SPIN : 0.0);
 
-      if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      if (time_time() < spinEnd)
       {
-         perror("pthread_attr_setstacksize failed");
-         free(pth);
-         return NULL;
+         sched_yield();
+         continue;
       }
 
-      if (pthread_create(pth, &pthAttr, thread_func, userdata))
+      __atomic_store_n(&shm->resWaiting, 1, __ATOMIC_SEQ_CST);
+
+      if (__atomic_load_n(&shm->done, __ATOMIC_SEQ_CST) == (head - 1))
       {
-         perror("pthread_create socket failed");
-         free(pth);
-         return NULL;
+         ts.tv_sec  = 1;
+         ts.tv_nsec = 0;
+
+         if (syscall(SYS_futex, &shm->done, FUTEX_WAIT, head - 1, &ts,
+                NULL, 0) && (errno == ETIMEDOUT))
+         {
+            /* check the daemon is still there */
+
+            if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+                   PI_COMMAND_SHM_MAGIC) ||
+                (recv(gPigCommand[pi], &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0))
+            {
+               __atomic_store_n(&shm->resWaiting, 0, __ATOMIC_SEQ_CST);
+               return pigif_bad_recv;
+            }
+         }
       }
+
+      __atomic_store_n(&shm->resWaiting, 0, __ATOMIC_SEQ_CST);
    }
-   return pth;
+
+   return slot->res;
 }
 
-void stop_thread(pthread_t *pth)
+static void cmd_shm_unmap(int pi)
 {
-   if (pth)
+   if (gCmdShm[pi])
    {
-      pthread_cancel(*pth);
-      pthread_join(*pth, NULL);
-      free(pth);
+      munmap(gCmdShm[pi], gCmdShmLen[pi]);
+      gCmdShm[pi] = NULL;
    }
 }
 
-int pigpio_start(const char *addrStr, const char *portStr)
+static int pigpio_command_direct(
+   int pi, int command, int p1, int p2, int rl)
 {
-   int pi;
-   int *userdata;
+   /* sends the command now, the caller having dealt with any queue */
 
-   for (pi=0; pi<MAX_PI; pi++)
-   {
-      if (!gPiInUse[pi]) break;
-   }
+   cmdCmd_t cmd;
+   int res;
 
-   if (pi >= MAX_PI) return pigif_too_many_pis;
+   cmd.cmd = command;
+   cmd.p1  = p1;
+   cmd.p2  = p2;
+   cmd.res = 0;
+
+   _pml(pi);
+
+   if (rl && gCmdShm[pi])
+   {
+      res = cmd_shm_command(pi, command, p1, p2);
+
+      if (res != PI_BAD_SHM_CMD)
+      {
+         _pmu(pi);
+         return res;
+      }
+   }
+
+   if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_send;
+   }
+
+   if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_recv;
+   }
+
+   if (rl) _pmu(pi);
+
+   return cmd.res;
+}
+
+static int pigpio_command(int pi, int command, int p1, int p2, int rl)
+{
+   int res;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (queue_owned(pi))
+   {
+      /* commands returning data are run once the queue is flushed */
+
+      if (rl) return queue_command(pi, command, p1, p2, 0, 0, NULL);
+
+      queue_sync(pi);
+
+      res = pigpio_command_direct(pi, command, p1, p2, rl);
+
+      /* it still takes its place in the results */
+
+      queue_result(pi, res);
+
+      return res;
+   }
+
+   return pigpio_command_direct(pi, command, p1, p2, rl);
+}
+
+static int pigpio_notify(int pi)
+{
+   cmdCmd_t cmd;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   cmd.cmd = PI_CMD_NOIB;
+   cmd.p1  = 0;
+   cmd.p2  = 0;
+   cmd.res = 0;
+
+   _pml(pi);
+
+   if (send(gPigNotify[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_send;
+   }
+
+   if (recv(gPigNotify[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_recv;
+   }
+
+   _pmu(pi);
+
+   return cmd.res;
+}
+
+static int pigpio_command_ext_direct
+   (int pi, int command, int p1, int p2, int p3,
+    int extents, gpioExtent_t *ext, int rl)
+{
+   int i;
+   cmdCmd_t cmd;
+
+   cmd.cmd = command;
+   cmd.p1  = p1;
+   cmd.p2  = p2;
+   cmd.p3  = p3;
+
+   _pml(pi);
+
+   if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_send;
+   }
+
+   for (i=0; i<extents; i++)
+   {
+      if (send(gPigCommand[pi], ext[i].ptr, ext[i].size, 0) != ext[i].size)
+      {
+         _pmu(pi);
+         return pigif_bad_send;
+      }
+   }
+
+   if (recv(gPigCommand[pi], &cmd, sizeof(cmd), MSG_WAITALL) != sizeof(cmd))
+   {
+      _pmu(pi);
+      return pigif_bad_recv;
+   }
+   if (rl) _pmu(pi);
+
+   return cmd.res;
+}
+
+static int pigpio_command_ext
+   (int pi, int command, int p1, int p2, int p3,
+    int extents, gpioExtent_t *ext, int rl)
+{
+   int res;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (queue_owned(pi))
+   {
+      if (rl) return queue_command(pi, command, p1, p2, p3, extents, ext);
+
+      queue_sync(pi);
+
+      res = pigpio_command_ext_direct(
+         pi, command, p1, p2, p3, extents, ext, rl);
+
+      /* it still takes its place in the results */
+
+      queue_result(pi, res);
+
+      return res;
+   }
+
+   return pigpio_command_ext_direct(
+      pi, command, p1, p2, p3, extents, ext, rl);
+}
+
+static int async_command
+   (int pi, int command, int p1, int p2, int p3,
+    int extents, gpioExtent_t *ext,
+    char *buf, unsigned count, asyncCBFunc_t f, void *userdata)
+{
+   async_t *a;
+   asyncReq_t *r;
+   cmdCmd_t cmd;
+   int i, status, cancelState;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   /* the responses would be taken as those of the queued commands */
+
+   if (queue_owned(pi)) return pigif_queue_busy;
+
+   r = malloc(sizeof(asyncReq_t));
+
+   if (r == NULL) return pigif_bad_malloc;
+
+   r->buf      = buf;
+   r->count    = count;
+   r->f        = f;
+   r->userdata = userdata;
+
+   cmd.cmd = command;
+   cmd.p1  = p1;
+   cmd.p2  = p2;
+   cmd.p3  = p3;
+
+   a = &gAsync[pi];
+
+   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+   pthread_mutex_lock(&gCmdMutex[pi]);
+   gCancelState[pi] = cancelState;
+
+   /* don't let the responses back up into the daemon */
+
+   if (a->count >= ASYNC_MAX) async_read(pi, 1);
+
+   r->id = a->nextId++ & 0x7FFFFFFF;
+
+   status = r->id;
+
+   if (send(gPigCommand[pi], &cmd, sizeof(cmd), 0) != sizeof(cmd))
+      status = pigif_bad_send;
+
+   for (i=0; (i<extents) && (status >= 0); i++)
+   {
+      if (send(gPigCommand[pi], ext[i].ptr, ext[i].size, 0) != ext[i].size)
+         status = pigif_bad_send;
+   }
+
+   if (status >= 0)
+   {
+      async_append(&a->pending, r);
+      a->count++;
+   }
+   else free(r);
+
+   cancelState = gCancelState[pi];
+   async_release(pi);
+   pthread_setcancelstate(cancelState, NULL);
+
+   return status;
+}
+
+static int pigpioOpenUnixSocket(const char *path)
+{
+   int sock;
+   struct sockaddr_un addr;
+
+   if (!path[0]) path = PI_DEFAULT_SOCKET_PATH;
+
+   if (strlen(path) > PI_MAX_SOCKET_PATH) return pigif_bad_connect;
+
+   memset(&addr, 0, sizeof(addr));
+
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   if (sock == -1) return pigif_bad_socket;
+
+   if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+   {
+      close(sock);
+      return pigif_bad_connect;
+   }
+
+   return sock;
+}
+
+static int pigpioOpenSocket(const char *addrStr, const char *portStr)
+{
+   int sock, err, opt;
+   struct addrinfo hints, *res, *rp;
+
+   /* unix:path selects the daemon's Unix domain socket */
+
+   if (strncmp(addrStr, "unix:", 5) == 0)
+      return pigpioOpenUnixSocket(addrStr + 5);
+
+   memset (&hints, 0, sizeof (hints));
+
+   hints.ai_family   = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags   |= AI_CANONNAME;
+
+   err = getaddrinfo (addrStr, portStr, &hints, &res);
+
+   if (err) return pigif_bad_getaddrinfo;
+
+   for (rp=res; rp!=NULL; rp=rp->ai_next)
+   {
+      sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+
+      if (sock == -1) continue;
+
+      /* Disable the Nagle algorithm. */
+      opt = 1;
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+      if (connect(sock, rp->ai_addr, rp->ai_addrlen) != -1) break;
+   }
+
+   freeaddrinfo(res);
+
+   if (rp == NULL) return pigif_bad_connect;
+
+   return sock;
+}
+
+static void dispatch_entries(
+   int pi, cbTable_t *t, int b, int level, uint32_t tick)
+{
+   cbEntry_t *e, *end;
+
+   end = &t->entry[t->first[b+1]];
+
+   for (e=&t->entry[t->first[b]]; e<end; e++)
+   {
+      if ((level == PI_TIMEOUT) || ((e->edge) ^ level))
+      {
+         if (e->ex) (e->f)(pi, b, level, tick, e->user);
+         else       (e->f)(pi, b, level, tick);
+      }
+   }
+}
+
+static void dispatch_notification(int pi, gpioReport_t *r)
+{
+   cbTable_t *t;
+   cbEntry_t *e, *end;
+   uint32_t changed;
+   int l, g;
+
+/*
+   printf("s=%4x f=%4x t=%10u l=%8x\n",
+      r->seqno, r->flags, r->tick, r->level);
+*/
+
+   if (r->flags == 0)
+   {
+      changed = (r->level ^ gLastLevel[pi]) & gNotifyBits[pi];
+
+      gLastLevel[pi] = r->level;
+
+      t = __atomic_load_n(&gCallbacks[pi], __ATOMIC_SEQ_CST);
+
+      if (t == NULL) return;
+
+      changed &= t->bits;
+
+      /* visit only the GPIO which changed */
+
+      while (changed)
+      {
+         g = __builtin_ctz(changed);
+
+         changed &= (changed - 1);
+
+         if ((r->level) & (1<<g)) l = 1; else l = 0;
+
+         dispatch_entries(pi, t, g, l, r->tick);
+      }
+   }
+   else
+   {
+      if ((r->flags) & PI_NTFY_FLAGS_WDOG)
+      {
+         g = (r->flags) & 31;
+
+         t = __atomic_load_n(&gCallbacks[pi], __ATOMIC_SEQ_CST);
+
+         if (t && (t->bits & (1<<g)))
+            dispatch_entries(pi, t, g, PI_TIMEOUT, r->tick);
+      }
+      else if ((r->flags) & PI_NTFY_FLAGS_EVENT)
+      {
+         g = (r->flags) & 31;
+
+         t = __atomic_load_n(&gEvtCallbacks[pi], __ATOMIC_SEQ_CST);
+
+         if ((t == NULL) || !(t->bits & (1<<g))) return;
+
+         end = &t->entry[t->first[g+1]];
+
+         for (e=&t->entry[t->first[g]]; e<end; e++)
+         {
+            if (e->ex) (e->f)(pi, g, r->tick, e->user);
+            else       (e->f)(pi, g, r->tick);
+         }
+      }
+   }
+}
+
+static void free_retired(int pi)
+{
+   cbTable_t *t, *next;
+
+   pthread_mutex_lock(&gCallbackMutex);
+   t = gRetired[pi];
+   gRetired[pi] = NULL;
+   pthread_mutex_unlock(&gCallbackMutex);
+
+   while (t)
+   {
+      next = t->retired;
+      free(t);
+      t = next;
+   }
+}
+
+static void notify_arm(int pi, int op)
+{
+   /* called with gNotifyMutex held */
+
+   struct epoll_event ev;
+
+   ev.events = EPOLLIN | EPOLLONESHOT;
+   ev.data.u64 = ((uint64_t)gNotifyGen[pi] << 32) | pi;
+
+   epoll_ctl(gEpoll, op, gPigNotify[pi], &ev);
+}
+
+static void *pthNotifyWorker(void *x)
+{
+   struct epoll_event ev;
+   notifyBuf_t *nb;
+   uint32_t gen;
+   int pi, bytes, r, broken;
+
+   while (1)
+   {
+      if (epoll_wait(gEpoll, &ev, 1, -1) < 1) continue;
+
+      pi  = ev.data.u64 & 0xFFFF;
+      gen = ev.data.u64 >> 32;
+
+      pthread_mutex_lock(&gNotifyMutex);
+
+      if (!gNotifyOn[pi] || (gen != gNotifyGen[pi]))
+      {
+         /* the connection was stopped since the event */
+
+         pthread_mutex_unlock(&gNotifyMutex);
+         continue;
+      }
+
+      if (ev.data.u64 & NOTIFY_CMD)
+      {
+         /* a response to an asynchronous request */
+
+         gCmdBusy[pi] = 1;
+         gCmdWorker[pi] = pthread_self();
+
+         pthread_mutex_unlock(&gNotifyMutex);
+
+         async_event(pi);
+
+         pthread_mutex_lock(&gNotifyMutex);
+
+         gCmdBusy[pi] = 0;
+
+         pthread_cond_broadcast(&gNotifyIdle);
+
+         pthread_mutex_unlock(&gNotifyMutex);
+         continue;
+      }
+
+      gNotifyBusy[pi] = 1;
+      gDispatcher[pi] = pthread_self();
+
+      pthread_mutex_unlock(&gNotifyMutex);
+
+      nb = gNotifyBuf[pi];
+
+      broken = 0;
+
+      bytes = recv(gPigNotify[pi], (char*)&nb->report + nb->got,
+         sizeof(nb->report) - nb->got, MSG_DONTWAIT);
+
+      if (bytes > 0)
+      {
+         nb->got += bytes;
+
+         r = 0;
+
+         __atomic_add_fetch(&gDispatchSeq[pi], 1, __ATOMIC_SEQ_CST);
+
+         /* a callback may stop the pi */
+
+         while ((nb->got >= sizeof(gpioReport_t)) && gNotifyOn[pi])
+         {
+            dispatch_notification(pi, &nb->report[r]);
+
+            r++;
+
+            nb->got -= sizeof(gpioReport_t);
+         }
+
+         __atomic_add_fetch(&gDispatchSeq[pi], 1, __ATOMIC_SEQ_CST);
+
+         if (gRetired[pi]) free_retired(pi);
+
+         /* copy any partial report to start of array */
+
+         if (nb->got && r) nb->report[0] = nb->report[r];
+      }
+      else if ((bytes == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+      {
+         fprintf(stderr,
+            "notify connection for pi %d broke with read error %d\n",
+            pi, bytes);
+
+         broken = 1;
+      }
+
+      pthread_mutex_lock(&gNotifyMutex);
+
+      gNotifyBusy[pi] = 0;
+
+      if (!broken && gNotifyOn[pi] && (gen == gNotifyGen[pi]))
+         notify_arm(pi, EPOLL_CTL_MOD);
+
+      pthread_cond_broadcast(&gNotifyIdle);
+
+      pthread_mutex_unlock(&gNotifyMutex);
+   }
+
+   return NULL;
+}
+
+static int notify_start(int pi)
+{
+   struct epoll_event ev;
+
+   pthread_mutex_lock(&gNotifyMutex);
+
+   if (gEpoll < 0) gEpoll = epoll_create1(EPOLL_CLOEXEC);
+
+   if (gNotifyBuf[pi] == NULL) gNotifyBuf[pi] = malloc(sizeof(notifyBuf_t));
+
+   if ((gEpoll < 0) || (gNotifyBuf[pi] == NULL))
+   {
+      pthread_mutex_unlock(&gNotifyMutex);
+      return pigif_notify_failed;
+   }
+
+   /* one worker per connected Pi up to the maximum */
+
+   if ((gWorkers <= gNotifying) && (gWorkers < gMaxWorkers))
+   {
+      gWorker[gWorkers] = start_thread(pthNotifyWorker, NULL);
+
+      if (gWorker[gWorkers]) gWorkers++;
+   }
+
+   if (!gWorkers)
+   {
+      pthread_mutex_unlock(&gNotifyMutex);
+      return pigif_notify_failed;
+   }
+
+   gNotifyBuf[pi]->got = 0;
+
+   gNotifyGen[pi]++;
+   gNotifyOn[pi] = 1;
+   gNotifying++;
+
+   notify_arm(pi, EPOLL_CTL_ADD);
+
+   /* the command socket is armed while asynchronous requests are pending */
+
+   ev.events = EPOLLONESHOT;
+   ev.data.u64 = ((uint64_t)gNotifyGen[pi] << 32) | NOTIFY_CMD | pi;
+
+   epoll_ctl(gEpoll, EPOLL_CTL_ADD, gPigCommand[pi], &ev);
+
+   pthread_mutex_unlock(&gNotifyMutex);
+
+   return 0;
+}
+
+static int notify_stop(int pi)
+{
+   int self, selfCmd;
+
+   /* returns 1 if called from a callback of the pi */
+
+   pthread_mutex_lock(&gNotifyMutex);
+
+   self = gNotifyBusy[pi] && pthread_equal(pthread_self(), gDispatcher[pi]);
+
+   selfCmd = gCmdBusy[pi] && pthread_equal(pthread_self(), gCmdWorker[pi]);
+
+   if (gNotifyOn[pi])
+   {
+      gNotifyOn[pi] = 0;
+      gNotifying--;
+
+      epoll_ctl(gEpoll, EPOLL_CTL_DEL, gPigNotify[pi], NULL);
+      epoll_ctl(gEpoll, EPOLL_CTL_DEL, gPigCommand[pi], NULL);
+
+      /* let the workers finish with the pi before its sockets are closed */
+
+      while ((gNotifyBusy[pi] && !self) || (gCmdBusy[pi] && !selfCmd))
+         pthread_cond_wait(&gNotifyIdle, &gNotifyMutex);
+   }
+
+   pthread_mutex_unlock(&gNotifyMutex);
+
+   return self;
+}
+
+static cbTable_t *build_table(int pi, int events)
+{
+   callback_t *p;
+   evtCallback_t *ep;
+   cbTable_t *t;
+   cbEntry_t *e;
+   int count[32], pos[32];
+   int b, n;
+
+   memset(count, 0, sizeof(count));
+
+   n = 0;
+
+   if (events)
+   {
+      for (ep=geCallBackFirst; ep; ep=ep->next)
+         if (ep->pi == pi) {count[ep->event]++; n++;}
+   }
+   else
+   {
+      for (p=gCallBackFirst; p; p=p->next)
+         if (p->pi == pi) {count[p->gpio]++; n++;}
+   }
+
+   t = malloc(sizeof(cbTable_t) + (n * sizeof(cbEntry_t)));
+
+   if (t == NULL) return NULL;
+
+   t->retired = NULL;
+   t->bits = 0;
+   t->first[0] = 0;
+
+   for (b=0; b<32; b++)
+   {
+      if (count[b]) t->bits |= (1<<b);
+      pos[b] = t->first[b];
+      t->first[b+1] = t->first[b] + count[b];
+   }
+
+   /* callbacks on the same bit keep their registration order */
+
+   if (events)
+   {
+      for (ep=geCallBackFirst; ep; ep=ep->next)
+      {
+         if (ep->pi != pi) continue;
+         e = &t->entry[pos[ep->event]++];
+         e->f = ep->f; e->user = ep->user; e->ex = ep->ex; e->edge = 0;
+      }
+   }
+   else
+   {
+      for (p=gCallBackFirst; p; p=p->next)
+      {
+         if (p->pi != pi) continue;
+         e = &t->entry[pos[p->gpio]++];
+         e->f = p->f; e->user = p->user; e->ex = p->ex; e->edge = p->edge;
+      }
+   }
+
+   return t;
+}
+
+static int publish_table(int pi, int events, cbTable_t **old)
+{
+   /* called with gCallbackMutex held */
+
+   cbTable_t *t, **slot;
+
+   t = build_table(pi, events);
+
+   if (t == NULL) return pigif_bad_malloc;
+
+   if (events) slot = &gEvtCallbacks[pi]; else slot = &gCallbacks[pi];
+
+   *old = __atomic_exchange_n(slot, t, __ATOMIC_SEQ_CST);
+
+   return 0;
+}
+
+static void retire_table(int pi, cbTable_t *t)
+{
+   uint32_t seq;
+   int spins;
+
+   if (t == NULL) return;
+
+   /* a callback changing callbacks leaves the free to its own thread */
+
+   if (gNotifyBusy[pi] && pthread_equal(pthread_self(), gDispatcher[pi]))
+   {
+      pthread_mutex_lock(&gCallbackMutex);
+      t->retired = gRetired[pi];
+      gRetired[pi] = t;
+      pthread_mutex_unlock(&gCallbackMutex);
+      return;
+   }
+
+   /* otherwise wait for any dispatch which might hold the old table */
+
+   seq = __atomic_load_n(&gDispatchSeq[pi], __ATOMIC_SEQ_CST);
+
+   spins = 0;
+
+   while ((seq & 1) &&
+          (seq == __atomic_load_n(&gDispatchSeq[pi], __ATOMIC_SEQ_CST)))
+   {
+      if (++spins < 100) sched_yield();
+      else               time_sleep(0.0001);
+   }
+
+   free(t);
+}
+
+static void findNotifyBits(int pi)
+{
+   uint32_t bits = 0;
+
+   if (gCallbacks[pi]) bits = gCallbacks[pi]->bits;
+
+   if (bits != gNotifyBits[pi])
+   {
+      gNotifyBits[pi] = bits;
+
+      /*
+         NB is not one of the caller's commands so is kept out of any
+         batch or pipeline the caller has open, where it would add a
+         result.  What is queued so far is sent first.
+      */
+
+      if (queue_owned(pi)) queue_sync(pi);
+
+      pigpio_command_direct(pi, PI_CMD_NB, gPigHandle[pi], bits, 1);
+   }
+}
+
+static void wfe_trigger(wfe_t *w)
+{
+   pthread_mutex_lock(&gWfeMutex);
+   w->triggered = 1;
+   pthread_cond_signal(&w->cond);
+   pthread_mutex_unlock(&gWfeMutex);
+}
+
+static void wfe_init(wfe_t *w)
+{
+   pthread_condattr_t attr;
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&w->cond, &attr);
+   pthread_condattr_destroy(&attr);
+
+   w->triggered = 0;
+}
+
+static int wfe_wait(wfe_t *w, double timeout)
+{
+   struct timespec ts;
+   double secs;
+   int triggered;
+
+   /* block until the notify thread triggers the wait or timeout */
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   secs = ts.tv_nsec / 1e9 + timeout;
+
+   ts.tv_sec += (time_t)secs;
+   ts.tv_nsec = (secs - (time_t)secs) * 1e9;
+
+   pthread_mutex_lock(&gWfeMutex);
+
+   while (!w->triggered)
+   {
+      if (pthread_cond_timedwait(&w->cond, &gWfeMutex, &ts) == ETIMEDOUT)
+         break;
+   }
+
+   triggered = w->triggered;
+
+   pthread_mutex_unlock(&gWfeMutex);
+
+   return triggered;
+}
+
+static void wfe_done(wfe_t *w)
+{
+   /* the callback was cancelled so no trigger can still be running */
+
+   pthread_cond_destroy(&w->cond);
+}
+
+static void _wfe(
+   int pi, unsigned user_gpio, unsigned level, uint32_t tick, void *user)
+{
+   wfe_trigger(user);
+}
+
+static int intCallback(
+   int pi, unsigned user_gpio, unsigned edge, void *f, void *user, int ex)
+{
+   callback_t *p;
+   cbTable_t *t, *old;
+   int i, id, status;
+
+   if ((user_gpio >=0) && (user_gpio < 32) && (edge >=0) && (edge <= 2) && f)
+   {
+      pthread_mutex_lock(&gCallbackMutex);
+
+      /* prevent duplicates, the same function may serve several users */
+
+      t = gCallbacks[pi];
+
+      if (t)
+      {
+         for (i=t->first[user_gpio]; i<t->first[user_gpio+1]; i++)
+         {
+            if ((t->entry[i].edge == edge) && (t->entry[i].f == f) &&
+                (t->entry[i].user == user))
+            {
+               pthread_mutex_unlock(&gCallbackMutex);
+               return pigif_duplicate_callback;
+            }
+         }
+      }
+
+      p = malloc(sizeof(callback_t));
+
+      if (p)
+      {
+         if (!gCallBackFirst) gCallBackFirst = p;
+
+         p->id = gCallbackId++;
+         p->pi = pi;
+         p->gpio = user_gpio;
+         p->edge = edge;
+         p->f = f;
+         p->user = user;
+         p->ex = ex;
+         p->next = 0;
+         p->prev = gCallBackLast;
+
+         if (p->prev) (p->prev)->next = p;
+         gCallBackLast = p;
+
+         status = publish_table(pi, 0, &old);
+
+         if (status < 0)
+         {
+            if (p->prev) {p->prev->next = NULL;}
+            else         {gCallBackFirst = NULL;}
+            gCallBackLast = p->prev;
+
+            free(p);
+
+            pthread_mutex_unlock(&gCallbackMutex);
+
+            return status;
+         }
+
+         findNotifyBits(pi);
+
+         id = p->id;
+
+         pthread_mutex_unlock(&gCallbackMutex);
+
+         retire_table(pi, old);
+
+         return id;
+      }
+
+      pthread_mutex_unlock(&gCallbackMutex);
+
+      return pigif_bad_malloc;
+   }
+
+   return pigif_bad_callback;
+}
+
+static void findEventBits(int pi)
+{
+   uint32_t bits = 0;
+
+   if (gEvtCallbacks[pi]) bits = gEvtCallbacks[pi]->bits;
+
+   if (bits != gEventBits[pi])
+   {
+      gEventBits[pi] = bits;
+      pigpio_command(pi, PI_CMD_EVM, gPigHandle[pi], gEventBits[pi], 1);
+   }
+}
+
+static void _ewfe(
+   int pi, unsigned event, uint32_t tick, void *user)
+{
+   wfe_trigger(user);
+}
+
+static int intEventCallback(
+   int pi, unsigned event, void *f, void *user, int ex)
+{
+   evtCallback_t *ep;
+   cbTable_t *t, *old;
+   int i, id, status;
+
+   if ((event >=0) && (event < 32) && f)
+   {
+      pthread_mutex_lock(&gCallbackMutex);
+
+      /* prevent duplicates, the same function may serve several users */
+
+      t = gEvtCallbacks[pi];
+
+      if (t)
+      {
+         for (i=t->first[event]; i<t->first[event+1]; i++)
+         {
+            if ((t->entry[i].f == f) && (t->entry[i].user == user))
+            {
+               pthread_mutex_unlock(&gCallbackMutex);
+               return pigif_duplicate_callback;
+            }
+         }
+      }
+
+      ep = malloc(sizeof(evtCallback_t));
+
+      if (ep)
+      {
+         if (!geCallBackFirst) geCallBackFirst = ep;
+
+         ep->id = gEvtCallbackId++;
+         ep->pi = pi;
+         ep->event = event;
+         ep->f = f;
+         ep->user = user;
+         ep->ex = ex;
+         ep->next = 0;
+         ep->prev = geCallBackLast;
+
+         if (ep->prev) (ep->prev)->next = ep;
+         geCallBackLast = ep;
+
+         status = publish_table(pi, 1, &old);
+
+         if (status < 0)
+         {
+            if (ep->prev) {ep->prev->next = NULL;}
+            else          {geCallBackFirst = NULL;}
+            geCallBackLast = ep->prev;
+
+            free(ep);
+
+            pthread_mutex_unlock(&gCallbackMutex);
+
+            return status;
+         }
+
+         findEventBits(pi);
+
+         id = ep->id;
+
+         pthread_mutex_unlock(&gCallbackMutex);
+
+         retire_table(pi, old);
+
+         return id;
+      }
+
+      pthread_mutex_unlock(&gCallbackMutex);
+
+      return pigif_bad_malloc;
+   }
+
+   return pigif_bad_callback;
+}
+
+/* PUBLIC ----------------------------------------------------------------- */
+
+double time_time(void)
+{
+   struct timeval tv;
+   double t;
+
+   gettimeofday(&tv, 0);
+
+   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
+
+   return t;
+}
+
+void time_sleep(double seconds)
+{
+   struct timespec ts, rem;
+
+   if (seconds > 0.0)
+   {
+      ts.tv_sec = seconds;
+      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
+
+      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
+      {
+         /* copy remaining time to ts */
+         ts.tv_sec  = rem.tv_sec;
+         ts.tv_nsec = rem.tv_nsec;
+      }
+   }
+}
+
+char *pigpio_error(int errnum)
+{
+   if (errnum > -1000) return cmdErrStr(errnum);
+   else
+   {
+      switch(errnum)
+      {
+         case pigif_bad_send:
+            return "failed to send to pigpiod";
+         case pigif_bad_recv:
+            return "failed to receive from pigpiod";
+         case pigif_bad_getaddrinfo:
+            return "failed to find address of pigpiod";
+         case pigif_bad_connect:
+            return "failed to connect to pigpiod";
+         case pigif_bad_socket:
+            return "failed to create socket";
+         case pigif_bad_noib:
+            return "failed to open notification in band";
+         case pigif_duplicate_callback:
+            return "identical callback exists";
+         case pigif_bad_malloc:
+            return "failed to malloc";
+         case pigif_bad_callback:
+            return "bad callback parameter";
+         case pigif_notify_failed:
+            return "failed to create notification thread";
+         case pigif_callback_not_found:
+            return "callback not found";
+         case pigif_unconnected_pi:
+            return "not connected to Pi";
+         case pigif_too_many_pis:
+            return "too many connected Pis";
+         case pigif_queue_busy:
+            return "commands already being queued";
+         case pigif_not_queuing:
+            return "commands not being queued";
+         case pigif_bad_workers:
+            return "bad number of notify workers (1-32)";
+         case pigif_bad_shm:
+            return "can't map command shared memory";
+
+         default:
+            return "unknown error";
+      }
+   }
+}
+
+unsigned pigpiod_if_version(void)
+{
+   return PIGPIOD_IF2_VERSION;
+}
+
+pthread_t *start_thread(gpioThreadFunc_t thread_func, void *userdata)
+{
+   pthread_t *pth;
+   pthread_attr_t pthAttr;
+
+   pth = malloc(sizeof(pthread_t));
+
+   if (pth)
+   {
+      if (pthread_attr_init(&pthAttr))
+      {
+         perror("pthread_attr_init failed");
+         free(pth);
+         return NULL;
+      }
+
+      if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      {
+         perror("pthread_attr_setstacksize failed");
+         free(pth);
+         return NULL;
+      }
+
+      if (pthread_create(pth, &pthAttr, thread_func, userdata))
+      {
+         perror("pthread_create socket failed");
+         free(pth);
+         return NULL;
+      }
+   }
+   return pth;
+}
+
+void stop_thread(pthread_t *pth)
+{
+   if (pth)
+   {
+      pthread_cancel(*pth);
+      pthread_join(*pth, NULL);
+      free(pth);
+   }
+}
+
+int pigpio_notify_workers(unsigned workers)
+{
+   if ((workers < 1) || (workers > MAX_PI)) return pigif_bad_workers;
+
+   pthread_mutex_lock(&gNotifyMutex);
+   gMaxWorkers = workers;
+   pthread_mutex_unlock(&gNotifyMutex);
+
+   return 0;
+}
+
+int pigpio_start(const char *addrStr, const char *portStr)
+{
+   int pi;
+
+   for (pi=0; pi<MAX_PI; pi++)
+   {
+      if (!gPiInUse[pi]) break;
+   }
+
+   if (pi >= MAX_PI) return pigif_too_many_pis;
+
+   gPiInUse[pi] = 1;
+
+   if ((!addrStr)  || (!strlen(addrStr)))
+   {
+      addrStr = getenv(PI_ENVADDR);
+
+      if ((!addrStr) || (!strlen(addrStr)))
+      {
+         addrStr = PI_DEFAULT_SOCKET_ADDR_STR;
+      }
+   }
+
+   if ((!portStr) || (!strlen(portStr)))
+   {
+      portStr = getenv(PI_ENVPORT);
+
+      if ((!portStr) || (!strlen(portStr)))
+      {
+         portStr = PI_DEFAULT_SOCKET_PORT_STR;
+      }
+   }
+
+   pthread_mutex_init(&gCmdMutex[pi], NULL);
+
+   async_init(pi);
+
+   gPigCommand[pi] = pigpioOpenSocket(addrStr, portStr);
+
+   if (gPigCommand[pi] >= 0)
+   {
+      gPigNotify[pi] = pigpioOpenSocket(addrStr, portStr);
+
+      if (gPigNotify[pi] >= 0)
+      {
+         gPigHandle[pi] = pigpio_notify(pi);
+
+         if (gPigHandle[pi] < 0) return pigif_bad_noib;
+         else
+         {
+            gLastLevel[pi] = read_bank_1(pi);
+
+            if (notify_start(pi) == 0) return pi;
+            else                       return pigif_notify_failed;
+
+         }
+      }
+      else return gPigNotify[pi];
+   }
+   else return gPigCommand[pi];
+}
+
+void pigpio_stop(int pi)
+{
+   asyncReq_t *r;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi]) return;
+
+   if (queue_owned(pi))
+   {
+      if (gQueue[pi].mode == QUEUE_BATCH) batch_end(pi, NULL, 0);
+      else                                pipeline_end(pi, NULL, 0);
+   }
 
-   gPiInUse[pi] = 1;
+   /* from a callback the worker frees retired tables itself */
 
-   if ((!addrStr)  || (!strlen(addrStr)))
+   if (!notify_stop(pi)) free_retired(pi);
+
+   if (gPigCommand[pi] >= 0)
    {
-      addrStr = getenv(PI_ENVADDR);
+      if (gPigHandle[pi] >= 0)
+      {
+         pigpio_command(pi, PI_CMD_NC, gPigHandle[pi], 0, 1);
+         gPigHandle[pi] = -1;
+      }
 
-      if ((!addrStr) || (!strlen(addrStr)))
+      /* the daemon closes the region with the socket */
+
+      cmd_shm_unmap(pi);
+
+      close(gPigCommand[pi]);
+      gPigCommand[pi] = -1;
+   }
+
+   if (gPigNotify[pi] >= 0)
+   {
+      close(gPigNotify[pi]);
+      gPigNotify[pi] = -1;
+   }
+
+   /*
+      The replies to pending requests are read before the NC above.
+      Without a notification handle there was no NC, so any still
+      pending are failed here, which calls their callbacks and frees
+      them.
+   */
+
+   pthread_mutex_lock(&gCmdMutex[pi]);
+   gAsync[pi].broken = 1;
+   async_read(pi, 1);
+   pthread_mutex_unlock(&gCmdMutex[pi]);
+
+   async_deliver(pi);
+
+   /* completions nobody waited for */
+
+   pthread_mutex_lock(&gAsyncMutex);
+   while ((r = async_pop(&gAsync[pi].done))) free(r);
+   pthread_mutex_unlock(&gAsyncMutex);
+
+   free(gQueue[pi].frame);
+   free(gQueue[pi].res);
+
+   memset(&gQueue[pi], 0, sizeof(queue_t));
+
+   gPiInUse[pi] = 0;
+}
+
+static int queue_start(int pi, int mode)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   /* a pipeline keeps the command socket to itself */
+
+   if (mode == QUEUE_PIPELINE) _pml(pi);
+
+   pthread_mutex_lock(&gQueueMutex);
+
+   if (gQueue[pi].mode != QUEUE_NONE)
+   {
+      pthread_mutex_unlock(&gQueueMutex);
+
+      if (mode == QUEUE_PIPELINE) _pmu(pi);
+
+      return pigif_queue_busy;
+   }
+
+   gQueue[pi].thread   = pthread_self();
+   gQueue[pi].frameLen = 0;
+   gQueue[pi].queued   = 0;
+   gQueue[pi].sent     = 0;
+   gQueue[pi].resLen   = 0;
+   gQueue[pi].mode     = mode;
+
+   pthread_mutex_unlock(&gQueueMutex);
+
+   return 0;
+}
+
+static int queue_end(int pi, int mode, int *results, unsigned count)
+{
+   int n;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (!queue_owned(pi) || (gQueue[pi].mode != mode))
+      return pigif_not_queuing;
+
+   queue_sync(pi);
+
+   n = gQueue[pi].resLen;
+
+   if (results)
+   {
+      if (count > n) count = n;
+      memcpy(results, gQueue[pi].res, count * sizeof(int));
+   }
+
+   gQueue[pi].resLen = 0;
+
+   pthread_mutex_lock(&gQueueMutex);
+   gQueue[pi].mode = QUEUE_NONE;
+   pthread_mutex_unlock(&gQueueMutex);
+
+   if (mode == QUEUE_PIPELINE) _pmu(pi);
+
+   return n;
+}
+
+int batch_start(int pi)
+   {return queue_start(pi, QUEUE_BATCH);}
+
+int batch_end(int pi, int *results, unsigned count)
+   {return queue_end(pi, QUEUE_BATCH, results, count);}
+
+int pipeline_start(int pi)
+   {return queue_start(pi, QUEUE_PIPELINE);}
+
+int pipeline_end(int pi, int *results, unsigned count)
+   {return queue_end(pi, QUEUE_PIPELINE, results, count);}
+
+int gpio_read_async(int pi, unsigned gpio, asyncCBFunc_t f, void *userdata)
+{
+   return async_command
+      (pi, PI_CMD_READ, gpio, 0, 0, 0, NULL, NULL, 0, f, userdata);
+}
+
+int i2c_read_device_async(int pi, unsigned handle, char *buf, unsigned count,
+   asyncCBFunc_t f, void *userdata)
+{
+   return async_command
+      (pi, PI_CMD_I2CRD, handle, count, 0, 0, NULL, buf, count, f, userdata);
+}
+
+int spi_xfer_async(int pi, unsigned handle, char *txBuf, char *rxBuf,
+   unsigned count, asyncCBFunc_t f, void *userdata)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=handle
+   p2=0
+   p3=count
+   ## extension ##
+   char buf[count]
+   */
+
+   ext[0].size = count;
+   ext[0].ptr = txBuf;
+
+   return async_command
+      (pi, PI_CMD_SPIX, handle, 0, count, 1, ext, rxBuf, count, f, userdata);
+}
+
+int async_wait(int pi, double timeout, unsigned *id, int *result)
+{
+   struct timespec ts;
+   asyncReq_t *r;
+   async_t *a;
+   double secs;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   a = &gAsync[pi];
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   secs = ts.tv_nsec / 1e9 + timeout;
+
+   ts.tv_sec += (time_t)secs;
+   ts.tv_nsec = (secs - (time_t)secs) * 1e9;
+
+   pthread_mutex_lock(&gAsyncMutex);
+
+   while ((a->done.first == NULL) && (timeout > 0.0))
+   {
+      if (pthread_cond_timedwait(&a->cond, &gAsyncMutex, &ts) == ETIMEDOUT)
+         break;
+   }
+
+   r = async_pop(&a->done);
+
+   pthread_mutex_unlock(&gAsyncMutex);
+
+   if (r == NULL) return 0;
+
+   if (id) *id = r->id;
+   if (result) *result = r->res;
+
+   free(r);
+
+   return 1;
+}
+
+int set_mode(int pi, unsigned gpio, unsigned mode)
+   {return pigpio_command(pi, PI_CMD_MODES, gpio, mode, 1);}
+
+int get_mode(int pi, unsigned gpio)
+   {return pigpio_command(pi, PI_CMD_MODEG, gpio, 0, 1);}
+
+int set_pull_up_down(int pi, unsigned gpio, unsigned pud)
+   {return pigpio_command(pi, PI_CMD_PUD, gpio, pud, 1);}
+
+int gpio_read(int pi, unsigned gpio)
+   {return pigpio_command(pi, PI_CMD_READ, gpio, 0, 1);}
+
+int gpio_write(int pi, unsigned gpio, unsigned level)
+   {return pigpio_command(pi, PI_CMD_WRITE, gpio, level, 1);}
+
+int set_PWM_dutycycle(int pi, unsigned user_gpio, unsigned dutycycle)
+   {return pigpio_command(pi, PI_CMD_PWM, user_gpio, dutycycle, 1);}
+
+int get_PWM_dutycycle(int pi, unsigned user_gpio)
+   {return pigpio_command(pi, PI_CMD_GDC, user_gpio, 0, 1);}
+
+int set_PWM_range(int pi, unsigned user_gpio, unsigned range)
+   {return pigpio_command(pi, PI_CMD_PRS, user_gpio, range, 1);}
+
+int get_PWM_range(int pi, unsigned user_gpio)
+   {return pigpio_command(pi, PI_CMD_PRG, user_gpio, 0, 1);}
+
+int get_PWM_real_range(int pi, unsigned user_gpio)
+   {return pigpio_command(pi, PI_CMD_PRRG, user_gpio, 0, 1);}
+
+int set_PWM_frequency(int pi, unsigned user_gpio, unsigned frequency)
+   {return pigpio_command(pi, PI_CMD_PFS, user_gpio, frequency, 1);}
+
+int get_PWM_frequency(int pi, unsigned user_gpio)
+   {return pigpio_command(pi, PI_CMD_PFG, user_gpio, 0, 1);}
+
+int set_servo_pulsewidth(int pi, unsigned user_gpio, unsigned pulsewidth)
+   {return pigpio_command(pi, PI_CMD_SERVO, user_gpio, pulsewidth, 1);}
+
+int get_servo_pulsewidth(int pi, unsigned user_gpio)
+   {return pigpio_command(pi, PI_CMD_GPW, user_gpio, 0, 1);}
+
+static int set_widths(int pi, int cmd, unsigned count, gpioWidth_t *widths)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=0
+   p2=0
+   p3=count*sizeof(gpioWidth_t)
+   ## extension ##
+   gpioWidth_t[] widths
+   */
+
+   if (!count) return 0;
+
+   ext[0].size = count * sizeof(gpioWidth_t);
+   ext[0].ptr = widths;
+
+   return pigpio_command_ext(pi, cmd, 0, 0, ext[0].size, 1, ext, 1);
+}
+
+int set_PWM_dutycycles(int pi, unsigned count, gpioWidth_t *widths)
+   {return set_widths(pi, PI_CMD_PWMM, count, widths);}
+
+int set_servo_pulsewidths(int pi, unsigned count, gpioWidth_t *widths)
+   {return set_widths(pi, PI_CMD_SERVOM, count, widths);}
+
+int notify_open(int pi)
+   {return pigpio_command(pi, PI_CMD_NO, 0, 0, 1);}
+
+int notify_begin(int pi, unsigned handle, uint32_t bits)
+   {return pigpio_command(pi, PI_CMD_NB, handle, bits, 1);}
+
+int notify_pause(int pi, unsigned handle)
+   {return pigpio_command(pi, PI_CMD_NB, handle, 0, 1);}
+
+int notify_close(int pi, unsigned handle)
+   {return pigpio_command(pi, PI_CMD_NC, handle, 0, 1);}
+
+int notify_open_shm(int pi, unsigned reports)
+   {return pigpio_command(pi, PI_CMD_NOS, reports, 0, 1);}
+
+/* shared memory is only of use if the daemon is on this machine */
+
+static int shm_local(int pi)
+{
+   struct sockaddr_storage addr;
+   socklen_t len;
+
+   len = sizeof(addr);
+
+   if (getpeername(gPigCommand[pi], (struct sockaddr *)&addr, &len))
+      return 0;
+
+   switch (addr.ss_family)
+   {
+      case AF_UNIX:
+         return 1;
+
+      case AF_INET:
+         return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24)
+            == 127;
+
+      case AF_INET6:
+         return IN6_IS_ADDR_LOOPBACK(
+            &((struct sockaddr_in6 *)&addr)->sin6_addr);
+   }
+
+   return 0;
+}
+
+gpioNotifyShm_t *notify_shm_attach(int pi, unsigned handle)
+{
+   int fd;
+   char name[32];
+   struct stat st;
+   gpioNotifyShm_t *shm;
+   uint32_t size;
+   int i;
+
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi]) return NULL;
+
+   if (!shm_local(pi)) return NULL;
+
+   sprintf(name, "/pigpio%d", handle);
+
+   fd = shm_open(name, O_RDWR, 0);
+
+   if (fd < 0) return NULL;
+
+   shm = MAP_FAILED;
+
+   if ((!fstat(fd, &st)) && (st.st_size >= sizeof(gpioNotifyShm_t)))
+   {
+      shm = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+
+   close(fd);
+
+   if (shm == MAP_FAILED) return NULL;
+
+   size = shm->size;
+
+   if ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != PI_NOTIFY_SHM_MAGIC)
+      || (!size) || (size & (size - 1))
+      || (((st.st_size - sizeof(gpioNotifyShm_t)) / sizeof(gpioReport_t))
+         < size))
+   {
+      munmap(shm, st.st_size);
+      return NULL;
+   }
+
+   pthread_mutex_lock(&gNotifyShmMutex);
+
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (!gNotifyShm[i].shm)
       {
-         addrStr = PI_DEFAULT_SOCKET_ADDR_STR;
+         gNotifyShm[i].shm  = shm;
+         gNotifyShm[i].len  = st.st_size;
+         gNotifyShm[i].size = size;
+         break;
       }
    }
 
-   if ((!portStr) || (!strlen(portStr)))
+   pthread_mutex_unlock(&gNotifyShmMutex);
+
+   if (i >= PI_NOTIFY_SLOTS)
    {
-      portStr = getenv(PI_ENVPORT);
+      munmap(shm, st.st_size);
+      return NULL;
+   }
 
-      if ((!portStr) || (!strlen(portStr)))
+   return shm;
+}
+
+int notify_shm_read(
+   gpioNotifyShm_t *shm, gpioReport_t *reports, unsigned count, double timeout)
+{
+   uint32_t head, tail, seq, i, size;
+   struct timespec ts;
+
+   size = 0;
+
+   pthread_mutex_lock(&gNotifyShmMutex);
+
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (shm && (gNotifyShm[i].shm == shm))
       {
-         portStr = PI_DEFAULT_SOCKET_PORT_STR;
+         size = gNotifyShm[i].size;
+         break;
       }
    }
 
-   pthread_mutex_init(&gCmdMutex[pi], NULL);
+   pthread_mutex_unlock(&gNotifyShmMutex);
 
-   gPigCommand[pi] = pigpioOpenSocket(addrStr, portStr);
+   if (!size) return pigif_bad_shm;
 
-   if (gPigCommand[pi] >= 0)
+   tail = shm->tail;
+
+   head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+
+   if ((head == tail) && (timeout > 0.0))
    {
-      gPigNotify[pi] = pigpioOpenSocket(addrStr, portStr);
+      seq = __atomic_load_n(&shm->futex, __ATOMIC_SEQ_CST);
 
-      if (gPigNotify[pi] >= 0)
+      __atomic_store_n(&shm->waiting, 1, __ATOMIC_SEQ_CST);
+
+      head = __atomic_load_n(&shm->head, __ATOMIC_SEQ_CST);
+
+      if (head == tail)
       {
-         gPigHandle[pi] = pigpio_notify(pi);
+         ts.tv_sec  = timeout;
+         ts.tv_nsec = (timeout - ts.tv_sec) * 1e9;
 
-         if (gPigHandle[pi] < 0) return pigif_bad_noib;
-         else
-         {
-            gLastLevel[pi] = read_bank_1(pi);
+         syscall(SYS_futex, &shm->futex, FUTEX_WAIT, seq, &ts, NULL, 0);
+
+         head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+      }
+
+      __atomic_store_n(&shm->waiting, 0, __ATOMIC_SEQ_CST);
+   }
+
+   if ((head - tail) > size) tail = head - size;
+
+   if (count > (head - tail)) count = head - tail;
+
+   for (i=0; i<count; i++)
+   {
+      reports[i] = shm->report[(tail + i) & (size - 1)];
+   }
 
-            /* must be freed by pthNotifyThread */
-            userdata = malloc(sizeof(*userdata));
-            *userdata = pi;
+   __atomic_store_n(&shm->tail, tail + count, __ATOMIC_RELEASE);
 
-            gPthNotify[pi] = start_thread(pthNotifyThread, userdata);
+   return count;
+}
+
+void notify_shm_detach(gpioNotifyShm_t *shm)
+{
+   int i;
 
-            if (gPthNotify[pi]) return pi;
-            else                return pigif_notify_failed;
+   if (!shm) return;
 
-         }
+   pthread_mutex_lock(&gNotifyShmMutex);
+
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
+   {
+      if (gNotifyShm[i].shm == shm)
+      {
+         munmap(shm, gNotifyShm[i].len);
+         gNotifyShm[i].shm = NULL;
+         break;
       }
-      else return gPigNotify[pi];
    }
-   else return gPigCommand[pi];
+
+   pthread_mutex_unlock(&gNotifyShmMutex);
 }
 
-void pigpio_stop(int pi)
+int command_open_shm(int pi, unsigned slots)
 {
-   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi]) return;
+   int fd, handle;
+   char name[32];
+   struct stat st;
+   gpioCommandShm_t *shm;
 
-   if (gPthNotify[pi])
-   {
-      stop_thread(gPthNotify[pi]);
-      gPthNotify[pi] = 0;
-   }
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
 
-   if (gPigCommand[pi] >= 0)
-   {
-      if (gPigHandle[pi] >= 0)
-      {
-         pigpio_command(pi, PI_CMD_NC, gPigHandle[pi], 0, 1);
-         gPigHandle[pi] = -1;
-      }
+   if (gCmdShm[pi]) return gCmdShmHandle[pi];
 
-      close(gPigCommand[pi]);
-      gPigCommand[pi] = -1;
-   }
+   /* the region is only shared with a daemon on this machine */
 
-   if (gPigNotify[pi] >= 0)
-   {
-      close(gPigNotify[pi]);
-      gPigNotify[pi] = -1;
-   }
+   if (!shm_local(pi)) return pigif_bad_shm;
 
-   gPiInUse[pi] = 0;
-}
+   handle = pigpio_command(pi, PI_CMD_SHMO, slots, 0, 1);
 
-int set_mode(int pi, unsigned gpio, unsigned mode)
-   {return pigpio_command(pi, PI_CMD_MODES, gpio, mode, 1);}
+   if (handle < 0) return handle;
 
-int get_mode(int pi, unsigned gpio)
-   {return pigpio_command(pi, PI_CMD_MODEG, gpio, 0, 1);}
+   sprintf(name, "/pigpiocmd%d", handle);
 
-int set_pull_up_down(int pi, unsigned gpio, unsigned pud)
-   {return pigpio_command(pi, PI_CMD_PUD, gpio, pud, 1);}
+   shm = MAP_FAILED;
 
-int gpio_read(int pi, unsigned gpio)
-   {return pigpio_command(pi, PI_CMD_READ, gpio, 0, 1);}
+   fd = shm_open(name, O_RDWR, 0);
 
-int gpio_write(int pi, unsigned gpio, unsigned level)
-   {return pigpio_command(pi, PI_CMD_WRITE, gpio, level, 1);}
+   if (fd >= 0)
+   {
+      if ((!fstat(fd, &st)) && (st.st_size >= sizeof(gpioCommandShm_t)))
+      {
+         shm = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+      }
 
-int set_PWM_dutycycle(int pi, unsigned user_gpio, unsigned dutycycle)
-   {return pigpio_command(pi, PI_CMD_PWM, user_gpio, dutycycle, 1);}
+      close(fd);
+   }
 
-int get_PWM_dutycycle(int pi, unsigned user_gpio)
-   {return pigpio_command(pi, PI_CMD_GDC, user_gpio, 0, 1);}
+   if ((shm != MAP_FAILED) &&
+       ((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+          PI_COMMAND_SHM_MAGIC) ||
+        (st.st_size <
+          (sizeof(gpioCommandShm_t) +
+             (shm->size * sizeof(gpioCommandSlot_t))))))
+   {
+      munmap(shm, st.st_size);
+      shm = MAP_FAILED;
+   }
 
-int set_PWM_range(int pi, unsigned user_gpio, unsigned range)
-   {return pigpio_command(pi, PI_CMD_PRS, user_gpio, range, 1);}
+   if (shm == MAP_FAILED)
+   {
+      pigpio_command(pi, PI_CMD_SHMC, handle, 0, 1);
+      return pigif_bad_shm;
+   }
 
-int get_PWM_range(int pi, unsigned user_gpio)
-   {return pigpio_command(pi, PI_CMD_PRG, user_gpio, 0, 1);}
+   _pml(pi);
 
-int get_PWM_real_range(int pi, unsigned user_gpio)
-   {return pigpio_command(pi, PI_CMD_PRRG, user_gpio, 0, 1);}
+   gCmdShm[pi]       = shm;
+   gCmdShmLen[pi]    = st.st_size;
+   gCmdShmHandle[pi] = handle;
 
-int set_PWM_frequency(int pi, unsigned user_gpio, unsigned frequency)
-   {return pigpio_command(pi, PI_CMD_PFS, user_gpio, frequency, 1);}
+   _pmu(pi);
 
-int get_PWM_frequency(int pi, unsigned user_gpio)
-   {return pigpio_command(pi, PI_CMD_PFG, user_gpio, 0, 1);}
+   return handle;
+}
 
-int set_servo_pulsewidth(int pi, unsigned user_gpio, unsigned pulsewidth)
-   {return pigpio_command(pi, PI_CMD_SERVO, user_gpio, pulsewidth, 1);}
+int command_close_shm(int pi)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
 
-int get_servo_pulsewidth(int pi, unsigned user_gpio)
-   {return pigpio_command(pi, PI_CMD_GPW, user_gpio, 0, 1);}
+   if (!gCmdShm[pi]) return 0;
 
-int notify_open(int pi)
-   {return pigpio_command(pi, PI_CMD_NO, 0, 0, 1);}
+   _pml(pi);
 
-int notify_begin(int pi, unsigned handle, uint32_t bits)
-   {return pigpio_command(pi, PI_CMD_NB, handle, bits, 1);}
+   cmd_shm_unmap(pi);
 
-int notify_pause(int pi, unsigned handle)
-   {return pigpio_command(pi, PI_CMD_NB, handle, 0, 1);}
+   _pmu(pi);
 
-int notify_close(int pi, unsigned handle)
-   {return pigpio_command(pi, PI_CMD_NC, handle, 0, 1);}
+   return pigpio_command(pi, PI_CMD_SHMC, gCmdShmHandle[pi], 0, 1);
+}
 
 int set_watchdog(int pi, unsigned user_gpio, unsigned timeout)
    {return pigpio_command(pi, PI_CMD_WDOG, user_gpio, timeout, 1);}
@@ -858,6 +2580,46 @@ int set_bank_1(int pi, uint32_t levels)
 int set_bank_2(int pi, uint32_t levels)
    {return pigpio_command(pi, PI_CMD_BS2, levels, 0, 1);}
 
+int gpio_snapshot(int pi, gpioStatus_t *status)
+{
+   int bytes;
+
+   bytes = pigpio_command(pi, PI_CMD_GSNAP, 0, 0, 0);
+
+   if (bytes > 0)
+   {
+      bytes = recvMax(
+         pi, status, (PI_MAX_GPIO+1) * sizeof(gpioStatus_t), bytes);
+
+      bytes /= sizeof(gpioStatus_t);
+   }
+
+   _pmu(pi);
+
+   return bytes;
+}
+
+int gpio_apply(int pi, unsigned count, gpioApply_t *apply)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=0
+   p2=0
+   p3=count*sizeof(gpioApply_t)
+   ## extension ##
+   gpioApply_t[] apply
+   */
+
+   if (!count) return 0;
+
+   ext[0].size = count * sizeof(gpioApply_t);
+   ext[0].ptr = apply;
+
+   return pigpio_command_ext(
+      pi, PI_CMD_GAPPLY, 0, 0, ext[0].size, 1, ext, 1);
+}
+
 int hardware_clock(int pi, unsigned gpio, unsigned frequency)
    {return pigpio_command(pi, PI_CMD_HC, gpio, frequency, 1);}
 
@@ -889,6 +2651,20 @@ uint32_t get_hardware_revision(int pi)
 uint32_t get_pigpio_version(int pi)
    {return pigpio_command(pi, PI_CMD_PIGPV, 0, 0, 1);}
 
+int get_statistics(int pi, gpioStatistics_t *stats, unsigned clear)
+{
+   int bytes;
+
+   bytes = pigpio_command(pi, PI_CMD_STATS, clear, 0, 0);
+
+   if (bytes > 0)
+      bytes = recvMax(pi, stats, sizeof(gpioStatistics_t), bytes);
+
+   _pmu(pi);
+
+   return bytes;
+}
+
 int wave_clear(int pi)
    {return pigpio_command(pi, PI_CMD_WVCLR, 0, 0, 1);}
 
@@ -956,9 +2732,93 @@ int wave_create(int pi)
 int wave_create_and_pad(int pi, int percent)
    {return pigpio_command(pi, PI_CMD_WVCAP, percent, 0, 1);}
 
+int wave_lookup(int pi)
+   {return pigpio_command(pi, PI_CMD_WVLKP, 0, 0, 1);}
+
 int wave_delete(int pi, unsigned wave_id)
    {return pigpio_command(pi, PI_CMD_WVDEL, wave_id, 0, 1);}
 
+int wave_compact(int pi)
+   {return pigpio_command(pi, PI_CMD_WVCMP, 0, 0, 1);}
+
+int wave_get_space(int pi, gpioWaveSpace_t *space)
+{
+   int bytes;
+
+   bytes = pigpio_command(pi, PI_CMD_WVSPC, 0, 0, 0);
+
+   if (bytes > 0)
+      bytes = recvMax(pi, space, sizeof(gpioWaveSpace_t), bytes);
+
+   _pmu(pi);
+
+   return bytes;
+}
+
+int wave_builder_open(int pi)
+   {return pigpio_command(pi, PI_CMD_WVBNEW, 0, 0, 1);}
+
+int wave_builder_add_generic(
+   int pi, unsigned handle, unsigned numPulses, gpioPulse_t *pulses)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=handle
+   p2=0
+   p3=pulses*sizeof(gpioPulse_t)
+   ## extension ##
+   gpioPulse_t[] pulses
+   */
+
+   ext[0].size = numPulses * sizeof(gpioPulse_t);
+   ext[0].ptr = pulses;
+
+   return pigpio_command_ext(
+      pi, PI_CMD_WVBAG, handle, 0, ext[0].size, 1, ext, 1);
+}
+
+int wave_builder_add_serial(
+   int pi, unsigned handle, unsigned user_gpio, unsigned baud,
+   uint32_t databits, uint32_t stophalfbits, uint32_t offset,
+   unsigned numChar, char *str)
+{
+   uint8_t buf[16];
+   gpioExtent_t ext[2];
+
+   /*
+   p1=handle
+   p2=user_gpio
+   p3=len+16
+   ## extension ##
+   uint32_t baud
+   uint32_t databits
+   uint32_t stophalfbits
+   uint32_t offset
+   char[len] str
+   */
+
+   memcpy(buf, &baud, 4);
+   memcpy(buf+4, &databits, 4);
+   memcpy(buf+8, &stophalfbits, 4);
+   memcpy(buf+12, &offset, 4);
+
+   ext[0].size = sizeof(buf);
+   ext[0].ptr = buf;
+
+   ext[1].size = numChar;
+   ext[1].ptr = str;
+
+   return pigpio_command_ext(pi, PI_CMD_WVBAS,
+      handle, user_gpio, numChar+sizeof(buf), 2, ext, 1);
+}
+
+int wave_builder_create(int pi, unsigned handle)
+   {return pigpio_command(pi, PI_CMD_WVBCRE, handle, 0, 1);}
+
+int wave_builder_close(int pi, unsigned handle)
+   {return pigpio_command(pi, PI_CMD_WVBDEL, handle, 0, 1);}
+
 int wave_tx_start(int pi) /* DEPRECATED */
    {return pigpio_command(pi, PI_CMD_WVGO, 0, 0, 1);}
 
@@ -1002,6 +2862,59 @@ int wave_tx_busy(int pi)
 int wave_tx_stop(int pi)
    {return pigpio_command(pi, PI_CMD_WVHLT, 0, 0, 1);}
 
+int wave_stream_open(
+   int pi, unsigned segments, unsigned segmentCBs, uint32_t threshold)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=segments
+   p2=segmentCBs
+   p3=4
+   ## extension ##
+   unsigned threshold
+   */
+
+   ext[0].size = sizeof(uint32_t);
+   ext[0].ptr = &threshold;
+
+   return pigpio_command_ext(
+      pi, PI_CMD_WVSOP, segments, segmentCBs, 4, 1, ext, 1);
+}
+
+int wave_stream_add(int pi, unsigned numPulses, gpioPulse_t *pulses)
+{
+   gpioExtent_t ext[1];
+
+   /*
+   p1=0
+   p2=0
+   p3=pulses*sizeof(gpioPulse_t)
+   ## extension ##
+   gpioPulse_t[] pulses
+   */
+
+   if (!numPulses) return 0;
+
+   ext[0].size = numPulses * sizeof(gpioPulse_t);
+   ext[0].ptr = pulses;
+
+   return pigpio_command_ext(
+      pi, PI_CMD_WVSAD, 0, 0, ext[0].size, 1, ext, 1);
+}
+
+int wave_stream_set_event(int pi, unsigned event)
+   {return pigpio_command(pi, PI_CMD_WVSEV, event, 0, 1);}
+
+int wave_stream_get_free(int pi)
+   {return pigpio_command(pi, PI_CMD_WVSST, 0, 0, 1);}
+
+int wave_stream_get_underruns(int pi)
+   {return pigpio_command(pi, PI_CMD_WVSST, 1, 0, 1);}
+
+int wave_stream_close(int pi)
+   {return pigpio_command(pi, PI_CMD_WVSCL, 0, 0, 1);}
+
 int wave_get_micros(int pi)
    {return pigpio_command(pi, PI_CMD_WVSM, 0, 0, 1);}
 
@@ -1029,6 +2942,12 @@ int wave_get_high_cbs(int pi)
 int wave_get_max_cbs(int pi)
    {return pigpio_command(pi, PI_CMD_WVSC, 2, 0, 1);}
 
+int wave_get_cache_hits(int pi)
+   {return pigpio_command(pi, PI_CMD_WVSCH, 0, 0, 1);}
+
+int wave_get_cache_misses(int pi)
+   {return pigpio_command(pi, PI_CMD_WVSCH, 1, 0, 1);}
+
 int gpio_trigger(int pi, unsigned user_gpio, unsigned pulseLen, uint32_t level)
 {
    gpioExtent_t ext[1];
@@ -1964,8 +3883,11 @@ int callback_ex(
 int callback_cancel(unsigned id)
 {
    callback_t *p;
+   cbTable_t *old;
    int pi;
 
+   pthread_mutex_lock(&gCallbackMutex);
+
    p = gCallBackFirst;
 
    while (p)
@@ -1980,35 +3902,66 @@ int callback_cancel(unsigned id)
          if (p->next) {p->next->prev = p->prev;}
          else         {gCallBackLast = p->prev;}
 
+         /* if a new table can't be made the callback stays registered */
+
+         if (publish_table(pi, 0, &old) < 0)
+         {
+            if (p->prev) {p->prev->next = p;}
+            else         {gCallBackFirst = p;}
+
+            if (p->next) {p->next->prev = p;}
+            else         {gCallBackLast = p;}
+
+            pthread_mutex_unlock(&gCallbackMutex);
+
+            return pigif_bad_malloc;
+         }
+
          free(p);
 
          findNotifyBits(pi);
 
+         pthread_mutex_unlock(&gCallbackMutex);
+
+         retire_table(pi, old);
+
          return 0;
       }
       p = p->next;
    }
+
+   pthread_mutex_unlock(&gCallbackMutex);
+
    return pigif_callback_not_found;
 }
 
 int wait_for_edge(int pi, unsigned user_gpio, unsigned edge, double timeout)
 {
-   int triggered = 0;
-   int id;
-   double due;
+   wfe_t w;
+   int id, triggered;
 
    if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
       return pigif_unconnected_pi;
 
    if (timeout <= 0.0) return 0;
 
-   due = time_time() + timeout;
+   wfe_init(&w);
+
+   id = callback_ex(pi, user_gpio, edge, _wfe, &w);
+
+   if (id < 0)
+   {
+      wfe_done(&w);
+      return id;
+   }
+
+   triggered = wfe_wait(&w, timeout);
 
-   id = callback_ex(pi, user_gpio, edge, _wfe, &triggered);
+   /* w is on this stack so the callback must be gone before returning */
 
-   while (!triggered && (time_time() < due)) time_sleep(0.05);
+   while (callback_cancel(id) == pigif_bad_malloc) time_sleep(0.001);
 
-   callback_cancel(id);
+   wfe_done(&w);
 
    return triggered;
 }
@@ -2072,8 +4025,11 @@ int event_callback_ex(
 int event_callback_cancel(unsigned id)
 {
    evtCallback_t *ep;
+   cbTable_t *old;
    int pi;
 
+   pthread_mutex_lock(&gCallbackMutex);
+
    ep = geCallBackFirst;
 
    while (ep)
@@ -2088,35 +4044,66 @@ int event_callback_cancel(unsigned id)
          if (ep->next) {ep->next->prev = ep->prev;}
          else          {geCallBackLast = ep->prev;}
 
+         /* if a new table can't be made the callback stays registered */
+
+         if (publish_table(pi, 1, &old) < 0)
+         {
+            if (ep->prev) {ep->prev->next = ep;}
+            else          {geCallBackFirst = ep;}
+
+            if (ep->next) {ep->next->prev = ep;}
+            else          {geCallBackLast = ep;}
+
+            pthread_mutex_unlock(&gCallbackMutex);
+
+            return pigif_bad_malloc;
+         }
+
          free(ep);
 
          findEventBits(pi);
 
+         pthread_mutex_unlock(&gCallbackMutex);
+
+         retire_table(pi, old);
+
          return 0;
       }
       ep = ep->next;
    }
+
+   pthread_mutex_unlock(&gCallbackMutex);
+
    return pigif_callback_not_found;
 }
 
 int wait_for_event(int pi, unsigned event, double timeout)
 {
-   int triggered = 0;
-   int id;
-   double due;
+   wfe_t w;
+   int id, triggered;
 
    if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
       return pigif_unconnected_pi;
 
    if (timeout <= 0.0) return 0;
 
-   due = time_time() + timeout;
+   wfe_init(&w);
+
+   id = event_callback_ex(pi, event, _ewfe, &w);
+
+   if (id < 0)
+   {
+      wfe_done(&w);
+      return id;
+   }
+
+   triggered = wfe_wait(&w, timeout);
 
-   id = event_callback_ex(pi, event, _ewfe, &triggered);
+   /* w is on this stack so the callback must be gone before returning */
 
-   while (!triggered && (time_time() < due)) time_sleep(0.05);
+   while (event_callback_cancel(id) == pigif_bad_malloc) time_sleep(0.001);
 
-   event_callback_cancel(id);
+   wfe_done(&w);
 
    return triggered;
 }
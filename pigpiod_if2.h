@@ -104,6 +104,24 @@ ESSENTIAL
 pigpio_start               Connects to a pigpio daemon
 pigpio_stop                Disconnects from a pigpio daemon
 
+pigpio_notify_workers      Sets the number of callback threads
+
+BATCHES
+
+batch_start                Starts queuing commands to send as one batch
+batch_end                  Sends the batch and returns the results
+
+pipeline_start             Starts sending commands without waiting
+pipeline_end               Waits for and returns the pipelined results
+
+ASYNCHRONOUS
+
+gpio_read_async            Reads a GPIO without waiting for the reply
+i2c_read_device_async      Reads an I2C device without waiting
+spi_xfer_async             Transfers SPI data without waiting
+
+async_wait                 Waits for an asynchronous request to complete
+
 BASIC
 
 set_mode                   Set a GPIO mode
@@ -117,6 +135,7 @@ gpio_write                 Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 set_PWM_dutycycle          Start/stop PWM pulses on a GPIO
+set_PWM_dutycycles         Start/stop PWM pulses on many GPIO at once
 set_PWM_frequency          Configure PWM frequency for a GPIO
 set_PWM_range              Configure PWM range for a GPIO
 
@@ -129,6 +148,7 @@ get_PWM_real_range         Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 set_servo_pulsewidth       Start/stop servo pulses on a GPIO
+set_servo_pulsewidths      Start/stop servo pulses on many GPIO at once
 
 get_servo_pulsewidth       Get the servo pulsewidth in use on a GPIO
 
@@ -147,6 +167,9 @@ clear_bank_2               Clear selected GPIO in bank 2
 set_bank_1                 Set selected GPIO in bank 1
 set_bank_2                 Set selected GPIO in bank 2
 
+gpio_snapshot              Get the settings and levels of all GPIO
+gpio_apply                 Configure many GPIO at once
+
 callback                   Create GPIO level change callback
 callback_ex                Create GPIO level change callback, extended
 
@@ -164,6 +187,14 @@ notify_begin               Start notifications for selected GPIO
 notify_pause               Pause notifications
 notify_close               Close a notification
 
+notify_open_shm            Request a shared memory notification handle
+notify_shm_attach          Map a shared memory notification
+notify_shm_read            Read reports from a shared memory notification
+notify_shm_detach          Unmap a shared memory notification
+
+command_open_shm           Send commands through shared memory
+command_close_shm          Send commands through the socket again
+
 hardware_clock             Start hardware clock on supported GPIO
 
 hardware_PWM               Start hardware PWM on supported GPIO
@@ -303,7 +334,16 @@ wave_add_serial            Adds serial data to the waveform
 
 wave_create                Creates a waveform from added data
 wave_create_and_pad        Creates a waveform of fixed size from added data
+wave_lookup                Finds a waveform with the added data
 wave_delete                Deletes one or more waveforms
+wave_compact               Moves waveforms together to join free space
+wave_get_space             Gets the waveform space free
+
+wave_builder_open          Opens a wave builder
+wave_builder_add_generic   Adds a pulse train to a wave builder
+wave_builder_add_serial    Adds serial data to a wave builder
+wave_builder_create        Creates a waveform from a wave builder
+wave_builder_close         Closes a wave builder
 
 wave_send_once             Transmits a waveform once
 wave_send_repeat           Transmits a waveform repeatedly
@@ -317,10 +357,20 @@ wave_tx_busy               Checks to see if the waveform has ended
 
 wave_tx_stop               Aborts the current waveform
 
+wave_stream_open           Opens a ring for streaming pulses
+wave_stream_add            Queues pulses on the stream
+wave_stream_set_event      Sets an event triggered to refill the stream
+wave_stream_get_free       Gets the free stream segments
+wave_stream_get_underruns  Gets the times the stream ran dry
+wave_stream_close          Closes the stream
+
 wave_get_cbs               Length in cbs of the current waveform
 wave_get_high_cbs          Length of longest waveform so far
 wave_get_max_cbs           Absolute maximum allowed cbs
 
+wave_get_cache_hits        Waveforms created which already existed
+wave_get_cache_misses      Waveforms created which did not exist
+
 wave_get_micros            Length in micros of the current waveform
 wave_get_high_micros       Length of longest waveform so far
 wave_get_max_micros        Absolute maximum allowed micros
@@ -335,6 +385,7 @@ get_current_tick           Get current tick (microseconds)
 
 get_hardware_revision      Get hardware revision
 get_pigpio_version         Get the pigpio version
+get_statistics             Get the daemon's run time statistics
 pigpiod_if_version         Get the pigpiod_if2 version
 
 pigpio_error               Get a text description of an error code.
@@ -364,6 +415,9 @@ typedef void (*evtCBFuncEx_t)
 
 typedef struct evtCallback_s evtCallback_t;
 
+typedef void (*asyncCBFunc_t)
+   (int pi, unsigned id, int result, void *userdata);
+
 /*F*/
 double time_time(void);
 /*D
@@ -450,6 +504,15 @@ Returns an integer value greater than or equal to zero if OK.
 
 This value is passed to the GPIO routines to specify the Pi
 to be operated on.
+
+An addrStr of the form unix:path connects to the daemon's Unix
+domain socket at path rather than over TCP, and portStr is ignored.
+unix: alone uses the default path, /var/run/pigpio.sock.  A local
+client saves the cost of the TCP/IP stack on every command.
+
+...
+pi = pigpio_start("unix:", NULL);
+...
 D*/
 
 /*F*/
@@ -463,6 +526,243 @@ pi: >=0 (as returned by [*pigpio_start*]).
 . .
 D*/
 
+/*F*/
+int pigpio_notify_workers(unsigned workers);
+/*D
+Sets the maximum number of threads used to call callbacks.
+
+. .
+workers: 1-32.
+. .
+
+Returns 0 if OK, otherwise pigif_bad_workers.
+
+The notification connections of all the Pis are served by one pool
+of threads rather than a thread per Pi.  A thread is added as each
+Pi is connected until there are workers threads (default 4).
+Connecting more Pis does not add threads.
+
+The callbacks of one Pi are always called in order, one at a time.
+Callbacks of different Pis may run at the same time on different
+threads.  A slow callback delays the other callbacks of its Pi and
+occupies one of the threads.
+
+Lowering the number does not stop threads already started.
+D*/
+
+/*F*/
+int batch_start(int pi);
+/*D
+Starts queuing commands for a Pi.  Until [*batch_end*] is called
+commands issued by this thread for the Pi are queued rather than
+sent, and return 0.  Other threads are not affected.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi or pigif_queue_busy.
+
+[*batch_end*] sends the queued commands to the daemon in a single
+message, the daemon runs them in order and returns all the results
+in one reply.  Toggling 20 outputs in a batch takes one round trip
+rather than 20.
+
+Commands which return data, such as [*i2c_read_device*], are not
+queued.  The commands already queued are sent and then the command
+is run immediately as usual.  Its result is also stored in its place
+in the results returned by [*batch_end*].
+
+...
+batch_start(pi);
+
+for (i=0; i<20; i++) gpio_write(pi, outputs[i], 1);
+
+batch_end(pi, results, 20);
+...
+D*/
+
+/*F*/
+int batch_end(int pi, int *results, unsigned maxResults);
+/*D
+Sends the commands queued since [*batch_start*] and stops queuing.
+
+. .
+        pi: >=0 (as returned by [*pigpio_start*]).
+   results: an array to receive the command results, may be NULL.
+maxResults: the number of results which fit in results.
+. .
+
+Returns the number of commands issued while batching if OK,
+otherwise pigif_unconnected_pi or pigif_not_queuing.
+
+The result of each command issued while batching, including any run
+immediately, is stored in results in the order the commands were
+issued.  A command which could not be sent or
+run has a negative result.
+D*/
+
+/*F*/
+int pipeline_start(int pi);
+/*D
+Starts pipelining commands for a Pi.  Until [*pipeline_end*] is
+called commands issued by this thread for the Pi are sent at once
+but their responses are not waited for, and the commands return 0.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi or pigif_queue_busy.
+
+The responses are read in order by [*pipeline_end*].  Other threads
+using the same Pi wait until [*pipeline_end*] is called.
+
+Commands which return data are not pipelined.  The responses already
+outstanding are read and then the command is run immediately as usual.
+Its result is also stored in its place in the results returned by
+[*pipeline_end*].
+D*/
+
+/*F*/
+int pipeline_end(int pi, int *results, unsigned maxResults);
+/*D
+Reads the responses to the commands sent since [*pipeline_start*]
+and stops pipelining.
+
+. .
+        pi: >=0 (as returned by [*pigpio_start*]).
+   results: an array to receive the command results, may be NULL.
+maxResults: the number of results which fit in results.
+. .
+
+Returns the number of commands issued while pipelining if OK,
+otherwise pigif_unconnected_pi or pigif_not_queuing.
+
+The result of each command issued while pipelining, including any
+run immediately, is stored in results in the order the commands were
+issued.
+D*/
+
+/*F*/
+int gpio_read_async(int pi, unsigned gpio, asyncCBFunc_t f, void *userdata);
+/*D
+Sends a request to read the GPIO level and returns without waiting
+for the reply.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+    gpio: 0-53.
+       f: the function to call with the result, or NULL.
+userdata: pointer to arbitrary user data passed to f.
+. .
+
+Returns a request id (>=0) if OK, otherwise pigif_unconnected_pi,
+pigif_queue_busy, pigif_bad_malloc, or pigif_bad_send.
+
+The result is that [*gpio_read*] would return.  It is passed to f
+together with the request id, or if f is NULL is returned by
+[*async_wait*].
+
+Many requests may be outstanding on one connection.  The daemon
+answers them in the order they were sent and they complete in that
+order.  A command issued in the usual way by any thread waits for
+the replies to the requests sent before it.
+
+The callbacks of a Pi are called one at a time in order.  They are
+called by a notification worker (see [*pigpio_notify_workers*]) or
+by a thread which has just issued a command to the same Pi.
+
+The request can not be made by a thread which is batching or
+pipelining commands for the Pi.
+
+...
+void done(int pi, unsigned id, int level, void *userdata)
+{
+   printf("request %u: level %d\n", id, level);
+}
+
+for (g=2; g<28; g++) gpio_read_async(pi, g, done, NULL);
+...
+D*/
+
+/*F*/
+int i2c_read_device_async(int pi, unsigned handle, char *buf, unsigned count,
+   asyncCBFunc_t f, void *userdata);
+/*D
+Sends a request to read count bytes from the I2C device associated
+with handle and returns without waiting for the reply.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+  handle: >=0, as returned by a call to [*i2c_open*].
+     buf: an array to receive the read data bytes.
+   count: >0, the number of bytes to read.
+       f: the function to call with the result, or NULL.
+userdata: pointer to arbitrary user data passed to f.
+. .
+
+Returns a request id (>=0) if OK, otherwise pigif_unconnected_pi,
+pigif_queue_busy, pigif_bad_malloc, or pigif_bad_send.
+
+The result is that [*i2c_read_device*] would return, the count of
+bytes read or an error.  buf must remain valid until the request has
+completed.  See [*gpio_read_async*].
+D*/
+
+/*F*/
+int spi_xfer_async(int pi, unsigned handle, char *txBuf, char *rxBuf,
+   unsigned count, asyncCBFunc_t f, void *userdata);
+/*D
+Sends a request to transfer count bytes with the SPI device
+associated with handle and returns without waiting for the reply.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+  handle: >=0, as returned by a call to [*spi_open*].
+   txBuf: the data bytes to write.
+   rxBuf: the received data bytes.
+   count: the number of bytes to transfer.
+       f: the function to call with the result, or NULL.
+userdata: pointer to arbitrary user data passed to f.
+. .
+
+Returns a request id (>=0) if OK, otherwise pigif_unconnected_pi,
+pigif_queue_busy, pigif_bad_malloc, or pigif_bad_send.
+
+The result is that [*spi_xfer*] would return, the count of bytes
+transferred or an error.  txBuf is sent before the function returns.
+rxBuf must remain valid until the request has completed.  See
+[*gpio_read_async*].
+D*/
+
+/*F*/
+int async_wait(int pi, double timeout, unsigned *id, int *result);
+/*D
+Waits for up to timeout seconds for an asynchronous request sent
+with a NULL callback function to complete.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+timeout: >=0.
+     id: set to the id of the completed request, may be NULL.
+ result: set to the result of the completed request, may be NULL.
+. .
+
+Returns 1 if a request completed, 0 on timeout, otherwise
+pigif_unconnected_pi.
+
+Completed requests are returned in the order they were sent.  A
+timeout of 0 returns a completed request if there is one without
+waiting.
+
+...
+for (i=0; i<10; i++) spi_xfer_async(pi, h, tx[i], rx[i], 3, NULL, NULL);
+
+for (i=0; i<10; i++) async_wait(pi, 1.0, NULL, &bytes[i]);
+...
+D*/
+
 /*F*/
 int set_mode(int pi, unsigned gpio, unsigned mode);
 /*D
@@ -558,6 +858,26 @@ The [*set_PWM_range*] function may be used to change the
 default range of 255.
 D*/
 
+/*F*/
+int set_PWM_dutycycles(int pi, unsigned count, gpioWidth_t *widths);
+/*D
+Set the PWM dutycycles of many GPIO with one command.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+ count: the number of entries in widths.
+widths: an array of [*gpioWidth_t*].
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_DUTYCYCLE,
+or PI_NOT_PERMITTED.
+
+Each entry is treated as by [*set_PWM_dutycycle*].  The daemon
+writes all the new dutycycles to the PWM schedule together so they
+take effect on the same PWM cycle.  Every entry is checked before any
+dutycycle is changed.  See gpioPWMMulti in the pigpio library.
+D*/
+
 /*F*/
 int get_PWM_dutycycle(int pi, unsigned user_gpio);
 /*D
@@ -773,6 +1093,26 @@ Thereafter use the [*set_PWM_dutycycle*] function to move the servo,
 e.g. set_PWM_dutycycle(25, 1500) will set a 1500 us pulse. 
 D*/
 
+/*F*/
+int set_servo_pulsewidths(int pi, unsigned count, gpioWidth_t *widths);
+/*D
+Set the servo pulsewidths of many GPIO with one command.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+ count: the number of entries in widths.
+widths: an array of [*gpioWidth_t*].
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_PULSEWIDTH or
+PI_NOT_PERMITTED.
+
+Each entry is treated as by [*set_servo_pulsewidth*].  The daemon
+writes all the new pulsewidths to the servo schedule together so
+every servo moves on the same pulse.  Every entry is checked before
+any pulsewidth is changed.  See gpioServoMulti in the pigpio library.
+D*/
+
 /*F*/
 int get_servo_pulsewidth(int pi, unsigned user_gpio);
 /*D
@@ -843,8 +1183,8 @@ typedef struct
 seqno: starts at 0 each time the handle is opened and then increments
 by one for each report.
 
-flags: three flags are defined, PI_NTFY_FLAGS_WDOG,
-PI_NTFY_FLAGS_ALIVE, and PI_NTFY_FLAGS_EVENT.
+flags: four flags are defined, PI_NTFY_FLAGS_WDOG,
+PI_NTFY_FLAGS_ALIVE, PI_NTFY_FLAGS_EVENT, and PI_NTFY_FLAGS_OVFL.
 
 If bit 5 is set (PI_NTFY_FLAGS_WDOG) then bits 0-4 of the flags
 indicate a GPIO which has had a watchdog timeout.
@@ -856,6 +1196,11 @@ of other notification activity.
 If bit 7 is set (PI_NTFY_FLAGS_EVENT) then bits 0-4 of the flags
 indicate an event which has been triggered.
 
+If bit 8 is set (PI_NTFY_FLAGS_OVFL) then reports were discarded
+because the pipe/socket was not being read quickly enough.  The tick
+is that of the first discarded report and the level is the number of
+reports discarded.
+
 tick: the number of microseconds since system boot.  It wraps around
 after 1h12m.
 
@@ -893,6 +1238,124 @@ handle: 0-31 (as returned by [*notify_open*])
 Returns 0 if OK, otherwise PI_BAD_HANDLE.
 D*/
 
+/*F*/
+int notify_open_shm(int pi, unsigned reports);
+/*D
+Get a free notification handle whose reports are delivered through
+shared memory rather than a pipe.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+reports: 0 (for the default) or a power of 2 in the range
+         PI_NOTIFY_SHM_MIN-PI_NOTIFY_SHM_MAX.
+. .
+
+Returns a handle greater than or equal to zero if OK,
+otherwise PI_NO_HANDLE, PI_BAD_NOTIFY_SIZE, or PI_NO_MEMORY.
+
+Shared memory is only accessible from the local machine.  Map
+the reports with [*notify_shm_attach*], then start them with
+[*notify_begin*].  Close the handle with [*notify_close*].
+
+The shared memory may only be used by its owner.  Over the daemon's
+Unix domain socket that is the user running this program, over a
+loopback address it is the user running the daemon.
+
+The reports have the same format as those read from a pipe.  No
+system calls are needed to read them while reports are arriving.
+D*/
+
+/*F*/
+gpioNotifyShm_t *notify_shm_attach(int pi, unsigned handle);
+/*D
+Maps the shared memory of a notification handle.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: 0-31 (as returned by [*notify_open_shm*])
+. .
+
+Returns a pointer to be passed to [*notify_shm_read*] if OK,
+otherwise NULL.  NULL is also returned if the daemon is not reached
+through its Unix domain socket or a loopback address.
+D*/
+
+/*F*/
+int notify_shm_read(
+   gpioNotifyShm_t *shm, gpioReport_t *reports, unsigned count, double timeout);
+/*D
+Reads reports from a shared memory notification.
+
+. .
+    shm: as returned by [*notify_shm_attach*]
+reports: an array to receive the reports
+  count: the maximum number of reports to read
+timeout: the maximum number of seconds to wait if no reports are
+         available, 0 to not wait
+. .
+
+Returns the number of reports read, 0 if none arrived in time, or
+pigif_bad_shm if shm is not attached.
+
+If reports are not read quickly enough the ring fills and later
+reports are discarded.  A report with the PI_NTFY_FLAGS_OVFL flag
+set gives the number discarded, see [*notify_begin*].
+D*/
+
+/*F*/
+void notify_shm_detach(gpioNotifyShm_t *shm);
+/*D
+Unmaps a shared memory notification.
+
+. .
+shm: as returned by [*notify_shm_attach*]
+. .
+D*/
+
+/*F*/
+int command_open_shm(int pi, unsigned slots);
+/*D
+Opens a shared memory command region on the daemon and sends later
+commands through it rather than the socket.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+slots: 0 (for the default) or a power of 2 in the range
+       PI_COMMAND_SHM_MIN-PI_COMMAND_SHM_MAX.
+. .
+
+Returns a handle greater than or equal to zero if OK,
+otherwise PI_NO_HANDLE, PI_BAD_SHM_SLOTS, PI_NO_MEMORY, or
+pigif_bad_shm.
+
+The daemon must be on the local machine and be reached through its
+Unix domain socket or a loopback address.  Commands without data
+(for example [*gpio_read*], [*gpio_write*], [*set_PWM_dutycycle*])
+then avoid the socket round trip, the others still use the socket.
+The commands are executed by the daemon with the same permission
+checks as over the socket.
+
+The region may only be used by its owner.  Over the daemon's Unix
+domain socket that is the user running this program, over a
+loopback address it is the user running the daemon.
+
+The region is closed by [*command_close_shm*] or [*pigpio_stop*].
+Calling this function again returns the same handle.
+D*/
+
+/*F*/
+int command_close_shm(int pi);
+/*D
+Closes the shared memory command region opened by
+[*command_open_shm*].  Later commands use the socket.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+D*/
+
 /*F*/
 int set_watchdog(int pi, unsigned user_gpio, unsigned timeout);
 /*D
@@ -1072,6 +1535,48 @@ A status of PI_SOME_PERMITTED indicates that the user is not
 allowed to write to one or more of the GPIO.
 D*/
 
+/*F*/
+int gpio_snapshot(int pi, gpioStatus_t *status);
+/*D
+Gets the mode, pull, level, and PWM, servo, watchdog, and filter
+settings of every GPIO in one command.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+status: an array of PI_MAX_GPIO+1 [*gpioStatus_t*] to receive the
+        settings, status[g] being those of GPIO g
+. .
+
+Returns the number of GPIO reported (PI_MAX_GPIO+1) if OK.
+
+This replaces a [*get_mode*], [*get_PWM_dutycycle*],
+[*get_servo_pulsewidth*] and so on for each GPIO.  See gpioSnapshot
+in the pigpio C library documentation for the fields.
+D*/
+
+/*F*/
+int gpio_apply(int pi, unsigned count, gpioApply_t *apply);
+/*D
+Makes the settings described by an array of [*gpioApply_t*], each
+of which may set the mode, pull, level, and PWM or servo settings of
+one GPIO, in one command.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+count: the number of entries in apply
+apply: an array of [*gpioApply_t*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_GPIO, PI_BAD_USER_GPIO,
+PI_BAD_MODE, PI_BAD_PUD, PI_BAD_LEVEL, PI_BAD_DUTYRANGE,
+PI_BAD_DUTYCYCLE, PI_BAD_PULSEWIDTH, PI_BAD_PARAM, PI_NOT_PERMITTED,
+or an error from the setting which failed.
+
+Every entry is checked before any setting is made.  See gpioApply
+in the pigpio C library documentation for the settings and the
+order in which they are made.
+D*/
+
 
 /*F*/
 int hardware_clock(int pi, unsigned gpio, unsigned clkfreq);
@@ -1222,6 +1727,31 @@ pi: >=0 (as returned by [*pigpio_start*]).
 D*/
 
 
+/*F*/
+int get_statistics(int pi, gpioStatistics_t *stats, unsigned clear);
+/*D
+Gets the daemon's run time statistics.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+stats: a [*gpioStatistics_t*] to receive the statistics.
+clear: 1 to zero the statistics once copied, otherwise 0.
+. .
+
+Returns the number of bytes copied to stats if OK, otherwise
+PI_BAD_PARAM.
+
+The statistics include the sampling loop period, the samples read
+per loop, the time taken to dispatch samples, to run each GPIO's
+callback, and to execute each command, and the delay from a level
+change to its notification being written.  See gpioStatistics in the
+pigpio library for a description of the fields.
+
+A daemon newer than the client may return a larger gpioStatistics_t;
+only the fields the client knows about are copied.
+D*/
+
+
 /*F*/
 int wave_clear(int pi);
 /*D
@@ -1333,13 +1863,18 @@ function.
 As many waveforms may be created as there is space available.  The
 wave id is passed to [*wave_send_**] to specify the waveform to transmit.
 
+If a waveform with exactly the same pulses already exists its wave id
+is returned and no new waveform is built.  Each wave id returned must
+be deleted once with [*wave_delete*]; the waveform is only removed
+when the last is deleted.
+
 Normal usage would be
 
 Step 1. [*wave_clear*] to clear all waveforms and added data.
 
 Step 2. [*wave_add_**] calls to supply the waveform data.
 
-Step 3. [*wave_create*] to create the waveform and get a unique id
+Step 3. [*wave_create*] to create the waveform and get its id
 
 Repeat steps 2 and 3 as needed.
 
@@ -1417,6 +1952,25 @@ PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
 D*/
 
 
+/*F*/
+int wave_lookup(int pi);
+/*D
+This function finds an existing waveform with the same pulses as
+those provided by the prior calls to the [*wave_add_**] functions.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+The added data is not consumed and the waveform is not referenced,
+so the wave id should not be deleted.  Call [*wave_create*] to take a
+reference to the waveform, which will then cost little.
+
+Returns the wave id if found, otherwise PI_EMPTY_WAVEFORM or
+PI_WAVE_NOT_CACHED.
+D*/
+
+
 /*F*/
 int wave_delete(int pi, unsigned wave_id);
 /*D
@@ -1427,21 +1981,164 @@ This function deletes the waveform with id wave_id.
 wave_id: >=0, as returned by [*wave_create*].
 . .
 
-Wave ids are allocated in order, 0, 1, 2, etc.
-
-The wave is flagged for deletion.  The resources used by the wave
-will only be reused when either of the following apply.
+If [*wave_create*] returned wave_id more than once, because the same
+waveform was created again, this only drops one reference and the
+waveform remains until deleted once for each create.
 
-- all waves with higher numbered wave ids have been deleted or have
-been flagged for deletion.
+A new wave is given the lowest free wave id, 0, 1, 2, etc.
 
-- a new wave is created which uses exactly the same resources as
-the current wave (see the C source for gpioWaveCreate for details).
+The DMA control blocks (CBs) and OOL used by the wave are freed
+immediately and joined to any free space either side, so they may be
+used by the next wave created.  A wave must not be deleted while it
+is being transmitted.
 
 Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
 D*/
 
 
+/*F*/
+int wave_compact(int pi);
+/*D
+This function moves the waveforms which have been created so that
+the DMA control blocks (CBs) and OOL they use are contiguous, leaving
+a single range of each free.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Deleting waves of varying size may leave the free space split into
+ranges too small for a large wave (see [*wave_get_space*]).
+Compacting joins them.  Wave ids are unchanged.  The waves can not be
+moved while any wave is being transmitted.
+
+Returns the number of waves moved if OK, otherwise PI_WAVE_TX_BUSY or
+PI_WAVE_STREAM_OPEN.
+D*/
+
+
+/*F*/
+int wave_get_space(int pi, gpioWaveSpace_t *space);
+/*D
+This function gets the DMA control blocks (CBs) and OOL free for
+new waveforms.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+space: a [*gpioWaveSpace_t*] to receive the free space.
+. .
+
+Returns the number of bytes copied to space if OK, otherwise a
+negative error code.
+
+A wave needs a single range of CBs and of OOL, so the largest wave
+which can be created is limited by largestCBs and largestOOL rather
+than freeCBs and freeOOL.  See gpioWaveGetSpace in the pigpio library
+for a description of the fields.
+D*/
+
+
+/*F*/
+int wave_builder_open(int pi);
+/*D
+This function opens a wave builder.  A wave builder collects pulse
+trains which are merged in time order when the waveform is created,
+rather than merging each addition into the current waveform.
+Several builders may be prepared at the same time.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns a handle (>=0) if OK, otherwise PI_NO_HANDLE.
+D*/
+
+
+/*F*/
+int wave_builder_add_generic(
+   int pi, unsigned handle, unsigned numPulses, gpioPulse_t *pulses);
+/*D
+This function adds a pulse train to a wave builder.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+   handle: >=0, as returned by [*wave_builder_open*].
+numPulses: the number of pulses.
+   pulses: an array of pulses.
+. .
+
+Returns the total number of pulses held by the builder if OK,
+otherwise PI_BAD_HANDLE, PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+The train starts at the start of the waveform.
+D*/
+
+
+/*F*/
+int wave_builder_add_serial
+   (int pi, unsigned handle, unsigned user_gpio, unsigned baud,
+    unsigned data_bits, unsigned stop_bits, unsigned offset,
+    unsigned numBytes, char *str);
+/*D
+This function adds a pulse train representing serial data to a
+wave builder.  The serial data starts offset microseconds from the
+start of the waveform.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+   handle: >=0, as returned by [*wave_builder_open*].
+user_gpio: 0-31.
+     baud: 50-1000000
+data_bits: number of data bits (1-32)
+stop_bits: number of stop half bits (2-8)
+   offset: >=0
+ numBytes: >=1
+      str: an array of chars.
+. .
+
+Returns the total number of pulses held by the builder if OK,
+otherwise PI_BAD_HANDLE, PI_BAD_USER_GPIO, PI_BAD_WAVE_BAUD,
+PI_BAD_DATABITS, PI_BAD_STOPBITS, PI_TOO_MANY_CHARS,
+PI_BAD_SER_OFFSET, PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+The data is formatted as for [*wave_add_serial*].
+D*/
+
+
+/*F*/
+int wave_builder_create(int pi, unsigned handle);
+/*D
+This function merges the pulse trains added to a wave builder in
+a single pass and creates a waveform from the result.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: >=0, as returned by [*wave_builder_open*].
+. .
+
+Returns the new waveform id if OK, otherwise PI_BAD_HANDLE,
+PI_EMPTY_WAVEFORM, PI_TOO_MANY_PULSES, PI_NO_MEMORY,
+PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
+
+The trains are consumed if the waveform is created, leaving the
+builder open and empty.
+D*/
+
+
+/*F*/
+int wave_builder_close(int pi, unsigned handle);
+/*D
+This function closes a wave builder.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: >=0, as returned by [*wave_builder_open*].
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+D*/
+
+
 /*F*/
 int wave_send_once(int pi, unsigned wave_id);
 /*D
@@ -1647,6 +2344,115 @@ pi: >=0 (as returned by [*pigpio_start*]).
 Returns 0 if OK.
 
 This function is intended to stop a waveform started with the repeat mode.
+
+It also stops a wave stream (see [*wave_stream_open*]) and drops its
+queued pulses.  The stream stays open.
+D*/
+
+/*F*/
+int wave_stream_open(
+   int pi, unsigned segments, unsigned segmentCBs, uint32_t threshold);
+/*D
+This function opens a wave stream, which transmits pulses as they are
+queued rather than as a finished waveform.
+
+. .
+        pi: >=0 (as returned by [*pigpio_start*]).
+  segments: 2-64, the segments in the ring
+segmentCBs: >=3, the DMA control blocks (CBs) in each segment
+ threshold: 1-segments, the free segments which ask for a refill
+. .
+
+Returns 0 if OK, otherwise PI_BAD_WAVE_STREAM, PI_WAVE_STREAM_OPEN,
+PI_WAVE_TX_BUSY, PI_TOO_MANY_CBS, PI_TOO_MANY_OOL, PI_NO_MEMORY, or
+PI_NO_ALERTS.
+
+The stream is a ring of segments taken from the waveform space.
+Pulses queued with [*wave_stream_add*] fill the free segments in turn
+and play without a gap for as long as they are queued in time.
+
+When the free segments rise to threshold, or the output runs out of
+pulses, the event set by [*wave_stream_set_event*] is triggered.  Use
+[*event_callback*] or [*wait_for_event*] to refill the stream.
+
+While the stream is open [*wave_send_once*] and the other ways of
+transmitting a waveform fail with PI_WAVE_STREAM_OPEN.
+
+The stream belongs to this connection and is closed if the connection
+is closed.  A stream can not be opened if the daemon was started with
+alerts disabled (pigpiod -m).
+D*/
+
+/*F*/
+int wave_stream_add(int pi, unsigned numPulses, gpioPulse_t *pulses);
+/*D
+This function queues pulses on the wave stream.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+numPulses: the number of pulses.
+   pulses: an array of pulses.
+. .
+
+Returns the number of pulses queued if OK, otherwise
+PI_NO_WAVE_STREAM, PI_TOO_MANY_CBS, or PI_SOME_PERMITTED.
+
+If there are not enough free segments for all the pulses the leading
+ones are queued and their number returned, which may be 0 when the
+ring is full.  If any pulse changes a GPIO which may not be updated
+none are queued and PI_SOME_PERMITTED is returned.
+D*/
+
+/*F*/
+int wave_stream_set_event(int pi, unsigned event);
+/*D
+This function sets the event triggered when the wave stream asks for
+a refill.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+event: 0-31, or PI_WAVE_STREAM_NO_EVENT to cancel.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_EVENT_ID or PI_NO_WAVE_STREAM.
+D*/
+
+/*F*/
+int wave_stream_get_free(int pi);
+/*D
+This function returns the number of free wave stream segments.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns the free segments if OK, otherwise PI_NO_WAVE_STREAM.
+D*/
+
+/*F*/
+int wave_stream_get_underruns(int pi);
+/*D
+This function returns the number of times the wave stream output has
+run out of queued pulses and stopped.  The end of a stream counts.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns the underruns if OK, otherwise PI_NO_WAVE_STREAM.
+D*/
+
+/*F*/
+int wave_stream_close(int pi);
+/*D
+This function closes the wave stream.  Any pulses still queued are
+dropped.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns 0 if OK, otherwise PI_NO_WAVE_STREAM.
 D*/
 
 /*F*/
@@ -1746,6 +2552,30 @@ pi: >=0 (as returned by [*pigpio_start*]).
 . .
 D*/
 
+/*F*/
+int wave_get_cache_hits(int pi);
+/*D
+This function returns the number of times [*wave_create*] (or
+[*wave_builder_create*]) found that the waveform already existed and
+returned its wave id rather than building a new one.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+D*/
+
+/*F*/
+int wave_get_cache_misses(int pi);
+/*D
+This function returns the number of times [*wave_create*] (or
+[*wave_builder_create*]) built a new waveform because no identical
+waveform existed.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+D*/
+
 /*F*/
 int gpio_trigger(int pi, unsigned user_gpio, unsigned pulseLen, unsigned level);
 /*D
@@ -3447,6 +4277,9 @@ user_gpio: 0-31.
 The function returns a callback id if OK, otherwise pigif_bad_malloc,
 pigif_duplicate_callback, or pigif_bad_callback.
 
+The same function may be registered for the same edge with different
+userdata, each registration is called.
+
 The callback is called with the GPIO, edge, tick, and the userdata
 pointer, whenever the GPIO has the identified edge.
 
@@ -3476,7 +4309,9 @@ This function cancels a callback identified by its id.
 callback_id: >=0, as returned by a call to [*callback*] or [*callback_ex*].
 . .
 
-The function returns 0 if OK, otherwise pigif_callback_not_found.
+The function returns 0 if OK, otherwise pigif_callback_not_found or
+pigif_bad_malloc.  If pigif_bad_malloc is returned the callback is
+still registered.
 D*/
 
 /*F*/
@@ -3493,13 +4328,16 @@ user_gpio: 0-31.
 . .
 
 The function returns when the edge occurs or after the timeout.
+The calling thread sleeps until the edge is reported by pigpiod.
 
-Do not use this function for precise timing purposes,
-the edge is only checked 20 times a second. Whenever
+Do not use this function for precise timing purposes, the return
+is delayed by the notification latency of pigpiod.  Whenever
 you need to know the accurate time of GPIO events use
 a [*callback*] function.
 
-The function returns 1 if the edge occurred, otherwise 0.
+The function returns 1 if the edge occurred, 0 on timeout,
+otherwise pigif_unconnected_pi, pigif_bad_callback, or
+pigif_bad_malloc.  Several threads may wait for the same edge.
 D*/
 
 /*F*/
@@ -3723,6 +4561,9 @@ userdata: a pointer to arbitrary user data.
 The function returns a callback id if OK, otherwise pigif_bad_malloc,
 pigif_duplicate_callback, or pigif_bad_callback.
 
+The same function may be registered for the same event with
+different userdata, each registration is called.
+
 The callback is called with the event id, the tick, and the userdata
 pointer whenever the event occurs.
 D*/
@@ -3737,7 +4578,9 @@ callback_id: >=0, as returned by a call to [*event_callback*] or
 [*event_callback_ex*].
 . .
 
-The function returns 0 if OK, otherwise pigif_callback_not_found.
+The function returns 0 if OK, otherwise pigif_callback_not_found or
+pigif_bad_malloc.  If pigif_bad_malloc is returned the callback is
+still registered.
 D*/
 
 /*F*/
@@ -3752,8 +4595,11 @@ timeout: >=0.
 . .
 
 The function returns when the event occurs or after the timeout.
+The calling thread sleeps until the event is reported by pigpiod.
 
-The function returns 1 if the event occurred, otherwise 0.
+The function returns 1 if the event occurred, 0 on timeout,
+otherwise pigif_unconnected_pi, pigif_bad_callback, or
+pigif_bad_malloc.  Several threads may wait for the same event.
 D*/
 
 /*F*/
@@ -3796,6 +4642,9 @@ the pigpio daemon.  It may be NULL in which case localhost
 is used unless overridden by the PIGPIO_ADDR environment
 variable.
 
+*apply::
+An array of [*gpioApply_t*] describing the settings to make.
+
 arg1::
 An unsigned argument passed to a user customised function.  Its
 meaning is defined by the customiser.
@@ -3811,6 +4660,12 @@ The count of bytes passed to a user customised function.
 A pointer to an array of bytes passed to a user customised function.
 Its meaning and content is defined by the customiser.
 
+asyncCBFunc_t::
+. .
+typedef void (*asyncCBFunc_t)
+   (int pi, unsigned id, int result, void *userdata);
+. .
+
 baud::
 The speed of serial communication (I2C, SPI, serial link, waves) in
 bits per second.
@@ -3878,12 +4733,16 @@ typedef void (*CBFuncEx_t)
 char::
 A single character, an 8 bit quantity able to store 0-255.
 
+clear::0-1
+1 to zero the statistics once they have been copied.
+
 clkfreq::4689-250M (13184-375M for the BCM2711)
 The hardware clock frequency.
 
 count::
 The number of bytes to be transferred in a file, I2C, SPI, or serial
-command.
+command, or the number of entries in a [*gpio_apply*],
+[*set_PWM_dutycycles*], or [*set_servo_pulsewidths*] array.
 
 CS::
 The GPIO used for the slave select signal when bit banging SPI.
@@ -3983,6 +4842,37 @@ Type 2    -  X  X  -  -  -  X  X  X  X  -  X  X  X  X  X
 Type 3    X  X  X  X  X  X  X  X  X  X  X  X  -  -  -  -
 . .
 
+gpioApply_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t what;
+   uint32_t mode;
+   uint32_t pud;
+   uint32_t level;
+   uint32_t range;
+   uint32_t frequency;
+   uint32_t dutycycle;
+   uint32_t pulsewidth;
+} gpioApply_t;
+. .
+
+what is a combination of PI_APPLY_MODE, PI_APPLY_PUD,
+PI_APPLY_LEVEL, PI_APPLY_RANGE, PI_APPLY_FREQUENCY,
+PI_APPLY_DUTYCYCLE, and PI_APPLY_PULSEWIDTH selecting the settings
+to make.
+
+gpioHistogram_t::
+. .
+typedef struct
+{
+   uint32_t count;
+   uint32_t max;
+   uint32_t bucket[PI_STATS_BUCKETS];
+} gpioHistogram_t;
+. .
+
 gpioPulse_t::
 . .
 typedef struct
@@ -3993,11 +4883,43 @@ typedef struct
 } gpioPulse_t;
 . .
 
+gpioStatistics_t::
+A structure holding the run time statistics, see gpioStatistics in the
+pigpio library.
+
+gpioStatus_t::
+. .
+typedef struct
+{
+   uint32_t mode;
+   uint32_t pud;
+   uint32_t level;
+   uint32_t use;
+   uint32_t dutycycle;
+   uint32_t range;
+   uint32_t frequency;
+   uint32_t pulsewidth;
+   uint32_t watchdog;
+   uint32_t glitch;
+   uint32_t noiseSteady;
+   uint32_t noiseActive;
+} gpioStatus_t;
+. .
+
 gpioThreadFunc_t::
 . .
 typedef void *(gpioThreadFunc_t) (void *);
 . .
 
+gpioWidth_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t width;
+} gpioWidth_t;
+. .
+
 handle::>=0
 A number referencing an object opened by one of
 
@@ -4006,6 +4928,7 @@ A number referencing an object opened by one of
 [*notify_open*] 
 [*serial_open*] 
 [*spi_open*]
+[*wave_builder_open*]
 
 i2c_addr::0-0x7F
 The address of a device on the I2C bus.
@@ -4019,6 +4942,9 @@ Flags which modify an I2C open command.  None are currently defined.
 i2c_reg:: 0-255
 A register of an I2C device.
 
+*id::
+The id of a completed asynchronous request.
+
 *inBuf::
 A buffer used to pass data to a function.
 
@@ -4055,6 +4981,9 @@ reported as PI_TIMEOUT.  See [*set_watchdog*].
 PI_TIMEOUT 2
 . .
 
+maxResults::
+The number of results which fit in the results array.
+
 MISO::
 The GPIO used for the MISO signal when bit banging SPI.
 
@@ -4202,6 +5131,12 @@ PI_MIN_DUTYCYCLE_RANGE 25
 PI_MAX_DUTYCYCLE_RANGE 40000
 . .
 
+*result::
+The result of a completed asynchronous request.
+
+*results::
+An array to receive the result of each queued command.
+
 *retBuf::
 A buffer to hold a number of bytes returned to a used customised function,
 
@@ -4249,6 +5184,12 @@ seekOffset::
 The number of bytes to move forward (positive) or backwards (negative)
 from the seek position (start, current, or end of file).
 
+segmentCBs:: >=3
+The DMA control blocks (CBs) in each segment of a wave stream.
+
+segments:: 2-64
+The number of segments in the ring of a wave stream.
+
 ser_flags::
 Flags which modify a serial open command.  None are currently defined.
 
@@ -4279,6 +5220,16 @@ to a waveform.
 #define PI_MAX_WAVE_HALFSTOPBITS 8
 . .
 
+*space::
+A [*gpioWaveSpace_t*] to receive the free waveform space.
+
+*stats::
+A [*gpioStatistics_t*] to receive the run time statistics.
+
+*status::
+An array of PI_MAX_GPIO+1 [*gpioStatus_t*] to receive the settings
+of each GPIO.
+
 *str::
  An array of characters.
 
@@ -4286,6 +5237,10 @@ thread_func::
 A function of type gpioThreadFunc_t used as the main function of a
 thread.
 
+threshold:: 1-segments
+The number of free wave stream segments at which the stream asks for
+a refill.
+
 timeout::
 A GPIO watchdog timeout in milliseconds.
 
@@ -4354,6 +5309,13 @@ One of
 [*wave_send_once*] 
 [*wave_send_repeat*]
 
+*widths::
+An array of [*gpioWidth_t*] giving the PWM dutycycle or servo pulsewidth
+to set for each GPIO.
+
+workers::1-32
+The maximum number of threads used to call callbacks.
+
 wVal::0-65535 (Hex 0x0-0xFFFF, Octal 0-0177777)
 A 16-bit word value.
 
@@ -4376,6 +5338,10 @@ typedef enum
    pigif_callback_not_found = -2010,
    pigif_unconnected_pi     = -2011,
    pigif_too_many_pis       = -2012,
+   pigif_queue_busy         = -2013,
+   pigif_not_queuing        = -2014,
+   pigif_bad_workers        = -2015,
+   pigif_bad_shm            = -2016,
 } pigifError_t;
 
 /*DEF_E*/
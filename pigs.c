@@ -36,6 +36,7 @@ This version is for pigpio version 69+
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -107,6 +108,33 @@ static int initOpts(int argc, char *argv[])
    return args;
 }
 
+static int openUnixSocket(const char *path)
+{
+   int sock;
+   struct sockaddr_un addr;
+
+   if (!path[0]) path = PI_DEFAULT_SOCKET_PATH;
+
+   if (strlen(path) > PI_MAX_SOCKET_PATH) return SOCKET_OPEN_FAILED;
+
+   memset(&addr, 0, sizeof(addr));
+
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   if (sock == -1) return SOCKET_OPEN_FAILED;
+
+   if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+   {
+      close(sock);
+      return SOCKET_OPEN_FAILED;
+   }
+
+   return sock;
+}
+
 static int openSocket(void)
 {
    int sock, err;
@@ -121,6 +149,10 @@ static int openSocket(void)
 
    if (!addrStr) addrStr = PI_DEFAULT_SOCKET_ADDR_STR;
 
+   /* PIGPIO_ADDR=unix:path selects the daemon's Unix domain socket */
+
+   if (strncmp(addrStr, "unix:", 5) == 0) return openUnixSocket(addrStr + 5);
+
    memset (&hints, 0, sizeof (hints));
 
    hints.ai_family   = PF_UNSPEC;
@@ -147,6 +179,67 @@ static int openSocket(void)
    return sock;
 }
 
+static void print_histogram(char *name, gpioHistogram_t *h)
+{
+   int i;
+
+   /* name, count, max, then the buckets */
+
+   printf("%s %u %u", name, h->count, h->max);
+
+   for (i=0; i<PI_STATS_BUCKETS; i++) printf(" %u", h->bucket[i]);
+
+   printf("\n");
+}
+
+static void print_statistics(gpioStatistics_t *s)
+{
+   int i;
+   char name[32];
+
+   printf("version %u\n", s->version);
+   printf("seconds %u\n", s->seconds);
+   printf("micros %u\n", s->micros);
+
+   printf("alertTicks %u lateTicks %u moreToDo %u\n",
+      s->alertTicks, s->lateTicks, s->moreToDo);
+   printf("samples %u maxSamples %u maxEmit %u emitFrags %u\n",
+      s->numSamples, s->maxSamples, s->maxEmit, s->emitFrags);
+   printf("cbTicks %u cbCalls %u DMARestarts %u dmaInitCbs %u\n",
+      s->cbTicks, s->cbCalls, s->DMARestarts, s->dmaInitCbsCount);
+   printf("pipe good %u short %u wouldBlock %u\n",
+      s->goodPipeWrite, s->shortPipeWrite, s->wouldBlockPipeWrite);
+   printf("alertRing full %u dropped %u maxUsed %u\n",
+      s->alertRingFull, s->alertRingDropped, s->alertRingMaxUsed);
+   printf("notifyDropped %u\n", s->notifyDropped);
+
+   print_histogram("alertPeriod", &s->alertPeriod);
+   print_histogram("alertSamples", &s->alertSamples);
+   print_histogram("emit", &s->emit);
+   print_histogram("notifyLatency", &s->notifyLatency);
+   print_histogram("command", &s->command);
+
+   for (i=0; i<PI_STATS_GPIOS; i++)
+   {
+      if (s->callback[i].count)
+      {
+         sprintf(name, "callback%d", i);
+         print_histogram(name, &s->callback[i]);
+      }
+   }
+
+   /* commands used, name (or number), calls, longest micros */
+
+   for (i=0; i<PI_STATS_COMMANDS; i++)
+   {
+      if (s->commandCalls[i])
+      {
+         if (cmdName(i)) printf("%s", cmdName(i)); else printf("%d", i);
+         printf(" %u %u\n", s->commandCalls[i], s->commandMax[i]);
+      }
+   }
+}
+
 void print_result(int sock, int rv, cmdCmd_t cmd)
 {
    int i, r, ch;
@@ -263,6 +356,61 @@ void print_result(int sock, int rv, cmdCmd_t cmd)
          printf("\n");
          break;
 
+      case 9: /*
+                 GSNAP
+              */
+         if (r < 0)
+         {
+            printf("%d\n", r);
+            report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+            break;
+         }
+
+         /* one line per GPIO, the gpioStatus_t fields in order */
+
+         p = (uint32_t *)response_buf;
+
+         for (i=0; i<(r/sizeof(gpioStatus_t)); i++)
+         {
+            printf("%d %u %u %u %u %u %u %u %u %u %u %u %u\n", i,
+               p[0], p[1], p[2], p[3], p[4], p[5],
+               p[6], p[7], p[8], p[9], p[10], p[11]);
+
+            p += sizeof(gpioStatus_t) / 4;
+         }
+         break;
+
+      case 10: /*
+                  STATS
+               */
+         if (r < 0)
+         {
+            printf("%d\n", r);
+            report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+            break;
+         }
+
+         print_statistics((gpioStatistics_t *)response_buf);
+         break;
+
+      case 11: /*
+                  WVSPC
+               */
+         if (r < 0)
+         {
+            printf("%d\n", r);
+            report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+            break;
+         }
+
+         /* waves, then total, free, largest free, and free ranges */
+
+         p = (uint32_t *)response_buf;
+
+         printf("waves %u\n", p[0]);
+         printf("cbs %u %u %u %u\n", p[1], p[2], p[3], p[4]);
+         printf("ool %u %u %u %u\n", p[5], p[6], p[7], p[8]);
+         break;
    }
 }
 
@@ -276,6 +424,7 @@ void get_extensions(int sock, int command, int res)
       case PI_CMD_CF2:
       case PI_CMD_FL:
       case PI_CMD_FR:
+      case PI_CMD_GSNAP:
       case PI_CMD_I2CPK:
       case PI_CMD_I2CRD:
       case PI_CMD_I2CRI:
@@ -286,6 +435,8 @@ void get_extensions(int sock, int command, int res)
       case PI_CMD_SLR:
       case PI_CMD_SPIX:
       case PI_CMD_SPIR:
+      case PI_CMD_STATS:
+      case PI_CMD_WVSPC:
 
          if (res > 0)
          {